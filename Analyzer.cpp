@@ -0,0 +1,642 @@
+/**
+ * \file Analyzer.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <strings.h>
+#include <thread>
+#include <vector>
+#include "Analyzer.h"
+#include "Fft.h"
+
+/// Frames decoded at a time
+static const size_t DECODE_BLOCK = 4096;
+
+/// Tempos considered, in beats per minute
+static const double MIN_BPM = 60;
+static const double MAX_BPM = 200;
+
+/// Tempo that's most likely, before listening, and how sure of it to be, in octaves
+static const double USUAL_BPM = 120;
+static const double USUAL_BPM_SPREAD = 1;
+
+/// Frequencies the key is worked out from, in Hz
+static const double CHROMA_LOW = 65;
+static const double CHROMA_HIGH = 2100;
+
+/// Frequencies the fingerprint covers, in Hz
+static const double FINGERPRINT_LOW = 40;
+static const double FINGERPRINT_HIGH = 16000;
+
+/// Quietest a gated block can be and still count, in LUFS
+static const double ABSOLUTE_GATE = -70;
+
+/// How far under the ungated loudness a block can be and still count, in LU
+static const double RELATIVE_GATE = -10;
+
+/// Krumhansl-Kessler key profiles, from the tonic up
+static const double MAJOR_PROFILE[12] = {6.35, 2.23, 3.48, 2.33, 4.38, 4.09, 2.52, 5.19, 2.39, 3.66, 2.29, 2.88};
+static const double MINOR_PROFILE[12] = {6.33, 2.68, 3.52, 5.38, 2.60, 3.53, 2.54, 4.75, 3.98, 2.69, 3.34, 3.17};
+
+/**
+ * \brief One biquad section of a filter, transposed direct form II
+ */
+struct Biquad
+{
+    double b0, b1, b2, a1, a2;  ///< Coefficients, normalized so a0 is 1
+    double z1 = 0, z2 = 0;      ///< State
+
+    /**
+     * \brief Filter one sample
+     * \param x The sample
+     * \returns The filtered sample
+     */
+    double Step(double x)
+    {
+        double y = b0 * x + z1;
+        z1 = b1 * x - a1 * y + z2;
+        z2 = b2 * x - a2 * y;
+        return y;
+    }
+};
+
+/**
+ * \brief Make the two sections of the R128 K-weighting filter for a sample rate
+ * \param rate Sample rate
+ * \param shelf Filled in with the high shelf, for the head
+ * \param highpass Filled in with the high-pass, the "RLB" curve
+ *
+ * BS.1770 gives the coefficients at 48kHz only; these are the analog
+ * prototypes it was made from, put back through the bilinear
+ * transform at the rate at hand.
+ */
+static void KWeighting(int rate, Biquad &shelf, Biquad &highpass)
+{
+    double f0 = 1681.974450955533;
+    double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / rate);
+    double vh = pow(10, gain / 20);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1 + k / q + k * k;
+    shelf.b0 = (vh + vb * k / q + k * k) / a0;
+    shelf.b1 = 2 * (k * k - vh) / a0;
+    shelf.b2 = (vh - vb * k / q + k * k) / a0;
+    shelf.a1 = 2 * (k * k - 1) / a0;
+    shelf.a2 = (1 - k / q + k * k) / a0;
+
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / rate);
+    a0 = 1 + k / q + k * k;
+    highpass.b0 = 1;
+    highpass.b1 = -2;
+    highpass.b2 = 1;
+    highpass.a1 = 2 * (k * k - 1) / a0;
+    highpass.a2 = (1 - k / q + k * k) / a0;
+}
+
+/**
+ * \brief Work out integrated loudness from 100ms mean squares
+ * \param blocks Weighted mean square of each 100ms of the track
+ * \returns Loudness in LUFS, no quieter than the absolute gate
+ */
+static double IntegratedLoudness(const std::vector<double> &blocks)
+{
+    auto lufs = [](double power) { return -0.691 + 10 * log10(power); };
+
+    // Gating blocks are 400ms long and overlap by 75%
+    std::vector<double> gated;
+    if (blocks.size() < 4)
+    {
+        double sum = 0;
+        for (double block : blocks)
+        {
+            sum += block;
+        }
+        gated.push_back(blocks.empty() ? 0 : sum / blocks.size());
+    }
+    for (size_t i = 0; i + 4 <= blocks.size(); ++i)
+    {
+        gated.push_back((blocks[i] + blocks[i + 1] + blocks[i + 2] + blocks[i + 3]) / 4);
+    }
+
+    double sum = 0;
+    size_t count = 0;
+    for (double power : gated)
+    {
+        if (power > 0 && lufs(power) > ABSOLUTE_GATE)
+        {
+            sum += power;
+            ++count;
+        }
+    }
+    if (count == 0)
+    {
+        return ABSOLUTE_GATE;
+    }
+
+    double threshold = lufs(sum / count) + RELATIVE_GATE;
+    sum = 0;
+    count = 0;
+    for (double power : gated)
+    {
+        if (power > 0 && lufs(power) > ABSOLUTE_GATE && lufs(power) > threshold)
+        {
+            sum += power;
+            ++count;
+        }
+    }
+
+    return count ? std::max(lufs(sum / count), ABSOLUTE_GATE) : ABSOLUTE_GATE;
+}
+
+/**
+ * \brief Find the tempo in an onset envelope
+ * \param onsets Spectral flux of each frame
+ * \param frameRate Frames per second
+ * \returns Beats per minute, or 0 if there's no clear beat
+ */
+static double Tempo(std::vector<float> onsets, double frameRate)
+{
+    size_t first = (size_t)floor(frameRate * 60 / MAX_BPM);
+    size_t last = (size_t)ceil(frameRate * 60 / MIN_BPM);
+    if (first < 2 || onsets.size() < last * 4)
+    {
+        return 0;
+    }
+
+    double mean = 0;
+    for (float onset : onsets)
+    {
+        mean += onset;
+    }
+    mean /= onsets.size();
+    for (float &onset : onsets)
+    {
+        onset -= mean;
+    }
+
+    // Lags either side of the range too, for interpolating at its ends
+    std::vector<double> correlation(last + 2, 0);
+    for (size_t lag = 0; lag < correlation.size(); ++lag)
+    {
+        if (lag != 0 && lag + 1 < first)
+        {
+            continue;
+        }
+        double sum = 0;
+        for (size_t i = 0; i + lag < onsets.size(); ++i)
+        {
+            sum += onsets[i] * onsets[i + lag];
+        }
+        correlation[lag] = sum / (onsets.size() - lag);
+    }
+    if (correlation[0] <= 0)
+    {
+        return 0;
+    }
+
+    size_t best = 0;
+    double bestScore = 0;
+    for (size_t lag = first; lag <= last; ++lag)
+    {
+        double octaves = log2(frameRate * 60 / lag / USUAL_BPM) / USUAL_BPM_SPREAD;
+        double score = correlation[lag] * exp(-0.5 * octaves * octaves);
+        if (score > bestScore)
+        {
+            best = lag;
+            bestScore = score;
+        }
+    }
+
+    // Anything this weak is noise, not a beat
+    if (best == 0 || correlation[best] < 0.05 * correlation[0])
+    {
+        return 0;
+    }
+
+    // Fit a parabola through the peak for a lag between frames
+    double left = correlation[best - 1], middle = correlation[best], right = correlation[best + 1];
+    double bend = left - 2 * middle + right;
+    double shift = bend < 0 ? 0.5 * (left - right) / bend : 0;
+
+    return frameRate * 60 / (best + std::max(-0.5, std::min(0.5, shift)));
+}
+
+/**
+ * \brief Find the key that best fits a chroma vector
+ * \param chroma Energy in each pitch class, from C
+ * \returns 0-11 for major keys, 12-23 for minor keys, or -1 if it's silent
+ */
+static int Key(const double chroma[12])
+{
+    double mean = 0;
+    for (int i = 0; i < 12; ++i)
+    {
+        mean += chroma[i] / 12;
+    }
+    if (mean <= 0)
+    {
+        return -1;
+    }
+
+    int best = -1;
+    double bestCorrelation = -2;
+    for (int mode = 0; mode < 2; ++mode)
+    {
+        const double *profile = mode ? MINOR_PROFILE : MAJOR_PROFILE;
+        double profileMean = 0;
+        for (int i = 0; i < 12; ++i)
+        {
+            profileMean += profile[i] / 12;
+        }
+
+        for (int tonic = 0; tonic < 12; ++tonic)
+        {
+            double xy = 0, xx = 0, yy = 0;
+            for (int i = 0; i < 12; ++i)
+            {
+                double x = chroma[(tonic + i) % 12] - mean;
+                double y = profile[i] - profileMean;
+                xy += x * y;
+                xx += x * x;
+                yy += y * y;
+            }
+            double correlation = xx > 0 ? xy / sqrt(xx * yy) : 0;
+            if (correlation > bestCorrelation)
+            {
+                best = mode * 12 + tonic;
+                bestCorrelation = correlation;
+            }
+        }
+    }
+
+    return best;
+}
+
+/**
+ * \brief Constructor
+ *
+ * Decodes with DefaultDecoder(), a thread per core, 64 tracks per chunk.
+ */
+CAnalyzer::CAnalyzer()
+{
+    mDecoders = DefaultDecoder;
+    mThreads = 0;
+    mChunk = 64;
+    mStop = false;
+}
+
+/**
+ * \brief Analyse every track that hasn't been yet
+ * \param storage Where the library is kept
+ * \returns Number of tracks analysed, or -1 if the storage isn't usable
+ *
+ * Tracks no decoder can read are left for a later run with a decoder
+ * that can; tracks that can't be read at all are saved as such, so
+ * they aren't tried again. Only this thread touches the storage.
+ */
+int CAnalyzer::Run(CStorage *storage)
+{
+    if (storage->GetStatus() != CONNECTION_OK)
+    {
+        return -1;
+    }
+
+    mStop = false;
+
+    int analyzed = 0;
+    long after = 0;
+    while (!mStop)
+    {
+        std::vector<CStorage::TrackRecord> tracks = storage->FindUnanalyzed(after, mChunk);
+        if (tracks.empty())
+        {
+            break;
+        }
+        after = tracks.back().id;
+
+        std::vector<CStorage::TrackFeatures> results = AnalyzeChunk(tracks);
+        storage->SaveFeatures(results);
+        analyzed += results.size();
+    }
+
+    return analyzed;
+}
+
+/**
+ * \brief Analyse a chunk of tracks, spread across threads
+ * \param tracks The tracks
+ * \returns What was found, for each track a decoder could be made for
+ *
+ * Doesn't touch the storage, so whoever owns it can carry on using it
+ * in the meantime.
+ */
+std::vector<CStorage::TrackFeatures> CAnalyzer::AnalyzeChunk(const std::vector<CStorage::TrackRecord> &tracks)
+{
+    unsigned threads = mThreads ? mThreads : std::max(1u, std::thread::hardware_concurrency());
+
+    std::vector<CStorage::TrackFeatures> found(tracks.size());
+    std::atomic<size_t> next(0);
+    auto work = [&]()
+    {
+        size_t i;
+        while (!mStop && (i = next++) < tracks.size())
+        {
+            std::unique_ptr<CDecoder> decoder(mDecoders(tracks[i].filepath));
+            if (!decoder)
+            {
+                continue;
+            }
+
+            found[i].track = tracks[i].id;
+            if (decoder->Open(tracks[i].filepath) == 0)
+            {
+                Analyze(decoder.get(), found[i]);
+            }
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (unsigned t = 1; t < threads && t < tracks.size(); ++t)
+    {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
+
+    std::vector<CStorage::TrackFeatures> results;
+    for (const CStorage::TrackFeatures &features : found)
+    {
+        if (features.track != 0)
+        {
+            results.push_back(features);
+        }
+    }
+
+    return results;
+}
+
+/**
+ * \brief Listen to one track
+ * \param decoder Decoder with the track open
+ * \param features Filled in with what was found; track is left alone
+ * \returns -1 if there was no audio to be had
+ */
+int CAnalyzer::Analyze(CDecoder *decoder, CStorage::TrackFeatures &features)
+{
+    features.decoded = false;
+
+    int rate = decoder->GetRate();
+    int channels = decoder->GetChannels();
+    if (rate < 8000 || channels < 1)
+    {
+        return -1;
+    }
+
+    // About 46ms frames, a quarter frame apart
+    size_t size = 256;
+    while (size * 2 <= (size_t)rate / 20)
+    {
+        size *= 2;
+    }
+    size_t hop = size / 4;
+    size_t bins = size / 2 + 1;
+    double binHz = (double)rate / size;
+    CFft fft(size);
+
+    // Which pitch class and fingerprint band each bin counts towards
+    std::vector<int> pitchClass(bins, -1);
+    for (size_t b = 1; b < bins; ++b)
+    {
+        double hz = b * binHz;
+        if (hz >= CHROMA_LOW && hz <= CHROMA_HIGH)
+        {
+            int note = (int)lround(12 * log2(hz / 440) + 69);
+            pitchClass[b] = note % 12;
+        }
+    }
+    size_t bandFirst[FINGERPRINT_BANDS], bandLast[FINGERPRINT_BANDS];
+    for (size_t band = 0; band < FINGERPRINT_BANDS; ++band)
+    {
+        double low = FINGERPRINT_LOW * pow(FINGERPRINT_HIGH / FINGERPRINT_LOW, (double)band / FINGERPRINT_BANDS);
+        double high = FINGERPRINT_LOW * pow(FINGERPRINT_HIGH / FINGERPRINT_LOW, (double)(band + 1) / FINGERPRINT_BANDS);
+        bandFirst[band] = (size_t)lround(low / binHz);
+        bandLast[band] = std::max(bandFirst[band], (size_t)lround(high / binHz) - 1);
+    }
+
+    // Loudness
+    std::vector<Biquad> shelves(channels), highpasses(channels);
+    std::vector<double> weights(channels, 1.0);
+    for (int c = 0; c < channels; ++c)
+    {
+        KWeighting(rate, shelves[c], highpasses[c]);
+    }
+    if (channels == 6)
+    {
+        // 5.1: the LFE doesn't count and the surrounds count for more
+        weights[3] = 0;
+        weights[4] = weights[5] = 1.41;
+    }
+    size_t blockFrames = rate / 10;
+    std::vector<double> blocks;
+    double blockSum = 0;
+    size_t blockFill = 0;
+    float peak = 0;
+
+    // Spectrum
+    std::vector<float> mono;
+    size_t monoUsed = 0;
+    std::vector<float> power(bins), previous(bins, 0);
+    std::vector<float> onsets;
+    double chroma[12] = {0};
+    std::vector<double> bandPower(FINGERPRINT_BANDS, 0);
+    size_t spectra = 0;
+
+    std::vector<float> samples(DECODE_BLOCK * channels);
+    uint64_t total = 0;
+    size_t frames;
+    while ((frames = decoder->Read(samples.data(), DECODE_BLOCK)) > 0)
+    {
+        total += frames;
+        for (size_t i = 0; i < frames; ++i)
+        {
+            const float *frame = &samples[i * channels];
+            float sum = 0;
+            for (int c = 0; c < channels; ++c)
+            {
+                peak = std::max(peak, fabsf(frame[c]));
+                double y = highpasses[c].Step(shelves[c].Step(frame[c]));
+                blockSum += weights[c] * y * y;
+                sum += frame[c];
+            }
+            mono.push_back(sum / channels);
+
+            if (++blockFill == blockFrames)
+            {
+                blocks.push_back(blockSum / blockFrames);
+                blockSum = 0;
+                blockFill = 0;
+            }
+        }
+
+        for (; monoUsed + size <= mono.size(); monoUsed += hop)
+        {
+            fft.Power(&mono[monoUsed], power.data());
+            ++spectra;
+
+            float flux = 0;
+            for (size_t b = 1; b < bins; ++b)
+            {
+                // Amplitude of a full scale sine comes out near 1
+                float level = log1pf(100 * sqrtf(power[b]) * 4 / size);
+                flux += std::max(0.0f, level - previous[b]);
+                previous[b] = level;
+
+                if (pitchClass[b] >= 0)
+                {
+                    chroma[pitchClass[b]] += sqrtf(power[b]);
+                }
+            }
+            onsets.push_back(flux);
+
+            for (size_t band = 0; band < FINGERPRINT_BANDS; ++band)
+            {
+                for (size_t b = bandFirst[band]; b <= bandLast[band] && b < bins; ++b)
+                {
+                    bandPower[band] += power[b] / (bandLast[band] - bandFirst[band] + 1);
+                }
+            }
+        }
+        mono.erase(mono.begin(), mono.begin() + monoUsed);
+        monoUsed = 0;
+    }
+
+    if (total == 0)
+    {
+        return -1;
+    }
+
+    features.decoded = true;
+    features.duration = (double)total / rate;
+    features.loudness = IntegratedLoudness(blocks);
+    features.peak = peak > 0 ? 20 * log10f(peak) : -120;
+    features.bpm = Tempo(onsets, (double)rate / hop);
+    features.key = Key(chroma);
+
+    double levels[FINGERPRINT_BANDS];
+    double mean = 0;
+    size_t heard = 0;
+    for (size_t band = 0; band < FINGERPRINT_BANDS; ++band)
+    {
+        levels[band] = bandFirst[band] < bins && spectra ? 10 * log10(bandPower[band] / spectra + 1e-12) : 0;
+        if (bandFirst[band] < bins)
+        {
+            mean += levels[band];
+            ++heard;
+        }
+    }
+    mean = heard ? mean / heard : 0;
+
+    features.fingerprint.assign(FINGERPRINT_BANDS, '\0');
+    for (size_t band = 0; band < FINGERPRINT_BANDS && bandFirst[band] < bins; ++band)
+    {
+        long step = lround(128 + 2 * (levels[band] - mean));
+        features.fingerprint[band] = (char)std::max(0L, std::min(255L, step));
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Make a decoder for a file, going by its extension
+ * \param filepath Where the file is
+ * \returns WAV decoder for .wav files, ffmpeg for anything else if it's
+ *          installed, or nullptr
+ */
+CDecoder *CAnalyzer::DefaultDecoder(const std::string &filepath)
+{
+    size_t dot = filepath.rfind('.');
+    if (dot != std::string::npos && strcasecmp(filepath.c_str() + dot, ".wav") == 0)
+    {
+        return new CWavDecoder();
+    }
+    if (CFfmpegDecoder::IsAvailable())
+    {
+        return new CFfmpegDecoder();
+    }
+    return nullptr;
+}
+
+/**
+ * \brief Work out how jarring it would be to go from one track to another
+ * \param a The track playing
+ * \param b The track that would be next
+ * \returns 0 for a perfect match, growing with each difference; infinity
+ *          if either wasn't decoded
+ *
+ * Roughly one unit each for tempos 7% apart (or double or half), keys
+ * two steps apart on the circle of fifths, spectra 8dB apart and
+ * loudness 6 LU apart.
+ */
+float CAnalyzer::Distance(const CStorage::TrackFeatures &a, const CStorage::TrackFeatures &b)
+{
+    if (!a.decoded || !b.decoded)
+    {
+        return std::numeric_limits<float>::infinity();
+    }
+
+    float distance = fabsf(a.loudness - b.loudness) / 6;
+
+    if (a.bpm > 0 && b.bpm > 0)
+    {
+        // Half and double time mix fine
+        float octaves = log2f(b.bpm / a.bpm);
+        distance += fabsf(octaves - roundf(octaves)) * 10;
+    }
+
+    if (a.key >= 0 && b.key >= 0)
+    {
+        // Relative majors and minors sit together on the circle of fifths
+        int fifthsA = ((a.key % 12 + (a.key >= 12 ? 3 : 0)) * 7) % 12;
+        int fifthsB = ((b.key % 12 + (b.key >= 12 ? 3 : 0)) * 7) % 12;
+        int steps = abs(fifthsA - fifthsB);
+        distance += 0.5f * std::min(steps, 12 - steps) + ((a.key >= 12) != (b.key >= 12) ? 0.25f : 0);
+    }
+
+    if (a.fingerprint.size() == b.fingerprint.size() && !a.fingerprint.empty())
+    {
+        float sum = 0;
+        for (size_t i = 0; i < a.fingerprint.size(); ++i)
+        {
+            float step = (float)(unsigned char)a.fingerprint[i] - (unsigned char)b.fingerprint[i];
+            sum += step * step;
+        }
+        distance += sqrtf(sum / a.fingerprint.size()) / 16;
+    }
+
+    return distance;
+}
+
+/**
+ * \brief Name a key
+ * \param key 0-11 for major keys, 12-23 for minor keys
+ * \returns Its name, e.g. "F# minor", or "" if it's not a key
+ */
+std::string CAnalyzer::KeyName(int key)
+{
+    static const char *const NOTES[12] = {"C", "C#", "D", "Eb", "E", "F", "F#", "G", "Ab", "A", "Bb", "B"};
+    if (key < 0 || key > 23)
+    {
+        return "";
+    }
+    return std::string(NOTES[key % 12]) + (key < 12 ? " major" : " minor");
+}
@@ -0,0 +1,107 @@
+/**
+ * \file Analyzer.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Analyzer class
+ */
+
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+#include "Decoder.h"
+#include "Storage.h"
+
+/**
+ * \brief Listens to every track once and keeps what it heard
+ *
+ * Each track is decoded a block at a time, and in the one pass:
+ *  - loudness is measured per EBU R128 (K-weighted, 400ms gated blocks)
+ *  - the sample peak is kept
+ *  - a frame is taken every quarter FFT, and its power spectrum gives
+ *    the spectral flux (for the tempo), the chroma (for the key) and
+ *    the energy in FINGERPRINT_BANDS log-spaced bands (for the
+ *    fingerprint)
+ *
+ * The tempo comes from autocorrelating the flux, nudged towards 120
+ * BPM; the key from matching the chroma against Krumhansl's major and
+ * minor profiles. The fingerprint is each band's level in half-dB
+ * steps around the track's average, so it's the same however loud
+ * the track is.
+ *
+ * Run() works through the library a chunk at a time, the tracks in a
+ * chunk spread across threads, and saves each chunk before moving on.
+ * Only tracks without findings are picked up, so an interrupted run
+ * carries on where it left off. Memory use is one decode block and
+ * one track's per-frame values per thread, whatever the library size.
+ */
+class CAnalyzer
+{
+public:
+
+    /// Makes a decoder for a file, or returns nullptr if nothing here can read that kind of file
+    typedef std::function<CDecoder *(const std::string &filepath)> DecoderFactory;
+
+    CAnalyzer();
+
+    /** \brief Copy constructor (disabled)
+     * \param analyzer Analyzer to construct this based on */
+    CAnalyzer(const CAnalyzer &analyzer) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param analyzer Analyzer whose attributes will override those of the current analyzer */
+    CAnalyzer& operator=(const CAnalyzer &analyzer) = delete;
+
+    /** \brief Destructor */
+    ~CAnalyzer() {}
+
+    /**
+     * \brief Choose how files are decoded
+     * \param decoders Makes a decoder for each file
+     */
+    void SetDecoders(DecoderFactory decoders) { mDecoders = decoders; }
+
+    /**
+     * \brief Choose how many tracks to analyse at once
+     * \param threads Number of threads, or 0 for one per core
+     */
+    void SetThreads(unsigned threads) { mThreads = threads; }
+
+    /**
+     * \brief Choose how many tracks to work through between saves
+     * \param tracks Tracks per chunk
+     */
+    void SetChunk(size_t tracks) { mChunk = tracks ? tracks : 1; }
+
+    int Run(CStorage *storage);
+
+    std::vector<CStorage::TrackFeatures> AnalyzeChunk(const std::vector<CStorage::TrackRecord> &tracks);
+
+    /**
+     * \brief Stop a Run() after the tracks it's in the middle of
+     *
+     * Safe to call from another thread.
+     */
+    void Stop() { mStop = true; }
+
+    static int Analyze(CDecoder *decoder, CStorage::TrackFeatures &features);
+
+    static CDecoder *DefaultDecoder(const std::string &filepath);
+
+    static float Distance(const CStorage::TrackFeatures &a, const CStorage::TrackFeatures &b);
+
+    static std::string KeyName(int key);
+
+    /// Number of bands, and so bytes, in a fingerprint
+    static const size_t FINGERPRINT_BANDS = 32;
+
+private:
+    DecoderFactory mDecoders;   ///< Makes a decoder for each file
+    unsigned mThreads;          ///< Tracks to analyse at once, or 0 for one per core
+    size_t mChunk;              ///< Tracks to work through between saves
+    std::atomic<bool> mStop;    ///< Whether Stop() has been called
+};
+
+#endif
@@ -0,0 +1,439 @@
+/**
+ * \file Artwork.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Artwork.h"
+#include "Encoding.h"
+#include "Tags.h"
+
+extern char **environ;
+
+/// First bytes of every artwork store, the last four being the version
+static const char STORE_HEADER[8] = {'M', 'M', 'A', 'R', 1, 0, 0, 0};
+
+/// Address space set aside for a store; it can't grow past this
+static const size_t STORE_RESERVE = (size_t)1 << 36;
+
+/// Kinds of record in a store
+enum Record : char
+{
+    RECORD_IMAGE = 'I',     ///< An image's hash, then each thumbnail's size and pixels
+    RECORD_ALBUM = 'A'      ///< An album, then its image's hash, or 0 for none
+};
+
+/**
+ * \brief Pull the cover art out of an audio file
+ * \param path Where the file is
+ * \param image Filled in with the image as it was embedded
+ * \returns -1 if the file can't be read or has no art
+ *
+ * The front cover is preferred where a file has several pictures.
+ */
+int CArtwork::Extract(const std::string &path, std::string &image)
+{
+    CTags tags;
+    if (tags.Read(path, true) != 0 || tags.GetPicture().empty())
+    {
+        return -1;
+    }
+
+    image = tags.GetPicture();
+    return 0;
+}
+
+/**
+ * \brief Returns the album a track's art is kept under
+ * \param filepath The track's filepath
+ * \returns The directory it's in, since an album is a directory of tracks
+ */
+std::string CArtwork::AlbumOf(const std::string &filepath)
+{
+    size_t slash = filepath.rfind('/');
+    return slash == std::string::npos ? "" : filepath.substr(0, slash);
+}
+
+/**
+ * \brief Constructor
+ *
+ * Nothing is open until Open() is called. New images are scaled to
+ * 64 and 256 pixels square by ffmpeg unless told otherwise.
+ */
+CArtworkStore::CArtworkStore()
+{
+    mFd = -1;
+    mBase = nullptr;
+    mFileBytes = 0;
+    mSizes = {64, 256};
+    mScaler = FfmpegScaler;
+}
+
+/**
+ * \brief Destructor
+ *
+ * Closes the store; pointers from Find() are no good after this
+ */
+CArtworkStore::~CArtworkStore()
+{
+    Close();
+}
+
+/**
+ * \brief Open a store, creating it if it doesn't exist
+ * \param path Where the store is
+ * \returns -1 if it can't be opened or isn't an artwork store
+ */
+int CArtworkStore::Open(const std::string &path)
+{
+    Close();
+
+    mFd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (mFd < 0)
+    {
+        return -1;
+    }
+
+    struct stat info;
+    fstat(mFd, &info);
+    size_t size = info.st_size;
+    if (size == 0)
+    {
+        if (write(mFd, STORE_HEADER, sizeof(STORE_HEADER)) != sizeof(STORE_HEADER))
+        {
+            Close();
+            return -1;
+        }
+        size = sizeof(STORE_HEADER);
+    }
+
+    void *reserved = mmap(nullptr, STORE_RESERVE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    mBase = reserved == MAP_FAILED ? nullptr : (char *)reserved;
+    if (!mBase || size > STORE_RESERVE || Map(size) != 0 || size < sizeof(STORE_HEADER) ||
+        memcmp(mBase, STORE_HEADER, sizeof(STORE_HEADER)) != 0)
+    {
+        Close();
+        return -1;
+    }
+
+    // Replay every whole frame; anything after the first bad one was a torn write
+    size_t offset = sizeof(STORE_HEADER);
+    while (offset + 8 <= size)
+    {
+        uint32_t length, sum;
+        memcpy(&length, mBase + offset, 4);
+        memcpy(&sum, mBase + offset + 4, 4);
+        if (length > size - offset - 8 || Checksum(mBase + offset + 8, length) != sum)
+        {
+            break;
+        }
+
+        Apply(mBase + offset + 8, mBase + offset + 8 + length);
+        offset += 8 + length;
+    }
+
+    if (offset < size && ftruncate(mFd, offset) != 0)
+    {
+        Close();
+        return -1;
+    }
+    mFileBytes = offset;
+
+    return 0;
+}
+
+/**
+ * \brief Close the store, if one is open
+ */
+void CArtworkStore::Close()
+{
+    if (mBase)
+    {
+        munmap(mBase, STORE_RESERVE);
+        mBase = nullptr;
+    }
+    if (mFd >= 0)
+    {
+        close(mFd);
+        mFd = -1;
+    }
+    mFileBytes = 0;
+    mImages.clear();
+    mAlbums.clear();
+}
+
+/**
+ * \brief Keep an album's art, scaling it unless another album has the same image
+ * \param album The album, see CArtwork::AlbumOf()
+ * \param image The image as it was embedded, or empty if the album has none
+ * \returns -1 if nothing is open, the image can't be scaled, or it can't be written
+ *
+ * An album with no art is kept as such, so Has() is true for it.
+ */
+int CArtworkStore::Add(const std::string &album, const std::string &image)
+{
+    if (!IsOpen())
+    {
+        return -1;
+    }
+
+    uint64_t hash = image.empty() ? 0 : ContentHash(image.data(), image.size());
+    if (!image.empty() && hash == 0)
+    {
+        hash = 1;   // 0 is for none
+    }
+    auto found = mAlbums.find(album);
+    if (found != mAlbums.end() && found->second == hash)
+    {
+        return 0;
+    }
+
+    std::string records;
+    if (hash && mImages.find(hash) == mImages.end())
+    {
+        records.push_back(RECORD_IMAGE);
+        records.append((const char *)&hash, 8);
+        PutVarint(records, mSizes.size());
+        for (int size : mSizes)
+        {
+            std::string pixels;
+            if (size < 1 || mScaler(image, size, pixels) != 0 || pixels.size() != (size_t)size * size * 3)
+            {
+                return -1;
+            }
+            PutVarint(records, size);
+            PutString(records, pixels);
+        }
+    }
+
+    records.push_back(RECORD_ALBUM);
+    PutString(records, album);
+    records.append((const char *)&hash, 8);
+
+    return Write(records);
+}
+
+/**
+ * \brief Whether an album's art, or lack of it, is kept
+ * \param album The album
+ */
+bool CArtworkStore::Has(const std::string &album)
+{
+    return mAlbums.find(album) != mAlbums.end();
+}
+
+/**
+ * \brief Look up an album's thumbnail
+ * \param album The album
+ * \param size Width and height wanted, in pixels; one of the sizes images were scaled to
+ * \returns size * size * 3 bytes of RGB, row by row, good until the
+ *          store is closed; or nullptr if there isn't one that size
+ */
+const unsigned char *CArtworkStore::Find(const std::string &album, int size)
+{
+    auto found = mAlbums.find(album);
+    if (found == mAlbums.end() || found->second == 0)
+    {
+        return nullptr;
+    }
+
+    auto image = mImages.find(found->second);
+    if (image == mImages.end())
+    {
+        return nullptr;
+    }
+    for (const Thumbnail &thumbnail : image->second)
+    {
+        if (thumbnail.size == size)
+        {
+            return (const unsigned char *)mBase + thumbnail.offset;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * \brief Scale an image by running ffmpeg over it
+ * \param image The image, in anything ffmpeg can read
+ * \param size Width and height wanted, in pixels
+ * \param pixels Filled in with size * size * 3 bytes of RGB, row by row
+ * \returns -1 if ffmpeg isn't there or can't read the image
+ *
+ * The image keeps its shape, centred on black. It goes to ffmpeg
+ * through a temporary file, so there's no pipe to deadlock on.
+ */
+int CArtworkStore::FfmpegScaler(const std::string &image, int size, std::string &pixels)
+{
+    char temp[] = "/tmp/musicmanager_art_XXXXXX";
+    int fd = mkstemp(temp);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    bool written = write(fd, image.data(), image.size()) == (ssize_t)image.size();
+    close(fd);
+
+    int pipes[2];
+    if (!written || pipe(pipes) != 0)
+    {
+        unlink(temp);
+        return -1;
+    }
+    fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipes[1]);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    std::string side = std::to_string(size);
+    std::string filter = "scale=" + side + ":" + side + ":force_original_aspect_ratio=decrease,"
+                         "pad=" + side + ":" + side + ":(ow-iw)/2:(oh-ih)/2";
+    const char *args[] = {"ffmpeg", "-nostdin", "-v", "quiet", "-i", temp, "-frames:v", "1", "-vf", filter.c_str(),
+                          "-f", "rawvideo", "-pix_fmt", "rgb24", "-", nullptr};
+
+    pid_t child;
+    int failed = posix_spawnp(&child, "ffmpeg", &actions, nullptr, (char **)args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipes[1]);
+
+    pixels.clear();
+    if (!failed)
+    {
+        char buffer[65536];
+        ssize_t n;
+        while ((n = read(pipes[0], buffer, sizeof(buffer))) != 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                break;
+            }
+            pixels.append(buffer, n);
+        }
+        waitpid(child, nullptr, 0);
+    }
+    close(pipes[0]);
+    unlink(temp);
+
+    return !failed && pixels.size() == (size_t)size * size * 3 ? 0 : -1;
+}
+
+/**
+ * \brief Take in the records of a frame already in the mapped file
+ * \param p Where the records start
+ * \param end Where they end
+ *
+ * Thumbnails aren't copied; the index just remembers where they are.
+ */
+void CArtworkStore::Apply(const char *p, const char *end)
+{
+    while (p < end)
+    {
+        char record = *p++;
+        uint64_t hash;
+
+        if (record == RECORD_IMAGE && end - p >= 8)
+        {
+            memcpy(&hash, p, 8);
+            p += 8;
+
+            std::vector<Thumbnail> thumbnails;
+            uint64_t count = GetVarint(p, end);
+            for (uint64_t i = 0; i < count && p < end; ++i)
+            {
+                int size = (int)GetVarint(p, end);
+                uint64_t bytes = GetVarint(p, end);
+                if (bytes > (uint64_t)(end - p))
+                {
+                    return;
+                }
+                if (bytes == (uint64_t)size * size * 3)
+                {
+                    thumbnails.push_back({size, (size_t)(p - mBase)});
+                }
+                p += bytes;
+            }
+            mImages[hash] = thumbnails;
+        }
+        else if (record == RECORD_ALBUM)
+        {
+            std::string album = GetString(p, end);
+            if (end - p < 8)
+            {
+                return;
+            }
+            memcpy(&hash, p, 8);
+            p += 8;
+            mAlbums[album] = hash;
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * \brief Map the file into the space set aside for it, up to a size
+ * \param size Bytes of the file to map
+ * \returns -1 if it can't be mapped
+ *
+ * The mapping goes at the same address every time, so whatever was
+ * mapped before stays where it was.
+ */
+int CArtworkStore::Map(size_t size)
+{
+    if (mmap(mBase, size, PROT_READ, MAP_SHARED | MAP_FIXED, mFd, 0) == MAP_FAILED)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Append records to the file as one frame, and take them in
+ * \param records The encoded records
+ * \returns -1 if they can't be written
+ */
+int CArtworkStore::Write(const std::string &records)
+{
+    uint32_t length = records.size();
+    uint32_t sum = Checksum(records.data(), records.size());
+
+    std::string frame(8, '\0');
+    memcpy(&frame[0], &length, 4);
+    memcpy(&frame[4], &sum, 4);
+    frame.append(records);
+
+    if (mFileBytes + frame.size() > STORE_RESERVE ||
+        write(mFd, frame.data(), frame.size()) != (ssize_t)frame.size())
+    {
+        return -1;
+    }
+
+    size_t start = mFileBytes + 8;
+    mFileBytes += frame.size();
+    if (Map(mFileBytes) != 0)
+    {
+        return -1;
+    }
+    Apply(mBase + start, mBase + mFileBytes);
+
+    return 0;
+}
@@ -0,0 +1,151 @@
+/**
+ * \file Artwork.h
+ * \author Matt Hammerly
+ * \brief Contains the definitions of the Artwork classes
+ */
+
+#ifndef ARTWORK_H
+#define ARTWORK_H
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * \brief Pulls cover art out of audio files
+ *
+ * Takes the picture CTags finds: ID3v2 APIC frames (PIC in ID3v2.2),
+ * the covr atom of MP4/M4A files, or a FLAC PICTURE block. Only the
+ * tag is read, never the audio. The image comes out as it was
+ * embedded, usually a JPEG or PNG.
+ */
+class CArtwork
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CArtwork() = delete;
+
+    static int Extract(const std::string &path, std::string &image);
+
+    static std::string AlbumOf(const std::string &filepath);
+};
+
+/**
+ * \brief Album art scaled to thumbnails, in one file mapped into memory
+ *
+ * Each image is scaled once to every size asked for, as rows of 8-bit
+ * RGB, size by size pixels, and kept by a hash of what was embedded, so
+ * albums sharing a cover share the thumbnails too. An index from album
+ * to image is kept in memory, and Find() hands back a pointer straight
+ * into the mapped file: no database, no file to open, nothing to decode.
+ *
+ * The file is a log like CLocalStorage's: a header, then frames of
+ * records, each with a length and a checksum. Opening it replays the
+ * frames, dropping a torn one at the end. An album with no art is
+ * recorded too, so its files aren't read again.
+ *
+ * The file is mapped into address space set aside when it's opened, so
+ * adding to it never moves what's already there, and pointers from
+ * Find() stay good until the store is closed.
+ *
+ * Scaling is left to a Scaler; FfmpegScaler() is the default, so no
+ * image libraries are needed here.
+ */
+class CArtworkStore
+{
+public:
+
+    /**
+     * \brief Turns an embedded image into a thumbnail
+     * \param image The image, as it was embedded
+     * \param size Width and height wanted, in pixels
+     * \param pixels Filled in with size * size * 3 bytes of RGB, row by row
+     * \returns -1 if the image can't be read
+     */
+    typedef std::function<int(const std::string &image, int size, std::string &pixels)> Scaler;
+
+    CArtworkStore();
+    ~CArtworkStore();
+
+    /** \brief Copy constructor (disabled)
+     * \param store Store to construct this based on */
+    CArtworkStore(const CArtworkStore &store) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param store Store whose attributes will override those of the current store */
+    CArtworkStore& operator=(const CArtworkStore &store) = delete;
+
+    int Open(const std::string &path);
+
+    void Close();
+
+    /**
+     * \brief Whether a file is open
+     * \returns true if Add() and Find() can be used
+     */
+    bool IsOpen() { return mFd >= 0; }
+
+    /**
+     * \brief Choose how images are scaled
+     * \param scaler The scaler; FfmpegScaler() until this is called
+     */
+    void SetScaler(const Scaler &scaler) { mScaler = scaler; }
+
+    /**
+     * \brief Choose the sizes new images are scaled to
+     * \param sizes Widths and heights, in pixels
+     */
+    void SetSizes(const std::vector<int> &sizes) { mSizes = sizes; }
+
+    int Add(const std::string &album, const std::string &image);
+
+    bool Has(const std::string &album);
+
+    const unsigned char *Find(const std::string &album, int size);
+
+    /**
+     * \brief Returns how many different images are kept
+     * \returns Number of images
+     */
+    size_t GetImageCount() { return mImages.size(); }
+
+    static int FfmpegScaler(const std::string &image, int size, std::string &pixels);
+
+private:
+    /// Where one thumbnail is in the file
+    struct Thumbnail
+    {
+        int size;           ///< Width and height, in pixels
+        size_t offset;      ///< Where its pixels start
+    };
+
+    void Apply(const char *p, const char *end);
+    int Map(size_t size);
+    int Write(const std::string &records);
+
+    /// File descriptor of the store, or -1 if none is open
+    int mFd;
+
+    /// Start of the address space set aside for the file, or nullptr
+    char *mBase;
+
+    /// Bytes of the file that are whole frames
+    size_t mFileBytes;
+
+    /// Thumbnails of each image, by hash
+    std::unordered_map<uint64_t, std::vector<Thumbnail>> mImages;
+
+    /// Hash of each album's image, or 0 for albums with none
+    std::unordered_map<std::string, uint64_t> mAlbums;
+
+    /// Sizes new images are scaled to
+    std::vector<int> mSizes;
+
+    /// What scales them
+    Scaler mScaler;
+};
+
+#endif
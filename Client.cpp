@@ -0,0 +1,531 @@
+/**
+ * \file Client.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Client.h"
+
+/// Bytes read from the server at a time
+static const size_t READ_CHUNK = 64 << 10;
+
+/**
+ * \brief Constructor, for a client that isn't connected yet
+ */
+CClient::CClient()
+{
+    mFd = -1;
+    mNextId = 1;
+}
+
+/**
+ * \brief Destructor
+ *
+ * Closes the connection, without sending anything not yet flushed
+ */
+CClient::~CClient()
+{
+    Close();
+}
+
+/**
+ * \brief Connect to a server
+ * \param path Where its socket is (see SocketPath())
+ * \returns -1 if something goes wrong, e.g. there's no server there
+ */
+int CClient::Connect(const std::string &path)
+{
+    Close();
+
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    mFd = fd;
+    return 0;
+}
+
+/**
+ * \brief Close the connection, forgetting anything not sent or received
+ */
+void CClient::Close()
+{
+    if (mFd >= 0)
+    {
+        close(mFd);
+        mFd = -1;
+    }
+    mOut.clear();
+    mIn.clear();
+    mAnswers.clear();
+}
+
+/**
+ * \brief Queue a request, to be sent by Flush() or the next Receive()
+ * \param opcode What to ask for
+ * \param payload What to ask it of (see Protocol.h)
+ * \returns Id to Receive() the answer by, or 0 if there's no connection
+ */
+uint32_t CClient::Send(Opcode opcode, const std::string &payload)
+{
+    if (mFd < 0)
+    {
+        return 0;
+    }
+
+    uint32_t id = mNextId++;
+    if (mNextId == 0)
+    {
+        mNextId = 1;
+    }
+    PutFrame(mOut, id, opcode, payload);
+    return id;
+}
+
+/**
+ * \brief Send every request queued
+ * \returns -1 if the connection is lost
+ */
+int CClient::Flush()
+{
+    size_t sent = 0;
+    while (mFd >= 0 && sent < mOut.size())
+    {
+        ssize_t put = send(mFd, mOut.data() + sent, mOut.size() - sent, MSG_NOSIGNAL);
+        if (put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (put <= 0)
+        {
+            Close();
+            return -1;
+        }
+        sent += put;
+    }
+    mOut.clear();
+    return mFd >= 0 ? 0 : -1;
+}
+
+/**
+ * \brief Wait for the answer to a request
+ * \param id What Send() gave back for it
+ * \param payload Filled in with the answer's payload
+ * \returns The answer's Status, or -1 if the connection is lost
+ *
+ * Anything still queued is sent first. Answers to other requests that
+ * turn up meanwhile are kept for their own Receive(), and
+ * notifications go to the listener.
+ */
+int CClient::Receive(uint32_t id, std::string &payload)
+{
+    if (id == 0 || Flush() != 0)
+    {
+        return -1;
+    }
+
+    for (;;)
+    {
+        auto answer = mAnswers.find(id);
+        if (answer != mAnswers.end())
+        {
+            int status = answer->second.first;
+            payload.swap(answer->second.second);
+            mAnswers.erase(answer);
+            return status;
+        }
+        if (Fill(-1) < 0 || Drain() < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+/**
+ * \brief Wait for notifications
+ * \param timeout Milliseconds to wait at most, 0 not to, or -1 forever
+ * \returns Number of notifications passed on, or -1 if the connection is lost
+ */
+int CClient::Poll(int timeout)
+{
+    if (Flush() != 0)
+    {
+        return -1;
+    }
+
+    int notified = Drain();
+    if (notified != 0)
+    {
+        return notified;
+    }
+    int got = Fill(timeout);
+    if (got <= 0)
+    {
+        return got;
+    }
+    return Drain();
+}
+
+/**
+ * \brief Send a request and wait for its answer
+ * \param opcode What to ask for
+ * \param payload What to ask it of
+ * \param reply Filled in with the answer's payload
+ * \returns The answer's Status, or -1 if the connection is lost
+ */
+int CClient::Call(Opcode opcode, const std::string &payload, std::string &reply)
+{
+    return Receive(Send(opcode, payload), reply);
+}
+
+/**
+ * \brief Read whatever the server has sent
+ * \param timeout Milliseconds to wait for something at most, 0 not to, or -1 forever
+ * \returns Bytes read, 0 if nothing came in time, or -1 if the connection is lost
+ */
+int CClient::Fill(int timeout)
+{
+    if (mFd < 0)
+    {
+        return -1;
+    }
+
+    pollfd waiting = {mFd, POLLIN, 0};
+    int ready;
+    while ((ready = poll(&waiting, 1, timeout)) < 0 && errno == EINTR);
+    if (ready == 0)
+    {
+        return 0;
+    }
+
+    char buffer[READ_CHUNK];
+    ssize_t got;
+    while ((got = recv(mFd, buffer, sizeof(buffer), 0)) < 0 && errno == EINTR);
+    if (ready < 0 || got <= 0)
+    {
+        Close();
+        return -1;
+    }
+    mIn.append(buffer, got);
+    return got;
+}
+
+/**
+ * \brief Look at every whole frame that has arrived
+ * \returns Number of notifications passed on, or -1 if the server sent something that isn't a frame
+ *
+ * Answers are kept for Receive().
+ */
+int CClient::Drain()
+{
+    int notified = 0;
+    const char *p = mIn.data();
+    const char *end = p + mIn.size();
+    for (;;)
+    {
+        uint32_t id;
+        unsigned char code;
+        const char *payload, *payloadEnd;
+        int whole = GetFrame(p, end, id, code, payload, payloadEnd);
+        if (whole < 0)
+        {
+            Close();
+            return -1;
+        }
+        if (whole == 0)
+        {
+            break;
+        }
+
+        if (id == 0 && code == OP_NOTIFY)
+        {
+            if (payload < payloadEnd && mListener)
+            {
+                Notification what = (Notification)*payload++;
+                mListener(what, GetId(payload, payloadEnd));
+            }
+            ++notified;
+        }
+        else
+        {
+            mAnswers[id] = std::make_pair((int)code, std::string(payload, payloadEnd));
+        }
+    }
+    mIn.erase(0, p - mIn.data());
+    return notified;
+}
+
+/**
+ * \brief Check the server is there
+ * \returns -1 if it isn't
+ */
+int CClient::Ping()
+{
+    std::string reply;
+    return Call(OP_PING, "", reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Start hearing about changes to the library
+ * \returns -1 if something goes wrong
+ */
+int CClient::Subscribe()
+{
+    std::string reply;
+    return Call(OP_SUBSCRIBE, "", reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Add a track to the library
+ * \param filepath The filepath of the file to be added
+ * \returns The ID of the new track, or "" if something goes wrong
+ */
+std::string CClient::AddTrack(const std::string &filepath)
+{
+    std::string payload, reply;
+    PutString(payload, filepath);
+    if (Call(OP_ADD_TRACK, payload, reply) != STATUS_OK)
+    {
+        return "";
+    }
+    const char *p = reply.data();
+    return GetId(p, p + reply.size());
+}
+
+/**
+ * \brief Remove a track from the library, and from every playlist
+ * \param id ID of the track
+ * \returns -1 if something goes wrong
+ */
+int CClient::RemoveTrack(const std::string &id)
+{
+    std::string payload, reply;
+    PutId(payload, id);
+    return Call(OP_REMOVE_TRACK, payload, reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Add a playlist to the library
+ * \param title The title of the playlist
+ * \returns The ID of the new playlist, or "" if something goes wrong
+ */
+std::string CClient::AddPlaylist(const std::string &title)
+{
+    std::string payload, reply;
+    PutString(payload, title);
+    if (Call(OP_ADD_PLAYLIST, payload, reply) != STATUS_OK)
+    {
+        return "";
+    }
+    const char *p = reply.data();
+    return GetId(p, p + reply.size());
+}
+
+/**
+ * \brief Remove a playlist from the library
+ * \param id ID of the playlist
+ * \returns -1 if something goes wrong
+ */
+int CClient::RemovePlaylist(const std::string &id)
+{
+    std::string payload, reply;
+    PutId(payload, id);
+    return Call(OP_REMOVE_PLAYLIST, payload, reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Read one page of a playlist, from the server's cache if it's warm
+ * \param id ID of the playlist
+ * \param page Number of the page, from 0; a page is CPlaylistCache::PAGE_TRACKS tracks
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track IDs on the page, in order; empty past the end
+ * \returns false if there is no such playlist, or something goes wrong
+ */
+bool CClient::LoadPlaylistPage(const std::string &id, size_t page, std::string &title, std::string &length,
+                               std::vector<std::string> &tracks)
+{
+    std::string payload, reply;
+    PutId(payload, id);
+    PutVarint(payload, page);
+    if (Call(OP_LOAD_PAGE, payload, reply) != STATUS_OK)
+    {
+        return false;
+    }
+
+    const char *p = reply.data();
+    const char *end = p + reply.size();
+    title = GetString(p, end);
+    length = std::to_string(GetVarint(p, end));
+    tracks = GetIds(p, end);
+    return true;
+}
+
+/**
+ * \brief Look tracks up by filepath
+ * \param filepaths The filepaths
+ * \returns The ID of each, or "" for ones not in the library; empty if something goes wrong
+ */
+std::vector<std::string> CClient::FindTracks(const std::vector<std::string> &filepaths)
+{
+    std::string payload, reply;
+    PutList(payload, filepaths);
+    if (Call(OP_FIND_TRACKS, payload, reply) != STATUS_OK)
+    {
+        return {};
+    }
+    const char *p = reply.data();
+    return GetIds(p, p + reply.size());
+}
+
+/**
+ * \brief Look tracks' filepaths up
+ * \param ids IDs of the tracks
+ * \returns The filepath of each, or "" for ones not in the library; empty if something goes wrong
+ */
+std::vector<std::string> CClient::FindFilepaths(const std::vector<std::string> &ids)
+{
+    std::string payload, reply;
+    PutIds(payload, ids);
+    if (Call(OP_FIND_FILEPATHS, payload, reply) != STATUS_OK)
+    {
+        return {};
+    }
+    const char *p = reply.data();
+    return GetList(p, p + reply.size());
+}
+
+/**
+ * \brief Insert tracks into a playlist
+ * \param playlist ID of the playlist
+ * \param tracks IDs of the tracks, in order
+ * \param position Where the first goes, from 1
+ * \returns -1 if something goes wrong, e.g. there's no such playlist
+ */
+int CClient::InsertTracks(const std::string &playlist, const std::vector<std::string> &tracks, int position)
+{
+    std::string payload, reply;
+    PutId(payload, playlist);
+    PutVarint(payload, position);
+    PutIds(payload, tracks);
+    return Call(OP_INSERT_TRACKS, payload, reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Remove a run of tracks from a playlist
+ * \param playlist ID of the playlist
+ * \param position Where the run starts, from 1
+ * \param count How many tracks it is
+ * \returns -1 if something goes wrong, e.g. there's no such playlist
+ */
+int CClient::RemoveRange(const std::string &playlist, int position, int count)
+{
+    std::string payload, reply;
+    PutId(payload, playlist);
+    PutVarint(payload, position);
+    PutVarint(payload, count);
+    return Call(OP_REMOVE_RANGE, payload, reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Move a run of tracks within a playlist
+ * \param playlist ID of the playlist
+ * \param from Where the run starts, from 1
+ * \param count How many tracks it is
+ * \param to Where it should start afterwards
+ * \returns -1 if something goes wrong, e.g. there's no such playlist
+ */
+int CClient::MoveRange(const std::string &playlist, int from, int count, int to)
+{
+    std::string payload, reply;
+    PutId(payload, playlist);
+    PutVarint(payload, from);
+    PutVarint(payload, count);
+    PutVarint(payload, to);
+    return Call(OP_MOVE_RANGE, payload, reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Note that something happened to a track while it was playing
+ * \param track ID of the track
+ * \param event What happened
+ * \param time When it happened, in seconds since the epoch, or 0 for now
+ * \returns -1 if something goes wrong
+ */
+int CClient::RecordPlay(const std::string &track, CStorage::PlayEvent event, long long time)
+{
+    std::string payload, reply;
+    PutId(payload, track);
+    PutVarint(payload, event);
+    PutVarint(payload, time);
+    return Call(OP_RECORD_PLAY, payload, reply) == STATUS_OK ? 0 : -1;
+}
+
+/**
+ * \brief Read how tracks have been listened to
+ * \param tracks IDs of the tracks
+ * \returns Stats of each, in the same order; empty if something goes wrong
+ */
+std::vector<CStorage::TrackStats> CClient::GetTrackStats(const std::vector<std::string> &tracks)
+{
+    std::string payload, reply;
+    PutIds(payload, tracks);
+    if (Call(OP_GET_STATS, payload, reply) != STATUS_OK)
+    {
+        return {};
+    }
+
+    const char *p = reply.data();
+    const char *end = p + reply.size();
+    if (GetVarint(p, end) != tracks.size())
+    {
+        return {};
+    }
+    std::vector<CStorage::TrackStats> stats(tracks.size());
+    for (CStorage::TrackStats &track : stats)
+    {
+        track.plays = GetVarint(p, end);
+        track.skips = GetVarint(p, end);
+        track.completions = GetVarint(p, end);
+        track.lastPlayed = GetVarint(p, end);
+    }
+    return stats;
+}
+
+/**
+ * \brief Fetch the thumbnail of a track's album art
+ * \param filepath The track's filepath
+ * \param size Width and height, in pixels; one of the server's artwork.sizes
+ * \returns size * size * 3 bytes of RGB, row by row, or "" if there isn't one
+ */
+std::string CClient::GetThumbnail(const std::string &filepath, int size)
+{
+    std::string payload, reply;
+    PutString(payload, filepath);
+    PutVarint(payload, size);
+    if (Call(OP_THUMBNAIL, payload, reply) != STATUS_OK)
+    {
+        return "";
+    }
+    return reply;
+}
@@ -0,0 +1,143 @@
+/**
+ * \file Client.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Client class
+ */
+
+#ifndef CLIENT_H
+#define CLIENT_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+#include "Protocol.h"
+#include "Storage.h"
+
+/**
+ * \brief Talks to a CServer, for frontends that don't keep a library of their own
+ *
+ * The calls named like CLibrary's and CPlaylist's send one request and
+ * wait for its answer. To pipeline, Send() as many requests as wanted,
+ * Flush() them, then Receive() each answer by the id Send() gave back;
+ * answers can be received in any order.
+ *
+ * Notifications (after Subscribe()) go to the listener whenever they
+ * turn up: while waiting for an answer, or in Poll(), which is for
+ * waiting on them alone, e.g. from a UI's event loop alongside its
+ * other file descriptors (see GetDescriptor()).
+ *
+ * If the connection is lost, every call fails until Connect() is
+ * called again.
+ */
+class CClient
+{
+public:
+
+    /**
+     * \brief Told about changes to the library
+     * \param what What happened
+     * \param id The track or playlist it happened to
+     *
+     * Called from inside the client, so it mustn't use the client itself.
+     */
+    typedef std::function<void(Notification what, const std::string &id)> Listener;
+
+    CClient();
+    ~CClient();
+
+    /** \brief Copy constructor (disabled)
+     * \param client Client to construct this based on */
+    CClient(const CClient &client) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param client Client whose attributes will override those of the current client */
+    CClient& operator=(const CClient &client) = delete;
+
+    int Connect(const std::string &path);
+
+    void Close();
+
+    /**
+     * \brief Whether there's a connection
+     * \returns false before Connect(), or once the connection is lost
+     */
+    bool IsConnected() { return mFd >= 0; }
+
+    /**
+     * \brief Returns the socket, to wait on it for notifications
+     * \returns File descriptor, or -1 if there's no connection
+     */
+    int GetDescriptor() { return mFd; }
+
+    /**
+     * \brief Choose what hears about notifications
+     * \param listener The listener; notifications are dropped until this is called
+     */
+    void SetListener(const Listener &listener) { mListener = listener; }
+
+    uint32_t Send(Opcode opcode, const std::string &payload = "");
+
+    int Flush();
+
+    int Receive(uint32_t id, std::string &payload);
+
+    int Poll(int timeout);
+
+    int Ping();
+
+    int Subscribe();
+
+    std::string AddTrack(const std::string &filepath);
+
+    int RemoveTrack(const std::string &id);
+
+    std::string AddPlaylist(const std::string &title);
+
+    int RemovePlaylist(const std::string &id);
+
+    bool LoadPlaylistPage(const std::string &id, size_t page, std::string &title, std::string &length,
+                          std::vector<std::string> &tracks);
+
+    std::vector<std::string> FindTracks(const std::vector<std::string> &filepaths);
+
+    std::vector<std::string> FindFilepaths(const std::vector<std::string> &ids);
+
+    int InsertTracks(const std::string &playlist, const std::vector<std::string> &tracks, int position);
+
+    int RemoveRange(const std::string &playlist, int position, int count);
+
+    int MoveRange(const std::string &playlist, int from, int count, int to);
+
+    int RecordPlay(const std::string &track, CStorage::PlayEvent event, long long time = 0);
+
+    std::vector<CStorage::TrackStats> GetTrackStats(const std::vector<std::string> &tracks);
+
+    std::string GetThumbnail(const std::string &filepath, int size);
+
+private:
+    int Call(Opcode opcode, const std::string &payload, std::string &reply);
+    int Fill(int timeout);
+    int Drain();
+
+    /// Socket to the server, or -1 if there's no connection
+    int mFd;
+
+    /// Id of the next request
+    uint32_t mNextId;
+
+    /// Requests not sent yet
+    std::string mOut;
+
+    /// What has arrived and not been looked at, ending with part of a frame if any
+    std::string mIn;
+
+    /// Answers that arrived before they were asked for: status and payload, by id
+    std::map<uint32_t, std::pair<int, std::string>> mAnswers;
+
+    /// What hears about notifications
+    Listener mListener;
+};
+
+#endif
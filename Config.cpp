@@ -0,0 +1,288 @@
+/**
+ * \file Config.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include "Config.h"
+
+/**
+ * \brief Cut the whitespace off both ends of a string
+ * \param text The string
+ * \returns What's left
+ */
+static std::string Trim(const std::string &text)
+{
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos)
+    {
+        return "";
+    }
+    size_t last = text.find_last_not_of(" \t\r\n");
+    return text.substr(first, last - first + 1);
+}
+
+/**
+ * \brief Add a keyword to a libpq connection string, quoted so anything goes
+ * \param conninfo Connection string to append to
+ * \param keyword libpq keyword, e.g. "host"
+ * \param value The value; nothing is added if it's empty
+ */
+static void AppendConnParam(std::string &conninfo, const char *keyword, const std::string &value)
+{
+    if (value.empty())
+    {
+        return;
+    }
+
+    if (!conninfo.empty())
+    {
+        conninfo += ' ';
+    }
+    conninfo += keyword;
+    conninfo += "='";
+    for (char c : value)
+    {
+        if (c == '\'' || c == '\\')
+        {
+            conninfo += '\\';
+        }
+        conninfo += c;
+    }
+    conninfo += '\'';
+}
+
+/**
+ * \brief Constructor
+ *
+ * Starts with every setting at its default.
+ */
+CConfig::CConfig()
+{
+    mValues["db.conninfo"] = "";
+    mValues["db.name"] = "";
+    mValues["db.host"] = "";
+    mValues["db.port"] = "";
+    mValues["db.user"] = "";
+    mValues["db.password"] = "";
+    mValues["db.schema"] = "";
+    mValues["db.replicas"] = "";
+    mValues["db.connect_timeout"] = "10";
+    mValues["db.statement_timeout"] = "0";
+    mValues["storage.local"] = "";
+    mValues["storage.shards"] = "";
+    mValues["history.batch"] = "512";
+    mValues["cache.playlist_bytes"] = "8388608";
+    mValues["analyzer.threads"] = "0";
+    mValues["analyzer.chunk"] = "64";
+    mValues["scheduler.threads"] = "1";
+    mValues["scheduler.rate"] = "0";
+    mValues["snapshot.restore_batch"] = "10000";
+    mValues["artwork.path"] = "";
+    mValues["artwork.sizes"] = "64,256";
+    mValues["export.codec"] = "mp3";
+    mValues["export.bitrate"] = "192";
+    mValues["export.threads"] = "0";
+    mValues["export.cache"] = "";
+    mValues["daemon.socket"] = "";
+}
+
+/**
+ * \brief Read the settings a program should start with
+ * \returns Defaults, overridden by the config file if there is one, then the environment
+ *
+ * The file is the one MUSICMANAGER_CONFIG names, or else
+ * ~/.config/musicmanager.conf. A missing file is fine; a bad line in
+ * one is skipped.
+ */
+CConfig CConfig::Startup()
+{
+    CConfig config;
+
+    const char *path = getenv("MUSICMANAGER_CONFIG");
+    const char *home = getenv("HOME");
+    if (path && *path)
+    {
+        config.Load(path);
+    }
+    else if (home && *home)
+    {
+        config.Load(std::string(home) + "/.config/musicmanager.conf");
+    }
+
+    config.LoadEnvironment();
+    return config;
+}
+
+/**
+ * \brief Read settings from a file
+ * \param path Where the file is
+ * \returns Number of settings read, or -1 if the file can't be read or has a bad line
+ *
+ * Good lines before and after a bad one are still read.
+ */
+int CConfig::Load(std::string path)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        return -1;
+    }
+
+    int read = 0;
+    bool bad = false;
+    std::string line;
+    while (std::getline(file, line))
+    {
+        line = Trim(line);
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+
+        if (Set(line) == 0)
+        {
+            ++read;
+        }
+        else
+        {
+            bad = true;
+        }
+    }
+
+    return bad ? -1 : read;
+}
+
+/**
+ * \brief Read settings from MUSICMANAGER_* environment variables
+ * \returns Number of settings read
+ */
+int CConfig::LoadEnvironment()
+{
+    int read = 0;
+    for (auto &setting : mValues)
+    {
+        const char *value = getenv(EnvironmentName(setting.first).c_str());
+        if (value)
+        {
+            setting.second = value;
+            ++read;
+        }
+    }
+    return read;
+}
+
+/**
+ * \brief Change a setting
+ * \param key The setting, e.g. "history.batch"
+ * \param value Its new value
+ * \returns -1 if there's no such setting
+ */
+int CConfig::Set(const std::string &key, const std::string &value)
+{
+    auto found = mValues.find(key);
+    if (found == mValues.end())
+    {
+        return -1;
+    }
+    found->second = value;
+    return 0;
+}
+
+/**
+ * \brief Change a setting given as "key = value", e.g. from a command line
+ * \param setting The setting and its new value
+ * \returns -1 if there's no '=' or no such setting
+ */
+int CConfig::Set(const std::string &setting)
+{
+    size_t equals = setting.find('=');
+    if (equals == std::string::npos)
+    {
+        return -1;
+    }
+    return Set(Trim(setting.substr(0, equals)), Trim(setting.substr(equals + 1)));
+}
+
+/**
+ * \brief Returns a setting
+ * \param key The setting
+ * \returns Its value, or empty if there's no such setting
+ */
+std::string CConfig::Get(const std::string &key) const
+{
+    auto found = mValues.find(key);
+    return found != mValues.end() ? found->second : "";
+}
+
+/**
+ * \brief Returns a setting as a whole number
+ * \param key The setting
+ * \returns Its value, or 0 if it isn't a number
+ */
+long CConfig::GetInt(const std::string &key) const
+{
+    return atol(Get(key).c_str());
+}
+
+/**
+ * \brief Returns a setting as a number
+ * \param key The setting
+ * \returns Its value, or 0 if it isn't a number
+ */
+double CConfig::GetDouble(const std::string &key) const
+{
+    return atof(Get(key).c_str());
+}
+
+/**
+ * \brief Returns every setting there is
+ * \returns Keys, in order
+ */
+std::vector<std::string> CConfig::Keys() const
+{
+    std::vector<std::string> keys;
+    for (auto &setting : mValues)
+    {
+        keys.push_back(setting.first);
+    }
+    return keys;
+}
+
+/**
+ * \brief Returns the environment variable a setting is read from
+ * \param key The setting, e.g. "db.host"
+ * \returns The variable's name, e.g. "MUSICMANAGER_DB_HOST"
+ */
+std::string CConfig::EnvironmentName(const std::string &key)
+{
+    std::string name = "MUSICMANAGER_";
+    for (char c : key)
+    {
+        name += c == '.' ? '_' : (char)toupper((unsigned char)c);
+    }
+    return name;
+}
+
+/**
+ * \brief Build the libpq connection string for the db.* settings
+ * \returns db.conninfo if it's set, otherwise one made from the rest
+ */
+std::string CConfig::ConnectionString() const
+{
+    if (!Get("db.conninfo").empty())
+    {
+        return Get("db.conninfo");
+    }
+
+    std::string conninfo;
+    AppendConnParam(conninfo, "dbname", Get("db.name"));
+    AppendConnParam(conninfo, "host", Get("db.host"));
+    AppendConnParam(conninfo, "port", Get("db.port"));
+    AppendConnParam(conninfo, "user", Get("db.user"));
+    AppendConnParam(conninfo, "password", Get("db.password"));
+    AppendConnParam(conninfo, "connect_timeout", Get("db.connect_timeout"));
+    return conninfo;
+}
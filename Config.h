@@ -0,0 +1,120 @@
+/**
+ * \file Config.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Config class
+ */
+
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * \brief Settings read at startup, so a deployment can be tuned without recompiling
+ *
+ * Every setting has a default, so an empty config works against
+ * whichever database libpq picks from PGHOST, PGDATABASE and the rest
+ * of the environment. Settings are then overridden
+ * from a file, and from the environment, in that order:
+ *
+ *     # Lines are "key = value"; blank lines and ones starting with # are skipped
+ *     db.host = /var/run/postgresql
+ *     db.name = music
+ *     history.batch = 2048
+ *
+ * and the same key in the environment is MUSICMANAGER_ followed by the
+ * key in capitals with dots as underscores, e.g. MUSICMANAGER_DB_HOST.
+ * Startup() does all of that, reading the file named by
+ * MUSICMANAGER_CONFIG or else ~/.config/musicmanager.conf if there is one.
+ *
+ * Settings:
+ *  - db.conninfo: libpq connection string or URI; if set, the other
+ *    db.* connection settings are ignored
+ *  - db.name, db.host, db.port, db.user, db.password: what to connect
+ *    to; empty ones are left to libpq, which falls back on PGHOST and
+ *    friends and ~/.pgpass
+ *  - db.schema: schema to keep the library in, made if it isn't there,
+ *    or empty for the usual search_path
+ *  - db.replicas: connection strings of standbys to send reads to,
+ *    separated by ';', or empty to read from the primary (see
+ *    CReplicatedStorage); the other db.* settings still apply to them
+ *  - db.connect_timeout: seconds to wait for a connection, or 0 forever
+ *  - db.statement_timeout: milliseconds any one statement can take, or 0
+ *    for no limit
+ *  - storage.local: library file to use instead of Postgres (see
+ *    CLocalStorage)
+ *  - storage.shards: "root=where;root=where" to spread tracks over
+ *    several storages by library root (see CShardedStorage), where each
+ *    is a connection string, or a library file if storage.local is set;
+ *    the db.* settings or storage.local are then the catalog; an
+ *    empty root takes tracks under no other, else they are refused
+ *  - history.batch: listening events buffered before they're written out
+ *  - cache.playlist_bytes: memory for recently read playlists, or 0 for none
+ *  - analyzer.threads: tracks analysed at once, or 0 for one per core
+ *  - analyzer.chunk: tracks analysed between saves
+ *  - scheduler.threads: background workers
+ *  - scheduler.rate: background steps per second at most, or 0 for no limit
+ *  - snapshot.restore_batch: tracks handed to the storage at a time on import
+ *  - artwork.path: file to keep album art thumbnails in, or empty for
+ *    none (see CArtworkStore)
+ *  - artwork.sizes: widths of the square thumbnails made, in pixels,
+ *    separated by commas
+ *  - export.codec: what CPlaylist::Sync() transcodes to: wav, mp3,
+ *    aac, opus, vorbis or flac (see CExporter)
+ *  - export.bitrate: kilobits per second, for the lossy codecs
+ *  - export.threads: tracks transcoded at once, or 0 for one per core
+ *  - export.cache: directory to keep transcodes in between syncs, or
+ *    empty for one in $XDG_CACHE_HOME
+ *  - daemon.socket: where musicmanagerd listens and clients connect
+ *    (see CServer), or empty for one in $XDG_RUNTIME_DIR
+ *
+ * Unknown keys are refused, so a typo doesn't silently leave the
+ * default in place.
+ */
+class CConfig
+{
+public:
+
+    CConfig();
+
+    /** \brief Copy constructor
+     * \param config Config to construct this based on */
+    CConfig(const CConfig &config) = default;
+
+    /** \brief Assignment operator
+     * \param config Config whose settings will override those of the current config */
+    CConfig& operator=(const CConfig &config) = default;
+
+    /** \brief Destructor */
+    ~CConfig() {}
+
+    static CConfig Startup();
+
+    int Load(std::string path);
+
+    int LoadEnvironment();
+
+    int Set(const std::string &key, const std::string &value);
+
+    int Set(const std::string &setting);
+
+    std::string Get(const std::string &key) const;
+
+    long GetInt(const std::string &key) const;
+
+    double GetDouble(const std::string &key) const;
+
+    std::vector<std::string> Keys() const;
+
+    static std::string EnvironmentName(const std::string &key);
+
+    std::string ConnectionString() const;
+
+private:
+    /// Every setting, by key
+    std::map<std::string, std::string> mValues;
+};
+
+#endif
@@ -0,0 +1,326 @@
+/**
+ * \file Decoder.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Decoder.h"
+
+extern char **environ;
+
+/// WAVE format tags
+static const int WAVE_PCM = 1;
+static const int WAVE_FLOAT = 3;
+static const int WAVE_EXTENSIBLE = 0xfffe;
+
+/// Rate and channels ffmpeg is asked to convert everything to
+static const int FFMPEG_RATE = 44100;
+static const int FFMPEG_CHANNELS = 2;
+
+/**
+ * \brief Read a little-endian integer out of a buffer
+ * \param p Where it starts
+ * \param bytes How many bytes it is
+ */
+static uint32_t Little(const unsigned char *p, int bytes)
+{
+    uint32_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i)
+    {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+/**
+ * \brief Destructor
+ *
+ * Closes the file
+ */
+CWavDecoder::~CWavDecoder()
+{
+    if (mFile)
+    {
+        fclose(mFile);
+    }
+}
+
+/**
+ * \brief Start reading a WAVE file
+ * \param path Where the file is
+ * \returns -1 if it can't be read, or isn't a format this understands
+ *
+ * Walks the chunks up to the audio, so fmt and data can come in
+ * either order with anything else in between.
+ */
+int CWavDecoder::Open(const std::string &path)
+{
+    if (mFile)
+    {
+        fclose(mFile);
+    }
+    mRate = mChannels = mBits = 0;
+    mRemaining = 0;
+
+    mFile = fopen(path.c_str(), "rb");
+    if (!mFile)
+    {
+        return -1;
+    }
+
+    unsigned char header[12];
+    if (fread(header, 1, 12, mFile) != 12 || memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0)
+    {
+        return -1;
+    }
+
+    int format = 0;
+    unsigned char chunk[8];
+    while (fread(chunk, 1, 8, mFile) == 8)
+    {
+        uint32_t size = Little(chunk + 4, 4);
+
+        if (memcmp(chunk, "fmt ", 4) == 0 && size >= 16)
+        {
+            unsigned char fmt[40] = {0};
+            size_t wanted = size < sizeof(fmt) ? size : sizeof(fmt);
+            if (fread(fmt, 1, wanted, mFile) != wanted)
+            {
+                return -1;
+            }
+            format = Little(fmt, 2);
+            mChannels = Little(fmt + 2, 2);
+            mRate = Little(fmt + 4, 4);
+            mBits = Little(fmt + 14, 2);
+            if (format == WAVE_EXTENSIBLE && size >= 26)
+            {
+                // The real tag is the start of the subformat GUID
+                format = Little(fmt + 24, 2);
+            }
+            fseek(mFile, (long)(size - wanted + (size & 1)), SEEK_CUR);
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            mRemaining = size;
+            break;
+        }
+        else
+        {
+            fseek(mFile, (long)size + (size & 1), SEEK_CUR);
+        }
+    }
+
+    mFloat = format == WAVE_FLOAT;
+    bool known = (format == WAVE_PCM && (mBits == 8 || mBits == 16 || mBits == 24 || mBits == 32)) ||
+                 (format == WAVE_FLOAT && mBits == 32);
+    if (!known || mChannels < 1 || mChannels > 32 || mRate < 1 || mRemaining == 0)
+    {
+        mRate = mChannels = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Read the next block of samples
+ * \param samples Filled in with up to frames * GetChannels() samples
+ * \param frames How many frames to read at most
+ * \returns Number of frames read; 0 at the end of the audio
+ */
+size_t CWavDecoder::Read(float *samples, size_t frames)
+{
+    if (!mFile || mChannels == 0)
+    {
+        return 0;
+    }
+
+    size_t width = mBits / 8;
+    size_t frameBytes = width * mChannels;
+    uint64_t wanted = frames * frameBytes;
+    if (wanted > mRemaining)
+    {
+        wanted = mRemaining - mRemaining % frameBytes;
+    }
+
+    mBuffer.resize(wanted);
+    size_t got = fread(&mBuffer[0], 1, wanted, mFile);
+    mRemaining -= got;
+    if (got < wanted)
+    {
+        mRemaining = 0;
+    }
+
+    size_t count = got / frameBytes * mChannels;
+    const unsigned char *p = (const unsigned char *)mBuffer.data();
+    for (size_t i = 0; i < count; ++i, p += width)
+    {
+        if (mFloat)
+        {
+            memcpy(&samples[i], p, 4);
+        }
+        else if (width == 1)
+        {
+            // 8-bit is the odd one out, and unsigned
+            samples[i] = (p[0] - 128) / 128.0f;
+        }
+        else
+        {
+            // Shift the sample to the top of an int so the sign comes along
+            int32_t value = (int32_t)(Little(p, width) << (32 - mBits));
+            samples[i] = value / 2147483648.0f;
+        }
+    }
+
+    return count / mChannels;
+}
+
+/**
+ * \brief Destructor
+ *
+ * Stops ffmpeg if it's still going
+ */
+CFfmpegDecoder::~CFfmpegDecoder()
+{
+    Close();
+}
+
+/**
+ * \brief Whether there's an ffmpeg to run
+ * \returns true if one is on the PATH
+ *
+ * Only looks the first time.
+ */
+bool CFfmpegDecoder::IsAvailable()
+{
+    static const bool available = []()
+    {
+        const char *path = getenv("PATH");
+        std::string dirs = path ? path : "/usr/bin:/bin";
+        size_t start = 0;
+        while (start <= dirs.size())
+        {
+            size_t end = dirs.find(':', start);
+            if (end == std::string::npos)
+            {
+                end = dirs.size();
+            }
+            std::string candidate = dirs.substr(start, end - start) + "/ffmpeg";
+            if (end > start && access(candidate.c_str(), X_OK) == 0)
+            {
+                return true;
+            }
+            start = end + 1;
+        }
+        return false;
+    }();
+
+    return available;
+}
+
+/**
+ * \brief Start ffmpeg decoding a file
+ * \param path Where the file is
+ * \returns -1 if ffmpeg can't be started
+ *
+ * A file ffmpeg can't make sense of reads as empty.
+ */
+int CFfmpegDecoder::Open(const std::string &path)
+{
+    Close();
+    mRate = mChannels = 0;
+
+    int pipes[2];
+    if (pipe(pipes) != 0)
+    {
+        return -1;
+    }
+    fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, pipes[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, pipes[1]);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    std::string rate = std::to_string(FFMPEG_RATE);
+    std::string channels = std::to_string(FFMPEG_CHANNELS);
+    const char *args[] = {"ffmpeg", "-nostdin", "-v", "quiet", "-i", path.c_str(), "-vn",
+                          "-f", "f32le", "-ac", channels.c_str(), "-ar", rate.c_str(), "-", nullptr};
+
+    int failed = posix_spawnp(&mChild, "ffmpeg", &actions, nullptr, (char **)args, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipes[1]);
+
+    if (failed)
+    {
+        close(pipes[0]);
+        mChild = -1;
+        return -1;
+    }
+
+    mPipe = pipes[0];
+    mRate = FFMPEG_RATE;
+    mChannels = FFMPEG_CHANNELS;
+    return 0;
+}
+
+/**
+ * \brief Read the next block of samples
+ * \param samples Filled in with up to frames * GetChannels() samples
+ * \param frames How many frames to read at most
+ * \returns Number of frames read; 0 once ffmpeg is done
+ */
+size_t CFfmpegDecoder::Read(float *samples, size_t frames)
+{
+    if (mPipe < 0)
+    {
+        return 0;
+    }
+
+    size_t frameBytes = sizeof(float) * mChannels;
+    size_t wanted = frames * frameBytes;
+    size_t got = 0;
+    char *out = (char *)samples;
+    while (got < wanted)
+    {
+        ssize_t n = read(mPipe, out + got, wanted - got);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+
+    return got / frameBytes;
+}
+
+/**
+ * \brief Stop reading, and stop ffmpeg if it isn't done
+ */
+void CFfmpegDecoder::Close()
+{
+    if (mPipe >= 0)
+    {
+        close(mPipe);
+        mPipe = -1;
+    }
+    if (mChild > 0)
+    {
+        kill(mChild, SIGTERM);
+        waitpid(mChild, nullptr, 0);
+        mChild = -1;
+    }
+}
@@ -0,0 +1,121 @@
+/**
+ * \file Decoder.h
+ * \author Matt Hammerly
+ * \brief Contains the definitions of the Decoder classes
+ */
+
+#ifndef DECODER_H
+#define DECODER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * \brief Reads audio out of a file as floats, a block at a time
+ *
+ * Samples come out interleaved, from -1 to 1, at whatever rate and
+ * with however many channels the file has. Only a block is ever held
+ * in memory, however long the track is.
+ */
+class CDecoder
+{
+public:
+
+    /** \brief Constructor */
+    CDecoder() {}
+
+    /** \brief Copy constructor (disabled)
+     * \param decoder Decoder to construct this based on */
+    CDecoder(const CDecoder &decoder) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param decoder Decoder whose attributes will override those of the current decoder */
+    CDecoder& operator=(const CDecoder &decoder) = delete;
+
+    /** \brief Destructor */
+    virtual ~CDecoder() {}
+
+    /** \brief Start reading a file
+     * \param path Where the file is
+     * \returns -1 if it can't be read */
+    virtual int Open(const std::string &path) = 0;
+
+    /** \brief Read the next block of samples
+     * \param samples Filled in with up to frames * GetChannels() samples
+     * \param frames How many frames to read at most
+     * \returns Number of frames read; 0 at the end, or if something goes wrong */
+    virtual size_t Read(float *samples, size_t frames) = 0;
+
+    /**
+     * \brief Returns the sample rate of what's being read
+     * \returns Frames per second, or 0 if nothing is open
+     */
+    int GetRate() { return mRate; }
+
+    /**
+     * \brief Returns the number of channels in what's being read
+     * \returns Samples per frame, or 0 if nothing is open
+     */
+    int GetChannels() { return mChannels; }
+
+protected:
+    int mRate = 0;      ///< Frames per second
+    int mChannels = 0;  ///< Samples per frame
+};
+
+/**
+ * \brief Reads uncompressed RIFF WAVE files
+ *
+ * Handles 8, 16, 24 and 32-bit integer PCM and 32-bit float, plain or
+ * WAVE_FORMAT_EXTENSIBLE.
+ */
+class CWavDecoder : public CDecoder
+{
+public:
+
+    /** \brief Constructor */
+    CWavDecoder() {}
+
+    virtual ~CWavDecoder();
+
+    virtual int Open(const std::string &path) override;
+    virtual size_t Read(float *samples, size_t frames) override;
+
+private:
+    FILE *mFile = nullptr;      ///< The file, or nullptr
+    int mBits = 0;              ///< Bits per sample
+    bool mFloat = false;        ///< Whether samples are floats rather than integers
+    uint64_t mRemaining = 0;    ///< Bytes of samples left to read
+    std::string mBuffer;        ///< Raw bytes of the block being read
+};
+
+/**
+ * \brief Reads anything ffmpeg can, by running it and reading its output
+ *
+ * ffmpeg is asked for 32-bit float stereo at 44.1kHz on a pipe, so
+ * compressed formats need no decoding libraries here.
+ */
+class CFfmpegDecoder : public CDecoder
+{
+public:
+
+    /** \brief Constructor */
+    CFfmpegDecoder() {}
+
+    virtual ~CFfmpegDecoder();
+
+    virtual int Open(const std::string &path) override;
+    virtual size_t Read(float *samples, size_t frames) override;
+
+    static bool IsAvailable();
+
+private:
+    void Close();
+
+    pid_t mChild = -1;  ///< The ffmpeg process, or -1
+    int mPipe = -1;     ///< Read end of its output, or -1
+};
+
+#endif
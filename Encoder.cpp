@@ -0,0 +1,307 @@
+/**
+ * \file Encoder.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cerrno>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include "Encoder.h"
+
+extern char **environ;
+
+/// Bytes of a WAVE header with just fmt and data chunks
+static const uint32_t WAV_HEADER_BYTES = 44;
+
+/**
+ * \brief Add a little-endian integer to a buffer
+ * \param out Where it goes
+ * \param value The integer
+ * \param bytes How many bytes it is
+ */
+static void PutLittle(std::string &out, uint32_t value, int bytes)
+{
+    for (int i = 0; i < bytes; ++i)
+    {
+        out += (char)(value >> (8 * i));
+    }
+}
+
+/**
+ * \brief Make a WAVE header
+ * \param rate Frames per second
+ * \param channels Samples per frame
+ * \param bytes Bytes of samples that follow
+ * \returns WAV_HEADER_BYTES bytes
+ */
+static std::string WavHeader(int rate, int channels, uint32_t bytes)
+{
+    std::string header = "RIFF";
+    PutLittle(header, 36 + bytes, 4);
+    header += "WAVEfmt ";
+    PutLittle(header, 16, 4);
+    PutLittle(header, 1, 2);
+    PutLittle(header, channels, 2);
+    PutLittle(header, rate, 4);
+    PutLittle(header, rate * channels * 2, 4);
+    PutLittle(header, channels * 2, 2);
+    PutLittle(header, 16, 2);
+    header += "data";
+    PutLittle(header, bytes, 4);
+    return header;
+}
+
+/**
+ * \brief Destructor
+ *
+ * Closes the file, if Close() wasn't called
+ */
+CWavEncoder::~CWavEncoder()
+{
+    if (mFile)
+    {
+        fclose(mFile);
+    }
+}
+
+/**
+ * \brief Start writing a WAVE file
+ * \param path Where the file goes
+ * \param rate Frames per second
+ * \param channels Samples per frame
+ * \returns -1 if it can't be written
+ *
+ * The header goes in now with the sizes left at 0.
+ */
+int CWavEncoder::Open(const std::string &path, int rate, int channels)
+{
+    if (mFile)
+    {
+        fclose(mFile);
+    }
+    mBytes = 0;
+    mFailed = false;
+    mChannels = channels;
+
+    mFile = fopen(path.c_str(), "wb");
+    if (!mFile || rate < 1 || channels < 1)
+    {
+        return -1;
+    }
+
+    std::string header = WavHeader(rate, channels, 0);
+    mFailed = fwrite(header.data(), 1, header.size(), mFile) != header.size();
+    return mFailed ? -1 : 0;
+}
+
+/**
+ * \brief Write the next block of samples, as 16-bit integers
+ * \param samples frames * channels samples
+ * \param frames How many frames there are
+ * \returns -1 if they can't be written
+ */
+int CWavEncoder::Write(const float *samples, size_t frames)
+{
+    if (!mFile || mFailed)
+    {
+        return -1;
+    }
+
+    size_t count = frames * mChannels;
+    mBuffer.clear();
+    for (size_t i = 0; i < count; ++i)
+    {
+        float sample = std::fmax(-1.0f, std::fmin(1.0f, samples[i]));
+        PutLittle(mBuffer, (uint16_t)(int16_t)lrintf(sample * 32767), 2);
+    }
+
+    mFailed = fwrite(mBuffer.data(), 1, mBuffer.size(), mFile) != mBuffer.size();
+    mBytes += mBuffer.size();
+    return mFailed ? -1 : 0;
+}
+
+/**
+ * \brief Fill in the sizes and close the file
+ * \returns -1 if anything couldn't be written
+ */
+int CWavEncoder::Close()
+{
+    if (!mFile)
+    {
+        return -1;
+    }
+
+    if (mBytes > 0xffffffffu - WAV_HEADER_BYTES)
+    {
+        mFailed = true;
+    }
+
+    std::string sizes;
+    PutLittle(sizes, 36 + mBytes, 4);
+    mFailed = mFailed || fseek(mFile, 4, SEEK_SET) != 0 || fwrite(sizes.data(), 1, 4, mFile) != 4;
+    sizes.clear();
+    PutLittle(sizes, mBytes, 4);
+    mFailed = mFailed || fseek(mFile, 40, SEEK_SET) != 0 || fwrite(sizes.data(), 1, 4, mFile) != 4;
+
+    mFailed = fclose(mFile) != 0 || mFailed;
+    mFile = nullptr;
+    return mFailed ? -1 : 0;
+}
+
+/**
+ * \brief Constructor
+ * \param codec ffmpeg's name for the codec, e.g. libmp3lame, aac, libopus, flac
+ * \param bitrate Kilobits per second, or 0 to leave it to ffmpeg (as for lossless codecs)
+ */
+CFfmpegEncoder::CFfmpegEncoder(std::string codec, int bitrate)
+    : mCodec(codec), mBitrate(bitrate)
+{
+}
+
+/**
+ * \brief Destructor
+ *
+ * Stops ffmpeg if Close() wasn't called
+ */
+CFfmpegEncoder::~CFfmpegEncoder()
+{
+    Stop();
+}
+
+/**
+ * \brief Start ffmpeg encoding to a file
+ * \param path Where the file goes; its extension picks the container
+ * \param rate Frames per second
+ * \param channels Samples per frame
+ * \returns -1 if ffmpeg can't be started
+ *
+ * A socket rather than a pipe, so a write to an ffmpeg that's given up
+ * fails instead of raising SIGPIPE.
+ */
+int CFfmpegEncoder::Open(const std::string &path, int rate, int channels)
+{
+    Stop();
+    mFailed = false;
+    mChannels = channels;
+
+    int sockets[2];
+    if (rate < 1 || channels < 1 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0)
+    {
+        return -1;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sockets[1], STDIN_FILENO);
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+    posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null", O_WRONLY, 0);
+
+    std::string rateArg = std::to_string(rate);
+    std::string channelsArg = std::to_string(channels);
+    std::string bitrateArg = std::to_string(mBitrate) + "k";
+    std::vector<const char *> args = {"ffmpeg", "-v", "quiet", "-y", "-f", "f32le", "-ar", rateArg.c_str(),
+                                      "-ac", channelsArg.c_str(), "-i", "pipe:0", "-vn", "-c:a", mCodec.c_str()};
+    if (mBitrate > 0)
+    {
+        args.push_back("-b:a");
+        args.push_back(bitrateArg.c_str());
+    }
+    args.push_back(path.c_str());
+    args.push_back(nullptr);
+
+    int failed = posix_spawnp(&mChild, "ffmpeg", &actions, nullptr, (char **)args.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(sockets[1]);
+
+    if (failed)
+    {
+        close(sockets[0]);
+        mChild = -1;
+        return -1;
+    }
+
+    mSocket = sockets[0];
+    return 0;
+}
+
+/**
+ * \brief Send ffmpeg the next block of samples
+ * \param samples frames * channels samples
+ * \param frames How many frames there are
+ * \returns -1 if ffmpeg has stopped taking them
+ */
+int CFfmpegEncoder::Write(const float *samples, size_t frames)
+{
+    if (mSocket < 0 || mFailed)
+    {
+        return -1;
+    }
+
+    const char *data = (const char *)samples;
+    size_t size = frames * mChannels * sizeof(float);
+    size_t sent = 0;
+    while (sent < size)
+    {
+        ssize_t n = send(mSocket, data + sent, size - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            mFailed = true;
+            return -1;
+        }
+        sent += n;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Tell ffmpeg that's all, and wait for it to finish the file
+ * \returns -1 if it didn't finish cleanly
+ */
+int CFfmpegEncoder::Close()
+{
+    if (mSocket < 0)
+    {
+        return -1;
+    }
+
+    close(mSocket);
+    mSocket = -1;
+
+    int status = 0;
+    while (waitpid(mChild, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    mChild = -1;
+
+    return !mFailed && WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+/**
+ * \brief Stop ffmpeg if it isn't done
+ */
+void CFfmpegEncoder::Stop()
+{
+    if (mSocket >= 0)
+    {
+        close(mSocket);
+        mSocket = -1;
+    }
+    if (mChild > 0)
+    {
+        kill(mChild, SIGTERM);
+        waitpid(mChild, nullptr, 0);
+        mChild = -1;
+    }
+}
@@ -0,0 +1,118 @@
+/**
+ * \file Encoder.h
+ * \author Matt Hammerly
+ * \brief Contains the definitions of the Encoder classes
+ */
+
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * \brief Writes audio to a file from floats, a block at a time
+ *
+ * The other end of a CDecoder: samples go in interleaved, from -1 to
+ * 1, at the rate and channels the file was opened with. Only a block
+ * is ever held in memory, however long the track is.
+ */
+class CEncoder
+{
+public:
+
+    /** \brief Constructor */
+    CEncoder() {}
+
+    /** \brief Copy constructor (disabled)
+     * \param encoder Encoder to construct this based on */
+    CEncoder(const CEncoder &encoder) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param encoder Encoder whose attributes will override those of the current encoder */
+    CEncoder& operator=(const CEncoder &encoder) = delete;
+
+    /** \brief Destructor */
+    virtual ~CEncoder() {}
+
+    /** \brief Start writing a file, replacing anything already there
+     * \param path Where the file goes
+     * \param rate Frames per second
+     * \param channels Samples per frame
+     * \returns -1 if it can't be written */
+    virtual int Open(const std::string &path, int rate, int channels) = 0;
+
+    /** \brief Write the next block of samples
+     * \param samples frames * channels samples
+     * \param frames How many frames there are
+     * \returns -1 if they can't be written */
+    virtual int Write(const float *samples, size_t frames) = 0;
+
+    /** \brief Finish the file
+     * \returns -1 if it couldn't be finished; what's there shouldn't be used */
+    virtual int Close() = 0;
+};
+
+/**
+ * \brief Writes 16-bit PCM RIFF WAVE files
+ *
+ * The sizes in the header are filled in by Close(), once they're known.
+ */
+class CWavEncoder : public CEncoder
+{
+public:
+
+    /** \brief Constructor */
+    CWavEncoder() {}
+
+    virtual ~CWavEncoder();
+
+    virtual int Open(const std::string &path, int rate, int channels) override;
+    virtual int Write(const float *samples, size_t frames) override;
+    virtual int Close() override;
+
+private:
+    FILE *mFile = nullptr;      ///< The file, or nullptr
+    int mChannels = 0;          ///< Samples per frame
+    uint64_t mBytes = 0;        ///< Bytes of samples written so far
+    bool mFailed = false;       ///< Whether a write has gone wrong
+    std::string mBuffer;        ///< Raw bytes of the block being written
+};
+
+/**
+ * \brief Writes anything ffmpeg can, by running it and feeding it samples
+ *
+ * Samples go to ffmpeg as 32-bit floats on a socket, so compressed
+ * formats need no encoding libraries here, and ffmpeg encodes on its
+ * own core while the next block is decoded. The container comes from
+ * the file's extension.
+ */
+class CFfmpegEncoder : public CEncoder
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CFfmpegEncoder() = delete;
+
+    CFfmpegEncoder(std::string codec, int bitrate);
+
+    virtual ~CFfmpegEncoder();
+
+    virtual int Open(const std::string &path, int rate, int channels) override;
+    virtual int Write(const float *samples, size_t frames) override;
+    virtual int Close() override;
+
+private:
+    void Stop();
+
+    std::string mCodec;     ///< ffmpeg's name for the codec
+    int mBitrate;           ///< Kilobits per second, or 0 to leave it to ffmpeg
+    int mChannels = 0;      ///< Samples per frame
+    pid_t mChild = -1;      ///< The ffmpeg process, or -1
+    int mSocket = -1;       ///< Our end of its input, or -1
+    bool mFailed = false;   ///< Whether a write has gone wrong
+};
+
+#endif
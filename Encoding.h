@@ -0,0 +1,166 @@
+/**
+ * \file Encoding.h
+ * \author Matt Hammerly
+ * \brief Helpers for the binary formats the library writes to disk
+ *
+ * Integers are written as little-endian base-128 varints, strings as a
+ * varint length followed by the bytes, and signed deltas are zigzagged
+ * first so small negative numbers stay small. Floats are written as
+ * their four bytes, as they are in memory.
+ */
+
+#ifndef ENCODING_H
+#define ENCODING_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+/**
+ * \brief Append an unsigned integer as a varint
+ * \param out String to append to
+ * \param value Value to append
+ */
+inline void PutVarint(std::string &out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+/**
+ * \brief Append a length-prefixed string
+ * \param out String to append to
+ * \param value String to append
+ */
+inline void PutString(std::string &out, const std::string &value)
+{
+    PutVarint(out, value.size());
+    out.append(value);
+}
+
+/**
+ * \brief Read a varint
+ * \param p Where to read from; advanced past the varint
+ * \param end End of the buffer
+ * \returns The value, or 0 if the buffer ran out (which also sets p to end)
+ */
+inline uint64_t GetVarint(const char *&p, const char *end)
+{
+    uint64_t value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7)
+    {
+        unsigned char byte = *p++;
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+    p = end;
+    return 0;
+}
+
+/**
+ * \brief Read a length-prefixed string
+ * \param p Where to read from; advanced past the string
+ * \param end End of the buffer
+ * \returns The string, or "" if the buffer ran out (which also sets p to end)
+ */
+inline std::string GetString(const char *&p, const char *end)
+{
+    uint64_t size = GetVarint(p, end);
+    if (size > (uint64_t)(end - p))
+    {
+        p = end;
+        return "";
+    }
+    std::string value(p, size);
+    p += size;
+    return value;
+}
+
+/**
+ * \brief Append a float
+ * \param out String to append to
+ * \param value Value to append
+ */
+inline void PutFloat(std::string &out, float value)
+{
+    out.append((const char *)&value, sizeof(value));
+}
+
+/**
+ * \brief Read a float
+ * \param p Where to read from; advanced past the float
+ * \param end End of the buffer
+ * \returns The value, or 0 if the buffer ran out (which also sets p to end)
+ */
+inline float GetFloat(const char *&p, const char *end)
+{
+    float value = 0;
+    if ((size_t)(end - p) < sizeof(value))
+    {
+        p = end;
+        return 0;
+    }
+    memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+    return value;
+}
+
+/**
+ * \brief Map a signed number onto an unsigned one, small magnitudes first
+ * \param value Signed value
+ */
+inline uint64_t ZigZag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+/**
+ * \brief Undo ZigZag()
+ * \param value Zigzagged value
+ */
+inline int64_t UnZigZag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * \brief FNV-1a hash, used to checksum what goes to disk
+ * \param data Bytes to hash
+ * \param size Number of bytes
+ * \param hash Hash of whatever came before, to checksum in pieces
+ */
+inline uint32_t Checksum(const char *data, size_t size, uint32_t hash = 2166136261u)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * \brief 64-bit FNV-1a hash, for telling contents apart
+ * \param data Bytes to hash
+ * \param size Number of bytes
+ * \param hash Hash of whatever came before, to hash a file in pieces
+ *
+ * Wide enough that two different things hashing the same won't
+ * happen in practice, so it can stand in for comparing them.
+ */
+inline uint64_t ContentHash(const char *data, size_t size, uint64_t hash = 14695981039346656037ull)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+#endif
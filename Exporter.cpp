@@ -0,0 +1,1085 @@
+/**
+ * \file Exporter.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <memory>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include "Encoding.h"
+#include "Exporter.h"
+#include "PlaylistFile.h"
+
+/// First bytes of every cache index, the last four being the version
+static const char INDEX_HEADER[8] = {'M', 'M', 'E', 'X', 1, 0, 0, 0};
+
+/// Frames decoded and encoded at a time
+static const size_t TRANSCODE_BLOCK_FRAMES = 4096;
+
+/// Bytes read at a time when hashing or copying a file
+static const size_t FILE_CHUNK_BYTES = 1 << 20;
+
+/// Kinds of record in a cache index
+enum Record : char
+{
+    RECORD_SOURCE = 'S',    ///< A filepath, its size and modification time, then its hash
+    RECORD_OUTPUT = 'O',    ///< A source hash and settings hash, then the transcode's size and hash
+    RECORD_TARGET = 'T',    ///< A path in a directory, a playlist that has it, then what was written there
+    RECORD_REMOVED = 'R'    ///< A path in a directory, and a playlist that no longer has it
+};
+
+/// Codecs tracks can be transcoded to
+static const struct
+{
+    const char *name;       ///< What it's called in SetFormat() and export.codec
+    const char *ffmpeg;     ///< What ffmpeg calls its encoder, or "" if it's written here
+    const char *extension;  ///< Extension its files get
+    bool lossless;          ///< Whether the bitrate means nothing to it
+} CODECS[] = {
+    {"wav", "", ".wav", true},
+    {"mp3", "libmp3lame", ".mp3", false},
+    {"aac", "aac", ".m4a", false},
+    {"opus", "libopus", ".opus", false},
+    {"vorbis", "libvorbis", ".ogg", false},
+    {"flac", "flac", ".flac", true}
+};
+
+/**
+ * \brief A queue between two stages that holds at most so many items
+ *
+ * Push() waits while it's full and Pop() while it's empty, so a stage
+ * that gets ahead waits for the next rather than piling up work.
+ */
+template <typename T>
+class CBoundedQueue
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CBoundedQueue() = delete;
+
+    /**
+     * \brief Constructor
+     * \param capacity Most items it holds at once
+     */
+    explicit CBoundedQueue(size_t capacity) : mCapacity(std::max<size_t>(capacity, 1)) {}
+
+    /** \brief Copy constructor (disabled)
+     * \param queue Queue to construct this based on */
+    CBoundedQueue(const CBoundedQueue &queue) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param queue Queue whose attributes will override those of the current queue */
+    CBoundedQueue& operator=(const CBoundedQueue &queue) = delete;
+
+    /**
+     * \brief Add an item, waiting for room
+     * \param item The item
+     */
+    void Push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        mNotFull.wait(lock, [&]() { return mItems.size() < mCapacity; });
+        mItems.push_back(std::move(item));
+        mNotEmpty.notify_one();
+    }
+
+    /**
+     * \brief Take the oldest item, waiting for one
+     * \param item Filled in with the item
+     * \returns false once the queue is closed and empty
+     */
+    bool Pop(T &item)
+    {
+        std::unique_lock<std::mutex> lock(mLock);
+        mNotEmpty.wait(lock, [&]() { return !mItems.empty() || mClosed; });
+        if (mItems.empty())
+        {
+            return false;
+        }
+        item = std::move(mItems.front());
+        mItems.pop_front();
+        mNotFull.notify_one();
+        return true;
+    }
+
+    /**
+     * \brief Say nothing more is coming, so Pop() returns false once the items run out
+     */
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mClosed = true;
+        mNotEmpty.notify_all();
+    }
+
+private:
+    size_t mCapacity;                       ///< Most items held at once
+    std::deque<T> mItems;                   ///< The items, oldest first
+    bool mClosed = false;                   ///< Whether Close() has been called
+    std::mutex mLock;                       ///< Guards the rest
+    std::condition_variable mNotFull;       ///< Signalled when an item's taken
+    std::condition_variable mNotEmpty;      ///< Signalled when an item's added, or on Close()
+};
+
+/**
+ * \brief Returns a file's modification time in nanoseconds
+ * \param info What stat() said about it
+ */
+static int64_t Modified(const struct stat &info)
+{
+    return (int64_t)info.st_mtim.tv_sec * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+/**
+ * \brief Hash a file's contents
+ * \param path Where the file is
+ * \param hash Filled in with the hash
+ * \param size Filled in with how many bytes it has
+ * \returns -1 if it can't be read
+ */
+static int HashFile(const std::string &path, uint64_t &hash, uint64_t &size)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    std::string buffer(FILE_CHUNK_BYTES, '\0');
+    hash = ContentHash(nullptr, 0);
+    size = 0;
+    ssize_t n;
+    while ((n = read(fd, &buffer[0], buffer.size())) != 0)
+    {
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0)
+        {
+            close(fd);
+            return -1;
+        }
+        hash = ContentHash(buffer.data(), n, hash);
+        size += n;
+    }
+
+    close(fd);
+    return 0;
+}
+
+/**
+ * \brief Put a file somewhere else, replacing whatever's there in one step
+ * \param from Where the file is
+ * \param to Where it goes
+ * \returns -1 if it can't be copied
+ *
+ * A hard link if both are on one filesystem, else a copy. Either way it
+ * goes in beside the destination first and is renamed over it, so the
+ * destination is never half written.
+ */
+static int CopyFile(const std::string &from, const std::string &to)
+{
+    std::string part = to + ".part";
+    unlink(part.c_str());
+
+    if (link(from.c_str(), part.c_str()) != 0)
+    {
+        int in = open(from.c_str(), O_RDONLY | O_CLOEXEC);
+        int out = open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        bool ok = in >= 0 && out >= 0;
+
+        std::string buffer(FILE_CHUNK_BYTES, '\0');
+        ssize_t n;
+        while (ok && (n = read(in, &buffer[0], buffer.size())) != 0)
+        {
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            ok = n > 0 && write(out, buffer.data(), n) == n;
+        }
+
+        if (in >= 0)
+        {
+            close(in);
+        }
+        ok = out >= 0 && close(out) == 0 && ok;
+        if (!ok)
+        {
+            unlink(part.c_str());
+            return -1;
+        }
+    }
+
+    if (rename(part.c_str(), to.c_str()) != 0)
+    {
+        unlink(part.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Make a directory and any it's in that aren't there yet
+ * \param path The directory
+ * \returns -1 if it can't be made
+ */
+static int MakeDirectories(const std::string &path)
+{
+    for (size_t slash = path.find('/', 1); ; slash = path.find('/', slash + 1))
+    {
+        std::string prefix = path.substr(0, slash);
+        if (!prefix.empty() && mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST)
+        {
+            return -1;
+        }
+        if (slash == std::string::npos)
+        {
+            break;
+        }
+    }
+
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode) ? 0 : -1;
+}
+
+/**
+ * \brief Make a name safe for any filesystem a player might use
+ * \param name The name
+ * \returns The name with anything FAT won't take turned into underscores
+ */
+static std::string SafeName(const std::string &name)
+{
+    std::string safe;
+    for (char c : name)
+    {
+        safe += (unsigned char)c < 0x20 || strchr("/\\:*?\"<>|", c) ? '_' : c;
+    }
+    if (safe.empty() || safe[0] == '.')
+    {
+        safe.insert(0, "_");
+    }
+    return safe;
+}
+
+/**
+ * \brief Work out where a track goes in a directory
+ * \param filepath The track's filepath
+ * \param extension Extension its transcode gets
+ * \param taken Names already given out, in lower case; the name given is added
+ * \returns album/title.ext, album being the last directory in the filepath,
+ *          with a number after the title if that's taken
+ *
+ * Names are compared ignoring case, as FAT does.
+ */
+static std::string TargetName(const std::string &filepath, const std::string &extension,
+                              std::set<std::string> &taken)
+{
+    size_t slash = filepath.rfind('/');
+    std::string title = filepath.substr(slash == std::string::npos ? 0 : slash + 1);
+    size_t dot = title.rfind('.');
+    if (dot != std::string::npos && dot > 0)
+    {
+        title.resize(dot);
+    }
+
+    std::string album;
+    if (slash != std::string::npos && slash > 0)
+    {
+        size_t before = filepath.rfind('/', slash - 1);
+        album = SafeName(filepath.substr(before == std::string::npos ? 0 : before + 1,
+                                         slash - (before == std::string::npos ? 0 : before + 1))) + "/";
+    }
+
+    std::string name = album + SafeName(title) + extension;
+    for (int n = 2; ; ++n)
+    {
+        std::string lower = name;
+        std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return tolower(c); });
+        if (taken.insert(lower).second)
+        {
+            return name;
+        }
+        name = album + SafeName(title) + " (" + std::to_string(n) + ")" + extension;
+    }
+}
+
+/**
+ * \brief Add a hash to a record
+ * \param out String to append to
+ * \param hash The hash
+ */
+static void PutHash(std::string &out, uint64_t hash)
+{
+    out.append((const char *)&hash, 8);
+}
+
+/**
+ * \brief Read a hash out of a record
+ * \param p Where to read from; advanced past the hash
+ * \param end End of the buffer
+ * \returns The hash, or 0 if the buffer ran out (which also sets p to end)
+ */
+static uint64_t GetHash(const char *&p, const char *end)
+{
+    uint64_t hash = 0;
+    if (end - p < 8)
+    {
+        p = end;
+        return 0;
+    }
+    memcpy(&hash, p, 8);
+    p += 8;
+    return hash;
+}
+
+/**
+ * \brief Add a record of something written into a directory
+ * \param out String to append to
+ * \param path Where it was written
+ * \param playlist Title of a playlist that has it
+ * \param source Hash of the source it was made from
+ * \param settings Hash of the codec and bitrate it was made with
+ * \param size Bytes it has
+ * \param modified Its modification time, in nanoseconds
+ */
+static void PutTarget(std::string &out, const std::string &path, const std::string &playlist, uint64_t source,
+                      uint64_t settings, uint64_t size, int64_t modified)
+{
+    out.push_back(RECORD_TARGET);
+    PutString(out, path);
+    PutString(out, playlist);
+    PutHash(out, source);
+    PutHash(out, settings);
+    PutVarint(out, size);
+    PutVarint(out, ZigZag(modified));
+}
+
+/**
+ * \brief Constructor
+ *
+ * Transcodes to 192kbps MP3, a thread per core, decoding with
+ * CAnalyzer::DefaultDecoder() and encoding with DefaultEncoder(), and
+ * keeps the transcodes in DefaultCache().
+ */
+CExporter::CExporter()
+{
+    mDecoders = CAnalyzer::DefaultDecoder;
+    mEncoders = DefaultEncoder;
+    mCodec = "mp3";
+    mBitrate = 192;
+    mThreads = 0;
+    mStop = false;
+    mSettings = 0;
+    mIndexFd = -1;
+    mIndexRecords = 0;
+}
+
+/**
+ * \brief Destructor
+ */
+CExporter::~CExporter()
+{
+    CloseIndex();
+}
+
+/**
+ * \brief Bring a directory in line with a playlist
+ * \param title Title of the playlist; names the M3U8 file, and which files are the playlist's
+ * \param filepaths The playlist's tracks, in order
+ * \param directory Where they go, made if it isn't there
+ * \param summary Filled in with what was done, if given
+ * \returns Number of tracks in the directory for the playlist, or -1 if the
+ *          codec is unknown, or the directory or cache can't be used
+ *
+ * A track that appears more than once is only written once. Tracks
+ * that can't be transcoded are left out of the M3U8; if an earlier sync
+ * put them there, the old file stays.
+ */
+int CExporter::Sync(const std::string &title, const std::vector<std::string> &filepaths,
+                    const std::string &directory, Summary *summary)
+{
+    mExtension = ExtensionOf(mCodec);
+    std::string root = directory;
+    while (root.size() > 1 && root.back() == '/')
+    {
+        root.pop_back();
+    }
+    if (mExtension.empty() || root.empty() || MakeDirectories(root) != 0)
+    {
+        return -1;
+    }
+
+    mCache = mCacheDirectory.empty() ? DefaultCache() : mCacheDirectory;
+    if (MakeDirectories(mCache) != 0 || OpenIndex() != 0)
+    {
+        return -1;
+    }
+
+    mStop = false;
+    mTitle = title;
+    bool lossless = mExtension == ".wav" || mExtension == ".flac";
+    std::string settings = mCodec + "/" + std::to_string(lossless ? 0 : mBitrate);
+    mSettings = ContentHash(settings.data(), settings.size());
+
+    // Names are given out in playlist order before anything starts, so they don't depend on timing
+    std::vector<Job> jobs;
+    std::vector<size_t> entries;
+    std::unordered_map<std::string, size_t> seen;
+    std::set<std::string> taken;
+    std::vector<std::string> names;
+    for (const std::string &filepath : filepaths)
+    {
+        auto found = seen.emplace(filepath, jobs.size());
+        if (found.second)
+        {
+            Job job;
+            job.index = jobs.size();
+            job.source = filepath;
+            names.push_back(TargetName(filepath, mExtension, taken));
+            job.target = root + "/" + names.back();
+            jobs.push_back(job);
+        }
+        entries.push_back(found.first->second);
+    }
+
+    std::vector<char> done(jobs.size(), 0);
+    std::atomic<size_t> transcoded(0), copied(0), skipped(0), failed(0);
+
+    unsigned threads = mThreads ? mThreads : std::max(1u, std::thread::hardware_concurrency());
+    CBoundedQueue<Job> transcodes(threads * 2);
+    CBoundedQueue<Job> writes(threads * 2);
+
+    std::vector<std::thread> transcoders;
+    for (unsigned t = 0; t < threads; ++t)
+    {
+        transcoders.emplace_back([&]()
+        {
+            Job job;
+            while (transcodes.Pop(job))
+            {
+                if (Transcode(job) == 0)
+                {
+                    writes.Push(job);
+                }
+                else
+                {
+                    ++failed;
+                }
+            }
+        });
+    }
+
+    std::thread writer([&]()
+    {
+        Job job;
+        while (writes.Pop(job))
+        {
+            if (Write(job) == 0)
+            {
+                done[job.index] = 1;
+                ++(job.transcoded ? transcoded : copied);
+            }
+            else
+            {
+                ++failed;
+            }
+        }
+    });
+
+    for (size_t i = 0; i < jobs.size() && !mStop; ++i)
+    {
+        switch (Read(jobs[i]))
+        {
+        case STAGE_FAILED:
+            ++failed;
+            break;
+        case STAGE_SKIPPED:
+            done[i] = 1;
+            ++skipped;
+            break;
+        case STAGE_TRANSCODE:
+            transcodes.Push(jobs[i]);
+            break;
+        case STAGE_WRITE:
+            writes.Push(jobs[i]);
+            break;
+        }
+    }
+
+    transcodes.Close();
+    for (std::thread &transcoder : transcoders)
+    {
+        transcoder.join();
+    }
+    writes.Close();
+    writer.join();
+
+    Summary result;
+    result.transcoded = transcoded;
+    result.copied = copied;
+    result.skipped = skipped;
+    result.failed = failed;
+
+    if (!mStop)
+    {
+        // Take out what this playlist put here before and doesn't have now
+        std::set<std::string> wanted;
+        for (const Job &job : jobs)
+        {
+            wanted.insert(job.target);
+        }
+
+        std::string records;
+        std::vector<std::string> gone;
+        {
+            std::lock_guard<std::mutex> lock(mLock);
+            std::string prefix = root + "/";
+            for (auto target = mTargets.lower_bound(prefix);
+                 target != mTargets.end() && target->first.compare(0, prefix.size(), prefix) == 0; ++target)
+            {
+                if (target->second.playlists.count(mTitle) && !wanted.count(target->first))
+                {
+                    records.push_back(RECORD_REMOVED);
+                    PutString(records, target->first);
+                    PutString(records, mTitle);
+                    if (target->second.playlists.size() == 1)
+                    {
+                        gone.push_back(target->first);
+                    }
+                }
+            }
+            Record(records);
+        }
+
+        for (const std::string &path : gone)
+        {
+            if (unlink(path.c_str()) == 0 || errno == ENOENT)
+            {
+                ++result.removed;
+            }
+            // The album's directory goes too, if that was the last of it
+            rmdir(path.substr(0, path.rfind('/')).c_str());
+        }
+
+        std::vector<std::string> listed;
+        for (size_t entry : entries)
+        {
+            if (done[entry])
+            {
+                listed.push_back(names[entry]);
+            }
+        }
+        CPlaylistFile file(root + "/" + SafeName(title.empty() ? "playlist" : title) + ".m3u8");
+        file.Write(title, listed);
+    }
+
+    Compact();
+    CloseIndex();
+
+    if (summary)
+    {
+        *summary = result;
+    }
+    return result.transcoded + result.copied + result.skipped;
+}
+
+/**
+ * \brief Make an encoder for a codec
+ * \param codec wav, mp3, aac, opus, vorbis or flac
+ * \param bitrate Kilobits per second, for the lossy ones
+ * \returns WAV encoder for wav, ffmpeg for the rest if it's installed, or nullptr
+ */
+CEncoder *CExporter::DefaultEncoder(const std::string &codec, int bitrate)
+{
+    for (const auto &known : CODECS)
+    {
+        if (codec != known.name)
+        {
+            continue;
+        }
+        if (!*known.ffmpeg)
+        {
+            return new CWavEncoder();
+        }
+        if (CFfmpegDecoder::IsAvailable())
+        {
+            return new CFfmpegEncoder(known.ffmpeg, known.lossless ? 0 : bitrate);
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * \brief Returns the extension a codec's files get
+ * \param codec wav, mp3, aac, opus, vorbis or flac
+ * \returns The extension, dot and all, or "" for a codec this doesn't know
+ */
+std::string CExporter::ExtensionOf(const std::string &codec)
+{
+    for (const auto &known : CODECS)
+    {
+        if (codec == known.name)
+        {
+            return known.extension;
+        }
+    }
+    return "";
+}
+
+/**
+ * \brief Work out where transcodes are kept unless told otherwise
+ * \returns musicmanager/transcodes in $XDG_CACHE_HOME, or else in ~/.cache,
+ *          or else one in /tmp named for the user
+ */
+std::string CExporter::DefaultCache()
+{
+    const char *cache = getenv("XDG_CACHE_HOME");
+    if (cache && *cache)
+    {
+        return std::string(cache) + "/musicmanager/transcodes";
+    }
+    const char *home = getenv("HOME");
+    if (home && *home)
+    {
+        return std::string(home) + "/.cache/musicmanager/transcodes";
+    }
+    return "/tmp/musicmanager-" + std::to_string(getuid()) + "-transcodes";
+}
+
+/**
+ * \brief Open the cache's index and take in what it knows
+ * \returns -1 if it can't be opened or isn't a cache index
+ */
+int CExporter::OpenIndex()
+{
+    CloseIndex();
+
+    mIndexFd = open((mCache + "/index").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (mIndexFd < 0)
+    {
+        return -1;
+    }
+
+    struct stat info;
+    fstat(mIndexFd, &info);
+    std::string data(info.st_size, '\0');
+    if (pread(mIndexFd, &data[0], data.size(), 0) != (ssize_t)data.size())
+    {
+        CloseIndex();
+        return -1;
+    }
+    if (data.empty())
+    {
+        data.assign(INDEX_HEADER, sizeof(INDEX_HEADER));
+        if (write(mIndexFd, data.data(), data.size()) != (ssize_t)data.size())
+        {
+            CloseIndex();
+            return -1;
+        }
+    }
+    if (data.size() < sizeof(INDEX_HEADER) || memcmp(data.data(), INDEX_HEADER, sizeof(INDEX_HEADER)) != 0)
+    {
+        CloseIndex();
+        return -1;
+    }
+
+    // Replay every whole frame; anything after the first bad one was a torn write
+    size_t offset = sizeof(INDEX_HEADER);
+    while (offset + 8 <= data.size())
+    {
+        uint32_t length, sum;
+        memcpy(&length, &data[offset], 4);
+        memcpy(&sum, &data[offset + 4], 4);
+        if (length > data.size() - offset - 8 || Checksum(&data[offset + 8], length) != sum)
+        {
+            break;
+        }
+
+        Apply(&data[offset + 8], &data[offset + 8] + length);
+        offset += 8 + length;
+    }
+
+    if (offset < data.size() && ftruncate(mIndexFd, offset) != 0)
+    {
+        CloseIndex();
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Close the cache's index, if it's open, and forget what it said
+ */
+void CExporter::CloseIndex()
+{
+    if (mIndexFd >= 0)
+    {
+        close(mIndexFd);
+        mIndexFd = -1;
+    }
+    mIndexRecords = 0;
+    mSources.clear();
+    mOutputs.clear();
+    mTargets.clear();
+}
+
+/**
+ * \brief Take in records, from the index or just written to it
+ * \param p Where the records start
+ * \param end Where they end
+ */
+void CExporter::Apply(const char *p, const char *end)
+{
+    while (p < end)
+    {
+        char record = *p++;
+        ++mIndexRecords;
+
+        if (record == RECORD_SOURCE)
+        {
+            std::string path = GetString(p, end);
+            Source source;
+            source.size = GetVarint(p, end);
+            source.modified = UnZigZag(GetVarint(p, end));
+            source.hash = GetHash(p, end);
+            mSources[path] = source;
+        }
+        else if (record == RECORD_OUTPUT)
+        {
+            uint64_t source = GetHash(p, end);
+            uint64_t settings = GetHash(p, end);
+            Output output;
+            output.size = GetVarint(p, end);
+            output.hash = GetHash(p, end);
+            mOutputs[{source, settings}] = output;
+        }
+        else if (record == RECORD_TARGET)
+        {
+            std::string path = GetString(p, end);
+            std::string playlist = GetString(p, end);
+            Target &target = mTargets[path];
+            target.source = GetHash(p, end);
+            target.settings = GetHash(p, end);
+            target.size = GetVarint(p, end);
+            target.modified = UnZigZag(GetVarint(p, end));
+            target.playlists.insert(playlist);
+        }
+        else if (record == RECORD_REMOVED)
+        {
+            std::string path = GetString(p, end);
+            std::string playlist = GetString(p, end);
+            auto target = mTargets.find(path);
+            if (target != mTargets.end())
+            {
+                target->second.playlists.erase(playlist);
+                if (target->second.playlists.empty())
+                {
+                    mTargets.erase(target);
+                }
+            }
+        }
+        else
+        {
+            return;
+        }
+    }
+}
+
+/**
+ * \brief Append records to the index as one frame, and take them in
+ * \param records The encoded records; nothing happens if there are none
+ *
+ * The caller holds mLock. If the index can't be written the records
+ * still count for this sync; the next one just does more work.
+ */
+void CExporter::Record(const std::string &records)
+{
+    if (records.empty())
+    {
+        return;
+    }
+
+    uint32_t length = records.size();
+    uint32_t sum = Checksum(records.data(), records.size());
+
+    std::string frame(8, '\0');
+    memcpy(&frame[0], &length, 4);
+    memcpy(&frame[4], &sum, 4);
+    frame.append(records);
+
+    if (mIndexFd >= 0 && write(mIndexFd, frame.data(), frame.size()) != (ssize_t)frame.size())
+    {
+        // A torn frame would hide every frame after it
+        close(mIndexFd);
+        mIndexFd = -1;
+    }
+
+    Apply(records.data(), records.data() + records.size());
+}
+
+/**
+ * \brief Rewrite the index with only what it still says, if most of it is out of date
+ *
+ * The new index is written beside the old one and renamed over it.
+ */
+void CExporter::Compact()
+{
+    size_t live = mSources.size() + mOutputs.size();
+    for (const auto &target : mTargets)
+    {
+        live += target.second.playlists.size();
+    }
+    if (mIndexFd < 0 || mIndexRecords <= 2 * live + 1024)
+    {
+        return;
+    }
+
+    std::string records;
+    for (const auto &source : mSources)
+    {
+        records.push_back(RECORD_SOURCE);
+        PutString(records, source.first);
+        PutVarint(records, source.second.size);
+        PutVarint(records, ZigZag(source.second.modified));
+        PutHash(records, source.second.hash);
+    }
+    for (const auto &output : mOutputs)
+    {
+        records.push_back(RECORD_OUTPUT);
+        PutHash(records, output.first.first);
+        PutHash(records, output.first.second);
+        PutVarint(records, output.second.size);
+        PutHash(records, output.second.hash);
+    }
+    for (const auto &target : mTargets)
+    {
+        for (const std::string &playlist : target.second.playlists)
+        {
+            PutTarget(records, target.first, playlist, target.second.source, target.second.settings,
+                      target.second.size, target.second.modified);
+        }
+    }
+
+    uint32_t length = records.size();
+    uint32_t sum = Checksum(records.data(), records.size());
+    std::string data(INDEX_HEADER, sizeof(INDEX_HEADER));
+    data.append((const char *)&length, 4);
+    data.append((const char *)&sum, 4);
+    data.append(records);
+
+    std::string path = mCache + "/index";
+    std::string part = path + ".part";
+    int fd = open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    bool ok = fd >= 0 && write(fd, data.data(), data.size()) == (ssize_t)data.size();
+    ok = fd >= 0 && close(fd) == 0 && ok;
+    if (!ok || rename(part.c_str(), path.c_str()) != 0)
+    {
+        unlink(part.c_str());
+    }
+}
+
+/**
+ * \brief Hash a track and decide what it needs
+ * \param job The track; its hash is filled in
+ * \returns What happens to it next
+ *
+ * A file in the directory is taken to be right without reading it if
+ * it's what the index says was written there, from this source with
+ * these settings, and its size and modification time haven't changed.
+ * Otherwise it's hashed and compared with the transcode in the cache.
+ */
+CExporter::Stage CExporter::Read(Job &job)
+{
+    struct stat info;
+    if (stat(job.source.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+    {
+        return STAGE_FAILED;
+    }
+
+    bool known = false;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto source = mSources.find(job.source);
+        if (source != mSources.end() && source->second.size == (uint64_t)info.st_size &&
+            source->second.modified == Modified(info))
+        {
+            job.hash = source->second.hash;
+            known = true;
+        }
+    }
+
+    if (!known)
+    {
+        uint64_t size;
+        if (HashFile(job.source, job.hash, size) != 0)
+        {
+            return STAGE_FAILED;
+        }
+
+        std::string records;
+        records.push_back(RECORD_SOURCE);
+        PutString(records, job.source);
+        PutVarint(records, info.st_size);
+        PutVarint(records, ZigZag(Modified(info)));
+        PutHash(records, job.hash);
+
+        std::lock_guard<std::mutex> lock(mLock);
+        Record(records);
+    }
+
+    struct stat there;
+    bool exists = stat(job.target.c_str(), &there) == 0 && S_ISREG(there.st_mode);
+
+    Output output = {0, 0};
+    bool cached = false;
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        auto target = mTargets.find(job.target);
+        if (exists && target != mTargets.end() && target->second.source == job.hash &&
+            target->second.settings == mSettings && target->second.size == (uint64_t)there.st_size &&
+            target->second.modified == Modified(there))
+        {
+            if (!target->second.playlists.count(mTitle))
+            {
+                std::string records;
+                PutTarget(records, job.target, mTitle, job.hash, mSettings, there.st_size, Modified(there));
+                Record(records);
+            }
+            return STAGE_SKIPPED;
+        }
+
+        auto found = mOutputs.find({job.hash, mSettings});
+        if (found != mOutputs.end())
+        {
+            output = found->second;
+            cached = true;
+        }
+    }
+
+    struct stat kept;
+    if (!cached || stat(CachePath(job.hash).c_str(), &kept) != 0 || (uint64_t)kept.st_size != output.size)
+    {
+        return STAGE_TRANSCODE;
+    }
+
+    uint64_t hash, size;
+    if (exists && (uint64_t)there.st_size == output.size && HashFile(job.target, hash, size) == 0 &&
+        hash == output.hash)
+    {
+        std::string records;
+        PutTarget(records, job.target, mTitle, job.hash, mSettings, there.st_size, Modified(there));
+
+        std::lock_guard<std::mutex> lock(mLock);
+        Record(records);
+        return STAGE_SKIPPED;
+    }
+
+    return STAGE_WRITE;
+}
+
+/**
+ * \brief Decode a track and encode it into the cache
+ * \param job The track
+ * \returns -1 if it can't be decoded or encoded, or Stop() was called
+ *
+ * It's encoded beside where it goes in the cache and renamed into
+ * place, so a transcode in the cache is always whole.
+ */
+int CExporter::Transcode(Job &job)
+{
+    std::unique_ptr<CDecoder> decoder(mDecoders(job.source));
+    std::unique_ptr<CEncoder> encoder(mEncoders(mCodec, mBitrate));
+    if (!decoder || !encoder || decoder->Open(job.source) != 0)
+    {
+        return -1;
+    }
+
+    std::string part = CachePath(job.hash, job.index + 1);
+    if (encoder->Open(part, decoder->GetRate(), decoder->GetChannels()) != 0)
+    {
+        unlink(part.c_str());
+        return -1;
+    }
+
+    std::vector<float> block(TRANSCODE_BLOCK_FRAMES * decoder->GetChannels());
+    bool ok = true;
+    size_t frames, total = 0;
+    while (ok && !mStop && (frames = decoder->Read(block.data(), TRANSCODE_BLOCK_FRAMES)) > 0)
+    {
+        ok = encoder->Write(block.data(), frames) == 0;
+        total += frames;
+    }
+    ok = encoder->Close() == 0 && ok && !mStop && total > 0;
+
+    Output output;
+    std::string path = CachePath(job.hash);
+    if (!ok || HashFile(part, output.hash, output.size) != 0 || rename(part.c_str(), path.c_str()) != 0)
+    {
+        unlink(part.c_str());
+        return -1;
+    }
+
+    std::string records;
+    records.push_back(RECORD_OUTPUT);
+    PutHash(records, job.hash);
+    PutHash(records, mSettings);
+    PutVarint(records, output.size);
+    PutHash(records, output.hash);
+
+    std::lock_guard<std::mutex> lock(mLock);
+    Record(records);
+    job.transcoded = true;
+    return 0;
+}
+
+/**
+ * \brief Put a track's transcode into the directory
+ * \param job The track, with its transcode in the cache
+ * \returns -1 if it can't be written
+ */
+int CExporter::Write(const Job &job)
+{
+    struct stat info;
+    if (MakeDirectories(job.target.substr(0, job.target.rfind('/'))) != 0 ||
+        CopyFile(CachePath(job.hash), job.target) != 0 || stat(job.target.c_str(), &info) != 0)
+    {
+        return -1;
+    }
+
+    std::string records;
+    PutTarget(records, job.target, mTitle, job.hash, mSettings, info.st_size, Modified(info));
+
+    std::lock_guard<std::mutex> lock(mLock);
+    Record(records);
+    return 0;
+}
+
+/**
+ * \brief Returns where a track's transcode is kept
+ * \param source Hash of the track's contents
+ * \param part 0 for the finished transcode, or a number unique to whoever's encoding it
+ *
+ * Two tracks with the same contents can be encoded at once, so each
+ * encodes to its own part. The extension comes last either way, so
+ * ffmpeg can pick the container from it.
+ */
+std::string CExporter::CachePath(uint64_t source, size_t part)
+{
+    char name[48];
+    snprintf(name, sizeof(name), "%016llx-%016llx", (unsigned long long)source, (unsigned long long)mSettings);
+    return mCache + "/" + name + (part ? ".part" + std::to_string(part) : "") + mExtension;
+}
@@ -0,0 +1,220 @@
+/**
+ * \file Exporter.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Exporter class
+ */
+
+#ifndef EXPORTER_H
+#define EXPORTER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "Analyzer.h"
+#include "Encoder.h"
+
+/**
+ * \brief Copies a playlist into a directory, say a phone or player, transcoding as it goes
+ *
+ * Each track goes through four stages, with a bounded queue between
+ * each and the next, so none gets more than a few tracks ahead:
+ *  - read: one thread stats each source and hashes its contents, then
+ *    decides whether the track is already in the directory, already
+ *    transcoded in the cache, or has to be transcoded
+ *  - decode and encode: a thread per core runs a CDecoder into a
+ *    CEncoder a block at a time. For ffmpeg these are a process each,
+ *    with the socket between them as the queue, so both are busy at once
+ *  - write: one thread copies finished transcodes into the directory,
+ *    where writes are best kept in order
+ *
+ * Transcodes are kept in a cache directory, named for the hash of the
+ * source's contents and of the codec and bitrate, so a track that's
+ * moved, renamed, or on another playlist isn't transcoded again. The
+ * cache's index also remembers each source's hash by its size and
+ * modification time, so unchanged files aren't read again, and what
+ * was written to each file in a directory, so those aren't either. A
+ * file in the directory that's the same as its transcode, whatever its
+ * modification time, is left alone. Only tracks whose sources have
+ * changed get transcoded again.
+ *
+ * The index is a log like CArtworkStore's, a frame at a time, each with
+ * a length and a checksum; a torn frame at the end is dropped when it's
+ * opened. The cache can be deleted at any time, at the price of
+ * transcoding again.
+ *
+ * Tracks go in the directory as album/title.ext, album being the
+ * directory the source is in, next to an M3U8 playlist named for the
+ * playlist. Files that a playlist put there on an earlier sync and no
+ * longer has are taken out, unless another playlist synced to the same
+ * directory still has them.
+ */
+class CExporter
+{
+public:
+
+    /// Makes an encoder for a codec and bitrate, or returns nullptr if nothing here can write it
+    typedef std::function<CEncoder *(const std::string &codec, int bitrate)> EncoderFactory;
+
+    /// What a sync did
+    struct Summary
+    {
+        size_t transcoded = 0;  ///< Tracks decoded and encoded again
+        size_t copied = 0;      ///< Tracks copied out of the cache without transcoding
+        size_t skipped = 0;     ///< Tracks already in the directory as they should be
+        size_t removed = 0;     ///< Files from earlier syncs taken out
+        size_t failed = 0;      ///< Tracks that couldn't be read, decoded or written
+    };
+
+    CExporter();
+
+    /** \brief Copy constructor (disabled)
+     * \param exporter Exporter to construct this based on */
+    CExporter(const CExporter &exporter) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param exporter Exporter whose attributes will override those of the current exporter */
+    CExporter& operator=(const CExporter &exporter) = delete;
+
+    ~CExporter();
+
+    /**
+     * \brief Choose how files are decoded
+     * \param decoders Makes a decoder for each file
+     */
+    void SetDecoders(CAnalyzer::DecoderFactory decoders) { mDecoders = decoders; }
+
+    /**
+     * \brief Choose how files are encoded
+     * \param encoders Makes an encoder for the codec
+     */
+    void SetEncoders(EncoderFactory encoders) { mEncoders = encoders; }
+
+    /**
+     * \brief Choose what tracks are transcoded to
+     * \param codec wav, mp3, aac, opus, vorbis or flac
+     * \param bitrate Kilobits per second, for the lossy ones
+     */
+    void SetFormat(const std::string &codec, int bitrate) { mCodec = codec; mBitrate = bitrate; }
+
+    /**
+     * \brief Choose how many tracks to transcode at once
+     * \param threads Number of threads, or 0 for one per core
+     */
+    void SetThreads(unsigned threads) { mThreads = threads; }
+
+    /**
+     * \brief Choose where transcodes are kept between syncs
+     * \param directory The cache directory, or empty for DefaultCache()
+     */
+    void SetCache(const std::string &directory) { mCacheDirectory = directory; }
+
+    int Sync(const std::string &title, const std::vector<std::string> &filepaths,
+             const std::string &directory, Summary *summary = nullptr);
+
+    /**
+     * \brief Stop a Sync() after the tracks it's in the middle of
+     *
+     * Safe to call from another thread.
+     */
+    void Stop() { mStop = true; }
+
+    static CEncoder *DefaultEncoder(const std::string &codec, int bitrate);
+
+    static std::string ExtensionOf(const std::string &codec);
+
+    static std::string DefaultCache();
+
+private:
+    /// What happens to a track once it's been read
+    enum Stage
+    {
+        STAGE_FAILED,           ///< Nothing; it couldn't be read
+        STAGE_SKIPPED,          ///< Nothing; it's in the directory already
+        STAGE_TRANSCODE,        ///< It's transcoded, then written
+        STAGE_WRITE             ///< It's written straight from the cache
+    };
+
+    /// A track going through the pipeline
+    struct Job
+    {
+        size_t index = 0;           ///< Where it is in the playlist
+        std::string source;         ///< Filepath of the track
+        std::string target;         ///< Where it goes in the directory
+        uint64_t hash = 0;          ///< Hash of the source's contents
+        bool transcoded = false;    ///< Whether it was transcoded on the way
+    };
+
+    /// A source's hash, as of its size and modification time
+    struct Source
+    {
+        uint64_t size;          ///< Bytes
+        int64_t modified;       ///< Modification time, in nanoseconds
+        uint64_t hash;          ///< Hash of its contents
+    };
+
+    /// A transcode in the cache
+    struct Output
+    {
+        uint64_t size;          ///< Bytes
+        uint64_t hash;          ///< Hash of its contents
+    };
+
+    /// A file written into a directory
+    struct Target
+    {
+        uint64_t source;        ///< Hash of the source it was made from
+        uint64_t settings;      ///< Hash of the codec and bitrate it was made with
+        uint64_t size;          ///< Bytes, when it was written
+        int64_t modified;       ///< Modification time when it was written, in nanoseconds
+        std::set<std::string> playlists;    ///< Titles of the playlists that have it
+    };
+
+    int OpenIndex();
+    void CloseIndex();
+    void Apply(const char *p, const char *end);
+    void Record(const std::string &records);
+    void Compact();
+
+    Stage Read(Job &job);
+    int Transcode(Job &job);
+    int Write(const Job &job);
+
+    std::string CachePath(uint64_t source, size_t part = 0);
+
+    CAnalyzer::DecoderFactory mDecoders;    ///< Makes a decoder for each file
+    EncoderFactory mEncoders;               ///< Makes the encoders
+    std::string mCodec;                     ///< What tracks are transcoded to
+    int mBitrate;                           ///< Kilobits per second
+    unsigned mThreads;                      ///< Tracks to transcode at once, or 0 for one per core
+    std::string mCacheDirectory;            ///< Where transcodes are kept, or empty for DefaultCache()
+    std::atomic<bool> mStop;                ///< Whether Stop() has been called
+
+    std::string mCache;                     ///< The cache directory in use during a Sync()
+    std::string mExtension;                 ///< Extension of what's being synced, e.g. ".mp3"
+    std::string mTitle;                     ///< Title of the playlist being synced
+    uint64_t mSettings;                     ///< Hash of the codec and bitrate being synced with
+
+    /// Guards the index and what's read from it, while the stages are under way
+    std::mutex mLock;
+
+    int mIndexFd;                           ///< File descriptor of the cache's index, or -1
+    size_t mIndexRecords;                   ///< Records in the index, live or not
+
+    /// Sources' hashes, by filepath
+    std::unordered_map<std::string, Source> mSources;
+
+    /// Transcodes in the cache, by source hash and settings hash
+    std::map<std::pair<uint64_t, uint64_t>, Output> mOutputs;
+
+    /// Files written into directories, by path
+    std::map<std::string, Target> mTargets;
+};
+
+#endif
@@ -0,0 +1,124 @@
+/**
+ * \file Fft.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cmath>
+#include "Fft.h"
+
+/**
+ * \brief Constructor
+ * \param size Samples per frame; a power of two, at least 4
+ */
+CFft::CFft(size_t size)
+{
+    mSize = size;
+    mHalf = size / 2;
+
+    mWindow.resize(mSize);
+    for (size_t i = 0; i < mSize; ++i)
+    {
+        mWindow[i] = 0.5 - 0.5 * cos(2 * M_PI * i / mSize);
+    }
+
+    int bits = 0;
+    while (((size_t)1 << bits) < mHalf)
+    {
+        ++bits;
+    }
+    mReversed.resize(mHalf);
+    for (size_t i = 0; i < mHalf; ++i)
+    {
+        size_t reversed = 0;
+        for (int b = 0; b < bits; ++b)
+        {
+            reversed |= ((i >> b) & 1) << (bits - 1 - b);
+        }
+        mReversed[i] = reversed;
+    }
+
+    // Stage with half-width h uses h twiddles, starting at offset h - 1
+    for (size_t h = 1; h < mHalf; h *= 2)
+    {
+        for (size_t j = 0; j < h; ++j)
+        {
+            mCos.push_back(cos(M_PI * j / h));
+            mSin.push_back(-sin(M_PI * j / h));
+        }
+    }
+
+    mUnpackCos.resize(mHalf + 1);
+    mUnpackSin.resize(mHalf + 1);
+    for (size_t k = 0; k <= mHalf; ++k)
+    {
+        mUnpackCos[k] = cos(2 * M_PI * k / mSize);
+        mUnpackSin[k] = -sin(2 * M_PI * k / mSize);
+    }
+
+    mRe.resize(mHalf);
+    mIm.resize(mHalf);
+}
+
+/**
+ * \brief Work out the power spectrum of one frame
+ * \param frame mSize samples; a Hann window is applied here
+ * \param power Filled in with mSize / 2 + 1 values, from DC to Nyquist
+ */
+void CFft::Power(const float *frame, float *power)
+{
+    // Even samples go in the real parts and odd ones in the imaginary parts
+    for (size_t i = 0; i < mHalf; ++i)
+    {
+        size_t to = mReversed[i];
+        mRe[to] = frame[2 * i] * mWindow[2 * i];
+        mIm[to] = frame[2 * i + 1] * mWindow[2 * i + 1];
+    }
+
+    Transform();
+
+    // Pull the spectra of the evens and odds apart and put them back together
+    for (size_t k = 0; k <= mHalf; ++k)
+    {
+        size_t a = k % mHalf;
+        size_t b = (mHalf - k) % mHalf;
+        float evenRe = 0.5f * (mRe[a] + mRe[b]);
+        float evenIm = 0.5f * (mIm[a] - mIm[b]);
+        float oddRe = 0.5f * (mIm[a] + mIm[b]);
+        float oddIm = -0.5f * (mRe[a] - mRe[b]);
+
+        float re = evenRe + mUnpackCos[k] * oddRe - mUnpackSin[k] * oddIm;
+        float im = evenIm + mUnpackCos[k] * oddIm + mUnpackSin[k] * oddRe;
+        power[k] = re * re + im * im;
+    }
+}
+
+/**
+ * \brief Transform mRe and mIm in place, already in bit-reversed order
+ */
+void CFft::Transform()
+{
+    float *re = mRe.data();
+    float *im = mIm.data();
+
+    for (size_t h = 1; h < mHalf; h *= 2)
+    {
+        const float *wr = &mCos[h - 1];
+        const float *wi = &mSin[h - 1];
+        for (size_t start = 0; start < mHalf; start += 2 * h)
+        {
+            float *ar = re + start;
+            float *ai = im + start;
+            float *br = re + start + h;
+            float *bi = im + start + h;
+            for (size_t j = 0; j < h; ++j)
+            {
+                float tr = br[j] * wr[j] - bi[j] * wi[j];
+                float ti = br[j] * wi[j] + bi[j] * wr[j];
+                br[j] = ar[j] - tr;
+                bi[j] = ai[j] - ti;
+                ar[j] += tr;
+                ai[j] += ti;
+            }
+        }
+    }
+}
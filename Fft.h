@@ -0,0 +1,67 @@
+/**
+ * \file Fft.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Fft class
+ */
+
+#ifndef FFT_H
+#define FFT_H
+
+#include <cstddef>
+#include <vector>
+
+/**
+ * \brief Works out the power spectrum of fixed-size frames of audio
+ *
+ * A real frame of N samples is packed into N/2 complex values and put
+ * through an iterative radix-2 FFT, then unpacked. Real and imaginary
+ * parts are kept in separate arrays and every stage has its own
+ * contiguous twiddle table, so each butterfly loop is a straight run
+ * over floats that the compiler vectorizes. Everything is allocated up
+ * front; one of these per thread, reused for every frame.
+ */
+class CFft
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CFft() = delete;
+
+    CFft(size_t size);
+
+    /** \brief Copy constructor (disabled)
+     * \param fft Fft to construct this based on */
+    CFft(const CFft &fft) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param fft Fft whose attributes will override those of the current fft */
+    CFft& operator=(const CFft &fft) = delete;
+
+    /** \brief Destructor */
+    ~CFft() {}
+
+    /**
+     * \brief Returns the number of samples in a frame
+     * \returns The frame size, a power of two
+     */
+    size_t GetSize() { return mSize; }
+
+    void Power(const float *frame, float *power);
+
+private:
+    void Transform();
+
+    size_t mSize;                   ///< Samples per frame
+    size_t mHalf;                   ///< Size of the complex transform, mSize / 2
+
+    std::vector<float> mWindow;     ///< Hann window, mSize long
+    std::vector<size_t> mReversed;  ///< Bit-reversed index of each complex value
+    std::vector<float> mCos;        ///< Every stage's twiddles, real parts, stage by stage
+    std::vector<float> mSin;        ///< Every stage's twiddles, imaginary parts
+    std::vector<float> mUnpackCos;  ///< Twiddles for unpacking the real spectrum, real parts
+    std::vector<float> mUnpackSin;  ///< Twiddles for unpacking the real spectrum, imaginary parts
+    std::vector<float> mRe;         ///< Working values, real parts
+    std::vector<float> mIm;         ///< Working values, imaginary parts
+};
+
+#endif
@@ -0,0 +1,110 @@
+/**
+ * \file Histogram.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cstring>
+#include "Histogram.h"
+
+/**
+ * \brief Constructor for an empty histogram
+ */
+CHistogram::CHistogram()
+{
+    Clear();
+}
+
+/**
+ * \brief Forget everything recorded
+ */
+void CHistogram::Clear()
+{
+    memset(mCounts, 0, sizeof(mCounts));
+    mCount = 0;
+    mSum = 0;
+    mMax = 0;
+}
+
+/**
+ * \brief Work out which bucket a value goes in
+ * \param value The value
+ * \returns Index of the bucket
+ */
+int CHistogram::BucketOf(uint64_t value)
+{
+    if (value < EXACT)
+    {
+        return value;
+    }
+
+    // The top bit picks the power of two, the next four the bucket within it
+    int top = 63 - __builtin_clzll(value);
+    int sub = (value >> (top - 4)) & (SUB_BUCKETS - 1);
+    return EXACT + (top - 5) * SUB_BUCKETS + sub;
+}
+
+/**
+ * \brief Work out the largest value a bucket holds
+ * \param bucket Index of the bucket
+ * \returns The value
+ */
+uint64_t CHistogram::ValueOf(int bucket)
+{
+    if (bucket < EXACT)
+    {
+        return bucket;
+    }
+
+    int top = (bucket - EXACT) / SUB_BUCKETS + 5;
+    uint64_t sub = (bucket - EXACT) % SUB_BUCKETS;
+    uint64_t low = (1ull << top) | (sub << (top - 4));
+    return low + (1ull << (top - 4)) - 1;
+}
+
+/**
+ * \brief Count a value
+ * \param value The value
+ */
+void CHistogram::Record(uint64_t value)
+{
+    ++mCounts[BucketOf(value)];
+    ++mCount;
+    mSum += value;
+    if (value > mMax)
+    {
+        mMax = value;
+    }
+}
+
+/**
+ * \brief Find the value a given share of the recorded values are at or below
+ * \param percentile Which percentile, 0-100
+ * \returns The value, to within 1/16 of it, or 0 if nothing has been recorded
+ */
+uint64_t CHistogram::GetPercentile(double percentile) const
+{
+    if (mCount == 0)
+    {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(percentile / 100 * mCount + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    uint64_t seen = 0;
+    for (int i = 0; i < BUCKETS; ++i)
+    {
+        seen += mCounts[i];
+        if (seen >= rank)
+        {
+            // Never report past what was actually recorded
+            uint64_t value = ValueOf(i);
+            return value < mMax ? value : mMax;
+        }
+    }
+
+    return mMax;
+}
@@ -0,0 +1,69 @@
+/**
+ * \file Histogram.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Histogram class
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstdint>
+
+/**
+ * \brief Counts values into log-linear buckets, HDR histogram style
+ *
+ * Values under 32 get a bucket each. Above that every power of two is
+ * split into 16 buckets, so any value is reported to within 1/16 of
+ * itself, across the whole 64-bit range, in a fixed 8KB of counters.
+ * Recording is a couple of shifts and an increment.
+ */
+class CHistogram
+{
+public:
+
+    CHistogram();
+
+    void Record(uint64_t value);
+
+    void Clear();
+
+    /**
+     * \brief Returns how many values have been recorded
+     * \returns The count
+     */
+    uint64_t GetCount() const { return mCount; }
+
+    /**
+     * \brief Returns the largest value recorded
+     * \returns The value, or 0 if nothing has been recorded
+     */
+    uint64_t GetMax() const { return mMax; }
+
+    /**
+     * \brief Returns the mean of the values recorded
+     * \returns The mean, or 0 if nothing has been recorded
+     */
+    double GetMean() const { return mCount ? (double)mSum / mCount : 0; }
+
+    uint64_t GetPercentile(double percentile) const;
+
+private:
+    /// Number of buckets that hold exactly one value
+    static const int EXACT = 32;
+
+    /// Number of buckets each power of two above EXACT is split into
+    static const int SUB_BUCKETS = 16;
+
+    /// Total number of buckets
+    static const int BUCKETS = EXACT + (64 - 5) * SUB_BUCKETS;
+
+    static int BucketOf(uint64_t value);
+    static uint64_t ValueOf(int bucket);
+
+    uint64_t mCounts[BUCKETS];  ///< How many values landed in each bucket
+    uint64_t mCount;            ///< How many values have been recorded
+    uint64_t mSum;              ///< Sum of the values recorded
+    uint64_t mMax;              ///< Largest value recorded
+};
+
+#endif
@@ -3,107 +3,159 @@
  * \author Matt Hammerly
  */
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
 #include <string>
-#include <iostream>
+#include "Analyzer.h"
 #include "Library.h"
+#include "LocalStorage.h"
+#include "PlaylistFile.h"
+#include "PostgresStorage.h"
+#include "ReplicatedStorage.h"
+#include "ShardedStorage.h"
+#include "Snapshot.h"
+#include "Tags.h"
+
+/// Tracks whose tags are read between saves
+static const size_t TAG_CHUNK = 256;
+
+/**
+ * \brief Make the storage a config points at
+ * \param config Settings to use
+ * \returns Postgres or local storage, or sharded storage made of several if storage.shards is set
+ *
+ * db.replicas puts a Postgres library's reads on its standbys. Shards
+ * each have their own primary, so it's ignored for them.
+ */
+static CStorage *MakeStorage(const CConfig &config)
+{
+    std::string local = config.Get("storage.local");
+    std::string shards = config.Get("storage.shards");
+    std::string replicas = config.Get("db.replicas");
+    if (shards.empty() && !local.empty())
+    {
+        return new CLocalStorage(local);
+    }
+    if (shards.empty() && replicas.empty())
+    {
+        return new CPostgresStorage(config);
+    }
+    if (shards.empty())
+    {
+        std::vector<CStorage *> standbys;
+        size_t start = 0;
+        while (start < replicas.size())
+        {
+            size_t end = std::min(replicas.find(';', start), replicas.size());
+            CConfig standby = config;
+            standby.Set("db.conninfo", replicas.substr(start, end - start));
+            standbys.push_back(new CPostgresStorage(standby));
+            start = end + 1;
+        }
+        return new CReplicatedStorage(new CPostgresStorage(config), standbys);
+    }
+
+    // "root=where;root=where", where is a connection string or a library file
+    std::vector<CShardedStorage::Shard> parts;
+    size_t start = 0;
+    while (start <= shards.size())
+    {
+        size_t end = std::min(shards.find(';', start), shards.size());
+        std::string part = shards.substr(start, end - start);
+        size_t equals = part.find('=');
+        if (equals != std::string::npos)
+        {
+            std::string where = part.substr(equals + 1);
+            CConfig shard = config;
+            shard.Set("db.conninfo", where);
+            parts.push_back({part.substr(0, equals), local.empty() ? (CStorage *)new CPostgresStorage(shard)
+                                                                   : (CStorage *)new CLocalStorage(where)});
+        }
+        start = end + 1;
+    }
+
+    CStorage *catalog = local.empty() ? (CStorage *)new CPostgresStorage(config) : (CStorage *)new CLocalStorage(local);
+    return new CShardedStorage(catalog, parts);
+}
 
 /**
  * \brief Default constructor
  *
- * Todo: sanitize the db credentials I guess lol
+ * Uses the settings a program starts with; see CConfig::Startup()
+ */
+CLibrary::CLibrary() : CLibrary(CConfig::Startup())
+{
+}
+
+/**
+ * \brief Constructor for the library a config points at
+ * \param config Settings to use; storage.local picks a library file over Postgres,
+ *               and storage.shards spreads tracks over several
+ *
+ * Check GetStatus() for whether the database could be reached.
  */
-CLibrary::CLibrary()
+CLibrary::CLibrary(const CConfig &config) : CLibrary(MakeStorage(config), config)
 {
-    char connectionString[512];
-    snprintf(connectionString, 512, "dbname=%s host=%s user=%s password=%s",
-             DBNAME, DBHOST, DBUSER, DBPW);
+}
 
-    mConnection = PQconnectdb(connectionString);
+/**
+ * \brief Constructor for a library kept somewhere else
+ * \param storage Storage to keep the library in; the library takes ownership
+ * \param config Settings to tune the library with; its storage settings are ignored
+ */
+CLibrary::CLibrary(CStorage *storage, const CConfig &config)
+{
+    mStorage = storage;
+    mStorage->SetStats(&mStats);
+    mConfig = config;
+    mHistoryBatch = std::max(1L, config.GetInt("history.batch"));
+    mPlaylistCache.SetBudget(std::max(0L, config.GetInt("cache.playlist_bytes")));
 
-    if (PQstatus(mConnection) == CONNECTION_BAD)
+    if (!config.Get("artwork.path").empty())
     {
-        std::cout << "Failed to connect to the database" << std::endl;
-        exit(0);
+        std::vector<int> sizes;
+        std::string list = config.Get("artwork.sizes");
+        for (size_t start = 0; start < list.size(); )
+        {
+            size_t end = std::min(list.find(',', start), list.size());
+            int size = atoi(list.substr(start, end - start).c_str());
+            if (size > 0)
+            {
+                sizes.push_back(size);
+            }
+            start = end + 1;
+        }
+        mArtwork.SetSizes(sizes);
+        mArtwork.Open(config.Get("artwork.path"));
     }
 }
 
 /**
  * \brief Destructor
  *
- * Will close the database connection before exiting
+ * Writes out any listening history still buffered, then closes the
+ * storage (and so the database connection) before exiting
  */
 CLibrary::~CLibrary()
 {
-    PQfinish(mConnection);
+    FlushHistory();
+    delete mStorage;
 }
 
 /**
  * \brief Create the database tables for this application
  *
  * \returns -1 if something goes wrong
- *
- * Todo: Write database schema in this comment
- *       `create trigger IF NOT EXISTS` or similar
  */
 int CLibrary::PrepareDatabase()
 {
-    PGresult *res;
-    res = PQexec(mConnection,
-            "CREATE TABLE IF NOT EXISTS tracks (\
-                id SERIAL NOT NULL PRIMARY KEY,\
-                filepath TEXT NOT NULL,\
-                date_added TIMESTAMPTZ NOT NULL DEFAULT NOW()\
-          )");
-    PQclear(res);
-
-    res = PQexec(mConnection,
-            "CREATE TABLE IF NOT EXISTS playlists (\
-                id SERIAL NOT NULL PRIMARY KEY,\
-                title TEXT NOT NULL,\
-                length INTEGER NOT NULL DEFAULT 0\
-          )");
-    PQclear(res);
-
-    res = PQexec(mConnection,
-            "CREATE TABLE IF NOT EXISTS tracks_playlists (\
-                id SERIAL NOT NULL PRIMARY KEY,\
-                track_id INTEGER NOT NULL,\
-                playlist_id INTEGER NOT NULL,\
-                position FLOAT NOT NULL\
-          )");
-    PQclear(res);
-
-    // Create a function to adjust the length of a playlist
-    res = PQexec(mConnection,
-            "CREATE OR REPLACE FUNCTION tracks_playlists_insert_func() RETURNS TRIGGER\
-            LANGUAGE plpgsql\
-            AS $tracks_playlists_insert_func$\
-            DECLARE\
-                pid INTEGER;\
-            BEGIN\
-                pid=0;\
-                IF (TG_OP = 'INSERT') THEN pid = NEW.playlist_id;\
-                ELSIF (TG_OP = 'DELETE') THEN pid = OLD.playlist_id;\
-                END IF;\
-                WITH Sub AS (SELECT COUNT(id) AS c FROM tracks_playlists WHERE playlist_id = pid)\
-                    UPDATE playlists AS Main SET length = Sub.c FROM Sub WHERE Main.id = pid AND 1=1;\
-                RETURN NULL;\
-            END;\
-            $tracks_playlists_insert_func$;");
-    PQclear(res);
-
-    // Create a trigger to adjust the length of a playlist on each insert or delete
-    res = PQexec(mConnection,
-            "CREATE TRIGGER tracks_playlists_insert_trg\
-            AFTER INSERT OR DELETE ON tracks_playlists\
-            FOR EACH ROW EXECUTE PROCEDURE tracks_playlists_insert_func();");
-    PQclear(res);
-
-    // Create a default playlist for all songs to be added to
-    res = PQexec(mConnection, "INSERT INTO playlists (title) VALUES ('library')");
-    PQclear(res);
+    CStats::Scope scope(&mStats, "Library::PrepareDatabase");
 
-    return 0;
+    mPlaylistCache.Clear();
+
+    return mStorage->PrepareDatabase();
 }
 
 /**
@@ -113,23 +165,14 @@ int CLibrary::PrepareDatabase()
  */
 int CLibrary::DestroyDatabase()
 {
-    PGresult *res;
-    res = PQexec(mConnection, "DROP TRIGGER IF EXISTS tracks_playlists_insert_trg ON tracks_playlists;");
-    PQclear(res);
-
-    res = PQexec(mConnection, "DROP FUNCTION IF EXISTS tracks_playlists_insert_func() CASCADE;");
-    PQclear(res);
-
-    res = PQexec(mConnection, "DROP TABLE IF EXISTS tracks;");
-    PQclear(res);
+    CStats::Scope scope(&mStats, "Library::DestroyDatabase");
 
-    res = PQexec(mConnection, "DROP TABLE IF EXISTS playlists;");
-    PQclear(res);
+    // There's nothing left for buffered history to belong to
+    mHistory.clear();
+    mRecommender.Clear();
+    mPlaylistCache.Clear();
 
-    res = PQexec(mConnection, "DROP TABLE IF EXISTS tracks_playlists;");
-    PQclear(res);
-
-    return 0;
+    return mStorage->DestroyDatabase();
 }
 
 /**
@@ -140,7 +183,7 @@ int CLibrary::DestroyDatabase()
  */
 ConnStatusType CLibrary::GetStatus()
 {
-    return PQstatus(mConnection);
+    return mStorage->GetStatus();
 }
 
 /**
@@ -148,10 +191,11 @@ ConnStatusType CLibrary::GetStatus()
  *
  * It makes tests easier. Might make this protected and
  * require a testing subclass to use this later, whatever.
+ * This is nullptr if the library isn't kept in Postgres.
  */
 PGconn* CLibrary::GetConnection()
 {
-    return mConnection;
+    return mStorage->GetConnection();
 }
 
 /**
@@ -163,28 +207,29 @@ PGconn* CLibrary::GetConnection()
  */
 std::string CLibrary::AddTrack(std::string filepath)
 {
-    std::string query = "INSERT INTO tracks (filepath) VALUES (";
+    CStats::Scope scope(&mStats, "Library::AddTrack");
 
-    // Safety first
-    char *escaped_filepath = PQescapeLiteral(mConnection, filepath.c_str(), filepath.length());
-    query.append(escaped_filepath);
-    PQfreemem(escaped_filepath);
-
-    query.append(") RETURNING id");
-
-    PGresult *res = PQexec(mConnection, query.c_str());
-    char *id = PQgetvalue(res, 0, 0);
-
-    // Create an std::string to return so we can appropriately free the PGresult
-    std::string std_id(id);
-    PQclear(res);
+    return mReactor.Run(AddTrackAsync(filepath));
+}
 
-    // Add this track to the all-library playlist created on database setup
-    std::string query2 = "INSERT INTO tracks_playlists (track_id, playlist_id, position) SELECT " + std_id + ", 1, COALESCE(MAX(position), 0) + 1 FROM tracks_playlists RETURNING id";
-    res = PQexec(mConnection, query2.c_str());
-    PQclear(res);
+/**
+ * \brief Add a track to the database, without blocking on it
+ * \param filepath The filepath of the file to be added
+ * \returns Task yielding the ID of the new track, or "" if it couldn't be added
+ *
+ * The library playlist is dropped from the cache once the track is in,
+ * so a page of it read while the track was going in isn't kept.
+ */
+CTask<std::string> CLibrary::AddTrackAsync(std::string filepath)
+{
+    std::string id = co_await mStorage->AddTrackAsync(&mReactor, filepath);
+    mPlaylistCache.Invalidate("1");
 
-    return std_id;
+    if (!id.empty())
+    {
+        AddArtwork(filepath);
+    }
+    co_return id;
 }
 
 /**
@@ -194,23 +239,19 @@ std::string CLibrary::AddTrack(std::string filepath)
  */
 std::string CLibrary::AddPlaylist(std::string title)
 {
-    std::string query = "INSERT INTO playlists (title) VALUES (";
-
-    // Safety first
-    char *escaped_title = PQescapeLiteral(mConnection, title.c_str(), title.length());
-    query.append(escaped_title);
-    PQfreemem(escaped_title);
-
-    query.append(") RETURNING id");
-
-    PGresult *res = PQexec(mConnection, query.c_str());
-    char *id = PQgetvalue(res, 0, 0);
+    CStats::Scope scope(&mStats, "Library::AddPlaylist");
 
-    // Create an std::string to return so we can appropriately free the PGresult
-    std::string std_id(id);
-    PQclear(res);
+    return mReactor.Run(AddPlaylistAsync(title));
+}
 
-    return std_id;
+/**
+ * \brief Add a playlist to the database, without blocking on it
+ * \param title The title of the playlist to be added
+ * \returns Task yielding the ID of the new playlist, or "" if it couldn't be added
+ */
+CTask<std::string> CLibrary::AddPlaylistAsync(std::string title)
+{
+    return mStorage->AddPlaylistAsync(&mReactor, title);
 }
 
 /**
@@ -220,33 +261,12 @@ std::string CLibrary::AddPlaylist(std::string title)
  */
 std::string CLibrary::RemoveTrack(std::string id)
 {
-    std::string query = "DELETE FROM tracks WHERE id=";
-
-    char escaped_id[30];
-    PQescapeStringConn(mConnection, escaped_id, id.c_str(), 30, 0);
-    query.append(escaped_id);
-    query.append("; DELETE FROM tracks_playlists WHERE track_id=");
-    query.append(escaped_id);
-
-    PGresult *res = PQexec(mConnection, query.c_str());
-    PQclear(res);
-
-    // We need to now normalize every playlist
-    // Ideally we'll only normalize those playlists the track was actually in
-    // but I'll do that some other day
-    res = PQexec(mConnection, "SELECT id FROM playlists");
-    int n = PQntuples(res);
-    for (int i = 0; i < n; ++i)
-    {
-        char *id = PQgetvalue(res, i, 0);
+    CStats::Scope scope(&mStats, "Library::RemoveTrack");
 
-        std::string normalize_query = "WITH Sub AS (SELECT id, row_number() OVER (ORDER BY position) FROM tracks_playlists WHERE playlist_id=";
-        normalize_query.append(id);
-        normalize_query.append(") UPDATE tracks_playlists AS Main SET position = Sub.row_number FROM Sub WHERE Main.id = Sub.id");
-
-        PQclear(PQexec(mConnection, normalize_query.c_str()));
-    }
-    PQclear(res);
+    mStorage->RemoveTrack(id);
+    mRecommender.RemoveTrack(id);
+    // It could have been in any of them
+    mPlaylistCache.Clear();
 
     return id;
 }
@@ -258,16 +278,561 @@ std::string CLibrary::RemoveTrack(std::string id)
  */
 std::string CLibrary::RemovePlaylist(std::string id)
 {
-    std::string query = "DELETE FROM playlists WHERE id=";
+    CStats::Scope scope(&mStats, "Library::RemovePlaylist");
 
-    char escaped_id[30];
-    PQescapeStringConn(mConnection, escaped_id, id.c_str(), 30, 0);
-    query.append(escaped_id);
-    query.append("; DELETE FROM tracks_playlists WHERE playlist_id=");
-    query.append(escaped_id);
+    // Only worth reading if there are recommendations to keep up to date
+    if (mRecommender.IsBuilt())
+    {
+        std::string title, length;
+        std::vector<std::string> tracks;
+        if (LoadPlaylist(id, title, length, tracks))
+        {
+            mRecommender.Removing(id, tracks, 0, tracks.size());
+        }
+    }
 
-    PGresult *res = PQexec(mConnection, query.c_str());
-    PQclear(res);
+    mPlaylistCache.Invalidate(id);
+    mStorage->RemovePlaylist(id);
 
     return id;
 }
+
+/**
+ * \brief Read a playlist, from memory if it was read recently
+ * \param id ID of the playlist
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track IDs, in order
+ * \returns false if there is no such playlist
+ *
+ * What's read from the storage is kept for next time, within the
+ * cache's budget. See CPlaylistCache.
+ */
+bool CLibrary::LoadPlaylist(std::string id, std::string &title, std::string &length, std::vector<std::string> &tracks)
+{
+    CStats::Scope scope(&mStats, "Library::LoadPlaylist");
+
+    if (mPlaylistCache.Get(id, title, length, tracks))
+    {
+        return true;
+    }
+
+    uint64_t version = mPlaylistCache.GetVersion(id);
+    if (!mStorage->LoadPlaylist(id, title, length, tracks))
+    {
+        return false;
+    }
+    mPlaylistCache.Put(id, version, title, length, tracks);
+
+    return true;
+}
+
+/**
+ * \brief Read one page of a playlist, from memory if it was read recently
+ * \param id ID of the playlist
+ * \param page Number of the page, from 0; a page is CPlaylistCache::PAGE_TRACKS tracks
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track IDs on the page, in order; empty past the end
+ * \returns false if there is no such playlist
+ *
+ * For showing a window onto a playlist too long to want all of.
+ */
+bool CLibrary::LoadPlaylistPage(std::string id, size_t page, std::string &title, std::string &length,
+                                std::vector<std::string> &tracks)
+{
+    CStats::Scope scope(&mStats, "Library::LoadPlaylistPage");
+
+    CStorage::PlaylistRange range = mReactor.Run(LoadPlaylistPageAsync(id, page));
+    title.swap(range.title);
+    length.swap(range.length);
+    tracks.swap(range.tracks);
+    return range.found;
+}
+
+/**
+ * \brief Read one page of a playlist, from memory if it was read recently, without blocking on it
+ * \param id ID of the playlist
+ * \param page Number of the page, from 0; a page is CPlaylistCache::PAGE_TRACKS tracks
+ * \returns Task yielding the title, length and the track IDs on the page; not found if there's no such playlist
+ *
+ * A page that changed while it was being read isn't kept in the cache.
+ */
+CTask<CStorage::PlaylistRange> CLibrary::LoadPlaylistPageAsync(std::string id, size_t page)
+{
+    CStorage::PlaylistRange range;
+    if (mPlaylistCache.GetPage(id, page, range.title, range.length, range.tracks))
+    {
+        range.found = true;
+        co_return range;
+    }
+
+    uint64_t version = mPlaylistCache.GetVersion(id);
+    size_t pageTracks = CPlaylistCache::PAGE_TRACKS;
+    range = co_await mStorage->LoadPlaylistRangeAsync(&mReactor, id, page * pageTracks + 1, pageTracks);
+    if (range.found)
+    {
+        mPlaylistCache.PutPage(id, version, page, range.title, range.length, range.tracks);
+    }
+
+    co_return range;
+}
+
+/**
+ * \brief Read every track in the library as it's needed, ordered by id
+ * \returns The tracks, for range-for
+ *
+ * Memory use stays flat however big the library is. Nothing else may
+ * use the library until the stream is finished or destroyed.
+ */
+CStream<CStorage::TrackRecord> CLibrary::StreamTracks()
+{
+    CStats::Scope scope(&mStats, "Library::StreamTracks");
+
+    return CStream<CStorage::TrackRecord>(mStorage->StreamTracks());
+}
+
+/**
+ * \brief Read a playlist's tracks as they're needed, in order
+ * \param id ID of the playlist
+ * \returns Positions, track ids and filepaths, for range-for; empty if there's no such playlist
+ *
+ * Unlike making a CPlaylist, which holds every track, memory use stays
+ * flat however long the playlist is, and the first track comes back
+ * without waiting for the rest. Nothing else may use the library until
+ * the stream is finished or destroyed.
+ */
+CStream<CStorage::EntryRecord> CLibrary::StreamPlaylist(std::string id)
+{
+    CStats::Scope scope(&mStats, "Library::StreamPlaylist");
+
+    return CStream<CStorage::EntryRecord>(mStorage->StreamPlaylist(id));
+}
+
+/**
+ * \brief Write a playlist out as an M3U/M3U8, PLS or XSPF file, streaming its tracks
+ * \param id ID of the playlist
+ * \param path Where to write it; the extension picks the format
+ * \returns Number of tracks written, or -1 if something goes wrong
+ *
+ * Takes the same memory for the million-track library playlist as for
+ * a short one. See CPlaylist::Export() for a playlist already loaded.
+ */
+int CLibrary::ExportPlaylist(std::string id, std::string path)
+{
+    CStats::Scope scope(&mStats, "Library::ExportPlaylist");
+
+    std::string title, length;
+    std::vector<std::string> none;
+    if (!mStorage->LoadPlaylistRange(id, 1, 0, title, length, none))
+    {
+        return -1;
+    }
+
+    CStream<CStorage::EntryRecord> entries = StreamPlaylist(id);
+    CStorage::EntryRecord entry;
+
+    CPlaylistFile file(path);
+    return file.Write(title, [&](std::string &filepath)
+    {
+        if (!entries.Next(entry))
+        {
+            return false;
+        }
+        filepath.swap(entry.filepath);
+        return true;
+    });
+}
+
+/**
+ * \brief Write the whole library out to a snapshot file
+ * \param path Where to write the snapshot
+ * \returns -1 if something goes wrong
+ *
+ * See CSnapshot for the format.
+ */
+int CLibrary::Export(std::string path)
+{
+    CStats::Scope scope(&mStats, "Library::Export");
+
+    CSnapshot snapshot(path);
+    return snapshot.Write(mStorage);
+}
+
+/**
+ * \brief Replace the whole library with one from a snapshot file
+ * \param path Where the snapshot is
+ * \returns -1 if something goes wrong
+ *
+ * Tracks and playlists keep the ids they were exported with.
+ * Playlist objects made before the import are out of date afterwards.
+ * Recommendations, if built, are built again from the new library.
+ */
+int CLibrary::Import(std::string path)
+{
+    CStats::Scope scope(&mStats, "Library::Import");
+
+    CSnapshot snapshot(path);
+    snapshot.SetBatch(std::max(1L, mConfig.GetInt("snapshot.restore_batch")));
+    int result = snapshot.Read(mStorage);
+    mPlaylistCache.Clear();
+
+    if (mRecommender.IsBuilt())
+    {
+        mRecommender.Build(mStorage);
+    }
+
+    return result;
+}
+
+/**
+ * \brief Rewrite the filepath of every track under one directory, e.g. once the music has moved to another disk
+ * \param oldPrefix Directory the tracks are under now
+ * \param newPrefix Directory they're under now instead
+ * \returns Number of tracks moved, or -1 if something goes wrong
+ *
+ * Both are taken as whole directories, so "/music" doesn't take in
+ * "/musical/". Tracks keep their ids, so playlists, history and
+ * features are untouched. Album art is kept by directory, so it has to
+ * be collected again for the tracks that moved (see CollectArtwork()).
+ */
+long CLibrary::RelocateRoot(std::string oldPrefix, std::string newPrefix)
+{
+    CStats::Scope scope(&mStats, "Library::RelocateRoot");
+
+    if (oldPrefix.empty())
+    {
+        return -1;
+    }
+    for (std::string *prefix : {&oldPrefix, &newPrefix})
+    {
+        if (!prefix->empty() && prefix->back() != '/')
+        {
+            prefix->push_back('/');
+        }
+    }
+
+    return oldPrefix == newPrefix ? 0 : mStorage->RelocateRoot(oldPrefix, newPrefix);
+}
+
+/**
+ * \brief Note that something happened to a track while it was playing
+ * \param track ID of the track
+ * \param event What happened
+ * \param time When it happened, in seconds since the epoch, or 0 for now
+ *
+ * Events are buffered and written out together once there are enough
+ * of them (see SetHistoryBatch()), by FlushHistory(), or when the
+ * library is destroyed.
+ */
+void CLibrary::RecordPlay(std::string track, CStorage::PlayEvent event, long long time)
+{
+    char *end = nullptr;
+    long id = strtol(track.c_str(), &end, 10);
+    if (track.empty() || *end != '\0' || id < 1)
+    {
+        return;
+    }
+
+    mHistory.push_back({id, event, time ? time : (long long)::time(nullptr)});
+    mRecommender.Played(mHistory.back());
+
+    if (mHistory.size() >= mHistoryBatch)
+    {
+        FlushHistory();
+    }
+}
+
+/**
+ * \brief Write out any buffered listening history
+ * \returns -1 if something goes wrong, in which case it stays buffered for next time
+ */
+int CLibrary::FlushHistory()
+{
+    if (mHistory.empty())
+    {
+        return 0;
+    }
+
+    CStats::Scope scope(&mStats, "Library::FlushHistory");
+
+    if (mStorage->AppendHistory(mHistory) != 0)
+    {
+        return -1;
+    }
+    mHistory.clear();
+    return 0;
+}
+
+/**
+ * \brief Choose how many events to buffer before writing them out
+ * \param events Number of events; 1 writes each one straight away
+ */
+void CLibrary::SetHistoryBatch(size_t events)
+{
+    mHistoryBatch = events ? events : 1;
+
+    if (mHistory.size() >= mHistoryBatch)
+    {
+        FlushHistory();
+    }
+}
+
+/**
+ * \brief Read a track's listening stats
+ * \param track ID of the track
+ * \returns Play count, skips, completions and when it was last played
+ */
+CStorage::TrackStats CLibrary::GetTrackStats(std::string track)
+{
+    return GetTrackStats(std::vector<std::string>({track})).front();
+}
+
+/**
+ * \brief Read several tracks' listening stats at once
+ * \param tracks IDs of the tracks
+ * \returns Stats in the same order; all zero for tracks never played
+ *
+ * Buffered history is written out first, so the numbers are current.
+ * Each track's stats are kept up to date as history is written, so
+ * this costs the same however long the history is.
+ */
+std::vector<CStorage::TrackStats> CLibrary::GetTrackStats(const std::vector<std::string> &tracks)
+{
+    CStats::Scope scope(&mStats, "Library::GetTrackStats");
+
+    FlushHistory();
+
+    return mStorage->GetTrackStats(tracks);
+}
+
+/**
+ * \brief Read the tags of every track whose tags haven't been read yet
+ * \returns Number of tracks read, or -1 if the storage isn't usable
+ *
+ * Only tags and headers are read, never the audio. Each chunk is saved
+ * before the next is read, so an interrupted run carries on where it
+ * left off. The "tag" job does the same in the background (see CScheduler).
+ */
+int CLibrary::CollectTags()
+{
+    CStats::Scope scope(&mStats, "Library::CollectTags");
+
+    if (GetStatus() != CONNECTION_OK)
+    {
+        return -1;
+    }
+
+    int read = 0;
+    long after = 0;
+    for (;;)
+    {
+        std::vector<CStorage::TrackRecord> tracks = mStorage->FindUntagged(after, TAG_CHUNK);
+        if (tracks.empty())
+        {
+            break;
+        }
+        mStorage->SaveTags(CTags::ReadTracks(tracks));
+        after = tracks.back().id;
+        read += tracks.size();
+    }
+    return read;
+}
+
+/**
+ * \brief List a page of the library by artist, album or genre
+ * \param level What to list: artists, an artist's albums (or all of them), an album's tracks, or genres
+ * \param parent The artist or album to list under, for albums and tracks
+ * \param after The last row of the page before, or a default row for the first page
+ * \param limit Most rows to return
+ * \returns The rows, in order, with how many tracks each has and how long they are
+ *
+ * The counts and lengths are kept as tracks are tagged and removed,
+ * and each page starts where the last one ended, so a column browser
+ * opens as fast on a huge library as on a small one. Tracks only show
+ * up once their tags have been read; see CollectTags().
+ */
+std::vector<CStorage::BrowseEntry> CLibrary::Browse(CStorage::BrowseLevel level, long parent,
+                                                    const CStorage::BrowseEntry &after, size_t limit)
+{
+    CStats::Scope scope(&mStats, "Library::Browse");
+
+    if (limit == 0)
+    {
+        return {};
+    }
+    return mStorage->Browse(level, parent, after, limit);
+}
+
+/**
+ * \brief Keep the art of every album in the library that hasn't had it kept yet
+ * \returns Number of albums looked at, or -1 if there's nowhere to keep art
+ *
+ * For libraries imported before artwork.path was set. Only the first
+ * track of each album is read.
+ */
+int CLibrary::CollectArtwork()
+{
+    CStats::Scope scope(&mStats, "Library::CollectArtwork");
+
+    if (!mArtwork.IsOpen())
+    {
+        return -1;
+    }
+
+    // Read the filepaths first, since the stream holds the storage
+    std::vector<std::string> firsts;
+    std::unordered_set<std::string> albums;
+    for (const CStorage::TrackRecord &track : StreamTracks())
+    {
+        std::string album = CArtwork::AlbumOf(track.filepath);
+        if (!mArtwork.Has(album) && albums.insert(album).second)
+        {
+            firsts.push_back(track.filepath);
+        }
+    }
+
+    for (const std::string &filepath : firsts)
+    {
+        AddArtwork(filepath);
+    }
+    return firsts.size();
+}
+
+/**
+ * \brief Look up the thumbnail of a track's album art
+ * \param filepath The track's filepath
+ * \param size Width and height wanted, in pixels; one of artwork.sizes
+ * \returns size * size * 3 bytes of RGB, row by row, or nullptr if there's none
+ *
+ * Straight from memory, with no database or file to go to, so it's
+ * cheap enough to call for every row drawn. See CArtworkStore.
+ */
+const unsigned char *CLibrary::GetThumbnail(const std::string &filepath, int size)
+{
+    return mArtwork.Find(CArtwork::AlbumOf(filepath), size);
+}
+
+/**
+ * \brief Keep the art of a track's album, if it hasn't been kept already
+ * \param filepath The track's filepath
+ *
+ * The album's other tracks are never read once one has been, art or
+ * no art.
+ */
+void CLibrary::AddArtwork(const std::string &filepath)
+{
+    std::string album = CArtwork::AlbumOf(filepath);
+    if (!mArtwork.IsOpen() || mArtwork.Has(album) || mArtworkTried.count(album))
+    {
+        return;
+    }
+
+    CStats::Scope scope(&mStats, "Library::AddArtwork");
+
+    std::string image;
+    CArtwork::Extract(filepath, image);
+    if (mArtwork.Add(album, image) != 0)
+    {
+        mArtworkTried.insert(album);
+    }
+}
+
+/**
+ * \brief Listen to every track that hasn't been listened to yet
+ * \param threads How many tracks to analyse at once, or 0 for analyzer.threads
+ * \returns Number of tracks analysed, or -1 if something goes wrong
+ *
+ * This can take a while on a big library, but it's saved as it goes
+ * and picks up where it left off. See CAnalyzer.
+ */
+int CLibrary::AnalyzeTracks(unsigned threads)
+{
+    CStats::Scope scope(&mStats, "Library::AnalyzeTracks");
+
+    CAnalyzer analyzer;
+    analyzer.SetThreads(threads ? threads : std::max(0L, mConfig.GetInt("analyzer.threads")));
+    analyzer.SetChunk(std::max(0L, mConfig.GetInt("analyzer.chunk")));
+    return analyzer.Run(mStorage);
+}
+
+/**
+ * \brief Read what listening to tracks found
+ * \param tracks IDs of the tracks
+ * \returns Findings in the same order; track is 0 for tracks not analysed yet
+ */
+std::vector<CStorage::TrackFeatures> CLibrary::GetFeatures(const std::vector<std::string> &tracks)
+{
+    CStats::Scope scope(&mStats, "Library::GetFeatures");
+
+    return mStorage->GetFeatures(tracks);
+}
+
+/**
+ * \brief Start suggesting tracks, from the playlists and listening history so far
+ * \returns -1 if something goes wrong
+ *
+ * From here on the library keeps the recommendations up to date as
+ * playlists are edited and tracks played, so this only needs calling
+ * once. See CRecommender.
+ */
+int CLibrary::BuildRecommendations()
+{
+    CStats::Scope scope(&mStats, "Library::BuildRecommendations");
+
+    FlushHistory();
+
+    return mRecommender.Build(mStorage);
+}
+
+/**
+ * \brief Suggest tracks that go with some others
+ * \param tracks IDs of the tracks, e.g. a playlist's
+ * \param count How many to suggest, at most
+ * \returns IDs of the suggestions, best first, or none before BuildRecommendations()
+ */
+std::vector<std::string> CLibrary::Recommend(const std::vector<std::string> &tracks, size_t count)
+{
+    CStats::Scope scope(&mStats, "Library::Recommend");
+
+    return mRecommender.Recommend(tracks, count);
+}
+
+/**
+ * \brief Take a snapshot of what this library has done and what it cost
+ * \returns Counters and latencies for each operation since the last ResetStats()
+ */
+CStats::Snapshot CLibrary::Stats()
+{
+    return mStats.GetSnapshot();
+}
+
+/**
+ * \brief Write a snapshot of the stats out in a readable table
+ * \param path File to append to, or empty for stderr
+ * \returns -1 if the file can't be written
+ */
+int CLibrary::DumpStats(std::string path)
+{
+    FILE *file = path.empty() ? stderr : fopen(path.c_str(), "a");
+    if (!file)
+    {
+        return -1;
+    }
+
+    CStats::Dump(mStats.GetSnapshot(), file);
+
+    if (file != stderr)
+    {
+        return fclose(file) == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Forget the stats collected so far
+ */
+void CLibrary::ResetStats()
+{
+    mStats.Reset();
+}
@@ -7,8 +7,18 @@
 #ifndef LIBRARY_H
 #define LIBRARY_H
 
+#include <string>
+#include <unordered_set>
+#include <vector>
 #include <postgresql/libpq-fe.h>
-#include "config.h"
+#include "Artwork.h"
+#include "Config.h"
+#include "PlaylistCache.h"
+#include "Reactor.h"
+#include "Recommender.h"
+#include "Stats.h"
+#include "Storage.h"
+#include "Stream.h"
 
 /**
  * \brief This class will talk to postgres so you don't have to
@@ -16,12 +26,27 @@
  * This class will handle the plumbing in managing the library
  * so there isn't hideous handwritten sql and old c library
  * use dirtying up the rest of our codebase.
+ *
+ * The library itself lives in a CStorage: Postgres by default,
+ * or a local file (see CLocalStorage) if one is handed in or
+ * configured. Batch sizes, cache budgets and thread counts come from
+ * a CConfig.
+ *
+ * The calls ending in Async return a CTask to co_await instead of
+ * blocking, so a UI or the daemon can have many under way at once from
+ * one thread; they wait in the library's reactor (see GetReactor()),
+ * which has to be turned for them to get anywhere. Their blocking
+ * namesakes just Run() them there. The Async calls themselves overlap,
+ * so they aren't counted as operations in the stats, though their
+ * statements are.
  */
 class CLibrary
 {
 public:
 
     CLibrary();
+    CLibrary(const CConfig &config);
+    CLibrary(CStorage *storage, const CConfig &config = CConfig());
     ~CLibrary();
 
     /** \brief Copy constructor (disabled)
@@ -39,6 +64,12 @@ public:
 
     PGconn* GetConnection();
 
+    /**
+     * \brief Returns the storage this library lives in
+     * \returns Pointer to storage object
+     */
+    CStorage *GetStorage() { return mStorage; }
+
     std::string AddTrack(std::string filepath);
 
     std::string AddPlaylist(std::string title);
@@ -47,8 +78,118 @@ public:
 
     std::string RemovePlaylist(std::string id);
 
+    bool LoadPlaylist(std::string id, std::string &title, std::string &length, std::vector<std::string> &tracks);
+
+    bool LoadPlaylistPage(std::string id, size_t page, std::string &title, std::string &length,
+                          std::vector<std::string> &tracks);
+
+    CTask<std::string> AddTrackAsync(std::string filepath);
+
+    CTask<std::string> AddPlaylistAsync(std::string title);
+
+    CTask<CStorage::PlaylistRange> LoadPlaylistPageAsync(std::string id, size_t page);
+
+    /**
+     * \brief Returns the reactor the Async calls wait in
+     * \returns Pointer to reactor, for an event loop to turn or to Run() tasks in
+     */
+    CReactor *GetReactor() { return &mReactor; }
+
+    /**
+     * \brief Returns the cache of recently read playlists
+     * \returns Pointer to cache object, e.g. to set its budget or read its counters
+     */
+    CPlaylistCache *GetPlaylistCache() { return &mPlaylistCache; }
+
+    /**
+     * \brief Returns the settings this library was made with
+     * \returns Reference to config object
+     */
+    const CConfig &GetConfig() { return mConfig; }
+
+    CStream<CStorage::TrackRecord> StreamTracks();
+
+    CStream<CStorage::EntryRecord> StreamPlaylist(std::string id);
+
+    int ExportPlaylist(std::string id, std::string path);
+
+    int Export(std::string path);
+
+    int Import(std::string path);
+
+    long RelocateRoot(std::string oldPrefix, std::string newPrefix);
+
+    void RecordPlay(std::string track, CStorage::PlayEvent event, long long time = 0);
+
+    int FlushHistory();
+
+    void SetHistoryBatch(size_t events);
+
+    CStorage::TrackStats GetTrackStats(std::string track);
+
+    std::vector<CStorage::TrackStats> GetTrackStats(const std::vector<std::string> &tracks);
+
+    int AnalyzeTracks(unsigned threads = 0);
+
+    std::vector<CStorage::TrackFeatures> GetFeatures(const std::vector<std::string> &tracks);
+
+    int BuildRecommendations();
+
+    std::vector<std::string> Recommend(const std::vector<std::string> &tracks, size_t count);
+
+    int CollectTags();
+
+    std::vector<CStorage::BrowseEntry> Browse(CStorage::BrowseLevel level, long parent,
+                                              const CStorage::BrowseEntry &after, size_t limit);
+
+    int CollectArtwork();
+
+    const unsigned char *GetThumbnail(const std::string &filepath, int size);
+
+    /**
+     * \brief Returns where album art is kept
+     * \returns Pointer to artwork store, closed if artwork.path isn't set
+     */
+    CArtworkStore *GetArtwork() { return &mArtwork; }
+
+    /**
+     * \brief Returns the recommender, if it's being kept up to date
+     * \returns Pointer to recommender object, or nullptr before BuildRecommendations()
+     */
+    CRecommender *GetRecommender() { return mRecommender.IsBuilt() ? &mRecommender : nullptr; }
+
+    /**
+     * \brief Returns what this library's operations are counted in
+     * \returns Pointer to stats object, e.g. to set up tracing
+     */
+    CStats *GetStats() { return &mStats; }
+
+    CStats::Snapshot Stats();
+
+    int DumpStats(std::string path = "");
+
+    void ResetStats();
+
 private:
-    PGconn *mConnection;                ///< Postgres database connection struct
+    void AddArtwork(const std::string &filepath);
+
+    CStorage *mStorage;                 ///< Where the library is kept
+
+    CStats mStats;                      ///< What the library has done and what it cost
+
+    CConfig mConfig;                    ///< Settings the library was made with
+
+    std::vector<CStorage::PlayRecord> mHistory; ///< Listening events not written out yet
+    size_t mHistoryBatch;                       ///< How many events to buffer before writing them out
+
+    CRecommender mRecommender;          ///< Suggests tracks, once built
+
+    CPlaylistCache mPlaylistCache;      ///< Recently read playlists
+
+    CReactor mReactor;                  ///< What the Async calls wait for the storage in
+
+    CArtworkStore mArtwork;             ///< Album art, as thumbnails
+    std::unordered_set<std::string> mArtworkTried;  ///< Albums whose art couldn't be kept, not to try again
 
 };
 
@@ -0,0 +1,1976 @@
+/**
+ * \file LocalStorage.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string_view>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "LocalStorage.h"
+#include "Encoding.h"
+
+/// What every library file starts with: a magic number and a format version
+static const char FILE_HEADER[8] = {'M', 'M', 'L', 'S', 1, 0, 0, 0};
+
+/// Kinds of edit that can appear in a frame
+enum Edit : unsigned char
+{
+    EDIT_ADD_TRACK = 1,     ///< id, date added, filepath
+    EDIT_ADD_PLAYLIST,      ///< id, title
+    EDIT_REMOVE_TRACK,      ///< id
+    EDIT_REMOVE_PLAYLIST,   ///< id
+    EDIT_INSERT,            ///< playlist, position, count, then count (membership id, track id) pairs
+    EDIT_REMOVE_RANGE,      ///< playlist, position, count
+    EDIT_MOVE_RANGE,        ///< playlist, from, count, to
+    EDIT_PLAYS,             ///< count, then count (track, plays, skips, completions, last played)
+    EDIT_FEATURES,          ///< count, then count (track, decoded, and if decoded: duration,
+                            ///< loudness, peak, bpm, zigzagged key, fingerprint)
+    EDIT_JOB,               ///< id, state, zigzagged priority, kind, argument, progress
+    EDIT_RELOCATE,          ///< directory moved from, directory moved to
+    EDIT_TAGS,              ///< count, then count (track, title, number, duration, bytes, artist id,
+                            ///< artist, album id, album title, genre id, genre)
+    EDIT_REORDER            ///< playlist, count, then count old positions, in their new order
+};
+
+/// Size of one listening history record: time (i64), track (u32), event (u8), padding
+static const size_t HISTORY_RECORD = 16;
+
+/**
+ * \brief Append one track's findings to an EDIT_FEATURES edit
+ * \param out String to append to
+ * \param track The findings
+ */
+static void PutFeatures(std::string &out, const CStorage::TrackFeatures &track)
+{
+    PutVarint(out, track.track);
+    out.push_back(track.decoded);
+    if (track.decoded)
+    {
+        PutFloat(out, track.duration);
+        PutFloat(out, track.loudness);
+        PutFloat(out, track.peak);
+        PutFloat(out, track.bpm);
+        PutVarint(out, ZigZag(track.key));
+        PutString(out, track.fingerprint);
+    }
+}
+
+/**
+ * \brief Append an EDIT_JOB edit
+ * \param out String to append to
+ * \param job The job
+ */
+static void PutJob(std::string &out, const CStorage::JobRecord &job)
+{
+    out.push_back(EDIT_JOB);
+    PutVarint(out, job.id);
+    out.push_back(job.state);
+    PutVarint(out, ZigZag(job.priority));
+    PutString(out, job.kind);
+    PutString(out, job.argument);
+    PutString(out, job.progress);
+}
+
+/**
+ * \brief Turn a string id into a number
+ * \param id The id
+ * \returns The id as a number, or 0 if it isn't one
+ */
+static long ToId(const std::string &id)
+{
+    char *end = nullptr;
+    long value = strtol(id.c_str(), &end, 10);
+    return (id.empty() || *end != '\0' || value < 0) ? 0 : value;
+}
+
+/**
+ * \brief Open a library file, creating it if it doesn't exist
+ * \param path Where the library file is
+ * \param durable Whether each commit should wait for the disk
+ */
+CLocalStorage::CLocalStorage(std::string path, bool durable)
+{
+    mPath = path;
+    mDurable = durable;
+    mFd = -1;
+
+    Open();
+}
+
+/**
+ * \brief Destructor
+ *
+ * Everything committed is already in the file, so this just closes it
+ */
+CLocalStorage::~CLocalStorage()
+{
+    if (mFd >= 0)
+    {
+        close(mFd);
+    }
+}
+
+/**
+ * \brief Read the library file into memory
+ * \returns -1 if the file can't be opened or isn't a library file
+ */
+int CLocalStorage::Open()
+{
+    Clear();
+    mPending.clear();
+
+    if (mFd >= 0)
+    {
+        close(mFd);
+    }
+
+    mFd = open(mPath.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (mFd < 0)
+    {
+        return -1;
+    }
+
+    struct stat info;
+    fstat(mFd, &info);
+    size_t size = info.st_size;
+
+    if (size == 0)
+    {
+        if (write(mFd, FILE_HEADER, sizeof(FILE_HEADER)) != sizeof(FILE_HEADER))
+        {
+            close(mFd);
+            mFd = -1;
+            return -1;
+        }
+        mCheckpointBytes = 0;
+        mFileBytes = sizeof(FILE_HEADER);
+        return 0;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, mFd, 0);
+    if (map == MAP_FAILED || size < sizeof(FILE_HEADER) || memcmp(map, FILE_HEADER, sizeof(FILE_HEADER)) != 0)
+    {
+        if (map != MAP_FAILED)
+        {
+            munmap(map, size);
+        }
+        close(mFd);
+        mFd = -1;
+        return -1;
+    }
+
+    // Replay every whole frame; anything after the first bad one was a torn write
+    const char *data = (const char *)map;
+    size_t offset = sizeof(FILE_HEADER);
+    mCheckpointBytes = 0;
+    while (offset + 8 <= size)
+    {
+        uint32_t length, sum;
+        memcpy(&length, data + offset, 4);
+        memcpy(&sum, data + offset + 4, 4);
+        if (length > size - offset - 8 || Checksum(data + offset + 8, length) != sum)
+        {
+            break;
+        }
+
+        Apply(std::string(data + offset + 8, length));
+
+        offset += 8 + length;
+        if (mCheckpointBytes == 0)
+        {
+            mCheckpointBytes = offset;
+        }
+    }
+
+    munmap(map, size);
+
+    if (offset < size && ftruncate(mFd, offset) != 0)
+    {
+        return -1;
+    }
+    mFileBytes = offset;
+
+    return 0;
+}
+
+/**
+ * \brief Forget everything held in memory
+ */
+void CLocalStorage::Clear()
+{
+    mTracks.clear();
+    mPlaylists.clear();
+    mTrackStats.clear();
+    mFeatures.clear();
+    mJobs.clear();
+    mDirectories.clear();
+    mDirectoryIds.clear();
+    mArtists = Groups();
+    mAlbums = Groups();
+    mGenres = Groups();
+    mAlbumTracks.clear();
+    mListings.clear();
+    mNextTrack = 1;
+    mNextPlaylist = 1;
+    mNextMembership = 1;
+    mNextJob = 1;
+    mNextDirectory = 1;
+}
+
+/**
+ * \brief Make a run of edits to the library held in memory
+ * \param edits The encoded edits
+ *
+ * This is the only place the in-memory library changes, so replaying
+ * the file and making new edits can't disagree.
+ */
+void CLocalStorage::Apply(const std::string &edits)
+{
+    const char *p = edits.data();
+    const char *end = p + edits.size();
+
+    while (p < end)
+    {
+        unsigned char edit = *p++;
+
+        if (edit == EDIT_ADD_TRACK)
+        {
+            long id = GetVarint(p, end);
+            Track &track = mTracks[id];
+            track.dateAdded = GetVarint(p, end);
+            SetFilepath(track, GetString(p, end));
+            mNextTrack = std::max(mNextTrack, id + 1);
+        }
+        else if (edit == EDIT_ADD_PLAYLIST)
+        {
+            long id = GetVarint(p, end);
+            mPlaylists[id].title = GetString(p, end);
+            mNextPlaylist = std::max(mNextPlaylist, id + 1);
+        }
+        else if (edit == EDIT_REMOVE_TRACK)
+        {
+            long id = GetVarint(p, end);
+            auto removed = mTracks.find(id);
+            auto listed = mListings.find(id);
+            if (listed != mListings.end())
+            {
+                // Only the playlists it's on
+                for (const auto &on : listed->second)
+                {
+                    auto playlist = mPlaylists.find(on.first);
+                    if (playlist == mPlaylists.end())
+                    {
+                        continue;
+                    }
+                    if (removed != mTracks.end())
+                    {
+                        Tally(playlist->second, removed->second, -on.second);
+                    }
+                    auto &members = playlist->second.members;
+                    members.erase(std::remove_if(members.begin(), members.end(),
+                                                 [id](const std::pair<long, long> &m) { return m.second == id; }),
+                                  members.end());
+                }
+                mListings.erase(listed);
+            }
+            if (removed != mTracks.end())
+            {
+                Untag(id, removed->second);
+                mTracks.erase(removed);
+            }
+            mTrackStats.erase(id);
+            mFeatures.erase(id);
+        }
+        else if (edit == EDIT_REMOVE_PLAYLIST)
+        {
+            long id = GetVarint(p, end);
+            auto found = mPlaylists.find(id);
+            if (found != mPlaylists.end())
+            {
+                for (const auto &member : found->second.members)
+                {
+                    Enter(id, found->second, member.second, -1);
+                }
+                mPlaylists.erase(found);
+            }
+        }
+        else if (edit == EDIT_INSERT)
+        {
+            long id = GetVarint(p, end);
+            uint64_t position = GetVarint(p, end);
+            uint64_t count = GetVarint(p, end);
+
+            std::vector<std::pair<long, long>> added;
+            for (uint64_t i = 0; i < count && p < end; ++i)
+            {
+                long membership = GetVarint(p, end);
+                long track = GetVarint(p, end);
+                added.push_back(std::make_pair(membership, track));
+                mNextMembership = std::max(mNextMembership, membership + 1);
+            }
+
+            auto found = mPlaylists.find(id);
+            if (found != mPlaylists.end())
+            {
+                auto &members = found->second.members;
+                position = std::min(std::max(position, (uint64_t)1), (uint64_t)members.size() + 1);
+                members.insert(members.begin() + position - 1, added.begin(), added.end());
+                for (const auto &member : added)
+                {
+                    Enter(id, found->second, member.second, 1);
+                }
+            }
+        }
+        else if (edit == EDIT_REMOVE_RANGE)
+        {
+            long id = GetVarint(p, end);
+            uint64_t position = GetVarint(p, end);
+            uint64_t count = GetVarint(p, end);
+
+            auto found = mPlaylists.find(id);
+            if (found != mPlaylists.end() && position >= 1 && position <= found->second.members.size())
+            {
+                auto &members = found->second.members;
+                count = std::min(count, members.size() - position + 1);
+                for (uint64_t i = position - 1; i < position - 1 + count; ++i)
+                {
+                    Enter(id, found->second, members[i].second, -1);
+                }
+                members.erase(members.begin() + position - 1, members.begin() + position - 1 + count);
+            }
+        }
+        else if (edit == EDIT_MOVE_RANGE)
+        {
+            long id = GetVarint(p, end);
+            uint64_t from = GetVarint(p, end);
+            uint64_t count = GetVarint(p, end);
+            uint64_t to = GetVarint(p, end);
+
+            auto found = mPlaylists.find(id);
+            if (found == mPlaylists.end())
+            {
+                continue;
+            }
+
+            auto &members = found->second.members;
+            if (from < 1 || to < 1 || from + count - 1 > members.size() || to + count - 1 > members.size())
+            {
+                continue;
+            }
+
+            auto begin = members.begin();
+            if (to < from)
+            {
+                std::rotate(begin + to - 1, begin + from - 1, begin + from - 1 + count);
+            }
+            else
+            {
+                std::rotate(begin + from - 1, begin + from - 1 + count, begin + to - 1 + count);
+            }
+        }
+        else if (edit == EDIT_REORDER)
+        {
+            long id = GetVarint(p, end);
+            uint64_t count = GetVarint(p, end);
+
+            std::vector<uint64_t> order;
+            for (uint64_t i = 0; i < count && p < end; ++i)
+            {
+                order.push_back(GetVarint(p, end));
+            }
+
+            auto found = mPlaylists.find(id);
+            if (found == mPlaylists.end() || order.size() != found->second.members.size())
+            {
+                continue;
+            }
+
+            // Only a shuffle of every position is taken
+            auto &members = found->second.members;
+            std::vector<bool> taken(members.size(), false);
+            std::vector<std::pair<long, long>> reordered;
+            reordered.reserve(members.size());
+            for (uint64_t position : order)
+            {
+                if (position < 1 || position > members.size() || taken[position - 1])
+                {
+                    break;
+                }
+                taken[position - 1] = true;
+                reordered.push_back(members[position - 1]);
+            }
+            if (reordered.size() == members.size())
+            {
+                members.swap(reordered);
+            }
+        }
+        else if (edit == EDIT_PLAYS)
+        {
+            uint64_t count = GetVarint(p, end);
+            for (uint64_t i = 0; i < count && p < end; ++i)
+            {
+                long id = GetVarint(p, end);
+                long plays = GetVarint(p, end);
+                long skips = GetVarint(p, end);
+                long completions = GetVarint(p, end);
+                long long lastPlayed = GetVarint(p, end);
+                if (mTracks.count(id) == 0)
+                {
+                    continue;
+                }
+
+                TrackStats &stats = mTrackStats[id];
+                stats.plays += plays;
+                stats.skips += skips;
+                stats.completions += completions;
+                stats.lastPlayed = std::max(stats.lastPlayed, lastPlayed);
+            }
+        }
+        else if (edit == EDIT_FEATURES)
+        {
+            uint64_t count = GetVarint(p, end);
+            for (uint64_t i = 0; i < count && p < end; ++i)
+            {
+                TrackFeatures track;
+                track.track = GetVarint(p, end);
+                track.decoded = p < end && *p++;
+                if (track.decoded)
+                {
+                    track.duration = GetFloat(p, end);
+                    track.loudness = GetFloat(p, end);
+                    track.peak = GetFloat(p, end);
+                    track.bpm = GetFloat(p, end);
+                    track.key = UnZigZag(GetVarint(p, end));
+                    track.fingerprint = GetString(p, end);
+                }
+                auto found = mTracks.find(track.track);
+                if (found == mTracks.end())
+                {
+                    continue;
+                }
+                mFeatures[track.track] = track;
+
+                // What was measured beats what the headers said
+                if (track.decoded && track.duration != found->second.duration)
+                {
+                    Track &tagged = found->second;
+                    if (tagged.artist != 0)
+                    {
+                        double change = track.duration - tagged.duration;
+                        Tally(mArtists, tagged.artist, 0, change);
+                        Tally(mAlbums, tagged.album, 0, change);
+                        Tally(mGenres, tagged.genre, 0, change);
+                    }
+                    List(track.track, tagged, -1);
+                    tagged.duration = track.duration;
+                    List(track.track, tagged, 1);
+                }
+            }
+        }
+        else if (edit == EDIT_JOB)
+        {
+            JobRecord job;
+            job.id = GetVarint(p, end);
+            job.state = p < end ? (JobState)*p++ : JOB_QUEUED;
+            job.priority = UnZigZag(GetVarint(p, end));
+            job.kind = GetString(p, end);
+            job.argument = GetString(p, end);
+            job.progress = GetString(p, end);
+            mNextJob = std::max(mNextJob, job.id + 1);
+            if (job.state == JOB_QUEUED || job.state == JOB_RUNNING)
+            {
+                mJobs[job.id] = job;
+            }
+            else
+            {
+                mJobs.erase(job.id);
+            }
+        }
+        else if (edit == EDIT_RELOCATE)
+        {
+            std::string from = GetString(p, end);
+            std::string to = GetString(p, end);
+
+            std::vector<long> moving;
+            for (const auto &directory : mDirectories)
+            {
+                if (directory.second.compare(0, from.size(), from) == 0)
+                {
+                    moving.push_back(directory.first);
+                    mDirectoryIds.erase(directory.second);
+                }
+            }
+
+            // A directory moved onto one that's already there is merged into it
+            std::unordered_map<long, long> merged;
+            for (long id : moving)
+            {
+                std::string &path = mDirectories[id];
+                path.replace(0, from.size(), to);
+                auto there = mDirectoryIds.try_emplace(path, id);
+                if (!there.second)
+                {
+                    merged[id] = there.first->second;
+                    mDirectories.erase(id);
+                }
+            }
+            if (!merged.empty())
+            {
+                for (auto &track : mTracks)
+                {
+                    auto into = merged.find(track.second.directory);
+                    if (into != merged.end())
+                    {
+                        track.second.directory = into->second;
+                    }
+                }
+            }
+        }
+        else if (edit == EDIT_TAGS)
+        {
+            uint64_t count = GetVarint(p, end);
+            for (uint64_t i = 0; i < count && p < end; ++i)
+            {
+                long id = GetVarint(p, end);
+                std::string title = GetString(p, end);
+                long number = GetVarint(p, end);
+                float duration = GetFloat(p, end);
+                long long bytes = GetVarint(p, end);
+                long artist = GetVarint(p, end);
+                std::string artistName = GetString(p, end);
+                long album = GetVarint(p, end);
+                std::string albumTitle = GetString(p, end);
+                long genre = GetVarint(p, end);
+                std::string genreName = GetString(p, end);
+
+                auto found = mTracks.find(id);
+                if (found == mTracks.end() || artist < 1 || album < 1 || genre < 1)
+                {
+                    continue;
+                }
+
+                Track &track = found->second;
+                Untag(id, track);
+                List(id, track, -1);
+                track.title = title;
+                track.number = number;
+                if (duration > 0)
+                {
+                    track.duration = duration;
+                }
+                track.bytes = bytes;
+                track.artist = Join(mArtists, artist, 0, artistName);
+                track.album = Join(mAlbums, album, artist, albumTitle);
+                track.genre = Join(mGenres, genre, 0, genreName);
+                List(id, track, 1);
+                Tag(id, track);
+            }
+        }
+        else
+        {
+            // Not something this version wrote; stop rather than guess
+            return;
+        }
+    }
+}
+
+/**
+ * \brief Make an edit, and write it out unless a batch is open
+ * \param edit The encoded edit
+ */
+void CLocalStorage::Record(const std::string &edit)
+{
+    Apply(edit);
+    mPending.append(edit);
+
+    if (mSavepoints.empty())
+    {
+        Write();
+    }
+}
+
+/**
+ * \brief Append the pending edits to the file as one frame
+ *
+ * Folds the log into a new checkpoint once it is bigger than the last one.
+ */
+void CLocalStorage::Write()
+{
+    if (mPending.empty() || mFd < 0)
+    {
+        return;
+    }
+
+    uint32_t length = mPending.size();
+    uint32_t sum = Checksum(mPending.data(), mPending.size());
+
+    std::string frame(8, '\0');
+    memcpy(&frame[0], &length, 4);
+    memcpy(&frame[4], &sum, 4);
+    frame.append(mPending);
+    mPending.clear();
+
+    auto start = std::chrono::steady_clock::now();
+    if (write(mFd, frame.data(), frame.size()) != (ssize_t)frame.size())
+    {
+        return;
+    }
+    if (mDurable)
+    {
+        fdatasync(mFd);
+    }
+    Count("write frame", frame.size(), start);
+
+    mFileBytes += frame.size();
+    if (mCheckpointBytes == 0)
+    {
+        mCheckpointBytes = mFileBytes;
+    }
+
+    if (mFileBytes - mCheckpointBytes > std::max(mCheckpointBytes, (size_t)1 << 20))
+    {
+        Checkpoint();
+    }
+}
+
+/**
+ * \brief Rewrite the file as a single checkpoint of the whole library
+ * \returns -1 if something goes wrong, in which case the old file is left alone
+ */
+int CLocalStorage::Checkpoint()
+{
+    if (mFd < 0 || !mSavepoints.empty())
+    {
+        return -1;
+    }
+
+    std::string edits;
+    for (const auto &track : mTracks)
+    {
+        edits.push_back(EDIT_ADD_TRACK);
+        PutVarint(edits, track.first);
+        PutVarint(edits, track.second.dateAdded);
+        PutString(edits, Filepath(track.second));
+    }
+    for (const auto &playlist : mPlaylists)
+    {
+        edits.push_back(EDIT_ADD_PLAYLIST);
+        PutVarint(edits, playlist.first);
+        PutString(edits, playlist.second.title);
+
+        edits.push_back(EDIT_INSERT);
+        PutVarint(edits, playlist.first);
+        PutVarint(edits, 1);
+        PutVarint(edits, playlist.second.members.size());
+        for (const auto &member : playlist.second.members)
+        {
+            PutVarint(edits, member.first);
+            PutVarint(edits, member.second);
+        }
+    }
+
+    edits.push_back(EDIT_PLAYS);
+    PutVarint(edits, mTrackStats.size());
+    for (const auto &stats : mTrackStats)
+    {
+        PutVarint(edits, stats.first);
+        PutVarint(edits, stats.second.plays);
+        PutVarint(edits, stats.second.skips);
+        PutVarint(edits, stats.second.completions);
+        PutVarint(edits, stats.second.lastPlayed);
+    }
+
+    edits.push_back(EDIT_FEATURES);
+    PutVarint(edits, mFeatures.size());
+    for (const auto &features : mFeatures)
+    {
+        PutFeatures(edits, features.second);
+    }
+
+    // After the features, so the lengths kept here win
+    edits.push_back(EDIT_TAGS);
+    PutVarint(edits, mTracks.size() - std::count_if(mTracks.begin(), mTracks.end(),
+                                                     [](const std::pair<const long, Track> &track)
+                                                     { return track.second.artist == 0; }));
+    for (const auto &track : mTracks)
+    {
+        if (track.second.artist == 0)
+        {
+            continue;
+        }
+        PutVarint(edits, track.first);
+        PutString(edits, track.second.title);
+        PutVarint(edits, track.second.number);
+        PutFloat(edits, track.second.duration);
+        PutVarint(edits, track.second.bytes);
+        PutVarint(edits, track.second.artist);
+        PutString(edits, mArtists.byId[track.second.artist].name);
+        PutVarint(edits, track.second.album);
+        PutString(edits, mAlbums.byId[track.second.album].name);
+        PutVarint(edits, track.second.genre);
+        PutString(edits, mGenres.byId[track.second.genre].name);
+    }
+
+    for (const auto &job : mJobs)
+    {
+        PutJob(edits, job.second);
+    }
+
+    uint32_t length = edits.size();
+    uint32_t sum = Checksum(edits.data(), edits.size());
+
+    std::string file(FILE_HEADER, sizeof(FILE_HEADER));
+    file.append((const char *)&length, 4);
+    file.append((const char *)&sum, 4);
+    file.append(edits);
+
+    auto start = std::chrono::steady_clock::now();
+    std::string temp = mPath + ".checkpoint";
+    int fd = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (write(fd, file.data(), file.size()) != (ssize_t)file.size() || fsync(fd) != 0)
+    {
+        close(fd);
+        unlink(temp.c_str());
+        return -1;
+    }
+    close(fd);
+
+    if (rename(temp.c_str(), mPath.c_str()) != 0)
+    {
+        unlink(temp.c_str());
+        return -1;
+    }
+
+    close(mFd);
+    mFd = open(mPath.c_str(), O_RDWR | O_APPEND);
+    mCheckpointBytes = file.size();
+    mFileBytes = file.size();
+    Count("checkpoint", file.size(), start);
+
+    return mFd < 0 ? -1 : 0;
+}
+
+/**
+ * \brief Tell the stats about a write, if anything is counting
+ * \param what What was written
+ * \param bytes How much was written
+ * \param start When the write started
+ *
+ * Nothing is ever read back after opening, so each write is the only
+ * thing that counts as a round trip here.
+ */
+void CLocalStorage::Count(const char *what, size_t bytes, std::chrono::steady_clock::time_point start)
+{
+    if (mStats)
+    {
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        mStats->Statement(what, bytes, 0, micros.count());
+    }
+}
+
+/**
+ * \brief Insert tracks into a playlist
+ * \param playlist ID of the playlist
+ * \param tracks IDs of the tracks
+ * \param position Position the first track should occupy
+ * \returns ID of the first membership
+ */
+std::string CLocalStorage::Insert(long playlist, const std::vector<std::string> &tracks, int position)
+{
+    long first = mNextMembership;
+
+    std::string edit(1, EDIT_INSERT);
+    PutVarint(edit, playlist);
+    PutVarint(edit, position);
+    PutVarint(edit, tracks.size());
+    for (const std::string &track : tracks)
+    {
+        PutVarint(edit, mNextMembership++);
+        PutVarint(edit, ToId(track));
+    }
+    Record(edit);
+
+    return std::to_string(first);
+}
+
+/**
+ * \brief Set which directory a track is in and its name there
+ * \param track The track
+ * \param filepath The track's filepath; everything up to the last '/' is the directory
+ */
+void CLocalStorage::SetFilepath(Track &track, const std::string &filepath)
+{
+    size_t cut = filepath.rfind('/') + 1;
+    auto directory = mDirectoryIds.try_emplace(filepath.substr(0, cut), mNextDirectory);
+    if (directory.second)
+    {
+        mDirectories[mNextDirectory++] = directory.first->first;
+    }
+
+    track.directory = directory.first->second;
+    track.basename = filepath.substr(cut);
+}
+
+/**
+ * \brief Put a track's filepath back together
+ * \param track The track
+ * \returns The filepath
+ */
+std::string CLocalStorage::Filepath(const Track &track)
+{
+    auto directory = mDirectories.find(track.directory);
+    return directory != mDirectories.end() ? directory->second + track.basename : track.basename;
+}
+
+/**
+ * \brief Make sure an artist, album or genre is there
+ * \param groups The artists, albums or genres
+ * \param id Its id
+ * \param parent The artist an album is by; 0 for the rest
+ * \param name Its name
+ * \returns The id
+ *
+ * Ids are chosen before the edit is made, so replaying it makes the
+ * same ones.
+ */
+long CLocalStorage::Join(Groups &groups, long id, long parent, const std::string &name)
+{
+    auto added = groups.byId.try_emplace(id);
+    if (added.second)
+    {
+        Group &group = added.first->second;
+        group.name = name;
+        group.parent = parent;
+        groups.ids[std::make_pair(parent, name)] = id;
+        groups.order.insert(std::make_tuple(parent, name, id));
+        if (parent != 0)
+        {
+            groups.order.insert(std::make_tuple(0L, name, id));
+        }
+        groups.next = std::max(groups.next, id + 1);
+    }
+    return id;
+}
+
+/**
+ * \brief Add to, or take away from, an artist, album or genre's tracks
+ * \param groups The artists, albums or genres
+ * \param id Its id
+ * \param tracks How many tracks to add, or take away if negative
+ * \param duration How many seconds to add, or take away if negative
+ *
+ * One left with no tracks is forgotten.
+ */
+void CLocalStorage::Tally(Groups &groups, long id, long tracks, double duration)
+{
+    auto found = groups.byId.find(id);
+    if (found == groups.byId.end())
+    {
+        return;
+    }
+
+    Group &group = found->second;
+    group.tracks += tracks;
+    group.duration += duration;
+    if (group.tracks <= 0)
+    {
+        groups.ids.erase(std::make_pair(group.parent, group.name));
+        groups.order.erase(std::make_tuple(group.parent, group.name, id));
+        groups.order.erase(std::make_tuple(0L, group.name, id));
+        groups.byId.erase(found);
+    }
+}
+
+/**
+ * \brief Count a track in its artist, album and genre
+ * \param id ID of the track
+ * \param track The track; nothing happens if its tags haven't been read
+ */
+void CLocalStorage::Tag(long id, Track &track)
+{
+    if (track.artist == 0)
+    {
+        return;
+    }
+    Tally(mArtists, track.artist, 1, track.duration);
+    Tally(mAlbums, track.album, 1, track.duration);
+    Tally(mGenres, track.genre, 1, track.duration);
+    mAlbumTracks.insert(std::make_tuple(track.album, track.number, track.title, id));
+}
+
+/**
+ * \brief Stop counting a track in its artist, album and genre
+ * \param id ID of the track
+ * \param track The track; nothing happens if its tags haven't been read
+ *
+ * Its ids are left alone, so Tag() can count it back in.
+ */
+void CLocalStorage::Untag(long id, Track &track)
+{
+    if (track.artist == 0)
+    {
+        return;
+    }
+    mAlbumTracks.erase(std::make_tuple(track.album, track.number, track.title, id));
+    Tally(mArtists, track.artist, -1, -track.duration);
+    Tally(mAlbums, track.album, -1, -track.duration);
+    Tally(mGenres, track.genre, -1, -track.duration);
+}
+
+/**
+ * \brief Add a track to a playlist's totals, or take it away
+ * \param playlist The playlist
+ * \param track The track
+ * \param times How many times it's being added, or taken away if negative
+ */
+void CLocalStorage::Tally(Playlist &playlist, const Track &track, long times)
+{
+    playlist.duration += (double)track.duration * times;
+    playlist.bytes += track.bytes * times;
+
+    std::pair<std::map<long, long> *, long> counts[] = {{&playlist.artists, track.artist},
+                                                        {&playlist.albums, track.album}};
+    for (auto &count : counts)
+    {
+        if (count.second == 0)
+        {
+            continue;
+        }
+        long &tracks = (*count.first)[count.second];
+        tracks += times;
+        if (tracks <= 0)
+        {
+            count.first->erase(count.second);
+        }
+    }
+}
+
+/**
+ * \brief Note a track going on a playlist, or coming off it
+ * \param id ID of the playlist
+ * \param playlist The playlist
+ * \param track ID of the track
+ * \param times How many times it's going on, or coming off if negative
+ */
+void CLocalStorage::Enter(long id, Playlist &playlist, long track, long times)
+{
+    auto found = mTracks.find(track);
+    if (found != mTracks.end())
+    {
+        Tally(playlist, found->second, times);
+    }
+
+    std::map<long, long> &on = mListings[track];
+    long &count = on[id];
+    count += times;
+    if (count <= 0)
+    {
+        on.erase(id);
+        if (on.empty())
+        {
+            mListings.erase(track);
+        }
+    }
+}
+
+/**
+ * \brief Add a track to the totals of every playlist it's on, or take it away
+ * \param id ID of the track
+ * \param track The track
+ * \param times 1 to add it as many times as it's on each, -1 to take it away
+ *
+ * Around a change to the track, so the totals follow it.
+ */
+void CLocalStorage::List(long id, const Track &track, long times)
+{
+    auto listed = mListings.find(id);
+    if (listed == mListings.end())
+    {
+        return;
+    }
+    for (const auto &on : listed->second)
+    {
+        auto playlist = mPlaylists.find(on.first);
+        if (playlist != mPlaylists.end())
+        {
+            Tally(playlist->second, track, on.second * times);
+        }
+    }
+}
+
+/**
+ * \brief Whether the library file is open
+ * \returns CONNECTION_OK if it is, CONNECTION_BAD if not
+ */
+ConnStatusType CLocalStorage::GetStatus()
+{
+    return mFd >= 0 ? CONNECTION_OK : CONNECTION_BAD;
+}
+
+/**
+ * \brief Create the library playlist, if there isn't one yet
+ * \returns -1 if the file isn't open
+ */
+int CLocalStorage::PrepareDatabase()
+{
+    if (mFd < 0)
+    {
+        return -1;
+    }
+
+    if (mPlaylists.empty())
+    {
+        AddPlaylist("library");
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Throw away the whole library
+ * \returns -1 if the file couldn't be rewritten
+ */
+int CLocalStorage::DestroyDatabase()
+{
+    mSavepoints.clear();
+    mPending.clear();
+    Clear();
+    unlink((mPath + ".history").c_str());
+
+    return Checkpoint();
+}
+
+/**
+ * \brief Add a track, and append it to the library playlist
+ * \param filepath The filepath of the track
+ * \returns ID of the new track
+ */
+std::string CLocalStorage::AddTrack(std::string filepath)
+{
+    long id = mNextTrack;
+
+    std::string edit(1, EDIT_ADD_TRACK);
+    PutVarint(edit, id);
+    PutVarint(edit, time(nullptr));
+    PutString(edit, filepath);
+
+    auto library = mPlaylists.find(1);
+    if (library != mPlaylists.end())
+    {
+        edit.push_back(EDIT_INSERT);
+        PutVarint(edit, 1);
+        PutVarint(edit, library->second.members.size() + 1);
+        PutVarint(edit, 1);
+        PutVarint(edit, mNextMembership++);
+        PutVarint(edit, id);
+    }
+
+    Record(edit);
+
+    return std::to_string(id);
+}
+
+/**
+ * \brief Add several tracks, and append them to the library playlist
+ * \param filepaths The filepaths of the tracks
+ * \returns IDs of the new tracks, in the same order
+ *
+ * The tracks and their library memberships are recorded as one edit.
+ */
+std::vector<std::string> CLocalStorage::AddTracks(const std::vector<std::string> &filepaths)
+{
+    std::vector<std::string> ids;
+    if (filepaths.empty())
+    {
+        return ids;
+    }
+    ids.reserve(filepaths.size());
+
+    std::string edit;
+    long now = time(nullptr);
+    for (size_t i = 0; i < filepaths.size(); ++i)
+    {
+        ids.push_back(std::to_string(mNextTrack + i));
+        edit.push_back(EDIT_ADD_TRACK);
+        PutVarint(edit, mNextTrack + i);
+        PutVarint(edit, now);
+        PutString(edit, filepaths[i]);
+    }
+
+    auto library = mPlaylists.find(1);
+    if (library != mPlaylists.end())
+    {
+        edit.push_back(EDIT_INSERT);
+        PutVarint(edit, 1);
+        PutVarint(edit, library->second.members.size() + 1);
+        PutVarint(edit, filepaths.size());
+        for (size_t i = 0; i < filepaths.size(); ++i)
+        {
+            PutVarint(edit, mNextMembership++);
+            PutVarint(edit, mNextTrack + i);
+        }
+    }
+
+    Record(edit);
+
+    return ids;
+}
+
+/**
+ * \brief Add an empty playlist
+ * \param title Title of the playlist
+ * \returns ID of the new playlist
+ */
+std::string CLocalStorage::AddPlaylist(std::string title)
+{
+    long id = mNextPlaylist;
+
+    std::string edit(1, EDIT_ADD_PLAYLIST);
+    PutVarint(edit, id);
+    PutString(edit, title);
+    Record(edit);
+
+    return std::to_string(id);
+}
+
+/**
+ * \brief Remove a track and all of its playlist memberships
+ * \param id ID of the track
+ */
+void CLocalStorage::RemoveTrack(std::string id)
+{
+    std::string edit(1, EDIT_REMOVE_TRACK);
+    PutVarint(edit, ToId(id));
+    Record(edit);
+}
+
+/**
+ * \brief Remove a playlist and all of its memberships
+ * \param id ID of the playlist
+ */
+void CLocalStorage::RemovePlaylist(std::string id)
+{
+    std::string edit(1, EDIT_REMOVE_PLAYLIST);
+    PutVarint(edit, ToId(id));
+    Record(edit);
+}
+
+/**
+ * \brief Read a playlist and its track IDs
+ * \param id ID of the playlist
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track IDs, in order
+ * \returns false if there is no such playlist
+ */
+bool CLocalStorage::LoadPlaylist(std::string id, std::string &title, std::string &length,
+                                 std::vector<std::string> &tracks)
+{
+    auto found = mPlaylists.find(ToId(id));
+    if (found == mPlaylists.end())
+    {
+        return false;
+    }
+
+    title = found->second.title;
+    length = std::to_string(found->second.members.size());
+
+    tracks.clear();
+    tracks.reserve(found->second.members.size());
+    for (const auto &member : found->second.members)
+    {
+        tracks.push_back(std::to_string(member.second));
+    }
+
+    return true;
+}
+
+/**
+ * \brief Read a playlist's title and length, and a run of its tracks
+ * \param id ID of the playlist
+ * \param position Position of the first track to read
+ * \param count Number of tracks to read at most
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track IDs, in order
+ * \returns false if there is no such playlist
+ */
+bool CLocalStorage::LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                      std::string &length, std::vector<std::string> &tracks)
+{
+    auto found = mPlaylists.find(ToId(id));
+    if (found == mPlaylists.end())
+    {
+        return false;
+    }
+
+    const auto &members = found->second.members;
+    title = found->second.title;
+    length = std::to_string(members.size());
+
+    tracks.clear();
+    for (size_t i = std::max(position, 1) - 1; i < members.size() && (int)tracks.size() < count; ++i)
+    {
+        tracks.push_back(std::to_string(members[i].second));
+    }
+
+    return true;
+}
+
+/**
+ * \brief Read what's on a playlist, added up
+ * \param id ID of the playlist
+ * \returns Its totals, all 0 if there is no such playlist
+ */
+CStorage::PlaylistTotals CLocalStorage::GetPlaylistTotals(std::string id)
+{
+    PlaylistTotals totals;
+
+    auto found = mPlaylists.find(ToId(id));
+    if (found != mPlaylists.end())
+    {
+        totals.tracks = found->second.members.size();
+        totals.duration = found->second.duration;
+        totals.bytes = found->second.bytes;
+        totals.artists = found->second.artists.size();
+        totals.albums = found->second.albums.size();
+    }
+
+    return totals;
+}
+
+/**
+ * \brief Look up tracks by filepath
+ * \param filepaths The filepaths to look up
+ * \returns IDs of the tracks in the same order, or "" where there is no such track
+ *
+ * The filepaths are hashed, and the tracks are walked once against them.
+ */
+std::vector<std::string> CLocalStorage::FindTracks(const std::vector<std::string> &filepaths)
+{
+    std::vector<std::string> ids(filepaths.size());
+
+    std::unordered_map<std::string_view, std::vector<size_t>> wanted;
+    wanted.reserve(filepaths.size());
+    for (size_t i = 0; i < filepaths.size(); ++i)
+    {
+        wanted[filepaths[i]].push_back(i);
+    }
+
+    // mTracks is in id order, so the first match is the oldest track
+    std::string filepath;
+    for (const auto &track : mTracks)
+    {
+        filepath.assign(mDirectories[track.second.directory]).append(track.second.basename);
+        auto found = wanted.find(filepath);
+        if (found != wanted.end())
+        {
+            for (size_t i : found->second)
+            {
+                ids[i] = std::to_string(track.first);
+            }
+            wanted.erase(found);
+        }
+    }
+
+    return ids;
+}
+
+/**
+ * \brief Look up the filepaths of tracks
+ * \param ids IDs of the tracks
+ * \returns Filepaths in the same order, or "" where there is no such track
+ */
+std::vector<std::string> CLocalStorage::FindFilepaths(const std::vector<std::string> &ids)
+{
+    std::vector<std::string> filepaths(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        auto track = mTracks.find(ToId(ids[i]));
+        if (track != mTracks.end())
+        {
+            filepaths[i] = Filepath(track->second);
+        }
+    }
+
+    return filepaths;
+}
+
+/**
+ * \brief Move every track under one directory to another, keeping their ids
+ * \param from Directory the tracks are under now, ending in '/'
+ * \param to Directory to move them under, ending in '/'
+ * \returns Number of tracks moved, or -1 if the file isn't open
+ *
+ * Only the directories under it are rewritten, with one small edit
+ * recorded however many tracks there are.
+ */
+long CLocalStorage::RelocateRoot(std::string from, std::string to)
+{
+    if (mFd < 0)
+    {
+        return -1;
+    }
+
+    std::vector<bool> under(mNextDirectory);
+    for (const auto &directory : mDirectories)
+    {
+        under[directory.first] = directory.second.compare(0, from.size(), from) == 0;
+    }
+    long moved = 0;
+    for (const auto &track : mTracks)
+    {
+        moved += under[track.second.directory];
+    }
+
+    std::string edit(1, EDIT_RELOCATE);
+    PutString(edit, from);
+    PutString(edit, to);
+    Record(edit);
+
+    return moved;
+}
+
+/**
+ * \brief Append a track to a playlist
+ * \param playlist ID of the playlist
+ * \param track ID of the track
+ * \returns ID of the membership
+ */
+std::string CLocalStorage::AppendTrack(std::string playlist, std::string track)
+{
+    auto found = mPlaylists.find(ToId(playlist));
+    int position = found == mPlaylists.end() ? 1 : found->second.members.size() + 1;
+
+    return Insert(ToId(playlist), std::vector<std::string>(1, track), position);
+}
+
+/**
+ * \brief Insert a track into a playlist
+ * \param playlist ID of the playlist
+ * \param track ID of the track
+ * \param position Position the track should occupy
+ * \returns ID of the membership
+ */
+std::string CLocalStorage::InsertTrack(std::string playlist, std::string track, int position)
+{
+    return Insert(ToId(playlist), std::vector<std::string>(1, track), position);
+}
+
+/**
+ * \brief Insert several tracks into a playlist, in order
+ * \param playlist ID of the playlist
+ * \param tracks IDs of the tracks
+ * \param position Position the first track should occupy
+ */
+void CLocalStorage::InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position)
+{
+    Insert(ToId(playlist), tracks, position);
+}
+
+/**
+ * \brief Remove a run of tracks from a playlist
+ * \param playlist ID of the playlist
+ * \param position Position of the first track to remove
+ * \param count Number of tracks to remove
+ */
+void CLocalStorage::RemoveRange(std::string playlist, int position, int count)
+{
+    std::string edit(1, EDIT_REMOVE_RANGE);
+    PutVarint(edit, ToId(playlist));
+    PutVarint(edit, position);
+    PutVarint(edit, count);
+    Record(edit);
+}
+
+/**
+ * \brief Move a run of tracks within a playlist
+ * \param playlist ID of the playlist
+ * \param from Position of the first track to move
+ * \param count Number of tracks to move
+ * \param to Position the first track should end up at
+ */
+void CLocalStorage::MoveRange(std::string playlist, int from, int count, int to)
+{
+    std::string edit(1, EDIT_MOVE_RANGE);
+    PutVarint(edit, ToId(playlist));
+    PutVarint(edit, from);
+    PutVarint(edit, count);
+    PutVarint(edit, to);
+    Record(edit);
+}
+
+/**
+ * \brief Put every track in a playlist in a new order
+ * \param playlist ID of the playlist
+ * \param order The current positions of its tracks, in the order they're to go in
+ */
+void CLocalStorage::Reorder(std::string playlist, const std::vector<long> &order)
+{
+    std::string edit(1, EDIT_REORDER);
+    PutVarint(edit, ToId(playlist));
+    PutVarint(edit, order.size());
+    for (long position : order)
+    {
+        PutVarint(edit, position);
+    }
+    Record(edit);
+}
+
+/**
+ * \brief Nothing to do; memberships are kept in order without positions
+ * \param playlist ID of the playlist
+ */
+void CLocalStorage::Normalize(std::string playlist)
+{
+    (void)playlist;
+}
+
+/**
+ * \brief Start holding edits back
+ * \returns true if no other batch was open
+ */
+bool CLocalStorage::BeginBatch()
+{
+    mSavepoints.push_back(mPending.size());
+    return mSavepoints.size() == 1;
+}
+
+/**
+ * \brief Close a batch, writing its edits out if it was the outermost
+ * \param playlist ID of the playlist the batch edited
+ * \param outer What BeginBatch() returned
+ * \returns 0; edits held in memory can't fail to commit
+ */
+int CLocalStorage::CommitBatch(std::string playlist, bool outer)
+{
+    (void)playlist;
+    (void)outer;
+
+    if (!mSavepoints.empty())
+    {
+        mSavepoints.pop_back();
+    }
+
+    if (mSavepoints.empty())
+    {
+        Write();
+    }
+    return 0;
+}
+
+/**
+ * \brief Throw away a batch's edits
+ * \param outer What BeginBatch() returned
+ *
+ * The file is replayed, followed by whatever edits were made before the batch.
+ */
+void CLocalStorage::RollbackBatch(bool outer)
+{
+    (void)outer;
+
+    if (mSavepoints.empty())
+    {
+        return;
+    }
+
+    std::string kept = mPending.substr(0, mSavepoints.back());
+    mSavepoints.pop_back();
+
+    Open();
+
+    Apply(kept);
+    mPending = kept;
+}
+
+/**
+ * \brief Visit every track, ordered by filepath
+ * \param visit Called once per track
+ */
+void CLocalStorage::ReadTracks(const std::function<void(const TrackRecord &)> &visit)
+{
+    std::vector<TrackRecord> ordered;
+    ordered.reserve(mTracks.size());
+    for (const auto &track : mTracks)
+    {
+        ordered.push_back({track.first, Filepath(track.second), track.second.dateAdded});
+    }
+    std::sort(ordered.begin(), ordered.end(),
+              [](const TrackRecord &a, const TrackRecord &b) { return a.filepath < b.filepath; });
+
+    for (const TrackRecord &record : ordered)
+    {
+        visit(record);
+    }
+}
+
+/**
+ * \brief Stream every track, ordered by id
+ * \returns Cursor over the tracks, to be deleted
+ *
+ * Nothing else may use the storage until the cursor is finished or deleted.
+ */
+CStorage::Cursor<CStorage::TrackRecord> *CLocalStorage::StreamTracks()
+{
+    auto it = mTracks.cbegin();
+    return new CallbackCursor<TrackRecord>([this, it](TrackRecord &track) mutable
+    {
+        if (it == mTracks.cend())
+        {
+            return false;
+        }
+        track.id = it->first;
+        track.filepath = Filepath(it->second);
+        track.dateAdded = it->second.dateAdded;
+        ++it;
+        return true;
+    });
+}
+
+/**
+ * \brief Stream a playlist's tracks, in order
+ * \param id ID of the playlist
+ * \returns Cursor over the tracks, to be deleted; empty if there's no such playlist
+ *
+ * Nothing else may use the storage until the cursor is finished or deleted.
+ */
+CStorage::Cursor<CStorage::EntryRecord> *CLocalStorage::StreamPlaylist(std::string id)
+{
+    auto found = mPlaylists.find(ToId(id));
+    const Playlist *playlist = found != mPlaylists.end() ? &found->second : nullptr;
+    size_t next = 0;
+
+    return new CallbackCursor<EntryRecord>([this, playlist, next](EntryRecord &entry) mutable
+    {
+        if (!playlist || next >= playlist->members.size())
+        {
+            return false;
+        }
+        entry.track = playlist->members[next].second;
+        entry.position = ++next;
+        auto track = mTracks.find(entry.track);
+        entry.filepath = track != mTracks.end() ? Filepath(track->second) : "";
+        return true;
+    });
+}
+
+/**
+ * \brief Visit every playlist, ordered by id
+ * \param visit Called once per playlist with its id, title and track ids in order
+ */
+void CLocalStorage::ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit)
+{
+    std::vector<long> tracks;
+    for (const auto &playlist : mPlaylists)
+    {
+        tracks.clear();
+        for (const auto &member : playlist.second.members)
+        {
+            tracks.push_back(member.second);
+        }
+        visit(playlist.first, playlist.second.title, tracks);
+    }
+}
+
+/**
+ * \brief Empty the library to have another restored into it
+ * \returns -1 if the file isn't open
+ *
+ * Nothing is written until EndRestore().
+ */
+int CLocalStorage::BeginRestore()
+{
+    if (mFd < 0)
+    {
+        return -1;
+    }
+
+    mSavepoints.clear();
+    mPending.clear();
+    Clear();
+
+    return 0;
+}
+
+/**
+ * \brief Restore tracks, keeping their ids
+ * \param tracks The tracks
+ */
+void CLocalStorage::RestoreTracks(const std::vector<TrackRecord> &tracks)
+{
+    for (const TrackRecord &record : tracks)
+    {
+        Track &track = mTracks[record.id];
+        SetFilepath(track, record.filepath);
+        track.dateAdded = record.dateAdded;
+        mNextTrack = std::max(mNextTrack, record.id + 1);
+    }
+}
+
+/**
+ * \brief Restore a playlist, keeping its id
+ * \param id ID of the playlist
+ * \param title Title of the playlist
+ * \param tracks Track ids, in order
+ */
+void CLocalStorage::RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks)
+{
+    Playlist &playlist = mPlaylists[id];
+    playlist.title = title;
+    for (const auto &member : playlist.members)
+    {
+        Enter(id, playlist, member.second, -1);
+    }
+    playlist.members.clear();
+    playlist.members.reserve(tracks.size());
+    for (long track : tracks)
+    {
+        playlist.members.push_back(std::make_pair(mNextMembership++, track));
+        Enter(id, playlist, track, 1);
+    }
+    mNextPlaylist = std::max(mNextPlaylist, id + 1);
+}
+
+/**
+ * \brief Write the restored library out as a new checkpoint
+ * \returns -1 if the file couldn't be rewritten
+ */
+int CLocalStorage::EndRestore()
+{
+    return Checkpoint();
+}
+
+/**
+ * \brief Add to the listening history and roll it into each track's stats
+ * \param events The events, oldest first
+ * \returns 0; the sums are held in memory, like any other edit
+ *
+ * The events themselves go on the end of a history file beside the
+ * library file, which is never read back. The per-track sums go into
+ * the library file as one edit.
+ */
+int CLocalStorage::AppendHistory(const std::vector<PlayRecord> &events)
+{
+    if (events.empty())
+    {
+        return 0;
+    }
+
+    std::string records(events.size() * HISTORY_RECORD, '\0');
+    std::map<long, TrackStats> totals;
+    for (size_t i = 0; i < events.size(); ++i)
+    {
+        const PlayRecord &record = events[i];
+        int64_t time = record.time;
+        uint32_t track = record.track;
+        memcpy(&records[i * HISTORY_RECORD], &time, 8);
+        memcpy(&records[i * HISTORY_RECORD + 8], &track, 4);
+        records[i * HISTORY_RECORD + 12] = record.event;
+
+        TrackStats &stats = totals[record.track];
+        stats.plays += record.event == EVENT_PLAY;
+        stats.skips += record.event == EVENT_SKIP;
+        stats.completions += record.event == EVENT_COMPLETE;
+        stats.lastPlayed = std::max(stats.lastPlayed, record.time);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int fd = open((mPath + ".history").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd >= 0)
+    {
+        if (write(fd, records.data(), records.size()) == (ssize_t)records.size() && mDurable)
+        {
+            fdatasync(fd);
+        }
+        close(fd);
+        Count("append history", records.size(), start);
+    }
+
+    std::string edit(1, EDIT_PLAYS);
+    PutVarint(edit, totals.size());
+    for (const auto &stats : totals)
+    {
+        PutVarint(edit, stats.first);
+        PutVarint(edit, stats.second.plays);
+        PutVarint(edit, stats.second.skips);
+        PutVarint(edit, stats.second.completions);
+        PutVarint(edit, stats.second.lastPlayed);
+    }
+    Record(edit);
+    return 0;
+}
+
+/**
+ * \brief Read the rolled up listening history of tracks
+ * \param ids IDs of the tracks
+ * \returns Stats in the same order; all zero for tracks never played
+ */
+std::vector<CStorage::TrackStats> CLocalStorage::GetTrackStats(const std::vector<std::string> &ids)
+{
+    std::vector<TrackStats> stats(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        auto found = mTrackStats.find(ToId(ids[i]));
+        if (found != mTrackStats.end())
+        {
+            stats[i] = found->second;
+        }
+    }
+
+    return stats;
+}
+
+/**
+ * \brief List tracks that haven't been analysed yet
+ * \param after Only list tracks with an id above this
+ * \param limit List no more than this many
+ * \returns The tracks, ordered by id
+ */
+std::vector<CStorage::TrackRecord> CLocalStorage::FindUnanalyzed(long after, size_t limit)
+{
+    std::vector<TrackRecord> tracks;
+    for (auto track = mTracks.upper_bound(after); track != mTracks.end() && tracks.size() < limit; ++track)
+    {
+        if (mFeatures.count(track->first) == 0)
+        {
+            tracks.push_back({track->first, Filepath(track->second), track->second.dateAdded});
+        }
+    }
+
+    return tracks;
+}
+
+/**
+ * \brief Keep what analysing tracks found, replacing anything found before
+ * \param features The findings; tracks that no longer exist are skipped
+ */
+void CLocalStorage::SaveFeatures(const std::vector<TrackFeatures> &features)
+{
+    if (features.empty())
+    {
+        return;
+    }
+
+    std::string edit(1, EDIT_FEATURES);
+    PutVarint(edit, features.size());
+    for (const TrackFeatures &track : features)
+    {
+        PutFeatures(edit, track);
+    }
+    Record(edit);
+}
+
+/**
+ * \brief Read what analysing tracks found
+ * \param ids IDs of the tracks
+ * \returns Findings in the same order; track is 0 for tracks not analysed yet
+ */
+std::vector<CStorage::TrackFeatures> CLocalStorage::GetFeatures(const std::vector<std::string> &ids)
+{
+    std::vector<TrackFeatures> features(ids.size());
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        auto found = mFeatures.find(ToId(ids[i]));
+        if (found != mFeatures.end())
+        {
+            features[i] = found->second;
+        }
+    }
+
+    return features;
+}
+
+/**
+ * \brief List tracks whose tags haven't been read yet
+ * \param after Only list tracks with an id above this
+ * \param limit List no more than this many
+ * \returns The tracks, ordered by id
+ */
+std::vector<CStorage::TrackRecord> CLocalStorage::FindUntagged(long after, size_t limit)
+{
+    std::vector<TrackRecord> tracks;
+    for (auto track = mTracks.upper_bound(after); track != mTracks.end() && tracks.size() < limit; ++track)
+    {
+        if (track->second.artist == 0)
+        {
+            tracks.push_back({track->first, Filepath(track->second), track->second.dateAdded});
+        }
+    }
+
+    return tracks;
+}
+
+/**
+ * \brief Keep what tracks' tags say, replacing what they said before
+ * \param tags The tags; tracks that no longer exist are skipped
+ *
+ * New artists, albums and genres get their ids here, so the edit
+ * carries them and replaying it can't hand out different ones.
+ */
+void CLocalStorage::SaveTags(const std::vector<TrackTags> &tags)
+{
+    if (tags.empty())
+    {
+        return;
+    }
+
+    // Ids for names not seen before, handed out in the order they come up
+    std::map<std::pair<long, std::string>, long> added[3];
+    long next[3] = {mArtists.next, mAlbums.next, mGenres.next};
+    Groups *groups[3] = {&mArtists, &mAlbums, &mGenres};
+    auto idOf = [&](int kind, long parent, const std::string &name)
+    {
+        auto key = std::make_pair(parent, name);
+        auto found = groups[kind]->ids.find(key);
+        if (found != groups[kind]->ids.end())
+        {
+            return found->second;
+        }
+        return added[kind].try_emplace(key, next[kind]).second ? next[kind]++ : added[kind][key];
+    };
+
+    std::string edit(1, EDIT_TAGS);
+    PutVarint(edit, tags.size());
+    for (const TrackTags &track : tags)
+    {
+        long artist = idOf(0, 0, track.artist);
+        PutVarint(edit, track.track);
+        PutString(edit, track.title);
+        PutVarint(edit, std::max(track.number, 0));
+        PutFloat(edit, track.duration);
+        PutVarint(edit, std::max(track.bytes, 0LL));
+        PutVarint(edit, artist);
+        PutString(edit, track.artist);
+        PutVarint(edit, idOf(1, artist, track.album));
+        PutString(edit, track.album);
+        PutVarint(edit, idOf(2, 0, track.genre));
+        PutString(edit, track.genre);
+    }
+    Record(edit);
+}
+
+/**
+ * \brief List a page of artists, albums, tracks or genres
+ * \param level What to list
+ * \param parent The artist to list albums by, or album to list tracks on
+ * \param after The last row of the page before, or a default row for the first page
+ * \param limit List no more than this many
+ * \returns The rows, in order
+ *
+ * Each page starts with a search of an ordered index, so it costs the
+ * same however far in it is.
+ */
+std::vector<CStorage::BrowseEntry> CLocalStorage::Browse(BrowseLevel level, long parent,
+                                                         const BrowseEntry &after, size_t limit)
+{
+    std::vector<BrowseEntry> entries;
+
+    if (level == BROWSE_TRACKS)
+    {
+        auto row = mAlbumTracks.upper_bound(std::make_tuple(parent, after.number, after.name, after.id));
+        for (; row != mAlbumTracks.end() && std::get<0>(*row) == parent && entries.size() < limit; ++row)
+        {
+            long id = std::get<3>(*row);
+            entries.push_back({id, std::get<2>(*row), std::get<1>(*row), 1, mTracks[id].duration});
+        }
+        return entries;
+    }
+
+    Groups &groups = level == BROWSE_ARTISTS ? mArtists : level == BROWSE_ALBUMS ? mAlbums : mGenres;
+    long under = level == BROWSE_ALBUMS ? parent : 0;
+    auto row = groups.order.upper_bound(std::make_tuple(under, after.name, after.id));
+    for (; row != groups.order.end() && std::get<0>(*row) == under && entries.size() < limit; ++row)
+    {
+        const Group &group = groups.byId[std::get<2>(*row)];
+        entries.push_back({std::get<2>(*row), group.name, 0, group.tracks, group.duration});
+    }
+
+    return entries;
+}
+
+/**
+ * \brief List playlists
+ * \param after Only list playlists with an id above this
+ * \param limit List no more than this many
+ * \returns Their ids, in order
+ */
+std::vector<long> CLocalStorage::FindPlaylists(long after, size_t limit)
+{
+    std::vector<long> ids;
+    for (auto playlist = mPlaylists.upper_bound(after); playlist != mPlaylists.end() && ids.size() < limit; ++playlist)
+    {
+        ids.push_back(playlist->first);
+    }
+
+    return ids;
+}
+
+/**
+ * \brief Fold the log into a fresh checkpoint
+ * \returns -1 if something goes wrong, or a batch is open
+ */
+int CLocalStorage::Vacuum()
+{
+    return Checkpoint();
+}
+
+/**
+ * \brief Keep a new background job
+ * \param job The job; its id is ignored
+ * \returns ID of the job, or -1 if the file isn't open
+ */
+long CLocalStorage::AddJob(const JobRecord &job)
+{
+    if (mFd < 0)
+    {
+        return -1;
+    }
+
+    JobRecord added = job;
+    added.id = mNextJob;
+
+    std::string edit;
+    PutJob(edit, added);
+    Record(edit);
+
+    return added.id;
+}
+
+/**
+ * \brief Keep where a background job is at; finished jobs are forgotten
+ * \param job The job
+ */
+void CLocalStorage::UpdateJob(const JobRecord &job)
+{
+    std::string edit;
+    PutJob(edit, job);
+    Record(edit);
+}
+
+/**
+ * \brief Read the background jobs that haven't finished
+ * \returns The jobs, ordered by id
+ */
+std::vector<CStorage::JobRecord> CLocalStorage::LoadJobs()
+{
+    std::vector<JobRecord> jobs;
+    for (const auto &job : mJobs)
+    {
+        jobs.push_back(job.second);
+    }
+
+    return jobs;
+}
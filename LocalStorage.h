@@ -0,0 +1,252 @@
+/**
+ * \file LocalStorage.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the LocalStorage class
+ */
+
+#ifndef LOCALSTORAGE_H
+#define LOCALSTORAGE_H
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "Storage.h"
+
+/**
+ * \brief Keeps a library in a single local file, no server needed
+ *
+ * The whole library is held in memory, in ordered maps of tracks and
+ * playlists, where each playlist keeps its memberships in order. The
+ * file is a log: a header followed by frames of edits, each with a
+ * length and a checksum. The first frame is a checkpoint holding the
+ * whole library, and every commit appends one more frame. Opening the
+ * file maps it in and replays the frames, dropping a torn one at the
+ * end. Once the log outgrows the checkpoint, it is folded into a new
+ * one, written beside the file and renamed over it.
+ *
+ * Filepaths are split at their last '/'. Each directory is kept once,
+ * and tracks hold only its id and their own name, so moving a directory
+ * (see RelocateRoot()) touches each directory under it and not each
+ * track. The file still has whole filepaths in it.
+ *
+ * Batches hold their edits back and write them as a single frame on
+ * commit. Rolling back replays the file and whatever came before the
+ * batch.
+ *
+ * Artists, albums and genres are kept with how many tracks each has
+ * and how long they are, and are indexed in the order they're browsed
+ * in, so a page of them is found in O(log n) and nothing is ever added
+ * up. The counts change as tracks are tagged, removed or measured.
+ * Each playlist keeps its own totals the same way, with a count of its
+ * tracks by artist and by album, and each track knows which playlists
+ * it's on, so retagging it only visits those.
+ *
+ * Listening history is kept as fixed-size records in a second file
+ * named after the first with ".history" on the end. Only the per-track
+ * sums live in the library file.
+ */
+class CLocalStorage : public CStorage
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CLocalStorage() = delete;
+
+    CLocalStorage(std::string path, bool durable = true);
+    virtual ~CLocalStorage();
+
+    /** \brief Copy constructor (disabled)
+     * \param storage Storage to construct this based on */
+    CLocalStorage(const CLocalStorage &storage) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param storage Storage whose attributes will override those of the current storage */
+    CLocalStorage& operator=(const CLocalStorage &storage) = delete;
+
+    virtual ConnStatusType GetStatus() override;
+
+    virtual int PrepareDatabase() override;
+    virtual int DestroyDatabase() override;
+
+    virtual std::string AddTrack(std::string filepath) override;
+    virtual std::vector<std::string> AddTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::string AddPlaylist(std::string title) override;
+    virtual void RemoveTrack(std::string id) override;
+    virtual void RemovePlaylist(std::string id) override;
+
+    virtual bool LoadPlaylist(std::string id, std::string &title, std::string &length,
+                              std::vector<std::string> &tracks) override;
+    virtual bool LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                   std::string &length, std::vector<std::string> &tracks) override;
+    virtual PlaylistTotals GetPlaylistTotals(std::string id) override;
+    virtual std::vector<std::string> FindTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::vector<std::string> FindFilepaths(const std::vector<std::string> &ids) override;
+    virtual long RelocateRoot(std::string from, std::string to) override;
+
+    virtual std::string AppendTrack(std::string playlist, std::string track) override;
+    virtual std::string InsertTrack(std::string playlist, std::string track, int position) override;
+    virtual void InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position) override;
+    virtual void RemoveRange(std::string playlist, int position, int count) override;
+    virtual void MoveRange(std::string playlist, int from, int count, int to) override;
+    virtual void Reorder(std::string playlist, const std::vector<long> &order) override;
+    virtual void Normalize(std::string playlist) override;
+
+    virtual bool BeginBatch() override;
+    virtual int CommitBatch(std::string playlist, bool outer) override;
+    virtual void RollbackBatch(bool outer) override;
+
+    virtual void ReadTracks(const std::function<void(const TrackRecord &)> &visit) override;
+    virtual Cursor<TrackRecord> *StreamTracks() override;
+    virtual Cursor<EntryRecord> *StreamPlaylist(std::string id) override;
+    virtual void ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit) override;
+    virtual int BeginRestore() override;
+    virtual void RestoreTracks(const std::vector<TrackRecord> &tracks) override;
+    virtual void RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks) override;
+    virtual int EndRestore() override;
+
+    virtual int AppendHistory(const std::vector<PlayRecord> &events) override;
+    virtual std::vector<TrackStats> GetTrackStats(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUnanalyzed(long after, size_t limit) override;
+    virtual void SaveFeatures(const std::vector<TrackFeatures> &features) override;
+    virtual std::vector<TrackFeatures> GetFeatures(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUntagged(long after, size_t limit) override;
+    virtual void SaveTags(const std::vector<TrackTags> &tags) override;
+    virtual std::vector<BrowseEntry> Browse(BrowseLevel level, long parent, const BrowseEntry &after,
+                                            size_t limit) override;
+
+    virtual std::vector<long> FindPlaylists(long after, size_t limit) override;
+    virtual int Vacuum() override;
+    virtual long AddJob(const JobRecord &job) override;
+    virtual void UpdateJob(const JobRecord &job) override;
+    virtual std::vector<JobRecord> LoadJobs() override;
+
+    int Checkpoint();
+
+private:
+    /// A track as it is held in memory
+    struct Track
+    {
+        long directory;         ///< ID of the directory the track is in
+        std::string basename;   ///< The filepath of the track past the directory
+        long long dateAdded;    ///< When the track was added, in seconds since the epoch
+        std::string title;      ///< Its title, from its tags
+        long artist = 0;        ///< ID of the artist its album is by, or 0 if its tags haven't been read
+        long album = 0;         ///< ID of its album, or 0
+        long genre = 0;         ///< ID of its genre, or 0
+        long number = 0;        ///< Where it is on its album, or 0
+        float duration = 0;     ///< Length in seconds, or 0 if it isn't known
+        long long bytes = 0;    ///< Size of its file when it was tagged, or 0
+    };
+
+    /// An artist, album or genre as it is held in memory
+    struct Group
+    {
+        std::string name;       ///< Its name, or an album's title
+        long parent = 0;        ///< The artist an album is by; 0 for artists and genres
+        long tracks = 0;        ///< Tracks in it
+        double duration = 0;    ///< Seconds of them all
+    };
+
+    /// Artists, albums or genres, indexed for browsing
+    struct Groups
+    {
+        std::map<long, Group> byId;                             ///< Each one, by id
+        std::map<std::pair<long, std::string>, long> ids;       ///< Their ids, by parent and name
+        std::set<std::tuple<long, std::string, long>> order;    ///< (parent, name, id) in browsing order;
+                                                                ///< albums are under 0 as well as their artist
+        long next = 1;                                          ///< Next id to hand out
+    };
+
+    /// A playlist as it is held in memory
+    struct Playlist
+    {
+        std::string title;                          ///< The title of the playlist
+        std::vector<std::pair<long, long>> members; ///< (membership id, track id), in order
+        double duration = 0;                        ///< Seconds of its tracks
+        long long bytes = 0;                        ///< Size of their files
+        std::map<long, long> artists;               ///< How many of its tracks each artist has
+        std::map<long, long> albums;                ///< How many of its tracks each album has
+    };
+
+    int Open();
+    void Clear();
+    void Apply(const std::string &edits);
+    void Record(const std::string &edit);
+    void Write();
+    void Count(const char *what, size_t bytes, std::chrono::steady_clock::time_point start);
+    std::string Insert(long playlist, const std::vector<std::string> &tracks, int position);
+    void SetFilepath(Track &track, const std::string &filepath);
+    std::string Filepath(const Track &track);
+    long Join(Groups &groups, long id, long parent, const std::string &name);
+    void Tally(Groups &groups, long id, long tracks, double duration);
+    void Tag(long id, Track &track);
+    void Untag(long id, Track &track);
+    void Tally(Playlist &playlist, const Track &track, long times);
+    void Enter(long id, Playlist &playlist, long track, long times);
+    void List(long id, const Track &track, long times);
+
+    /// Where the library file is
+    std::string mPath;
+
+    /// Whether each commit waits for the disk
+    bool mDurable;
+
+    /// File descriptor of the library file, or -1 if it couldn't be opened
+    int mFd;
+
+    /// Size of the checkpoint at the start of the file
+    size_t mCheckpointBytes;
+
+    /// Size of the whole file
+    size_t mFileBytes;
+
+    /// Tracks, by id
+    std::map<long, Track> mTracks;
+
+    /// Directories tracks are in, each ending in '/', by id
+    std::map<long, std::string> mDirectories;
+
+    /// IDs of the directories, by path
+    std::unordered_map<std::string, long> mDirectoryIds;
+
+    /// Playlists, by id
+    std::map<long, Playlist> mPlaylists;
+
+    /// Listening history rolled up, by track id
+    std::map<long, TrackStats> mTrackStats;
+
+    /// What analysing each track found, by track id
+    std::map<long, TrackFeatures> mFeatures;
+
+    /// Artists, albums and genres, with their track counts and lengths
+    Groups mArtists, mAlbums, mGenres;
+
+    /// Tracks on each album, as (album, number, title, id), in browsing order
+    std::set<std::tuple<long, long, std::string, long>> mAlbumTracks;
+
+    /// How many times each track is on each playlist, by track id then playlist id
+    std::unordered_map<long, std::map<long, long>> mListings;
+
+    /// Background jobs that haven't finished, by id
+    std::map<long, JobRecord> mJobs;
+
+    long mNextTrack;        ///< Next track id to hand out
+    long mNextPlaylist;     ///< Next playlist id to hand out
+    long mNextMembership;   ///< Next membership id to hand out
+    long mNextJob;          ///< Next job id to hand out
+    long mNextDirectory;    ///< Next directory id to hand out
+
+    /// Edits made since the last write
+    std::string mPending;
+
+    /// How much of mPending came before each open batch
+    std::vector<size_t> mSavepoints;
+};
+
+#endif
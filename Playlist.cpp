@@ -3,7 +3,43 @@
  * \author Matt Hammerly
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include "Analyzer.h"
 #include "Playlist.h"
+#include "PlaylistFile.h"
+
+/**
+ * \brief Whether a string is a usable position or count
+ * \param value The string to check
+ */
+static bool IsIndex(const std::string &value)
+{
+    return !value.empty() && value.size() < 10 && value.find_first_not_of("0123456789") == std::string::npos;
+}
+
+/**
+ * \brief Whether a string is a usable track id
+ * \param id The string to check
+ *
+ * A sharded library's ids run past what an int holds, so these are
+ * read as a long rather than held to IsIndex().
+ */
+static bool IsTrackId(const std::string &id)
+{
+    if (id.empty() || id[0] < '0' || id[0] > '9')
+    {
+        return false;
+    }
+
+    char *end = nullptr;
+    errno = 0;
+    long value = strtol(id.c_str(), &end, 10);
+    return *end == '\0' && errno != ERANGE && value > 0;
+}
 
 /**
  * \brief Constructor for a playlist not in the database
@@ -15,8 +51,10 @@ CPlaylist::CPlaylist(CLibrary *library)
     mId = "temp";
     mTitle = "working playlist";
     mLength = "0";
-
-    // Fill in any logic necessary to initialize an empty container for tracks
+    mInBatch = false;
+    mFound = false;
+    mHaveTotals = false;
+    mCacheVersion = 0;
 }
 
 /**
@@ -26,27 +64,34 @@ CPlaylist::CPlaylist(CLibrary *library)
  */
 CPlaylist::CPlaylist(CLibrary *library, std::string id)
 {
+    CStats::Scope scope(library->GetStats(), "Playlist::Load");
+
     mLibrary = library;
     mId = id;
+    mInBatch = false;
+    mHaveTotals = false;
 
-    // We need to fetch the playlist data from the database
-    PGconn *conn = mLibrary->GetConnection();
-
-    std::string query = "SELECT id, title, length FROM playlists WHERE id=";
-
-    char escaped_id[30];
-    PQescapeStringConn(conn, escaped_id, mId.c_str(), 30, 0);
-    query.append(escaped_id);
-    
-
-    PGresult *res = PQexec(conn, query.c_str());
-
-    mTitle = PQgetvalue(res, 0, 1);
-    mLength = PQgetvalue(res, 0, 2);
-
-    PQclear(res);
+    // We need to fetch the playlist and its tracks from the database, unless it was read recently
+    mFound = mLibrary->LoadPlaylist(mId, mTitle, mLength, mTracks);
+    if (!mFound)
+    {
+        mLength = "0";
+    }
+    mCacheVersion = mLibrary->GetPlaylistCache()->GetVersion(mId);
+}
 
-    // Fill in any logic necessary to populate a container with associated tracks
+/**
+ * \brief Destructor
+ *
+ * Leaves the playlist as it is now in the library's cache, unless
+ * something else has changed it since, so opening it again is free
+ */
+CPlaylist::~CPlaylist()
+{
+    if (mFound && !mInBatch)
+    {
+        mLibrary->GetPlaylistCache()->Put(mId, mCacheVersion, mTitle, mLength, mTracks);
+    }
 }
 
 /**
@@ -56,33 +101,17 @@ CPlaylist::CPlaylist(CLibrary *library, std::string id)
  */
 std::string CPlaylist::AppendTrack(std::string id)
 {
-    // Fill in any logic necessary to append a Track object to this playlist's container
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::AppendTrack");
+
+    mTracks.push_back(id);
+    NoteAdded(mTracks.size() - 1, 1);
 
     mLength = std::to_string(std::stoi(mLength, nullptr, 10) + 1);
 
     if (mId != "temp")
     {
-        PGconn* conn = mLibrary->GetConnection();
-
-        char escaped_playlist_id[30];
-        PQescapeStringConn(conn, escaped_playlist_id, mId.c_str(), 30, 0);
-        char escaped_track_id[30];
-        PQescapeStringConn(conn, escaped_track_id, id.c_str(), 30, 0);
-
-        std::string query = "INSERT INTO tracks_playlists (playlist_id, track_id, position) SELECT ";
-        query.append(escaped_playlist_id);
-        query.append(", ");
-        query.append(escaped_track_id);
-        query.append(", COALESCE(MAX(position), 0) + 1 FROM tracks_playlists WHERE playlist_id=");
-        query.append(escaped_playlist_id);
-        query.append(" RETURNING id");
-
-        PGresult *res = PQexec(conn, query.c_str());
-        
-        std::string associationId(PQgetvalue(res, 0, 0));
-        PQclear(res);
-
-        return associationId;
+        Changed();
+        return mLibrary->GetStorage()->AppendTrack(mId, id);
     }
     else {  // No association was created; this is for a temporary playlist
         return "temp";
@@ -94,75 +123,89 @@ std::string CPlaylist::AppendTrack(std::string id)
  * \param id ID of the track to insert
  * \param position Index you want the track to occupy, as a string
  * \returns ID of the association record, or "temp" if a temp playlist
+ *
+ * Positions past the end of the playlist append the track.
  */
 std::string CPlaylist::InsertTrack(std::string id, std::string position)
 {
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::InsertTrack");
+
     // Ignore empty inputs
-    if (position.empty() || position.find_first_not_of("0123456789") != std::string::npos)
+    if (!IsIndex(position))
     {
         // this is a terrible hack and I need to change it
         return "null";
     }
 
-    // Fill in any logic necessary to insert a Track object into this playlist's container
+    int index = std::min(std::max(std::stoi(position), 1), (int)mTracks.size() + 1);
+
+    mTracks.insert(mTracks.begin() + index - 1, id);
+    NoteAdded(index - 1, 1);
 
     mLength = std::to_string(std::stoi(mLength, nullptr, 10) + 1);
 
     if (mId != "temp")
     {
-        PGconn *conn = mLibrary->GetConnection();
+        Changed();
+        return mLibrary->GetStorage()->InsertTrack(mId, id, index);
+    }
 
-        char escaped_playlist_id[30];
-        PQescapeStringConn(conn, escaped_playlist_id, mId.c_str(), 30, 0);
-        char escaped_track_id[30];
-        PQescapeStringConn(conn, escaped_track_id, id.c_str(), 30, 0);
-        char escaped_position[30];
-        PQescapeStringConn(conn, escaped_position, position.c_str(), 30, 0);
+    return "temp";
+}
 
-        std::string query = "INSERT INTO tracks_playlists (playlist_id, track_id, position) VALUES (";
-        query.append(escaped_playlist_id);
-        query.append(", ");
-        query.append(escaped_track_id);
-        query.append(", ");
-        query.append(escaped_position);
-        query.append(" - 0.5) RETURNING id"); // subtract 0.5
+/**
+ * \brief Insert several tracks into a playlist, in order
+ * \param ids IDs of the tracks to insert
+ * \param position Index the first track should occupy, as a string
+ *
+ * The tracks after the position are shifted once, and all of the
+ * memberships go in together.
+ */
+void CPlaylist::InsertTracks(std::vector<std::string> ids, std::string position)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::InsertTracks");
 
-        PGresult *res = PQexec(conn, query.c_str());
+    if (!IsIndex(position) || ids.empty())
+    {
+        return;
+    }
 
-        std::string associationId(PQgetvalue(res, 0, 0));
-        PQclear(res);
+    for (const std::string &id : ids)
+    {
+        if (!IsTrackId(id))
+        {
+            return;
+        }
+    }
 
-        // We inserted a fraction, and now we want to correct all records to have integer positions
-        Normalize();
+    int index = std::min(std::max(std::stoi(position), 1), (int)mTracks.size() + 1);
+    int count = ids.size();
 
-        return associationId;
+    if (mId != "temp")
+    {
+        Changed();
+        mLibrary->GetStorage()->InsertTracks(mId, ids, index);
     }
 
-    return "temp";
+    mTracks.insert(mTracks.begin() + index - 1, ids.begin(), ids.end());
+    NoteAdded(index - 1, count);
+    mLength = std::to_string(std::stoi(mLength, nullptr, 10) + count);
 }
 
 /**
  * \brief Normalize a playlist's positions to be all integers
  *
- * Inserts are done by inserting fractions into the position column,
- * and this function will normalize a playlist so all positions are
- * integers.
+ * Edits keep positions running 1..n on their own, so this only
+ * has work to do for playlists written by older versions that
+ * left gaps behind.
  */
 void CPlaylist::Normalize()
 {
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::Normalize");
+
     if (mId != "temp")
     {
-        PGconn *conn = mLibrary->GetConnection();
-
-        char escaped_id[30];
-        PQescapeStringConn(conn, escaped_id, mId.c_str(), 30, 0);
-
-        std::string query = "WITH Sub AS (SELECT id, row_number() OVER (ORDER BY position) FROM tracks_playlists WHERE playlist_id=";
-        query.append(escaped_id);
-        query.append(") UPDATE tracks_playlists AS Main SET position = Sub.row_number FROM Sub WHERE Main.id = Sub.id");
-
-        PGresult *res = PQexec(conn, query.c_str());
-        PQclear(res);
+        mLibrary->GetStorage()->Normalize(mId);
     }
 
     return;
@@ -174,31 +217,546 @@ void CPlaylist::Normalize()
  */
 void CPlaylist::RemoveTrack(std::string position)
 {
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::RemoveTrack");
+
+    RemoveRange(position, "1");
+}
+
+/**
+ * \brief Remove a run of tracks from a playlist
+ * \param position Index of the first track to remove
+ * \param count Number of tracks to remove
+ *
+ * Runs past the end of the playlist are cut short.
+ */
+void CPlaylist::RemoveRange(std::string position, std::string count)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::RemoveRange");
+
+    // Ignore empty inputs
+    if (!IsIndex(position) || !IsIndex(count))
+    {
+        return;
+    }
+
+    int index = std::stoi(position);
+    int n = std::min(std::stoi(count), (int)mTracks.size() - index + 1);
+    if (index < 1 || n < 1)
+    {
+        return;
+    }
+
+    if (mId != "temp")
+    {
+        Changed();
+        mLibrary->GetStorage()->RemoveRange(mId, index, n);
+    }
+
+    if (CRecommender *recommender = mLibrary->GetRecommender())
+    {
+        recommender->Removing(mId, mTracks, index - 1, n);
+    }
+
+    mTracks.erase(mTracks.begin() + index - 1, mTracks.begin() + index - 1 + n);
+    mLength = std::to_string(std::stoi(mLength, nullptr, 10) - n);
+}
+
+/**
+ * \brief Move one track to another position
+ * \param from Index of the track to move
+ * \param to Index the track should end up at
+ */
+void CPlaylist::MoveTrack(std::string from, std::string to)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::MoveTrack");
+
+    MoveRange(from, "1", to);
+}
+
+/**
+ * \brief Move a run of tracks to another position
+ * \param from Index of the first track to move
+ * \param count Number of tracks to move
+ * \param to Index the first track should end up at
+ *
+ * Only the tracks between the old and new spots are touched.
+ */
+void CPlaylist::MoveRange(std::string from, std::string count, std::string to)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::MoveRange");
+
     // Ignore empty inputs
-    if (position.empty() || position.find_first_not_of("0123456789") != std::string::npos)
+    if (!IsIndex(from) || !IsIndex(count) || !IsIndex(to))
+    {
+        return;
+    }
+
+    int size = mTracks.size();
+    int first = std::stoi(from);
+    int n = std::min(std::stoi(count), size - first + 1);
+    if (first < 1 || n < 1)
     {
         return;
     }
+    int target = std::min(std::max(std::stoi(to), 1), size - n + 1);
+    if (target == first)
+    {
+        return;
+    }
+
+    if (mId != "temp")
+    {
+        Changed();
+        mLibrary->GetStorage()->MoveRange(mId, first, n, target);
+    }
+
+    auto begin = mTracks.begin();
+    if (target < first)
+    {
+        std::rotate(begin + target - 1, begin + first - 1, begin + first - 1 + n);
+    }
+    else
+    {
+        std::rotate(begin + first - 1, begin + first - 1 + n, begin + target - 1 + n);
+    }
+}
+
+/**
+ * \brief Append the tracks in an M3U/M3U8, PLS or XSPF file
+ * \param path Where the playlist file is
+ * \returns Number of tracks appended, or -1 if the file can't be read
+ *
+ * Each distinct filepath is looked up once, and all of them in one go.
+ * Filepaths that aren't in the library yet are added to it together,
+ * then every track goes into the playlist with one insert. Either
+ * all of that happens or none of it does.
+ */
+int CPlaylist::Import(std::string path)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::Import");
+
+    CPlaylistFile file(path);
+    std::vector<std::string> filepaths;
+    if (file.Read(filepaths) < 0)
+    {
+        return -1;
+    }
+    if (filepaths.empty())
+    {
+        return 0;
+    }
+
+    // Playlists repeat themselves; only look each filepath up once
+    std::unordered_map<std::string_view, size_t> slots;
+    slots.reserve(filepaths.size());
+    std::vector<size_t> entries;
+    entries.reserve(filepaths.size());
+    std::vector<std::string> distinct;
+    for (const std::string &filepath : filepaths)
+    {
+        auto slot = slots.emplace(filepath, distinct.size());
+        if (slot.second)
+        {
+            distinct.push_back(filepath);
+        }
+        entries.push_back(slot.first->second);
+    }
+
+    CStorage *storage = mLibrary->GetStorage();
+
+    std::optional<Batch> batch;
+    if (!mInBatch)
+    {
+        batch.emplace(this);
+    }
+
+    std::vector<std::string> ids = storage->FindTracks(distinct);
+
+    std::vector<size_t> missing;
+    std::vector<std::string> unknown;
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        if (ids[i].empty())
+        {
+            missing.push_back(i);
+            unknown.push_back(distinct[i]);
+        }
+    }
+
+    if (!unknown.empty())
+    {
+        // They go on the end of the library playlist too
+        mLibrary->GetPlaylistCache()->Invalidate("1");
+    }
+    std::vector<std::string> added = storage->AddTracks(unknown);
+    for (size_t i = 0; i < missing.size() && i < added.size(); ++i)
+    {
+        ids[missing[i]] = added[i];
+    }
+
+    std::vector<std::string> tracks;
+    tracks.reserve(entries.size());
+    for (size_t entry : entries)
+    {
+        tracks.push_back(ids[entry]);
+    }
+
+    // Tracks that couldn't be added take the whole import down with them
+    if (std::find(tracks.begin(), tracks.end(), "") != tracks.end())
+    {
+        return -1;
+    }
+
+    InsertTracks(tracks, std::to_string(mTracks.size() + 1));
+
+    if (batch && batch->Commit() != 0)
+    {
+        return -1;
+    }
+
+    return tracks.size();
+}
+
+/**
+ * \brief Write this playlist out as an M3U/M3U8, PLS or XSPF file
+ * \param path Where to write it; the extension picks the format
+ * \returns Number of tracks written, or -1 if something goes wrong
+ */
+int CPlaylist::Export(std::string path)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::Export");
+
+    std::vector<std::string> filepaths = mLibrary->GetStorage()->FindFilepaths(mTracks);
+
+    CPlaylistFile file(path);
+    return file.Write(mTitle, filepaths);
+}
+
+/**
+ * \brief Copy this playlist's tracks into a directory, transcoded, and write it there as an M3U8
+ * \param directory Where to put them, e.g. a player's mount point
+ * \param summary Filled in with what was done, if given
+ * \returns Number of tracks in the directory, or -1 if something goes wrong
+ *
+ * Codec, bitrate, threads and cache come from the library's export.*
+ * settings. Only tracks that changed since the last sync are
+ * transcoded again; see CExporter.
+ */
+int CPlaylist::Sync(std::string directory, CExporter::Summary *summary)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::Sync");
+
+    const CConfig &config = mLibrary->GetConfig();
+    CExporter exporter;
+    exporter.SetFormat(config.Get("export.codec"), config.GetInt("export.bitrate"));
+    exporter.SetThreads(std::max(0L, config.GetInt("export.threads")));
+    exporter.SetCache(config.Get("export.cache"));
+
+    std::vector<std::string> filepaths = mLibrary->GetStorage()->FindFilepaths(mTracks);
+    return exporter.Sync(mTitle, filepaths, directory, summary);
+}
+
+/**
+ * \brief Read one page of this playlist
+ * \param page Number of the page, from 0; a page is CPlaylistCache::PAGE_TRACKS tracks
+ * \returns The title, length and the track IDs on the page; empty past the end
+ *
+ * Every track is already held here, so this reads nothing from the
+ * library. Its pages line up with CLibrary::LoadPlaylistPageAsync()'s.
+ */
+CStorage::PlaylistRange CPlaylist::LoadPage(size_t page)
+{
+    CStorage::PlaylistRange range;
+    range.found = mFound || mId == "temp";
+    range.title = mTitle;
+    range.length = mLength;
 
-    // Fill in any logic necessary to remove a track from the collection of Track objects
+    size_t pageTracks = CPlaylistCache::PAGE_TRACKS;
+    size_t first = std::min(page * pageTracks, mTracks.size());
+    size_t last = std::min(first + pageTracks, mTracks.size());
+    range.tracks.assign(mTracks.begin() + first, mTracks.begin() + last);
 
-    mLength = std::to_string(std::stoi(mLength, nullptr, 10) - 1);
+    return range;
+}
+
+/**
+ * \brief Read this playlist's tracks back from the library as they're needed
+ * \returns Positions, track ids and filepaths, for range-for; empty if the playlist isn't kept
+ *
+ * Handy for the filepaths, which aren't held here. For a playlist too
+ * long to hold at all, skip making a CPlaylist and use
+ * CLibrary::StreamPlaylist(). Nothing else may use the library until
+ * the stream is finished or destroyed.
+ */
+CStream<CStorage::EntryRecord> CPlaylist::Stream()
+{
+    return mLibrary->StreamPlaylist(mId);
+}
+
+/**
+ * \brief Append tracks that go with the ones already here
+ * \param count How many tracks to append, at most
+ * \returns Number of tracks appended
+ *
+ * Needs the library's recommendations built (see
+ * CLibrary::BuildRecommendations()); appends nothing otherwise.
+ */
+int CPlaylist::Extend(std::string count)
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::Extend");
+
+    if (!IsIndex(count))
+    {
+        return 0;
+    }
+
+    std::vector<std::string> tracks = mLibrary->Recommend(mTracks, std::stoi(count));
+    InsertTracks(tracks, std::to_string(mTracks.size() + 1));
+
+    return tracks.size();
+}
+
+/**
+ * \brief Reorder the playlist so each track leads smoothly into the next
+ * \returns Number of tracks that changed place
+ *
+ * Starting from the first track, the next is always the closest of
+ * those left in tempo, key, sound and loudness (see
+ * CAnalyzer::Distance()). Tracks that haven't been analysed go at the
+ * end, in the order they were in. Needs CLibrary::AnalyzeTracks() to
+ * have been run; nothing is worked out here. The new order is worked
+ * out in memory and written in one go.
+ */
+int CPlaylist::OrderForTransitions()
+{
+    CStats::Scope scope(mLibrary->GetStats(), "Playlist::OrderForTransitions");
+
+    size_t n = mTracks.size();
+    if (n < 3)
+    {
+        return 0;
+    }
+
+    std::vector<CStorage::TrackFeatures> features = mLibrary->GetFeatures(mTracks);
+
+    std::vector<size_t> order(1, 0);
+    std::vector<bool> placed(n, false);
+    placed[0] = true;
+    for (size_t step = 1; step < n; ++step)
+    {
+        const CStorage::TrackFeatures &last = features[order.back()];
+        size_t best = n;
+        float bestDistance = 0;
+        for (size_t i = 1; i < n; ++i)
+        {
+            if (placed[i] || !features[i].decoded)
+            {
+                continue;
+            }
+            float distance = CAnalyzer::Distance(last, features[i]);
+            if (best == n || distance < bestDistance)
+            {
+                best = i;
+                bestDistance = distance;
+            }
+        }
+        if (best == n)
+        {
+            break;
+        }
+        order.push_back(best);
+        placed[best] = true;
+    }
+    for (size_t i = 1; i < n; ++i)
+    {
+        if (!placed[i])
+        {
+            order.push_back(i);
+        }
+    }
+
+    std::vector<long> positions(n);
+    std::vector<std::string> tracks(n);
+    int moved = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        positions[i] = order[i] + 1;
+        tracks[i] = mTracks[order[i]];
+        moved += order[i] != i;
+    }
+    if (moved == 0)
+    {
+        return 0;
+    }
 
     if (mId != "temp")
     {
-        PGconn *conn = mLibrary->GetConnection();
+        Changed();
+        mLibrary->GetStorage()->Reorder(mId, positions);
+    }
+    mTracks.swap(tracks);
+
+    return moved;
+}
+
+/**
+ * \brief Note that the playlist is about to change, so the library's cache forgets it
+ *
+ * The destructor puts it back as it ends up.
+ */
+void CPlaylist::Changed()
+{
+    mCacheVersion = mLibrary->GetPlaylistCache()->Invalidate(mId);
+    mHaveTotals = false;
+}
+
+/**
+ * \brief Returns what's on the playlist, added up
+ * \returns The totals, read from the storage the first time they're asked for after a change
+ *
+ * The storage keeps them as tracks come and go, so this is one lookup
+ * and never a pass over the tracks. Inside a batch they may lag until
+ * it's committed. A working playlist isn't kept anywhere, so only its
+ * tracks are counted.
+ */
+const CStorage::PlaylistTotals &CPlaylist::Totals()
+{
+    if (mId == "temp")
+    {
+        mTotals = CStorage::PlaylistTotals();
+        mTotals.tracks = mTracks.size();
+    }
+    else if (!mHaveTotals)
+    {
+        CStats::Scope scope(mLibrary->GetStats(), "Playlist::Totals");
+        mTotals = mLibrary->GetStorage()->GetPlaylistTotals(mId);
+        mHaveTotals = true;
+    }
+    return mTotals;
+}
+
+/**
+ * \brief Let the library's recommender know tracks were added
+ * \param first Index in mTracks of the first track added
+ * \param count Number of tracks added
+ */
+void CPlaylist::NoteAdded(size_t first, size_t count)
+{
+    if (CRecommender *recommender = mLibrary->GetRecommender())
+    {
+        recommender->Added(mId, mTracks, first, count);
+    }
+}
 
-        char escaped_id[30];
-        PQescapeStringConn(conn, escaped_id, mId.c_str(), 30, 0);
-        char escaped_position[30];
-        PQescapeStringConn(conn, escaped_position, position.c_str(), 30, 0);
+/**
+ * \brief Open a batch on a playlist
+ * \param playlist The playlist to be edited
+ *
+ * Starts a transaction, or a savepoint if the storage is already in one.
+ */
+CPlaylist::Batch::Batch(CPlaylist *playlist)
+{
+    CStats::Scope scope(playlist->mLibrary->GetStats(), "Playlist::BeginBatch");
+
+    mPlaylist = playlist;
+    mOpen = true;
+    mOwnsTransaction = false;
+    mWasInBatch = mPlaylist->mInBatch;
+    mLength = mPlaylist->mLength;
+    mTracks = mPlaylist->mTracks;
+
+    mPlaylist->mInBatch = true;
+
+    if (mPlaylist->mId != "temp")
+    {
+        mOwnsTransaction = mPlaylist->mLibrary->GetStorage()->BeginBatch();
+    }
+}
 
-        std::string query = "DELETE FROM tracks_playlists WHERE position=";
-        query.append(escaped_position);
-        query.append(" AND playlist_id=");
-        query.append(escaped_id);
+/**
+ * \brief Destructor
+ *
+ * Rolls back anything that wasn't committed
+ */
+CPlaylist::Batch::~Batch()
+{
+    Rollback();
+}
 
-        PGresult *res = PQexec(conn, query.c_str());
-        PQclear(res);
+/**
+ * \brief Normalize the playlist, recount its length and commit the batch
+ * \returns -1 if the storage couldn't commit it
+ *
+ * A batch the storage couldn't commit has been rolled back there, so
+ * the playlist goes back to how it was when the batch was opened.
+ */
+int CPlaylist::Batch::Commit()
+{
+    CStats::Scope scope(mPlaylist->mLibrary->GetStats(), "Playlist::CommitBatch");
+
+    if (!mOpen)
+    {
+        return 0;
+    }
+
+    if (mPlaylist->mId != "temp" &&
+        mPlaylist->mLibrary->GetStorage()->CommitBatch(mPlaylist->mId, mOwnsTransaction) != 0)
+    {
+        Restore();
+        return -1;
+    }
+
+    mOpen = false;
+    mPlaylist->mInBatch = mWasInBatch;
+    mPlaylist->mHaveTotals = false;
+    return 0;
+}
+
+/**
+ * \brief Throw away everything done in the batch
+ *
+ * Does nothing if the batch was already committed or rolled back.
+ */
+void CPlaylist::Batch::Rollback()
+{
+    CStats::Scope scope(mPlaylist->mLibrary->GetStats(), "Playlist::RollbackBatch");
+
+    if (!mOpen)
+    {
+        return;
+    }
+
+    Restore();
+
+    if (mPlaylist->mId != "temp")
+    {
+        mPlaylist->mLibrary->GetStorage()->RollbackBatch(mOwnsTransaction);
+    }
+}
+
+/**
+ * \brief Close the batch and put the playlist back how it was when the batch was opened
+ *
+ * Only the copy held here; what's in the storage is left to the caller.
+ */
+void CPlaylist::Batch::Restore()
+{
+    mOpen = false;
+    mPlaylist->mInBatch = mWasInBatch;
+    mPlaylist->mLength = mLength;
+
+    CRecommender *recommender = mPlaylist->mLibrary->GetRecommender();
+    if (recommender && mPlaylist->mTracks != mTracks)
+    {
+        recommender->Removing(mPlaylist->mId, mPlaylist->mTracks, 0, mPlaylist->mTracks.size());
+        recommender->Added(mPlaylist->mId, mTracks, 0, mTracks.size());
+    }
+
+    mPlaylist->mTracks.swap(mTracks);
+    mPlaylist->mHaveTotals = false;
+
+    if (mPlaylist->mId != "temp")
+    {
+        mPlaylist->Changed();
     }
 }
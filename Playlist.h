@@ -8,6 +8,8 @@
 #define PLAYLIST_H
 
 #include <string>
+#include <vector>
+#include "Exporter.h"
 #include "Library.h"
 
 /**
@@ -22,6 +24,62 @@ class CPlaylist
 {
 public:
 
+    /**
+     * \brief Groups a run of playlist edits into one transaction
+     *
+     * While a batch is open the totals trigger is held off, and the
+     * playlist is normalized and added up again once, on Commit().
+     * A batch that goes out of scope without being
+     * committed is rolled back, along with the in-memory tracks.
+     *
+     * Opening a batch while the connection is already in a transaction
+     * (say, another playlist's batch) uses a savepoint instead.
+     */
+    class Batch
+    {
+    public:
+
+        /** \brief Default constructor (disabled) */
+        Batch() = delete;
+
+        Batch(CPlaylist *playlist);
+
+        /** \brief Copy constructor (disabled)
+         * \param batch Batch to construct this based on */
+        Batch(const Batch &batch) = delete;
+
+        /** \brief Assignment operator (disabled)
+         * \param batch Batch whose attributes will override those of the current batch */
+        Batch& operator=(const Batch &batch) = delete;
+
+        ~Batch();
+
+        int Commit();
+
+        void Rollback();
+
+    private:
+        void Restore();
+
+        /// The playlist being edited
+        CPlaylist *mPlaylist;
+
+        /// Whether this batch has been neither committed nor rolled back
+        bool mOpen;
+
+        /// Whether this batch started the transaction, or only a savepoint in one
+        bool mOwnsTransaction;
+
+        /// Whether the playlist was already in a batch when this one was opened
+        bool mWasInBatch;
+
+        /// The length of the playlist when the batch was opened, for rollback
+        std::string mLength;
+
+        /// The tracks of the playlist when the batch was opened, for rollback
+        std::vector<std::string> mTracks;
+    };
+
     /** \brief Default constructor (disabled) */
     CPlaylist() = delete;
 
@@ -36,8 +94,7 @@ public:
      * \param playlist Playlist whose attributes will override those of the current playlist */
     CPlaylist& operator=(const CPlaylist &playlist) = delete;
 
-    /** \brief Destructor */
-    ~CPlaylist() {}
+    ~CPlaylist();
 
     /**
      * \brief Returns the ID of this playlist
@@ -57,6 +114,42 @@ public:
      */
     std::string GetLength() { return mLength; }
 
+    /**
+     * \brief Returns how long this playlist plays for
+     * \returns Seconds of its tracks, as far as their lengths are known
+     */
+    double GetDuration() { return Totals().duration; }
+
+    /**
+     * \brief Returns how much disk this playlist's files take up
+     * \returns Bytes, as far as its tracks have been tagged
+     */
+    long long GetSize() { return Totals().bytes; }
+
+    /**
+     * \brief Returns how many different artists this playlist's tracks are by
+     * \returns Number of artists, as far as its tracks have been tagged
+     */
+    long GetArtistCount() { return Totals().artists; }
+
+    /**
+     * \brief Returns how many different albums this playlist's tracks are from
+     * \returns Number of albums, as far as its tracks have been tagged
+     */
+    long GetAlbumCount() { return Totals().albums; }
+
+    /**
+     * \brief Returns whether this playlist is in the library
+     * \returns false if there was no such playlist, or it's a working one
+     */
+    bool Exists() { return mFound; }
+
+    /**
+     * \brief Returns the IDs of the tracks in this playlist
+     * \returns Track IDs, in playlist order
+     */
+    const std::vector<std::string> &GetTracks() { return mTracks; }
+
     /**
      * \brief Returns the library this playlist belongs to
      * \returns Pointer to library object
@@ -67,11 +160,37 @@ public:
 
     std::string InsertTrack(std::string id, std::string position);
 
+    void InsertTracks(std::vector<std::string> ids, std::string position);
+
     void Normalize();
 
     void RemoveTrack(std::string position);
 
+    void RemoveRange(std::string position, std::string count);
+
+    void MoveTrack(std::string from, std::string to);
+
+    void MoveRange(std::string from, std::string count, std::string to);
+
+    int Import(std::string path);
+
+    int Export(std::string path);
+
+    int Sync(std::string directory, CExporter::Summary *summary = nullptr);
+
+    CStream<CStorage::EntryRecord> Stream();
+
+    CStorage::PlaylistRange LoadPage(size_t page);
+
+    int Extend(std::string count);
+
+    int OrderForTransitions();
+
 private:
+    void NoteAdded(size_t first, size_t count);
+    void Changed();
+    const CStorage::PlaylistTotals &Totals();
+
     /// The id of the playlist in the database
     std::string mId;
 
@@ -83,6 +202,24 @@ private:
 
     /// The library this playlist belongs to
     CLibrary *mLibrary;
+
+    /// The IDs of the tracks in this playlist, in order
+    std::vector<std::string> mTracks;
+
+    /// Whether a batch is open on this playlist
+    bool mInBatch;
+
+    /// Whether the playlist was found in the database
+    bool mFound;
+
+    /// What's on the playlist, added up, as last read from the storage
+    CStorage::PlaylistTotals mTotals;
+
+    /// Whether mTotals is still good
+    bool mHaveTotals;
+
+    /// Version of the playlist in the library's cache that this one matches
+    uint64_t mCacheVersion;
 };
 
 #endif
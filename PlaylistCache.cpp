@@ -0,0 +1,353 @@
+/**
+ * \file PlaylistCache.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include "PlaylistCache.h"
+
+/// Rough cost of a list node, a map node and the like, on top of what's in them
+static const size_t NODE_BYTES = 64;
+
+/**
+ * \brief Work out about how much memory a string takes up
+ * \param text The string
+ */
+static size_t Bytes(const std::string &text)
+{
+    // Short strings fit inside the object itself
+    return sizeof(std::string) + (text.capacity() > 15 ? text.capacity() + 1 : 0);
+}
+
+/**
+ * \brief Constructor
+ * \param budget Bytes that can be held
+ */
+CPlaylistCache::CPlaylistCache(size_t budget)
+{
+    mBudget = budget;
+    mBytes = 0;
+    mCleared = 0;
+    mClock = 0;
+}
+
+/**
+ * \brief Change how many bytes can be held
+ * \param bytes The budget; 0 turns the cache off
+ */
+void CPlaylistCache::SetBudget(size_t bytes)
+{
+    mBudget = bytes;
+    Evict();
+}
+
+/**
+ * \brief Returns the version of a playlist, to hand back to Put()
+ * \param playlist ID of the playlist
+ */
+uint64_t CPlaylistCache::GetVersion(const std::string &playlist)
+{
+    auto found = mVersions.find(playlist);
+    return found != mVersions.end() ? found->second : mCleared;
+}
+
+/**
+ * \brief Forget a playlist because it's changed
+ * \param playlist ID of the playlist
+ * \returns Its new version
+ */
+uint64_t CPlaylistCache::Invalidate(const std::string &playlist)
+{
+    Drop(playlist);
+    return mVersions[playlist] = ++mClock;
+}
+
+/**
+ * \brief Forget every playlist, e.g. because a track was removed from all of them
+ */
+void CPlaylistCache::Clear()
+{
+    mEntries.clear();
+    mRecent.clear();
+    mVersions.clear();
+    mBytes = 0;
+    mCleared = ++mClock;
+}
+
+/**
+ * \brief Look up a whole playlist
+ * \param playlist ID of the playlist
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track ids, in order
+ * \returns false if the header or any page isn't held
+ */
+bool CPlaylistCache::Get(const std::string &playlist, std::string &title, std::string &length,
+                         std::vector<std::string> &tracks)
+{
+    auto found = mEntries.find(playlist);
+    size_t count = found != mEntries.end() ? atol(found->second.length.c_str()) : 0;
+    size_t pages = (count + PAGE_TRACKS - 1) / PAGE_TRACKS;
+    if (found == mEntries.end() || found->second.pages.size() < pages)
+    {
+        ++mCounters.misses;
+        return false;
+    }
+
+    Entry &entry = found->second;
+    tracks.clear();
+    tracks.reserve(count);
+    for (size_t page = 0; page < pages; ++page)
+    {
+        Page &held = entry.pages.at(page);
+        tracks.insert(tracks.end(), held.tracks.begin(), held.tracks.end());
+        Touch(held.place);
+    }
+    Touch(entry.place);
+
+    title = entry.title;
+    length = entry.length;
+    ++mCounters.hits;
+
+    return true;
+}
+
+/**
+ * \brief Look up one page of a playlist
+ * \param playlist ID of the playlist
+ * \param page Number of the page, from 0
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track ids on the page; empty past the end
+ * \returns false if the header or page isn't held
+ */
+bool CPlaylistCache::GetPage(const std::string &playlist, size_t page, std::string &title, std::string &length,
+                             std::vector<std::string> &tracks)
+{
+    auto found = mEntries.find(playlist);
+    if (found == mEntries.end())
+    {
+        ++mCounters.misses;
+        return false;
+    }
+
+    Entry &entry = found->second;
+    auto held = entry.pages.find(page);
+    if (held == entry.pages.end())
+    {
+        if (page * PAGE_TRACKS < (size_t)atol(entry.length.c_str()))
+        {
+            ++mCounters.misses;
+            return false;
+        }
+        // Nothing out there to miss
+        tracks.clear();
+    }
+    else
+    {
+        tracks = held->second.tracks;
+        Touch(held->second.place);
+    }
+    Touch(entry.place);
+
+    title = entry.title;
+    length = entry.length;
+    ++mCounters.hits;
+
+    return true;
+}
+
+/**
+ * \brief Keep a whole playlist read from the storage
+ * \param playlist ID of the playlist
+ * \param version What GetVersion() returned before it was read
+ * \param title The title
+ * \param length The length
+ * \param tracks The track ids, in order
+ *
+ * Not kept if the playlist has changed since, or it would take up
+ * more than a quarter of the budget.
+ */
+void CPlaylistCache::Put(const std::string &playlist, uint64_t version, const std::string &title,
+                         const std::string &length, const std::vector<std::string> &tracks)
+{
+    if (version != GetVersion(playlist) || tracks.size() * sizeof(std::string) > mBudget / 4)
+    {
+        return;
+    }
+
+    // Nothing's changed it since it was put here, so if it's all still here it's the same
+    auto found = mEntries.find(playlist);
+    if (found != mEntries.end() && found->second.length == length &&
+        found->second.pages.size() == (tracks.size() + PAGE_TRACKS - 1) / PAGE_TRACKS)
+    {
+        return;
+    }
+
+    Drop(playlist);
+    for (size_t first = 0, page = 0; first < tracks.size(); first += PAGE_TRACKS, ++page)
+    {
+        size_t last = std::min(first + PAGE_TRACKS, tracks.size());
+        PutPage(playlist, version, page, title, length,
+                std::vector<std::string>(tracks.begin() + first, tracks.begin() + last));
+    }
+    Header(playlist, title, length);
+    Evict();
+}
+
+/**
+ * \brief Keep one page of a playlist read from the storage
+ * \param playlist ID of the playlist
+ * \param version What GetVersion() returned before it was read
+ * \param page Number of the page, from 0
+ * \param title The title
+ * \param length The length
+ * \param tracks The track ids on the page
+ *
+ * Not kept if the playlist has changed since.
+ */
+void CPlaylistCache::PutPage(const std::string &playlist, uint64_t version, size_t page, const std::string &title,
+                             const std::string &length, const std::vector<std::string> &tracks)
+{
+    if (version != GetVersion(playlist))
+    {
+        return;
+    }
+
+    Entry *entry = Header(playlist, title, length);
+
+    size_t bytes = NODE_BYTES + sizeof(Page) + tracks.size() * sizeof(std::string);
+    for (const std::string &track : tracks)
+    {
+        bytes += Bytes(track) - sizeof(std::string);
+    }
+
+    auto held = entry->pages.find(page);
+    if (held != entry->pages.end())
+    {
+        mBytes -= held->second.bytes;
+        mRecent.erase(held->second.place);
+        entry->pages.erase(held);
+    }
+
+    mRecent.push_front({playlist, (long)page});
+    entry->pages[page] = {tracks, bytes, mRecent.begin()};
+    mBytes += bytes;
+
+    Evict();
+}
+
+/**
+ * \brief Returns how well the cache is doing
+ * \returns Hits, misses, evictions and what's held
+ */
+CPlaylistCache::Counters CPlaylistCache::GetCounters()
+{
+    Counters counters = mCounters;
+    counters.bytes = mBytes;
+    counters.budget = mBudget;
+    counters.headers = mEntries.size();
+    counters.pages = mRecent.size() - mEntries.size();
+    return counters;
+}
+
+/**
+ * \brief Start counting hits, misses and evictions from zero
+ */
+void CPlaylistCache::ResetCounters()
+{
+    mCounters = Counters();
+}
+
+/**
+ * \brief Find or make a playlist's header, and mark it used
+ * \param playlist ID of the playlist
+ * \param title The title
+ * \param length The length
+ * \returns The entry
+ */
+CPlaylistCache::Entry *CPlaylistCache::Header(const std::string &playlist, const std::string &title,
+                                              const std::string &length)
+{
+    auto found = mEntries.find(playlist);
+    if (found != mEntries.end())
+    {
+        Entry &entry = found->second;
+        if (entry.length != length || entry.title != title)
+        {
+            // Out of step with the pages held, so start again
+            Drop(playlist);
+        }
+        else
+        {
+            Touch(entry.place);
+            return &entry;
+        }
+    }
+
+    mRecent.push_front({playlist, -1});
+    Entry &entry = mEntries[playlist];
+    entry.title = title;
+    entry.length = length;
+    entry.place = mRecent.begin();
+    entry.bytes = NODE_BYTES * 2 + sizeof(Entry) + Bytes(playlist) * 2 + Bytes(entry.title) + Bytes(entry.length);
+    mBytes += entry.bytes;
+
+    return &entry;
+}
+
+/**
+ * \brief Mark a header or page as just used
+ * \param place Where it is in the list
+ */
+void CPlaylistCache::Touch(Place place)
+{
+    mRecent.splice(mRecent.begin(), mRecent, place);
+}
+
+/**
+ * \brief Forget a playlist's header and pages
+ * \param playlist ID of the playlist
+ */
+void CPlaylistCache::Drop(const std::string &playlist)
+{
+    auto found = mEntries.find(playlist);
+    if (found == mEntries.end())
+    {
+        return;
+    }
+
+    for (auto &page : found->second.pages)
+    {
+        mBytes -= page.second.bytes;
+        mRecent.erase(page.second.place);
+    }
+    mBytes -= found->second.bytes;
+    mRecent.erase(found->second.place);
+    mEntries.erase(found);
+}
+
+/**
+ * \brief Drop the least recently used headers and pages until the budget is met
+ */
+void CPlaylistCache::Evict()
+{
+    while (mBytes > mBudget && !mRecent.empty())
+    {
+        const std::pair<std::string, long> &oldest = mRecent.back();
+        auto found = mEntries.find(oldest.first);
+        if (oldest.second < 0)
+        {
+            mCounters.evictions += 1 + found->second.pages.size();
+            Drop(oldest.first);
+            continue;
+        }
+
+        Page &page = found->second.pages.at(oldest.second);
+        mBytes -= page.bytes;
+        found->second.pages.erase(oldest.second);
+        mRecent.pop_back();
+        ++mCounters.evictions;
+    }
+}
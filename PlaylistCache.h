@@ -0,0 +1,144 @@
+/**
+ * \file PlaylistCache.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the PlaylistCache class
+ */
+
+#ifndef PLAYLISTCACHE_H
+#define PLAYLISTCACHE_H
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/**
+ * \brief Keeps recently read playlists in memory, up to a budget
+ *
+ * Each playlist is kept as a header (title and length) and pages of
+ * PAGE_TRACKS track ids, so a window onto a huge playlist can be
+ * cached without the whole thing. Headers and pages share one
+ * least-recently-used list, and the oldest go once the bytes held pass
+ * the budget. A playlist's pages go with its header.
+ *
+ * Every playlist has a version, bumped whenever it's invalidated.
+ * Whoever reads from the storage takes the version first and hands it
+ * back with what they read; if the playlist was invalidated in
+ * between, what they read is out of date and isn't kept.
+ *
+ * Like the library it belongs to, this isn't thread-safe.
+ */
+class CPlaylistCache
+{
+public:
+
+    /// Tracks per page
+    static const size_t PAGE_TRACKS = 512;
+
+    /// Bytes held by default
+    static const size_t DEFAULT_BUDGET = 8 << 20;
+
+    /// How well the cache is doing
+    struct Counters
+    {
+        uint64_t hits = 0;          ///< Lookups answered from memory
+        uint64_t misses = 0;        ///< Lookups that had to go to the storage
+        uint64_t evictions = 0;     ///< Headers and pages dropped to stay in budget
+        size_t bytes = 0;           ///< Bytes held
+        size_t budget = 0;          ///< Bytes that can be held
+        size_t headers = 0;         ///< Playlists held
+        size_t pages = 0;           ///< Pages held
+    };
+
+    CPlaylistCache(size_t budget = DEFAULT_BUDGET);
+
+    /** \brief Copy constructor (disabled)
+     * \param cache Cache to construct this based on */
+    CPlaylistCache(const CPlaylistCache &cache) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param cache Cache whose attributes will override those of the current cache */
+    CPlaylistCache& operator=(const CPlaylistCache &cache) = delete;
+
+    /** \brief Destructor */
+    ~CPlaylistCache() {}
+
+    void SetBudget(size_t bytes);
+
+    uint64_t GetVersion(const std::string &playlist);
+
+    uint64_t Invalidate(const std::string &playlist);
+
+    void Clear();
+
+    bool Get(const std::string &playlist, std::string &title, std::string &length,
+             std::vector<std::string> &tracks);
+
+    bool GetPage(const std::string &playlist, size_t page, std::string &title, std::string &length,
+                 std::vector<std::string> &tracks);
+
+    void Put(const std::string &playlist, uint64_t version, const std::string &title,
+             const std::string &length, const std::vector<std::string> &tracks);
+
+    void PutPage(const std::string &playlist, uint64_t version, size_t page, const std::string &title,
+                 const std::string &length, const std::vector<std::string> &tracks);
+
+    Counters GetCounters();
+
+    void ResetCounters();
+
+private:
+    /// Where a header (page -1) or page sits in the least-recently-used list
+    typedef std::list<std::pair<std::string, long>>::iterator Place;
+
+    /// A page of a playlist
+    struct Page
+    {
+        std::vector<std::string> tracks;    ///< Track ids
+        size_t bytes;                       ///< Memory it takes up
+        Place place;                        ///< Where it is in the list
+    };
+
+    /// A playlist
+    struct Entry
+    {
+        std::string title;                          ///< The title
+        std::string length;                         ///< The length
+        size_t bytes;                               ///< Memory the header takes up
+        Place place;                                ///< Where the header is in the list
+        std::unordered_map<size_t, Page> pages;     ///< Pages held, by number
+    };
+
+    Entry *Header(const std::string &playlist, const std::string &title, const std::string &length);
+    void Touch(Place place);
+    void Drop(const std::string &playlist);
+    void Evict();
+
+    /// Bytes that can be held
+    size_t mBudget;
+
+    /// Bytes held
+    size_t mBytes;
+
+    /// Playlists held, by id
+    std::unordered_map<std::string, Entry> mEntries;
+
+    /// Headers and pages, most recently used first
+    std::list<std::pair<std::string, long>> mRecent;
+
+    /// Version of each playlist invalidated since the last Clear()
+    std::unordered_map<std::string, uint64_t> mVersions;
+
+    /// Version of every playlist not in mVersions
+    uint64_t mCleared;
+
+    /// Last version handed out
+    uint64_t mClock;
+
+    /// Hits, misses and evictions
+    Counters mCounters;
+};
+
+#endif
@@ -0,0 +1,568 @@
+/**
+ * \file PlaylistFile.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <string_view>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "PlaylistFile.h"
+
+/// How much output to build up before writing it out
+static const size_t CHUNK_BYTES = 1 << 20;
+
+/**
+ * \brief Whether a string starts with another, ignoring ASCII case
+ * \param value The string to check
+ * \param prefix What it should start with
+ */
+static bool StartsWith(std::string_view value, std::string_view prefix)
+{
+    return value.size() >= prefix.size() && strncasecmp(value.data(), prefix.data(), prefix.size()) == 0;
+}
+
+/**
+ * \brief Trim spaces, tabs and carriage returns off both ends of a string
+ * \param value The string
+ * \returns The trimmed string, pointing into the same memory
+ */
+static std::string_view Trim(std::string_view value)
+{
+    size_t first = value.find_first_not_of(" \t\r");
+    if (first == std::string_view::npos)
+    {
+        return std::string_view();
+    }
+    return value.substr(first, value.find_last_not_of(" \t\r") - first + 1);
+}
+
+/**
+ * \brief Take the next line from a buffer
+ * \param p Where to start; moved past the end of the line
+ * \param end End of the buffer
+ * \returns The trimmed line, pointing into the buffer
+ */
+static std::string_view NextLine(const char *&p, const char *end)
+{
+    const char *newline = (const char *)memchr(p, '\n', end - p);
+    if (!newline)
+    {
+        newline = end;
+    }
+
+    std::string_view line(p, newline - p);
+    p = newline < end ? newline + 1 : end;
+
+    return Trim(line);
+}
+
+/**
+ * \brief Undo %XX escapes in a URI
+ * \param value The escaped string
+ * \returns The unescaped string
+ */
+static std::string PercentDecode(std::string_view value)
+{
+    std::string out;
+    out.reserve(value.size());
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        unsigned char byte = 0;
+        if (value[i] == '%' && i + 2 < value.size() &&
+            std::from_chars(value.data() + i + 1, value.data() + i + 3, byte, 16).ptr == value.data() + i + 3)
+        {
+            out.push_back(byte);
+            i += 2;
+        }
+        else
+        {
+            out.push_back(value[i]);
+        }
+    }
+
+    return out;
+}
+
+/**
+ * \brief Undo XML entities
+ * \param value The escaped string
+ * \returns The unescaped string
+ */
+static std::string XmlUnescape(std::string_view value)
+{
+    static const std::pair<std::string_view, char> entities[] = {
+        {"&amp;", '&'}, {"&lt;", '<'}, {"&gt;", '>'}, {"&quot;", '"'}, {"&apos;", '\''}
+    };
+
+    std::string out;
+    out.reserve(value.size());
+    for (size_t i = 0; i < value.size(); ++i)
+    {
+        if (value[i] != '&')
+        {
+            out.push_back(value[i]);
+            continue;
+        }
+
+        std::string_view rest = value.substr(i);
+        bool replaced = false;
+        for (const auto &entity : entities)
+        {
+            if (rest.substr(0, entity.first.size()) == entity.first)
+            {
+                out.push_back(entity.second);
+                i += entity.first.size() - 1;
+                replaced = true;
+                break;
+            }
+        }
+
+        // Numeric references only turn up for plain ASCII in practice
+        unsigned code = 0;
+        size_t semicolon = rest.find(';');
+        if (!replaced && rest.size() > 2 && rest[1] == '#' && semicolon != std::string_view::npos)
+        {
+            bool hex = rest[2] == 'x' || rest[2] == 'X';
+            const char *first = rest.data() + (hex ? 3 : 2);
+            if (std::from_chars(first, rest.data() + semicolon, code, hex ? 16 : 10).ptr == rest.data() + semicolon &&
+                code < 0x80)
+            {
+                out.push_back((char)code);
+                i += semicolon;
+                replaced = true;
+            }
+        }
+
+        if (!replaced)
+        {
+            out.push_back('&');
+        }
+    }
+
+    return out;
+}
+
+/**
+ * \brief Tidy "." and ".." out of a path
+ * \param path The path
+ * \returns The path without them
+ */
+static std::string Clean(const std::string &path)
+{
+    if (path.find("/.") == std::string::npos && path.compare(0, 2, "./") != 0)
+    {
+        return path;
+    }
+
+    std::vector<std::string_view> parts;
+    std::string_view rest(path);
+    while (!rest.empty())
+    {
+        size_t slash = rest.find('/');
+        std::string_view part = rest.substr(0, slash);
+        rest = slash == std::string_view::npos ? std::string_view() : rest.substr(slash + 1);
+
+        if (part == "..")
+        {
+            if (!parts.empty() && parts.back() != "..")
+            {
+                parts.pop_back();
+            }
+            else if (path[0] != '/')
+            {
+                parts.push_back(part);
+            }
+        }
+        else if (!part.empty() && part != ".")
+        {
+            parts.push_back(part);
+        }
+    }
+
+    std::string out = path[0] == '/' ? "/" : "";
+    for (size_t i = 0; i < parts.size(); ++i)
+    {
+        if (i > 0)
+        {
+            out.push_back('/');
+        }
+        out.append(parts[i]);
+    }
+
+    return out;
+}
+
+/**
+ * \brief Turn an entry from a playlist file into a filepath
+ * \param entry The entry
+ * \param directory Directory the playlist file is in, with a trailing slash
+ * \returns The filepath
+ */
+static std::string Resolve(std::string_view entry, const std::string &directory)
+{
+    if (StartsWith(entry, "file://"))
+    {
+        entry.remove_prefix(7);
+        if (StartsWith(entry, "localhost/"))
+        {
+            entry.remove_prefix(9);
+        }
+        return Clean(PercentDecode(entry));
+    }
+
+    if (entry.find("://") != std::string_view::npos || entry[0] == '/')
+    {
+        return std::string(entry);
+    }
+
+    std::string path = directory;
+    path.append(entry);
+    return Clean(path);
+}
+
+/**
+ * \brief Escape a string for XML
+ * \param value The string
+ * \param out String to append the escaped value to
+ */
+static void AppendXml(std::string_view value, std::string &out)
+{
+    for (char c : value)
+    {
+        switch (c)
+        {
+            case '&': out.append("&amp;"); break;
+            case '<': out.append("&lt;"); break;
+            case '>': out.append("&gt;"); break;
+            case '"': out.append("&quot;"); break;
+            default: out.push_back(c);
+        }
+    }
+}
+
+/**
+ * \brief Write a filepath as a URI
+ * \param path The filepath
+ * \param out String to append the URI to
+ *
+ * URIs are left as they are; paths become file:// URIs.
+ */
+static void AppendUri(const std::string &path, std::string &out)
+{
+    if (path.find("://") != std::string::npos)
+    {
+        out.append(path);
+        return;
+    }
+
+    static const char hex[] = "0123456789ABCDEF";
+
+    if (path[0] == '/')
+    {
+        out.append("file://");
+    }
+    for (unsigned char c : path)
+    {
+        if (isalnum(c) || (c && strchr("-._~/", c)))
+        {
+            out.push_back(c);
+        }
+        else
+        {
+            out.push_back('%');
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 15]);
+        }
+    }
+}
+
+/**
+ * \brief Constructor
+ * \param path Where the playlist file is, or is to be written
+ */
+CPlaylistFile::CPlaylistFile(std::string path)
+{
+    mPath = path;
+}
+
+/**
+ * \brief Work out what format the file is in
+ * \param data Contents of the file, or nullptr if it is being written
+ * \param size Size of the contents
+ * \returns The format; M3U if nothing gives it away
+ */
+CPlaylistFile::Format CPlaylistFile::FormatOf(const char *data, size_t size)
+{
+    std::string_view path(mPath);
+    std::string_view extension = path.substr(std::min(path.rfind('.'), path.size()));
+    if (StartsWith(extension, ".m3u"))
+    {
+        return FORMAT_M3U;
+    }
+    if (StartsWith(extension, ".pls"))
+    {
+        return FORMAT_PLS;
+    }
+    if (StartsWith(extension, ".xspf"))
+    {
+        return FORMAT_XSPF;
+    }
+
+    std::string_view start = data ? Trim(std::string_view(data, std::min(size, (size_t)64))) : std::string_view();
+    if (StartsWith(start, "[playlist]"))
+    {
+        return FORMAT_PLS;
+    }
+    if (StartsWith(start, "<"))
+    {
+        return FORMAT_XSPF;
+    }
+
+    return FORMAT_M3U;
+}
+
+/**
+ * \brief Read the filepaths out of the playlist file
+ * \param filepaths Filled in with the filepaths, in playlist order
+ * \returns Number of filepaths read, or -1 if the file can't be read
+ */
+int CPlaylistFile::Read(std::vector<std::string> &filepaths)
+{
+    filepaths.clear();
+
+    int fd = open(mPath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    size_t size = info.st_size;
+    if (size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char *p = (const char *)map;
+    const char *end = p + size;
+
+    // Skip a UTF-8 byte order mark
+    if (size >= 3 && memcmp(p, "\xEF\xBB\xBF", 3) == 0)
+    {
+        p += 3;
+    }
+
+    std::string directory = mPath.substr(0, mPath.rfind('/') + 1);
+
+    switch (FormatOf(p, end - p))
+    {
+        case FORMAT_M3U:
+            while (p < end)
+            {
+                std::string_view line = NextLine(p, end);
+                if (!line.empty() && line[0] != '#')
+                {
+                    filepaths.push_back(Resolve(line, directory));
+                }
+            }
+            break;
+
+        case FORMAT_PLS:
+        {
+            // Entries are numbered, and nothing says they're in order
+            std::vector<std::pair<long, std::string_view>> entries;
+            while (p < end)
+            {
+                std::string_view line = NextLine(p, end);
+                size_t equals = line.find('=');
+                long number;
+                if (StartsWith(line, "file") && equals != std::string_view::npos && equals + 1 < line.size() &&
+                    std::from_chars(line.data() + 4, line.data() + equals, number).ptr == line.data() + equals)
+                {
+                    entries.emplace_back(number, Trim(line.substr(equals + 1)));
+                }
+            }
+
+            std::stable_sort(entries.begin(), entries.end(),
+                             [](const std::pair<long, std::string_view> &a, const std::pair<long, std::string_view> &b)
+                             { return a.first < b.first; });
+
+            filepaths.reserve(entries.size());
+            for (const auto &entry : entries)
+            {
+                filepaths.push_back(Resolve(entry.second, directory));
+            }
+            break;
+        }
+
+        case FORMAT_XSPF:
+        {
+            std::string_view text(p, end - p);
+            size_t at = 0;
+            while ((at = text.find("<location>", at)) != std::string_view::npos)
+            {
+                at += 10;
+                size_t close = text.find("</location>", at);
+                if (close == std::string_view::npos)
+                {
+                    break;
+                }
+
+                std::string location = XmlUnescape(Trim(text.substr(at, close - at)));
+                if (!location.empty())
+                {
+                    filepaths.push_back(Resolve(location, directory));
+                }
+                at = close + 11;
+            }
+            break;
+        }
+    }
+
+    munmap(map, size);
+
+    return filepaths.size();
+}
+
+/**
+ * \brief Write a playlist out to the file
+ * \param title Title of the playlist
+ * \param filepaths Filepaths of the tracks, in order; empty ones are skipped
+ * \returns Number of tracks written, or -1 if something goes wrong
+ */
+int CPlaylistFile::Write(const std::string &title, const std::vector<std::string> &filepaths)
+{
+    size_t next = 0;
+    return Write(title, [&](std::string &filepath)
+    {
+        if (next == filepaths.size())
+        {
+            return false;
+        }
+        filepath = filepaths[next++];
+        return true;
+    });
+}
+
+/**
+ * \brief Write a playlist out to the file as its tracks are read
+ * \param title Title of the playlist
+ * \param next Fills in the next track's filepath, or returns false once there are none left;
+ *             empty ones are skipped
+ * \returns Number of tracks written, or -1 if something goes wrong
+ *
+ * Only a chunk of the file is held at a time, so however long the
+ * playlist is this takes no more memory than next does.
+ */
+int CPlaylistFile::Write(const std::string &title, const std::function<bool(std::string &filepath)> &next)
+{
+    FILE *file = fopen(mPath.c_str(), "wb");
+    if (!file)
+    {
+        return -1;
+    }
+
+    bool ok = true;
+    std::string chunk;
+    auto flush = [&]()
+    {
+        ok = ok && fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+        chunk.clear();
+    };
+
+    Format format = FormatOf(nullptr, 0);
+    int count = 0;
+
+    if (format == FORMAT_M3U)
+    {
+        chunk.append("#EXTM3U\n#PLAYLIST:");
+        chunk.append(title);
+        chunk.append("\n");
+    }
+    else if (format == FORMAT_PLS)
+    {
+        chunk.append("[playlist]\n");
+    }
+    else
+    {
+        chunk.append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+        chunk.append("<playlist version=\"1\" xmlns=\"http://xspf.org/ns/0/\">\n  <title>");
+        AppendXml(title, chunk);
+        chunk.append("</title>\n  <trackList>\n");
+    }
+
+    std::string filepath;
+    while (next(filepath))
+    {
+        if (filepath.empty())
+        {
+            continue;
+        }
+        ++count;
+
+        if (format == FORMAT_M3U)
+        {
+            chunk.append(filepath);
+            chunk.append("\n");
+        }
+        else if (format == FORMAT_PLS)
+        {
+            chunk.append("File");
+            chunk.append(std::to_string(count));
+            chunk.append("=");
+            chunk.append(filepath);
+            chunk.append("\n");
+        }
+        else
+        {
+            std::string uri;
+            AppendUri(filepath, uri);
+            chunk.append("    <track><location>");
+            AppendXml(uri, chunk);
+            chunk.append("</location></track>\n");
+        }
+
+        if (chunk.size() >= CHUNK_BYTES)
+        {
+            flush();
+        }
+    }
+
+    if (format == FORMAT_PLS)
+    {
+        chunk.append("NumberOfEntries=");
+        chunk.append(std::to_string(count));
+        chunk.append("\nVersion=2\n");
+    }
+    else if (format == FORMAT_XSPF)
+    {
+        chunk.append("  </trackList>\n</playlist>\n");
+    }
+
+    flush();
+    ok = (fclose(file) == 0) && ok;
+
+    return ok ? count : -1;
+}
@@ -0,0 +1,67 @@
+/**
+ * \file PlaylistFile.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the PlaylistFile class
+ */
+
+#ifndef PLAYLISTFILE_H
+#define PLAYLISTFILE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * \brief A playlist file on disk, in M3U/M3U8, PLS or XSPF format
+ *
+ * This only deals with filepaths; CPlaylist turns them into tracks.
+ * The format comes from the file extension, or failing that from
+ * what the file starts with.
+ *
+ * Reading maps the file in and scans it in place, only copying out
+ * the filepaths themselves. Relative paths are taken relative to the
+ * playlist file, and file:// URIs are turned back into paths. Other
+ * URIs are left alone.
+ */
+class CPlaylistFile
+{
+public:
+
+    /// Kinds of playlist file
+    enum Format
+    {
+        FORMAT_M3U,     ///< One path per line, # for comments
+        FORMAT_PLS,     ///< FileN=path entries under [playlist]
+        FORMAT_XSPF     ///< XML with a <location> per track
+    };
+
+    /** \brief Default constructor (disabled) */
+    CPlaylistFile() = delete;
+
+    CPlaylistFile(std::string path);
+
+    /** \brief Copy constructor (disabled)
+     * \param file Playlist file to construct this based on */
+    CPlaylistFile(const CPlaylistFile &file) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param file Playlist file whose attributes will override those of the current one */
+    CPlaylistFile& operator=(const CPlaylistFile &file) = delete;
+
+    /** \brief Destructor */
+    ~CPlaylistFile() {}
+
+    int Read(std::vector<std::string> &filepaths);
+
+    int Write(const std::string &title, const std::vector<std::string> &filepaths);
+
+    int Write(const std::string &title, const std::function<bool(std::string &filepath)> &next);
+
+private:
+    Format FormatOf(const char *data, size_t size);
+
+    /// Where the playlist file is
+    std::string mPath;
+};
+
+#endif
@@ -0,0 +1,2744 @@
+/**
+ * \file PostgresStorage.cpp
+ * \author Matt Hammerly
+ */
+
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include "PostgresStorage.h"
+
+/**
+ * \brief Escape a value for COPY's text format
+ * \param value The value
+ * \param out String to append the escaped value to
+ */
+static void AppendCopyField(const std::string &value, std::string &out)
+{
+    for (char c : value)
+    {
+        switch (c)
+        {
+            case '\\': out.append("\\\\"); break;
+            case '\t': out.append("\\t"); break;
+            case '\n': out.append("\\n"); break;
+            case '\r': out.append("\\r"); break;
+            default: out.push_back(c);
+        }
+    }
+}
+
+/**
+ * \brief Write a time as a timestamp Postgres will read back exactly
+ * \param seconds Seconds since the epoch
+ * \param out String to append the timestamp to
+ */
+static void AppendTimestamp(long long seconds, std::string &out)
+{
+    time_t time = seconds;
+    struct tm utc;
+    gmtime_r(&time, &utc);
+
+    char timestamp[64];
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S+00", &utc);
+    out.append(timestamp);
+}
+
+/**
+ * \brief Build a Postgres array literal out of strings
+ * \param values The strings
+ * \returns The literal, to be sent as a query parameter
+ *
+ * Sending the array as one parameter means nothing has to be escaped
+ * for sql, only for the array syntax.
+ */
+static std::string TextArray(const std::vector<std::string> &values)
+{
+    std::string array = "{";
+    for (const std::string &value : values)
+    {
+        if (array.size() > 1)
+        {
+            array.push_back(',');
+        }
+        array.push_back('"');
+        for (char c : value)
+        {
+            if (c == '"' || c == '\\')
+            {
+                array.push_back('\\');
+            }
+            array.push_back(c);
+        }
+        array.push_back('"');
+    }
+    array.push_back('}');
+
+    return array;
+}
+
+/**
+ * \brief Build a Postgres array literal out of ids
+ * \param ids The ids
+ * \returns The literal, to be sent as a query parameter
+ */
+static std::string IdArray(const std::vector<std::string> &ids)
+{
+    std::string array = "{";
+    for (const std::string &id : ids)
+    {
+        if (array.size() > 1)
+        {
+            array.push_back(',');
+        }
+        array.append(id);
+    }
+    array.push_back('}');
+
+    return array;
+}
+
+/**
+ * \brief Count the bytes in a result
+ * \param res The result
+ * \returns Bytes across every field of every row
+ */
+static size_t ResultBytes(const PGresult *res)
+{
+    size_t bytes = 0;
+    int rows = PQntuples(res);
+    int fields = PQnfields(res);
+    for (int i = 0; i < rows; ++i)
+    {
+        for (int j = 0; j < fields; ++j)
+        {
+            bytes += PQgetlength(res, i, j);
+        }
+    }
+    return bytes;
+}
+
+/// Rows to ask the server for at a time when streaming, where libpq can
+static const int STREAM_CHUNK_ROWS = 256;
+
+/**
+ * \brief Streams the rows of a query already sent, a chunk at a time
+ *
+ * With libpq 17 or newer rows come STREAM_CHUNK_ROWS at a time,
+ * otherwise one at a time. Either way only that many are held.
+ */
+template<typename Row>
+class CPostgresCursor : public CStorage::Cursor<Row>
+{
+public:
+
+    /// Turns row i of a result into a Row
+    typedef void (*Parse)(const PGresult *res, int i, Row &row);
+
+    /// Called once the rows are done with, with how many bytes came back
+    typedef std::function<void(size_t received)> Finish;
+
+    /**
+     * \brief Constructor
+     * \param connection Connection the query was sent on
+     * \param sent Whether sending it worked
+     * \param parse Turns each row into a Row
+     * \param finish Called once the rows are done with
+     */
+    CPostgresCursor(PGconn *connection, bool sent, Parse parse, Finish finish)
+    {
+        mConnection = connection;
+        mParse = parse;
+        mFinish = finish;
+        mResult = nullptr;
+        mRow = 0;
+        mReceived = 0;
+        mDone = !sent;
+
+        if (sent)
+        {
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            PQsetChunkedRowsMode(mConnection, STREAM_CHUNK_ROWS);
+#else
+            PQsetSingleRowMode(mConnection);
+#endif
+        }
+    }
+
+    /**
+     * \brief Destructor
+     *
+     * Cancels the query if its rows haven't all been read, so the
+     * connection is free again without reading the rest.
+     */
+    virtual ~CPostgresCursor()
+    {
+        PQclear(mResult);
+        if (!mDone)
+        {
+            PGcancel *cancel = PQgetCancel(mConnection);
+            if (cancel)
+            {
+                char error[256];
+                PQcancel(cancel, error, sizeof(error));
+                PQfreeCancel(cancel);
+            }
+
+            PGresult *res;
+            while ((res = PQgetResult(mConnection)) != nullptr)
+            {
+                PQclear(res);
+            }
+        }
+        mFinish(mReceived);
+    }
+
+    /**
+     * \brief Read the next row
+     * \param row Filled in with the row
+     * \returns false once there are no rows left, or the query failed
+     */
+    virtual bool Next(Row &row) override
+    {
+        while (!mResult || mRow >= PQntuples(mResult))
+        {
+            PQclear(mResult);
+            mResult = nullptr;
+            if (mDone)
+            {
+                return false;
+            }
+
+            PGresult *res = PQgetResult(mConnection);
+            if (!res)
+            {
+                mDone = true;
+                continue;
+            }
+
+            ExecStatusType status = PQresultStatus(res);
+#ifdef LIBPQ_HAS_CHUNK_MODE
+            bool rows = status == PGRES_SINGLE_TUPLE || status == PGRES_TUPLES_CHUNK;
+#else
+            bool rows = status == PGRES_SINGLE_TUPLE;
+#endif
+            if (rows)
+            {
+                mResult = res;
+                mRow = 0;
+                mReceived += ResultBytes(res);
+            }
+            else
+            {
+                // The empty result that ends the rows, or an error
+                PQclear(res);
+            }
+        }
+
+        mParse(mResult, mRow++, row);
+        return true;
+    }
+
+private:
+    PGconn *mConnection;    ///< Connection the query was sent on
+    Parse mParse;           ///< Turns each row into a Row
+    Finish mFinish;         ///< Called once the rows are done with
+    PGresult *mResult;      ///< The chunk being read, or nullptr
+    int mRow;               ///< Next row of the chunk
+    size_t mReceived;       ///< Bytes received so far
+    bool mDone;             ///< Whether every result has been read
+};
+
+/**
+ * \brief Constructor for the database a config points at
+ * \param config Settings to connect with (see CConfig)
+ *
+ * Doesn't give up on a bad connection; check GetStatus().
+ */
+CPostgresStorage::CPostgresStorage(const CConfig &config)
+{
+    mConnInfo = config.ConnectionString();
+    mConnection = PQconnectdb(mConnInfo.c_str());
+    if (PQstatus(mConnection) != CONNECTION_OK)
+    {
+        return;
+    }
+
+    long timeout = config.GetInt("db.statement_timeout");
+    if (timeout > 0)
+    {
+        std::string sql = "SET statement_timeout = " + std::to_string(timeout);
+        PQclear(PQexec(mConnection, sql.c_str()));
+        mSetup += sql + ";";
+    }
+
+    // Nothing here names a schema, so everything lands in this one. A
+    // standby refuses to make it, but it'll be there if the primary has it
+    std::string schema = config.Get("db.schema");
+    char *quoted = schema.empty() ? nullptr : PQescapeIdentifier(mConnection, schema.c_str(), schema.size());
+    if (quoted)
+    {
+        PQclear(PQexec(mConnection, (std::string("CREATE SCHEMA IF NOT EXISTS ") + quoted).c_str()));
+        PQclear(PQexec(mConnection, (std::string("SET search_path TO ") + quoted).c_str()));
+        mSetup += std::string("SET search_path TO ") + quoted + ";";
+        PQfreemem(quoted);
+    }
+}
+
+/**
+ * \brief Constructor for a database given by its connection string
+ * \param conninfo libpq connection string, e.g. "host=/tmp port=5499 dbname=scratch"
+ *
+ * Doesn't give up on a bad connection; check GetStatus().
+ */
+CPostgresStorage::CPostgresStorage(std::string conninfo)
+{
+    mConnInfo = conninfo;
+    mConnection = PQconnectdb(conninfo.c_str());
+}
+
+/**
+ * \brief Destructor
+ *
+ * Will close the database connection before exiting
+ */
+CPostgresStorage::~CPostgresStorage()
+{
+    if (mPipeline)
+    {
+        PQfinish(mPipeline);
+    }
+    PQfinish(mConnection);
+}
+
+/**
+ * \brief Create the database tables for this application
+ *
+ * \returns -1 if something goes wrong
+ *
+ * Todo: Write database schema in this comment
+ *       `create trigger IF NOT EXISTS` or similar
+ */
+int CPostgresStorage::PrepareDatabase()
+{
+    PGresult *res;
+
+    // Filepaths are split at their last '/', into a directory and the name in it
+    res = Exec(
+            "CREATE OR REPLACE FUNCTION path_directory(filepath TEXT) RETURNS TEXT\
+            LANGUAGE sql IMMUTABLE\
+            AS $path_directory$ SELECT COALESCE(substring(filepath FROM '^.*/'), '') $path_directory$;\
+            CREATE OR REPLACE FUNCTION path_basename(filepath TEXT) RETURNS TEXT\
+            LANGUAGE sql IMMUTABLE\
+            AS $path_basename$ SELECT substring(filepath FROM '[^/]*$') $path_basename$;");
+    PQclear(res);
+
+    // Each directory is kept once, so moving one is one row however many tracks are in it
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS directories (\
+                id SERIAL NOT NULL PRIMARY KEY,\
+                path TEXT NOT NULL UNIQUE\
+          )");
+    PQclear(res);
+
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS tracks (\
+                id SERIAL NOT NULL PRIMARY KEY,\
+                directory_id INTEGER NOT NULL,\
+                basename TEXT NOT NULL,\
+                date_added TIMESTAMPTZ NOT NULL DEFAULT NOW()\
+          )");
+    PQclear(res);
+
+    // Libraries made before directories were kept have whole filepaths in tracks
+    res = Exec(
+            "DO $split_filepaths$ BEGIN\
+                IF EXISTS (SELECT 1 FROM information_schema.columns WHERE table_schema = current_schema()\
+                           AND table_name = 'tracks' AND column_name = 'filepath') THEN\
+                    INSERT INTO directories (path) SELECT DISTINCT path_directory(filepath) FROM tracks\
+                        ON CONFLICT (path) DO NOTHING;\
+                    ALTER TABLE tracks ADD COLUMN directory_id INTEGER, ADD COLUMN basename TEXT;\
+                    UPDATE tracks SET directory_id = directories.id, basename = path_basename(tracks.filepath)\
+                        FROM directories WHERE directories.path = path_directory(tracks.filepath);\
+                    ALTER TABLE tracks DROP COLUMN filepath,\
+                        ALTER COLUMN directory_id SET NOT NULL, ALTER COLUMN basename SET NOT NULL;\
+                END IF;\
+            END $split_filepaths$;");
+    PQclear(res);
+
+    // Playlist files refer to tracks by filepath, and only ever by equality
+    res = Exec("CREATE INDEX IF NOT EXISTS tracks_directory_idx ON tracks (directory_id, basename)");
+    PQclear(res);
+
+    // Whole filepaths, for reading
+    res = Exec(
+            "CREATE OR REPLACE VIEW track_paths AS\
+                SELECT tracks.id, directories.path || tracks.basename AS filepath, tracks.date_added\
+                FROM tracks JOIN directories ON directories.id = tracks.directory_id");
+    PQclear(res);
+
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS playlists (\
+                id SERIAL NOT NULL PRIMARY KEY,\
+                title TEXT NOT NULL,\
+                length INTEGER NOT NULL DEFAULT 0\
+          )");
+    PQclear(res);
+
+    // A sharded catalog keeps global track ids here, which run past INTEGER
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS tracks_playlists (\
+                id SERIAL NOT NULL PRIMARY KEY,\
+                track_id BIGINT NOT NULL,\
+                playlist_id INTEGER NOT NULL,\
+                position FLOAT NOT NULL\
+          )");
+    PQclear(res);
+
+    // Libraries made before that have them as INTEGER
+    res = Exec(
+            "DO $wide_track_ids$ BEGIN\
+                IF EXISTS (SELECT 1 FROM information_schema.columns WHERE table_schema = current_schema()\
+                           AND table_name = 'tracks_playlists' AND column_name = 'track_id'\
+                           AND data_type = 'integer') THEN\
+                    ALTER TABLE tracks_playlists ALTER COLUMN track_id TYPE BIGINT;\
+                END IF;\
+            END $wide_track_ids$;");
+    PQclear(res);
+
+    // Listening history is only ever appended to, a month per partition
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS play_history (\
+                track_id INTEGER NOT NULL,\
+                event SMALLINT NOT NULL,\
+                played_at TIMESTAMPTZ NOT NULL\
+          ) PARTITION BY RANGE (played_at)");
+    PQclear(res);
+
+    // and rolled up into here as it's flushed, so nothing ever counts it
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS track_stats (\
+                track_id INTEGER NOT NULL PRIMARY KEY,\
+                plays INTEGER NOT NULL DEFAULT 0,\
+                skips INTEGER NOT NULL DEFAULT 0,\
+                completions INTEGER NOT NULL DEFAULT 0,\
+                last_played TIMESTAMPTZ\
+          )");
+    PQclear(res);
+
+    // Worked out once per track by CAnalyzer, never at play time
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS track_features (\
+                track_id INTEGER NOT NULL PRIMARY KEY,\
+                decoded BOOLEAN NOT NULL,\
+                duration REAL,\
+                loudness REAL,\
+                peak REAL,\
+                bpm REAL,\
+                musical_key SMALLINT,\
+                fingerprint BYTEA,\
+                analyzed_at TIMESTAMPTZ NOT NULL DEFAULT NOW()\
+          )");
+    PQclear(res);
+
+    // Artists, albums and genres are kept once each, for browsing, with how many
+    // tracks each has and how long they are kept up to date by tracks_tags_trg
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS artists (\
+                id SERIAL NOT NULL PRIMARY KEY,\
+                name TEXT NOT NULL UNIQUE,\
+                tracks INTEGER NOT NULL DEFAULT 0,\
+                duration DOUBLE PRECISION NOT NULL DEFAULT 0\
+          );\
+          CREATE TABLE IF NOT EXISTS albums (\
+                id SERIAL NOT NULL PRIMARY KEY,\
+                artist_id INTEGER NOT NULL REFERENCES artists (id),\
+                title TEXT NOT NULL,\
+                tracks INTEGER NOT NULL DEFAULT 0,\
+                duration DOUBLE PRECISION NOT NULL DEFAULT 0,\
+                UNIQUE (artist_id, title)\
+          );\
+          CREATE TABLE IF NOT EXISTS genres (\
+                id SERIAL NOT NULL PRIMARY KEY,\
+                name TEXT NOT NULL UNIQUE,\
+                tracks INTEGER NOT NULL DEFAULT 0,\
+                duration DOUBLE PRECISION NOT NULL DEFAULT 0\
+          )");
+    PQclear(res);
+
+    // Tracks whose tags haven't been read have no artist, album or genre.
+    // Libraries made before tags were kept take their lengths from their features
+    res = Exec(
+            "DO $tag_columns$ BEGIN\
+                IF NOT EXISTS (SELECT 1 FROM information_schema.columns WHERE table_schema = current_schema()\
+                               AND table_name = 'tracks' AND column_name = 'artist_id') THEN\
+                    ALTER TABLE tracks\
+                        ADD COLUMN title TEXT NOT NULL DEFAULT '',\
+                        ADD COLUMN number INTEGER NOT NULL DEFAULT 0,\
+                        ADD COLUMN duration REAL NOT NULL DEFAULT 0,\
+                        ADD COLUMN artist_id INTEGER REFERENCES artists (id),\
+                        ADD COLUMN album_id INTEGER REFERENCES albums (id),\
+                        ADD COLUMN genre_id INTEGER REFERENCES genres (id);\
+                    UPDATE tracks SET duration = track_features.duration FROM track_features\
+                        WHERE track_features.track_id = tracks.id AND track_features.decoded;\
+                END IF;\
+            END $tag_columns$;");
+    PQclear(res);
+
+    // Every level of browsing is a walk along one of these from where the last page ended
+    res = Exec(
+            "CREATE INDEX IF NOT EXISTS artists_browse_idx ON artists (name, id);\
+            CREATE INDEX IF NOT EXISTS genres_browse_idx ON genres (name, id);\
+            CREATE INDEX IF NOT EXISTS albums_browse_idx ON albums (title, id);\
+            CREATE INDEX IF NOT EXISTS albums_artist_idx ON albums (artist_id, title, id);\
+            CREATE INDEX IF NOT EXISTS tracks_album_idx ON tracks (album_id, number, title, id);\
+            CREATE INDEX IF NOT EXISTS tracks_artist_idx ON tracks (artist_id);\
+            CREATE INDEX IF NOT EXISTS tracks_genre_idx ON tracks (genre_id);\
+            CREATE INDEX IF NOT EXISTS tracks_untagged_idx ON tracks (id) WHERE artist_id IS NULL");
+    PQclear(res);
+
+    // Background jobs that haven't finished yet; see CScheduler
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS jobs (\
+                id BIGSERIAL NOT NULL PRIMARY KEY,\
+                kind TEXT NOT NULL,\
+                argument TEXT NOT NULL,\
+                priority INTEGER NOT NULL,\
+                state SMALLINT NOT NULL,\
+                progress TEXT NOT NULL,\
+                updated_at TIMESTAMPTZ NOT NULL DEFAULT NOW()\
+          )");
+    PQclear(res);
+
+    // What's on each playlist is added up as tracks go on and come off, with
+    // how many of its tracks each artist and album has, so the distinct ones
+    // are counted without looking through the playlist
+    res = Exec(
+            "CREATE TABLE IF NOT EXISTS playlist_artists (\
+                playlist_id INTEGER NOT NULL,\
+                artist_id INTEGER NOT NULL,\
+                tracks INTEGER NOT NULL,\
+                PRIMARY KEY (playlist_id, artist_id)\
+          );\
+          CREATE TABLE IF NOT EXISTS playlist_albums (\
+                playlist_id INTEGER NOT NULL,\
+                album_id INTEGER NOT NULL,\
+                tracks INTEGER NOT NULL,\
+                PRIMARY KEY (playlist_id, album_id)\
+          );\
+          CREATE INDEX IF NOT EXISTS tracks_playlists_track_idx ON tracks_playlists (track_id)");
+    PQclear(res);
+
+    // Add a track to a playlist's totals, or take it away, in a handful of index lookups
+    res = Exec(
+            "CREATE OR REPLACE FUNCTION playlist_tally(pid INTEGER, times INTEGER, track_duration DOUBLE PRECISION,\
+                track_bytes BIGINT, artist INTEGER, album INTEGER) RETURNS VOID\
+            LANGUAGE plpgsql\
+            AS $playlist_tally$\
+            DECLARE\
+                left_over INTEGER;\
+                new_artists INTEGER := 0;\
+                new_albums INTEGER := 0;\
+            BEGIN\
+                IF artist IS NOT NULL THEN\
+                    INSERT INTO playlist_artists VALUES (pid, artist, times)\
+                        ON CONFLICT (playlist_id, artist_id) DO UPDATE SET tracks = playlist_artists.tracks + times\
+                        RETURNING tracks INTO left_over;\
+                    IF left_over <= 0 THEN\
+                        DELETE FROM playlist_artists WHERE playlist_id = pid AND artist_id = artist;\
+                        new_artists := -1;\
+                    ELSIF left_over = times THEN\
+                        new_artists := 1;\
+                    END IF;\
+                END IF;\
+                IF album IS NOT NULL THEN\
+                    INSERT INTO playlist_albums VALUES (pid, album, times)\
+                        ON CONFLICT (playlist_id, album_id) DO UPDATE SET tracks = playlist_albums.tracks + times\
+                        RETURNING tracks INTO left_over;\
+                    IF left_over <= 0 THEN\
+                        DELETE FROM playlist_albums WHERE playlist_id = pid AND album_id = album;\
+                        new_albums := -1;\
+                    ELSIF left_over = times THEN\
+                        new_albums := 1;\
+                    END IF;\
+                END IF;\
+                UPDATE playlists SET length = length + times, duration = duration + times * track_duration,\
+                    bytes = bytes + times * track_bytes, artists = artists + new_artists, albums = albums + new_albums\
+                    WHERE id = pid;\
+            END;\
+            $playlist_tally$;");
+    PQclear(res);
+
+    // Add a playlist up from scratch, for after a batch or a restore
+    res = Exec(
+            "CREATE OR REPLACE FUNCTION playlist_recount(pid INTEGER) RETURNS VOID\
+            LANGUAGE plpgsql\
+            AS $playlist_recount$\
+            BEGIN\
+                DELETE FROM playlist_artists WHERE playlist_id = pid;\
+                DELETE FROM playlist_albums WHERE playlist_id = pid;\
+                INSERT INTO playlist_artists SELECT pid, tracks.artist_id, COUNT(*)\
+                    FROM tracks_playlists JOIN tracks ON tracks.id = tracks_playlists.track_id\
+                    WHERE tracks_playlists.playlist_id = pid AND tracks.artist_id IS NOT NULL GROUP BY tracks.artist_id;\
+                INSERT INTO playlist_albums SELECT pid, tracks.album_id, COUNT(*)\
+                    FROM tracks_playlists JOIN tracks ON tracks.id = tracks_playlists.track_id\
+                    WHERE tracks_playlists.playlist_id = pid AND tracks.album_id IS NOT NULL GROUP BY tracks.album_id;\
+                UPDATE playlists SET length = Sub.length, duration = Sub.duration, bytes = Sub.bytes,\
+                    artists = (SELECT COUNT(*) FROM playlist_artists WHERE playlist_id = pid),\
+                    albums = (SELECT COUNT(*) FROM playlist_albums WHERE playlist_id = pid)\
+                    FROM (SELECT COUNT(*) AS length, COALESCE(SUM(tracks.duration), 0) AS duration,\
+                            COALESCE(SUM(tracks.bytes), 0) AS bytes\
+                          FROM tracks_playlists LEFT JOIN tracks ON tracks.id = tracks_playlists.track_id\
+                          WHERE tracks_playlists.playlist_id = pid) AS Sub\
+                    WHERE playlists.id = pid;\
+            END;\
+            $playlist_recount$;");
+    PQclear(res);
+
+    // Libraries made before playlists were added up are added up once here
+    res = Exec(
+            "DO $playlist_totals$ BEGIN\
+                IF NOT EXISTS (SELECT 1 FROM information_schema.columns WHERE table_schema = current_schema()\
+                               AND table_name = 'playlists' AND column_name = 'bytes') THEN\
+                    ALTER TABLE playlists\
+                        ADD COLUMN duration DOUBLE PRECISION NOT NULL DEFAULT 0,\
+                        ADD COLUMN bytes BIGINT NOT NULL DEFAULT 0,\
+                        ADD COLUMN artists INTEGER NOT NULL DEFAULT 0,\
+                        ADD COLUMN albums INTEGER NOT NULL DEFAULT 0;\
+                    ALTER TABLE tracks ADD COLUMN IF NOT EXISTS bytes BIGINT NOT NULL DEFAULT 0;\
+                    PERFORM playlist_recount(id) FROM playlists;\
+                END IF;\
+            END $playlist_totals$;");
+    PQclear(res);
+
+    // Create a function to adjust the totals of a playlist
+    // A playlist batch sets musicmanager.defer_length for its transaction
+    // and recounts the playlist itself once on commit
+    res = Exec(
+            "CREATE OR REPLACE FUNCTION tracks_playlists_insert_func() RETURNS TRIGGER\
+            LANGUAGE plpgsql\
+            AS $tracks_playlists_insert_func$\
+            DECLARE\
+                membership tracks_playlists;\
+                times INTEGER;\
+                track tracks;\
+            BEGIN\
+                IF current_setting('musicmanager.defer_length', true) = 'on' THEN RETURN NULL;\
+                END IF;\
+                IF (TG_OP = 'INSERT') THEN membership := NEW; times := 1;\
+                ELSE membership := OLD; times := -1;\
+                END IF;\
+                SELECT * INTO track FROM tracks WHERE id = membership.track_id;\
+                PERFORM playlist_tally(membership.playlist_id, times, COALESCE(track.duration, 0),\
+                                       COALESCE(track.bytes, 0), track.artist_id, track.album_id);\
+                RETURN NULL;\
+            END;\
+            $tracks_playlists_insert_func$;");
+    PQclear(res);
+
+    // Create a trigger to adjust the totals of a playlist on each insert or delete
+    res = Exec(
+            "CREATE TRIGGER tracks_playlists_insert_trg\
+            AFTER INSERT OR DELETE ON tracks_playlists\
+            FOR EACH ROW EXECUTE PROCEDURE tracks_playlists_insert_func();");
+    PQclear(res);
+
+    // Move a track's count and length from the artist, album and genre it was in
+    // to the ones it's in now; each change costs the same however big they are.
+    // The playlists it's on are found by tracks_playlists_track_idx and moved the same way
+    res = Exec(
+            "CREATE OR REPLACE FUNCTION tracks_tags_func() RETURNS TRIGGER\
+            LANGUAGE plpgsql\
+            AS $tracks_tags_func$\
+            DECLARE\
+                pid INTEGER;\
+            BEGIN\
+                IF TG_OP <> 'INSERT' AND OLD.artist_id IS NOT NULL THEN\
+                    UPDATE artists SET tracks = tracks - 1, duration = duration - OLD.duration WHERE id = OLD.artist_id;\
+                    UPDATE albums SET tracks = tracks - 1, duration = duration - OLD.duration WHERE id = OLD.album_id;\
+                    UPDATE genres SET tracks = tracks - 1, duration = duration - OLD.duration WHERE id = OLD.genre_id;\
+                END IF;\
+                IF TG_OP <> 'DELETE' AND NEW.artist_id IS NOT NULL THEN\
+                    UPDATE artists SET tracks = tracks + 1, duration = duration + NEW.duration WHERE id = NEW.artist_id;\
+                    UPDATE albums SET tracks = tracks + 1, duration = duration + NEW.duration WHERE id = NEW.album_id;\
+                    UPDATE genres SET tracks = tracks + 1, duration = duration + NEW.duration WHERE id = NEW.genre_id;\
+                END IF;\
+                IF TG_OP = 'UPDATE' AND (OLD.duration, OLD.bytes, OLD.artist_id, OLD.album_id)\
+                                        IS DISTINCT FROM (NEW.duration, NEW.bytes, NEW.artist_id, NEW.album_id) THEN\
+                    FOR pid IN SELECT playlist_id FROM tracks_playlists WHERE track_id = NEW.id LOOP\
+                        PERFORM playlist_tally(pid, -1, OLD.duration, OLD.bytes, OLD.artist_id, OLD.album_id);\
+                        PERFORM playlist_tally(pid, 1, NEW.duration, NEW.bytes, NEW.artist_id, NEW.album_id);\
+                    END LOOP;\
+                END IF;\
+                RETURN NULL;\
+            END;\
+            $tracks_tags_func$;");
+    PQclear(res);
+
+    res = Exec(
+            "DROP TRIGGER IF EXISTS tracks_tags_trg ON tracks;\
+            CREATE TRIGGER tracks_tags_trg\
+            AFTER INSERT OR DELETE OR UPDATE OF artist_id, album_id, genre_id, duration, bytes ON tracks\
+            FOR EACH ROW EXECUTE PROCEDURE tracks_tags_func();");
+    PQclear(res);
+
+    // Create a default playlist for all songs to be added to
+    res = Exec("INSERT INTO playlists (title) VALUES ('library')");
+    PQclear(res);
+
+    return 0;
+}
+
+/**
+ * \brief Destroy all database objects used in this application
+ *
+ * \returns -1 if something goes wrong? I don't know what or why, frankly.
+ */
+int CPostgresStorage::DestroyDatabase()
+{
+    PGresult *res;
+    res = Exec("DROP TRIGGER IF EXISTS tracks_playlists_insert_trg ON tracks_playlists;");
+    PQclear(res);
+
+    res = Exec("DROP FUNCTION IF EXISTS tracks_playlists_insert_func() CASCADE;");
+    PQclear(res);
+
+    res = Exec("DROP FUNCTION IF EXISTS tracks_tags_func() CASCADE;");
+    PQclear(res);
+
+    res = Exec("DROP FUNCTION IF EXISTS playlist_tally(INTEGER, INTEGER, DOUBLE PRECISION, BIGINT, INTEGER, INTEGER),\
+            playlist_recount(INTEGER);");
+    PQclear(res);
+
+    res = Exec("DROP VIEW IF EXISTS track_paths;");
+    PQclear(res);
+
+    res = Exec("DROP TABLE IF EXISTS tracks, directories, albums, artists, genres;");
+    PQclear(res);
+
+    res = Exec("DROP FUNCTION IF EXISTS path_directory(TEXT), path_basename(TEXT);");
+    PQclear(res);
+
+    res = Exec("DROP TABLE IF EXISTS playlists;");
+    PQclear(res);
+
+    res = Exec("DROP TABLE IF EXISTS tracks_playlists, playlist_artists, playlist_albums;");
+    PQclear(res);
+
+    res = Exec("DROP TABLE IF EXISTS play_history, track_stats, track_features, jobs;");
+    PQclear(res);
+    mPartitions.clear();
+
+    return 0;
+}
+
+/**
+ * \brief Exposes the database connection status
+ * \returns PostgreSQL connection status object
+ */
+ConnStatusType CPostgresStorage::GetStatus()
+{
+    return PQstatus(mConnection);
+}
+
+/**
+ * \brief Returns a pointer to the connection object
+ */
+PGconn* CPostgresStorage::GetConnection()
+{
+    return mConnection;
+}
+
+/**
+ * \brief Returns where the server's write-ahead log has got to
+ * \returns LSN as a number, or -1 if it can't be read
+ *
+ * The insert position rather than the flushed one, so it's past the
+ * commit of anything this connection has committed even with
+ * synchronous_commit off.
+ */
+long long CPostgresStorage::GetWritePosition()
+{
+    PGresult *res = Exec("SELECT (pg_current_wal_insert_lsn() - '0/0')::TEXT");
+    long long position = PQntuples(res) == 1 ? atoll(PQgetvalue(res, 0, 0)) : -1;
+    PQclear(res);
+
+    return position;
+}
+
+/**
+ * \brief Returns how far a standby has replayed its primary's write-ahead log
+ * \returns LSN as a number, or -1 if it can't be read
+ *
+ * A server that isn't a standby has seen all of its own writes, so
+ * it gives its write position instead.
+ */
+long long CPostgresStorage::GetReplayPosition()
+{
+    PGresult *res = Exec("SELECT (CASE WHEN pg_is_in_recovery() THEN pg_last_wal_replay_lsn() "
+                         "ELSE pg_current_wal_insert_lsn() END - '0/0')::TEXT");
+    long long position = PQntuples(res) == 1 && !PQgetisnull(res, 0, 0) ? atoll(PQgetvalue(res, 0, 0)) : -1;
+    PQclear(res);
+
+    return position;
+}
+
+/// Adds a track and puts it on the end of the library playlist; updating a directory that's there already is what gets its id back
+static constexpr CStatement<Column<long>, std::string> ADD_TRACK{"add_track",
+        "WITH Directory AS (\
+            INSERT INTO directories (path) VALUES (path_directory($1))\
+            ON CONFLICT (path) DO UPDATE SET path = EXCLUDED.path RETURNING id\
+        ), New AS (\
+            INSERT INTO tracks (directory_id, basename) SELECT id, path_basename($1) FROM Directory RETURNING id\
+        ), Library AS (\
+            INSERT INTO tracks_playlists (track_id, playlist_id, position)\
+            SELECT New.id, 1, Last.position + 1\
+            FROM New, (SELECT COALESCE(MAX(position), 0) AS position FROM tracks_playlists WHERE playlist_id=1) AS Last\
+        )\
+        SELECT id FROM New"};
+
+/**
+ * \brief Add a track to the database
+ * \param filepath The filepath of the file to be added
+ * \returns The ID of the new track (as a string)
+ *
+ * This method also adds the track to the all-library playlist created on database setup
+ */
+std::string CPostgresStorage::AddTrack(std::string filepath)
+{
+    long id = 0;
+    PGresult *res = Run(ADD_TRACK, filepath);
+    ReadRow<Column<long>>(res, id);
+    PQclear(res);
+
+    return std::to_string(id);
+}
+
+/**
+ * \brief Add several tracks to the database
+ * \param filepaths The filepaths of the files to be added
+ * \returns The IDs of the new tracks, in the same order, or none if something goes wrong
+ *
+ * The tracks and their library memberships go in with one statement,
+ * and the library's totals are tallied a row at a time as they do.
+ */
+std::vector<std::string> CPostgresStorage::AddTracks(const std::vector<std::string> &filepaths)
+{
+    std::vector<std::string> ids;
+    if (filepaths.empty())
+    {
+        return ids;
+    }
+
+    std::string array = TextArray(filepaths);
+
+    PGresult *res = Exec("WITH Paths AS (\
+                SELECT path_directory(filepath) AS directory, path_basename(filepath) AS basename, ord\
+                FROM unnest($1::TEXT[]) WITH ORDINALITY AS Given(filepath, ord)\
+            ), Dirs AS (\
+                INSERT INTO directories (path) SELECT DISTINCT directory FROM Paths\
+                ON CONFLICT (path) DO UPDATE SET path = EXCLUDED.path RETURNING id, path\
+            ), New AS (\
+                INSERT INTO tracks (directory_id, basename)\
+                SELECT Dirs.id, Paths.basename FROM Paths JOIN Dirs ON Dirs.path = Paths.directory ORDER BY Paths.ord\
+                RETURNING id\
+            ), Library AS (\
+                INSERT INTO tracks_playlists (track_id, playlist_id, position)\
+                SELECT New.id, 1, Last.position + ROW_NUMBER() OVER (ORDER BY New.id)\
+                FROM New, (SELECT COALESCE(MAX(position), 0) AS position FROM tracks_playlists WHERE playlist_id=1) AS Last\
+            )\
+            SELECT id FROM New ORDER BY id",
+            array);
+
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+        PQclear(res);
+        return ids;
+    }
+
+    // Ids come from one sequence in insertion order
+    ids.reserve(PQntuples(res));
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        ids.push_back(PQgetvalue(res, i, 0));
+    }
+    PQclear(res);
+
+    return ids;
+}
+
+/// Adds a playlist
+static constexpr CStatement<Column<long>, std::string> ADD_PLAYLIST{"add_playlist",
+        "INSERT INTO playlists (title) VALUES ($1) RETURNING id"};
+
+/**
+ * \brief Add a playlist to the database
+ * \param title The title of the playlist to be added
+ * \returns The ID of the new playlist (as a string)
+ */
+std::string CPostgresStorage::AddPlaylist(std::string title)
+{
+    long id = 0;
+    PGresult *res = Run(ADD_PLAYLIST, title);
+    ReadRow<Column<long>>(res, id);
+    PQclear(res);
+
+    return std::to_string(id);
+}
+
+/**
+ * \brief Removes a track from the database, and all records of the track's playlist membership
+ * \param id ID of the track to be deleted
+ */
+void CPostgresStorage::RemoveTrack(std::string id)
+{
+    // Memberships first, so the playlists can still see what they're taking off
+    std::string query = "DELETE FROM tracks_playlists WHERE track_id=";
+
+    char escaped_id[30];
+    PQescapeStringConn(mConnection, escaped_id, id.c_str(), 30, 0);
+    query.append(escaped_id);
+    query.append("; DELETE FROM tracks WHERE id=");
+    query.append(escaped_id);
+    // History stays, it's append-only
+    query.append("; DELETE FROM track_stats WHERE track_id=");
+    query.append(escaped_id);
+    query.append("; DELETE FROM track_features WHERE track_id=");
+    query.append(escaped_id);
+
+    PGresult *res = Exec(query.c_str());
+    PQclear(res);
+
+    // We need to now normalize every playlist
+    // Ideally we'll only normalize those playlists the track was actually in
+    // but I'll do that some other day
+    res = Exec("SELECT id FROM playlists");
+    int n = PQntuples(res);
+    for (int i = 0; i < n; ++i)
+    {
+        Normalize(PQgetvalue(res, i, 0));
+    }
+    PQclear(res);
+}
+
+/**
+ * \brief Removes a playlist from the database, and all records of membership in the playlist
+ * \param id ID of the playlist to be deleted
+ */
+void CPostgresStorage::RemovePlaylist(std::string id)
+{
+    std::string query = "DELETE FROM playlists WHERE id=";
+
+    char escaped_id[30];
+    PQescapeStringConn(mConnection, escaped_id, id.c_str(), 30, 0);
+    query.append(escaped_id);
+    query.append("; DELETE FROM tracks_playlists WHERE playlist_id=");
+    query.append(escaped_id);
+    query.append("; DELETE FROM playlist_artists WHERE playlist_id=");
+    query.append(escaped_id);
+    query.append("; DELETE FROM playlist_albums WHERE playlist_id=");
+    query.append(escaped_id);
+
+    PGresult *res = Exec(query.c_str());
+    PQclear(res);
+}
+
+/// A playlist's title and stored length
+struct PlaylistHead
+{
+    std::string title;      ///< Title
+    long length = 0;        ///< Stored length
+};
+
+/// Reads a playlist's title and length
+static constexpr CStatement<Columns<&PlaylistHead::title, &PlaylistHead::length>, long> LOAD_PLAYLIST{
+        "load_playlist", "SELECT title, length FROM playlists WHERE id=$1"};
+
+/// A track on a playlist, and where
+struct Membership
+{
+    long track = 0;         ///< ID of the track
+    double position = 0;    ///< Its position
+};
+
+/// Reads a playlist's tracks, in order
+static constexpr CStatement<Columns<&Membership::track, &Membership::position>, long> LOAD_PLAYLIST_TRACKS{
+        "load_playlist_tracks", "SELECT track_id, position FROM tracks_playlists WHERE playlist_id=$1 ORDER BY position"};
+
+/**
+ * \brief Read a playlist and its track IDs
+ * \param id ID of the playlist
+ * \param title Filled in with the title
+ * \param length Filled in with the stored length
+ * \param tracks Filled in with the track IDs, in order
+ * \returns false if there is no such playlist
+ *
+ * Playlists with gaps in their positions, left by older versions,
+ * are normalized on the way through.
+ */
+bool CPostgresStorage::LoadPlaylist(std::string id, std::string &title, std::string &length,
+                                    std::vector<std::string> &tracks)
+{
+    long pid = atol(id.c_str());
+
+    PlaylistHead head;
+    PGresult *res = Run(LOAD_PLAYLIST, pid);
+    int found = ReadRow<Columns<&PlaylistHead::title, &PlaylistHead::length>>(res, head);
+    PQclear(res);
+
+    if (found < 0)
+    {
+        return false;
+    }
+
+    title = head.title;
+    length = std::to_string(head.length);
+
+    std::vector<Membership> rows;
+    res = Run(LOAD_PLAYLIST_TRACKS, pid);
+    ReadRows<Columns<&Membership::track, &Membership::position>>(res, rows);
+    PQclear(res);
+
+    bool dense = true;
+    tracks.clear();
+    tracks.reserve(rows.size());
+    for (size_t i = 0; i < rows.size(); ++i)
+    {
+        tracks.push_back(std::to_string(rows[i].track));
+        dense = dense && rows[i].position == i + 1;
+    }
+
+    if (!dense)
+    {
+        Normalize(id);
+    }
+
+    return true;
+}
+
+/// A playlist's title and length, and one of a run of its tracks
+struct RangeRow
+{
+    std::string title;      ///< Title
+    long length = 0;        ///< Stored length
+    long track = 0;         ///< ID of the track, or 0 if the run is empty
+};
+
+/// Reads a playlist's title and length, and the tracks from one position up to (not including) another
+static constexpr CStatement<Columns<&RangeRow::title, &RangeRow::length, &RangeRow::track>, long, int, long>
+        LOAD_PLAYLIST_RANGE{"load_playlist_range",
+        "SELECT title, length, Range.track_id FROM playlists LEFT JOIN LATERAL (\
+            SELECT track_id, position FROM tracks_playlists WHERE playlist_id = playlists.id\
+            AND position >= $2 AND position < $3\
+            ORDER BY position) AS Range ON TRUE WHERE playlists.id = $1 ORDER BY Range.position"};
+
+/**
+ * \brief Read a playlist's title and length, and a run of its tracks
+ * \param id ID of the playlist
+ * \param position Position of the first track to read
+ * \param count Number of tracks to read at most
+ * \param title Filled in with the title
+ * \param length Filled in with the stored length
+ * \param tracks Filled in with the track IDs, in order
+ * \returns false if there is no such playlist
+ *
+ * Both come back from one round trip. Positions run 1..n, so the run
+ * is a range scan rather than an OFFSET.
+ */
+bool CPostgresStorage::LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                         std::string &length, std::vector<std::string> &tracks)
+{
+    position = std::max(position, 1);
+
+    std::vector<RangeRow> rows;
+    PGresult *res = Run(LOAD_PLAYLIST_RANGE, atol(id.c_str()), position, (long)position + count);
+    ReadRows<Columns<&RangeRow::title, &RangeRow::length, &RangeRow::track>>(res, rows);
+    PQclear(res);
+
+    if (rows.empty())
+    {
+        return false;
+    }
+
+    title = rows[0].title;
+    length = std::to_string(rows[0].length);
+
+    tracks.clear();
+    for (const RangeRow &row : rows)
+    {
+        if (row.track)
+        {
+            tracks.push_back(std::to_string(row.track));
+        }
+    }
+
+    return true;
+}
+
+/// How a playlist's totals are read
+typedef Columns<&CStorage::PlaylistTotals::tracks, &CStorage::PlaylistTotals::duration,
+                &CStorage::PlaylistTotals::bytes, &CStorage::PlaylistTotals::artists,
+                &CStorage::PlaylistTotals::albums> TotalsColumns;
+
+/// Reads a playlist's totals
+static constexpr CStatement<TotalsColumns, long> GET_PLAYLIST_TOTALS{"get_playlist_totals",
+        "SELECT length, duration, bytes, artists, albums FROM playlists WHERE id = $1"};
+
+/**
+ * \brief Read what's on a playlist, added up
+ * \param id ID of the playlist
+ * \returns Its totals, all 0 if there is no such playlist
+ *
+ * One row, kept up to date by tracks_playlists_insert_trg and tracks_tags_trg.
+ */
+CStorage::PlaylistTotals CPostgresStorage::GetPlaylistTotals(std::string id)
+{
+    PlaylistTotals totals;
+
+    PGresult *res = Run(GET_PLAYLIST_TOTALS, atol(id.c_str()));
+    if (ReadRow<TotalsColumns>(res, totals) < 0)
+    {
+        totals = PlaylistTotals();
+    }
+    PQclear(res);
+
+    return totals;
+}
+
+/**
+ * \brief Look up tracks by filepath
+ * \param filepaths The filepaths to look up
+ * \returns IDs of the tracks in the same order, or "" where there is no such track
+ *
+ * All of the filepaths go over in one query.
+ */
+std::vector<std::string> CPostgresStorage::FindTracks(const std::vector<std::string> &filepaths)
+{
+    std::vector<std::string> ids(filepaths.size());
+    if (filepaths.empty())
+    {
+        return ids;
+    }
+
+    std::string array = TextArray(filepaths);
+
+    PGresult *res = Exec("SELECT Paths.ord, MIN(tracks.id)\
+            FROM unnest($1::TEXT[]) WITH ORDINALITY AS Paths(filepath, ord)\
+            JOIN directories ON directories.path = path_directory(Paths.filepath)\
+            JOIN tracks ON tracks.directory_id = directories.id AND tracks.basename = path_basename(Paths.filepath)\
+            GROUP BY Paths.ord",
+            array);
+
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        ids[atol(PQgetvalue(res, i, 0)) - 1] = PQgetvalue(res, i, 1);
+    }
+    PQclear(res);
+
+    return ids;
+}
+
+/**
+ * \brief Look up the filepaths of tracks
+ * \param ids IDs of the tracks
+ * \returns Filepaths in the same order, or "" where there is no such track
+ */
+std::vector<std::string> CPostgresStorage::FindFilepaths(const std::vector<std::string> &ids)
+{
+    std::vector<std::string> filepaths(ids.size());
+    if (ids.empty())
+    {
+        return filepaths;
+    }
+
+    std::string array = IdArray(ids);
+
+    PGresult *res = Exec("SELECT Ids.ord, track_paths.filepath\
+            FROM unnest($1::INTEGER[]) WITH ORDINALITY AS Ids(id, ord)\
+            JOIN track_paths ON track_paths.id = Ids.id",
+            array);
+
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        filepaths[atol(PQgetvalue(res, i, 0)) - 1] = PQgetvalue(res, i, 1);
+    }
+    PQclear(res);
+
+    return filepaths;
+}
+
+/**
+ * \brief Move every track under one directory to another, keeping their ids
+ * \param from Directory the tracks are under now, ending in '/'
+ * \param to Directory to move them under, ending in '/'
+ * \returns Number of tracks moved, or -1 if something goes wrong
+ *
+ * Three statements in one transaction rewrite the directories under
+ * it, however many tracks there are:
+ *  - a directory moved onto one that stays put is merged into it, which
+ *    is the only time tracks themselves are written
+ *  - the rest are parked on paths ending in \x01, which no directory
+ *    has, since every path is either empty or ends in '/'
+ *  - the parked ones are given their new paths
+ *
+ * UNIQUE(path) is checked row by row, and ADD_TRACK's ON CONFLICT needs
+ * it that way, so parking is what keeps a directory from landing on
+ * one that hasn't moved out yet, e.g. when moving /a/ into /a/a/.
+ */
+long CPostgresStorage::RelocateRoot(std::string from, std::string to)
+{
+    std::vector<std::string> prefixes = {from, to};
+    bool outer = PQtransactionStatus(mConnection) == PQTRANS_IDLE;
+    PQclear(Exec(outer ? "BEGIN" : "SAVEPOINT relocate_root"));
+
+    long moved = -1;
+    PGresult *res = Exec("WITH Merging AS (\
+                SELECT Moving.id, directories.id AS into_id FROM directories AS Moving\
+                JOIN directories ON directories.path = $2::TEXT || substr(Moving.path, length($1::TEXT) + 1)\
+                WHERE starts_with(Moving.path, $1::TEXT) AND NOT starts_with(directories.path, $1::TEXT)\
+            ), Merged AS (\
+                UPDATE tracks SET directory_id = Merging.into_id FROM Merging\
+                WHERE tracks.directory_id = Merging.id RETURNING tracks.id\
+            ), Removed AS (\
+                DELETE FROM directories WHERE id IN (SELECT id FROM Merging)\
+            )\
+            SELECT COUNT(*) FROM Merged",
+            prefixes);
+    if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+    {
+        moved = atol(PQgetvalue(res, 0, 0));
+    }
+    PQclear(res);
+
+    if (moved >= 0)
+    {
+        res = Exec("UPDATE directories SET path = path || chr(1) WHERE starts_with(path, $1::TEXT)", from);
+        moved = PQresultStatus(res) == PGRES_COMMAND_OK ? moved : -1;
+        PQclear(res);
+    }
+
+    if (moved >= 0)
+    {
+        res = Exec("WITH Renamed AS (\
+                    UPDATE directories\
+                    SET path = $2::TEXT || substr(path, length($1::TEXT) + 1, length(path) - length($1::TEXT) - 1)\
+                    WHERE starts_with(path, $1::TEXT) AND right(path, 1) = chr(1) RETURNING id\
+                )\
+                SELECT COUNT(*) FROM tracks WHERE directory_id IN (SELECT id FROM Renamed)",
+                prefixes);
+        moved = PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1 ? moved + atol(PQgetvalue(res, 0, 0)) : -1;
+        PQclear(res);
+    }
+
+    if (moved >= 0)
+    {
+        res = Exec(outer ? "COMMIT" : "RELEASE SAVEPOINT relocate_root");
+        moved = PQresultStatus(res) == PGRES_COMMAND_OK ? moved : -1;
+        PQclear(res);
+    }
+    if (moved < 0 && PQtransactionStatus(mConnection) != PQTRANS_IDLE)
+    {
+        PQclear(Exec(outer ? "ROLLBACK" : "ROLLBACK TO SAVEPOINT relocate_root; RELEASE SAVEPOINT relocate_root"));
+    }
+
+    return moved;
+}
+
+/**
+ * \brief Add a track, and append it to the library playlist, without blocking
+ * \param reactor Reactor to wait for the result in
+ * \param filepath The filepath of the track
+ * \returns Task yielding the ID of the new track, or "" if it couldn't be added
+ *
+ * It's the statement AddTrack() runs, so it's one round trip however
+ * many others are in the pipeline with it.
+ */
+CTask<std::string> CPostgresStorage::AddTrackAsync(CReactor *reactor, std::string filepath)
+{
+    if (!CanPipeline())
+    {
+        co_return AddTrack(filepath);
+    }
+
+    long id = 0;
+    PGresult *res = co_await RunAsync(reactor, ADD_TRACK, filepath);
+    bool added = ReadRow<Column<long>>(res, id) == 0;
+    PQclear(res);
+
+    co_return added ? std::to_string(id) : "";
+}
+
+/**
+ * \brief Add an empty playlist, without blocking
+ * \param reactor Reactor to wait for the result in
+ * \param title Title of the playlist
+ * \returns Task yielding the ID of the new playlist, or "" if it couldn't be added
+ */
+CTask<std::string> CPostgresStorage::AddPlaylistAsync(CReactor *reactor, std::string title)
+{
+    if (!CanPipeline())
+    {
+        co_return AddPlaylist(title);
+    }
+
+    long id = 0;
+    PGresult *res = co_await RunAsync(reactor, ADD_PLAYLIST, title);
+    bool added = ReadRow<Column<long>>(res, id) == 0;
+    PQclear(res);
+
+    co_return added ? std::to_string(id) : "";
+}
+
+/**
+ * \brief Read a playlist's title and length, and a run of its tracks, without blocking
+ * \param reactor Reactor to wait for the result in
+ * \param id ID of the playlist
+ * \param position Position of the first track to read
+ * \param count Number of tracks to read at most
+ * \returns Task yielding the playlist and the tracks
+ */
+CTask<CStorage::PlaylistRange> CPostgresStorage::LoadPlaylistRangeAsync(CReactor *reactor, std::string id,
+                                                                        int position, int count)
+{
+    PlaylistRange range;
+    if (!CanPipeline())
+    {
+        range.found = LoadPlaylistRange(id, position, count, range.title, range.length, range.tracks);
+        co_return range;
+    }
+
+    position = std::max(position, 1);
+
+    std::vector<RangeRow> rows;
+    PGresult *res = co_await RunAsync(reactor, LOAD_PLAYLIST_RANGE, atol(id.c_str()), position, (long)position + count);
+    ReadRows<Columns<&RangeRow::title, &RangeRow::length, &RangeRow::track>>(res, rows);
+    PQclear(res);
+
+    if (!rows.empty())
+    {
+        range.found = true;
+        range.title = rows[0].title;
+        range.length = std::to_string(rows[0].length);
+    }
+    for (const RangeRow &row : rows)
+    {
+        if (row.track)
+        {
+            range.tracks.push_back(std::to_string(row.track));
+        }
+    }
+
+    co_return range;
+}
+
+/// Puts a track on the end of a playlist
+static constexpr CStatement<Column<long>, long, long> APPEND_TRACK{"append_track",
+        "INSERT INTO tracks_playlists (playlist_id, track_id, position)\
+        SELECT $1, $2, COALESCE(MAX(position), 0) + 1 FROM tracks_playlists WHERE playlist_id=$1 RETURNING id"};
+
+/**
+ * \brief Append a track to a playlist
+ * \param playlist ID of the playlist
+ * \param track ID of the track
+ * \returns ID of the association record
+ */
+std::string CPostgresStorage::AppendTrack(std::string playlist, std::string track)
+{
+    long associationId = 0;
+    PGresult *res = Run(APPEND_TRACK, atol(playlist.c_str()), atol(track.c_str()));
+    ReadRow<Column<long>>(res, associationId);
+    PQclear(res);
+
+    return std::to_string(associationId);
+}
+
+/// Makes room at a position by shifting everything at or after it down one, and puts a track there
+static constexpr CStatement<Column<long>, long, long, int> INSERT_TRACK{"insert_track",
+        "WITH Shifted AS (\
+            UPDATE tracks_playlists SET position = position + 1 WHERE playlist_id=$1 AND position >= $3\
+        )\
+        INSERT INTO tracks_playlists (playlist_id, track_id, position) VALUES ($1, $2, $3) RETURNING id"};
+
+/**
+ * \brief Insert a track into a playlist
+ * \param playlist ID of the playlist
+ * \param track ID of the track
+ * \param position Position the track should occupy
+ * \returns ID of the association record
+ */
+std::string CPostgresStorage::InsertTrack(std::string playlist, std::string track, int position)
+{
+    long associationId = 0;
+    PGresult *res = Run(INSERT_TRACK, atol(playlist.c_str()), atol(track.c_str()), position);
+    ReadRow<Column<long>>(res, associationId);
+    PQclear(res);
+
+    return std::to_string(associationId);
+}
+
+/// Shifts everything at or after a position down by how many tracks there are, and puts them there
+static constexpr CStatement<NoRows, long, std::vector<long>, int> INSERT_TRACKS{"insert_tracks",
+        "WITH Shifted AS (\
+            UPDATE tracks_playlists SET position = position + cardinality($2) WHERE playlist_id=$1 AND position >= $3\
+        )\
+        INSERT INTO tracks_playlists (playlist_id, track_id, position)\
+        SELECT $1, t, $3 - 1 + ord FROM unnest($2) WITH ORDINALITY AS New(t, ord)"};
+
+/**
+ * \brief Insert several tracks into a playlist, in order
+ * \param playlist ID of the playlist
+ * \param tracks IDs of the tracks, which must be numeric
+ * \param position Position the first track should occupy
+ *
+ * The tracks after the position are shifted once, and all of the
+ * memberships go in with a single INSERT.
+ */
+void CPostgresStorage::InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position)
+{
+    // Track IDs go over as one binary array
+    std::vector<long> ids;
+    ids.reserve(tracks.size());
+    for (const std::string &id : tracks)
+    {
+        ids.push_back(atol(id.c_str()));
+    }
+
+    PQclear(Run(INSERT_TRACKS, atol(playlist.c_str()), ids, position));
+}
+
+/// Deletes the run from one position to another and closes the gap behind it
+static constexpr CStatement<NoRows, long, int, int> REMOVE_RANGE{"remove_range",
+        "WITH Removed AS (\
+            DELETE FROM tracks_playlists WHERE playlist_id=$1 AND position BETWEEN $2 AND $3\
+        )\
+        UPDATE tracks_playlists SET position = position - ($3 - $2 + 1) WHERE playlist_id=$1 AND position > $3"};
+
+/**
+ * \brief Remove a run of tracks from a playlist
+ * \param playlist ID of the playlist
+ * \param position Position of the first track to remove
+ * \param count Number of tracks to remove
+ */
+void CPostgresStorage::RemoveRange(std::string playlist, int position, int count)
+{
+    PQclear(Run(REMOVE_RANGE, atol(playlist.c_str()), position, position + count - 1));
+}
+
+/// Moves the run between two positions by one offset, and slides everything else between two others by another
+static constexpr CStatement<NoRows, long, int, int, int, int, int, int> MOVE_RANGE{"move_range",
+        "UPDATE tracks_playlists SET position = CASE WHEN position BETWEEN $2 AND $3 THEN position + $4\
+        ELSE position + $5 END WHERE playlist_id=$1 AND position BETWEEN $6 AND $7"};
+
+/**
+ * \brief Move a run of tracks within a playlist
+ * \param playlist ID of the playlist
+ * \param from Position of the first track to move
+ * \param count Number of tracks to move
+ * \param to Position the first track should end up at
+ *
+ * Only the rows between the old and new spots are touched, in one UPDATE.
+ */
+void CPostgresStorage::MoveRange(std::string playlist, int from, int count, int to)
+{
+    // The span that changes, and how far everything else in it slides
+    int low = std::min(from, to);
+    int high = std::max(from, to) + count - 1;
+    int shift = to < from ? count : -count;
+
+    PQclear(Run(MOVE_RANGE, atol(playlist.c_str()), from, from + count - 1, to - from, shift, low, high));
+}
+
+/// Gives each row the position of its old one in a list of them
+static constexpr CStatement<NoRows, long, std::vector<long>> REORDER{"reorder",
+        "UPDATE tracks_playlists AS Main SET position = New.position\
+        FROM unnest($2) WITH ORDINALITY AS New(old, position)\
+        WHERE Main.playlist_id=$1 AND Main.position = New.old AND Main.position <> New.position"};
+
+/**
+ * \brief Put every track in a playlist in a new order
+ * \param playlist ID of the playlist
+ * \param order The current positions of its tracks, in the order they're to go in
+ *
+ * One UPDATE, touching only the rows that change place.
+ */
+void CPostgresStorage::Reorder(std::string playlist, const std::vector<long> &order)
+{
+    PQclear(Run(REORDER, atol(playlist.c_str()), order));
+}
+
+/// Renumbers the rows of a playlist that are out of place
+static constexpr CStatement<NoRows, long> NORMALIZE{"normalize",
+        "WITH Sub AS (SELECT id, row_number() OVER (ORDER BY position) FROM tracks_playlists WHERE playlist_id=$1)\
+        UPDATE tracks_playlists AS Main SET position = Sub.row_number FROM Sub\
+        WHERE Main.id = Sub.id AND Main.position <> Sub.row_number"};
+
+/**
+ * \brief Normalize a playlist's positions to be all integers
+ * \param playlist ID of the playlist
+ *
+ * Edits keep positions running 1..n on their own, so this only
+ * rewrites rows whose position is out of place, e.g. playlists
+ * written by older versions that left gaps behind.
+ */
+void CPostgresStorage::Normalize(std::string playlist)
+{
+    PQclear(Run(NORMALIZE, atol(playlist.c_str())));
+}
+
+/**
+ * \brief Start a transaction, or a savepoint if one is already open
+ * \returns true if this started the transaction
+ *
+ * The playlist totals trigger is held off for the rest of the transaction.
+ */
+bool CPostgresStorage::BeginBatch()
+{
+    if (PQtransactionStatus(mConnection) == PQTRANS_IDLE)
+    {
+        PQclear(Exec("BEGIN; SET LOCAL musicmanager.defer_length = 'on'"));
+        return true;
+    }
+
+    PQclear(Exec("SAVEPOINT playlist_batch"));
+    return false;
+}
+
+/// Adds a playlist up again from scratch
+static constexpr CStatement<NoRows, long> RECOUNT{"recount", "SELECT playlist_recount($1::INTEGER)"};
+
+/**
+ * \brief Normalize a playlist, add it up again, and commit
+ * \param playlist ID of the playlist the batch edited
+ * \param outer Whether the batch started the transaction
+ * \returns -1 if something in the batch failed, or committing did
+ *
+ * A batch that can't be committed is rolled back, so the connection is
+ * never left in an aborted transaction.
+ */
+int CPostgresStorage::CommitBatch(std::string playlist, bool outer)
+{
+    long id = atol(playlist.c_str());
+    bool ok = PQtransactionStatus(mConnection) == PQTRANS_INTRANS;
+
+    if (ok)
+    {
+        PGresult *res = Run(NORMALIZE, id);
+        ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+    }
+    if (ok)
+    {
+        PGresult *res = Run(RECOUNT, id);
+        ok = PQresultStatus(res) == PGRES_TUPLES_OK;
+        PQclear(res);
+    }
+    if (ok)
+    {
+        PGresult *res = Exec(outer ? "COMMIT" : "RELEASE SAVEPOINT playlist_batch");
+        ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+    }
+
+    if (ok)
+    {
+        return 0;
+    }
+
+    // A COMMIT that fails ends the transaction itself
+    if (PQtransactionStatus(mConnection) != PQTRANS_IDLE)
+    {
+        RollbackBatch(outer);
+    }
+    mPartitions.clear();
+    return -1;
+}
+
+/**
+ * \brief Roll back a transaction or savepoint
+ * \param outer Whether the batch started the transaction
+ */
+void CPostgresStorage::RollbackBatch(bool outer)
+{
+    if (outer)
+    {
+        PQclear(Exec("ROLLBACK"));
+    }
+    else
+    {
+        PQclear(Exec("ROLLBACK TO SAVEPOINT playlist_batch; RELEASE SAVEPOINT playlist_batch"));
+    }
+
+    // Any partitions made in the batch are gone too
+    mPartitions.clear();
+}
+
+/**
+ * \brief Run a statement, counting it
+ * \param query The statement
+ * \returns The result, to be PQclear()ed
+ */
+PGresult *CPostgresStorage::Exec(const char *query)
+{
+    auto start = std::chrono::steady_clock::now();
+    PGresult *res = PQexec(mConnection, query);
+    Count(query, strlen(query), mStats ? ResultBytes(res) : 0, start);
+    return res;
+}
+
+/**
+ * \brief Run a statement with one text parameter, counting it
+ * \param query The statement, using $1 for the parameter
+ * \param param The parameter
+ * \returns The result, to be PQclear()ed
+ */
+PGresult *CPostgresStorage::Exec(const char *query, const std::string &param)
+{
+    const char *params[1] = {param.c_str()};
+
+    auto start = std::chrono::steady_clock::now();
+    PGresult *res = PQexecParams(mConnection, query, 1, nullptr, params, nullptr, nullptr, 0);
+    Count(query, strlen(query) + param.size(), mStats ? ResultBytes(res) : 0, start);
+    return res;
+}
+
+/**
+ * \brief Run a statement with text parameters, counting it
+ * \param query The statement, using $1, $2 and so on for the parameters
+ * \param params The parameters
+ * \returns The result, to be PQclear()ed
+ */
+PGresult *CPostgresStorage::Exec(const char *query, const std::vector<std::string> &params)
+{
+    std::vector<const char *> values;
+    size_t sent = strlen(query);
+    for (const std::string &param : params)
+    {
+        values.push_back(param.c_str());
+        sent += param.size();
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    PGresult *res = PQexecParams(mConnection, query, values.size(), nullptr, values.data(), nullptr, nullptr, 0);
+    Count(query, sent, mStats ? ResultBytes(res) : 0, start);
+    return res;
+}
+
+/**
+ * \brief Run a prepared statement, preparing it first if it hasn't been on this connection
+ * \param name Name it's prepared under
+ * \param text Its SQL
+ * \param count Number of parameters
+ * \param types Oids of the parameters
+ * \param values Each parameter's bytes
+ * \param lengths How many bytes each one has
+ * \param formats Each one's format, 1 for binary
+ * \param sent Bytes of parameters, for the stats
+ * \returns The result, in binary, to be PQclear()ed
+ *
+ * Prepared statements outlive transactions, so one prepared inside a
+ * batch that's rolled back is still there. One that fails to prepare
+ * isn't remembered, and is tried again next time.
+ */
+PGresult *CPostgresStorage::RunPrepared(const char *name, const char *text, int count, const Oid *types,
+                                        const char *const *values, const int *lengths, const int *formats,
+                                        size_t sent)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    if (mPrepared.find(name) == mPrepared.end())
+    {
+        PGresult *res = PQprepare(mConnection, name, text, count, types);
+        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        {
+            Count(text, strlen(text), 0, start);
+            return res;
+        }
+        PQclear(res);
+        mPrepared.emplace(name);
+        sent += strlen(text);
+    }
+
+    PGresult *res = PQexecPrepared(mConnection, name, count, values, lengths, formats, 1);
+    Count(text, sent, mStats ? ResultBytes(res) : 0, start);
+    return res;
+}
+
+/**
+ * \brief Tell the stats about a statement, if anything is counting
+ * \param query The statement
+ * \param sent Bytes sent
+ * \param received Bytes received
+ * \param start When the statement was sent
+ */
+void CPostgresStorage::Count(const char *query, size_t sent, size_t received,
+                             std::chrono::steady_clock::time_point start)
+{
+    if (mStats)
+    {
+        auto micros = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start);
+        mStats->Statement(query, sent, received, micros.count());
+    }
+}
+
+/**
+ * \brief Send rows to the server with COPY ... FROM STDIN
+ * \param query The COPY statement
+ * \param rows The rows, in COPY's text format
+ * \returns -1 if something goes wrong
+ */
+int CPostgresStorage::Copy(const char *query, const std::string &rows)
+{
+    PGresult *res = Exec(query);
+    bool ready = PQresultStatus(res) == PGRES_COPY_IN;
+    PQclear(res);
+
+    if (!ready)
+    {
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    int sent = PQputCopyData(mConnection, rows.data(), rows.size());
+    PQputCopyEnd(mConnection, sent == 1 ? nullptr : "failed to send rows");
+
+    int status = 0;
+    while ((res = PQgetResult(mConnection)) != nullptr)
+    {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+        {
+            status = -1;
+        }
+        PQclear(res);
+    }
+    Count(query, rows.size(), 0, start);
+
+    return status;
+}
+
+/**
+ * \brief Whether the Async calls can use the pipelined connection
+ * \returns false if a transaction is open on the first connection, or
+ *          the pipelined one can't be opened
+ *
+ * Opens the pipelined connection the first time, blocking while it
+ * connects, as the first connection did.
+ */
+bool CPostgresStorage::CanPipeline()
+{
+    if (PQstatus(mConnection) != CONNECTION_OK || PQtransactionStatus(mConnection) != PQTRANS_IDLE)
+    {
+        return false;
+    }
+    if (mPipeline)
+    {
+        return true;
+    }
+
+    PGconn *conn = PQconnectdb(mConnInfo.c_str());
+    if (PQstatus(conn) == CONNECTION_OK && !mSetup.empty())
+    {
+        PQclear(PQexec(conn, mSetup.c_str()));
+    }
+    if (PQstatus(conn) != CONNECTION_OK || PQsetnonblocking(conn, 1) != 0 || PQenterPipelineMode(conn) != 1)
+    {
+        PQfinish(conn);
+        return false;
+    }
+    mPipeline = conn;
+    return true;
+}
+
+/**
+ * \brief Run a prepared statement on the pipelined connection, preparing it first if it hasn't been there
+ * \param reactor Reactor to wait in
+ * \param name Name it's prepared under
+ * \param text Its SQL
+ * \param count Number of parameters
+ * \param types Oids of the parameters
+ * \param values Each parameter's bytes
+ * \param lengths How many bytes each one has
+ * \param formats Each one's format, 1 for binary
+ * \param sent Bytes of parameters, for the stats
+ * \returns Task yielding the result, in binary, to be PQclear()ed, or nullptr if the connection failed
+ *
+ * The statement is queued straight away, behind its preparation if it
+ * needs one, with a sync of its own so an error in it doesn't abort the
+ * ones after it. Whatever the socket won't take yet is left to a
+ * FlushAsync(). A preparation that fails aborts the statement after it,
+ * and isn't remembered, so it's tried again next time.
+ */
+CTask<PGresult *> CPostgresStorage::RunPreparedAsync(CReactor *reactor, const char *name, const char *text, int count,
+                                                     const Oid *types, const char *const *values, const int *lengths,
+                                                     const int *formats, size_t sent)
+{
+    /// Waits for a statement's results to arrive
+    struct Arrival
+    {
+        Pending *pending;       ///< The statement
+
+        bool await_ready() { return pending->done; }
+        void await_suspend(std::coroutine_handle<> waiter) { pending->waiter = waiter; }
+        void await_resume() {}
+    };
+
+    auto start = std::chrono::steady_clock::now();
+    bool preparing = mPipelinePrepared.find(name) == mPipelinePrepared.end();
+    if ((preparing && !PQsendPrepare(mPipeline, name, text, count, types)) ||
+        !PQsendQueryPrepared(mPipeline, name, count, values, lengths, formats, 1) ||
+        !PQpipelineSync(mPipeline))
+    {
+        co_return nullptr;
+    }
+    if (preparing)
+    {
+        mPipelinePrepared.emplace(name);
+        sent += strlen(text);
+    }
+
+    Pending pending;
+    mPending.push_back(&pending);
+
+    if (!mWriting && PQflush(mPipeline) == 1)
+    {
+        reactor->Spawn(FlushAsync(reactor));
+    }
+    if (!mReading && !mPending.empty())
+    {
+        reactor->Spawn(ReadAsync(reactor));
+    }
+    co_await Arrival{&pending};
+
+    if (preparing && PQresultStatus(pending.result) == PGRES_PIPELINE_ABORTED)
+    {
+        mPipelinePrepared.erase(name);
+    }
+    Count(text, sent, mStats ? ResultBytes(pending.result) : 0, start);
+    co_return pending.result;
+}
+
+/**
+ * \brief Send what libpq is holding for the pipelined connection as the socket takes it
+ * \param reactor Reactor to wait in
+ * \returns Task that runs until nothing is left to send
+ *
+ * Only one coroutine can wait to write on the socket, so statements
+ * queued meanwhile just go out with the rest. If sending fails,
+ * reading will too, and says so.
+ */
+CTask<> CPostgresStorage::FlushAsync(CReactor *reactor)
+{
+    mWriting = true;
+    while (mPipeline && PQflush(mPipeline) == 1)
+    {
+        co_await reactor->Writable(PQsocket(mPipeline));
+    }
+    mWriting = false;
+}
+
+/**
+ * \brief Hand results from the pipelined connection to the statements waiting for them
+ * \param reactor Reactor to wait in
+ * \returns Task that runs until no statements are waiting
+ */
+CTask<> CPostgresStorage::ReadAsync(CReactor *reactor)
+{
+    mReading = true;
+    while (!mPending.empty())
+    {
+        // Each statement's results end with a null, then its sync
+        while (!mPending.empty() && !PQisBusy(mPipeline))
+        {
+            PGresult *res = PQgetResult(mPipeline);
+            if (!res)
+            {
+                continue;
+            }
+            if (PQresultStatus(res) != PGRES_PIPELINE_SYNC)
+            {
+                PQclear(mPending.front()->result);
+                mPending.front()->result = res;
+                continue;
+            }
+            PQclear(res);
+
+            Pending *pending = mPending.front();
+            mPending.pop_front();
+            pending->done = true;
+            if (pending->waiter)
+            {
+                pending->waiter.resume();
+            }
+        }
+        if (mPending.empty())
+        {
+            break;
+        }
+
+        co_await reactor->Readable(PQsocket(mPipeline));
+        if (!PQconsumeInput(mPipeline))
+        {
+            FailPipeline();
+        }
+    }
+    mReading = false;
+}
+
+/**
+ * \brief Give up on the pipelined connection
+ *
+ * Every statement waiting on it gets nullptr, and the next Async call
+ * connects again.
+ */
+void CPostgresStorage::FailPipeline()
+{
+    std::deque<Pending *> failed;
+    failed.swap(mPending);
+    PQfinish(mPipeline);
+    mPipeline = nullptr;
+    mPipelinePrepared.clear();
+
+    for (Pending *pending : failed)
+    {
+        PQclear(pending->result);
+        pending->result = nullptr;
+        pending->done = true;
+        if (pending->waiter)
+        {
+            pending->waiter.resume();
+        }
+    }
+}
+
+/**
+ * \brief Visit every track, ordered by filepath
+ * \param visit Called once per track
+ *
+ * Rows are streamed one at a time, so the whole table is never held in
+ * memory. visit must not use the connection.
+ */
+void CPostgresStorage::ReadTracks(const std::function<void(const TrackRecord &)> &visit)
+{
+    const char *query = "SELECT id, filepath, EXTRACT(EPOCH FROM date_added)::BIGINT FROM track_paths ORDER BY filepath";
+    auto start = std::chrono::steady_clock::now();
+    if (!PQsendQuery(mConnection, query))
+    {
+        return;
+    }
+    PQsetSingleRowMode(mConnection);
+
+    TrackRecord record;
+    PGresult *res;
+    size_t received = 0;
+    while ((res = PQgetResult(mConnection)) != nullptr)
+    {
+        if (PQresultStatus(res) == PGRES_SINGLE_TUPLE)
+        {
+            received += ResultBytes(res);
+            record.id = atol(PQgetvalue(res, 0, 0));
+            record.filepath = PQgetvalue(res, 0, 1);
+            record.dateAdded = atoll(PQgetvalue(res, 0, 2));
+            visit(record);
+        }
+        PQclear(res);
+    }
+    Count(query, strlen(query), received, start);
+}
+
+/**
+ * \brief Stream every track, ordered by id
+ * \returns Cursor over the tracks, to be deleted
+ *
+ * Only a chunk of rows is held at a time. Nothing else may use the
+ * connection until the cursor is finished or deleted.
+ */
+CStorage::Cursor<CStorage::TrackRecord> *CPostgresStorage::StreamTracks()
+{
+    static const char *query = "SELECT id, filepath, EXTRACT(EPOCH FROM date_added)::BIGINT FROM track_paths ORDER BY id";
+    auto start = std::chrono::steady_clock::now();
+    bool sent = PQsendQuery(mConnection, query);
+
+    return new CPostgresCursor<TrackRecord>(mConnection, sent,
+        [](const PGresult *res, int i, TrackRecord &track)
+        {
+            track.id = atol(PQgetvalue(res, i, 0));
+            track.filepath = PQgetvalue(res, i, 1);
+            track.dateAdded = atoll(PQgetvalue(res, i, 2));
+        },
+        [this, start](size_t received) { Count(query, strlen(query), received, start); });
+}
+
+/**
+ * \brief Stream a playlist's tracks, in order
+ * \param id ID of the playlist
+ * \returns Cursor over the tracks, to be deleted; empty if there's no such playlist
+ *
+ * Only a chunk of rows is held at a time. Nothing else may use the
+ * connection until the cursor is finished or deleted.
+ */
+CStorage::Cursor<CStorage::EntryRecord> *CPostgresStorage::StreamPlaylist(std::string id)
+{
+    static const char *query = "SELECT tracks_playlists.position, tracks.id, tracks.filepath\
+            FROM tracks_playlists JOIN track_paths AS tracks ON tracks.id = tracks_playlists.track_id\
+            WHERE tracks_playlists.playlist_id = $1::BIGINT ORDER BY tracks_playlists.position";
+    const char *params[1] = {id.c_str()};
+    auto start = std::chrono::steady_clock::now();
+    bool sent = PQsendQueryParams(mConnection, query, 1, nullptr, params, nullptr, nullptr, 0);
+
+    return new CPostgresCursor<EntryRecord>(mConnection, sent,
+        [](const PGresult *res, int i, EntryRecord &entry)
+        {
+            entry.position = atol(PQgetvalue(res, i, 0));
+            entry.track = atol(PQgetvalue(res, i, 1));
+            entry.filepath = PQgetvalue(res, i, 2);
+        },
+        [this, start, id](size_t received) { Count(query, strlen(query) + id.size(), received, start); });
+}
+
+/**
+ * \brief Visit every playlist, ordered by id
+ * \param visit Called once per playlist with its id, title and track ids in order
+ *
+ * Memberships are streamed one row at a time, so only one playlist's
+ * tracks are held in memory. visit must not use the connection.
+ */
+void CPostgresStorage::ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit)
+{
+    PGresult *res = Exec("SELECT id, title FROM playlists ORDER BY id");
+
+    std::vector<std::pair<long, std::string>> playlists;
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        playlists.push_back(std::make_pair(atol(PQgetvalue(res, i, 0)), std::string(PQgetvalue(res, i, 1))));
+    }
+    PQclear(res);
+
+    const char *query = "SELECT playlist_id, track_id FROM tracks_playlists ORDER BY playlist_id, position";
+    auto start = std::chrono::steady_clock::now();
+    if (!PQsendQuery(mConnection, query))
+    {
+        return;
+    }
+    PQsetSingleRowMode(mConnection);
+
+    // Memberships come in playlist order, so walk the playlists alongside them
+    size_t current = 0;
+    size_t received = 0;
+    std::vector<long> tracks;
+    while ((res = PQgetResult(mConnection)) != nullptr)
+    {
+        if (PQresultStatus(res) == PGRES_SINGLE_TUPLE)
+        {
+            received += ResultBytes(res);
+            long playlist = atol(PQgetvalue(res, 0, 0));
+            while (current < playlists.size() && playlists[current].first < playlist)
+            {
+                visit(playlists[current].first, playlists[current].second, tracks);
+                tracks.clear();
+                ++current;
+            }
+            if (current < playlists.size() && playlists[current].first == playlist)
+            {
+                tracks.push_back(atol(PQgetvalue(res, 0, 1)));
+            }
+        }
+        PQclear(res);
+    }
+
+    Count(query, strlen(query), received, start);
+
+    for (; current < playlists.size(); ++current)
+    {
+        visit(playlists[current].first, playlists[current].second, tracks);
+        tracks.clear();
+    }
+}
+
+/**
+ * \brief Empty the database to have a library restored into it
+ * \returns -1 if something goes wrong
+ *
+ * The restore happens in one transaction, with the length trigger held
+ * off until EndRestore().
+ */
+int CPostgresStorage::BeginRestore()
+{
+    PrepareDatabase();
+
+    PGresult *res = Exec(
+            "BEGIN; SET LOCAL musicmanager.defer_length = 'on';\
+            TRUNCATE tracks, directories, artists, albums, genres, playlists, tracks_playlists,\
+                playlist_artists, playlist_albums RESTART IDENTITY");
+    int status = PQresultStatus(res) == PGRES_COMMAND_OK ? 0 : -1;
+    PQclear(res);
+
+    return status;
+}
+
+/**
+ * \brief Restore tracks, keeping their ids
+ * \param tracks The tracks
+ */
+void CPostgresStorage::RestoreTracks(const std::vector<TrackRecord> &tracks)
+{
+    std::string rows;
+    for (const TrackRecord &track : tracks)
+    {
+        rows.append(std::to_string(track.id));
+        rows.push_back('\t');
+        AppendCopyField(track.filepath, rows);
+        rows.push_back('\t');
+        AppendTimestamp(track.dateAdded, rows);
+        rows.push_back('\n');
+    }
+
+    // Whole filepaths go in beside the tracks, to be split up from there
+    PGresult *res = Exec("CREATE TEMP TABLE IF NOT EXISTS restored_tracks\
+            (id INTEGER, filepath TEXT, date_added TIMESTAMPTZ) ON COMMIT DROP");
+    PQclear(res);
+
+    Copy("COPY restored_tracks (id, filepath, date_added) FROM STDIN", rows);
+
+    res = Exec(
+            "INSERT INTO directories (path) SELECT DISTINCT path_directory(filepath) FROM restored_tracks\
+                ON CONFLICT (path) DO NOTHING;\
+            INSERT INTO tracks (id, directory_id, basename, date_added)\
+                SELECT restored_tracks.id, directories.id, path_basename(filepath), date_added\
+                FROM restored_tracks JOIN directories ON directories.path = path_directory(filepath);\
+            TRUNCATE restored_tracks");
+    PQclear(res);
+}
+
+/**
+ * \brief Restore a playlist, keeping its id
+ * \param id ID of the playlist
+ * \param title Title of the playlist
+ * \param tracks Track ids, in order
+ */
+void CPostgresStorage::RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks)
+{
+    std::string query = "INSERT INTO playlists (id, title) VALUES (";
+    query.append(std::to_string(id));
+    query.append(", ");
+
+    char *escaped_title = PQescapeLiteral(mConnection, title.c_str(), title.length());
+    query.append(escaped_title);
+    PQfreemem(escaped_title);
+
+    query.append(")");
+    PQclear(Exec(query.c_str()));
+
+    std::string rows;
+    std::string playlist = std::to_string(id);
+    for (size_t i = 0; i < tracks.size(); ++i)
+    {
+        rows.append(playlist);
+        rows.push_back('\t');
+        rows.append(std::to_string(tracks[i]));
+        rows.push_back('\t');
+        rows.append(std::to_string(i + 1));
+        rows.push_back('\n');
+    }
+
+    Copy("COPY tracks_playlists (playlist_id, track_id, position) FROM STDIN", rows);
+}
+
+/**
+ * \brief Fix up ids and add the playlists up, and commit the restore
+ * \returns -1 if something went wrong, in which case nothing was restored
+ */
+int CPostgresStorage::EndRestore()
+{
+    PGresult *res = Exec(
+            "SELECT setval(pg_get_serial_sequence('tracks', 'id'), COALESCE(MAX(id), 0) + 1, false) FROM tracks;\
+            SELECT setval(pg_get_serial_sequence('playlists', 'id'), COALESCE(MAX(id), 0) + 1, false) FROM playlists;\
+            SELECT playlist_recount(id) FROM playlists;\
+            COMMIT");
+
+    // A failed transaction turns COMMIT into ROLLBACK
+    int status = std::string(PQcmdStatus(res)) == "COMMIT" ? 0 : -1;
+    PQclear(res);
+
+    if (PQtransactionStatus(mConnection) != PQTRANS_IDLE)
+    {
+        PQclear(Exec("ROLLBACK"));
+    }
+
+    return status;
+}
+
+/**
+ * \brief Add to the listening history and roll it into each track's stats
+ * \param events The events, oldest first
+ * \returns -1 if something goes wrong, in which case none of them were written
+ *
+ * The events are copied into play_history, making any monthly
+ * partitions they need first. They are summed per track here and
+ * added to track_stats with one upsert, so each flush costs the same
+ * no matter how much history there already is. Each step is checked,
+ * and the lot rolled back if one fails.
+ */
+int CPostgresStorage::AppendHistory(const std::vector<PlayRecord> &events)
+{
+    if (events.empty())
+    {
+        return 0;
+    }
+
+    std::string partitions;
+    std::string rows;
+    std::map<long, TrackStats> totals;
+    for (const PlayRecord &record : events)
+    {
+        time_t time = record.time;
+        struct tm utc;
+        gmtime_r(&time, &utc);
+
+        char name[48];
+        snprintf(name, sizeof(name), "play_history_%04d_%02d", utc.tm_year + 1900, utc.tm_mon + 1);
+        if (mPartitions.insert(name).second)
+        {
+            int next_year = utc.tm_year + 1900 + (utc.tm_mon == 11);
+            int next_month = utc.tm_mon == 11 ? 1 : utc.tm_mon + 2;
+            char partition[256];
+            snprintf(partition, sizeof(partition),
+                     "CREATE TABLE IF NOT EXISTS %s PARTITION OF play_history FOR VALUES "
+                     "FROM ('%04d-%02d-01 00:00:00+00') TO ('%04d-%02d-01 00:00:00+00');",
+                     name, utc.tm_year + 1900, utc.tm_mon + 1, next_year, next_month);
+            partitions.append(partition);
+        }
+
+        rows.append(std::to_string(record.track));
+        rows.push_back('\t');
+        rows.append(std::to_string(record.event));
+        rows.push_back('\t');
+        AppendTimestamp(record.time, rows);
+        rows.push_back('\n');
+
+        TrackStats &stats = totals[record.track];
+        stats.plays += record.event == EVENT_PLAY;
+        stats.skips += record.event == EVENT_SKIP;
+        stats.completions += record.event == EVENT_COMPLETE;
+        stats.lastPlayed = std::max(stats.lastPlayed, record.time);
+    }
+
+    std::string upsert = "INSERT INTO track_stats (track_id, plays, skips, completions, last_played)\
+            SELECT New.* FROM (VALUES ";
+    for (auto it = totals.begin(); it != totals.end(); ++it)
+    {
+        if (it != totals.begin())
+        {
+            upsert.append(", ");
+        }
+        upsert.append("(" + std::to_string(it->first) + ", " + std::to_string(it->second.plays) + ", " +
+                      std::to_string(it->second.skips) + ", " + std::to_string(it->second.completions) +
+                      ", to_timestamp(" + std::to_string(it->second.lastPlayed) + "))");
+    }
+    upsert.append(") AS New(track_id, plays, skips, completions, last_played)\
+            JOIN tracks ON tracks.id = New.track_id\
+            ON CONFLICT (track_id) DO UPDATE SET\
+                plays = track_stats.plays + EXCLUDED.plays,\
+                skips = track_stats.skips + EXCLUDED.skips,\
+                completions = track_stats.completions + EXCLUDED.completions,\
+                last_played = GREATEST(track_stats.last_played, EXCLUDED.last_played)");
+
+    bool outer = PQtransactionStatus(mConnection) == PQTRANS_IDLE;
+    PGresult *res = Exec(outer ? "BEGIN" : "SAVEPOINT play_history");
+    bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+    PQclear(res);
+
+    // Nothing was started, so there's nothing to roll back
+    if (!ok)
+    {
+        mPartitions.clear();
+        return -1;
+    }
+
+    if (!partitions.empty())
+    {
+        res = Exec(partitions.c_str());
+        ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+    }
+    if (ok)
+    {
+        ok = Copy("COPY play_history (track_id, event, played_at) FROM STDIN", rows) == 0;
+    }
+    if (ok)
+    {
+        res = Exec(upsert.c_str());
+        ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+    }
+    if (ok)
+    {
+        res = Exec(outer ? "COMMIT" : "RELEASE SAVEPOINT play_history");
+        ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        PQclear(res);
+    }
+
+    if (ok)
+    {
+        return 0;
+    }
+
+    // A COMMIT that fails ends the transaction itself, and the partitions go with it
+    if (PQtransactionStatus(mConnection) != PQTRANS_IDLE)
+    {
+        PQclear(Exec(outer ? "ROLLBACK" : "ROLLBACK TO SAVEPOINT play_history; RELEASE SAVEPOINT play_history"));
+    }
+    mPartitions.clear();
+    return -1;
+}
+
+/**
+ * \brief Read the rolled up listening history of tracks
+ * \param ids IDs of the tracks
+ * \returns Stats in the same order; all zero for tracks never played
+ *
+ * One primary key lookup per track, all in one query.
+ */
+std::vector<CStorage::TrackStats> CPostgresStorage::GetTrackStats(const std::vector<std::string> &ids)
+{
+    std::vector<TrackStats> stats(ids.size());
+    if (ids.empty())
+    {
+        return stats;
+    }
+
+    PGresult *res = Exec("SELECT Ids.ord, plays, skips, completions, COALESCE(EXTRACT(EPOCH FROM last_played)::BIGINT, 0)\
+            FROM unnest($1::INTEGER[]) WITH ORDINALITY AS Ids(id, ord)\
+            JOIN track_stats ON track_stats.track_id = Ids.id",
+            IdArray(ids));
+
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        TrackStats &track = stats[atol(PQgetvalue(res, i, 0)) - 1];
+        track.plays = atol(PQgetvalue(res, i, 1));
+        track.skips = atol(PQgetvalue(res, i, 2));
+        track.completions = atol(PQgetvalue(res, i, 3));
+        track.lastPlayed = atoll(PQgetvalue(res, i, 4));
+    }
+    PQclear(res);
+
+    return stats;
+}
+
+/**
+ * \brief List tracks that haven't been analysed yet
+ * \param after Only list tracks with an id above this
+ * \param limit List no more than this many
+ * \returns The tracks, ordered by id
+ */
+std::vector<CStorage::TrackRecord> CPostgresStorage::FindUnanalyzed(long after, size_t limit)
+{
+    std::vector<TrackRecord> tracks;
+
+    std::string query = "SELECT id, filepath, EXTRACT(EPOCH FROM date_added)::BIGINT FROM track_paths AS tracks\
+            WHERE id > " + std::to_string(after) + "\
+            AND NOT EXISTS (SELECT 1 FROM track_features WHERE track_features.track_id = tracks.id)\
+            ORDER BY id LIMIT " + std::to_string(limit);
+
+    PGresult *res = Exec(query.c_str());
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        tracks.push_back({atol(PQgetvalue(res, i, 0)), PQgetvalue(res, i, 1), atoll(PQgetvalue(res, i, 2))});
+    }
+    PQclear(res);
+
+    return tracks;
+}
+
+/**
+ * \brief Keep what analysing tracks found, replacing anything found before
+ * \param features The findings; tracks that no longer exist are skipped
+ *
+ * All of them go in with one upsert.
+ */
+void CPostgresStorage::SaveFeatures(const std::vector<TrackFeatures> &features)
+{
+    if (features.empty())
+    {
+        return;
+    }
+
+    std::string upsert = "INSERT INTO track_features\
+            (track_id, decoded, duration, loudness, peak, bpm, musical_key, fingerprint)\
+            SELECT New.* FROM (VALUES ";
+    std::vector<std::string> ids;
+    for (size_t i = 0; i < features.size(); ++i)
+    {
+        const TrackFeatures &track = features[i];
+        ids.push_back(std::to_string(track.track));
+        if (i > 0)
+        {
+            upsert.append(", ");
+        }
+        upsert.append("(" + std::to_string(track.track));
+        if (!track.decoded)
+        {
+            upsert.append(", FALSE, NULL::REAL, NULL::REAL, NULL::REAL, NULL::REAL, NULL::SMALLINT, NULL::BYTEA)");
+            continue;
+        }
+
+        char numbers[160];
+        snprintf(numbers, sizeof(numbers), ", TRUE, %.9g::REAL, %.9g::REAL, %.9g::REAL, %.9g::REAL, %d::SMALLINT, '\\x",
+                 track.duration, track.loudness, track.peak, track.bpm, track.key);
+        upsert.append(numbers);
+        for (unsigned char byte : track.fingerprint)
+        {
+            static const char hex[] = "0123456789abcdef";
+            upsert.push_back(hex[byte >> 4]);
+            upsert.push_back(hex[byte & 15]);
+        }
+        upsert.append("'::BYTEA)");
+    }
+    upsert.append(") AS New(track_id, decoded, duration, loudness, peak, bpm, musical_key, fingerprint)\
+            JOIN tracks ON tracks.id = New.track_id\
+            ON CONFLICT (track_id) DO UPDATE SET\
+                decoded = EXCLUDED.decoded,\
+                duration = EXCLUDED.duration,\
+                loudness = EXCLUDED.loudness,\
+                peak = EXCLUDED.peak,\
+                bpm = EXCLUDED.bpm,\
+                musical_key = EXCLUDED.musical_key,\
+                fingerprint = EXCLUDED.fingerprint,\
+                analyzed_at = NOW()");
+
+    // What was measured beats what the headers said; the trigger moves the difference along
+    upsert.append("; UPDATE tracks SET duration = track_features.duration FROM track_features\
+            WHERE track_features.track_id = tracks.id AND track_features.decoded\
+            AND tracks.duration <> track_features.duration AND tracks.id IN (");
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        upsert.append(i > 0 ? ", " + ids[i] : ids[i]);
+    }
+    upsert.append(")");
+
+    PQclear(Exec(upsert.c_str()));
+}
+
+/**
+ * \brief Read what analysing tracks found
+ * \param ids IDs of the tracks
+ * \returns Findings in the same order; track is 0 for tracks not analysed yet
+ */
+std::vector<CStorage::TrackFeatures> CPostgresStorage::GetFeatures(const std::vector<std::string> &ids)
+{
+    std::vector<TrackFeatures> features(ids.size());
+    if (ids.empty())
+    {
+        return features;
+    }
+
+    PGresult *res = Exec("SELECT Ids.ord, Ids.id, decoded, duration, loudness, peak, bpm, musical_key, fingerprint\
+            FROM unnest($1::INTEGER[]) WITH ORDINALITY AS Ids(id, ord)\
+            JOIN track_features ON track_features.track_id = Ids.id",
+            IdArray(ids));
+
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        TrackFeatures &track = features[atol(PQgetvalue(res, i, 0)) - 1];
+        track.track = atol(PQgetvalue(res, i, 1));
+        track.decoded = PQgetvalue(res, i, 2)[0] == 't';
+        if (!track.decoded)
+        {
+            continue;
+        }
+        track.duration = atof(PQgetvalue(res, i, 3));
+        track.loudness = atof(PQgetvalue(res, i, 4));
+        track.peak = atof(PQgetvalue(res, i, 5));
+        track.bpm = atof(PQgetvalue(res, i, 6));
+        track.key = atoi(PQgetvalue(res, i, 7));
+
+        size_t length = 0;
+        unsigned char *bytes = PQunescapeBytea((const unsigned char *)PQgetvalue(res, i, 8), &length);
+        if (bytes)
+        {
+            track.fingerprint.assign((const char *)bytes, length);
+            PQfreemem(bytes);
+        }
+    }
+    PQclear(res);
+
+    return features;
+}
+
+/**
+ * \brief List tracks whose tags haven't been read yet
+ * \param after Only list tracks with an id above this
+ * \param limit List no more than this many
+ * \returns The tracks, ordered by id
+ *
+ * Only untagged tracks are in tracks_untagged_idx, so this doesn't
+ * get slower as more of the library is tagged.
+ */
+std::vector<CStorage::TrackRecord> CPostgresStorage::FindUntagged(long after, size_t limit)
+{
+    std::vector<TrackRecord> tracks;
+
+    std::string query = "SELECT tracks.id, directories.path || tracks.basename,\
+            EXTRACT(EPOCH FROM tracks.date_added)::BIGINT\
+            FROM tracks JOIN directories ON directories.id = tracks.directory_id\
+            WHERE tracks.artist_id IS NULL AND tracks.id > " + std::to_string(after) + "\
+            ORDER BY tracks.id LIMIT " + std::to_string(limit);
+
+    PGresult *res = Exec(query.c_str());
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        tracks.push_back({atol(PQgetvalue(res, i, 0)), PQgetvalue(res, i, 1), atoll(PQgetvalue(res, i, 2))});
+    }
+    PQclear(res);
+
+    return tracks;
+}
+
+/**
+ * \brief Keep what tracks' tags say, replacing what they said before
+ * \param tags The tags; tracks that no longer exist are skipped
+ *
+ * One statement: the names are upserted, then the tracks pointed at
+ * them. tracks_tags_trg moves each track's count and length across,
+ * row by row.
+ */
+void CPostgresStorage::SaveTags(const std::vector<TrackTags> &tags)
+{
+    if (tags.empty())
+    {
+        return;
+    }
+
+    std::vector<std::string> ids, titles, artists, albums, genres, numbers, durations, sizes;
+    for (const TrackTags &track : tags)
+    {
+        char duration[32];
+        snprintf(duration, sizeof(duration), "%.9g", track.duration);
+
+        ids.push_back(std::to_string(track.track));
+        titles.push_back(track.title);
+        artists.push_back(track.artist);
+        albums.push_back(track.album);
+        genres.push_back(track.genre);
+        numbers.push_back(std::to_string(std::max(track.number, 0)));
+        durations.push_back(duration);
+        sizes.push_back(std::to_string(std::max(track.bytes, 0LL)));
+    }
+
+    PGresult *res = Exec(
+            "WITH New AS (SELECT * FROM unnest($1::INTEGER[], $2::TEXT[], $3::TEXT[], $4::TEXT[], $5::TEXT[],\
+                    $6::INTEGER[], $7::REAL[], $8::BIGINT[]) AS New(track_id, title, artist, album, genre, number,\
+                    duration, bytes)),\
+                ArtistIds AS (INSERT INTO artists (name) SELECT DISTINCT artist FROM New\
+                    ON CONFLICT (name) DO UPDATE SET name = EXCLUDED.name RETURNING id, name),\
+                GenreIds AS (INSERT INTO genres (name) SELECT DISTINCT genre FROM New\
+                    ON CONFLICT (name) DO UPDATE SET name = EXCLUDED.name RETURNING id, name),\
+                AlbumIds AS (INSERT INTO albums (artist_id, title)\
+                    SELECT DISTINCT ArtistIds.id, New.album FROM New JOIN ArtistIds ON ArtistIds.name = New.artist\
+                    ON CONFLICT (artist_id, title) DO UPDATE SET title = EXCLUDED.title\
+                    RETURNING id, artist_id, title)\
+            UPDATE tracks SET title = New.title, number = New.number,\
+                duration = CASE WHEN New.duration > 0 THEN New.duration ELSE tracks.duration END, bytes = New.bytes,\
+                artist_id = ArtistIds.id, album_id = AlbumIds.id, genre_id = GenreIds.id\
+            FROM New JOIN ArtistIds ON ArtistIds.name = New.artist\
+                JOIN AlbumIds ON AlbumIds.artist_id = ArtistIds.id AND AlbumIds.title = New.album\
+                JOIN GenreIds ON GenreIds.name = New.genre\
+            WHERE tracks.id = New.track_id",
+            {IdArray(ids), TextArray(titles), TextArray(artists), TextArray(albums), TextArray(genres),
+             IdArray(numbers), IdArray(durations), IdArray(sizes)});
+    PQclear(res);
+}
+
+/**
+ * \brief List a page of artists, albums, tracks or genres
+ * \param level What to list
+ * \param parent The artist to list albums by, or album to list tracks on
+ * \param after The last row of the page before, or a default row for the first page
+ * \param limit List no more than this many
+ * \returns The rows, in order
+ *
+ * Each page is a row comparison against where the last one ended,
+ * walked along an index in order, so it costs the same however far in
+ * it is and never counts or adds anything up.
+ */
+std::vector<CStorage::BrowseEntry> CPostgresStorage::Browse(BrowseLevel level, long parent,
+                                                            const BrowseEntry &after, size_t limit)
+{
+    std::vector<BrowseEntry> entries;
+
+    std::string query;
+    std::vector<std::string> params = {after.name, std::to_string(after.id)};
+    if (level == BROWSE_TRACKS)
+    {
+        query = "SELECT id, title, number, 1, duration FROM tracks\
+                WHERE album_id = $3 AND (number, title, id) > ($4, $1, $2) ORDER BY number, title, id";
+        params.push_back(std::to_string(parent));
+        params.push_back(std::to_string(after.number));
+    }
+    else if (level == BROWSE_ALBUMS && parent != 0)
+    {
+        query = "SELECT id, title, 0, tracks, duration FROM albums\
+                WHERE artist_id = $3 AND tracks > 0 AND (title, id) > ($1, $2) ORDER BY title, id";
+        params.push_back(std::to_string(parent));
+    }
+    else
+    {
+        query = level == BROWSE_ALBUMS ? "SELECT id, title, 0, tracks, duration FROM albums\
+                                          WHERE tracks > 0 AND (title, id) > ($1, $2) ORDER BY title, id" :
+                level == BROWSE_GENRES ? "SELECT id, name, 0, tracks, duration FROM genres\
+                                          WHERE tracks > 0 AND (name, id) > ($1, $2) ORDER BY name, id" :
+                                         "SELECT id, name, 0, tracks, duration FROM artists\
+                                          WHERE tracks > 0 AND (name, id) > ($1, $2) ORDER BY name, id";
+    }
+    query.append(" LIMIT " + std::to_string(limit));
+
+    PGresult *res = Exec(query.c_str(), params);
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        entries.push_back({atol(PQgetvalue(res, i, 0)), PQgetvalue(res, i, 1), atol(PQgetvalue(res, i, 2)),
+                           atol(PQgetvalue(res, i, 3)), atof(PQgetvalue(res, i, 4))});
+    }
+    PQclear(res);
+
+    return entries;
+}
+
+/**
+ * \brief List playlists
+ * \param after Only list playlists with an id above this
+ * \param limit List no more than this many
+ * \returns Their ids, in order
+ */
+std::vector<long> CPostgresStorage::FindPlaylists(long after, size_t limit)
+{
+    std::vector<long> ids;
+
+    std::string query = "SELECT id FROM playlists WHERE id > " + std::to_string(after) +
+                        " ORDER BY id LIMIT " + std::to_string(limit);
+
+    PGresult *res = Exec(query.c_str());
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        ids.push_back(atol(PQgetvalue(res, i, 0)));
+    }
+    PQclear(res);
+
+    return ids;
+}
+
+/**
+ * \brief Vacuum and analyze the tables that churn
+ * \returns -1 if something goes wrong, or a transaction is open
+ *
+ * VACUUM can't run inside a transaction, so this won't either.
+ * Directories no track is in any more are dropped first.
+ */
+int CPostgresStorage::Vacuum()
+{
+    if (PQtransactionStatus(mConnection) != PQTRANS_IDLE)
+    {
+        return -1;
+    }
+
+    // Directories whose tracks have all gone or moved out
+    PGresult *res = Exec("DELETE FROM directories\
+            WHERE NOT EXISTS (SELECT 1 FROM tracks WHERE tracks.directory_id = directories.id)");
+    PQclear(res);
+
+    // and artists, albums and genres that have no tracks left, which browsing already skips
+    res = Exec("DELETE FROM albums WHERE tracks = 0;\
+            DELETE FROM artists WHERE tracks = 0 AND NOT EXISTS (SELECT 1 FROM albums WHERE albums.artist_id = artists.id);\
+            DELETE FROM genres WHERE tracks = 0");
+    PQclear(res);
+
+    res = Exec("VACUUM (ANALYZE) tracks_playlists, playlists, playlist_artists, playlist_albums, tracks, directories,\
+            artists, albums, genres, track_stats, jobs");
+    int status = PQresultStatus(res) == PGRES_COMMAND_OK ? 0 : -1;
+    PQclear(res);
+
+    return status;
+}
+
+/**
+ * \brief Keep a new background job
+ * \param job The job; its id is ignored
+ * \returns ID of the job, or -1 if something goes wrong
+ */
+long CPostgresStorage::AddJob(const JobRecord &job)
+{
+    std::string query = "INSERT INTO jobs (kind, argument, priority, state, progress) VALUES (";
+
+    for (const std::string *text : {&job.kind, &job.argument})
+    {
+        char *escaped = PQescapeLiteral(mConnection, text->c_str(), text->length());
+        query.append(escaped);
+        query.append(", ");
+        PQfreemem(escaped);
+    }
+    query.append(std::to_string(job.priority) + ", " + std::to_string(job.state) + ", ");
+
+    char *escaped_progress = PQescapeLiteral(mConnection, job.progress.c_str(), job.progress.length());
+    query.append(escaped_progress);
+    PQfreemem(escaped_progress);
+
+    query.append(") RETURNING id");
+
+    PGresult *res = Exec(query.c_str());
+    long id = PQntuples(res) == 1 ? atol(PQgetvalue(res, 0, 0)) : -1;
+    PQclear(res);
+
+    return id;
+}
+
+/**
+ * \brief Keep where a background job is at; finished jobs are forgotten
+ * \param job The job
+ */
+void CPostgresStorage::UpdateJob(const JobRecord &job)
+{
+    std::string query;
+    if (job.state == JOB_QUEUED || job.state == JOB_RUNNING)
+    {
+        query = "UPDATE jobs SET state = " + std::to_string(job.state) + ", progress = ";
+
+        char *escaped_progress = PQescapeLiteral(mConnection, job.progress.c_str(), job.progress.length());
+        query.append(escaped_progress);
+        PQfreemem(escaped_progress);
+
+        query.append(", updated_at = NOW() WHERE id = " + std::to_string(job.id));
+    }
+    else
+    {
+        query = "DELETE FROM jobs WHERE id = " + std::to_string(job.id);
+    }
+
+    PQclear(Exec(query.c_str()));
+}
+
+/**
+ * \brief Read the background jobs that haven't finished
+ * \returns The jobs, ordered by id
+ */
+std::vector<CStorage::JobRecord> CPostgresStorage::LoadJobs()
+{
+    std::vector<JobRecord> jobs;
+
+    PGresult *res = Exec("SELECT id, kind, argument, priority, state, progress FROM jobs ORDER BY id");
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        JobRecord job;
+        job.id = atol(PQgetvalue(res, i, 0));
+        job.kind = PQgetvalue(res, i, 1);
+        job.argument = PQgetvalue(res, i, 2);
+        job.priority = atoi(PQgetvalue(res, i, 3));
+        job.state = (JobState)atoi(PQgetvalue(res, i, 4));
+        job.progress = PQgetvalue(res, i, 5);
+        jobs.push_back(job);
+    }
+    PQclear(res);
+
+    return jobs;
+}
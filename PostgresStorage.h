@@ -0,0 +1,207 @@
+/**
+ * \file PostgresStorage.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the PostgresStorage class
+ */
+
+#ifndef POSTGRESSTORAGE_H
+#define POSTGRESSTORAGE_H
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <set>
+#include "Config.h"
+#include "Query.h"
+#include "Reactor.h"
+#include "Storage.h"
+
+/**
+ * \brief Keeps a library in a PostgreSQL database
+ *
+ * This is where all of the hideous handwritten sql lives.
+ *
+ * The Async calls go over a second connection, opened the first time
+ * one is made, in pipeline mode: each statement is sent as soon as it's
+ * asked for, without waiting for the ones before it to come back, and
+ * the reactor wakes whoever's waiting as results arrive. So any number
+ * can be under way at once from one thread. A batch or restore under
+ * way on the first connection has to see everything in its
+ * transaction, so while one is, the Async calls are made on the first
+ * connection, blocking, like the rest.
+ *
+ * Statements that run on every edit or read of a playlist are
+ * CStatements (see Query.h): prepared once per connection, with binary
+ * parameters and results, so running one builds and parses no text.
+ */
+class CPostgresStorage : public CStorage
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CPostgresStorage() = delete;
+
+    CPostgresStorage(const CConfig &config);
+    CPostgresStorage(std::string conninfo);
+    virtual ~CPostgresStorage();
+
+    /** \brief Copy constructor (disabled)
+     * \param storage Storage to construct this based on */
+    CPostgresStorage(const CPostgresStorage &storage) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param storage Storage whose attributes will override those of the current storage */
+    CPostgresStorage& operator=(const CPostgresStorage &storage) = delete;
+
+    virtual ConnStatusType GetStatus() override;
+
+    virtual PGconn *GetConnection() override;
+    virtual long long GetWritePosition() override;
+    virtual long long GetReplayPosition() override;
+
+    virtual int PrepareDatabase() override;
+    virtual int DestroyDatabase() override;
+
+    virtual std::string AddTrack(std::string filepath) override;
+    virtual std::vector<std::string> AddTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::string AddPlaylist(std::string title) override;
+    virtual void RemoveTrack(std::string id) override;
+    virtual void RemovePlaylist(std::string id) override;
+
+    virtual bool LoadPlaylist(std::string id, std::string &title, std::string &length,
+                              std::vector<std::string> &tracks) override;
+    virtual bool LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                   std::string &length, std::vector<std::string> &tracks) override;
+    virtual PlaylistTotals GetPlaylistTotals(std::string id) override;
+    virtual std::vector<std::string> FindTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::vector<std::string> FindFilepaths(const std::vector<std::string> &ids) override;
+    virtual long RelocateRoot(std::string from, std::string to) override;
+
+    virtual CTask<std::string> AddTrackAsync(CReactor *reactor, std::string filepath) override;
+    virtual CTask<std::string> AddPlaylistAsync(CReactor *reactor, std::string title) override;
+    virtual CTask<PlaylistRange> LoadPlaylistRangeAsync(CReactor *reactor, std::string id, int position, int count) override;
+
+    virtual std::string AppendTrack(std::string playlist, std::string track) override;
+    virtual std::string InsertTrack(std::string playlist, std::string track, int position) override;
+    virtual void InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position) override;
+    virtual void RemoveRange(std::string playlist, int position, int count) override;
+    virtual void MoveRange(std::string playlist, int from, int count, int to) override;
+    virtual void Reorder(std::string playlist, const std::vector<long> &order) override;
+    virtual void Normalize(std::string playlist) override;
+
+    virtual bool BeginBatch() override;
+    virtual int CommitBatch(std::string playlist, bool outer) override;
+    virtual void RollbackBatch(bool outer) override;
+
+    virtual void ReadTracks(const std::function<void(const TrackRecord &)> &visit) override;
+    virtual Cursor<TrackRecord> *StreamTracks() override;
+    virtual Cursor<EntryRecord> *StreamPlaylist(std::string id) override;
+    virtual void ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit) override;
+    virtual int BeginRestore() override;
+    virtual void RestoreTracks(const std::vector<TrackRecord> &tracks) override;
+    virtual void RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks) override;
+    virtual int EndRestore() override;
+
+    virtual int AppendHistory(const std::vector<PlayRecord> &events) override;
+    virtual std::vector<TrackStats> GetTrackStats(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUnanalyzed(long after, size_t limit) override;
+    virtual void SaveFeatures(const std::vector<TrackFeatures> &features) override;
+    virtual std::vector<TrackFeatures> GetFeatures(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUntagged(long after, size_t limit) override;
+    virtual void SaveTags(const std::vector<TrackTags> &tags) override;
+    virtual std::vector<BrowseEntry> Browse(BrowseLevel level, long parent, const BrowseEntry &after,
+                                            size_t limit) override;
+
+    virtual std::vector<long> FindPlaylists(long after, size_t limit) override;
+    virtual int Vacuum() override;
+    virtual long AddJob(const JobRecord &job) override;
+    virtual void UpdateJob(const JobRecord &job) override;
+    virtual std::vector<JobRecord> LoadJobs() override;
+
+private:
+    /// A statement sent on the pipelined connection, waiting for its result
+    struct Pending
+    {
+        PGresult *result = nullptr;         ///< Its result, once it's arrived, or nullptr
+        bool done = false;                  ///< Whether everything for it has arrived
+        std::coroutine_handle<> waiter;     ///< What to resume once it has, or nullptr
+    };
+
+    PGresult *Exec(const char *query);
+    PGresult *Exec(const char *query, const std::string &param);
+    PGresult *Exec(const char *query, const std::vector<std::string> &params);
+
+    /**
+     * \brief Run a statement, preparing it first if it hasn't been on this connection
+     * \param statement The statement
+     * \param params Its parameters, of exactly the types it was defined with
+     * \returns The result, in binary, to be PQclear()ed
+     */
+    template <typename Rows, typename... Params>
+    PGresult *Run(const CStatement<Rows, Params...> &statement, const std::type_identity_t<Params> &...params)
+    {
+        BoundParams<Params...> bound(params...);
+        return RunPrepared(statement.GetName(), statement.GetText(), sizeof...(Params), statement.GetTypes(),
+                           bound.values, bound.lengths, bound.formats, bound.sent);
+    }
+
+    PGresult *RunPrepared(const char *name, const char *text, int count, const Oid *types,
+                          const char *const *values, const int *lengths, const int *formats, size_t sent);
+    void Count(const char *query, size_t sent, size_t received, std::chrono::steady_clock::time_point start);
+    int Copy(const char *query, const std::string &rows);
+    bool CanPipeline();
+
+    /**
+     * \brief Run a statement on the pipelined connection, preparing it first if it hasn't been there
+     * \param reactor Reactor to wait in
+     * \param statement The statement
+     * \param params Its parameters, of exactly the types it was defined with
+     * \returns Task yielding the result, in binary, to be PQclear()ed, or nullptr if the connection failed
+     */
+    template <typename Rows, typename... Params>
+    CTask<PGresult *> RunAsync(CReactor *reactor, const CStatement<Rows, Params...> &statement,
+                               std::type_identity_t<Params> ...params)
+    {
+        BoundParams<Params...> bound(params...);
+        co_return co_await RunPreparedAsync(reactor, statement.GetName(), statement.GetText(), sizeof...(Params),
+                                            statement.GetTypes(), bound.values, bound.lengths, bound.formats,
+                                            bound.sent);
+    }
+
+    CTask<PGresult *> RunPreparedAsync(CReactor *reactor, const char *name, const char *text, int count,
+                                       const Oid *types, const char *const *values, const int *lengths,
+                                       const int *formats, size_t sent);
+    CTask<> FlushAsync(CReactor *reactor);
+    CTask<> ReadAsync(CReactor *reactor);
+    void FailPipeline();
+
+    PGconn *mConnection;                ///< Postgres database connection struct
+
+    std::string mConnInfo;              ///< What mConnection connected to, for the pipelined connection
+    std::string mSetup;                 ///< Settings to give the pipelined connection, as SQL
+
+    /// Connection the Async calls pipeline their statements on, or nullptr until one is made
+    PGconn *mPipeline = nullptr;
+
+    /// Statements sent on mPipeline whose results haven't all arrived, in the order sent
+    std::deque<Pending *> mPending;
+
+    /// Whether a ReadAsync() is taking results off mPipeline
+    bool mReading = false;
+
+    /// Whether a FlushAsync() is sending what's queued on mPipeline
+    bool mWriting = false;
+
+    /// play_history partitions known to exist
+    std::set<std::string> mPartitions;
+
+    /// Names of the CStatements prepared on mConnection
+    std::set<std::string, std::less<>> mPrepared;
+
+    /// Names of the CStatements prepared, or being prepared, on mPipeline
+    std::set<std::string, std::less<>> mPipelinePrepared;
+};
+
+#endif
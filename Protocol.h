@@ -0,0 +1,255 @@
+/**
+ * \file Protocol.h
+ * \author Matt Hammerly
+ * \brief What CServer and CClient say to each other
+ *
+ * Every message is a frame: a four byte little-endian length of what
+ * follows, a four byte request id, a one byte code, then the payload.
+ * A request's code is its Opcode, and its response carries the same id
+ * with a Status as its code, so a client can send many requests before
+ * reading any responses; they come back in the order sent. A
+ * notification is pushed with id 0 and code OP_NOTIFY.
+ *
+ * Payloads are built from the helpers in Encoding.h: numbers, ids and
+ * positions are varints, strings are length-prefixed, and a list is a
+ * varint count followed by its items. An id of 0 means there's none.
+ * Each opcode's request and response payloads:
+ *
+ *  - OP_PING: anything / the same back
+ *  - OP_SUBSCRIBE: nothing / nothing; notifications are sent from then on
+ *  - OP_ADD_TRACK: filepath / track id
+ *  - OP_REMOVE_TRACK: track id / nothing
+ *  - OP_ADD_PLAYLIST: title / playlist id
+ *  - OP_REMOVE_PLAYLIST: playlist id / nothing
+ *  - OP_LOAD_PAGE: playlist id, page / title, length, track ids
+ *  - OP_FIND_TRACKS: filepaths / track ids
+ *  - OP_FIND_FILEPATHS: track ids / filepaths, "" where there's none
+ *  - OP_INSERT_TRACKS: playlist id, position, track ids / nothing
+ *  - OP_REMOVE_RANGE: playlist id, position, count / nothing
+ *  - OP_MOVE_RANGE: playlist id, from, count, to / nothing
+ *  - OP_RECORD_PLAY: track id, event, time / nothing
+ *  - OP_GET_STATS: track ids / plays, skips, completions and last
+ *    played for each
+ *  - OP_THUMBNAIL: filepath, size / size * size * 3 bytes of RGB, or
+ *    nothing if there's no art
+ *  - OP_NOTIFY: (pushed) a Notification, then the id it's about
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include "Config.h"
+#include "Encoding.h"
+
+/// Bytes of length, id and code before each payload
+static const size_t FRAME_HEADER = 9;
+
+/// Largest frame either side will take; anything bigger drops the connection
+static const size_t FRAME_LIMIT = 64 << 20;
+
+/// What a request asks for
+enum Opcode : unsigned char
+{
+    OP_PING = 1,            ///< Check the server is there
+    OP_SUBSCRIBE,           ///< Start getting notifications
+    OP_ADD_TRACK,           ///< CLibrary::AddTrack()
+    OP_REMOVE_TRACK,        ///< CLibrary::RemoveTrack()
+    OP_ADD_PLAYLIST,        ///< CLibrary::AddPlaylist()
+    OP_REMOVE_PLAYLIST,     ///< CLibrary::RemovePlaylist()
+    OP_LOAD_PAGE,           ///< CLibrary::LoadPlaylistPage()
+    OP_FIND_TRACKS,         ///< CStorage::FindTracks()
+    OP_FIND_FILEPATHS,      ///< CStorage::FindFilepaths()
+    OP_INSERT_TRACKS,       ///< CPlaylist::InsertTracks()
+    OP_REMOVE_RANGE,        ///< CPlaylist::RemoveRange()
+    OP_MOVE_RANGE,          ///< CPlaylist::MoveRange()
+    OP_RECORD_PLAY,         ///< CLibrary::RecordPlay()
+    OP_GET_STATS,           ///< CLibrary::GetTrackStats()
+    OP_THUMBNAIL,           ///< CLibrary::GetThumbnail()
+    OP_NOTIFY = 0x80        ///< Pushed by the server, never sent to it
+};
+
+/// How a request went
+enum Status : unsigned char
+{
+    STATUS_OK = 0,          ///< It was done; the payload is the answer
+    STATUS_FAILED,          ///< It couldn't be done, e.g. there's no such playlist
+    STATUS_BAD_REQUEST      ///< The opcode or payload made no sense
+};
+
+/// What a notification is about
+enum Notification : unsigned char
+{
+    NOTIFY_TRACK_ADDED = 1,     ///< A track was added; the library playlist changed too
+    NOTIFY_TRACK_REMOVED,       ///< A track was removed, from every playlist it was in
+    NOTIFY_PLAYLIST_ADDED,      ///< A playlist was added
+    NOTIFY_PLAYLIST_REMOVED,    ///< A playlist was removed
+    NOTIFY_PLAYLIST_CHANGED     ///< A playlist's tracks changed
+};
+
+/**
+ * \brief Work out where the server's socket is
+ * \param config Settings; daemon.socket, if it's set
+ * \returns The path: daemon.socket, or else musicmanager.socket in
+ *          $XDG_RUNTIME_DIR, or else one in /tmp named for the user
+ */
+inline std::string SocketPath(const CConfig &config)
+{
+    std::string path = config.Get("daemon.socket");
+    if (!path.empty())
+    {
+        return path;
+    }
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime && *runtime)
+    {
+        return std::string(runtime) + "/musicmanager.socket";
+    }
+    return "/tmp/musicmanager-" + std::to_string(getuid()) + ".socket";
+}
+
+/**
+ * \brief Append a frame
+ * \param out String to append to
+ * \param id Request id, or 0 for a notification
+ * \param code Opcode or Status
+ * \param payload The payload
+ */
+inline void PutFrame(std::string &out, uint32_t id, unsigned char code, const std::string &payload)
+{
+    uint32_t length = payload.size() + FRAME_HEADER - 4;
+    out.append((const char *)&length, 4);
+    out.append((const char *)&id, 4);
+    out.push_back((char)code);
+    out.append(payload);
+}
+
+/**
+ * \brief Read a frame, if a whole one has arrived
+ * \param p Where to read from; advanced past the frame if there's a whole one
+ * \param end End of what has arrived
+ * \param id Filled in with the request id
+ * \param code Filled in with the opcode or Status
+ * \param payload Filled in with where the payload starts
+ * \param payloadEnd Filled in with where it ends
+ * \returns 1 if there was a whole frame, 0 if more has to arrive first, or -1 if it's too big
+ */
+inline int GetFrame(const char *&p, const char *end, uint32_t &id, unsigned char &code,
+                    const char *&payload, const char *&payloadEnd)
+{
+    if ((size_t)(end - p) < FRAME_HEADER)
+    {
+        return 0;
+    }
+
+    uint32_t length;
+    memcpy(&length, p, 4);
+    if (length < FRAME_HEADER - 4 || length > FRAME_LIMIT)
+    {
+        return -1;
+    }
+    if ((size_t)(end - p) < length + 4)
+    {
+        return 0;
+    }
+
+    memcpy(&id, p + 4, 4);
+    code = (unsigned char)p[8];
+    payload = p + FRAME_HEADER;
+    payloadEnd = p + 4 + length;
+    p = payloadEnd;
+    return 1;
+}
+
+/**
+ * \brief Append a list of strings
+ * \param out String to append to
+ * \param values The strings
+ */
+inline void PutList(std::string &out, const std::vector<std::string> &values)
+{
+    PutVarint(out, values.size());
+    for (const std::string &value : values)
+    {
+        PutString(out, value);
+    }
+}
+
+/**
+ * \brief Read a list of strings
+ * \param p Where to read from; advanced past the list
+ * \param end End of the buffer
+ * \returns The strings; cut short if the buffer ran out
+ */
+inline std::vector<std::string> GetList(const char *&p, const char *end)
+{
+    uint64_t count = GetVarint(p, end);
+    std::vector<std::string> values;
+    values.reserve(count < (uint64_t)(end - p) ? count : end - p);
+    for (uint64_t i = 0; i < count && p < end; ++i)
+    {
+        values.push_back(GetString(p, end));
+    }
+    return values;
+}
+
+/**
+ * \brief Append an id
+ * \param out String to append to
+ * \param id The id, as the library hands it out, or "" for none
+ */
+inline void PutId(std::string &out, const std::string &id)
+{
+    PutVarint(out, strtoull(id.c_str(), nullptr, 10));
+}
+
+/**
+ * \brief Read an id
+ * \param p Where to read from; advanced past the id
+ * \param end End of the buffer
+ * \returns The id, as the library takes it, or "" for none
+ */
+inline std::string GetId(const char *&p, const char *end)
+{
+    uint64_t id = GetVarint(p, end);
+    return id ? std::to_string(id) : "";
+}
+
+/**
+ * \brief Append a list of ids
+ * \param out String to append to
+ * \param ids The ids
+ */
+inline void PutIds(std::string &out, const std::vector<std::string> &ids)
+{
+    PutVarint(out, ids.size());
+    for (const std::string &id : ids)
+    {
+        PutId(out, id);
+    }
+}
+
+/**
+ * \brief Read a list of ids
+ * \param p Where to read from; advanced past the list
+ * \param end End of the buffer
+ * \returns The ids; cut short if the buffer ran out
+ */
+inline std::vector<std::string> GetIds(const char *&p, const char *end)
+{
+    uint64_t count = GetVarint(p, end);
+    std::vector<std::string> ids;
+    ids.reserve(count < (uint64_t)(end - p) ? count : end - p);
+    for (uint64_t i = 0; i < count && p < end; ++i)
+    {
+        ids.push_back(GetId(p, end));
+    }
+    return ids;
+}
+
+#endif
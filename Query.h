@@ -0,0 +1,567 @@
+/**
+ * \file Query.h
+ * \author Matt Hammerly
+ * \brief Contains the definitions of the Statement and row mapping templates
+ *
+ * A statement is defined once, as a constexpr CStatement naming the C++
+ * types of its parameters and the row type it reads back. Parameters go
+ * over in Postgres' binary format and rows come back in it, so running
+ * one builds no SQL and parses no text. Handing a statement a parameter
+ * of the wrong type, a statement whose placeholders don't match its
+ * parameter list, or a row with a field that can't be read are all
+ * compile errors.
+ *
+ * What can't be known at compile time is what the server will send
+ * back; ReadRows() checks each column's type once per result.
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+#include <postgresql/libpq-fe.h>
+
+/// Postgres type oids, from pg_type
+enum PgOid : Oid
+{
+    PG_BOOL = 16,
+    PG_NAME = 19,
+    PG_INT8 = 20,
+    PG_INT2 = 21,
+    PG_INT4 = 23,
+    PG_TEXT = 25,
+    PG_FLOAT4 = 700,
+    PG_FLOAT8 = 701,
+    PG_BPCHAR = 1042,
+    PG_VARCHAR = 1043,
+    PG_INT8_ARRAY = 1016
+};
+
+/**
+ * \brief Write an integer big-endian, as Postgres' binary format has it
+ * \param value The value
+ * \param bytes How many bytes it takes
+ * \param out Where to write it
+ */
+inline void PutBigEndian(uint64_t value, int bytes, char *out)
+{
+    for (int i = bytes - 1; i >= 0; --i)
+    {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+/**
+ * \brief Read a big-endian integer
+ * \param in Where to read it from
+ * \param bytes How many bytes it takes
+ * \returns The value, sign-extended from its width
+ */
+inline int64_t GetBigEndian(const char *in, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+    {
+        value = (value << 8) | (unsigned char)in[i];
+    }
+    int unused = 64 - 8 * bytes;
+    return unused > 0 && unused < 64 ? (int64_t)(value << unused) >> unused : (int64_t)value;
+}
+
+/**
+ * \brief How a C++ type goes to and from Postgres' binary format
+ *
+ * Only the types specialised below can be parameters or fields, so
+ * anything else fails to compile where it's used. Each one has:
+ *
+ * - TYPE, the oid parameters of it are sent as
+ * - Reads(type), whether a column of that type can be read into it
+ * - Bind(value, scratch, owned, length), which returns the bytes to
+ *   send, using scratch for anything eight bytes or smaller and owned
+ *   for anything bigger
+ * - Read(data, length, type, value), which fills value in from a column
+ */
+template <typename T, typename = void>
+struct PgValue;
+
+/**
+ * \brief Integers, sent as int2, int4 or int8 by size, and read from any of them
+ */
+template <typename T>
+struct PgValue<T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, bool>>>
+{
+    static constexpr Oid TYPE = sizeof(T) <= 2 ? PG_INT2 : sizeof(T) <= 4 ? PG_INT4 : PG_INT8;
+
+    static bool Reads(Oid type) { return type == PG_INT2 || type == PG_INT4 || type == PG_INT8; }
+
+    static const char *Bind(const T &value, char *scratch, std::string &owned, int &length)
+    {
+        (void)owned;
+        length = sizeof(T) <= 2 ? 2 : sizeof(T) <= 4 ? 4 : 8;
+        PutBigEndian((uint64_t)(int64_t)value, length, scratch);
+        return scratch;
+    }
+
+    static void Read(const char *data, int length, Oid type, T &value)
+    {
+        (void)type;
+        value = (T)GetBigEndian(data, length);
+    }
+};
+
+/**
+ * \brief Floating point, sent as float4 or float8 by size, and read from either
+ */
+template <typename T>
+struct PgValue<T, std::enable_if_t<std::is_floating_point_v<T>>>
+{
+    static constexpr Oid TYPE = sizeof(T) == 4 ? PG_FLOAT4 : PG_FLOAT8;
+
+    static bool Reads(Oid type) { return type == PG_FLOAT4 || type == PG_FLOAT8; }
+
+    static const char *Bind(const T &value, char *scratch, std::string &owned, int &length)
+    {
+        (void)owned;
+        if (sizeof(T) == 4)
+        {
+            uint32_t bits;
+            float narrow = value;
+            memcpy(&bits, &narrow, 4);
+            PutBigEndian(bits, 4, scratch);
+            length = 4;
+        }
+        else
+        {
+            uint64_t bits;
+            double wide = value;
+            memcpy(&bits, &wide, 8);
+            PutBigEndian(bits, 8, scratch);
+            length = 8;
+        }
+        return scratch;
+    }
+
+    static void Read(const char *data, int length, Oid type, T &value)
+    {
+        (void)length;
+        if (type == PG_FLOAT4)
+        {
+            uint32_t bits = (uint32_t)GetBigEndian(data, 4);
+            float narrow;
+            memcpy(&narrow, &bits, 4);
+            value = narrow;
+        }
+        else
+        {
+            uint64_t bits = (uint64_t)GetBigEndian(data, 8);
+            double wide;
+            memcpy(&wide, &bits, 8);
+            value = wide;
+        }
+    }
+};
+
+/**
+ * \brief Booleans, one byte
+ */
+template <>
+struct PgValue<bool>
+{
+    static constexpr Oid TYPE = PG_BOOL;
+
+    static bool Reads(Oid type) { return type == PG_BOOL; }
+
+    static const char *Bind(const bool &value, char *scratch, std::string &owned, int &length)
+    {
+        (void)owned;
+        scratch[0] = value ? 1 : 0;
+        length = 1;
+        return scratch;
+    }
+
+    static void Read(const char *data, int length, Oid type, bool &value)
+    {
+        (void)type;
+        value = length > 0 && data[0] != 0;
+    }
+};
+
+/**
+ * \brief Strings, whose binary format is just their bytes
+ */
+template <>
+struct PgValue<std::string>
+{
+    static constexpr Oid TYPE = PG_TEXT;
+
+    static bool Reads(Oid type)
+    {
+        return type == PG_TEXT || type == PG_VARCHAR || type == PG_BPCHAR || type == PG_NAME;
+    }
+
+    static const char *Bind(const std::string &value, char *scratch, std::string &owned, int &length)
+    {
+        (void)scratch;
+        (void)owned;
+        length = value.size();
+        return value.data();
+    }
+
+    static void Read(const char *data, int length, Oid type, std::string &value)
+    {
+        (void)type;
+        value.assign(data, length);
+    }
+};
+
+/**
+ * \brief Lists of ids, sent as a one-dimensional int8[]
+ *
+ * The binary array format is a header (dimensions, null flag, element
+ * type, then each dimension's size and lower bound) followed by each
+ * element's length and bytes.
+ */
+template <>
+struct PgValue<std::vector<long>>
+{
+    static constexpr Oid TYPE = PG_INT8_ARRAY;
+
+    static bool Reads(Oid type) { return type == PG_INT8_ARRAY; }
+
+    static const char *Bind(const std::vector<long> &value, char *scratch, std::string &owned, int &length)
+    {
+        (void)scratch;
+        owned.assign(20 + 12 * value.size(), '\0');
+        char *out = &owned[0];
+        PutBigEndian(1, 4, out);
+        PutBigEndian(0, 4, out + 4);
+        PutBigEndian(PG_INT8, 4, out + 8);
+        PutBigEndian(value.size(), 4, out + 12);
+        PutBigEndian(1, 4, out + 16);
+        out += 20;
+        for (long element : value)
+        {
+            PutBigEndian(8, 4, out);
+            PutBigEndian((uint64_t)element, 8, out + 4);
+            out += 12;
+        }
+        length = owned.size();
+        return owned.data();
+    }
+
+    static void Read(const char *data, int length, Oid type, std::vector<long> &value)
+    {
+        (void)type;
+        value.clear();
+        if (length < 12 || GetBigEndian(data, 4) != 1)
+        {
+            return;
+        }
+        const char *end = data + length;
+        const char *p = data + 20;
+        while (p + 4 <= end)
+        {
+            int64_t size = GetBigEndian(p, 4);
+            p += 4;
+            if (size < 0 || p + size > end)
+            {
+                value.push_back(0);
+                continue;
+            }
+            value.push_back((long)GetBigEndian(p, size));
+            p += size;
+        }
+    }
+};
+
+/**
+ * \brief Returns the highest $n placeholder in a statement
+ * \param text The statement
+ * \returns The highest n, or 0 if it has none
+ *
+ * Quoted strings and identifiers are skipped.
+ */
+constexpr int CountPlaceholders(const char *text)
+{
+    int highest = 0;
+    char quote = 0;
+    for (const char *p = text; *p; ++p)
+    {
+        if (quote)
+        {
+            quote = *p == quote ? 0 : quote;
+        }
+        else if (*p == '\'' || *p == '"')
+        {
+            quote = *p;
+        }
+        else if (*p == '$' && p[1] >= '1' && p[1] <= '9')
+        {
+            int n = 0;
+            while (p[1] >= '0' && p[1] <= '9')
+            {
+                n = n * 10 + (*++p - '0');
+            }
+            highest = n > highest ? n : highest;
+        }
+    }
+    return highest;
+}
+
+/**
+ * \brief A row read into a struct, a column to each of some of its fields
+ *
+ * Columns are read in the order the fields are listed, e.g.
+ * Columns<&Totals::tracks, &Totals::duration> for "SELECT length, duration ...".
+ */
+template <auto... Fields>
+struct Columns
+{
+    static_assert(sizeof...(Fields) > 0, "a row needs at least one column");
+
+    /// The struct a field is in
+    template <typename Struct, typename Field>
+    static Struct StructOf(Field Struct::*);
+
+    /// What each row is read into
+    typedef decltype(StructOf(std::get<0>(std::make_tuple(Fields...)))) Row;
+
+    /// How many columns each row has
+    static constexpr int COUNT = sizeof...(Fields);
+
+    /**
+     * \brief Whether a result's columns can be read into the fields
+     * \param res The result
+     */
+    static bool Fits(const PGresult *res)
+    {
+        int column = 0;
+        return PQnfields(res) == COUNT && PQfformat(res, 0) == 1
+               && (FieldFits<Fields>(res, column++) && ...);
+    }
+
+    /**
+     * \brief Read one row
+     * \param res The result
+     * \param row Which row
+     * \param value Filled in; fields whose column is NULL are left alone
+     */
+    static void Read(const PGresult *res, int row, Row &value)
+    {
+        int column = 0;
+        (ReadField<Fields>(res, row, column++, value), ...);
+    }
+
+private:
+    template <auto Field>
+    static bool FieldFits(const PGresult *res, int column)
+    {
+        typedef std::remove_reference_t<decltype(std::declval<Row>().*Field)> Type;
+        return PgValue<Type>::Reads(PQftype(res, column));
+    }
+
+    template <auto Field>
+    static void ReadField(const PGresult *res, int row, int column, Row &value)
+    {
+        typedef std::remove_reference_t<decltype(value.*Field)> Type;
+        if (!PQgetisnull(res, row, column))
+        {
+            PgValue<Type>::Read(PQgetvalue(res, row, column), PQgetlength(res, row, column),
+                                PQftype(res, column), value.*Field);
+        }
+    }
+};
+
+/**
+ * \brief A row of one column, read into a plain value
+ */
+template <typename T>
+struct Column
+{
+    /// What each row is read into
+    typedef T Row;
+
+    /// How many columns each row has
+    static constexpr int COUNT = 1;
+
+    /**
+     * \brief Whether a result's column can be read into a T
+     * \param res The result
+     */
+    static bool Fits(const PGresult *res)
+    {
+        return PQnfields(res) == 1 && PQfformat(res, 0) == 1 && PgValue<T>::Reads(PQftype(res, 0));
+    }
+
+    /**
+     * \brief Read one row
+     * \param res The result
+     * \param row Which row
+     * \param value Filled in, or left alone if the column is NULL
+     */
+    static void Read(const PGresult *res, int row, T &value)
+    {
+        if (!PQgetisnull(res, row, 0))
+        {
+            PgValue<T>::Read(PQgetvalue(res, row, 0), PQgetlength(res, row, 0), PQftype(res, 0), value);
+        }
+    }
+};
+
+/**
+ * \brief What a statement that returns no rows reads back
+ */
+struct NoRows
+{
+};
+
+/**
+ * \brief A statement, with the types of its parameters and of the rows it returns
+ *
+ * Made at compile time:
+ *
+ *     static constexpr CStatement<Column<long>, std::string, long> ADD_THING{
+ *         "add_thing", "INSERT INTO things (name, size) VALUES ($1, $2) RETURNING id"};
+ *
+ * It's prepared on a connection the first time it's run there, under
+ * its name, which has to be unique.
+ */
+template <typename Rows, typename... Params>
+class CStatement
+{
+public:
+
+    /**
+     * \brief Define a statement
+     * \param name Name to prepare it under
+     * \param text The SQL, using $1, $2 and so on for the parameters
+     *
+     * Fails to compile if the placeholders don't match the parameters.
+     */
+    consteval CStatement(const char *name, const char *text)
+        : mName(name), mText(text), mTypes{PgValue<Params>::TYPE...}
+    {
+        if (CountPlaceholders(text) != (int)sizeof...(Params))
+        {
+            throw "the statement's placeholders don't match its parameters";
+        }
+    }
+
+    /**
+     * \brief Returns the name it's prepared under
+     * \returns The name
+     */
+    constexpr const char *GetName() const { return mName; }
+
+    /**
+     * \brief Returns the SQL
+     * \returns The SQL
+     */
+    constexpr const char *GetText() const { return mText; }
+
+    /**
+     * \brief Returns the oids of its parameters
+     * \returns Oids, in order, or nullptr if it has none
+     */
+    constexpr const Oid *GetTypes() const { return sizeof...(Params) ? mTypes.data() : nullptr; }
+
+private:
+    /// Name it's prepared under
+    const char *mName;
+
+    /// The SQL
+    const char *mText;
+
+    /// Oids of its parameters
+    std::array<Oid, sizeof...(Params)> mTypes;
+};
+
+/**
+ * \brief Parameters in binary, laid out the way PQexecPrepared() takes them
+ *
+ * Numbers are written into space kept here, and strings are pointed at
+ * where they are, so nothing is allocated for either.
+ */
+template <typename... Params>
+struct BoundParams
+{
+    static constexpr size_t COUNT = sizeof...(Params);
+
+    const char *values[COUNT ? COUNT : 1];      ///< Each parameter's bytes
+    int lengths[COUNT ? COUNT : 1];             ///< How many bytes each one has
+    int formats[COUNT ? COUNT : 1];             ///< All 1, for binary
+    char scratch[COUNT ? COUNT : 1][8];         ///< Where numbers are written
+    std::string owned[COUNT ? COUNT : 1];       ///< Where anything longer is written
+    size_t sent = 0;                            ///< Bytes of them all, for the stats
+
+    /**
+     * \brief Lay the parameters out
+     * \param params The parameters; strings have to outlive this
+     */
+    explicit BoundParams(const Params &...params)
+    {
+        size_t i = 0;
+        ((values[i] = PgValue<Params>::Bind(params, scratch[i], owned[i], lengths[i]),
+          formats[i] = 1, sent += lengths[i], ++i), ...);
+        (void)i;
+    }
+
+    /** \brief Copy constructor (disabled)
+     * \param params Parameters to construct this based on */
+    BoundParams(const BoundParams &params) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param params Parameters whose attributes will override those of the current ones */
+    BoundParams& operator=(const BoundParams &params) = delete;
+};
+
+/**
+ * \brief Read every row of a result
+ * \param res The result, from running a statement returning Rows
+ * \param rows Filled in with the rows, in order
+ * \returns -1 if the statement failed, or its columns don't fit the rows
+ */
+template <typename Rows>
+int ReadRows(const PGresult *res, std::vector<typename Rows::Row> &rows)
+{
+    rows.clear();
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || !Rows::Fits(res))
+    {
+        return -1;
+    }
+
+    int n = PQntuples(res);
+    rows.resize(n);
+    for (int i = 0; i < n; ++i)
+    {
+        Rows::Read(res, i, rows[i]);
+    }
+    return 0;
+}
+
+/**
+ * \brief Read the first row of a result
+ * \param res The result, from running a statement returning Rows
+ * \param row Filled in with the row
+ * \returns -1 if the statement failed, returned nothing, or its columns don't fit the row
+ */
+template <typename Rows>
+int ReadRow(const PGresult *res, typename Rows::Row &row)
+{
+    if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) < 1 || !Rows::Fits(res))
+    {
+        return -1;
+    }
+
+    Rows::Read(res, 0, row);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,172 @@
+/**
+ * \file Reactor.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cerrno>
+#include <vector>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include "Reactor.h"
+
+/// Events taken from epoll at a time
+static const int EVENT_BATCH = 64;
+
+/**
+ * \brief Constructor
+ */
+CReactor::CReactor()
+{
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    mWaiting = 0;
+}
+
+/**
+ * \brief Destructor
+ *
+ * Destroys spawned tasks that haven't finished, where they are
+ */
+CReactor::~CReactor()
+{
+    mSpawned.clear();
+    if (mEpoll >= 0)
+    {
+        close(mEpoll);
+    }
+}
+
+/**
+ * \brief Start a task that nothing will await
+ * \param task The task; kept until it finishes, or the reactor is destroyed
+ */
+void CReactor::Spawn(CTask<> task)
+{
+    mSpawned.push_back(std::move(task));
+    mSpawned.back().Start();
+    Sweep();
+}
+
+/**
+ * \brief Wait for descriptors to be ready, and resume what was waiting on them
+ * \param timeout Milliseconds to wait at most, 0 not to, or -1 forever
+ * \returns Number of coroutines resumed, or -1 if none are waiting, so there's nothing to wait for
+ */
+int CReactor::RunOnce(int timeout)
+{
+    if (mWaiting == 0 || mEpoll < 0)
+    {
+        return -1;
+    }
+
+    epoll_event events[EVENT_BATCH];
+    int ready = epoll_wait(mEpoll, events, EVENT_BATCH, timeout);
+    if (ready < 0)
+    {
+        return errno == EINTR ? 0 : -1;
+    }
+
+    // Take every waiter off first, so what's resumed can wait again straight away
+    std::vector<std::coroutine_handle<>> resuming;
+    for (int i = 0; i < ready; ++i)
+    {
+        int fd = events[i].data.fd;
+        auto watchers = mWatchers.find(fd);
+        if (watchers == mWatchers.end())
+        {
+            continue;
+        }
+
+        uint32_t hangup = EPOLLHUP | EPOLLERR;
+        if (watchers->second.reader && (events[i].events & (EPOLLIN | hangup)))
+        {
+            resuming.push_back(std::exchange(watchers->second.reader, nullptr));
+        }
+        if (watchers->second.writer && (events[i].events & (EPOLLOUT | hangup)))
+        {
+            resuming.push_back(std::exchange(watchers->second.writer, nullptr));
+        }
+        Update(fd, false);
+    }
+
+    mWaiting -= resuming.size();
+    for (std::coroutine_handle<> waiter : resuming)
+    {
+        waiter.resume();
+    }
+    Sweep();
+
+    return resuming.size();
+}
+
+/**
+ * \brief Have a coroutine wait on a descriptor
+ * \param fd The descriptor
+ * \param write Whether it's waiting for room to write
+ * \param waiter The coroutine
+ * \returns false if epoll can't wait on the descriptor, in which case the coroutine carries on
+ */
+bool CReactor::Watch(int fd, bool write, std::coroutine_handle<> waiter)
+{
+    auto watchers = mWatchers.try_emplace(fd);
+    (write ? watchers.first->second.writer : watchers.first->second.reader) = waiter;
+    if (!Update(fd, watchers.second))
+    {
+        auto left = mWatchers.find(fd);
+        if (left != mWatchers.end())
+        {
+            (write ? left->second.writer : left->second.reader) = nullptr;
+        }
+        return false;
+    }
+    ++mWaiting;
+    return true;
+}
+
+/**
+ * \brief Tell epoll what's waited for on a descriptor now
+ * \param fd The descriptor
+ * \param added Whether epoll isn't watching it yet
+ * \returns false if epoll can't wait on it
+ *
+ * A descriptor nothing is waiting on is dropped from epoll altogether,
+ * so it can be closed without telling the reactor.
+ */
+bool CReactor::Update(int fd, bool added)
+{
+    auto watchers = mWatchers.find(fd);
+
+    epoll_event event = {};
+    event.data.fd = fd;
+    if (watchers->second.reader)
+    {
+        event.events |= EPOLLIN;
+    }
+    if (watchers->second.writer)
+    {
+        event.events |= EPOLLOUT;
+    }
+
+    if (!event.events)
+    {
+        epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, nullptr);
+        mWatchers.erase(watchers);
+        return true;
+    }
+    if (epoll_ctl(mEpoll, added ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) != 0)
+    {
+        if (added)
+        {
+            mWatchers.erase(watchers);
+        }
+        return false;
+    }
+    return true;
+}
+
+/**
+ * \brief Forget spawned tasks that have finished
+ */
+void CReactor::Sweep()
+{
+    mSpawned.remove_if([](CTask<> &task) { return task.IsDone(); });
+}
@@ -0,0 +1,153 @@
+/**
+ * \file Reactor.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Reactor class
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <coroutine>
+#include <list>
+#include <map>
+#include "Task.h"
+
+/**
+ * \brief Resumes coroutines when the file descriptors they wait on are ready
+ *
+ * A coroutine co_awaits Readable() or Writable() on a non-blocking
+ * descriptor and is resumed by RunOnce() once epoll says it's ready,
+ * so one thread can have any number of operations under way on any
+ * number of sockets without a thread or a callback for each.
+ *
+ * Run() is the way in from ordinary code: it starts a task and turns
+ * the loop until the task is done. Spawn() starts one that nothing
+ * awaits, to run alongside as the loop turns.
+ *
+ * Only one coroutine at a time can wait to read, and one to write, on
+ * any one descriptor. Like the tasks it runs, a reactor belongs to one
+ * thread at a time.
+ */
+class CReactor
+{
+public:
+
+    /// What a coroutine awaits to wait on a descriptor
+    class Readiness
+    {
+    public:
+
+        /** \brief Default constructor (disabled) */
+        Readiness() = delete;
+
+        /**
+         * \brief Constructor
+         * \param reactor Reactor to wait in
+         * \param fd Descriptor to wait on
+         * \param write Whether to wait for room to write rather than something to read
+         */
+        Readiness(CReactor *reactor, int fd, bool write) : mReactor(reactor), mFd(fd), mWrite(write) {}
+
+        /** \brief Always wait; don't call this without trying the descriptor first */
+        bool await_ready() { return false; }
+
+        /**
+         * \brief Wait on the descriptor
+         * \param waiter The coroutine waiting
+         * \returns false to carry straight on, if it's a descriptor epoll can't wait on, like a file's
+         */
+        bool await_suspend(std::coroutine_handle<> waiter) { return mReactor->Watch(mFd, mWrite, waiter); }
+
+        /** \brief Carry on; the descriptor is ready, or has hung up */
+        void await_resume() {}
+
+    private:
+        CReactor *mReactor;     ///< Reactor to wait in
+        int mFd;                ///< Descriptor to wait on
+        bool mWrite;            ///< Whether to wait for room to write
+    };
+
+    CReactor();
+    ~CReactor();
+
+    /** \brief Copy constructor (disabled)
+     * \param reactor Reactor to construct this based on */
+    CReactor(const CReactor &reactor) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param reactor Reactor whose attributes will override those of the current reactor */
+    CReactor& operator=(const CReactor &reactor) = delete;
+
+    /**
+     * \brief Wait for something to read
+     * \param fd The descriptor
+     * \returns Something to co_await
+     */
+    Readiness Readable(int fd) { return Readiness(this, fd, false); }
+
+    /**
+     * \brief Wait for room to write
+     * \param fd The descriptor
+     * \returns Something to co_await
+     */
+    Readiness Writable(int fd) { return Readiness(this, fd, true); }
+
+    void Spawn(CTask<> task);
+
+    int RunOnce(int timeout);
+
+    /**
+     * \brief Run a task to the end
+     * \param task The task
+     * \returns What it co_returned, or a default T if it got stuck with
+     *          nothing to wait for
+     *
+     * Tasks spawned meanwhile carry on as far as they can get while
+     * this one runs, and no further.
+     */
+    template <typename T>
+    T Run(CTask<T> task)
+    {
+        task.Start();
+        while (!task.IsDone() && RunOnce(-1) >= 0);
+        return task.Result();
+    }
+
+    /**
+     * \brief Returns how many coroutines are waiting on descriptors
+     * \returns Number of coroutines
+     */
+    size_t GetWaiting() { return mWaiting; }
+
+    /**
+     * \brief Returns how many spawned tasks haven't finished
+     * \returns Number of tasks
+     */
+    size_t GetSpawned() { return mSpawned.size(); }
+
+private:
+    /// Who is waiting on a descriptor
+    struct Watchers
+    {
+        std::coroutine_handle<> reader;     ///< Waiting to read, or nullptr
+        std::coroutine_handle<> writer;     ///< Waiting to write, or nullptr
+    };
+
+    bool Watch(int fd, bool write, std::coroutine_handle<> waiter);
+    bool Update(int fd, bool added);
+    void Sweep();
+
+    /// What RunOnce() waits on
+    int mEpoll;
+
+    /// Who is waiting on each descriptor epoll is watching
+    std::map<int, Watchers> mWatchers;
+
+    /// Coroutines waiting
+    size_t mWaiting;
+
+    /// Spawned tasks that haven't finished
+    std::list<CTask<>> mSpawned;
+};
+
+#endif
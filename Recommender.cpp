@@ -0,0 +1,663 @@
+/**
+ * \file Recommender.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <functional>
+#include <queue>
+#include "Recommender.h"
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+/// ID of the playlist every track is in, which says nothing about taste
+static const long LIBRARY_PLAYLIST = 1;
+
+/// Unmerged edits to let pile up before compacting, at the least
+static const size_t MIN_PENDING = 4096;
+
+/**
+ * \brief Scramble a track id into 64 random-looking bits
+ * \param track The track id
+ * \returns The bits; bit d is the sign of the track's direction in dimension d
+ *
+ * This is splitmix64's finalizer, so nothing needs to be stored per track.
+ */
+static uint64_t Direction(uint32_t track)
+{
+    uint64_t x = track + 0x9e3779b97f4a7c15ull;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * \brief Constructor for a recommender with nothing built
+ */
+CRecommender::CRecommender()
+{
+    Clear();
+}
+
+/**
+ * \brief Forget everything, until the next Build()
+ */
+void CRecommender::Clear()
+{
+    mBuilt = false;
+    mOffsets.assign(1, 0);
+    mEntries.clear();
+    mPending.clear();
+    mPendingCount = 0;
+    mSketches.clear();
+    mDirty.clear();
+    mIsDirty.clear();
+    mPlays.clear();
+    mSkips.clear();
+}
+
+/**
+ * \brief Count every playlist and the listening history in a storage
+ * \param storage Where the library is kept
+ * \returns -1 if the storage isn't usable
+ *
+ * Reads each playlist once and the stats of every track in one go,
+ * then works out the matrix a row at a time. From here on the
+ * recommender has to be told about every edit (see Added(),
+ * Removing(), RemoveTrack() and Played()); CLibrary and CPlaylist do
+ * that themselves.
+ */
+int CRecommender::Build(CStorage *storage)
+{
+    Clear();
+
+    if (storage->GetStatus() != CONNECTION_OK)
+    {
+        return -1;
+    }
+
+    // Every counted playlist's tracks, back to back
+    std::vector<size_t> starts(1, 0);
+    std::vector<uint32_t> members;
+    std::vector<long> library;
+    long last = 0;
+
+    storage->ReadPlaylists([&](long id, const std::string &, const std::vector<long> &tracks)
+    {
+        if (id == LIBRARY_PLAYLIST)
+        {
+            library = tracks;
+        }
+        else if (tracks.size() >= 2 && tracks.size() <= MAX_PLAYLIST)
+        {
+            for (long track : tracks)
+            {
+                members.push_back(track);
+                last = std::max(last, track);
+            }
+            starts.push_back(members.size());
+        }
+    });
+
+    for (long track : library)
+    {
+        last = std::max(last, track);
+    }
+    if (last > UINT32_MAX - 1)
+    {
+        return -1;
+    }
+    Grow(last);
+
+    size_t rows = mOffsets.size() - 1;
+    size_t playlists = starts.size() - 1;
+
+    // Which playlists each track is in, once per time it's in them
+    std::vector<size_t> byTrack(rows + 1, 0);
+    for (uint32_t track : members)
+    {
+        ++byTrack[track + 1];
+    }
+    for (size_t t = 0; t < rows; ++t)
+    {
+        byTrack[t + 1] += byTrack[t];
+    }
+    std::vector<uint32_t> memberships(members.size());
+    std::vector<size_t> next(byTrack.begin(), byTrack.end() - 1);
+    for (size_t p = 0; p < playlists; ++p)
+    {
+        for (size_t i = starts[p]; i < starts[p + 1]; ++i)
+        {
+            memberships[next[members[i]]++] = p;
+        }
+    }
+
+    // A row is the sum of the playlists its track is in
+    std::vector<float> sums(rows, 0);
+    std::vector<uint32_t> touched;
+    for (size_t t = 0; t < rows; ++t)
+    {
+        touched.clear();
+        for (size_t m = byTrack[t]; m < byTrack[t + 1]; ++m)
+        {
+            size_t p = memberships[m];
+            for (size_t i = starts[p]; i < starts[p + 1]; ++i)
+            {
+                uint32_t other = members[i];
+                if (other == t)
+                {
+                    continue;
+                }
+                if (sums[other] == 0)
+                {
+                    touched.push_back(other);
+                }
+                sums[other] += 1;
+            }
+        }
+
+        std::sort(touched.begin(), touched.end());
+        for (uint32_t other : touched)
+        {
+            mEntries.push_back({other, sums[other]});
+            sums[other] = 0;
+        }
+        mOffsets[t + 1] = mEntries.size();
+    }
+
+    std::vector<std::string> ids;
+    ids.reserve(library.size());
+    for (long track : library)
+    {
+        ids.push_back(std::to_string(track));
+    }
+    std::vector<CStorage::TrackStats> stats = storage->GetTrackStats(ids);
+    for (size_t i = 0; i < stats.size() && i < library.size(); ++i)
+    {
+        mPlays[library[i]] = stats[i].plays;
+        mSkips[library[i]] = stats[i].skips;
+    }
+
+    std::vector<Entry> row;
+    for (size_t t = 0; t < rows; ++t)
+    {
+        row.assign(mEntries.begin() + mOffsets[t], mEntries.begin() + mOffsets[t + 1]);
+        Sketch(t, row);
+    }
+
+    mBuilt = true;
+    return 0;
+}
+
+/**
+ * \brief Count tracks that were just added to a playlist
+ * \param playlist ID of the playlist
+ * \param tracks Every track in the playlist now, in order
+ * \param first Index in tracks of the first one added
+ * \param count Number of tracks added
+ */
+void CRecommender::Added(const std::string &playlist, const std::vector<std::string> &tracks,
+                         size_t first, size_t count)
+{
+    if (!mBuilt || count == 0 || playlist == "temp" || playlist == std::to_string(LIBRARY_PLAYLIST))
+    {
+        return;
+    }
+
+    size_t before = tracks.size() - count;
+    if (before > MAX_PLAYLIST)
+    {
+        return;
+    }
+
+    if (tracks.size() <= MAX_PLAYLIST)
+    {
+        Change(tracks, first, count, 1);
+    }
+    else
+    {
+        // It's grown too long to count, so take back what it had counted
+        std::vector<std::string> rest(tracks.begin(), tracks.begin() + first);
+        rest.insert(rest.end(), tracks.begin() + first + count, tracks.end());
+        Change(rest, 0, rest.size(), -1);
+    }
+}
+
+/**
+ * \brief Uncount tracks that are about to be removed from a playlist
+ * \param playlist ID of the playlist
+ * \param tracks Every track in the playlist still, in order
+ * \param first Index in tracks of the first one to be removed
+ * \param count Number of tracks to be removed
+ */
+void CRecommender::Removing(const std::string &playlist, const std::vector<std::string> &tracks,
+                            size_t first, size_t count)
+{
+    if (!mBuilt || count == 0 || playlist == "temp" || playlist == std::to_string(LIBRARY_PLAYLIST))
+    {
+        return;
+    }
+
+    size_t after = tracks.size() - count;
+    if (after > MAX_PLAYLIST)
+    {
+        return;
+    }
+
+    if (tracks.size() <= MAX_PLAYLIST)
+    {
+        Change(tracks, first, count, -1);
+    }
+    else
+    {
+        // It's short enough to count now
+        std::vector<std::string> rest(tracks.begin(), tracks.begin() + first);
+        rest.insert(rest.end(), tracks.begin() + first + count, tracks.end());
+        Change(rest, 0, rest.size(), 1);
+    }
+}
+
+/**
+ * \brief Forget a track that was removed from the library
+ * \param track ID of the track
+ */
+void CRecommender::RemoveTrack(const std::string &track)
+{
+    uint32_t id = IdOf(track);
+    if (!mBuilt || id == 0 || id >= mOffsets.size() - 1)
+    {
+        return;
+    }
+
+    std::vector<Entry> row;
+    Row(id, row);
+    for (const Entry &entry : row)
+    {
+        Pair(id, entry.track, -entry.weight);
+    }
+    mPlays[id] = 0;
+    mSkips[id] = 0;
+
+    if (mPendingCount > std::max(MIN_PENDING, mEntries.size() / 4))
+    {
+        Compact();
+    }
+}
+
+/**
+ * \brief Count something that happened while a track was playing
+ * \param event What happened
+ */
+void CRecommender::Played(const CStorage::PlayRecord &event)
+{
+    if (!mBuilt || event.track < 1 || event.track > UINT32_MAX - 1)
+    {
+        return;
+    }
+
+    Grow(event.track);
+    if (event.event == CStorage::EVENT_PLAY)
+    {
+        ++mPlays[event.track];
+    }
+    else if (event.event == CStorage::EVENT_SKIP)
+    {
+        ++mSkips[event.track];
+    }
+}
+
+/**
+ * \brief Suggest tracks that go with some others
+ * \param tracks IDs of the tracks, e.g. a playlist's
+ * \param count How many to suggest, at most
+ * \returns IDs of the suggestions, best first; none of them are in tracks
+ *
+ * Only tracks that share a playlist with something are ever suggested,
+ * so this may come back short.
+ */
+std::vector<std::string> CRecommender::Recommend(const std::vector<std::string> &tracks, size_t count)
+{
+    std::vector<std::string> result;
+    if (!mBuilt || count == 0)
+    {
+        return result;
+    }
+
+    Refresh();
+
+    size_t rows = mOffsets.size() - 1;
+    std::vector<bool> exclude(rows, false);
+    int sum[DIMENSIONS] = {0};
+    for (const std::string &track : tracks)
+    {
+        uint32_t id = IdOf(track);
+        if (id == 0 || id >= rows)
+        {
+            continue;
+        }
+        exclude[id] = true;
+
+        const int8_t *sketch = &mSketches[id * DIMENSIONS];
+        for (size_t d = 0; d < DIMENSIONS; ++d)
+        {
+            sum[d] += sketch[d];
+        }
+    }
+
+    int top = 0;
+    for (size_t d = 0; d < DIMENSIONS; ++d)
+    {
+        top = std::max(top, std::abs(sum[d]));
+    }
+    if (top == 0)
+    {
+        return result;
+    }
+
+    alignas(32) int8_t query[DIMENSIONS];
+    for (size_t d = 0; d < DIMENSIONS; ++d)
+    {
+        query[d] = (int8_t)lrintf(127.0f * sum[d] / top);
+    }
+
+    // The best so far, worst on top
+    typedef std::pair<float, uint32_t> Scored;
+    std::priority_queue<Scored, std::vector<Scored>, std::greater<Scored>> best;
+
+    for (size_t t = 1; t < rows; ++t)
+    {
+        if (exclude[t])
+        {
+            continue;
+        }
+
+        int dot = Dot(query, &mSketches[t * DIMENSIONS]);
+        if (dot <= 0)
+        {
+            continue;
+        }
+
+        float score = dot;
+        if (mPlays[t])
+        {
+            score *= 1.0f - 0.5f * std::min(1.0f, (float)mSkips[t] / mPlays[t]);
+        }
+
+        if (best.size() < count)
+        {
+            best.push({score, (uint32_t)t});
+        }
+        else if (score > best.top().first)
+        {
+            best.pop();
+            best.push({score, (uint32_t)t});
+        }
+    }
+
+    result.resize(best.size());
+    for (size_t i = result.size(); i-- > 0; best.pop())
+    {
+        result[i] = std::to_string(best.top().second);
+    }
+
+    return result;
+}
+
+/**
+ * \brief Make room for a track's row
+ * \param track The largest track id that needs a row
+ */
+void CRecommender::Grow(uint32_t track)
+{
+    size_t rows = (size_t)track + 1;
+    if (rows <= mOffsets.size() - 1)
+    {
+        return;
+    }
+
+    mOffsets.resize(rows + 1, mOffsets.back());
+    mSketches.resize(rows * DIMENSIONS, 0);
+    mIsDirty.resize(rows, false);
+    mPlays.resize(rows, 0);
+    mSkips.resize(rows, 0);
+}
+
+/**
+ * \brief Count two tracks sharing a playlist, both ways round
+ * \param a One track
+ * \param b The other track
+ * \param weight How much to count it; negative to uncount it
+ */
+void CRecommender::Pair(uint32_t a, uint32_t b, float weight)
+{
+    if (a == b || a == 0 || b == 0)
+    {
+        return;
+    }
+
+    Grow(std::max(a, b));
+
+    mPending[a].push_back({b, weight});
+    mPending[b].push_back({a, weight});
+    mPendingCount += 2;
+
+    for (uint32_t track : {a, b})
+    {
+        if (!mIsDirty[track])
+        {
+            mIsDirty[track] = true;
+            mDirty.push_back(track);
+        }
+    }
+}
+
+/**
+ * \brief Count a run of a playlist's tracks against the rest of it and each other
+ * \param tracks Every track in the playlist, in order
+ * \param first Index in tracks of the first one in the run
+ * \param count Number of tracks in the run
+ * \param sign 1 to count them, -1 to uncount them
+ */
+void CRecommender::Change(const std::vector<std::string> &tracks, size_t first, size_t count, float sign)
+{
+    std::vector<uint32_t> ids;
+    ids.reserve(tracks.size());
+    for (const std::string &track : tracks)
+    {
+        ids.push_back(IdOf(track));
+    }
+
+    size_t end = first + count;
+    for (size_t i = first; i < end; ++i)
+    {
+        for (size_t j = 0; j < ids.size(); ++j)
+        {
+            // Pairs within the run only count once
+            if (j < i || j >= end)
+            {
+                Pair(ids[i], ids[j], sign);
+            }
+        }
+    }
+
+    if (mPendingCount > std::max(MIN_PENDING, mEntries.size() / 4))
+    {
+        Compact();
+    }
+}
+
+/**
+ * \brief Read a track's row, edits and all
+ * \param track The track
+ * \param row Filled in with the row's nonzeros, ordered by track
+ */
+void CRecommender::Row(uint32_t track, std::vector<Entry> &row)
+{
+    row.assign(mEntries.begin() + mOffsets[track], mEntries.begin() + mOffsets[track + 1]);
+
+    auto pending = mPending.find(track);
+    if (pending == mPending.end())
+    {
+        return;
+    }
+
+    row.insert(row.end(), pending->second.begin(), pending->second.end());
+    std::sort(row.begin(), row.end(), [](const Entry &a, const Entry &b) { return a.track < b.track; });
+
+    // Fold repeats together and drop whatever has been uncounted to nothing
+    size_t kept = 0;
+    for (size_t i = 0; i < row.size(); )
+    {
+        Entry entry = row[i];
+        for (++i; i < row.size() && row[i].track == entry.track; ++i)
+        {
+            entry.weight += row[i].weight;
+        }
+        if (entry.weight > 0.5f)
+        {
+            row[kept++] = entry;
+        }
+    }
+    row.resize(kept);
+}
+
+/**
+ * \brief Merge every edit into the matrix proper
+ */
+void CRecommender::Compact()
+{
+    size_t rows = mOffsets.size() - 1;
+    std::vector<size_t> offsets(rows + 1, 0);
+    std::vector<Entry> entries;
+    entries.reserve(mEntries.size() + mPendingCount);
+
+    std::vector<Entry> row;
+    for (size_t t = 0; t < rows; ++t)
+    {
+        Row(t, row);
+        entries.insert(entries.end(), row.begin(), row.end());
+        offsets[t + 1] = entries.size();
+    }
+
+    mOffsets.swap(offsets);
+    mEntries.swap(entries);
+    mPending.clear();
+    mPendingCount = 0;
+}
+
+/**
+ * \brief Bring every changed track's sketch up to date
+ */
+void CRecommender::Refresh()
+{
+    std::vector<Entry> row;
+    for (uint32_t track : mDirty)
+    {
+        Row(track, row);
+        Sketch(track, row);
+        mIsDirty[track] = false;
+    }
+    mDirty.clear();
+}
+
+/**
+ * \brief Work out a track's sketch from its row
+ * \param track The track
+ * \param row The track's row
+ *
+ * Each track has a fixed random direction; a sketch is the track's own
+ * direction plus those of the tracks it shares playlists with, weighted
+ * by how often, scaled to fit in bytes. Counts are damped so one
+ * playlist pasted in ten times doesn't drown everything else out.
+ */
+void CRecommender::Sketch(uint32_t track, const std::vector<Entry> &row)
+{
+    int8_t *sketch = &mSketches[track * DIMENSIONS];
+    if (row.empty())
+    {
+        std::fill(sketch, sketch + DIMENSIONS, 0);
+        return;
+    }
+
+    float sum[DIMENSIONS] = {0};
+    float self = 0;
+    for (const Entry &entry : row)
+    {
+        float weight = log1pf(entry.weight);
+        self = std::max(self, weight);
+
+        // Branch free, so the loop vectorizes
+        uint64_t direction = Direction(entry.track);
+        for (size_t d = 0; d < DIMENSIONS; ++d)
+        {
+            sum[d] += weight * (float)((int)(direction >> d & 1) * 2 - 1);
+        }
+    }
+
+    uint64_t direction = Direction(track);
+    float norm = 0;
+    for (size_t d = 0; d < DIMENSIONS; ++d)
+    {
+        sum[d] += (direction >> d & 1) ? self : -self;
+        norm += sum[d] * sum[d];
+    }
+
+    norm = sqrtf(norm);
+    for (size_t d = 0; d < DIMENSIONS; ++d)
+    {
+        sketch[d] = (int8_t)lrintf(127.0f * sum[d] / norm);
+    }
+}
+
+/**
+ * \brief Turn a track id into a row number
+ * \param id ID of the track
+ * \returns Row number, or 0 if the id is no good
+ */
+uint32_t CRecommender::IdOf(const std::string &id)
+{
+    char *end = nullptr;
+    unsigned long track = strtoul(id.c_str(), &end, 10);
+    if (id.empty() || *end != '\0' || track > UINT32_MAX - 1)
+    {
+        return 0;
+    }
+    return track;
+}
+
+/**
+ * \brief Dot product of two sketches
+ * \param a One sketch
+ * \param b The other sketch
+ * \returns The dot product
+ *
+ * With AVX2 this is four multiply-adds; otherwise the loop is simple
+ * enough for the compiler to vectorize itself.
+ */
+int CRecommender::Dot(const int8_t *a, const int8_t *b)
+{
+#ifdef __AVX2__
+    __m256i total = _mm256_setzero_si256();
+    for (size_t d = 0; d < DIMENSIONS; d += 16)
+    {
+        __m256i x = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(a + d)));
+        __m256i y = _mm256_cvtepi8_epi16(_mm_loadu_si128((const __m128i *)(b + d)));
+        total = _mm256_add_epi32(total, _mm256_madd_epi16(x, y));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(total), _mm256_extracti128_si256(total, 1));
+    half = _mm_hadd_epi32(half, half);
+    half = _mm_hadd_epi32(half, half);
+    return _mm_cvtsi128_si32(half);
+#else
+    int total = 0;
+    for (size_t d = 0; d < DIMENSIONS; ++d)
+    {
+        total += a[d] * b[d];
+    }
+    return total;
+#endif
+}
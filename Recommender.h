@@ -0,0 +1,134 @@
+/**
+ * \file Recommender.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Recommender class
+ */
+
+#ifndef RECOMMENDER_H
+#define RECOMMENDER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "Storage.h"
+
+/**
+ * \brief Suggests tracks that go with the ones in a playlist
+ *
+ * Two tracks are related as often as they sit in the same playlist.
+ * Those counts are kept as a sparse matrix, one row per track, in
+ * compressed sparse row form; edits made since it was last compacted
+ * sit alongside it until there are enough to be worth merging in.
+ *
+ * Each row is folded into a short signed-random-projection sketch of
+ * DIMENSIONS bytes, so tracks with related rows have sketches that
+ * point the same way. Suggesting tracks is one pass of int8 dot
+ * products over every sketch, which is a few milliseconds even for
+ * half a million tracks, and never touches the storage. Tracks that
+ * tend to get skipped are marked down.
+ *
+ * The library playlist, and playlists longer than MAX_PLAYLIST (which
+ * are more catalog than taste), aren't counted.
+ */
+class CRecommender
+{
+public:
+
+    CRecommender();
+
+    /** \brief Copy constructor (disabled)
+     * \param recommender Recommender to construct this based on */
+    CRecommender(const CRecommender &recommender) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param recommender Recommender whose attributes will override those of the current recommender */
+    CRecommender& operator=(const CRecommender &recommender) = delete;
+
+    /** \brief Destructor */
+    ~CRecommender() {}
+
+    int Build(CStorage *storage);
+
+    void Clear();
+
+    /**
+     * \brief Whether Build() has been called since the last Clear()
+     * \returns true if it has
+     */
+    bool IsBuilt() { return mBuilt; }
+
+    void Added(const std::string &playlist, const std::vector<std::string> &tracks, size_t first, size_t count);
+
+    void Removing(const std::string &playlist, const std::vector<std::string> &tracks, size_t first, size_t count);
+
+    void RemoveTrack(const std::string &track);
+
+    void Played(const CStorage::PlayRecord &event);
+
+    std::vector<std::string> Recommend(const std::vector<std::string> &tracks, size_t count);
+
+    /**
+     * \brief Returns how many related pairs of tracks are counted
+     * \returns Nonzero entries in the matrix, counting edits not merged in yet
+     */
+    size_t GetPairs() { return mEntries.size() + mPendingCount; }
+
+    /// Number of bytes in each track's sketch
+    static const size_t DIMENSIONS = 64;
+
+    /// Longest playlist that is counted
+    static const size_t MAX_PLAYLIST = 1000;
+
+private:
+    /// One nonzero in a row of the matrix
+    struct Entry
+    {
+        uint32_t track;     ///< The column: the other track
+        float weight;       ///< How many times they shared a playlist
+    };
+
+    void Grow(uint32_t track);
+    void Pair(uint32_t a, uint32_t b, float weight);
+    void Change(const std::vector<std::string> &tracks, size_t first, size_t count, float sign);
+    void Row(uint32_t track, std::vector<Entry> &row);
+    void Compact();
+    void Refresh();
+    void Sketch(uint32_t track, const std::vector<Entry> &row);
+
+    static uint32_t IdOf(const std::string &id);
+    static int Dot(const int8_t *a, const int8_t *b);
+
+    /// Whether Build() has been called since the last Clear()
+    bool mBuilt;
+
+    /// Where each track's row starts in mEntries; one longer than the number of rows
+    std::vector<size_t> mOffsets;
+
+    /// Every row's nonzeros, ordered by track within each row
+    std::vector<Entry> mEntries;
+
+    /// Changes to rows not merged into mEntries yet, unordered and possibly repeated
+    std::unordered_map<uint32_t, std::vector<Entry>> mPending;
+
+    /// Number of entries in mPending
+    size_t mPendingCount;
+
+    /// Each track's sketch, DIMENSIONS bytes apiece; all zero for tracks in no playlist
+    std::vector<int8_t> mSketches;
+
+    /// Tracks whose row has changed since their sketch was worked out
+    std::vector<uint32_t> mDirty;
+
+    /// Whether each track is in mDirty
+    std::vector<bool> mIsDirty;
+
+    /// Times each track started playing
+    std::vector<uint32_t> mPlays;
+
+    /// Times each track was skipped
+    std::vector<uint32_t> mSkips;
+};
+
+#endif
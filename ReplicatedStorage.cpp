@@ -0,0 +1,627 @@
+/**
+ * \file ReplicatedStorage.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include "ReplicatedStorage.h"
+
+/**
+ * \brief Constructor
+ * \param primary Storage to write to; this takes ownership
+ * \param standbys Storages following the primary to read from; this takes ownership
+ */
+CReplicatedStorage::CReplicatedStorage(CStorage *primary, const std::vector<CStorage *> &standbys)
+{
+    mPrimary = primary;
+    mStandbys = standbys;
+    mReplayed.assign(mStandbys.size(), -1);
+}
+
+/**
+ * \brief Destructor
+ *
+ * Closes the primary and every standby
+ */
+CReplicatedStorage::~CReplicatedStorage()
+{
+    delete mPrimary;
+    for (CStorage *standby : mStandbys)
+    {
+        delete standby;
+    }
+}
+
+/**
+ * \brief Choose where the primary and every standby report statements
+ * \param stats Stats to report to, or nullptr to stop reporting
+ */
+void CReplicatedStorage::SetStats(CStats *stats)
+{
+    mStats = stats;
+    mPrimary->SetStats(stats);
+    for (CStorage *standby : mStandbys)
+    {
+        standby->SetStats(stats);
+    }
+}
+
+/**
+ * \brief Exposes whether the primary can be reached
+ * \returns The primary's status; standbys that can't be reached just aren't read from
+ */
+ConnStatusType CReplicatedStorage::GetStatus()
+{
+    return mPrimary->GetStatus();
+}
+
+/**
+ * \brief Returns the primary's Postgres connection
+ * \returns Connection, or nullptr if the primary isn't Postgres
+ */
+PGconn *CReplicatedStorage::GetConnection()
+{
+    return mPrimary->GetConnection();
+}
+
+/**
+ * \brief Returns how far the primary's committed writes have got
+ * \returns Position in its write-ahead log, 0 if it doesn't have one, or -1 if it can't tell
+ */
+long long CReplicatedStorage::GetWritePosition()
+{
+    return mPrimary->GetWritePosition();
+}
+
+/**
+ * \brief Pick where the next read goes
+ * \returns The next standby in turn that has caught up with this storage's writes, or the primary
+ *
+ * A batch or restore reads from the primary, since nothing in it has
+ * been committed for a standby to see.
+ */
+CStorage *CReplicatedStorage::ForRead()
+{
+    if (mStandbys.empty() || mBatches > 0 || mRestoring)
+    {
+        ++mPrimaryReads;
+        return mPrimary;
+    }
+
+    if (mWritten)
+    {
+        mNeeded = mPrimary->GetWritePosition();
+        if (mNeeded < 0)
+        {
+            // No telling what the standbys need to have seen; ask again next time
+            ++mPrimaryReads;
+            return mPrimary;
+        }
+        mWritten = false;
+    }
+
+    for (size_t tried = 0; tried < mStandbys.size(); ++tried)
+    {
+        size_t standby = (mNext + tried) % mStandbys.size();
+        if (mStandbys[standby]->GetStatus() != CONNECTION_OK)
+        {
+            continue;
+        }
+
+        if (mReplayed[standby] < mNeeded)
+        {
+            mReplayed[standby] = std::max(mReplayed[standby], mStandbys[standby]->GetReplayPosition());
+        }
+        if (mReplayed[standby] >= mNeeded)
+        {
+            mNext = (standby + 1) % mStandbys.size();
+            ++mStandbyReads;
+            return mStandbys[standby];
+        }
+    }
+
+    ++mPrimaryReads;
+    return mPrimary;
+}
+
+/**
+ * \brief Create the tables on the primary; they reach the standbys from there
+ * \returns -1 if something goes wrong
+ */
+int CReplicatedStorage::PrepareDatabase()
+{
+    return ForWrite()->PrepareDatabase();
+}
+
+/**
+ * \brief Drop the tables on the primary; that reaches the standbys from there
+ * \returns -1 if something goes wrong
+ */
+int CReplicatedStorage::DestroyDatabase()
+{
+    return ForWrite()->DestroyDatabase();
+}
+
+/**
+ * \brief Add a track on the primary
+ * \param filepath The filepath of the track
+ * \returns ID of the new track
+ */
+std::string CReplicatedStorage::AddTrack(std::string filepath)
+{
+    return ForWrite()->AddTrack(filepath);
+}
+
+/**
+ * \brief Add several tracks on the primary
+ * \param filepaths The filepaths of the tracks
+ * \returns IDs of the new tracks, in the same order
+ */
+std::vector<std::string> CReplicatedStorage::AddTracks(const std::vector<std::string> &filepaths)
+{
+    return ForWrite()->AddTracks(filepaths);
+}
+
+/**
+ * \brief Add an empty playlist on the primary
+ * \param title Title of the playlist
+ * \returns ID of the new playlist
+ */
+std::string CReplicatedStorage::AddPlaylist(std::string title)
+{
+    return ForWrite()->AddPlaylist(title);
+}
+
+/**
+ * \brief Remove a track on the primary
+ * \param id ID of the track
+ */
+void CReplicatedStorage::RemoveTrack(std::string id)
+{
+    ForWrite()->RemoveTrack(id);
+}
+
+/**
+ * \brief Remove a playlist on the primary
+ * \param id ID of the playlist
+ */
+void CReplicatedStorage::RemovePlaylist(std::string id)
+{
+    ForWrite()->RemovePlaylist(id);
+}
+
+/**
+ * \brief Read a playlist from a standby if one has caught up
+ * \param id ID of the playlist
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track IDs, in order
+ * \returns false if there is no such playlist
+ */
+bool CReplicatedStorage::LoadPlaylist(std::string id, std::string &title, std::string &length,
+                                      std::vector<std::string> &tracks)
+{
+    return ForRead()->LoadPlaylist(id, title, length, tracks);
+}
+
+/**
+ * \brief Read a window of a playlist from a standby if one has caught up
+ * \param id ID of the playlist
+ * \param position First position wanted, from 1
+ * \param count Most tracks wanted
+ * \param title Filled in with the title
+ * \param length Filled in with the whole playlist's length
+ * \param tracks Filled in with the track IDs in the window, in order
+ * \returns false if there is no such playlist
+ */
+bool CReplicatedStorage::LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                           std::string &length, std::vector<std::string> &tracks)
+{
+    return ForRead()->LoadPlaylistRange(id, position, count, title, length, tracks);
+}
+
+/**
+ * \brief Read what's on a playlist, added up, from a standby if one has caught up
+ * \param id ID of the playlist
+ * \returns Its totals, all 0 if there is no such playlist
+ */
+CStorage::PlaylistTotals CReplicatedStorage::GetPlaylistTotals(std::string id)
+{
+    return ForRead()->GetPlaylistTotals(id);
+}
+
+/**
+ * \brief Look up tracks by filepath on a standby if one has caught up
+ * \param filepaths The filepaths to look up
+ * \returns IDs of the tracks in the same order, or "" where there is no such track
+ */
+std::vector<std::string> CReplicatedStorage::FindTracks(const std::vector<std::string> &filepaths)
+{
+    return ForRead()->FindTracks(filepaths);
+}
+
+/**
+ * \brief Look up the filepaths of tracks on a standby if one has caught up
+ * \param ids IDs of the tracks
+ * \returns Filepaths in the same order, or "" where there is no such track
+ */
+std::vector<std::string> CReplicatedStorage::FindFilepaths(const std::vector<std::string> &ids)
+{
+    return ForRead()->FindFilepaths(ids);
+}
+
+/**
+ * \brief Move every track under one directory to another, on the primary
+ * \param from Directory the tracks are under now
+ * \param to Directory to move them under
+ * \returns Number of tracks moved, or -1 if something goes wrong
+ */
+long CReplicatedStorage::RelocateRoot(std::string from, std::string to)
+{
+    return ForWrite()->RelocateRoot(from, to);
+}
+
+/**
+ * \brief Add a track on the primary, without blocking
+ * \param reactor Reactor to wait for the result in
+ * \param filepath The filepath of the track
+ * \returns Task yielding the ID of the new track
+ *
+ * Noted as a write again once it's done, in case a read went by while
+ * it was under way and found the standbys caught up without it.
+ */
+CTask<std::string> CReplicatedStorage::AddTrackAsync(CReactor *reactor, std::string filepath)
+{
+    std::string id = co_await ForWrite()->AddTrackAsync(reactor, filepath);
+    mWritten = true;
+    co_return id;
+}
+
+/**
+ * \brief Add an empty playlist on the primary, without blocking
+ * \param reactor Reactor to wait for the result in
+ * \param title Title of the playlist
+ * \returns Task yielding the ID of the new playlist
+ */
+CTask<std::string> CReplicatedStorage::AddPlaylistAsync(CReactor *reactor, std::string title)
+{
+    std::string id = co_await ForWrite()->AddPlaylistAsync(reactor, title);
+    mWritten = true;
+    co_return id;
+}
+
+/**
+ * \brief Read a window onto a playlist on a standby if one has caught up, without blocking
+ * \param reactor Reactor to wait for the result in
+ * \param id ID of the playlist
+ * \param position First position wanted, from 1
+ * \param count Most tracks wanted
+ * \returns Task yielding the playlist and the tracks
+ */
+CTask<CStorage::PlaylistRange> CReplicatedStorage::LoadPlaylistRangeAsync(CReactor *reactor, std::string id,
+                                                                          int position, int count)
+{
+    return ForRead()->LoadPlaylistRangeAsync(reactor, id, position, count);
+}
+
+/**
+ * \brief Append a track to a playlist on the primary
+ * \param playlist ID of the playlist
+ * \param track ID of the track
+ * \returns ID of the new membership
+ */
+std::string CReplicatedStorage::AppendTrack(std::string playlist, std::string track)
+{
+    return ForWrite()->AppendTrack(playlist, track);
+}
+
+/**
+ * \brief Insert a track into a playlist on the primary
+ * \param playlist ID of the playlist
+ * \param track ID of the track
+ * \param position Where to put it
+ * \returns ID of the new membership
+ */
+std::string CReplicatedStorage::InsertTrack(std::string playlist, std::string track, int position)
+{
+    return ForWrite()->InsertTrack(playlist, track, position);
+}
+
+/**
+ * \brief Insert tracks into a playlist on the primary
+ * \param playlist ID of the playlist
+ * \param tracks IDs of the tracks, in order
+ * \param position Where to put the first one
+ */
+void CReplicatedStorage::InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position)
+{
+    ForWrite()->InsertTracks(playlist, tracks, position);
+}
+
+/**
+ * \brief Remove a run of tracks from a playlist on the primary
+ * \param playlist ID of the playlist
+ * \param position Position of the first track to remove
+ * \param count How many to remove
+ */
+void CReplicatedStorage::RemoveRange(std::string playlist, int position, int count)
+{
+    ForWrite()->RemoveRange(playlist, position, count);
+}
+
+/**
+ * \brief Move a run of tracks within a playlist on the primary
+ * \param playlist ID of the playlist
+ * \param from Position of the first track to move
+ * \param count How many to move
+ * \param to Position the first of them ends up at
+ */
+void CReplicatedStorage::MoveRange(std::string playlist, int from, int count, int to)
+{
+    ForWrite()->MoveRange(playlist, from, count, to);
+}
+
+/**
+ * \brief Put every track in a playlist on the primary in a new order
+ * \param playlist ID of the playlist
+ * \param order The current positions of its tracks, in the order they're to go in
+ */
+void CReplicatedStorage::Reorder(std::string playlist, const std::vector<long> &order)
+{
+    ForWrite()->Reorder(playlist, order);
+}
+
+/**
+ * \brief Tidy up a playlist's positions on the primary
+ * \param playlist ID of the playlist
+ */
+void CReplicatedStorage::Normalize(std::string playlist)
+{
+    ForWrite()->Normalize(playlist);
+}
+
+/**
+ * \brief Start a batch of edits on the primary; reads stay there until it's over
+ * \returns Whether this started the outermost batch
+ */
+bool CReplicatedStorage::BeginBatch()
+{
+    ++mBatches;
+    return ForWrite()->BeginBatch();
+}
+
+/**
+ * \brief Commit a batch of edits on the primary
+ * \param playlist ID of the playlist the batch edited
+ * \param outer What BeginBatch() returned
+ * \returns -1 if it couldn't be committed, and was rolled back
+ */
+int CReplicatedStorage::CommitBatch(std::string playlist, bool outer)
+{
+    int status = ForWrite()->CommitBatch(playlist, outer);
+    --mBatches;
+    return status;
+}
+
+/**
+ * \brief Throw away a batch of edits on the primary
+ * \param outer What BeginBatch() returned
+ */
+void CReplicatedStorage::RollbackBatch(bool outer)
+{
+    ForWrite()->RollbackBatch(outer);
+    --mBatches;
+}
+
+/**
+ * \brief Visit every track, on a standby if one has caught up
+ * \param visit Called once per track
+ */
+void CReplicatedStorage::ReadTracks(const std::function<void(const TrackRecord &)> &visit)
+{
+    ForRead()->ReadTracks(visit);
+}
+
+/**
+ * \brief Stream every track from a standby if one has caught up
+ * \returns Cursor over the tracks, to be deleted
+ */
+CStorage::Cursor<CStorage::TrackRecord> *CReplicatedStorage::StreamTracks()
+{
+    return ForRead()->StreamTracks();
+}
+
+/**
+ * \brief Stream a playlist's tracks from a standby if one has caught up
+ * \param id ID of the playlist
+ * \returns Cursor over the tracks, to be deleted
+ */
+CStorage::Cursor<CStorage::EntryRecord> *CReplicatedStorage::StreamPlaylist(std::string id)
+{
+    return ForRead()->StreamPlaylist(id);
+}
+
+/**
+ * \brief Visit every playlist, on a standby if one has caught up
+ * \param visit Called once per playlist with its id, title and track ids in order
+ */
+void CReplicatedStorage::ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit)
+{
+    ForRead()->ReadPlaylists(visit);
+}
+
+/**
+ * \brief Get the primary ready to be restored into; reads stay there until it's done
+ * \returns -1 if it can't be
+ */
+int CReplicatedStorage::BeginRestore()
+{
+    mRestoring = true;
+    return ForWrite()->BeginRestore();
+}
+
+/**
+ * \brief Restore tracks on the primary
+ * \param tracks The tracks
+ */
+void CReplicatedStorage::RestoreTracks(const std::vector<TrackRecord> &tracks)
+{
+    ForWrite()->RestoreTracks(tracks);
+}
+
+/**
+ * \brief Restore a playlist on the primary
+ * \param id ID of the playlist
+ * \param title Title of the playlist
+ * \param tracks IDs of its tracks, in order
+ */
+void CReplicatedStorage::RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks)
+{
+    ForWrite()->RestorePlaylist(id, title, tracks);
+}
+
+/**
+ * \brief Finish restoring the primary
+ * \returns -1 if something went wrong
+ */
+int CReplicatedStorage::EndRestore()
+{
+    int result = ForWrite()->EndRestore();
+    mRestoring = false;
+    return result;
+}
+
+/**
+ * \brief Add to the listening history on the primary
+ * \param events The events, oldest first
+ * \returns -1 if something goes wrong, in which case none of them were written
+ */
+int CReplicatedStorage::AppendHistory(const std::vector<PlayRecord> &events)
+{
+    return ForWrite()->AppendHistory(events);
+}
+
+/**
+ * \brief Read tracks' listening stats from a standby if one has caught up
+ * \param ids IDs of the tracks
+ * \returns Stats in the same order
+ */
+std::vector<CStorage::TrackStats> CReplicatedStorage::GetTrackStats(const std::vector<std::string> &ids)
+{
+    return ForRead()->GetTrackStats(ids);
+}
+
+/**
+ * \brief Find tracks that haven't been analysed yet, on a standby if one has caught up
+ * \param after Only tracks with an id above this
+ * \param limit Most tracks to return
+ * \returns The tracks, ordered by id
+ */
+std::vector<CStorage::TrackRecord> CReplicatedStorage::FindUnanalyzed(long after, size_t limit)
+{
+    return ForRead()->FindUnanalyzed(after, limit);
+}
+
+/**
+ * \brief Keep what analysing tracks found, on the primary
+ * \param features The findings
+ */
+void CReplicatedStorage::SaveFeatures(const std::vector<TrackFeatures> &features)
+{
+    ForWrite()->SaveFeatures(features);
+}
+
+/**
+ * \brief Read what analysing tracks found, from a standby if one has caught up
+ * \param ids IDs of the tracks
+ * \returns Findings in the same order
+ */
+std::vector<CStorage::TrackFeatures> CReplicatedStorage::GetFeatures(const std::vector<std::string> &ids)
+{
+    return ForRead()->GetFeatures(ids);
+}
+
+/**
+ * \brief List tracks whose tags haven't been read, from a standby if one has caught up
+ * \param after Only list tracks with an id above this
+ * \param limit List no more than this many
+ * \returns The tracks, ordered by id
+ */
+std::vector<CStorage::TrackRecord> CReplicatedStorage::FindUntagged(long after, size_t limit)
+{
+    return ForRead()->FindUntagged(after, limit);
+}
+
+/**
+ * \brief Keep what tracks' tags say, on the primary
+ * \param tags The tags
+ */
+void CReplicatedStorage::SaveTags(const std::vector<TrackTags> &tags)
+{
+    ForWrite()->SaveTags(tags);
+}
+
+/**
+ * \brief Browse a page of the library on a standby if one has caught up
+ * \param level What to list
+ * \param parent The artist or album to list under
+ * \param after The last row of the page before
+ * \param limit Most rows to return
+ * \returns The rows, in order
+ */
+std::vector<CStorage::BrowseEntry> CReplicatedStorage::Browse(BrowseLevel level, long parent,
+                                                              const BrowseEntry &after, size_t limit)
+{
+    return ForRead()->Browse(level, parent, after, limit);
+}
+
+/**
+ * \brief Page through the playlists on a standby if one has caught up
+ * \param after Only playlists with an id above this
+ * \param limit Most playlists to return
+ * \returns IDs of the playlists, in order
+ */
+std::vector<long> CReplicatedStorage::FindPlaylists(long after, size_t limit)
+{
+    return ForRead()->FindPlaylists(after, limit);
+}
+
+/**
+ * \brief Reclaim space on the primary
+ * \returns -1 if it couldn't right now
+ */
+int CReplicatedStorage::Vacuum()
+{
+    return mPrimary->Vacuum();
+}
+
+/**
+ * \brief Keep a new background job on the primary
+ * \param job The job; its id is ignored
+ * \returns ID of the job, or -1 if something goes wrong
+ */
+long CReplicatedStorage::AddJob(const JobRecord &job)
+{
+    return ForWrite()->AddJob(job);
+}
+
+/**
+ * \brief Keep where a background job is at, on the primary
+ * \param job The job
+ */
+void CReplicatedStorage::UpdateJob(const JobRecord &job)
+{
+    ForWrite()->UpdateJob(job);
+}
+
+/**
+ * \brief Read the background jobs that haven't finished from the primary
+ * \returns The jobs, ordered by id
+ *
+ * Jobs are only ever resumed by whoever is about to update them, so a
+ * standby's copy is no use here.
+ */
+std::vector<CStorage::JobRecord> CReplicatedStorage::LoadJobs()
+{
+    return mPrimary->LoadJobs();
+}
@@ -0,0 +1,171 @@
+/**
+ * \file ReplicatedStorage.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the ReplicatedStorage class
+ */
+
+#ifndef REPLICATEDSTORAGE_H
+#define REPLICATEDSTORAGE_H
+
+#include <vector>
+#include "Storage.h"
+
+/**
+ * \brief Sends reads to standbys and everything else to the primary
+ *
+ * Writes, batches, restores and jobs always go to the primary. Reads
+ * go to the standbys in turn, so browsing doesn't compete with a busy
+ * writer, but never to one that hasn't caught up with this storage's
+ * own writes: after a write, the next read asks the primary where its
+ * log has got to, and a standby is only used once its replay position
+ * has reached that. Until one has, reads stay on the primary. Replay
+ * positions only go forward, so each standby's last one is kept and it
+ * is only asked again when that isn't far enough.
+ *
+ * Other clients' writes reach the standbys when they reach them; only
+ * this storage's own writes are waited for.
+ *
+ * Like the storages it's made of, this can only be used from one
+ * thread at a time.
+ */
+class CReplicatedStorage : public CStorage
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CReplicatedStorage() = delete;
+
+    CReplicatedStorage(CStorage *primary, const std::vector<CStorage *> &standbys);
+    virtual ~CReplicatedStorage();
+
+    /** \brief Copy constructor (disabled)
+     * \param storage Storage to construct this based on */
+    CReplicatedStorage(const CReplicatedStorage &storage) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param storage Storage whose attributes will override those of the current storage */
+    CReplicatedStorage& operator=(const CReplicatedStorage &storage) = delete;
+
+    /**
+     * \brief Returns the storage writes go to
+     * \returns Pointer to storage object
+     */
+    CStorage *GetPrimary() { return mPrimary; }
+
+    /**
+     * \brief Returns how many reads went to the primary
+     * \returns Number of reads
+     */
+    long GetPrimaryReads() { return mPrimaryReads; }
+
+    /**
+     * \brief Returns how many reads went to a standby
+     * \returns Number of reads
+     */
+    long GetStandbyReads() { return mStandbyReads; }
+
+    virtual void SetStats(CStats *stats) override;
+
+    virtual ConnStatusType GetStatus() override;
+    virtual PGconn *GetConnection() override;
+    virtual long long GetWritePosition() override;
+
+    virtual int PrepareDatabase() override;
+    virtual int DestroyDatabase() override;
+
+    virtual std::string AddTrack(std::string filepath) override;
+    virtual std::vector<std::string> AddTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::string AddPlaylist(std::string title) override;
+    virtual void RemoveTrack(std::string id) override;
+    virtual void RemovePlaylist(std::string id) override;
+
+    virtual bool LoadPlaylist(std::string id, std::string &title, std::string &length,
+                              std::vector<std::string> &tracks) override;
+    virtual bool LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                   std::string &length, std::vector<std::string> &tracks) override;
+    virtual PlaylistTotals GetPlaylistTotals(std::string id) override;
+    virtual std::vector<std::string> FindTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::vector<std::string> FindFilepaths(const std::vector<std::string> &ids) override;
+    virtual long RelocateRoot(std::string from, std::string to) override;
+
+    virtual CTask<std::string> AddTrackAsync(CReactor *reactor, std::string filepath) override;
+    virtual CTask<std::string> AddPlaylistAsync(CReactor *reactor, std::string title) override;
+    virtual CTask<PlaylistRange> LoadPlaylistRangeAsync(CReactor *reactor, std::string id, int position, int count) override;
+
+    virtual std::string AppendTrack(std::string playlist, std::string track) override;
+    virtual std::string InsertTrack(std::string playlist, std::string track, int position) override;
+    virtual void InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position) override;
+    virtual void RemoveRange(std::string playlist, int position, int count) override;
+    virtual void MoveRange(std::string playlist, int from, int count, int to) override;
+    virtual void Reorder(std::string playlist, const std::vector<long> &order) override;
+    virtual void Normalize(std::string playlist) override;
+
+    virtual bool BeginBatch() override;
+    virtual int CommitBatch(std::string playlist, bool outer) override;
+    virtual void RollbackBatch(bool outer) override;
+
+    virtual void ReadTracks(const std::function<void(const TrackRecord &)> &visit) override;
+    virtual Cursor<TrackRecord> *StreamTracks() override;
+    virtual Cursor<EntryRecord> *StreamPlaylist(std::string id) override;
+    virtual void ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit) override;
+    virtual int BeginRestore() override;
+    virtual void RestoreTracks(const std::vector<TrackRecord> &tracks) override;
+    virtual void RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks) override;
+    virtual int EndRestore() override;
+
+    virtual int AppendHistory(const std::vector<PlayRecord> &events) override;
+    virtual std::vector<TrackStats> GetTrackStats(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUnanalyzed(long after, size_t limit) override;
+    virtual void SaveFeatures(const std::vector<TrackFeatures> &features) override;
+    virtual std::vector<TrackFeatures> GetFeatures(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUntagged(long after, size_t limit) override;
+    virtual void SaveTags(const std::vector<TrackTags> &tags) override;
+    virtual std::vector<BrowseEntry> Browse(BrowseLevel level, long parent, const BrowseEntry &after,
+                                            size_t limit) override;
+
+    virtual std::vector<long> FindPlaylists(long after, size_t limit) override;
+    virtual int Vacuum() override;
+    virtual long AddJob(const JobRecord &job) override;
+    virtual void UpdateJob(const JobRecord &job) override;
+    virtual std::vector<JobRecord> LoadJobs() override;
+
+private:
+    CStorage *ForRead();
+
+    /**
+     * \brief Note that the primary has been written to
+     * \returns The primary, for the write
+     */
+    CStorage *ForWrite() { mWritten = true; return mPrimary; }
+
+    /// Where writes go
+    CStorage *mPrimary;
+
+    /// Where reads go when they can
+    std::vector<CStorage *> mStandbys;
+
+    /// Furthest each standby is known to have replayed
+    std::vector<long long> mReplayed;
+
+    /// Standby to try first for the next read
+    size_t mNext = 0;
+
+    /// Primary's write position a standby has to reach to be read from
+    long long mNeeded = 0;
+
+    /// Whether there have been writes since mNeeded was read
+    bool mWritten = false;
+
+    /// Batches open on the primary
+    int mBatches = 0;
+
+    /// Whether a restore is under way on the primary
+    bool mRestoring = false;
+
+    long mPrimaryReads = 0;     ///< Reads that went to the primary
+    long mStandbyReads = 0;     ///< Reads that went to a standby
+};
+
+#endif
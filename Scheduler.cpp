@@ -0,0 +1,648 @@
+/**
+ * \file Scheduler.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cstdlib>
+#include "Analyzer.h"
+#include "Scheduler.h"
+#include "Tags.h"
+
+/// Playlists tidied per step of a "normalize" job over all of them
+static const size_t NORMALIZE_STEP = 16;
+
+/// Tracks analysed per step of an "analyze" job
+static const size_t ANALYZE_STEP = 8;
+
+/// Tracks whose tags are read per step of a "tag" job
+static const size_t TAG_STEP = 64;
+
+/**
+ * \brief Tidies up one playlist, or all of them a few at a time
+ */
+class CNormalizeJob : public CJob
+{
+public:
+
+    /**
+     * \brief Constructor
+     * \param playlist The playlist, or "" for all of them
+     * \param progress The last playlist done, if it's picking up after a restart
+     */
+    CNormalizeJob(const std::string &playlist, const std::string &progress)
+    {
+        mPlaylist = playlist;
+        mProgress = progress;
+    }
+
+    /**
+     * \brief Tidy up the next few playlists
+     * \param library Library to work on
+     * \param turn Unused; this only ever talks to the storage
+     * \returns 1 if there are more to do, 0 once they're done
+     */
+    virtual int Step(CLibrary *library, CScheduler::Turn &turn) override
+    {
+        (void)turn;
+        CStorage *storage = library->GetStorage();
+
+        std::vector<long> playlists;
+        if (mPlaylist.empty())
+        {
+            playlists = storage->FindPlaylists(atol(mProgress.c_str()), NORMALIZE_STEP);
+        }
+        else
+        {
+            playlists.push_back(atol(mPlaylist.c_str()));
+        }
+
+        for (long playlist : playlists)
+        {
+            // Committing a batch normalizes and recounts the length
+            library->GetPlaylistCache()->Invalidate(std::to_string(playlist));
+            bool outer = storage->BeginBatch();
+            if (storage->CommitBatch(std::to_string(playlist), outer) != 0)
+            {
+                return -1;
+            }
+            mProgress = std::to_string(playlist);
+        }
+
+        return mPlaylist.empty() && playlists.size() == NORMALIZE_STEP ? 1 : 0;
+    }
+
+private:
+    std::string mPlaylist;  ///< The playlist, or "" for all of them
+};
+
+/**
+ * \brief Analyses tracks that haven't been yet, a few at a time
+ *
+ * The library is let go of while the audio is being decoded.
+ */
+class CAnalyzeJob : public CJob
+{
+public:
+
+    /**
+     * \brief Constructor
+     * \param progress The last track looked at, if it's picking up after a restart
+     */
+    CAnalyzeJob(const std::string &progress)
+    {
+        mProgress = progress;
+        mAnalyzer.SetThreads(1);
+    }
+
+    /**
+     * \brief Analyse the next few tracks
+     * \param library Library to work on
+     * \param turn The worker's hold on the library
+     * \returns 1 if there might be more to do, 0 once they're done
+     */
+    virtual int Step(CLibrary *library, CScheduler::Turn &turn) override
+    {
+        CStorage *storage = library->GetStorage();
+
+        std::vector<CStorage::TrackRecord> tracks = storage->FindUnanalyzed(atol(mProgress.c_str()), ANALYZE_STEP);
+        if (tracks.empty())
+        {
+            return 0;
+        }
+
+        turn.Pause();
+        std::vector<CStorage::TrackFeatures> features = mAnalyzer.AnalyzeChunk(tracks);
+        turn.Resume();
+
+        storage->SaveFeatures(features);
+        mProgress = std::to_string(tracks.back().id);
+
+        return 1;
+    }
+
+private:
+    CAnalyzer mAnalyzer;    ///< Does the listening
+};
+
+/**
+ * \brief Reads the tags of tracks that haven't had them read, a few at a time
+ *
+ * The library is let go of while the files are being read.
+ */
+class CTagJob : public CJob
+{
+public:
+
+    /**
+     * \brief Constructor
+     * \param progress The last track looked at, if it's picking up after a restart
+     */
+    CTagJob(const std::string &progress)
+    {
+        mProgress = progress;
+    }
+
+    /**
+     * \brief Read the tags of the next few tracks
+     * \param library Library to work on
+     * \param turn The worker's hold on the library
+     * \returns 1 if there might be more to do, 0 once they're done
+     */
+    virtual int Step(CLibrary *library, CScheduler::Turn &turn) override
+    {
+        CStorage *storage = library->GetStorage();
+
+        std::vector<CStorage::TrackRecord> tracks = storage->FindUntagged(atol(mProgress.c_str()), TAG_STEP);
+        if (tracks.empty())
+        {
+            return 0;
+        }
+
+        turn.Pause();
+        std::vector<CStorage::TrackTags> tags = CTags::ReadTracks(tracks);
+        turn.Resume();
+
+        storage->SaveTags(tags);
+        mProgress = std::to_string(tracks.back().id);
+
+        return 1;
+    }
+};
+
+/**
+ * \brief Reclaims the space edits leave behind, in one go
+ */
+class CVacuumJob : public CJob
+{
+public:
+
+    /**
+     * \brief Vacuum the storage
+     * \param library Library to work on
+     * \param turn Unused; this only ever talks to the storage
+     * \returns 0 once it's done, -1 if it failed
+     */
+    virtual int Step(CLibrary *library, CScheduler::Turn &turn) override
+    {
+        (void)turn;
+        return library->GetStorage()->Vacuum() == 0 ? 0 : -1;
+    }
+};
+
+/**
+ * \brief Take hold of the library for a step
+ * \param scheduler The scheduler the step is for
+ */
+CScheduler::Turn::Turn(CScheduler *scheduler)
+{
+    mScheduler = scheduler;
+    mHeld = false;
+    Resume();
+}
+
+/**
+ * \brief Destructor
+ *
+ * Lets go of the library, if it's held
+ */
+CScheduler::Turn::~Turn()
+{
+    Pause();
+}
+
+/**
+ * \brief Let go of the library, so interactive work can get in
+ */
+void CScheduler::Turn::Pause()
+{
+    if (mHeld)
+    {
+        mScheduler->mHold.unlock();
+        mHeld = false;
+    }
+}
+
+/**
+ * \brief Take hold of the library again, once no interactive work wants it
+ */
+void CScheduler::Turn::Resume()
+{
+    while (!mHeld)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mScheduler->mMutex);
+            mScheduler->mWake.wait(lock, [this]() { return mScheduler->mInteractive == 0; });
+        }
+
+        mScheduler->mHold.lock();
+
+        // Interactive work that turned up in the meantime still goes first
+        std::lock_guard<std::mutex> lock(mScheduler->mMutex);
+        if (mScheduler->mInteractive == 0)
+        {
+            mHeld = true;
+        }
+        else
+        {
+            mScheduler->mHold.unlock();
+        }
+    }
+}
+
+/**
+ * \brief Take hold of the library for interactive work
+ * \param scheduler The scheduler the library is held from
+ *
+ * Waits for the step in progress, if there is one.
+ */
+CScheduler::Interactive::Interactive(CScheduler *scheduler)
+{
+    mScheduler = scheduler;
+    {
+        std::lock_guard<std::mutex> lock(mScheduler->mMutex);
+        ++mScheduler->mInteractive;
+    }
+    mScheduler->mHold.lock();
+}
+
+/**
+ * \brief Destructor
+ *
+ * Lets go of the library, and lets the workers carry on
+ */
+CScheduler::Interactive::~Interactive()
+{
+    mScheduler->mHold.unlock();
+    {
+        std::lock_guard<std::mutex> lock(mScheduler->mMutex);
+        --mScheduler->mInteractive;
+    }
+    mScheduler->mWake.notify_all();
+}
+
+/**
+ * \brief Constructor
+ * \param library Library the jobs work on
+ *
+ * Knows the built-in kinds of job, has no limit on the rate, and
+ * doesn't run anything until Start().
+ */
+CScheduler::CScheduler(CLibrary *library)
+{
+    mLibrary = library;
+    mSequence = 0;
+    mInteractive = 0;
+    mInterval = std::chrono::steady_clock::duration::zero();
+    mStopping = false;
+
+    SetRate(library->GetConfig().GetDouble("scheduler.rate"));
+
+    Register("normalize", [](const std::string &argument, const std::string &progress) -> CJob *
+    {
+        return new CNormalizeJob(argument, progress);
+    });
+    Register("analyze", [](const std::string &, const std::string &progress) -> CJob *
+    {
+        return new CAnalyzeJob(progress);
+    });
+    Register("tag", [](const std::string &, const std::string &progress) -> CJob *
+    {
+        return new CTagJob(progress);
+    });
+    Register("vacuum", [](const std::string &, const std::string &) -> CJob *
+    {
+        return new CVacuumJob();
+    });
+}
+
+/**
+ * \brief Destructor
+ *
+ * Stops the workers; unfinished jobs stay in the storage for next time
+ */
+CScheduler::~CScheduler()
+{
+    Stop();
+}
+
+/**
+ * \brief Teach the scheduler a kind of job
+ * \param kind Name of the kind, as it's kept in the storage
+ * \param factory Makes jobs of that kind
+ */
+void CScheduler::Register(const std::string &kind, JobFactory factory)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mKinds[kind] = factory;
+}
+
+/**
+ * \brief Pick up the jobs that didn't finish last time
+ * \returns Number of jobs picked up, or -1 if the storage isn't usable
+ *
+ * Jobs of kinds that haven't been registered are left in the storage.
+ */
+int CScheduler::Resume()
+{
+    std::vector<CStorage::JobRecord> records;
+    {
+        Interactive interactive(this);
+        if (mLibrary->GetStatus() != CONNECTION_OK)
+        {
+            return -1;
+        }
+        records = mLibrary->GetStorage()->LoadJobs();
+    }
+
+    int resumed = 0;
+    std::lock_guard<std::mutex> lock(mMutex);
+    for (CStorage::JobRecord &record : records)
+    {
+        auto kind = mKinds.find(record.kind);
+        if (mJobs.count(record.id) || kind == mKinds.end())
+        {
+            continue;
+        }
+
+        CJob *job = kind->second(record.argument, record.progress);
+        if (!job)
+        {
+            continue;
+        }
+
+        record.state = CStorage::JOB_QUEUED;
+        mJobs[record.id].record = record;
+        mJobs[record.id].job.reset(job);
+        Queue(record.id, record.priority);
+        ++resumed;
+    }
+    mWake.notify_all();
+
+    return resumed;
+}
+
+/**
+ * \brief Add a job
+ * \param kind What kind of job it is
+ * \param argument What it's to work on; what this means depends on the kind
+ * \param priority Higher goes first; see Priority
+ * \returns ID of the job, or -1 if there's no such kind or it couldn't be kept
+ */
+long CScheduler::Submit(const std::string &kind, const std::string &argument, int priority)
+{
+    CJob *job = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto found = mKinds.find(kind);
+        if (found != mKinds.end())
+        {
+            job = found->second(argument, "");
+        }
+    }
+    if (!job)
+    {
+        return -1;
+    }
+
+    CStorage::JobRecord record;
+    record.kind = kind;
+    record.argument = argument;
+    record.priority = priority;
+    {
+        Interactive interactive(this);
+        record.id = mLibrary->GetStorage()->AddJob(record);
+    }
+    if (record.id < 0)
+    {
+        delete job;
+        return -1;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJobs[record.id].record = record;
+        mJobs[record.id].job.reset(job);
+        Queue(record.id, priority);
+    }
+    mWake.notify_all();
+
+    return record.id;
+}
+
+/**
+ * \brief Stop a job and forget it
+ * \param id ID of the job
+ * \returns false if there's no such job, or it has already finished
+ *
+ * A job a worker is on stops after the step it's on.
+ */
+bool CScheduler::Cancel(long id)
+{
+    CStorage::JobRecord record;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto found = mJobs.find(id);
+        if (found == mJobs.end())
+        {
+            return false;
+        }
+        if (found->second.running)
+        {
+            found->second.cancelled = true;
+            return true;
+        }
+
+        record = found->second.record;
+        record.state = CStorage::JOB_CANCELLED;
+        mJobs.erase(found);
+        mFinished[id] = CStorage::JOB_CANCELLED;
+    }
+    mIdle.notify_all();
+
+    Interactive interactive(this);
+    mLibrary->GetStorage()->UpdateJob(record);
+
+    return true;
+}
+
+/**
+ * \brief Find out where a job is at
+ * \param id ID of the job
+ * \returns Its state, or 0 if this scheduler doesn't know of it
+ */
+CStorage::JobState CScheduler::GetState(long id)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    auto found = mJobs.find(id);
+    if (found != mJobs.end())
+    {
+        return found->second.running ? CStorage::JOB_RUNNING : CStorage::JOB_QUEUED;
+    }
+
+    auto finished = mFinished.find(id);
+    return finished != mFinished.end() ? finished->second : (CStorage::JobState)0;
+}
+
+/**
+ * \brief Limit how often steps are taken, across all workers
+ * \param steps Steps per second at most, or 0 for no limit
+ */
+void CScheduler::SetRate(double steps)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mInterval = steps > 0
+        ? std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1 / steps))
+        : std::chrono::steady_clock::duration::zero();
+}
+
+/**
+ * \brief Start working through the jobs
+ * \param threads Number of workers, or 0 for the library's scheduler.threads
+ *
+ * Does nothing if the workers are already running.
+ */
+void CScheduler::Start(unsigned threads)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mWorkers.empty())
+    {
+        return;
+    }
+
+    if (threads == 0)
+    {
+        threads = (unsigned)std::max(1L, mLibrary->GetConfig().GetInt("scheduler.threads"));
+    }
+
+    mStopping = false;
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        mWorkers.emplace_back(&CScheduler::Work, this);
+    }
+}
+
+/**
+ * \brief Stop the workers once they've finished the steps they're on
+ *
+ * Jobs that haven't finished stay queued, here and in the storage.
+ */
+void CScheduler::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopping = true;
+    }
+    mWake.notify_all();
+
+    for (std::thread &worker : mWorkers)
+    {
+        worker.join();
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    mWorkers.clear();
+}
+
+/**
+ * \brief Wait for every job to finish
+ *
+ * Returns straight away if the workers aren't running.
+ */
+void CScheduler::Wait()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    mIdle.wait(lock, [this]() { return mJobs.empty() || mWorkers.empty() || mStopping; });
+}
+
+/**
+ * \brief Put a job in the queue
+ * \param id ID of the job
+ * \param priority Its priority
+ *
+ * mMutex must be held.
+ */
+void CScheduler::Queue(long id, int priority)
+{
+    mQueue.push({priority, mSequence++, id});
+}
+
+/**
+ * \brief What each worker does: take steps until told to stop
+ */
+void CScheduler::Work()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true)
+    {
+        mWake.wait(lock, [this]() { return mStopping || (mInteractive == 0 && !mQueue.empty()); });
+        if (mStopping)
+        {
+            break;
+        }
+
+        long id = mQueue.top().id;
+        mQueue.pop();
+        auto found = mJobs.find(id);
+        if (found == mJobs.end() || found->second.running)
+        {
+            continue;
+        }
+        Job &job = found->second;
+        job.running = true;
+        CStorage::JobRecord record = job.record;
+
+        // Hold back to the rate
+        if (mInterval > std::chrono::steady_clock::duration::zero())
+        {
+            auto now = std::chrono::steady_clock::now();
+            auto start = std::max(now, mNextStep);
+            mNextStep = start + mInterval;
+            if (mWake.wait_until(lock, start, [this]() { return mStopping; }))
+            {
+                job.running = false;
+                Queue(id, record.priority);
+                break;
+            }
+        }
+        lock.unlock();
+
+        int result;
+        {
+            Turn turn(this);
+
+            result = job.job->Step(mLibrary, turn);
+            turn.Resume();
+
+            record.progress = job.job->GetProgress();
+            if (result > 0)
+            {
+                std::lock_guard<std::mutex> guard(mMutex);
+                record.state = job.cancelled ? CStorage::JOB_CANCELLED : CStorage::JOB_RUNNING;
+            }
+            else
+            {
+                record.state = result == 0 ? CStorage::JOB_DONE : CStorage::JOB_FAILED;
+            }
+            mLibrary->GetStorage()->UpdateJob(record);
+        }
+
+        lock.lock();
+        job.running = false;
+        if (record.state == CStorage::JOB_RUNNING)
+        {
+            job.record = record;
+            Queue(id, record.priority);
+        }
+        else
+        {
+            mJobs.erase(found);
+            mFinished[id] = record.state;
+            mIdle.notify_all();
+        }
+        // Another worker may be free for this job, or the one after it
+        mWake.notify_one();
+    }
+
+    mIdle.notify_all();
+}
@@ -0,0 +1,284 @@
+/**
+ * \file Scheduler.h
+ * \author Matt Hammerly
+ * \brief Contains the definitions of the Scheduler and Job classes
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Library.h"
+
+class CJob;
+
+/**
+ * \brief Runs maintenance work in the background, a step at a time
+ *
+ * Jobs are kept in the storage as they're submitted and after every
+ * step, so whatever hadn't finished is picked up again by Resume()
+ * after a restart, from where it got to. Workers take the
+ * highest-priority job, run one step of it and put it back, so a more
+ * urgent job submitted part way through goes next rather than waiting
+ * for the rest of a long one. Steps can be held to a rate, to keep the
+ * load on the database down. The rate and number of workers start out
+ * as the library's scheduler.rate and scheduler.threads (see CConfig).
+ *
+ * Neither the library nor its storage can be used from two threads at
+ * once, so a step only runs while it holds the library. While workers
+ * are running, anything else using the library (playlists too) has to
+ * do it inside an Interactive, which waits for the step in progress
+ * and holds every other step off until it's done. Interactive work
+ * never waits for more than one step.
+ *
+ * Kinds of job built in:
+ *  - "normalize": tidy up a playlist's positions and recount its
+ *    length; the argument is the playlist, or "" for all of them
+ *  - "analyze": analyse tracks that haven't been yet (see CAnalyzer)
+ *  - "tag": read the tags of tracks that haven't had them read (see CTags)
+ *  - "vacuum": reclaim the space edits leave behind
+ */
+class CScheduler
+{
+public:
+
+    /// Makes a job of some kind from its argument and how far it got, or returns nullptr if it can't
+    typedef std::function<CJob *(const std::string &argument, const std::string &progress)> JobFactory;
+
+    /// Usual priorities; any int will do, higher goes first
+    enum Priority : int
+    {
+        PRIORITY_LOW = -10,     ///< Whenever there's nothing else
+        PRIORITY_NORMAL = 0,    ///< Most things
+        PRIORITY_HIGH = 10      ///< Something's waiting on it
+    };
+
+    /**
+     * \brief A worker's hold on the library for one step
+     *
+     * The step is started with it held. Pause it around anything slow
+     * that doesn't touch the library, so interactive work can get in.
+     */
+    class Turn
+    {
+    public:
+
+        /** \brief Default constructor (disabled) */
+        Turn() = delete;
+
+        Turn(CScheduler *scheduler);
+
+        /** \brief Copy constructor (disabled)
+         * \param turn Turn to construct this based on */
+        Turn(const Turn &turn) = delete;
+
+        /** \brief Assignment operator (disabled)
+         * \param turn Turn whose attributes will override those of the current turn */
+        Turn& operator=(const Turn &turn) = delete;
+
+        ~Turn();
+
+        void Pause();
+
+        void Resume();
+
+    private:
+        /// The scheduler the library is held from
+        CScheduler *mScheduler;
+
+        /// Whether the library is held
+        bool mHeld;
+    };
+
+    /**
+     * \brief Holds the library for interactive work, ahead of any job
+     *
+     * Open one of these around anything done to the library while
+     * workers are running. They can be nested.
+     */
+    class Interactive
+    {
+    public:
+
+        /** \brief Default constructor (disabled) */
+        Interactive() = delete;
+
+        Interactive(CScheduler *scheduler);
+
+        /** \brief Copy constructor (disabled)
+         * \param interactive Interactive to construct this based on */
+        Interactive(const Interactive &interactive) = delete;
+
+        /** \brief Assignment operator (disabled)
+         * \param interactive Interactive whose attributes will override those of the current interactive */
+        Interactive& operator=(const Interactive &interactive) = delete;
+
+        ~Interactive();
+
+    private:
+        /// The scheduler the library is held from
+        CScheduler *mScheduler;
+    };
+
+    /** \brief Default constructor (disabled) */
+    CScheduler() = delete;
+
+    CScheduler(CLibrary *library);
+
+    /** \brief Copy constructor (disabled)
+     * \param scheduler Scheduler to construct this based on */
+    CScheduler(const CScheduler &scheduler) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param scheduler Scheduler whose attributes will override those of the current scheduler */
+    CScheduler& operator=(const CScheduler &scheduler) = delete;
+
+    ~CScheduler();
+
+    void Register(const std::string &kind, JobFactory factory);
+
+    int Resume();
+
+    long Submit(const std::string &kind, const std::string &argument = "", int priority = PRIORITY_NORMAL);
+
+    bool Cancel(long id);
+
+    CStorage::JobState GetState(long id);
+
+    void SetRate(double steps);
+
+    void Start(unsigned threads = 0);
+
+    void Stop();
+
+    void Wait();
+
+private:
+    /// A job this scheduler knows of
+    struct Job
+    {
+        CStorage::JobRecord record;     ///< The job as it's kept
+        std::unique_ptr<CJob> job;      ///< What does the work
+        bool running = false;           ///< Whether a worker has it
+        bool cancelled = false;         ///< Whether it's to stop after the step it's on
+    };
+
+    /// A job's place in the queue
+    struct Entry
+    {
+        int priority;       ///< The job's priority
+        long sequence;      ///< When it was queued, so equal priorities take turns
+        long id;            ///< The job
+
+        /**
+         * \brief Whether this comes after another entry
+         * \param entry The other entry
+         * \returns true if this should wait for the other one
+         */
+        bool operator<(const Entry &entry) const
+        {
+            return priority != entry.priority ? priority < entry.priority : sequence > entry.sequence;
+        }
+    };
+
+    void Work();
+    void Queue(long id, int priority);
+
+    /// Library the jobs work on
+    CLibrary *mLibrary;
+
+    /// Held while anything uses the library; recursive so interactive work can nest and submit jobs
+    std::recursive_mutex mHold;
+
+    /// Guards everything below
+    std::mutex mMutex;
+
+    /// Signalled when there might be a step to take, or workers are to stop
+    std::condition_variable mWake;
+
+    /// Signalled when a job finishes
+    std::condition_variable mIdle;
+
+    /// Kinds of job, by name
+    std::map<std::string, JobFactory> mKinds;
+
+    /// Jobs that haven't finished, by id
+    std::map<long, Job> mJobs;
+
+    /// How jobs that finished while this was running ended, by id
+    std::map<long, CStorage::JobState> mFinished;
+
+    /// Jobs waiting for a worker; cancelled ones are dropped as they come up
+    std::priority_queue<Entry> mQueue;
+
+    /// Next queue sequence number
+    long mSequence;
+
+    /// Interactive holds open or waiting
+    int mInteractive;
+
+    /// Shortest time between steps, or zero for no limit
+    std::chrono::steady_clock::duration mInterval;
+
+    /// Earliest the next step can start
+    std::chrono::steady_clock::time_point mNextStep;
+
+    /// Whether workers are to stop
+    bool mStopping;
+
+    /// The workers
+    std::vector<std::thread> mWorkers;
+};
+
+/**
+ * \brief One piece of background work, done a step at a time
+ *
+ * Steps should be short, a few statements at most, since interactive
+ * work waits for the one in progress. How far the job has got goes in
+ * mProgress, which is saved after every step and handed back to the
+ * job's factory after a restart.
+ */
+class CJob
+{
+public:
+
+    /** \brief Constructor */
+    CJob() {}
+
+    /** \brief Copy constructor (disabled)
+     * \param job Job to construct this based on */
+    CJob(const CJob &job) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param job Job whose attributes will override those of the current job */
+    CJob& operator=(const CJob &job) = delete;
+
+    /** \brief Destructor */
+    virtual ~CJob() {}
+
+    /** \brief Do the next step
+     * \param library Library to work on
+     * \param turn The worker's hold on the library, held to start with
+     * \returns 1 if there's more to do, 0 once it's done, -1 if it failed */
+    virtual int Step(CLibrary *library, CScheduler::Turn &turn) = 0;
+
+    /**
+     * \brief Returns how far the job has got
+     * \returns Progress, in whatever form the job likes
+     */
+    const std::string &GetProgress() { return mProgress; }
+
+protected:
+    std::string mProgress;  ///< How far the job has got
+};
+
+#endif
@@ -0,0 +1,645 @@
+/**
+ * \file Server.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <optional>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "Playlist.h"
+#include "Server.h"
+
+/// Events taken from epoll at a time
+static const int EVENT_BATCH = 64;
+
+/// Bytes read from a client at a time
+static const size_t READ_CHUNK = 64 << 10;
+
+/// Largest thumbnail that can be asked for, in pixels
+static const uint64_t THUMBNAIL_LIMIT = 4096;
+
+/**
+ * \brief Constructor
+ * \param library The library to share; it must outlive the server
+ * \param scheduler Scheduler running jobs on the library, or nullptr if there isn't one
+ */
+CServer::CServer(CLibrary *library, CScheduler *scheduler)
+{
+    mLibrary = library;
+    mScheduler = scheduler;
+    mListen = -1;
+    mRequests = 0;
+
+    mEpoll = epoll_create1(EPOLL_CLOEXEC);
+    mWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (mEpoll >= 0 && mWake >= 0)
+    {
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = mWake;
+        epoll_ctl(mEpoll, EPOLL_CTL_ADD, mWake, &event);
+    }
+}
+
+/**
+ * \brief Destructor
+ *
+ * Drops every client and removes the socket
+ */
+CServer::~CServer()
+{
+    while (!mClients.empty())
+    {
+        Close(mClients.begin()->first);
+    }
+    if (mListen >= 0)
+    {
+        close(mListen);
+        unlink(mPath.c_str());
+    }
+    if (mWake >= 0)
+    {
+        close(mWake);
+    }
+    if (mEpoll >= 0)
+    {
+        close(mEpoll);
+    }
+}
+
+/**
+ * \brief Start taking connections
+ * \param path Where to put the socket
+ * \returns -1 if something goes wrong, e.g. another server is already there
+ *
+ * A socket left behind by a server that's gone is replaced.
+ */
+int CServer::Listen(const std::string &path)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (mListen >= 0 || mEpoll < 0 || mWake < 0 || path.empty() || path.size() >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    // Only take the path over if nothing answers on it
+    if (connect(fd, (sockaddr *)&address, sizeof(address)) == 0 || errno == EAGAIN)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    unlink(path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (bind(fd, (sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0 ||
+        epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &event) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    mListen = fd;
+    mPath = path;
+    return 0;
+}
+
+/**
+ * \brief Serve clients until Stop() is called
+ * \returns -1 if something goes wrong, e.g. Listen() hasn't been
+ *
+ * Each time round, everything that's arrived is handled, then the
+ * notifications it caused go out, then every response that's waiting
+ * is sent.
+ */
+int CServer::Run()
+{
+    if (mListen < 0)
+    {
+        return -1;
+    }
+
+    epoll_event events[EVENT_BATCH];
+    for (;;)
+    {
+        int ready = epoll_wait(mEpoll, events, EVENT_BATCH, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        bool stopping = false;
+        for (int i = 0; i < ready; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == mWake)
+            {
+                uint64_t count;
+                while (read(mWake, &count, sizeof(count)) > 0);
+                stopping = true;
+            }
+            else if (fd == mListen)
+            {
+                Accept();
+            }
+            else
+            {
+                auto client = mClients.find(fd);
+                if (client != mClients.end() && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                {
+                    Read(fd, client->second);
+                }
+            }
+        }
+
+        if (!mNotifications.empty())
+        {
+            for (auto &client : mClients)
+            {
+                if (client.second.subscribed && !client.second.closing)
+                {
+                    client.second.out += mNotifications;
+                }
+            }
+            mNotifications.clear();
+        }
+
+        std::vector<int> closing;
+        for (auto &client : mClients)
+        {
+            if (client.second.sent < client.second.out.size())
+            {
+                Flush(client.first, client.second);
+            }
+            if (client.second.closing)
+            {
+                closing.push_back(client.first);
+            }
+        }
+        for (int fd : closing)
+        {
+            Close(fd);
+        }
+
+        if (stopping)
+        {
+            return 0;
+        }
+    }
+}
+
+/**
+ * \brief Make Run() return, once it's finished what it's doing
+ *
+ * Safe to call from any thread, or from a signal handler.
+ */
+void CServer::Stop()
+{
+    // This only fails if the counter is full, in which case Run() is being woken anyway
+    uint64_t one = 1;
+    if (write(mWake, &one, sizeof(one)) < 0)
+    {
+        return;
+    }
+}
+
+/**
+ * \brief Take every connection that's waiting
+ */
+void CServer::Accept()
+{
+    for (;;)
+    {
+        int fd = accept4(mListen, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            return;
+        }
+
+        epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = fd;
+        if (epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            close(fd);
+            continue;
+        }
+        mClients[fd] = Client();
+    }
+}
+
+/**
+ * \brief Read what a client has sent, and handle every whole request in it
+ * \param fd The client's socket
+ * \param client The client
+ *
+ * Responses are queued rather than sent, so a pipeline of requests
+ * goes back in as few writes as it can. A client that has hung up, or
+ * sent a frame too big to take, is marked to be dropped.
+ */
+void CServer::Read(int fd, Client &client)
+{
+    char buffer[READ_CHUNK];
+    for (;;)
+    {
+        ssize_t got = read(fd, buffer, sizeof(buffer));
+        if (got > 0)
+        {
+            client.in.append(buffer, got);
+            continue;
+        }
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            client.closing = true;
+        }
+        break;
+    }
+
+    // Workers can't take a step while requests are being handled, so hold them off once for the lot
+    std::optional<CScheduler::Interactive> interactive;
+
+    const char *p = client.in.data();
+    const char *end = p + client.in.size();
+    for (;;)
+    {
+        uint32_t id;
+        unsigned char opcode;
+        const char *payload, *payloadEnd;
+        int whole = GetFrame(p, end, id, opcode, payload, payloadEnd);
+        if (whole <= 0)
+        {
+            if (whole < 0)
+            {
+                client.closing = true;
+            }
+            break;
+        }
+
+        if (mScheduler && !interactive)
+        {
+            interactive.emplace(mScheduler);
+        }
+
+        std::string reply;
+        unsigned char status = Handle(client, opcode, payload, payloadEnd, reply);
+        PutFrame(client.out, id, status, reply);
+        ++mRequests;
+    }
+    client.in.erase(0, p - client.in.data());
+}
+
+/**
+ * \brief Send as much of what's queued for a client as it will take
+ * \param fd The client's socket
+ * \param client The client
+ *
+ * What's left is sent when there's room, and a client that has let
+ * more than OUTPUT_LIMIT pile up is marked to be dropped.
+ */
+void CServer::Flush(int fd, Client &client)
+{
+    while (client.sent < client.out.size())
+    {
+        ssize_t put = send(fd, client.out.data() + client.sent, client.out.size() - client.sent, MSG_NOSIGNAL);
+        if (put > 0)
+        {
+            client.sent += put;
+            continue;
+        }
+        if (put < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (put < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        client.closing = true;
+        return;
+    }
+
+    if (client.sent == client.out.size())
+    {
+        client.out.clear();
+        client.sent = 0;
+    }
+    else if (client.sent > client.out.size() / 2)
+    {
+        client.out.erase(0, client.sent);
+        client.sent = 0;
+    }
+
+    if (client.out.size() - client.sent > OUTPUT_LIMIT)
+    {
+        client.closing = true;
+        return;
+    }
+
+    bool writing = !client.out.empty();
+    if (writing != client.writing)
+    {
+        epoll_event event = {};
+        event.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+        event.data.fd = fd;
+        epoll_ctl(mEpoll, EPOLL_CTL_MOD, fd, &event);
+        client.writing = writing;
+    }
+}
+
+/**
+ * \brief Drop a client
+ * \param fd The client's socket
+ */
+void CServer::Close(int fd)
+{
+    epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    mClients.erase(fd);
+}
+
+/**
+ * \brief Carry out one request
+ * \param client The client that sent it
+ * \param opcode What it asks for
+ * \param p Start of its payload
+ * \param end End of its payload
+ * \param reply Filled in with the response's payload
+ * \returns Status of the response
+ *
+ * See Protocol.h for what each request carries and gets back.
+ */
+unsigned char CServer::Handle(Client &client, unsigned char opcode, const char *p, const char *end,
+                              std::string &reply)
+{
+    switch (opcode)
+    {
+        case OP_PING:
+        {
+            reply.assign(p, end);
+            return STATUS_OK;
+        }
+        case OP_SUBSCRIBE:
+        {
+            client.subscribed = true;
+            return STATUS_OK;
+        }
+        case OP_ADD_TRACK:
+        {
+            std::string filepath = GetString(p, end);
+            if (filepath.empty() || p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            std::string id = mLibrary->AddTrack(filepath);
+            if (id.empty())
+            {
+                return STATUS_FAILED;
+            }
+            PutId(reply, id);
+            Notify(NOTIFY_TRACK_ADDED, id);
+            return STATUS_OK;
+        }
+        case OP_REMOVE_TRACK:
+        {
+            std::string id = GetId(p, end);
+            if (id.empty() || p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            mLibrary->RemoveTrack(id);
+            Notify(NOTIFY_TRACK_REMOVED, id);
+            return STATUS_OK;
+        }
+        case OP_ADD_PLAYLIST:
+        {
+            std::string title = GetString(p, end);
+            if (p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            std::string id = mLibrary->AddPlaylist(title);
+            if (id.empty())
+            {
+                return STATUS_FAILED;
+            }
+            PutId(reply, id);
+            Notify(NOTIFY_PLAYLIST_ADDED, id);
+            return STATUS_OK;
+        }
+        case OP_REMOVE_PLAYLIST:
+        {
+            std::string id = GetId(p, end);
+            if (id.empty() || p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            mLibrary->RemovePlaylist(id);
+            Notify(NOTIFY_PLAYLIST_REMOVED, id);
+            return STATUS_OK;
+        }
+        case OP_LOAD_PAGE:
+        {
+            std::string id = GetId(p, end);
+            uint64_t page = GetVarint(p, end);
+            if (id.empty() || page > INT_MAX / CPlaylistCache::PAGE_TRACKS || p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            std::string title, length;
+            std::vector<std::string> tracks;
+            if (!mLibrary->LoadPlaylistPage(id, page, title, length, tracks))
+            {
+                return STATUS_FAILED;
+            }
+            PutString(reply, title);
+            PutVarint(reply, strtoull(length.c_str(), nullptr, 10));
+            PutIds(reply, tracks);
+            return STATUS_OK;
+        }
+        case OP_FIND_TRACKS:
+        {
+            std::vector<std::string> filepaths = GetList(p, end);
+            if (p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            PutIds(reply, mLibrary->GetStorage()->FindTracks(filepaths));
+            return STATUS_OK;
+        }
+        case OP_FIND_FILEPATHS:
+        {
+            std::vector<std::string> ids = GetIds(p, end);
+            if (p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            PutList(reply, mLibrary->GetStorage()->FindFilepaths(ids));
+            return STATUS_OK;
+        }
+        case OP_INSERT_TRACKS:
+        case OP_REMOVE_RANGE:
+        case OP_MOVE_RANGE:
+        {
+            return EditPlaylist(opcode, p, end);
+        }
+        case OP_RECORD_PLAY:
+        {
+            std::string track = GetId(p, end);
+            uint64_t event = GetVarint(p, end);
+            uint64_t time = GetVarint(p, end);
+            if (track.empty() || event < CStorage::EVENT_PLAY || event > CStorage::EVENT_COMPLETE || p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            mLibrary->RecordPlay(track, (CStorage::PlayEvent)event, time);
+            return STATUS_OK;
+        }
+        case OP_GET_STATS:
+        {
+            std::vector<std::string> tracks = GetIds(p, end);
+            if (p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            std::vector<CStorage::TrackStats> stats = mLibrary->GetTrackStats(tracks);
+            PutVarint(reply, stats.size());
+            for (const CStorage::TrackStats &track : stats)
+            {
+                PutVarint(reply, track.plays);
+                PutVarint(reply, track.skips);
+                PutVarint(reply, track.completions);
+                PutVarint(reply, track.lastPlayed);
+            }
+            return STATUS_OK;
+        }
+        case OP_THUMBNAIL:
+        {
+            std::string filepath = GetString(p, end);
+            uint64_t size = GetVarint(p, end);
+            if (filepath.empty() || size == 0 || size > THUMBNAIL_LIMIT || p != end)
+            {
+                return STATUS_BAD_REQUEST;
+            }
+            const unsigned char *pixels = mLibrary->GetThumbnail(filepath, size);
+            if (pixels)
+            {
+                reply.assign((const char *)pixels, size * size * 3);
+            }
+            return STATUS_OK;
+        }
+        default:
+        {
+            return STATUS_BAD_REQUEST;
+        }
+    }
+}
+
+/**
+ * \brief Carry out a request to edit a playlist's tracks
+ * \param opcode OP_INSERT_TRACKS, OP_REMOVE_RANGE or OP_MOVE_RANGE
+ * \param p Start of its payload
+ * \param end End of its payload
+ * \returns Status of the response
+ *
+ * The playlist is opened as a CPlaylist, so it comes from the library's
+ * cache and the cache is kept up to date.
+ */
+unsigned char CServer::EditPlaylist(unsigned char opcode, const char *p, const char *end)
+{
+    std::string id = GetId(p, end);
+    uint64_t position = GetVarint(p, end);
+    uint64_t count = 0, to = 0;
+    std::vector<std::string> tracks;
+    if (opcode == OP_INSERT_TRACKS)
+    {
+        tracks = GetIds(p, end);
+    }
+    else
+    {
+        count = GetVarint(p, end);
+    }
+    if (opcode == OP_MOVE_RANGE)
+    {
+        to = GetVarint(p, end);
+    }
+
+    if (id.empty() || position == 0 || p != end)
+    {
+        return STATUS_BAD_REQUEST;
+    }
+    for (const std::string &track : tracks)
+    {
+        if (track.empty())
+        {
+            return STATUS_BAD_REQUEST;
+        }
+    }
+
+    CPlaylist playlist(mLibrary, id);
+    if (!playlist.Exists())
+    {
+        return STATUS_FAILED;
+    }
+
+    if (opcode == OP_INSERT_TRACKS)
+    {
+        playlist.InsertTracks(tracks, std::to_string(position));
+    }
+    else if (opcode == OP_REMOVE_RANGE)
+    {
+        playlist.RemoveRange(std::to_string(position), std::to_string(count));
+    }
+    else
+    {
+        playlist.MoveRange(std::to_string(position), std::to_string(count), std::to_string(to));
+    }
+
+    Notify(NOTIFY_PLAYLIST_CHANGED, id);
+    return STATUS_OK;
+}
+
+/**
+ * \brief Queue a notification for every subscribed client
+ * \param what What happened
+ * \param id The track or playlist it happened to
+ */
+void CServer::Notify(Notification what, const std::string &id)
+{
+    std::string payload(1, (char)what);
+    PutId(payload, id);
+    PutFrame(mNotifications, 0, OP_NOTIFY, payload);
+}
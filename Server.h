@@ -0,0 +1,126 @@
+/**
+ * \file Server.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Server class
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include "Library.h"
+#include "Protocol.h"
+#include "Scheduler.h"
+
+/**
+ * \brief Shares one library with any number of clients over a Unix socket
+ *
+ * The library, its playlist cache, recommender and artwork stay open
+ * and warm in one process, and frontends connect with a CClient
+ * instead of opening the library themselves. Requests and responses
+ * are the frames in Protocol.h.
+ *
+ * One thread runs everything, waiting on epoll. Every whole request a
+ * client has sent is handled as soon as it arrives, in order, and the
+ * responses go back together, so a client can pipeline as many as it
+ * likes without waiting on each. Responses a client isn't reading are
+ * kept for it up to OUTPUT_LIMIT bytes, after which it's dropped
+ * rather than let it hold the rest up.
+ *
+ * Clients that subscribe are told whenever a track or playlist is
+ * added, removed or edited through the server, whoever asked for it.
+ *
+ * If a scheduler is given, requests are handled inside an Interactive,
+ * so background jobs can keep running alongside.
+ */
+class CServer
+{
+public:
+
+    /// Bytes of responses kept for a client before it's dropped
+    static const size_t OUTPUT_LIMIT = 16 << 20;
+
+    /** \brief Default constructor (disabled) */
+    CServer() = delete;
+
+    CServer(CLibrary *library, CScheduler *scheduler = nullptr);
+    ~CServer();
+
+    /** \brief Copy constructor (disabled)
+     * \param server Server to construct this based on */
+    CServer(const CServer &server) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param server Server whose attributes will override those of the current server */
+    CServer& operator=(const CServer &server) = delete;
+
+    int Listen(const std::string &path);
+
+    int Run();
+
+    void Stop();
+
+    /**
+     * \brief Returns how many clients are connected
+     * \returns Number of clients
+     */
+    size_t GetClientCount() { return mClients.size(); }
+
+    /**
+     * \brief Returns how many requests have been handled
+     * \returns Number of requests
+     */
+    long GetRequestCount() { return mRequests; }
+
+private:
+    /// A connected client
+    struct Client
+    {
+        std::string in;             ///< What has arrived and not been handled, ending with part of a frame if any
+        std::string out;            ///< Responses and notifications not sent yet
+        size_t sent = 0;            ///< How much of out has been sent
+        bool writing = false;       ///< Whether epoll is watching for room to send more
+        bool subscribed = false;    ///< Whether to send notifications
+        bool closing = false;       ///< Whether to drop it once this round is done
+    };
+
+    void Accept();
+    void Read(int fd, Client &client);
+    void Flush(int fd, Client &client);
+    void Close(int fd);
+    unsigned char Handle(Client &client, unsigned char opcode, const char *p, const char *end,
+                         std::string &reply);
+    unsigned char EditPlaylist(unsigned char opcode, const char *p, const char *end);
+    void Notify(Notification what, const std::string &id);
+
+    /// Library requests are handled against
+    CLibrary *mLibrary;
+
+    /// Scheduler whose jobs share the library, or nullptr if there is none
+    CScheduler *mScheduler;
+
+    /// Socket clients connect to, or -1 before Listen()
+    int mListen;
+
+    /// Where the socket is, to remove it again
+    std::string mPath;
+
+    /// What Run() waits on
+    int mEpoll;
+
+    /// Written to by Stop() to wake Run()
+    int mWake;
+
+    /// Connected clients, by socket
+    std::map<int, Client> mClients;
+
+    /// Notifications from the requests being handled, to send once they're done
+    std::string mNotifications;
+
+    /// Requests handled so far
+    long mRequests;
+};
+
+#endif
@@ -0,0 +1,1166 @@
+/**
+ * \file ShardedStorage.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <future>
+#include <memory>
+#include "ShardedStorage.h"
+
+/// Tracks of a playlist read from the catalog at a time when streaming it
+static const int STREAM_PAGE = 1024;
+
+/**
+ * \brief Turn a string id into a number
+ * \param id The id
+ * \returns The id as a number, or -1 if it isn't one
+ */
+static long ToId(const std::string &id)
+{
+    char *end = nullptr;
+    long value = strtol(id.c_str(), &end, 10);
+    return (id.empty() || *end != '\0' || value < 1) ? -1 : value;
+}
+
+/**
+ * \brief Constructor
+ * \param catalog Storage to keep playlists and jobs in; this takes ownership
+ * \param shards Storages to keep tracks in, and their roots; this takes ownership.
+ *               At most SHARD_LIMIT, and the order mustn't change once tracks are added
+ */
+CShardedStorage::CShardedStorage(CStorage *catalog, const std::vector<Shard> &shards)
+{
+    mCatalog = catalog;
+    mShards = shards;
+    if (mShards.size() > (size_t)SHARD_LIMIT)
+    {
+        for (size_t shard = SHARD_LIMIT; shard < mShards.size(); ++shard)
+        {
+            delete mShards[shard].storage;
+        }
+        mShards.resize(SHARD_LIMIT);
+    }
+    mUnwrittenHistory.resize(mShards.size());
+}
+
+/**
+ * \brief Destructor
+ *
+ * Closes the catalog and every shard
+ */
+CShardedStorage::~CShardedStorage()
+{
+    delete mCatalog;
+    for (Shard &shard : mShards)
+    {
+        delete shard.storage;
+    }
+}
+
+/**
+ * \brief Work out which shard a track belongs in
+ * \param filepath The track's filepath
+ * \returns The shard with the longest root the filepath starts with, or NO_SHARD if none
+ */
+size_t CShardedStorage::ShardFor(const std::string &filepath)
+{
+    size_t best = NO_SHARD;
+    size_t longest = 0;
+    bool found = false;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        const std::string &root = mShards[shard].root;
+        if (filepath.compare(0, root.size(), root) == 0 && (!found || root.size() > longest))
+        {
+            best = shard;
+            longest = root.size();
+            found = true;
+        }
+    }
+    return best;
+}
+
+/**
+ * \brief Choose where the catalog and every shard report statements
+ * \param stats Stats to report to, or nullptr to stop reporting
+ */
+void CShardedStorage::SetStats(CStats *stats)
+{
+    mStats = stats;
+    mCatalog->SetStats(stats);
+    for (Shard &shard : mShards)
+    {
+        shard.storage->SetStats(stats);
+    }
+}
+
+/**
+ * \brief Exposes whether the catalog and every shard can be reached
+ * \returns CONNECTION_OK only if they all can
+ */
+ConnStatusType CShardedStorage::GetStatus()
+{
+    if (mShards.empty() || mCatalog->GetStatus() != CONNECTION_OK)
+    {
+        return CONNECTION_BAD;
+    }
+    for (Shard &shard : mShards)
+    {
+        if (shard.storage->GetStatus() != CONNECTION_OK)
+        {
+            return CONNECTION_BAD;
+        }
+    }
+    return CONNECTION_OK;
+}
+
+/**
+ * \brief Create the tables in the catalog and every shard
+ * \returns -1 if something goes wrong in any of them
+ */
+int CShardedStorage::PrepareDatabase()
+{
+    int result = mCatalog->PrepareDatabase();
+    for (Shard &shard : mShards)
+    {
+        result = shard.storage->PrepareDatabase() != 0 ? -1 : result;
+    }
+    return result;
+}
+
+/**
+ * \brief Drop the tables in the catalog and every shard
+ * \returns -1 if something goes wrong in any of them
+ */
+int CShardedStorage::DestroyDatabase()
+{
+    int result = mCatalog->DestroyDatabase();
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        result = mShards[shard].storage->DestroyDatabase() != 0 ? -1 : result;
+        mUnwrittenHistory[shard].clear();
+    }
+    return result;
+}
+
+/**
+ * \brief Add a track to the shard for its root, and to the library playlist
+ * \param filepath The filepath of the track
+ * \returns Global ID of the new track, or "" if something goes wrong or it's under no shard's root
+ */
+std::string CShardedStorage::AddTrack(std::string filepath)
+{
+    size_t shard = ShardFor(filepath);
+    if (shard == NO_SHARD)
+    {
+        return "";
+    }
+
+    long local = ToId(mShards[shard].storage->AddTrack(filepath));
+    if (local < 1)
+    {
+        return "";
+    }
+
+    std::string id = std::to_string(GlobalId(local, shard));
+    mCatalog->AppendTrack("1", id);
+    return id;
+}
+
+/**
+ * \brief Add several tracks, each to the shard for its root
+ * \param filepaths The filepaths of the tracks
+ * \returns Global IDs of the new tracks, in the same order; "" for any under no shard's root
+ *
+ * The shards add theirs at once, then they all go on the end of the
+ * library playlist together, in the order given.
+ */
+std::vector<std::string> CShardedStorage::AddTracks(const std::vector<std::string> &filepaths)
+{
+    std::vector<std::vector<std::string>> paths(mShards.size());
+    std::vector<std::vector<size_t>> places(mShards.size());
+    for (size_t i = 0; i < filepaths.size(); ++i)
+    {
+        size_t shard = ShardFor(filepaths[i]);
+        if (shard == NO_SHARD)
+        {
+            continue;
+        }
+        paths[shard].push_back(filepaths[i]);
+        places[shard].push_back(i);
+    }
+
+    std::vector<size_t> busy;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        if (!paths[shard].empty())
+        {
+            busy.push_back(shard);
+        }
+    }
+
+    std::vector<std::string> ids(filepaths.size());
+    Parallel(busy, [&](size_t shard)
+    {
+        std::vector<std::string> added = mShards[shard].storage->AddTracks(paths[shard]);
+        for (size_t i = 0; i < added.size() && i < places[shard].size(); ++i)
+        {
+            long local = ToId(added[i]);
+            ids[places[shard][i]] = local > 0 ? std::to_string(GlobalId(local, shard)) : "";
+        }
+    });
+
+    std::vector<std::string> members;
+    members.reserve(ids.size());
+    for (const std::string &id : ids)
+    {
+        if (!id.empty())
+        {
+            members.push_back(id);
+        }
+    }
+
+    std::string title, length;
+    std::vector<std::string> none;
+    if (!members.empty() && mCatalog->LoadPlaylistRange("1", 1, 0, title, length, none))
+    {
+        mCatalog->InsertTracks("1", members, atoi(length.c_str()) + 1);
+    }
+
+    return ids;
+}
+
+/**
+ * \brief Add an empty playlist to the catalog
+ * \param title Title of the playlist
+ * \returns ID of the new playlist
+ */
+std::string CShardedStorage::AddPlaylist(std::string title)
+{
+    return mCatalog->AddPlaylist(title);
+}
+
+/**
+ * \brief Remove a track from its shard, and from every playlist
+ * \param id Global ID of the track
+ */
+void CShardedStorage::RemoveTrack(std::string id)
+{
+    long global = ToId(id);
+    if (global < 1 || ShardOf(global) >= mShards.size())
+    {
+        return;
+    }
+
+    mShards[ShardOf(global)].storage->RemoveTrack(std::to_string(LocalId(global)));
+    mCatalog->RemoveTrack(id);
+}
+
+/**
+ * \brief Remove a playlist from the catalog
+ * \param id ID of the playlist
+ */
+void CShardedStorage::RemovePlaylist(std::string id)
+{
+    mCatalog->RemovePlaylist(id);
+}
+
+/**
+ * \brief Read a playlist and its global track IDs from the catalog
+ * \param id ID of the playlist
+ * \param title Filled in with the title
+ * \param length Filled in with the length
+ * \param tracks Filled in with the track IDs, in order
+ * \returns false if there is no such playlist
+ */
+bool CShardedStorage::LoadPlaylist(std::string id, std::string &title, std::string &length,
+                                   std::vector<std::string> &tracks)
+{
+    return mCatalog->LoadPlaylist(id, title, length, tracks);
+}
+
+/**
+ * \brief Read a window of a playlist from the catalog
+ * \param id ID of the playlist
+ * \param position First position wanted, from 1
+ * \param count Most tracks wanted
+ * \param title Filled in with the title
+ * \param length Filled in with the whole playlist's length
+ * \param tracks Filled in with the global track IDs in the window, in order
+ * \returns false if there is no such playlist
+ */
+bool CShardedStorage::LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                        std::string &length, std::vector<std::string> &tracks)
+{
+    return mCatalog->LoadPlaylistRange(id, position, count, title, length, tracks);
+}
+
+/**
+ * \brief Read what's on a playlist, added up
+ * \param id ID of the playlist
+ * \returns Its totals, all 0 if there is no such playlist
+ *
+ * The catalog only has the tracks' ids, so it can only count them. The
+ * library playlist is the exception: each shard's own one holds all of
+ * its tracks, so their totals are added up instead, an artist or album
+ * spread over several shards counting once per shard.
+ */
+CStorage::PlaylistTotals CShardedStorage::GetPlaylistTotals(std::string id)
+{
+    PlaylistTotals totals = mCatalog->GetPlaylistTotals(id);
+    if (id != "1")
+    {
+        return totals;
+    }
+
+    std::vector<size_t> all;
+    for (size_t i = 0; i < mShards.size(); ++i)
+    {
+        all.push_back(i);
+    }
+    std::vector<PlaylistTotals> found(mShards.size());
+    Parallel(all, [&](size_t shard) { found[shard] = mShards[shard].storage->GetPlaylistTotals("1"); });
+
+    for (const PlaylistTotals &shard : found)
+    {
+        totals.duration += shard.duration;
+        totals.bytes += shard.bytes;
+        totals.artists += shard.artists;
+        totals.albums += shard.albums;
+    }
+    return totals;
+}
+
+/**
+ * \brief Look up tracks by filepath, in each one's shard at once
+ * \param filepaths The filepaths to look up
+ * \returns Global IDs of the tracks in the same order, or "" where there is no such track
+ */
+std::vector<std::string> CShardedStorage::FindTracks(const std::vector<std::string> &filepaths)
+{
+    std::vector<std::vector<std::string>> paths(mShards.size());
+    std::vector<std::vector<size_t>> places(mShards.size());
+    std::vector<size_t> busy;
+    for (size_t i = 0; i < filepaths.size(); ++i)
+    {
+        size_t shard = ShardFor(filepaths[i]);
+        if (shard == NO_SHARD)
+        {
+            continue;
+        }
+        if (paths[shard].empty())
+        {
+            busy.push_back(shard);
+        }
+        paths[shard].push_back(filepaths[i]);
+        places[shard].push_back(i);
+    }
+
+    std::vector<std::string> ids(filepaths.size());
+    Parallel(busy, [&](size_t shard)
+    {
+        std::vector<std::string> found = mShards[shard].storage->FindTracks(paths[shard]);
+        for (size_t i = 0; i < found.size() && i < places[shard].size(); ++i)
+        {
+            long local = ToId(found[i]);
+            ids[places[shard][i]] = local > 0 ? std::to_string(GlobalId(local, shard)) : "";
+        }
+    });
+
+    return ids;
+}
+
+/**
+ * \brief Look up the filepaths of tracks, in each one's shard at once
+ * \param ids Global IDs of the tracks
+ * \returns Filepaths in the same order, or "" where there is no such track
+ */
+std::vector<std::string> CShardedStorage::FindFilepaths(const std::vector<std::string> &ids)
+{
+    Split split = SplitIds(ids);
+
+    std::vector<std::string> filepaths(ids.size());
+    Parallel(split.shards, [&](size_t shard)
+    {
+        std::vector<std::string> found = mShards[shard].storage->FindFilepaths(split.ids[shard]);
+        for (size_t i = 0; i < found.size() && i < split.places[shard].size(); ++i)
+        {
+            filepaths[split.places[shard][i]].swap(found[i]);
+        }
+    });
+
+    return filepaths;
+}
+
+/**
+ * \brief Move every track under one directory to another, in every shard at once
+ * \param from Directory the tracks are under now
+ * \param to Directory to move them under
+ * \returns Number of tracks moved, or -1 if something goes wrong or they'd end up under another shard's root,
+ *          or under none
+ *
+ * Roots under the directory move with it, so a shard's tracks stay
+ * where ShardFor() will look for them. The roots are only changed
+ * here; whatever the shards were made from has to be changed to match.
+ */
+long CShardedStorage::RelocateRoot(std::string from, std::string to)
+{
+    std::vector<std::string> roots;
+    std::vector<bool> moving;
+    std::vector<size_t> all;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        const std::string &root = mShards[shard].root;
+        moving.push_back(!root.empty() && root.compare(0, from.size(), from) == 0);
+        roots.push_back(moving.back() ? to + root.substr(from.size()) : root);
+        all.push_back(shard);
+    }
+
+    // What the directory's shard had there has to stay under its root, and
+    // mustn't fall under a longer one that stays put; roots that move keep
+    // what was under them
+    size_t owner = ShardFor(from);
+    if (owner != NO_SHARD && to.compare(0, roots[owner].size(), roots[owner]) != 0)
+    {
+        return -1;
+    }
+    for (size_t shard = 0; shard < mShards.size() && owner != NO_SHARD; ++shard)
+    {
+        const std::string &root = roots[shard];
+        bool overlaps = root.compare(0, to.size(), to) == 0 || to.compare(0, root.size(), root) == 0;
+        if (shard != owner && !moving[shard] && overlaps && root.size() > roots[owner].size())
+        {
+            return -1;
+        }
+    }
+
+    std::vector<long> moved(mShards.size(), 0);
+    Parallel(all, [&](size_t shard)
+    {
+        moved[shard] = mShards[shard].storage->RelocateRoot(from, to);
+    });
+
+    long total = 0;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        if (moved[shard] < 0)
+        {
+            return -1;
+        }
+        total += moved[shard];
+        mShards[shard].root = roots[shard];
+    }
+    return total;
+}
+
+/**
+ * \brief Append a track to a playlist in the catalog
+ * \param playlist ID of the playlist
+ * \param track Global ID of the track
+ * \returns ID of the new membership
+ */
+std::string CShardedStorage::AppendTrack(std::string playlist, std::string track)
+{
+    return mCatalog->AppendTrack(playlist, track);
+}
+
+/**
+ * \brief Insert a track into a playlist in the catalog
+ * \param playlist ID of the playlist
+ * \param track Global ID of the track
+ * \param position Where to put it
+ * \returns ID of the new membership
+ */
+std::string CShardedStorage::InsertTrack(std::string playlist, std::string track, int position)
+{
+    return mCatalog->InsertTrack(playlist, track, position);
+}
+
+/**
+ * \brief Insert tracks into a playlist in the catalog
+ * \param playlist ID of the playlist
+ * \param tracks Global IDs of the tracks, in order
+ * \param position Where to put the first one
+ */
+void CShardedStorage::InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position)
+{
+    mCatalog->InsertTracks(playlist, tracks, position);
+}
+
+/**
+ * \brief Remove a run of tracks from a playlist in the catalog
+ * \param playlist ID of the playlist
+ * \param position Position of the first track to remove
+ * \param count How many to remove
+ */
+void CShardedStorage::RemoveRange(std::string playlist, int position, int count)
+{
+    mCatalog->RemoveRange(playlist, position, count);
+}
+
+/**
+ * \brief Move a run of tracks within a playlist in the catalog
+ * \param playlist ID of the playlist
+ * \param from Position of the first track to move
+ * \param count How many to move
+ * \param to Position the first of them ends up at
+ */
+void CShardedStorage::MoveRange(std::string playlist, int from, int count, int to)
+{
+    mCatalog->MoveRange(playlist, from, count, to);
+}
+
+/**
+ * \brief Put every track in a playlist in the catalog in a new order
+ * \param playlist ID of the playlist
+ * \param order The current positions of its tracks, in the order they're to go in
+ */
+void CShardedStorage::Reorder(std::string playlist, const std::vector<long> &order)
+{
+    mCatalog->Reorder(playlist, order);
+}
+
+/**
+ * \brief Tidy up a playlist's positions in the catalog
+ * \param playlist ID of the playlist
+ */
+void CShardedStorage::Normalize(std::string playlist)
+{
+    mCatalog->Normalize(playlist);
+}
+
+/**
+ * \brief Start a batch of playlist edits in the catalog
+ * \returns Whether this started the outermost batch
+ */
+bool CShardedStorage::BeginBatch()
+{
+    return mCatalog->BeginBatch();
+}
+
+/**
+ * \brief Commit a batch of playlist edits in the catalog
+ * \param playlist ID of the playlist the batch edited
+ * \param outer What BeginBatch() returned
+ * \returns -1 if it couldn't be committed, and was rolled back
+ */
+int CShardedStorage::CommitBatch(std::string playlist, bool outer)
+{
+    return mCatalog->CommitBatch(playlist, outer);
+}
+
+/**
+ * \brief Throw away a batch of playlist edits in the catalog
+ * \param outer What BeginBatch() returned
+ */
+void CShardedStorage::RollbackBatch(bool outer)
+{
+    mCatalog->RollbackBatch(outer);
+}
+
+/**
+ * \brief Visit every track, a shard at a time
+ * \param visit Called once per track, with its global id
+ *
+ * Tracks come ordered by filepath within each shard, and shards in order.
+ */
+void CShardedStorage::ReadTracks(const std::function<void(const TrackRecord &)> &visit)
+{
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        mShards[shard].storage->ReadTracks([&](const TrackRecord &track)
+        {
+            TrackRecord global = track;
+            global.id = GlobalId(track.id, shard);
+            visit(global);
+        });
+    }
+}
+
+/**
+ * \brief Stream every track, ordered by global id
+ * \returns Cursor over the tracks, to be deleted
+ *
+ * Every shard streams at once, and the next track is always the
+ * lowest id any of them has waiting, so a row per shard is held.
+ */
+CStorage::Cursor<CStorage::TrackRecord> *CShardedStorage::StreamTracks()
+{
+    struct Head
+    {
+        std::unique_ptr<Cursor<TrackRecord>> cursor;    ///< The shard's tracks
+        TrackRecord track;                              ///< Its next track, with its global id
+        bool waiting;                                   ///< Whether it has a next track
+    };
+
+    auto heads = std::make_shared<std::vector<Head>>(mShards.size());
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        Head &head = (*heads)[shard];
+        head.cursor.reset(mShards[shard].storage->StreamTracks());
+        head.waiting = head.cursor->Next(head.track);
+        head.track.id = GlobalId(head.track.id, shard);
+    }
+
+    return new CallbackCursor<TrackRecord>([heads](TrackRecord &track)
+    {
+        Head *lowest = nullptr;
+        for (Head &head : *heads)
+        {
+            if (head.waiting && (!lowest || head.track.id < lowest->track.id))
+            {
+                lowest = &head;
+            }
+        }
+        if (!lowest)
+        {
+            return false;
+        }
+
+        track = lowest->track;
+        size_t shard = ShardOf(track.id);
+        lowest->waiting = lowest->cursor->Next(lowest->track);
+        lowest->track.id = GlobalId(lowest->track.id, shard);
+        return true;
+    });
+}
+
+/**
+ * \brief Stream a playlist's tracks, in order
+ * \param id ID of the playlist
+ * \returns Cursor over the tracks, to be deleted; empty if there's no such playlist
+ *
+ * A page of STREAM_PAGE tracks is read from the catalog at a time and
+ * its filepaths resolved in every shard at once.
+ */
+CStorage::Cursor<CStorage::EntryRecord> *CShardedStorage::StreamPlaylist(std::string id)
+{
+    auto page = std::make_shared<std::vector<EntryRecord>>();
+    size_t next = 0;
+    int position = 1;
+
+    return new CallbackCursor<EntryRecord>([this, id, page, next, position](EntryRecord &entry) mutable
+    {
+        if (next == page->size())
+        {
+            std::string title, length;
+            std::vector<std::string> tracks;
+            if (!mCatalog->LoadPlaylistRange(id, position, STREAM_PAGE, title, length, tracks) || tracks.empty())
+            {
+                return false;
+            }
+
+            std::vector<std::string> filepaths = FindFilepaths(tracks);
+            page->resize(tracks.size());
+            for (size_t i = 0; i < tracks.size(); ++i)
+            {
+                (*page)[i] = {position + (long)i, atol(tracks[i].c_str()), std::move(filepaths[i])};
+            }
+            position += tracks.size();
+            next = 0;
+        }
+
+        entry = std::move((*page)[next++]);
+        return true;
+    });
+}
+
+/**
+ * \brief Visit every playlist in the catalog, ordered by id
+ * \param visit Called once per playlist with its id, title and global track ids in order
+ */
+void CShardedStorage::ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit)
+{
+    mCatalog->ReadPlaylists(visit);
+}
+
+/**
+ * \brief Get the catalog and every shard ready to be restored into
+ * \returns -1 if any of them can't be
+ */
+int CShardedStorage::BeginRestore()
+{
+    int result = mCatalog->BeginRestore();
+    for (Shard &shard : mShards)
+    {
+        result = shard.storage->BeginRestore() != 0 ? -1 : result;
+    }
+    return result;
+}
+
+/**
+ * \brief Restore tracks, each into the shard its id says
+ * \param tracks The tracks, with their global ids
+ */
+void CShardedStorage::RestoreTracks(const std::vector<TrackRecord> &tracks)
+{
+    std::vector<std::vector<TrackRecord>> split(mShards.size());
+    for (const TrackRecord &track : tracks)
+    {
+        if (ShardOf(track.id) < mShards.size())
+        {
+            split[ShardOf(track.id)].push_back(track);
+            split[ShardOf(track.id)].back().id = LocalId(track.id);
+        }
+    }
+
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        if (!split[shard].empty())
+        {
+            mShards[shard].storage->RestoreTracks(split[shard]);
+        }
+    }
+}
+
+/**
+ * \brief Restore a playlist into the catalog
+ * \param id ID of the playlist
+ * \param title Title of the playlist
+ * \param tracks Global IDs of its tracks, in order
+ */
+void CShardedStorage::RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks)
+{
+    mCatalog->RestorePlaylist(id, title, tracks);
+}
+
+/**
+ * \brief Finish restoring the catalog and every shard
+ * \returns -1 if any of them went wrong
+ */
+int CShardedStorage::EndRestore()
+{
+    int result = mCatalog->EndRestore();
+    for (Shard &shard : mShards)
+    {
+        result = shard.storage->EndRestore() != 0 ? -1 : result;
+    }
+    return result;
+}
+
+/**
+ * \brief Add to the listening history, each event in its track's shard
+ * \param events The events, oldest first
+ * \returns -1 if every shard given events fails, in which case none of them were written
+ *
+ * Shards that take their share keep it, so a shard that fails while
+ * others don't holds on to its share here, and it goes ahead of that
+ * shard's events next time rather than being handed back to be sent
+ * to every shard again.
+ */
+int CShardedStorage::AppendHistory(const std::vector<PlayRecord> &events)
+{
+    std::vector<std::vector<PlayRecord>> split(mShards.size());
+    std::vector<size_t> busy;
+    for (const PlayRecord &event : events)
+    {
+        size_t shard = ShardOf(event.track);
+        if (shard < mShards.size())
+        {
+            if (split[shard].empty())
+            {
+                busy.push_back(shard);
+            }
+            split[shard].push_back(event);
+            split[shard].back().track = LocalId(event.track);
+        }
+    }
+
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        if (!mUnwrittenHistory[shard].empty() && split[shard].empty())
+        {
+            busy.push_back(shard);
+        }
+    }
+
+    std::vector<int> results(mShards.size(), 0);
+    Parallel(busy, [&](size_t shard)
+    {
+        std::vector<PlayRecord> batch = mUnwrittenHistory[shard];
+        batch.insert(batch.end(), split[shard].begin(), split[shard].end());
+        results[shard] = mShards[shard].storage->AppendHistory(batch);
+    });
+
+    bool given = false;
+    bool written = false;
+    for (size_t shard : busy)
+    {
+        given = given || !split[shard].empty();
+        if (results[shard] == 0)
+        {
+            mUnwrittenHistory[shard].clear();
+            written = written || !split[shard].empty();
+        }
+    }
+    if (given && !written)
+    {
+        return -1;
+    }
+
+    for (size_t shard : busy)
+    {
+        if (results[shard] != 0)
+        {
+            mUnwrittenHistory[shard].insert(mUnwrittenHistory[shard].end(), split[shard].begin(), split[shard].end());
+        }
+    }
+    return 0;
+}
+
+/**
+ * \brief Read tracks' listening stats, in each one's shard at once
+ * \param ids Global IDs of the tracks
+ * \returns Stats in the same order; all zero for tracks never played
+ */
+std::vector<CStorage::TrackStats> CShardedStorage::GetTrackStats(const std::vector<std::string> &ids)
+{
+    Split split = SplitIds(ids);
+
+    std::vector<TrackStats> stats(ids.size());
+    Parallel(split.shards, [&](size_t shard)
+    {
+        std::vector<TrackStats> found = mShards[shard].storage->GetTrackStats(split.ids[shard]);
+        for (size_t i = 0; i < found.size() && i < split.places[shard].size(); ++i)
+        {
+            stats[split.places[shard][i]] = found[i];
+        }
+    });
+
+    return stats;
+}
+
+/**
+ * \brief Find tracks that haven't been analysed yet, across every shard
+ * \param after Only tracks with a global id above this
+ * \param limit Most tracks to return
+ * \returns The tracks with their global ids, ordered by global id
+ */
+std::vector<CStorage::TrackRecord> CShardedStorage::FindUnanalyzed(long after, size_t limit)
+{
+    std::vector<std::vector<TrackRecord>> found(mShards.size());
+    std::vector<size_t> all;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        all.push_back(shard);
+    }
+
+    Parallel(all, [&](size_t shard)
+    {
+        // Global ids above after, in this shard, are local ids above this
+        long local = after >= (long)shard ? (after - (long)shard) / SHARD_LIMIT : 0;
+        found[shard] = mShards[shard].storage->FindUnanalyzed(local, limit);
+    });
+
+    std::vector<TrackRecord> tracks;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        for (TrackRecord &track : found[shard])
+        {
+            track.id = GlobalId(track.id, shard);
+            tracks.push_back(std::move(track));
+        }
+    }
+    std::sort(tracks.begin(), tracks.end(), [](const TrackRecord &a, const TrackRecord &b) { return a.id < b.id; });
+    if (tracks.size() > limit)
+    {
+        tracks.resize(limit);
+    }
+
+    return tracks;
+}
+
+/**
+ * \brief Keep what analysing tracks found, each in its track's shard
+ * \param features The findings, with global track ids
+ */
+void CShardedStorage::SaveFeatures(const std::vector<TrackFeatures> &features)
+{
+    std::vector<std::vector<TrackFeatures>> split(mShards.size());
+    std::vector<size_t> busy;
+    for (const TrackFeatures &found : features)
+    {
+        size_t shard = ShardOf(found.track);
+        if (found.track > 0 && shard < mShards.size())
+        {
+            if (split[shard].empty())
+            {
+                busy.push_back(shard);
+            }
+            split[shard].push_back(found);
+            split[shard].back().track = LocalId(found.track);
+        }
+    }
+
+    Parallel(busy, [&](size_t shard) { mShards[shard].storage->SaveFeatures(split[shard]); });
+}
+
+/**
+ * \brief Read what analysing tracks found, in each one's shard at once
+ * \param ids Global IDs of the tracks
+ * \returns Findings in the same order; track is 0 for tracks not analysed yet
+ */
+std::vector<CStorage::TrackFeatures> CShardedStorage::GetFeatures(const std::vector<std::string> &ids)
+{
+    Split split = SplitIds(ids);
+
+    std::vector<TrackFeatures> features(ids.size());
+    Parallel(split.shards, [&](size_t shard)
+    {
+        std::vector<TrackFeatures> found = mShards[shard].storage->GetFeatures(split.ids[shard]);
+        for (size_t i = 0; i < found.size() && i < split.places[shard].size(); ++i)
+        {
+            TrackFeatures &place = features[split.places[shard][i]];
+            place = std::move(found[i]);
+            if (place.track)
+            {
+                place.track = GlobalId(place.track, shard);
+            }
+        }
+    });
+
+    return features;
+}
+
+/**
+ * \brief List tracks whose tags haven't been read, across every shard at once
+ * \param after Only list tracks with a global id above this
+ * \param limit List no more than this many
+ * \returns The tracks, with global ids, ordered by them
+ */
+std::vector<CStorage::TrackRecord> CShardedStorage::FindUntagged(long after, size_t limit)
+{
+    std::vector<std::vector<TrackRecord>> found(mShards.size());
+    std::vector<size_t> all;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        all.push_back(shard);
+    }
+
+    Parallel(all, [&](size_t shard)
+    {
+        long local = after >= (long)shard ? (after - (long)shard) / SHARD_LIMIT : 0;
+        found[shard] = mShards[shard].storage->FindUntagged(local, limit);
+    });
+
+    std::vector<TrackRecord> tracks;
+    for (size_t shard = 0; shard < mShards.size(); ++shard)
+    {
+        for (TrackRecord &track : found[shard])
+        {
+            track.id = GlobalId(track.id, shard);
+            tracks.push_back(std::move(track));
+        }
+    }
+    std::sort(tracks.begin(), tracks.end(), [](const TrackRecord &a, const TrackRecord &b) { return a.id < b.id; });
+    if (tracks.size() > limit)
+    {
+        tracks.resize(limit);
+    }
+
+    return tracks;
+}
+
+/**
+ * \brief Keep what tracks' tags say, each in its track's shard
+ * \param tags The tags, with global track ids
+ */
+void CShardedStorage::SaveTags(const std::vector<TrackTags> &tags)
+{
+    std::vector<std::vector<TrackTags>> split(mShards.size());
+    std::vector<size_t> busy;
+    for (const TrackTags &read : tags)
+    {
+        size_t shard = ShardOf(read.track);
+        if (read.track > 0 && shard < mShards.size())
+        {
+            if (split[shard].empty())
+            {
+                busy.push_back(shard);
+            }
+            split[shard].push_back(read);
+            split[shard].back().track = LocalId(read.track);
+        }
+    }
+
+    Parallel(busy, [&](size_t shard) { mShards[shard].storage->SaveTags(split[shard]); });
+}
+
+/**
+ * \brief Browse a page of the library, merging every shard's page
+ * \param level What to list
+ * \param parent Global id of the artist or album to list under, which is only in its own shard
+ * \param after The last row of the page before, with a global id
+ * \param limit Most rows to return
+ * \returns The rows, with global ids, in order
+ *
+ * Artists and genres are kept per shard, so one with tracks under two
+ * roots is listed once for each. Names are merged in byte order.
+ */
+std::vector<CStorage::BrowseEntry> CShardedStorage::Browse(BrowseLevel level, long parent,
+                                                           const BrowseEntry &after, size_t limit)
+{
+    std::vector<size_t> asked;
+    if ((level == BROWSE_ALBUMS && parent != 0) || level == BROWSE_TRACKS)
+    {
+        if (parent > 0 && ShardOf(parent) < mShards.size())
+        {
+            asked.push_back(ShardOf(parent));
+        }
+    }
+    else
+    {
+        for (size_t shard = 0; shard < mShards.size(); ++shard)
+        {
+            asked.push_back(shard);
+        }
+    }
+
+    std::vector<std::vector<BrowseEntry>> found(mShards.size());
+    Parallel(asked, [&](size_t shard)
+    {
+        // Rows tied with after on number and name come after it if their global id is higher
+        BrowseEntry local = after;
+        local.id = after.id >= (long)shard ? (after.id - (long)shard) / SHARD_LIMIT : -1;
+        found[shard] = mShards[shard].storage->Browse(level, parent ? LocalId(parent) : 0, local, limit);
+    });
+
+    std::vector<BrowseEntry> entries;
+    for (size_t shard : asked)
+    {
+        for (BrowseEntry &entry : found[shard])
+        {
+            entry.id = GlobalId(entry.id, shard);
+            entries.push_back(std::move(entry));
+        }
+    }
+    std::sort(entries.begin(), entries.end(), [](const BrowseEntry &a, const BrowseEntry &b)
+    {
+        if (a.number != b.number)
+        {
+            return a.number < b.number;
+        }
+        int names = a.name.compare(b.name);
+        return names != 0 ? names < 0 : a.id < b.id;
+    });
+    if (entries.size() > limit)
+    {
+        entries.resize(limit);
+    }
+
+    return entries;
+}
+
+/**
+ * \brief Page through the playlists in the catalog
+ * \param after Only playlists with an id above this
+ * \param limit Most playlists to return
+ * \returns IDs of the playlists, in order
+ */
+std::vector<long> CShardedStorage::FindPlaylists(long after, size_t limit)
+{
+    return mCatalog->FindPlaylists(after, limit);
+}
+
+/**
+ * \brief Reclaim space in the catalog and every shard
+ * \returns -1 if any of them couldn't right now
+ */
+int CShardedStorage::Vacuum()
+{
+    int result = mCatalog->Vacuum();
+    for (Shard &shard : mShards)
+    {
+        result = shard.storage->Vacuum() != 0 ? -1 : result;
+    }
+    return result;
+}
+
+/**
+ * \brief Keep a new background job in the catalog
+ * \param job The job; its id is ignored
+ * \returns ID of the job, or -1 if something goes wrong
+ */
+long CShardedStorage::AddJob(const JobRecord &job)
+{
+    return mCatalog->AddJob(job);
+}
+
+/**
+ * \brief Keep where a background job is at, in the catalog
+ * \param job The job
+ */
+void CShardedStorage::UpdateJob(const JobRecord &job)
+{
+    mCatalog->UpdateJob(job);
+}
+
+/**
+ * \brief Read the background jobs that haven't finished from the catalog
+ * \returns The jobs, ordered by id
+ */
+std::vector<CStorage::JobRecord> CShardedStorage::LoadJobs()
+{
+    return mCatalog->LoadJobs();
+}
+
+/**
+ * \brief Split a list of global track ids up by shard
+ * \param ids The ids
+ * \returns Each shard's local ids and where they came from; ids that
+ *          aren't numbers or name no shard go nowhere
+ */
+CShardedStorage::Split CShardedStorage::SplitIds(const std::vector<std::string> &ids)
+{
+    Split split;
+    split.ids.resize(mShards.size());
+    split.places.resize(mShards.size());
+
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        long global = ToId(ids[i]);
+        size_t shard = global > 0 ? ShardOf(global) : mShards.size();
+        if (shard >= mShards.size())
+        {
+            continue;
+        }
+
+        if (split.ids[shard].empty())
+        {
+            split.shards.push_back(shard);
+        }
+        split.ids[shard].push_back(std::to_string(LocalId(global)));
+        split.places[shard].push_back(i);
+    }
+
+    return split;
+}
+
+/**
+ * \brief Do some work in several shards at once
+ * \param shards The shards
+ * \param work Called with each shard's number, on a thread of its own if there's more than one
+ *
+ * Each shard is its own connection or file, so they can all be busy
+ * at once. Returns once every one is done.
+ */
+void CShardedStorage::Parallel(const std::vector<size_t> &shards, const std::function<void(size_t)> &work)
+{
+    if (shards.size() == 1)
+    {
+        work(shards[0]);
+        return;
+    }
+
+    std::vector<std::future<void>> running;
+    for (size_t shard : shards)
+    {
+        running.push_back(std::async(std::launch::async, work, shard));
+    }
+    for (std::future<void> &done : running)
+    {
+        done.get();
+    }
+}
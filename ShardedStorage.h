@@ -0,0 +1,191 @@
+/**
+ * \file ShardedStorage.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the ShardedStorage class
+ */
+
+#ifndef SHARDEDSTORAGE_H
+#define SHARDEDSTORAGE_H
+
+#include <string>
+#include <vector>
+#include "Storage.h"
+
+/**
+ * \brief Spreads a library's tracks over several storages, by library root
+ *
+ * Each shard is a whole storage (a Postgres database, say, or a local
+ * file) and owns the tracks under one root directory, along with
+ * their history, stats and features. Playlists and jobs live in a
+ * separate catalog storage, whose own tracks table stays empty.
+ *
+ * A track's id outside its shard is its id in the shard times
+ * SHARD_LIMIT plus the shard's number, so the shard can be read
+ * straight off any id. Playlists in the catalog hold these global ids,
+ * so one playlist can mix tracks from every shard. Global ids run past
+ * what an INTEGER holds, so the catalog keeps them as BIGINT.
+ *
+ * A filepath under none of the roots is refused, rather than put in
+ * some shard where it'd never be looked for. A shard with the root ""
+ * takes anything no other shard does.
+ *
+ * Anything that takes a list of tracks (filepaths, stats, features)
+ * splits it by shard, asks the shards at once on a thread each, and
+ * puts the answers back in the order asked. Streaming a playlist does
+ * the same a page at a time.
+ *
+ * The shards still put their own tracks on their own library
+ * playlist. Nothing reads it; the catalog's is the real one.
+ *
+ * Like the storages it's made of, this can only be used from one
+ * thread at a time.
+ */
+class CShardedStorage : public CStorage
+{
+public:
+
+    /// Most shards there can be; ids are spread this far apart
+    static const long SHARD_LIMIT = 64;
+
+    /// What ShardFor() returns for a filepath under no shard's root
+    static const size_t NO_SHARD = (size_t)-1;
+
+    /// A storage and the root directory of the tracks it keeps
+    struct Shard
+    {
+        std::string root;       ///< Filepaths starting with this go here; "" takes anything
+        CStorage *storage;      ///< Where they're kept
+    };
+
+    /** \brief Default constructor (disabled) */
+    CShardedStorage() = delete;
+
+    CShardedStorage(CStorage *catalog, const std::vector<Shard> &shards);
+    virtual ~CShardedStorage();
+
+    /** \brief Copy constructor (disabled)
+     * \param storage Storage to construct this based on */
+    CShardedStorage(const CShardedStorage &storage) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param storage Storage whose attributes will override those of the current storage */
+    CShardedStorage& operator=(const CShardedStorage &storage) = delete;
+
+    /**
+     * \brief Returns the id a track has outside its shard
+     * \param local Its id in the shard
+     * \param shard Number of the shard
+     */
+    static long GlobalId(long local, size_t shard) { return local * SHARD_LIMIT + shard; }
+
+    /**
+     * \brief Returns the shard a track is in
+     * \param global Its global id
+     */
+    static size_t ShardOf(long global) { return global % SHARD_LIMIT; }
+
+    /**
+     * \brief Returns the id a track has in its shard
+     * \param global Its global id
+     */
+    static long LocalId(long global) { return global / SHARD_LIMIT; }
+
+    size_t ShardFor(const std::string &filepath);
+
+    /**
+     * \brief Returns how many shards there are
+     * \returns Number of shards
+     */
+    size_t GetShardCount() { return mShards.size(); }
+
+    /**
+     * \brief Returns one of the shards' storage
+     * \param shard Number of the shard
+     * \returns Pointer to storage object
+     */
+    CStorage *GetShard(size_t shard) { return mShards.at(shard).storage; }
+
+    virtual void SetStats(CStats *stats) override;
+
+    virtual ConnStatusType GetStatus() override;
+
+    virtual int PrepareDatabase() override;
+    virtual int DestroyDatabase() override;
+
+    virtual std::string AddTrack(std::string filepath) override;
+    virtual std::vector<std::string> AddTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::string AddPlaylist(std::string title) override;
+    virtual void RemoveTrack(std::string id) override;
+    virtual void RemovePlaylist(std::string id) override;
+
+    virtual bool LoadPlaylist(std::string id, std::string &title, std::string &length,
+                              std::vector<std::string> &tracks) override;
+    virtual bool LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                   std::string &length, std::vector<std::string> &tracks) override;
+    virtual PlaylistTotals GetPlaylistTotals(std::string id) override;
+    virtual std::vector<std::string> FindTracks(const std::vector<std::string> &filepaths) override;
+    virtual std::vector<std::string> FindFilepaths(const std::vector<std::string> &ids) override;
+    virtual long RelocateRoot(std::string from, std::string to) override;
+
+    virtual std::string AppendTrack(std::string playlist, std::string track) override;
+    virtual std::string InsertTrack(std::string playlist, std::string track, int position) override;
+    virtual void InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position) override;
+    virtual void RemoveRange(std::string playlist, int position, int count) override;
+    virtual void MoveRange(std::string playlist, int from, int count, int to) override;
+    virtual void Reorder(std::string playlist, const std::vector<long> &order) override;
+    virtual void Normalize(std::string playlist) override;
+
+    virtual bool BeginBatch() override;
+    virtual int CommitBatch(std::string playlist, bool outer) override;
+    virtual void RollbackBatch(bool outer) override;
+
+    virtual void ReadTracks(const std::function<void(const TrackRecord &)> &visit) override;
+    virtual Cursor<TrackRecord> *StreamTracks() override;
+    virtual Cursor<EntryRecord> *StreamPlaylist(std::string id) override;
+    virtual void ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit) override;
+    virtual int BeginRestore() override;
+    virtual void RestoreTracks(const std::vector<TrackRecord> &tracks) override;
+    virtual void RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks) override;
+    virtual int EndRestore() override;
+
+    virtual int AppendHistory(const std::vector<PlayRecord> &events) override;
+    virtual std::vector<TrackStats> GetTrackStats(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUnanalyzed(long after, size_t limit) override;
+    virtual void SaveFeatures(const std::vector<TrackFeatures> &features) override;
+    virtual std::vector<TrackFeatures> GetFeatures(const std::vector<std::string> &ids) override;
+
+    virtual std::vector<TrackRecord> FindUntagged(long after, size_t limit) override;
+    virtual void SaveTags(const std::vector<TrackTags> &tags) override;
+    virtual std::vector<BrowseEntry> Browse(BrowseLevel level, long parent, const BrowseEntry &after,
+                                            size_t limit) override;
+
+    virtual std::vector<long> FindPlaylists(long after, size_t limit) override;
+    virtual int Vacuum() override;
+    virtual long AddJob(const JobRecord &job) override;
+    virtual void UpdateJob(const JobRecord &job) override;
+    virtual std::vector<JobRecord> LoadJobs() override;
+
+private:
+    /// A list of tracks split up by shard
+    struct Split
+    {
+        std::vector<size_t> shards;                         ///< Shards with anything to do
+        std::vector<std::vector<std::string>> ids;          ///< Each shard's local ids, as strings
+        std::vector<std::vector<size_t>> places;            ///< Where each came from in the list
+    };
+
+    Split SplitIds(const std::vector<std::string> &ids);
+    void Parallel(const std::vector<size_t> &shards, const std::function<void(size_t)> &work);
+
+    /// Where playlists and jobs are kept
+    CStorage *mCatalog;
+
+    /// Where tracks are kept, by number
+    std::vector<Shard> mShards;
+
+    /// Each shard's listening history it failed to take while others took theirs; see AppendHistory()
+    std::vector<std::vector<PlayRecord>> mUnwrittenHistory;
+};
+
+#endif
@@ -0,0 +1,239 @@
+/**
+ * \file Snapshot.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "Snapshot.h"
+#include "Encoding.h"
+
+/// Format version this code writes and reads
+static const uint32_t SNAPSHOT_VERSION = 1;
+
+/// Size of the fixed header at the start of a snapshot
+static const size_t HEADER_BYTES = 32;
+
+/// How much of the body to build up before writing it out
+static const size_t CHUNK_BYTES = 1 << 20;
+
+/// How many tracks to hand the storage at a time when reading, by default
+static const size_t RESTORE_TRACKS = 10000;
+
+/**
+ * \brief Constructor
+ * \param path Where the snapshot file is, or is to be written
+ */
+CSnapshot::CSnapshot(std::string path)
+{
+    mPath = path;
+    mBatch = RESTORE_TRACKS;
+}
+
+/**
+ * \brief Write everything in a storage out to the snapshot file
+ * \param storage Storage to read the library from
+ * \returns -1 if something goes wrong
+ */
+int CSnapshot::Write(CStorage *storage)
+{
+    FILE *file = fopen(mPath.c_str(), "wb");
+    if (!file)
+    {
+        return -1;
+    }
+
+    // Leave room for the header; the counts aren't known until the end
+    char header[HEADER_BYTES] = {0};
+    bool ok = fwrite(header, 1, HEADER_BYTES, file) == HEADER_BYTES;
+
+    uint64_t trackCount = 0;
+    uint64_t playlistCount = 0;
+    uint64_t bodyBytes = 0;
+    uint32_t sum = Checksum(nullptr, 0);
+
+    std::string chunk;
+    auto flush = [&]()
+    {
+        ok = ok && fwrite(chunk.data(), 1, chunk.size(), file) == chunk.size();
+        sum = Checksum(chunk.data(), chunk.size(), sum);
+        bodyBytes += chunk.size();
+        chunk.clear();
+    };
+
+    std::string previous;
+    storage->ReadTracks([&](const CStorage::TrackRecord &track)
+    {
+        size_t shared = 0;
+        size_t limit = std::min(previous.size(), track.filepath.size());
+        while (shared < limit && previous[shared] == track.filepath[shared])
+        {
+            ++shared;
+        }
+
+        PutVarint(chunk, shared);
+        PutVarint(chunk, track.filepath.size() - shared);
+        chunk.append(track.filepath, shared, std::string::npos);
+        PutVarint(chunk, track.id);
+        PutVarint(chunk, track.dateAdded);
+
+        previous = track.filepath;
+        ++trackCount;
+
+        if (chunk.size() >= CHUNK_BYTES)
+        {
+            flush();
+        }
+    });
+
+    storage->ReadPlaylists([&](long id, const std::string &title, const std::vector<long> &tracks)
+    {
+        PutVarint(chunk, id);
+        PutString(chunk, title);
+        PutVarint(chunk, tracks.size());
+
+        long last = 0;
+        for (long track : tracks)
+        {
+            PutVarint(chunk, ZigZag(track - last));
+            last = track;
+
+            if (chunk.size() >= CHUNK_BYTES)
+            {
+                flush();
+            }
+        }
+
+        ++playlistCount;
+    });
+
+    flush();
+
+    ok = ok && fwrite(&sum, 1, 4, file) == 4;
+
+    memcpy(header, "MMLX", 4);
+    memcpy(header + 4, &SNAPSHOT_VERSION, 4);
+    memcpy(header + 8, &trackCount, 8);
+    memcpy(header + 16, &playlistCount, 8);
+    memcpy(header + 24, &bodyBytes, 8);
+    ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(header, 1, HEADER_BYTES, file) == HEADER_BYTES;
+
+    ok = (fclose(file) == 0) && ok;
+
+    return ok ? 0 : -1;
+}
+
+/**
+ * \brief Replace everything in a storage with the snapshot
+ * \param storage Storage to restore the library into
+ * \returns -1 if the file is missing, damaged or from a newer version,
+ *          in which case the storage is left alone
+ */
+int CSnapshot::Read(CStorage *storage)
+{
+    int fd = open(mPath.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    struct stat info;
+    fstat(fd, &info);
+    size_t size = info.st_size;
+
+    if (size < HEADER_BYTES + 4)
+    {
+        close(fd);
+        return -1;
+    }
+
+    void *map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+
+    const char *data = (const char *)map;
+    uint32_t version, sum;
+    uint64_t trackCount, playlistCount, bodyBytes;
+    memcpy(&version, data + 4, 4);
+    memcpy(&trackCount, data + 8, 8);
+    memcpy(&playlistCount, data + 16, 8);
+    memcpy(&bodyBytes, data + 24, 8);
+
+    // Check everything before touching the storage
+    if (memcmp(data, "MMLX", 4) != 0 || version != SNAPSHOT_VERSION || bodyBytes != size - HEADER_BYTES - 4)
+    {
+        munmap(map, size);
+        return -1;
+    }
+
+    const char *p = data + HEADER_BYTES;
+    const char *end = p + bodyBytes;
+    memcpy(&sum, end, 4);
+    if (Checksum(p, bodyBytes) != sum || storage->BeginRestore() != 0)
+    {
+        munmap(map, size);
+        return -1;
+    }
+
+    std::vector<CStorage::TrackRecord> tracks;
+    tracks.reserve(std::min<uint64_t>(trackCount, mBatch));
+    std::string previous;
+    for (uint64_t i = 0; i < trackCount && p < end; ++i)
+    {
+        uint64_t shared = GetVarint(p, end);
+        uint64_t rest = GetVarint(p, end);
+        if (shared > previous.size() || rest > (uint64_t)(end - p))
+        {
+            break;
+        }
+
+        CStorage::TrackRecord track;
+        track.filepath.reserve(shared + rest);
+        track.filepath.assign(previous, 0, shared);
+        track.filepath.append(p, rest);
+        p += rest;
+        track.id = GetVarint(p, end);
+        track.dateAdded = GetVarint(p, end);
+
+        previous = track.filepath;
+        tracks.push_back(std::move(track));
+
+        if (tracks.size() == mBatch)
+        {
+            storage->RestoreTracks(tracks);
+            tracks.clear();
+        }
+    }
+    storage->RestoreTracks(tracks);
+
+    std::vector<long> members;
+    for (uint64_t i = 0; i < playlistCount && p < end; ++i)
+    {
+        long id = GetVarint(p, end);
+        std::string title = GetString(p, end);
+        uint64_t count = GetVarint(p, end);
+
+        members.clear();
+        long last = 0;
+        for (uint64_t j = 0; j < count && p < end; ++j)
+        {
+            last += UnZigZag(GetVarint(p, end));
+            members.push_back(last);
+        }
+
+        storage->RestorePlaylist(id, title, members);
+    }
+
+    munmap(map, size);
+
+    return storage->EndRestore();
+}
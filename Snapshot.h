@@ -0,0 +1,72 @@
+/**
+ * \file Snapshot.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Snapshot class
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include "Storage.h"
+
+/**
+ * \brief A whole library (tracks, playlists and memberships) in one compact file
+ *
+ * The file is a fixed header, a body and a checksum of the body:
+ *
+ *     "MMLX" | version (u32) | tracks (u64) | playlists (u64) | body bytes (u64)
+ *     tracks, sorted by filepath, each:
+ *         bytes shared with the previous filepath, rest of the filepath,
+ *         id, date added
+ *     playlists, by id, each:
+ *         id, title, track count, then each track id as a zigzagged
+ *         difference from the one before it
+ *     FNV-1a checksum of the body (u32)
+ *
+ * Numbers in the body are varints. Sorting by filepath means each path
+ * only stores what differs from the last one, which for a library laid
+ * out as artist/album/track is usually just the file name.
+ *
+ * Both directions stream: writing goes out in chunks as the storage is
+ * read, and reading maps the file and restores it in chunks.
+ */
+class CSnapshot
+{
+public:
+
+    /** \brief Default constructor (disabled) */
+    CSnapshot() = delete;
+
+    CSnapshot(std::string path);
+
+    /** \brief Copy constructor (disabled)
+     * \param snapshot Snapshot to construct this based on */
+    CSnapshot(const CSnapshot &snapshot) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param snapshot Snapshot whose attributes will override those of the current snapshot */
+    CSnapshot& operator=(const CSnapshot &snapshot) = delete;
+
+    /** \brief Destructor */
+    ~CSnapshot() {}
+
+    /**
+     * \brief Choose how many tracks to hand the storage at a time when reading
+     * \param tracks Tracks per batch
+     */
+    void SetBatch(size_t tracks) { mBatch = tracks ? tracks : 1; }
+
+    int Write(CStorage *storage);
+
+    int Read(CStorage *storage);
+
+private:
+    /// Where the snapshot file is
+    std::string mPath;
+
+    /// How many tracks to hand the storage at a time when reading
+    size_t mBatch;
+};
+
+#endif
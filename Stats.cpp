@@ -0,0 +1,188 @@
+/**
+ * \file Stats.cpp
+ * \author Matt Hammerly
+ */
+
+#include <cinttypes>
+#include <cstring>
+#include "Stats.h"
+
+/// Operation that statements made outside of any scope are charged to
+static const char *const NO_OPERATION = "other";
+
+/**
+ * \brief Constructor with nothing counted
+ */
+CStats::CStats()
+{
+    mCurrent = nullptr;
+    mTraceEvery = 0;
+    mStatementCount = 0;
+    mNextTrace = 0;
+}
+
+/**
+ * \brief Count a statement sent to the storage
+ * \param query Text of the statement
+ * \param bytesSent Query and parameter bytes sent
+ * \param bytesReceived Result bytes received
+ * \param micros How long it took
+ */
+void CStats::Statement(const char *query, size_t bytesSent, size_t bytesReceived, uint64_t micros)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    const char *name = mCurrent ? mCurrent : NO_OPERATION;
+    auto operation = mOperations.find(name);
+    if (operation == mOperations.end())
+    {
+        operation = mOperations.emplace(name, Operation()).first;
+    }
+
+    ++operation->second.statements;
+    operation->second.bytesSent += bytesSent;
+    operation->second.bytesReceived += bytesReceived;
+    mStatements.Record(micros);
+
+    if (mTraceEvery == 0 || ++mStatementCount % mTraceEvery != 0)
+    {
+        return;
+    }
+
+    Trace trace = {name, std::string(query, strnlen(query, MAX_TRACE_TEXT)), micros, bytesSent, bytesReceived};
+    if (mTraces.size() < MAX_TRACES)
+    {
+        mTraces.push_back(std::move(trace));
+    }
+    else
+    {
+        mTraces[mNextTrace] = std::move(trace);
+        mNextTrace = (mNextTrace + 1) % MAX_TRACES;
+    }
+}
+
+/**
+ * \brief Choose how many statements to keep the text of
+ * \param every Keep one in this many, or 0 to keep none
+ */
+void CStats::SetTraceSampling(unsigned every)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mTraceEvery = every;
+    mStatementCount = 0;
+}
+
+/**
+ * \brief Copy out everything counted so far
+ * \returns The copy
+ */
+CStats::Snapshot CStats::GetSnapshot()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    Snapshot snapshot;
+    snapshot.operations = mOperations;
+    snapshot.statements = mStatements;
+    snapshot.traces.assign(mTraces.begin() + mNextTrace, mTraces.end());
+    snapshot.traces.insert(snapshot.traces.end(), mTraces.begin(), mTraces.begin() + mNextTrace);
+
+    return snapshot;
+}
+
+/**
+ * \brief Forget everything counted so far
+ *
+ * Tracing stays as it was set.
+ */
+void CStats::Reset()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+
+    mOperations.clear();
+    mStatements.Clear();
+    mTraces.clear();
+    mNextTrace = 0;
+    mStatementCount = 0;
+}
+
+/**
+ * \brief Write a snapshot out in a readable table
+ * \param snapshot The snapshot
+ * \param file Where to write it, e.g. stderr
+ */
+void CStats::Dump(const Snapshot &snapshot, FILE *file)
+{
+    fprintf(file, "%-28s %10s %10s %12s %12s %10s %10s %10s\n",
+            "operation", "calls", "statements", "sent", "received", "p50 us", "p99 us", "max us");
+
+    for (const auto &operation : snapshot.operations)
+    {
+        const Operation &counts = operation.second;
+        fprintf(file, "%-28s %10" PRIu64 " %10" PRIu64 " %12" PRIu64 " %12" PRIu64 " %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+                operation.first.c_str(), counts.calls, counts.statements, counts.bytesSent, counts.bytesReceived,
+                counts.latency.GetPercentile(50), counts.latency.GetPercentile(99), counts.latency.GetMax());
+    }
+
+    fprintf(file, "%-28s %10" PRIu64 " %10s %12s %12s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 "\n",
+            "(each statement)", snapshot.statements.GetCount(), "", "", "",
+            snapshot.statements.GetPercentile(50), snapshot.statements.GetPercentile(99), snapshot.statements.GetMax());
+
+    for (const Trace &trace : snapshot.traces)
+    {
+        fprintf(file, "[%s] %" PRIu64 " us, %" PRIu64 " B sent, %" PRIu64 " B received: %s\n",
+                trace.operation.c_str(), trace.micros, trace.bytesSent, trace.bytesReceived, trace.query.c_str());
+    }
+}
+
+/**
+ * \brief Start charging statements to an operation
+ * \param stats Stats to charge, or nullptr to count nothing
+ * \param name Name of the operation; must outlive the scope
+ *
+ * Does nothing if another operation is already open.
+ */
+CStats::Scope::Scope(CStats *stats, const char *name)
+{
+    mStats = nullptr;
+    if (!stats)
+    {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(stats->mMutex);
+    if (!stats->mCurrent)
+    {
+        stats->mCurrent = name;
+        mStats = stats;
+        mStart = std::chrono::steady_clock::now();
+    }
+}
+
+/**
+ * \brief Destructor
+ *
+ * Counts the call and how long it took
+ */
+CStats::Scope::~Scope()
+{
+    if (!mStats)
+    {
+        return;
+    }
+
+    uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - mStart).count();
+
+    std::lock_guard<std::mutex> lock(mStats->mMutex);
+
+    auto operation = mStats->mOperations.find(mStats->mCurrent);
+    if (operation == mStats->mOperations.end())
+    {
+        operation = mStats->mOperations.emplace(mStats->mCurrent, Operation()).first;
+    }
+    ++operation->second.calls;
+    operation->second.latency.Record(micros);
+
+    mStats->mCurrent = nullptr;
+}
@@ -0,0 +1,148 @@
+/**
+ * \file Stats.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Stats class
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "Histogram.h"
+
+/**
+ * \brief Counts what a library does and what it costs
+ *
+ * CLibrary and CPlaylist open a Scope for each public operation, and
+ * the storage reports every statement it sends. Statements are charged
+ * to whatever operation is open, so a snapshot shows, say, how many
+ * round trips one RemoveTrack took. Scopes opened inside another (a
+ * RemoveTrack calling RemoveRange) are folded into the outer one.
+ *
+ * Every Nth statement's text can be kept too; the most recent ones
+ * are in the snapshot.
+ */
+class CStats
+{
+public:
+
+    /// Counters for one kind of operation
+    struct Operation
+    {
+        uint64_t calls = 0;         ///< How many times it was called
+        uint64_t statements = 0;    ///< Round trips it made to the storage
+        uint64_t bytesSent = 0;     ///< Query and parameter bytes sent
+        uint64_t bytesReceived = 0; ///< Result bytes received
+        CHistogram latency;         ///< How long each call took, in microseconds
+    };
+
+    /// A statement whose text was kept
+    struct Trace
+    {
+        std::string operation;  ///< Operation it was charged to
+        std::string query;      ///< Its text, cut short if long
+        uint64_t micros;        ///< How long it took
+        uint64_t bytesSent;     ///< Bytes sent
+        uint64_t bytesReceived; ///< Bytes received
+    };
+
+    /// Everything counted, as of when it was taken
+    struct Snapshot
+    {
+        std::map<std::string, Operation, std::less<>> operations;  ///< Counters, by operation name
+        CHistogram statements;                                      ///< Every statement's latency, in microseconds
+        std::vector<Trace> traces;                                  ///< Kept statements, oldest first
+    };
+
+    /**
+     * \brief Charges statements to an operation for as long as it exists
+     */
+    class Scope
+    {
+    public:
+
+        /** \brief Default constructor (disabled) */
+        Scope() = delete;
+
+        Scope(CStats *stats, const char *name);
+
+        /** \brief Copy constructor (disabled)
+         * \param scope Scope to construct this based on */
+        Scope(const Scope &scope) = delete;
+
+        /** \brief Assignment operator (disabled)
+         * \param scope Scope whose attributes will override those of the current scope */
+        Scope& operator=(const Scope &scope) = delete;
+
+        ~Scope();
+
+    private:
+        /// Stats to charge, or nullptr if this scope is nested in another
+        CStats *mStats;
+
+        /// When the operation started
+        std::chrono::steady_clock::time_point mStart;
+    };
+
+    CStats();
+
+    /** \brief Copy constructor (disabled)
+     * \param stats Stats to construct this based on */
+    CStats(const CStats &stats) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param stats Stats whose attributes will override those of the current stats */
+    CStats& operator=(const CStats &stats) = delete;
+
+    /** \brief Destructor */
+    ~CStats() {}
+
+    void Statement(const char *query, size_t bytesSent, size_t bytesReceived, uint64_t micros);
+
+    void SetTraceSampling(unsigned every);
+
+    Snapshot GetSnapshot();
+
+    void Reset();
+
+    static void Dump(const Snapshot &snapshot, FILE *file);
+
+private:
+    /// How many kept statements to hold on to
+    static const size_t MAX_TRACES = 256;
+
+    /// How much of a kept statement's text to hold on to
+    static const size_t MAX_TRACE_TEXT = 512;
+
+    /// Guards everything below
+    std::mutex mMutex;
+
+    /// Counters, by operation name
+    std::map<std::string, Operation, std::less<>> mOperations;
+
+    /// Every statement's latency
+    CHistogram mStatements;
+
+    /// Name of the open operation, or nullptr
+    const char *mCurrent;
+
+    /// Keep every this many statements' text, or 0 for none
+    unsigned mTraceEvery;
+
+    /// Statements seen since tracing was set up
+    uint64_t mStatementCount;
+
+    /// Kept statements, used as a ring once full
+    std::vector<Trace> mTraces;
+
+    /// Where the next kept statement goes once mTraces is full
+    size_t mNextTrace;
+};
+
+#endif
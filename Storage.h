@@ -0,0 +1,570 @@
+/**
+ * \file Storage.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Storage interface
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+#include <postgresql/libpq-fe.h>
+#include "Stats.h"
+#include "Task.h"
+
+class CReactor;
+
+/**
+ * \brief This class is what a library keeps its tracks and playlists in
+ *
+ * CLibrary and CPlaylist check their inputs and keep their in-memory
+ * state, and leave the actual reading and writing to one of these.
+ * Positions are 1-based and always run 1..n without gaps; callers
+ * clamp them before they get here.
+ */
+class CStorage
+{
+public:
+
+    /// A playlist's title and length, and a run of its tracks
+    struct PlaylistRange
+    {
+        bool found = false;                 ///< Whether there is such a playlist
+        std::string title;                  ///< The title
+        std::string length;                 ///< The stored length
+        std::vector<std::string> tracks;    ///< The track IDs, in order
+    };
+
+    /// A track as it is read or written in bulk
+    struct TrackRecord
+    {
+        long id;                ///< The id of the track
+        std::string filepath;   ///< The filepath of the track
+        long long dateAdded;    ///< When the track was added, in seconds since the epoch
+    };
+
+    /// A track's place in a playlist, as it is streamed
+    struct EntryRecord
+    {
+        long position;          ///< Where it is in the playlist, from 1
+        long track;             ///< The id of the track
+        std::string filepath;   ///< The filepath of the track
+    };
+
+    /**
+     * \brief Hands out the rows of a read one at a time, holding only a few in memory
+     *
+     * Nothing else may use the storage until Next() has returned false
+     * or the cursor is destroyed. Destroying it early abandons the rest
+     * of the rows. See CStream for walking one with range-for.
+     */
+    template<typename Row>
+    class Cursor
+    {
+    public:
+
+        /** \brief Constructor */
+        Cursor() {}
+
+        /** \brief Copy constructor (disabled)
+         * \param cursor Cursor to construct this based on */
+        Cursor(const Cursor &cursor) = delete;
+
+        /** \brief Assignment operator (disabled)
+         * \param cursor Cursor whose attributes will override those of the current cursor */
+        Cursor& operator=(const Cursor &cursor) = delete;
+
+        /** \brief Destructor */
+        virtual ~Cursor() {}
+
+        /** \brief Read the next row
+         * \param row Filled in with the row
+         * \returns false once there are no rows left, or the read failed */
+        virtual bool Next(Row &row) = 0;
+    };
+
+    /**
+     * \brief A cursor whose rows come from a function
+     *
+     * For storages that have their rows to hand, or build them out of
+     * other reads.
+     */
+    template<typename Row>
+    class CallbackCursor : public Cursor<Row>
+    {
+    public:
+
+        /**
+         * \brief Constructor
+         * \param next Fills in the next row, or returns false once there are none left
+         */
+        CallbackCursor(std::function<bool(Row &)> next) : mNext(next) {}
+
+        /**
+         * \brief Read the next row
+         * \param row Filled in with the row
+         * \returns false once there are no rows left
+         */
+        virtual bool Next(Row &row) override { return mNext(row); }
+
+    private:
+        std::function<bool(Row &)> mNext;   ///< Fills in the next row
+    };
+
+    /// Things that can happen to a track while it's being listened to
+    enum PlayEvent : unsigned char
+    {
+        EVENT_PLAY = 1,     ///< It started playing
+        EVENT_SKIP,         ///< It was stopped or skipped before the end
+        EVENT_COMPLETE      ///< It played to the end
+    };
+
+    /// One entry in the listening history
+    struct PlayRecord
+    {
+        long track;         ///< The id of the track
+        PlayEvent event;    ///< What happened
+        long long time;     ///< When it happened, in seconds since the epoch
+    };
+
+    /// Listening history rolled up for one track
+    struct TrackStats
+    {
+        long plays = 0;             ///< Times it started playing
+        long skips = 0;             ///< Times it was skipped
+        long completions = 0;       ///< Times it played to the end
+        long long lastPlayed = 0;   ///< When anything last happened to it, in seconds since the epoch, or 0
+
+        /**
+         * \brief Returns the share of plays that were skipped
+         * \returns Skip rate from 0 to 1, or 0 if it has never been played
+         */
+        double SkipRate() const { return plays ? (double)skips / plays : 0; }
+    };
+
+    /// What analysing a track's audio found
+    struct TrackFeatures
+    {
+        long track = 0;             ///< The id of the track, or 0 if it hasn't been analysed
+        bool decoded = false;       ///< Whether its audio could be read; nothing else is set if not
+        float duration = 0;         ///< Length, in seconds
+        float loudness = 0;         ///< Integrated loudness, in LUFS (EBU R128)
+        float peak = 0;             ///< Sample peak, in dBFS
+        float bpm = 0;              ///< Tempo, in beats per minute, or 0 if it has no clear beat
+        int key = -1;               ///< 0-11 for C major to B major, 12-23 for C minor to B minor, or -1
+        std::string fingerprint;    ///< Shape of the spectrum, one byte per band; see CAnalyzer
+
+        /**
+         * \brief Work out how much to turn the track up or down by
+         * \param target Loudness to play at, in LUFS
+         * \returns Gain in dB, held down so the peak doesn't clip, or 0 if not decoded
+         */
+        float Gain(float target = -18) const
+        {
+            return decoded ? std::min(target - loudness, -peak) : 0;
+        }
+    };
+
+    /// What a track's tags say, as it's kept for browsing
+    struct TrackTags
+    {
+        long track = 0;         ///< The id of the track
+        std::string title;      ///< Its title, or ""
+        std::string artist;     ///< Who its album is by, or ""; the album artist where there is one
+        std::string album;      ///< The album's title, or ""
+        std::string genre;      ///< Its genre, or ""
+        int number = 0;         ///< Where it is on the album, or 0
+        float duration = 0;     ///< Length in seconds, or 0 to keep the one already known
+        long long bytes = 0;    ///< Size of its file, or 0 if it couldn't be read
+    };
+
+    /// What a level of browsing lists
+    enum BrowseLevel : unsigned char
+    {
+        BROWSE_ARTISTS = 1,     ///< Every artist; there's no parent
+        BROWSE_ALBUMS,          ///< The albums by an artist, or every album if the parent is 0
+        BROWSE_TRACKS,          ///< The tracks on an album
+        BROWSE_GENRES           ///< Every genre; there's no parent
+    };
+
+    /**
+     * \brief One row of browsing, and where the next page starts
+     *
+     * Rows are ordered by number, then name, then id. Passing the last
+     * row of a page back as where to start gives the next page, however
+     * deep into the list it is; a default one starts at the beginning.
+     */
+    struct BrowseEntry
+    {
+        long id = 0;            ///< The id of the artist, album, genre or track
+        std::string name;       ///< Its name, or the title of an album or track
+        long number = 0;        ///< Where a track is on its album; 0 for everything else
+        long tracks = 0;        ///< How many tracks it has; 1 for a track
+        double duration = 0;    ///< Seconds of those tracks, added up
+    };
+
+    /**
+     * \brief What's on a playlist, added up
+     *
+     * Kept up to date as each track goes on or comes off, and as
+     * tracks are tagged, so reading it never goes through the tracks.
+     * A track on twice counts twice, except towards the artists and
+     * albums, which count each one once.
+     */
+    struct PlaylistTotals
+    {
+        long tracks = 0;        ///< How many tracks are on it
+        double duration = 0;    ///< Seconds of them, as far as their lengths are known
+        long long bytes = 0;    ///< Size of their files, as far as they've been tagged
+        long artists = 0;       ///< How many different artists they're by
+        long albums = 0;        ///< How many different albums they're from
+    };
+
+    /// Where a background job is at
+    enum JobState : unsigned char
+    {
+        JOB_QUEUED = 1,     ///< Waiting for a worker, or interrupted before it finished
+        JOB_RUNNING,        ///< Being worked on
+        JOB_DONE,           ///< Finished
+        JOB_FAILED,         ///< Gave up
+        JOB_CANCELLED       ///< Cancelled before it finished
+    };
+
+    /// A background job, as kept so it can carry on after a restart
+    struct JobRecord
+    {
+        long id = 0;                    ///< The id of the job
+        std::string kind;               ///< What sort of job it is; see CScheduler
+        std::string argument;           ///< What it was asked to work on
+        int priority = 0;               ///< Higher goes first
+        JobState state = JOB_QUEUED;    ///< Where it's at
+        std::string progress;           ///< How far it got, in whatever form its kind likes
+    };
+
+    /** \brief Destructor */
+    virtual ~CStorage() {}
+
+    /**
+     * \brief Whether the storage is usable
+     * \returns CONNECTION_OK if it is, CONNECTION_BAD if not
+     */
+    virtual ConnStatusType GetStatus() = 0;
+
+    /**
+     * \brief Returns the Postgres connection behind this storage
+     * \returns Connection, or nullptr if this storage isn't Postgres
+     */
+    virtual PGconn *GetConnection() { return nullptr; }
+
+    /**
+     * \brief Returns how far this storage's committed writes have got
+     * \returns Position in its write-ahead log, 0 if it doesn't have one, or -1 if it can't tell
+     *
+     * A standby whose GetReplayPosition() has reached this has seen
+     * every write made here so far.
+     */
+    virtual long long GetWritePosition() { return 0; }
+
+    /**
+     * \brief Returns how far this storage has replayed the writes of the one it's a standby for
+     * \returns Position in that one's write-ahead log, 0 if it doesn't have one, or -1 if it can't tell
+     */
+    virtual long long GetReplayPosition() { return 0; }
+
+    /** \brief Create whatever the storage needs, and the library playlist
+     * \returns -1 if something goes wrong */
+    virtual int PrepareDatabase() = 0;
+
+    /** \brief Throw away everything in the storage
+     * \returns -1 if something goes wrong */
+    virtual int DestroyDatabase() = 0;
+
+    /** \brief Add a track, and append it to the library playlist
+     * \param filepath The filepath of the track
+     * \returns ID of the new track */
+    virtual std::string AddTrack(std::string filepath) = 0;
+
+    /** \brief Add several tracks, and append them to the library playlist
+     * \param filepaths The filepaths of the tracks
+     * \returns IDs of the new tracks, in the same order */
+    virtual std::vector<std::string> AddTracks(const std::vector<std::string> &filepaths) = 0;
+
+    /** \brief Add an empty playlist
+     * \param title Title of the playlist
+     * \returns ID of the new playlist */
+    virtual std::string AddPlaylist(std::string title) = 0;
+
+    /** \brief Remove a track and all of its playlist memberships
+     * \param id ID of the track */
+    virtual void RemoveTrack(std::string id) = 0;
+
+    /** \brief Remove a playlist and all of its memberships
+     * \param id ID of the playlist */
+    virtual void RemovePlaylist(std::string id) = 0;
+
+    /**
+     * \brief Read a playlist
+     * \param id ID of the playlist
+     * \param title Filled in with the title
+     * \param length Filled in with the stored length
+     * \param tracks Filled in with the track IDs, in order
+     * \returns false if there is no such playlist
+     */
+    virtual bool LoadPlaylist(std::string id, std::string &title, std::string &length,
+                              std::vector<std::string> &tracks) = 0;
+
+    /**
+     * \brief Read a playlist's title and length, and a run of its tracks
+     * \param id ID of the playlist
+     * \param position Position of the first track to read
+     * \param count Number of tracks to read at most
+     * \param title Filled in with the title
+     * \param length Filled in with the stored length
+     * \param tracks Filled in with the track IDs, in order
+     * \returns false if there is no such playlist
+     */
+    virtual bool LoadPlaylistRange(std::string id, int position, int count, std::string &title,
+                                   std::string &length, std::vector<std::string> &tracks) = 0;
+
+    /**
+     * \brief Read what's on a playlist, added up
+     * \param id ID of the playlist
+     * \returns Its totals, all 0 if there is no such playlist
+     */
+    virtual PlaylistTotals GetPlaylistTotals(std::string id) = 0;
+
+    /**
+     * \brief AddTrack(), without blocking the thread on the storage
+     * \param reactor Reactor to wait for the storage in
+     * \param filepath The filepath of the track
+     * \returns Task yielding the ID of the new track, or "" if it couldn't be added
+     *
+     * Storages that never wait on anything just do it; see CReactor.
+     */
+    virtual CTask<std::string> AddTrackAsync(CReactor *reactor, std::string filepath)
+    {
+        (void)reactor;
+        co_return AddTrack(filepath);
+    }
+
+    /**
+     * \brief AddPlaylist(), without blocking the thread on the storage
+     * \param reactor Reactor to wait for the storage in
+     * \param title Title of the playlist
+     * \returns Task yielding the ID of the new playlist, or "" if it couldn't be added
+     */
+    virtual CTask<std::string> AddPlaylistAsync(CReactor *reactor, std::string title)
+    {
+        (void)reactor;
+        co_return AddPlaylist(title);
+    }
+
+    /**
+     * \brief LoadPlaylistRange(), without blocking the thread on the storage
+     * \param reactor Reactor to wait for the storage in
+     * \param id ID of the playlist
+     * \param position Position of the first track to read
+     * \param count Number of tracks to read at most
+     * \returns Task yielding the playlist and the tracks
+     */
+    virtual CTask<PlaylistRange> LoadPlaylistRangeAsync(CReactor *reactor, std::string id, int position, int count)
+    {
+        (void)reactor;
+        PlaylistRange range;
+        range.found = LoadPlaylistRange(id, position, count, range.title, range.length, range.tracks);
+        co_return range;
+    }
+
+    /** \brief Look up tracks by filepath
+     * \param filepaths The filepaths to look up
+     * \returns IDs of the tracks in the same order, or "" where there is no such track */
+    virtual std::vector<std::string> FindTracks(const std::vector<std::string> &filepaths) = 0;
+
+    /** \brief Look up the filepaths of tracks
+     * \param ids IDs of the tracks
+     * \returns Filepaths in the same order, or "" where there is no such track */
+    virtual std::vector<std::string> FindFilepaths(const std::vector<std::string> &ids) = 0;
+
+    /** \brief Move every track under one directory to another, keeping their ids
+     * \param from Directory the tracks are under now, ending in '/'
+     * \param to Directory to move them under, ending in '/'
+     * \returns Number of tracks moved, or -1 if something goes wrong */
+    virtual long RelocateRoot(std::string from, std::string to) = 0;
+
+    /** \brief Add a track to the end of a playlist
+     * \param playlist ID of the playlist
+     * \param track ID of the track
+     * \returns ID of the membership */
+    virtual std::string AppendTrack(std::string playlist, std::string track) = 0;
+
+    /** \brief Insert a track into a playlist
+     * \param playlist ID of the playlist
+     * \param track ID of the track
+     * \param position Position the track should occupy
+     * \returns ID of the membership */
+    virtual std::string InsertTrack(std::string playlist, std::string track, int position) = 0;
+
+    /** \brief Insert several tracks into a playlist, in order
+     * \param playlist ID of the playlist
+     * \param tracks IDs of the tracks
+     * \param position Position the first track should occupy */
+    virtual void InsertTracks(std::string playlist, const std::vector<std::string> &tracks, int position) = 0;
+
+    /** \brief Remove a run of tracks from a playlist
+     * \param playlist ID of the playlist
+     * \param position Position of the first track to remove
+     * \param count Number of tracks to remove */
+    virtual void RemoveRange(std::string playlist, int position, int count) = 0;
+
+    /** \brief Move a run of tracks within a playlist
+     * \param playlist ID of the playlist
+     * \param from Position of the first track to move
+     * \param count Number of tracks to move
+     * \param to Position the first track should end up at */
+    virtual void MoveRange(std::string playlist, int from, int count, int to) = 0;
+
+    /** \brief Put every track in a playlist in a new order
+     * \param playlist ID of the playlist
+     * \param order The current positions of its tracks, in the order they're to go in */
+    virtual void Reorder(std::string playlist, const std::vector<long> &order) = 0;
+
+    /** \brief Close any gaps in a playlist's positions
+     * \param playlist ID of the playlist */
+    virtual void Normalize(std::string playlist) = 0;
+
+    /**
+     * \brief Start a batch of edits
+     * \returns true if this started the transaction, false if it nested in one
+     */
+    virtual bool BeginBatch() = 0;
+
+    /** \brief Tidy up a playlist and make a batch's edits stick
+     * \param playlist ID of the playlist the batch edited
+     * \param outer What BeginBatch() returned
+     * \returns -1 if the batch couldn't be committed; its edits are rolled back */
+    virtual int CommitBatch(std::string playlist, bool outer) = 0;
+
+    /** \brief Throw away a batch's edits
+     * \param outer What BeginBatch() returned */
+    virtual void RollbackBatch(bool outer) = 0;
+
+    /** \brief Visit every track, ordered by filepath
+     * \param visit Called once per track */
+    virtual void ReadTracks(const std::function<void(const TrackRecord &)> &visit) = 0;
+
+    /** \brief Stream every track, ordered by id
+     * \returns Cursor over the tracks, to be deleted */
+    virtual Cursor<TrackRecord> *StreamTracks() = 0;
+
+    /** \brief Stream a playlist's tracks, in order
+     * \param id ID of the playlist
+     * \returns Cursor over the tracks, to be deleted; empty if there's no such playlist */
+    virtual Cursor<EntryRecord> *StreamPlaylist(std::string id) = 0;
+
+    /** \brief Visit every playlist, ordered by id
+     * \param visit Called once per playlist with its id, title and track ids in order */
+    virtual void ReadPlaylists(const std::function<void(long, const std::string &, const std::vector<long> &)> &visit) = 0;
+
+    /** \brief Empty the storage to have a library restored into it
+     * \returns -1 if something goes wrong */
+    virtual int BeginRestore() = 0;
+
+    /** \brief Restore tracks, keeping their ids
+     * \param tracks The tracks */
+    virtual void RestoreTracks(const std::vector<TrackRecord> &tracks) = 0;
+
+    /** \brief Restore a playlist, keeping its id
+     * \param id ID of the playlist
+     * \param title Title of the playlist
+     * \param tracks Track ids, in order */
+    virtual void RestorePlaylist(long id, const std::string &title, const std::vector<long> &tracks) = 0;
+
+    /** \brief Make a restore stick
+     * \returns -1 if something goes wrong */
+    virtual int EndRestore() = 0;
+
+    /** \brief Add to the listening history and roll it into each track's stats
+     * \param events The events, oldest first
+     * \returns -1 if something goes wrong, in which case none of them were written */
+    virtual int AppendHistory(const std::vector<PlayRecord> &events) = 0;
+
+    /** \brief Read the rolled up listening history of tracks
+     * \param ids IDs of the tracks
+     * \returns Stats in the same order; all zero for tracks never played */
+    virtual std::vector<TrackStats> GetTrackStats(const std::vector<std::string> &ids) = 0;
+
+    /** \brief List tracks that haven't been analysed yet
+     * \param after Only list tracks with an id above this
+     * \param limit List no more than this many
+     * \returns The tracks, ordered by id */
+    virtual std::vector<TrackRecord> FindUnanalyzed(long after, size_t limit) = 0;
+
+    /** \brief Keep what analysing tracks found, replacing anything found before
+     * \param features The findings; tracks that no longer exist are skipped */
+    virtual void SaveFeatures(const std::vector<TrackFeatures> &features) = 0;
+
+    /** \brief Read what analysing tracks found
+     * \param ids IDs of the tracks
+     * \returns Findings in the same order; track is 0 for tracks not analysed yet */
+    virtual std::vector<TrackFeatures> GetFeatures(const std::vector<std::string> &ids) = 0;
+
+    /** \brief List tracks whose tags haven't been read yet
+     * \param after Only list tracks with an id above this
+     * \param limit List no more than this many
+     * \returns The tracks, ordered by id */
+    virtual std::vector<TrackRecord> FindUntagged(long after, size_t limit) = 0;
+
+    /** \brief Keep what tracks' tags say, replacing what they said before
+     * \param tags The tags; tracks that no longer exist are skipped
+     *
+     * Artists, albums and genres are made as they're first seen, and
+     * each one's count and total length is kept up to date as tracks
+     * come and go, so browsing never has to add anything up. */
+    virtual void SaveTags(const std::vector<TrackTags> &tags) = 0;
+
+    /** \brief List a page of artists, albums, tracks or genres
+     * \param level What to list
+     * \param parent The artist to list albums by, or album to list tracks on
+     * \param after The last row of the page before, or a default row for the first page
+     * \param limit List no more than this many
+     * \returns The rows, in order; artists, albums and genres without tracks are left out */
+    virtual std::vector<BrowseEntry> Browse(BrowseLevel level, long parent, const BrowseEntry &after, size_t limit) = 0;
+
+    /** \brief List playlists
+     * \param after Only list playlists with an id above this
+     * \param limit List no more than this many
+     * \returns Their ids, in order */
+    virtual std::vector<long> FindPlaylists(long after, size_t limit) = 0;
+
+    /** \brief Reclaim the space edits have left behind
+     * \returns -1 if something goes wrong, or it can't be done right now */
+    virtual int Vacuum() = 0;
+
+    /** \brief Keep a new background job
+     * \param job The job; its id is ignored
+     * \returns ID of the job, or -1 if something goes wrong */
+    virtual long AddJob(const JobRecord &job) = 0;
+
+    /** \brief Keep where a background job is at; finished jobs are forgotten
+     * \param job The job */
+    virtual void UpdateJob(const JobRecord &job) = 0;
+
+    /** \brief Read the background jobs that haven't finished
+     * \returns The jobs, ordered by id */
+    virtual std::vector<JobRecord> LoadJobs() = 0;
+
+    /**
+     * \brief Choose where to report statements
+     * \param stats Stats to report to, or nullptr to stop reporting
+     */
+    virtual void SetStats(CStats *stats) { mStats = stats; }
+
+protected:
+    /// Where each statement is reported, or nullptr
+    CStats *mStats = nullptr;
+};
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * \file Stream.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Stream class
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <cstddef>
+#include <iterator>
+#include <memory>
+#include "Storage.h"
+
+/**
+ * \brief Rows read from the storage as they're needed, for range-for
+ *
+ *     for (const CStorage::EntryRecord &entry : library.StreamPlaylist("1"))
+ *     {
+ *         ...
+ *     }
+ *
+ * Only the row being looked at and whatever the storage reads ahead
+ * are held, however many rows there are, and the first row is there
+ * as soon as the storage has it. Nothing else may use the library or
+ * its storage until the stream is finished or destroyed; see
+ * CStorage::Cursor. It can only be walked once.
+ */
+template<typename Row>
+class CStream
+{
+public:
+
+    /// Walks the stream; every copy walks the same one
+    class Iterator
+    {
+    public:
+        typedef std::input_iterator_tag iterator_category;  ///< Can only go forward, once
+        typedef Row value_type;                             ///< What's read
+        typedef std::ptrdiff_t difference_type;             ///< Unused, but iterators need one
+        typedef const Row *pointer;                         ///< Pointer to a row
+        typedef const Row &reference;                       ///< Reference to a row
+
+        /**
+         * \brief Constructor
+         * \param stream Stream being walked, or nullptr for the end
+         */
+        Iterator(CStream *stream = nullptr) : mStream(stream) {}
+
+        /** \brief Returns the row it's on */
+        const Row &operator*() const { return mStream->mRow; }
+
+        /** \brief Returns the row it's on */
+        const Row *operator->() const { return &mStream->mRow; }
+
+        /**
+         * \brief Move on to the next row
+         * \returns This, at the end if there are no rows left
+         */
+        Iterator &operator++()
+        {
+            if (!mStream->Next(mStream->mRow))
+            {
+                mStream = nullptr;
+            }
+            return *this;
+        }
+
+        /**
+         * \brief Whether two iterators are at the same place
+         * \param iterator The other iterator
+         */
+        bool operator==(const Iterator &iterator) const { return mStream == iterator.mStream; }
+
+        /**
+         * \brief Whether two iterators are at different places
+         * \param iterator The other iterator
+         */
+        bool operator!=(const Iterator &iterator) const { return mStream != iterator.mStream; }
+
+    private:
+        CStream *mStream;   ///< Stream being walked, or nullptr at the end
+    };
+
+    /** \brief Default constructor (disabled) */
+    CStream() = delete;
+
+    /**
+     * \brief Constructor
+     * \param cursor Cursor to read from; the stream takes ownership
+     */
+    CStream(CStorage::Cursor<Row> *cursor) : mCursor(cursor) {}
+
+    /** \brief Copy constructor (disabled)
+     * \param stream Stream to construct this based on */
+    CStream(const CStream &stream) = delete;
+
+    /** \brief Move constructor
+     * \param stream Stream to take the cursor from */
+    CStream(CStream &&stream) = default;
+
+    /** \brief Assignment operator (disabled)
+     * \param stream Stream whose attributes will override those of the current stream */
+    CStream& operator=(const CStream &stream) = delete;
+
+    /** \brief Destructor; abandons whatever hasn't been read */
+    ~CStream() {}
+
+    /**
+     * \brief Read the next row, for walking the stream by hand
+     * \param row Filled in with the row
+     * \returns false once there are no rows left
+     */
+    bool Next(Row &row) { return mCursor && mCursor->Next(row); }
+
+    /**
+     * \brief Start walking the stream
+     * \returns Iterator on the first row, or at the end if there are none
+     */
+    Iterator begin()
+    {
+        Iterator first(this);
+        return ++first;
+    }
+
+    /**
+     * \brief Returns where walking the stream ends
+     * \returns Iterator at the end
+     */
+    Iterator end() { return Iterator(); }
+
+private:
+    /// Where rows come from
+    std::unique_ptr<CStorage::Cursor<Row>> mCursor;
+
+    /// Row the iterators are on
+    Row mRow;
+};
+
+#endif
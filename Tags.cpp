@@ -0,0 +1,926 @@
+/**
+ * \file Tags.cpp
+ * \author Matt Hammerly
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include "Tags.h"
+
+/// Most bytes of tag, moov atom or metadata block read
+static const size_t TAG_LIMIT = 64 << 20;
+
+/// Bytes after a tag searched for the first MPEG frame
+static const size_t MPEG_SEARCH = 4096;
+
+/// ID3v2 and FLAC picture type of a front cover
+static const int FRONT_COVER = 3;
+
+/// The ID3v1 genres, which ID3v2 and MP4 tags can refer to by number
+static const char *const GENRES[] = {
+    "Blues", "Classic Rock", "Country", "Dance", "Disco", "Funk", "Grunge", "Hip-Hop",
+    "Jazz", "Metal", "New Age", "Oldies", "Other", "Pop", "R&B", "Rap",
+    "Reggae", "Rock", "Techno", "Industrial", "Alternative", "Ska", "Death Metal", "Pranks",
+    "Soundtrack", "Euro-Techno", "Ambient", "Trip-Hop", "Vocal", "Jazz+Funk", "Fusion", "Trance",
+    "Classical", "Instrumental", "Acid", "House", "Game", "Sound Clip", "Gospel", "Noise",
+    "AlternRock", "Bass", "Soul", "Punk", "Space", "Meditative", "Instrumental Pop", "Instrumental Rock",
+    "Ethnic", "Gothic", "Darkwave", "Techno-Industrial", "Electronic", "Pop-Folk", "Eurodance", "Dream",
+    "Southern Rock", "Comedy", "Cult", "Gangsta", "Top 40", "Christian Rap", "Pop/Funk", "Jungle",
+    "Native American", "Cabaret", "New Wave", "Psychadelic", "Rave", "Showtunes", "Trailer", "Lo-Fi",
+    "Tribal", "Acid Punk", "Acid Jazz", "Polka", "Retro", "Musical", "Rock & Roll", "Hard Rock"
+};
+
+/// Number of ID3v1 genres
+static const int GENRE_COUNT = sizeof(GENRES) / sizeof(GENRES[0]);
+
+/// MPEG audio bitrates in kbps, by MPEG-1 or not, layer and index
+static const int MPEG_BITRATES[2][3][15] = {
+    {
+        {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+        {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320}
+    },
+    {
+        {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+        {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160}
+    }
+};
+
+/// MPEG-1 sample rates, by index; MPEG-2 halves them and MPEG-2.5 quarters them
+static const int MPEG_RATES[3] = {44100, 48000, 32000};
+
+/**
+ * \brief Read a big-endian integer out of a buffer
+ * \param p Where it starts
+ * \param bytes How many bytes it is
+ */
+static uint64_t Big(const unsigned char *p, int bytes)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; ++i)
+    {
+        value = value << 8 | p[i];
+    }
+    return value;
+}
+
+/**
+ * \brief Read a little-endian 32-bit integer out of a buffer
+ * \param p Where its four bytes start
+ */
+static uint32_t Little(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/**
+ * \brief Read an ID3v2 "syncsafe" integer, 7 bits to a byte
+ * \param p Where its four bytes start
+ */
+static uint32_t Syncsafe(const unsigned char *p)
+{
+    return (p[0] & 0x7f) << 21 | (p[1] & 0x7f) << 14 | (p[2] & 0x7f) << 7 | (p[3] & 0x7f);
+}
+
+/**
+ * \brief Undo ID3v2 unsynchronisation, which puts a 0 after every 0xff
+ * \param data The unsynchronised bytes
+ * \returns The bytes as they were
+ */
+static std::string Resync(const std::string &data)
+{
+    std::string out;
+    out.reserve(data.size());
+    for (size_t i = 0; i < data.size(); ++i)
+    {
+        out.push_back(data[i]);
+        if ((unsigned char)data[i] == 0xff && i + 1 < data.size() && data[i + 1] == 0)
+        {
+            ++i;
+        }
+    }
+    return out;
+}
+
+/**
+ * \brief Append a character to a string as UTF-8
+ * \param out String to append to
+ * \param c The character
+ */
+static void PutUtf8(std::string &out, uint32_t c)
+{
+    if (c < 0x80)
+    {
+        out.push_back(c);
+    }
+    else if (c < 0x800)
+    {
+        out.push_back(0xc0 | c >> 6);
+        out.push_back(0x80 | (c & 0x3f));
+    }
+    else if (c < 0x10000)
+    {
+        out.push_back(0xe0 | c >> 12);
+        out.push_back(0x80 | (c >> 6 & 0x3f));
+        out.push_back(0x80 | (c & 0x3f));
+    }
+    else
+    {
+        out.push_back(0xf0 | c >> 18);
+        out.push_back(0x80 | (c >> 12 & 0x3f));
+        out.push_back(0x80 | (c >> 6 & 0x3f));
+        out.push_back(0x80 | (c & 0x3f));
+    }
+}
+
+/**
+ * \brief Turn the text of an ID3v2 frame into UTF-8
+ * \param body The frame, past its header
+ * \param begin Where the text starts, past the encoding byte
+ * \param encoding 0 for ISO-8859-1, 1 for UTF-16 with a byte order mark, 2 for UTF-16BE, 3 for UTF-8
+ * \returns The first of its values; ID3v2.4 puts a 0 between several
+ */
+static std::string DecodeText(const std::string &body, size_t begin, int encoding)
+{
+    std::string text;
+    const unsigned char *bytes = (const unsigned char *)body.data();
+
+    if (encoding == 1 || encoding == 2)
+    {
+        bool little = false;
+        if (encoding == 1 && begin + 1 < body.size())
+        {
+            if (bytes[begin] == 0xff && bytes[begin + 1] == 0xfe)
+            {
+                little = true;
+                begin += 2;
+            }
+            else if (bytes[begin] == 0xfe && bytes[begin + 1] == 0xff)
+            {
+                begin += 2;
+            }
+        }
+
+        auto unit = [&](size_t p) -> uint32_t
+        {
+            return little ? bytes[p] | bytes[p + 1] << 8 : bytes[p] << 8 | bytes[p + 1];
+        };
+        for (size_t p = begin; p + 1 < body.size(); p += 2)
+        {
+            uint32_t c = unit(p);
+            if (c == 0)
+            {
+                break;
+            }
+            if (c >= 0xd800 && c < 0xdc00 && p + 3 < body.size() && unit(p + 2) >= 0xdc00 && unit(p + 2) < 0xe000)
+            {
+                c = 0x10000 + ((c - 0xd800) << 10) + (unit(p + 2) - 0xdc00);
+                p += 2;
+            }
+            PutUtf8(text, c);
+        }
+        return text;
+    }
+
+    size_t end = body.find('\0', begin);
+    end = end == std::string::npos ? body.size() : end;
+    if (encoding == 3)
+    {
+        return body.substr(begin, end - begin);
+    }
+    for (size_t p = begin; p < end; ++p)
+    {
+        PutUtf8(text, bytes[p]);
+    }
+    return text;
+}
+
+/**
+ * \brief Whether a string is a number and nothing else
+ * \param text The string
+ */
+static bool IsNumber(const std::string &text)
+{
+    return !text.empty() && std::all_of(text.begin(), text.end(), [](char c) { return isdigit((unsigned char)c); });
+}
+
+/**
+ * \brief Make sense of an ID3 genre
+ * \param genre As it was in the tag: a name, an ID3v1 genre number, or
+ *              numbers in brackets like "(17)" before an optional name
+ * \returns The name, or "" if there isn't one
+ */
+static std::string GenreName(const std::string &genre)
+{
+    int number = -1;
+    size_t p = 0;
+    while (p < genre.size() && genre[p] == '(')
+    {
+        size_t close = genre.find(')', p);
+        if (close == std::string::npos || !IsNumber(genre.substr(p + 1, close - p - 1)))
+        {
+            break;
+        }
+        if (number < 0)
+        {
+            number = atoi(genre.c_str() + p + 1);
+        }
+        p = close + 1;
+    }
+
+    std::string name = genre.substr(p);
+    if (IsNumber(name))
+    {
+        number = atoi(name.c_str());
+        name.clear();
+    }
+    if (name.empty() && number >= 0 && number < GENRE_COUNT)
+    {
+        name = GENRES[number];
+    }
+    return name;
+}
+
+/**
+ * \brief Pull the image out of an APIC or PIC frame
+ * \param body The frame, past its header
+ * \param pic Whether it's ID3v2.2's PIC, with a three letter format instead of a MIME type
+ * \param type Filled in with the picture type
+ * \param image Filled in with the image
+ * \returns -1 if the frame is cut short
+ */
+static int ReadPicture(const std::string &body, bool pic, int &type, std::string &image)
+{
+    if (body.size() < 2)
+    {
+        return -1;
+    }
+    int encoding = body[0];
+
+    size_t p = 1;
+    if (pic)
+    {
+        p += 3;
+    }
+    else
+    {
+        p = body.find('\0', p);
+        if (p == std::string::npos)
+        {
+            return -1;
+        }
+        ++p;
+    }
+    if (p >= body.size())
+    {
+        return -1;
+    }
+    type = (unsigned char)body[p++];
+
+    // The description ends with a 0 as wide as its characters
+    if (encoding == 1 || encoding == 2)
+    {
+        while (p + 1 < body.size() && (body[p] != 0 || body[p + 1] != 0))
+        {
+            p += 2;
+        }
+        p += 2;
+    }
+    else
+    {
+        p = body.find('\0', p);
+        p = p == std::string::npos ? body.size() : p + 1;
+    }
+    if (p >= body.size())
+    {
+        return -1;
+    }
+
+    image = body.substr(p);
+    return 0;
+}
+
+/**
+ * \brief Find a child atom in an MP4 atom's body
+ * \param data Where the body is
+ * \param begin Where to start looking
+ * \param end Where the body ends
+ * \param type The four letter type wanted
+ * \param child Filled in with where the child's body starts
+ * \param childEnd Filled in with where it ends
+ * \returns Whether there is one
+ */
+static bool FindAtom(const std::string &data, size_t begin, size_t end, const char *type,
+                     size_t &child, size_t &childEnd)
+{
+    const unsigned char *bytes = (const unsigned char *)data.data();
+    while (begin + 8 <= end)
+    {
+        uint64_t size = Big(bytes + begin, 4);
+        size_t headerBytes = 8;
+        if (size == 1 && begin + 16 <= end)
+        {
+            size = Big(bytes + begin + 8, 8);
+            headerBytes = 16;
+        }
+        else if (size == 0)
+        {
+            size = end - begin;
+        }
+        if (size < headerBytes || size > end - begin)
+        {
+            return false;
+        }
+
+        if (memcmp(bytes + begin + 4, type, 4) == 0)
+        {
+            child = begin + headerBytes;
+            childEnd = begin + size;
+            return true;
+        }
+        begin += size;
+    }
+    return false;
+}
+
+/**
+ * \brief Read a file's tags
+ * \param path Where the file is
+ * \param picture Whether to keep the cover too; the front cover is
+ *                preferred where a file has several pictures
+ * \returns -1 if the file can't be read or isn't a kind read here
+ *
+ * Whatever was read before is forgotten first. A file of a kind read
+ * here with no tags is fine; everything is just left empty.
+ */
+int CTags::Read(const std::string &path, bool picture)
+{
+    Clear();
+
+    FILE *file = fopen(path.c_str(), "rb");
+    if (!file)
+    {
+        return -1;
+    }
+    struct stat info;
+    off_t size = fstat(fileno(file), &info) == 0 ? info.st_size : 0;
+
+    int result = -1;
+    off_t offset = 0;
+    unsigned char header[16];
+    if (fread(header, 1, 10, file) != 10)
+    {
+        fclose(file);
+        return -1;
+    }
+
+    // An ID3v2 tag can go in front of anything
+    if (memcmp(header, "ID3", 3) == 0)
+    {
+        size_t tagBytes = Syncsafe(header + 6);
+        std::string tag(std::min(tagBytes, TAG_LIMIT), '\0');
+        if (fread(&tag[0], 1, tag.size(), file) == tag.size())
+        {
+            result = ReadId3(tag, header[3], header[5], picture);
+        }
+
+        offset = 10 + tagBytes + (header[3] == 4 && (header[5] & 0x10) ? 10 : 0);
+        if (fseeko(file, offset, SEEK_SET) != 0 || fread(header, 1, 10, file) != 10)
+        {
+            fclose(file);
+            return result;
+        }
+    }
+
+    if (memcmp(header, "fLaC", 4) == 0)
+    {
+        result = ReadFlac(file, offset + 4, picture);
+    }
+    else if (memcmp(header + 4, "ftyp", 4) == 0)
+    {
+        // Walk the top-level atoms, reading only moov
+        while (fseeko(file, offset, SEEK_SET) == 0 && fread(header, 1, 8, file) == 8)
+        {
+            uint64_t atomBytes = Big(header, 4);
+            size_t headerBytes = 8;
+            if (atomBytes == 1)
+            {
+                if (fread(header + 8, 1, 8, file) != 8)
+                {
+                    break;
+                }
+                atomBytes = Big(header + 8, 8);
+                headerBytes = 16;
+            }
+            if (atomBytes < headerBytes && atomBytes != 0)
+            {
+                break;
+            }
+
+            if (memcmp(header + 4, "moov", 4) == 0)
+            {
+                std::string moov(atomBytes ? std::min(atomBytes - headerBytes, (uint64_t)TAG_LIMIT) : TAG_LIMIT, '\0');
+                moov.resize(fread(&moov[0], 1, moov.size(), file));
+                result = ReadMoov(moov, picture);
+                break;
+            }
+            if (atomBytes == 0)
+            {
+                break;
+            }
+            offset += atomBytes;
+        }
+    }
+    else if (ReadMpeg(file, offset, size) == 0)
+    {
+        result = 0;
+    }
+
+    fclose(file);
+    return result;
+}
+
+/**
+ * \brief Forget everything read
+ */
+void CTags::Clear()
+{
+    mTitle.clear();
+    mArtist.clear();
+    mAlbumArtist.clear();
+    mAlbum.clear();
+    mGenre.clear();
+    mNumber = 0;
+    mDuration = 0;
+    mPicture.clear();
+}
+
+/**
+ * \brief Read the tags of tracks, to be kept with CStorage::SaveTags()
+ * \param tracks The tracks
+ * \returns What each one's tags say, in the same order
+ *
+ * Tracks whose files can't be read come back with everything empty,
+ * so they're kept as read and aren't tried again. The album is filed
+ * under the album artist where there is one. The size of each file is
+ * taken while it's there.
+ */
+std::vector<CStorage::TrackTags> CTags::ReadTracks(const std::vector<CStorage::TrackRecord> &tracks)
+{
+    std::vector<CStorage::TrackTags> read;
+    read.reserve(tracks.size());
+
+    CTags tags;
+    for (const CStorage::TrackRecord &track : tracks)
+    {
+        tags.Read(track.filepath);
+
+        CStorage::TrackTags record;
+        record.track = track.id;
+        record.title = tags.GetTitle();
+        record.artist = tags.GetAlbumArtist().empty() ? tags.GetArtist() : tags.GetAlbumArtist();
+        record.album = tags.GetAlbum();
+        record.genre = tags.GetGenre();
+        record.number = tags.GetNumber();
+        record.duration = tags.GetDuration();
+        struct stat info;
+        if (stat(track.filepath.c_str(), &info) == 0)
+        {
+            record.bytes = info.st_size;
+        }
+        read.push_back(record);
+    }
+
+    return read;
+}
+
+/**
+ * \brief Read the frames of an ID3v2 tag
+ * \param tag The tag, past its ten byte header
+ * \param version Its major version, 2 to 4
+ * \param flags Its header flags
+ * \param picture Whether to keep the cover
+ * \returns -1 if it's a version that isn't read here
+ */
+int CTags::ReadId3(std::string tag, int version, int flags, bool picture)
+{
+    if (version < 2 || version > 4)
+    {
+        return -1;
+    }
+    if ((flags & 0x80) && version < 4)
+    {
+        tag = Resync(tag);
+    }
+
+    size_t p = 0;
+    if ((flags & 0x40) && version >= 3 && tag.size() >= 4)
+    {
+        const unsigned char *ext = (const unsigned char *)tag.data();
+        p = version == 3 ? Big(ext, 4) + 4 : Syncsafe(ext);
+    }
+
+    size_t headerBytes = version == 2 ? 6 : 10;
+    bool cover = false;
+    while (p + headerBytes <= tag.size())
+    {
+        const unsigned char *frame = (const unsigned char *)tag.data() + p;
+        if (frame[0] == 0)
+        {
+            break;  // Padding
+        }
+
+        size_t size = version == 2 ? Big(frame + 3, 3) : version == 3 ? Big(frame + 4, 4) : Syncsafe(frame + 4);
+        if (size > tag.size() - p - headerBytes)
+        {
+            break;
+        }
+        int frameFlags = version == 2 ? 0 : frame[9];
+        size_t at = p + headerBytes;
+        p += headerBytes + size;
+
+        // Each frame wanted, by its ID3v2.3 name and its ID3v2.2 one
+        auto is = [&](const char *id, const char *id22)
+        {
+            return version == 2 ? memcmp(frame, id22, 3) == 0 : memcmp(frame, id, 4) == 0;
+        };
+        std::string *text = is("TIT2", "TT2") ? &mTitle :
+                            is("TPE1", "TP1") ? &mArtist :
+                            is("TPE2", "TP2") ? &mAlbumArtist :
+                            is("TALB", "TAL") ? &mAlbum :
+                            is("TCON", "TCO") ? &mGenre : nullptr;
+        bool number = is("TRCK", "TRK");
+        bool length = is("TLEN", "TLE");
+        bool pic = is("APIC", "PIC");
+        if (!text && !number && !length && !(pic && picture && !cover))
+        {
+            continue;
+        }
+
+        std::string body = tag.substr(at, size);
+        if (version == 3)
+        {
+            if (frameFlags & 0xc0)
+            {
+                continue;   // Compressed or encrypted
+            }
+            if (frameFlags & 0x20)
+            {
+                body.erase(0, 1);   // Group id
+            }
+        }
+        else if (version == 4)
+        {
+            if (frameFlags & 0x0c)
+            {
+                continue;   // Compressed or encrypted
+            }
+            if (frameFlags & 0x40)
+            {
+                body.erase(0, 1);   // Group id
+            }
+            if (frameFlags & 0x02)
+            {
+                body = Resync(body);
+            }
+            if (frameFlags & 0x01)
+            {
+                body.erase(0, 4);   // Data length
+            }
+        }
+
+        if (pic)
+        {
+            int type = 0;
+            std::string image;
+            if (ReadPicture(body, version == 2, type, image) != 0 || image.empty())
+            {
+                continue;
+            }
+            if (type == FRONT_COVER || mPicture.empty())
+            {
+                mPicture.swap(image);
+                cover = type == FRONT_COVER;
+            }
+            continue;
+        }
+
+        if (body.empty())
+        {
+            continue;
+        }
+        std::string value = DecodeText(body, 1, body[0]);
+        if (text == &mGenre)
+        {
+            mGenre = GenreName(value);
+        }
+        else if (text)
+        {
+            *text = value;
+        }
+        else if (number)
+        {
+            mNumber = atoi(value.c_str());     // "3/12" is track 3
+        }
+        else if (length)
+        {
+            mDuration = atof(value.c_str()) / 1000;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Read the tags in an MP4 moov atom
+ * \param moov The atom's body
+ * \param picture Whether to keep the first covr image
+ * \returns 0, since a file with no tags is still an MP4
+ *
+ * The length is in mvhd. The tags are each at udta/meta/ilst/<name>/data,
+ * with meta sometimes straight under moov. meta has four bytes of
+ * version and flags before its children, and data eight bytes of type
+ * and locale before the value.
+ */
+int CTags::ReadMoov(const std::string &moov, bool picture)
+{
+    const unsigned char *bytes = (const unsigned char *)moov.data();
+
+    size_t mvhd, mvhdEnd;
+    if (FindAtom(moov, 0, moov.size(), "mvhd", mvhd, mvhdEnd) && mvhdEnd - mvhd >= 20)
+    {
+        // Version 1 has 64-bit times and duration
+        bool wide = bytes[mvhd] == 1;
+        size_t scale = mvhd + (wide ? 20 : 12);
+        if (scale + (wide ? 12 : 8) <= mvhdEnd)
+        {
+            uint64_t timescale = Big(bytes + scale, 4);
+            uint64_t duration = Big(bytes + scale + 4, wide ? 8 : 4);
+            mDuration = timescale ? (double)duration / timescale : 0;
+        }
+    }
+
+    size_t begin = 0, end = moov.size();
+    size_t udta, udtaEnd;
+    if (FindAtom(moov, 0, moov.size(), "udta", udta, udtaEnd))
+    {
+        begin = udta;
+        end = udtaEnd;
+    }
+
+    size_t meta, metaEnd, ilst, ilstEnd;
+    if ((!FindAtom(moov, begin, end, "meta", meta, metaEnd) &&
+         !FindAtom(moov, 0, moov.size(), "meta", meta, metaEnd)) ||
+        !FindAtom(moov, meta + 4, metaEnd, "ilst", ilst, ilstEnd))
+    {
+        return 0;
+    }
+
+    // Finds an item and the bounds of its value
+    size_t data, dataEnd;
+    auto item = [&](const char *name) -> bool
+    {
+        size_t found, foundEnd;
+        return FindAtom(moov, ilst, ilstEnd, name, found, foundEnd) &&
+               FindAtom(moov, found, foundEnd, "data", data, dataEnd) && dataEnd - data > 8;
+    };
+    auto text = [&](const char *name, std::string &value)
+    {
+        if (item(name))
+        {
+            value = moov.substr(data + 8, dataEnd - data - 8);
+        }
+    };
+
+    text("\xa9nam", mTitle);
+    text("\xa9" "ART", mArtist);
+    text("aART", mAlbumArtist);
+    text("\xa9" "alb", mAlbum);
+    text("\xa9gen", mGenre);
+    if (mGenre.empty() && item("gnre") && dataEnd - data >= 10)
+    {
+        // The ID3v1 number, plus one
+        int number = Big(bytes + data + 8, 2) - 1;
+        if (number >= 0 && number < GENRE_COUNT)
+        {
+            mGenre = GENRES[number];
+        }
+    }
+    if (item("trkn") && dataEnd - data >= 12)
+    {
+        mNumber = Big(bytes + data + 10, 2);
+    }
+    if (picture)
+    {
+        text("covr", mPicture);
+    }
+
+    return 0;
+}
+
+/**
+ * \brief Read the metadata blocks of a FLAC file
+ * \param file The file
+ * \param offset Where the first block starts, past "fLaC"
+ * \param picture Whether to keep the cover
+ * \returns -1 if the blocks are cut short before STREAMINFO
+ */
+int CTags::ReadFlac(FILE *file, off_t offset, bool picture)
+{
+    bool info = false;
+    bool cover = false;
+    unsigned char header[4];
+    while (fseeko(file, offset, SEEK_SET) == 0 && fread(header, 1, 4, file) == 4)
+    {
+        bool last = header[0] & 0x80;
+        int type = header[0] & 0x7f;
+        size_t size = Big(header + 1, 3);
+        offset += 4 + size;
+
+        bool wanted = type == 0 || type == 4 || (type == 6 && picture && !cover);
+        if (wanted && size <= TAG_LIMIT)
+        {
+            std::string block(size, '\0');
+            if (fread(&block[0], 1, size, file) != size)
+            {
+                break;
+            }
+            const unsigned char *bytes = (const unsigned char *)block.data();
+
+            if (type == 0 && size >= 18)
+            {
+                // STREAMINFO: 20 bits of sample rate, then 36 bits of samples past the rate's byte
+                uint64_t rate = Big(bytes + 10, 3) >> 4;
+                uint64_t samples = (uint64_t)(bytes[13] & 0x0f) << 32 | Big(bytes + 14, 4);
+                mDuration = rate ? (double)samples / rate : 0;
+                info = true;
+            }
+            else if (type == 4)
+            {
+                ReadVorbisComments(block);
+            }
+            else if (type == 6 && size >= 8)
+            {
+                // PICTURE: type, MIME type, description, four sizes, then the image
+                int pictureType = Big(bytes, 4);
+                size_t p = 4;
+                for (int skip = 0; skip < 2 && p + 4 <= size; ++skip)
+                {
+                    p += 4 + Big(bytes + p, 4);
+                }
+                p += 16;
+                if (p + 4 <= size && Big(bytes + p, 4) <= size - p - 4)
+                {
+                    if (pictureType == FRONT_COVER || mPicture.empty())
+                    {
+                        mPicture = block.substr(p + 4, Big(bytes + p, 4));
+                        cover = pictureType == FRONT_COVER;
+                    }
+                }
+            }
+        }
+
+        if (last)
+        {
+            break;
+        }
+    }
+
+    return info ? 0 : -1;
+}
+
+/**
+ * \brief Read a block of Vorbis comments, as FLAC keeps them
+ * \param block The block: a vendor string, then a count of NAME=value
+ *              strings, all with little-endian 32-bit lengths
+ *
+ * Names are matched whatever their case, and only the first of each is kept.
+ */
+void CTags::ReadVorbisComments(const std::string &block)
+{
+    const unsigned char *bytes = (const unsigned char *)block.data();
+    size_t size = block.size();
+    if (size < 8)
+    {
+        return;
+    }
+
+    size_t p = 4 + (size_t)Little(bytes);
+    if (p + 4 > size)
+    {
+        return;
+    }
+    uint32_t count = Little(bytes + p);
+    p += 4;
+
+    for (uint32_t i = 0; i < count && p + 4 <= size; ++i)
+    {
+        size_t length = Little(bytes + p);
+        p += 4;
+        if (length > size - p)
+        {
+            break;
+        }
+        std::string comment = block.substr(p, length);
+        p += length;
+
+        size_t equals = comment.find('=');
+        if (equals == std::string::npos)
+        {
+            continue;
+        }
+        std::string name = comment.substr(0, equals);
+        std::transform(name.begin(), name.end(), name.begin(), [](char c) { return toupper((unsigned char)c); });
+        std::string value = comment.substr(equals + 1);
+
+        std::string *field = name == "TITLE" ? &mTitle :
+                             name == "ARTIST" ? &mArtist :
+                             name == "ALBUMARTIST" || name == "ALBUM ARTIST" ? &mAlbumArtist :
+                             name == "ALBUM" ? &mAlbum :
+                             name == "GENRE" ? &mGenre : nullptr;
+        if (field && field->empty())
+        {
+            *field = value;
+        }
+        else if (name == "TRACKNUMBER" && mNumber == 0)
+        {
+            mNumber = atoi(value.c_str());
+        }
+    }
+}
+
+/**
+ * \brief Work out an MP3's length from its first frame, unless a tag already said
+ * \param file The file
+ * \param offset Where the audio starts, past any ID3v2 tag
+ * \param size Size of the whole file
+ * \returns -1 if there's no MPEG audio frame near the start
+ *
+ * A VBR file has a Xing or Info header in its first frame with the
+ * number of frames; otherwise the bitrate is taken to hold throughout.
+ */
+int CTags::ReadMpeg(FILE *file, off_t offset, off_t size)
+{
+    unsigned char buffer[MPEG_SEARCH];
+    if (fseeko(file, offset, SEEK_SET) != 0)
+    {
+        return -1;
+    }
+    size_t read = fread(buffer, 1, sizeof(buffer), file);
+
+    for (size_t i = 0; i + 4 <= read; ++i)
+    {
+        const unsigned char *h = buffer + i;
+        if (h[0] != 0xff || (h[1] & 0xe0) != 0xe0)
+        {
+            continue;
+        }
+
+        int version = h[1] >> 3 & 3;    // 0 for 2.5, 2 for 2, 3 for 1
+        int layer = 4 - (h[1] >> 1 & 3);
+        int bitrateIndex = h[2] >> 4;
+        int rateIndex = h[2] >> 2 & 3;
+        if (version == 1 || layer == 4 || bitrateIndex == 0 || bitrateIndex == 15 || rateIndex == 3)
+        {
+            continue;
+        }
+
+        bool mpeg1 = version == 3;
+        bool mono = (h[3] >> 6) == 3;
+        int rate = MPEG_RATES[rateIndex] >> (mpeg1 ? 0 : version == 2 ? 1 : 2);
+        int samples = layer == 1 ? 384 : layer == 3 && !mpeg1 ? 576 : 1152;
+        int bitrate = MPEG_BITRATES[mpeg1 ? 0 : 1][layer - 1][bitrateIndex] * 1000;
+
+        // Anything can have 0xffe in it; a real frame has another straight after it
+        int padding = h[2] >> 1 & 1;
+        size_t frameBytes = layer == 1 ? (12 * bitrate / rate + padding) * 4 : samples / 8 * bitrate / rate + padding;
+        if (i + frameBytes + 2 <= read && (buffer[i + frameBytes] != 0xff || (buffer[i + frameBytes + 1] & 0xe0) != 0xe0))
+        {
+            continue;
+        }
+
+        if (mDuration > 0)
+        {
+            return 0;
+        }
+
+        size_t xing = i + 4 + (mpeg1 ? (mono ? 17 : 32) : (mono ? 9 : 17));
+        if (xing + 12 <= read && (memcmp(buffer + xing, "Xing", 4) == 0 || memcmp(buffer + xing, "Info", 4) == 0) &&
+            (Big(buffer + xing + 4, 4) & 1))
+        {
+            mDuration = (double)Big(buffer + xing + 8, 4) * samples / rate;
+        }
+        else if (size > offset + (off_t)i)
+        {
+            mDuration = (double)(size - offset - i) * 8 / bitrate;
+        }
+        return 0;
+    }
+
+    return -1;
+}
@@ -0,0 +1,97 @@
+/**
+ * \file Tags.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Tags class
+ */
+
+#ifndef TAGS_H
+#define TAGS_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "Storage.h"
+
+/**
+ * \brief What an audio file's tags say about it
+ *
+ * Reads ID3v2 frames at the start of MP3s and friends (ID3v2.2 to
+ * 2.4), the ilst atom of MP4/M4A files, and the Vorbis comments and
+ * pictures of FLAC files. Only the tags and headers are read, never
+ * the audio, so it's cheap enough to run over a whole library.
+ *
+ * The length comes from the header where that's cheap: STREAMINFO in
+ * FLAC, mvhd in MP4, and TLEN, the Xing header or the bitrate of the
+ * first frame in MP3. Anything the tags don't say is left empty, or 0.
+ */
+class CTags
+{
+public:
+
+    /** \brief Constructor */
+    CTags() { Clear(); }
+
+    /** \brief Copy constructor (disabled)
+     * \param tags Tags to construct this based on */
+    CTags(const CTags &tags) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param tags Tags whose attributes will override those of the current tags */
+    CTags& operator=(const CTags &tags) = delete;
+
+    int Read(const std::string &path, bool picture = false);
+
+    void Clear();
+
+    /** \brief Returns the title
+     * \returns Title, or "" */
+    const std::string &GetTitle() const { return mTitle; }
+
+    /** \brief Returns who the track is by
+     * \returns Artist, or "" */
+    const std::string &GetArtist() const { return mArtist; }
+
+    /** \brief Returns who the album is by, where that's different from the artist
+     * \returns Album artist, or "" */
+    const std::string &GetAlbumArtist() const { return mAlbumArtist; }
+
+    /** \brief Returns the album
+     * \returns Album title, or "" */
+    const std::string &GetAlbum() const { return mAlbum; }
+
+    /** \brief Returns the genre, with ID3v1 genre numbers turned into names
+     * \returns Genre, or "" */
+    const std::string &GetGenre() const { return mGenre; }
+
+    /** \brief Returns where the track is on its album
+     * \returns Track number, or 0 */
+    int GetNumber() const { return mNumber; }
+
+    /** \brief Returns how long the track is
+     * \returns Length in seconds, or 0 if the headers don't say */
+    double GetDuration() const { return mDuration; }
+
+    /** \brief Returns the cover, if it was asked for
+     * \returns Image as it was embedded, or "" */
+    const std::string &GetPicture() const { return mPicture; }
+
+    static std::vector<CStorage::TrackTags> ReadTracks(const std::vector<CStorage::TrackRecord> &tracks);
+
+private:
+    int ReadId3(std::string tag, int version, int flags, bool picture);
+    int ReadMoov(const std::string &moov, bool picture);
+    int ReadFlac(FILE *file, off_t offset, bool picture);
+    void ReadVorbisComments(const std::string &block);
+    int ReadMpeg(FILE *file, off_t offset, off_t size);
+
+    std::string mTitle;         ///< Title
+    std::string mArtist;        ///< Who the track is by
+    std::string mAlbumArtist;   ///< Who the album is by
+    std::string mAlbum;         ///< Album title
+    std::string mGenre;         ///< Genre
+    int mNumber;                ///< Track number, or 0
+    double mDuration;           ///< Length in seconds, or 0
+    std::string mPicture;       ///< The cover, if it was asked for
+};
+
+#endif
@@ -0,0 +1,201 @@
+/**
+ * \file Task.h
+ * \author Matt Hammerly
+ * \brief Contains the definition of the Task class template
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+/**
+ * \brief Where a task keeps what it co_returns
+ */
+template <typename T>
+struct TaskResult
+{
+    T value{};      ///< What was co_returned
+
+    /**
+     * \brief Keep what was co_returned
+     * \param result The result
+     */
+    template <typename U>
+    void return_value(U &&result) { value = std::forward<U>(result); }
+
+    /**
+     * \brief Hand the result over
+     * \returns The result
+     */
+    T Take() { return std::move(value); }
+};
+
+/**
+ * \brief Where a task that returns nothing keeps it
+ */
+template <>
+struct TaskResult<void>
+{
+    /** \brief Note that the task returned */
+    void return_void() {}
+
+    /** \brief Hand the result over */
+    void Take() {}
+};
+
+/**
+ * \brief A coroutine that yields a T when it's co_awaited
+ *
+ * A task doesn't start until it's co_awaited, or handed to a CReactor
+ * to Run() or Spawn(). Whatever awaits it is carried on straight from
+ * where the task finishes, so chains of tasks don't pile up on the
+ * stack. Nothing here involves threads; a task and everything it
+ * awaits run on the thread that resumes them.
+ *
+ * A task can only be awaited once, and has to outlive any coroutine it
+ * is running.
+ */
+template <typename T = void>
+class CTask
+{
+public:
+
+    struct promise_type;
+
+    /// Handle of the coroutine a task runs
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    /// Carries on whatever was awaiting the task, once it's finished
+    struct FinalAwaiter
+    {
+        /** \brief Always suspend, so the result can be read */
+        bool await_ready() noexcept { return false; }
+
+        /**
+         * \brief Pick what runs next
+         * \param task The task that just finished
+         * \returns Whatever was awaiting it, if anything
+         */
+        std::coroutine_handle<> await_suspend(Handle task) noexcept
+        {
+            std::coroutine_handle<> continuation = task.promise().continuation;
+            return continuation ? continuation : std::noop_coroutine();
+        }
+
+        /** \brief Never resumed */
+        void await_resume() noexcept {}
+    };
+
+    /// What the compiler builds a task's coroutine around
+    struct promise_type : TaskResult<T>
+    {
+        /// What's awaiting the task, if anything
+        std::coroutine_handle<> continuation;
+
+        /** \brief Make the task the coroutine returns */
+        CTask get_return_object() { return CTask(Handle::from_promise(*this)); }
+
+        /** \brief Don't start until awaited */
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        /** \brief Carry on whatever was awaiting */
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        /** \brief Nothing here throws; if something does, there's no one to catch it */
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    /** \brief Constructor, for a task with no coroutine */
+    CTask() {}
+
+    /**
+     * \brief Constructor
+     * \param handle The coroutine the task runs
+     */
+    explicit CTask(Handle handle) : mHandle(handle) {}
+
+    /** \brief Copy constructor (disabled)
+     * \param task Task to construct this based on */
+    CTask(const CTask &task) = delete;
+
+    /** \brief Assignment operator (disabled)
+     * \param task Task whose attributes will override those of the current task */
+    CTask& operator=(const CTask &task) = delete;
+
+    /**
+     * \brief Move constructor
+     * \param task Task to take the coroutine of
+     */
+    CTask(CTask &&task) noexcept : mHandle(std::exchange(task.mHandle, nullptr)) {}
+
+    /**
+     * \brief Move assignment operator
+     * \param task Task to take the coroutine of
+     * \returns This task
+     */
+    CTask& operator=(CTask &&task) noexcept
+    {
+        if (this != &task)
+        {
+            if (mHandle)
+            {
+                mHandle.destroy();
+            }
+            mHandle = std::exchange(task.mHandle, nullptr);
+        }
+        return *this;
+    }
+
+    /** \brief Destructor; destroys the coroutine, finished or not */
+    ~CTask()
+    {
+        if (mHandle)
+        {
+            mHandle.destroy();
+        }
+    }
+
+    /**
+     * \brief Whether the task has finished
+     * \returns true once it has co_returned
+     */
+    bool IsDone() { return !mHandle || mHandle.done(); }
+
+    /** \brief Start the task without awaiting it; see CReactor::Spawn() */
+    void Start() { mHandle.resume(); }
+
+    /**
+     * \brief Take the result of a finished task
+     * \returns What it co_returned
+     */
+    T Result() { return mHandle.promise().Take(); }
+
+    /** \brief Never ready before it's started */
+    bool await_ready() { return IsDone(); }
+
+    /**
+     * \brief Start the task, to carry on the awaiting coroutine when it's done
+     * \param caller The awaiting coroutine
+     * \returns The task's coroutine, to run now
+     */
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> caller)
+    {
+        mHandle.promise().continuation = caller;
+        return mHandle;
+    }
+
+    /**
+     * \brief Hand the result to the awaiting coroutine
+     * \returns What the task co_returned
+     */
+    T await_resume() { return Result(); }
+
+private:
+    /// The coroutine, or nullptr
+    Handle mHandle;
+};
+
+#endif
@@ -0,0 +1,457 @@
+/**
+ * \file bench.cpp
+ * \author Matt Hammerly
+ * \brief This file contains int main() for timing library and playlist operations
+ *
+ * Seeds a library of each requested size, times each operation a number
+ * of times, and writes throughput and latency percentiles out as JSON so
+ * runs from different commits can be compared.
+ *
+ *     bench [--tracks 10000,100000] [--playlists 10,1000] [--samples 200]
+ *           [--conninfo "host=/tmp port=5499 dbname=bench"] [--local FILE]
+ *           [--set history.batch=2048 ...] [--label NAME] [--out FILE]
+ *
+ * The database is destroyed and recreated for every library size, so
+ * point it at a throwaway Postgres rather than the usual one:
+ *
+ *     initdb -D /tmp/bench_pg
+ *     pg_ctl -D /tmp/bench_pg -o "-k /tmp -p 5499 -c listen_addresses=''" start
+ *     createdb -h /tmp -p 5499 bench
+ *     bench --conninfo "host=/tmp port=5499 dbname=bench" --out bench_output.txt
+ *     pg_ctl -D /tmp/bench_pg stop
+ *
+ * --local runs against a library file instead, with no server at all.
+ *
+ * Settings start out as the program's usual ones (see CConfig) and
+ * --set overrides them, so a knob can be swept by running once per
+ * value. The tuning settings a run used go in its JSON.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "Config.h"
+#include "Library.h"
+#include "LocalStorage.h"
+#include "Playlist.h"
+#include "PostgresStorage.h"
+
+using std::cerr; using std::endl;
+
+/// How many tracks to seed at a time
+static const size_t SEED_CHUNK = 10000;
+
+/// What the benchmark was asked to do
+struct Options
+{
+    std::vector<long> tracks = {10000};         ///< Library sizes to seed
+    std::vector<long> playlists = {10, 1000};   ///< Playlist sizes to seed
+    int samples = 200;                          ///< Timed calls per operation
+    CConfig config = CConfig::Startup();        ///< Settings, including which Postgres to use
+    std::string local;                          ///< Library file to use instead of Postgres
+    std::string label;                          ///< Free text to tag the run with, like a commit
+    std::string out;                            ///< Where to write the JSON, or empty for stdout
+};
+
+/// Timings for one operation at one size
+struct Result
+{
+    std::string operation;          ///< What was timed
+    long tracks;                    ///< Size of the library
+    long playlist;                  ///< Size of the playlist, or 0 for library operations
+    std::vector<double> latencies;  ///< Each call, in microseconds
+};
+
+/**
+ * \brief Split a comma separated list of sizes
+ * \param list The list
+ * \returns The sizes
+ */
+static std::vector<long> ParseSizes(const char *list)
+{
+    std::vector<long> sizes;
+    for (const char *p = list; *p; )
+    {
+        char *end;
+        long size = strtol(p, &end, 10);
+        if (end == p)
+        {
+            break;
+        }
+        sizes.push_back(size);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return sizes;
+}
+
+/**
+ * \brief Time an operation a number of times
+ * \param result Where the latencies go
+ * \param samples How many times to call it
+ * \param operation Called with the sample number
+ */
+static void Time(Result &result, int samples, const std::function<void(int)> &operation)
+{
+    result.latencies.reserve(samples);
+    for (int i = 0; i < samples; ++i)
+    {
+        auto start = std::chrono::steady_clock::now();
+        operation(i);
+        auto stop = std::chrono::steady_clock::now();
+        result.latencies.push_back(std::chrono::duration<double, std::micro>(stop - start).count());
+    }
+}
+
+/**
+ * \brief Pick a percentile out of sorted latencies
+ * \param sorted Latencies, smallest first
+ * \param percentile Which one, 0-100
+ */
+static double Percentile(const std::vector<double> &sorted, double percentile)
+{
+    if (sorted.empty())
+    {
+        return 0;
+    }
+    size_t rank = (size_t)(percentile / 100 * (sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+/**
+ * \brief Escape a string for JSON
+ * \param value The string
+ * \returns The quoted string
+ */
+static std::string Json(const std::string &value)
+{
+    std::string out = "\"";
+    for (char c : value)
+    {
+        if (c == '"' || c == '\\')
+        {
+            out.push_back('\\');
+            out.push_back(c);
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            out.append(escaped);
+        }
+        else
+        {
+            out.push_back(c);
+        }
+    }
+    out.push_back('"');
+    return out;
+}
+
+/**
+ * \brief Write the results out as JSON
+ * \param options What the benchmark was asked to do
+ * \param results Timings for every operation and size
+ * \returns -1 if the output can't be written
+ */
+static int Report(const Options &options, std::vector<Result> &results)
+{
+    FILE *file = options.out.empty() ? stdout : fopen(options.out.c_str(), "w");
+    if (!file)
+    {
+        return -1;
+    }
+
+    fprintf(file, "{\n  \"label\": %s,\n  \"backend\": \"%s\",\n  \"samples\": %d,\n  \"settings\": {",
+            Json(options.label).c_str(), options.local.empty() ? "postgres" : "local", options.samples);
+
+    // Only the tuning ones; where the library is and how to log in to it don't belong in a report
+    bool first = true;
+    for (const std::string &key : options.config.Keys())
+    {
+        if (key.compare(0, 3, "db.") == 0 && key != "db.statement_timeout")
+        {
+            continue;
+        }
+        if (key.compare(0, 8, "storage.") == 0)
+        {
+            continue;
+        }
+        fprintf(file, "%s%s: %s", first ? "" : ", ", Json(key).c_str(), Json(options.config.Get(key)).c_str());
+        first = false;
+    }
+
+    fprintf(file, "},\n  \"results\": [");
+
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        std::vector<double> &sorted = results[i].latencies;
+        std::sort(sorted.begin(), sorted.end());
+
+        double total = 0;
+        for (double latency : sorted)
+        {
+            total += latency;
+        }
+        double mean = sorted.empty() ? 0 : total / sorted.size();
+
+        fprintf(file,
+                "%s\n    {\"operation\": %s, \"tracks\": %ld, \"playlist\": %ld, \"calls\": %zu, "
+                "\"ops_per_sec\": %.1f, \"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}",
+                i ? "," : "", Json(results[i].operation).c_str(), results[i].tracks, results[i].playlist,
+                sorted.size(), total > 0 ? sorted.size() * 1e6 / total : 0, mean,
+                Percentile(sorted, 50), Percentile(sorted, 99), sorted.empty() ? 0 : sorted.back());
+    }
+
+    fprintf(file, "\n  ]\n}\n");
+
+    if (file != stdout)
+    {
+        return fclose(file) == 0 ? 0 : -1;
+    }
+    return 0;
+}
+
+/**
+ * \brief Make up a filepath for a track
+ * \param n Which track
+ */
+static std::string BenchPath(long n)
+{
+    char path[96];
+    snprintf(path, sizeof(path), "/bench/artist %04ld/album %02ld/%08ld track.flac", n / 1000, n / 100 % 10, n);
+    return path;
+}
+
+/**
+ * \brief Time everything against one library size
+ * \param options What the benchmark was asked to do
+ * \param tracks How many tracks to seed
+ * \param results Where the timings go
+ * \returns -1 if the storage can't be used
+ */
+static int Run(const Options &options, long tracks, std::vector<Result> &results)
+{
+    CStorage *storage;
+    if (!options.local.empty())
+    {
+        remove(options.local.c_str());
+        storage = new CLocalStorage(options.local, false);
+    }
+    else
+    {
+        storage = new CPostgresStorage(options.config);
+    }
+
+    CLibrary library(storage, options.config);
+    if (library.GetStatus() != CONNECTION_OK)
+    {
+        cerr << "Failed to open the library" << endl;
+        return -1;
+    }
+
+    library.DestroyDatabase();
+    library.PrepareDatabase();
+
+    std::mt19937 random(tracks);
+    int samples = options.samples;
+
+    cerr << "Seeding " << tracks << " tracks" << endl;
+    // Each call here adds a whole chunk
+    Result seed = {"add_tracks_" + std::to_string(SEED_CHUNK), tracks, 0, {}};
+    std::vector<std::string> filepaths;
+    for (long n = 0; n < tracks; n += SEED_CHUNK)
+    {
+        filepaths.clear();
+        for (long i = n; i < std::min(tracks, n + (long)SEED_CHUNK); ++i)
+        {
+            filepaths.push_back(BenchPath(i));
+        }
+        Time(seed, 1, [&](int) { storage->AddTracks(filepaths); });
+    }
+    results.push_back(seed);
+
+    long next = tracks;
+    Result add = {"add_track", tracks, 0, {}};
+    Time(add, samples, [&](int) { library.AddTrack(BenchPath(next++)); });
+    results.push_back(add);
+
+    // How soon the first track of the library playlist comes back, then how long all of them take
+    Result first = {"stream_library_first_row", tracks, tracks, {}};
+    Time(first, samples, [&](int) { library.StreamPlaylist("1").begin(); });
+    results.push_back(first);
+
+    Result stream = {"stream_library_playlist", tracks, tracks, {}};
+    Time(stream, std::min(samples, 10), [&](int)
+    {
+        size_t count = 0;
+        for (const CStorage::EntryRecord &entry : library.StreamPlaylist("1"))
+        {
+            count += !entry.filepath.empty();
+        }
+    });
+    results.push_back(stream);
+
+    // Every track moves each time, back and forth between two roots
+    Result relocate = {"relocate_root", tracks, 0, {}};
+    Time(relocate, std::min(samples, 10), [&](int i)
+    {
+        library.RelocateRoot(i % 2 ? "/moved/bench" : "/bench", i % 2 ? "/bench" : "/moved/bench");
+    });
+    results.push_back(relocate);
+
+    auto randomTrack = [&]() { return std::to_string(random() % tracks + 1); };
+
+    for (long size : options.playlists)
+    {
+        cerr << "Seeding a playlist of " << size << " tracks" << endl;
+        std::string id = library.AddPlaylist("bench " + std::to_string(size));
+        {
+            CPlaylist playlist(&library, id);
+            std::vector<std::string> ids;
+            for (long n = 0; n < size; n += SEED_CHUNK)
+            {
+                ids.clear();
+                for (long i = n; i < std::min(size, n + (long)SEED_CHUNK); ++i)
+                {
+                    ids.push_back(randomTrack());
+                }
+                playlist.InsertTracks(ids, std::to_string(n + 1));
+            }
+        }
+
+        Result load = {"load_playlist", tracks, size, {}};
+        Time(load, samples, [&](int)
+        {
+            library.GetPlaylistCache()->Invalidate(id);
+            CPlaylist playlist(&library, id);
+        });
+        results.push_back(load);
+
+        Result cached = {"load_playlist_cached", tracks, size, {}};
+        Time(cached, samples, [&](int) { CPlaylist playlist(&library, id); });
+        results.push_back(cached);
+
+        CPlaylist playlist(&library, id);
+
+        Result append = {"append_track", tracks, size, {}};
+        Time(append, samples, [&](int) { playlist.AppendTrack(randomTrack()); });
+        results.push_back(append);
+
+        Result head = {"insert_track_head", tracks, size, {}};
+        Time(head, samples, [&](int) { playlist.InsertTrack(randomTrack(), "1"); });
+        results.push_back(head);
+
+        Result middle = {"insert_track_middle", tracks, size, {}};
+        Time(middle, samples, [&](int)
+        {
+            playlist.InsertTrack(randomTrack(), std::to_string(playlist.GetTracks().size() / 2 + 1));
+        });
+        results.push_back(middle);
+
+        Result tail = {"insert_track_tail", tracks, size, {}};
+        Time(tail, samples, [&](int)
+        {
+            playlist.InsertTrack(randomTrack(), std::to_string(playlist.GetTracks().size() + 1));
+        });
+        results.push_back(tail);
+
+        Result normalize = {"normalize", tracks, size, {}};
+        Time(normalize, samples, [&](int) { playlist.Normalize(); });
+        results.push_back(normalize);
+
+        Result removePosition = {"remove_track_position", tracks, size, {}};
+        Time(removePosition, samples, [&](int)
+        {
+            playlist.RemoveTrack(std::to_string(playlist.GetTracks().size() / 2 + 1));
+        });
+        results.push_back(removePosition);
+    }
+
+    // Every playlist is in place now, so this pays for keeping them all dense
+    Result removeTrack = {"remove_track", tracks, 0, {}};
+    Time(removeTrack, std::min((long)samples, tracks), [&](int i) { library.RemoveTrack(std::to_string(i + 1)); });
+    results.push_back(removeTrack);
+
+    library.DestroyDatabase();
+
+    return 0;
+}
+
+/**
+ * \brief Main entry point of the benchmark
+ */
+int main(int argc, char **argv)
+{
+    Options options;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "--tracks") && more)
+        {
+            options.tracks = ParseSizes(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--playlists") && more)
+        {
+            options.playlists = ParseSizes(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--samples") && more)
+        {
+            options.samples = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--conninfo") && more)
+        {
+            options.config.Set("db.conninfo", argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--local") && more)
+        {
+            options.local = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--set") && more)
+        {
+            if (options.config.Set(argv[++i]) != 0)
+            {
+                cerr << "Unknown setting: " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "--label") && more)
+        {
+            options.label = argv[++i];
+        }
+        else if (!strcmp(argv[i], "--out") && more)
+        {
+            options.out = argv[++i];
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--tracks N,...] [--playlists N,...] [--samples N]" << endl
+                 << "       [--conninfo CONNINFO | --local FILE] [--set KEY=VALUE ...]" << endl
+                 << "       [--label NAME] [--out FILE]" << endl;
+            return 1;
+        }
+    }
+
+    std::vector<Result> results;
+    for (long tracks : options.tracks)
+    {
+        if (tracks < 1 || Run(options, tracks, results) != 0)
+        {
+            return 1;
+        }
+    }
+
+    if (!options.local.empty())
+    {
+        remove(options.local.c_str());
+    }
+
+    return Report(options, results) == 0 ? 0 : 1;
+}
@@ -1,36 +0,0 @@
-/**
- * \file config.h
- * \author Matt Hammerly
- * \brief This file is where configuration options are to be declared
- */
-
-#ifndef CONFIG_H
-#define CONFIG_H
-
-// I'm hiding my setup in here lol
-#include "realconfig.h"
-
-/*
- * This is where you would define config variables.
- * See below for details.
- *
- * This application uses PostgreSQL as a backend
- * for its music library. It requires access to an
- * account with write access to a database to
- * funciton.
- *
- *  Name of the database this application will use
- * #define DBNAME "music"
- *
- *  Host that the database is on
- * #define DBHOST "localhost"
- *
- *  User that this application should act as
- * #define DBUSER "username"
- *
- *  Password for the above user account
- * #define DBPW "password"
- *
- */
-
-#endif
@@ -0,0 +1,98 @@
+/**
+ * \file daemon.cpp
+ * \author Matt Hammerly
+ * \brief This file contains int main() for musicmanagerd, which shares one library with many frontends
+ *
+ * Opens the library the usual settings point at (see CConfig), keeps it
+ * open, and serves it over a Unix socket (see CServer) until it's sent
+ * SIGINT or SIGTERM. Background jobs left over from last time are
+ * picked up and run alongside.
+ *
+ *     musicmanagerd [--socket PATH] [--set KEY=VALUE ...]
+ *
+ * The socket is daemon.socket, or else musicmanager.socket in
+ * $XDG_RUNTIME_DIR; frontends find it the same way (see SocketPath()).
+ */
+
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include "Config.h"
+#include "Library.h"
+#include "Scheduler.h"
+#include "Server.h"
+
+using std::cerr; using std::endl;
+
+/// The server, for the signal handler to stop
+static CServer *server = nullptr;
+
+/**
+ * \brief Stop serving when asked to
+ * \param signal The signal
+ */
+static void Terminate(int signal)
+{
+    (void)signal;
+    if (server)
+    {
+        server->Stop();
+    }
+}
+
+int main(int argc, char **argv)
+{
+    CConfig config = CConfig::Startup();
+
+    for (int i = 1; i < argc; ++i)
+    {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "--socket") && more)
+        {
+            config.Set("daemon.socket", argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--set") && more)
+        {
+            if (config.Set(argv[++i]) != 0)
+            {
+                cerr << "Unknown setting: " << argv[i] << endl;
+                return 1;
+            }
+        }
+        else
+        {
+            cerr << "usage: " << argv[0] << " [--socket PATH] [--set KEY=VALUE ...]" << endl;
+            return 1;
+        }
+    }
+
+    CLibrary library(config);
+    if (library.GetStatus() != CONNECTION_OK || library.PrepareDatabase() != 0)
+    {
+        cerr << "Couldn't open the library" << endl;
+        return 1;
+    }
+
+    CScheduler scheduler(&library);
+    scheduler.Resume();
+    scheduler.Start();
+
+    CServer listening(&library, &scheduler);
+    std::string path = SocketPath(config);
+    if (listening.Listen(path) != 0)
+    {
+        cerr << "Couldn't listen on " << path << endl;
+        return 1;
+    }
+
+    server = &listening;
+    signal(SIGINT, Terminate);
+    signal(SIGTERM, Terminate);
+    signal(SIGPIPE, SIG_IGN);
+
+    int result = listening.Run();
+
+    server = nullptr;
+    scheduler.Stop();
+    return result == 0 ? 0 : 1;
+}
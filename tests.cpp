@@ -3,11 +3,43 @@
  * \author Matt Hammerly
  * \brief This file contains int main() which will run tests as they're written
  */
+#include <algorithm>
+#include <atomic>
 #include <iostream>
 #include <cassert>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "Config.h"
 #include "Library.h"
+#include "PlaylistFile.h"
+#include "PostgresStorage.h"
+#include "Query.h"
+#include "LocalStorage.h"
 #include "Track.h"
 #include "Playlist.h"
+#include "Histogram.h"
+#include "Reactor.h"
+#include "Recommender.h"
+#include "Analyzer.h"
+#include "Artwork.h"
+#include "Exporter.h"
+#include "Client.h"
+#include "ReplicatedStorage.h"
+#include "Scheduler.h"
+#include "Server.h"
+#include "ShardedStorage.h"
+#include "Tags.h"
 #include "tests.h"
 
 using std::cout; using std::endl;
@@ -21,35 +53,299 @@ const std::string track2 = "/home/matt/hdd/dev/cpp/musicmanager/test_data/Beirut
 /// Title of one playlist
 const std::string playlist1 = "test1";
 
+/// Library file to test the local storage with, or empty to test against Postgres
+std::string storage_path;
+
+/// Settings to reach Postgres with, read once before any test starts
+CConfig test_config;
+
+/// Name of the test running on this thread
+thread_local std::string test_name;
+
+/// A test, and whether it has to run with nothing else going on
+struct TestCase
+{
+    const char *name;   ///< Name of the test
+    void (*run)();      ///< The test
+    bool alone;         ///< Whether it touches process-wide state, like the environment
+};
+
+/// Every test, in the order they're started
+static const TestCase test_cases[] =
+{
+    {"Test_Library_Constructor", Test_Library_Constructor, false},
+    {"Test_Library_PrepareDatabase", Test_Library_PrepareDatabase, false},
+    {"Test_Library_DestroyDatabase", Test_Library_DestroyDatabase, false},
+    {"Test_Library_AddTrack", Test_Library_AddTrack, false},
+    {"Test_Library_AddPlaylist", Test_Library_AddPlaylist, false},
+    {"Test_Library_RemoveTrack", Test_Library_RemoveTrack, false},
+    {"Test_Library_RemovePlaylist", Test_Library_RemovePlaylist, false},
+    {"Test_Playlist_Constructors", Test_Playlist_Constructors, false},
+    {"Test_Playlist_AppendTrack", Test_Playlist_AppendTrack, false},
+    {"Test_Playlist_InsertTrack", Test_Playlist_InsertTrack, false},
+    {"Test_Playlist_Normalize", Test_Playlist_Normalize, false},
+    {"Test_Playlist_RemoveTrack", Test_Playlist_RemoveTrack, false},
+    {"Test_Playlist_Batch", Test_Playlist_Batch, false},
+    {"Test_Playlist_Totals", Test_Playlist_Totals, false},
+    {"Test_Playlist_InsertTracks", Test_Playlist_InsertTracks, false},
+    {"Test_Playlist_RemoveRange", Test_Playlist_RemoveRange, false},
+    {"Test_Playlist_MoveRange", Test_Playlist_MoveRange, false},
+    {"Test_LocalStorage_Reopen", Test_LocalStorage_Reopen, false},
+    {"Test_Library_ExportImport", Test_Library_ExportImport, false},
+    {"Test_Playlist_ImportExport", Test_Playlist_ImportExport, false},
+    {"Test_Histogram", Test_Histogram, false},
+    {"Test_Query", Test_Query, false},
+    {"Test_Library_Stats", Test_Library_Stats, false},
+    {"Test_Library_PlayHistory", Test_Library_PlayHistory, false},
+    {"Test_Library_Recommend", Test_Library_Recommend, false},
+    {"Test_Analyzer", Test_Analyzer, false},
+    {"Test_Exporter", Test_Exporter, false},
+    {"Test_Scheduler", Test_Scheduler, false},
+    {"Test_Library_PlaylistCache", Test_Library_PlaylistCache, false},
+    {"Test_Library_Stream", Test_Library_Stream, false},
+    {"Test_Library_RelocateRoot", Test_Library_RelocateRoot, false},
+    {"Test_ShardedStorage", Test_ShardedStorage, false},
+    {"Test_ReplicatedStorage", Test_ReplicatedStorage, false},
+    {"Test_Artwork", Test_Artwork, false},
+    {"Test_Library_Browse", Test_Library_Browse, false},
+    {"Test_Server", Test_Server, false},
+    {"Test_Async", Test_Async, false},
+    {"Test_Config", Test_Config, true},
+};
+
 /**
- * \brief Main entry point of program, where tests will be run
+ * \brief Returns the schema a test keeps its Postgres library in
+ * \param name Name of the test
+ *
+ * The process id keeps two runs of the suite against one database apart.
+ */
+static std::string TestSchema(const std::string &name)
+{
+    std::string schema = "test_" + std::to_string(getpid()) + "_";
+    for (char c : name.substr(name.compare(0, 5, "Test_") == 0 ? 5 : 0))
+    {
+        schema += (char)tolower((unsigned char)c);
+    }
+    return schema;
+}
+
+/**
+ * \brief Returns the library file a test keeps its local library in
+ * \param name Name of the test
+ */
+static std::string TestPath(const std::string &name)
+{
+    return storage_path + "." + name;
+}
+
+/**
+ * \brief Make the storage the running test's library should live in
+ * \param part Suffix for a test that needs more than one library, or empty
+ * \returns Postgres storage in the test's own schema, or local storage in its own file if a path was given
+ *
+ * Every call from one test reaches the same library, so a test can
+ * open it again to check what was kept. A test that asks for parts
+ * has to drop them itself.
+ */
+static CStorage *TestStorage(const std::string &part = "")
+{
+    if (storage_path.empty())
+    {
+        CConfig config = test_config;
+        config.Set("db.schema", TestSchema(test_name + part));
+        return new CPostgresStorage(config);
+    }
+    return new CLocalStorage(TestPath(test_name + part), false);
+}
+
+/**
+ * \brief Throw away whatever a test left in its storage
+ * \param name Name of the test
+ */
+static void DropTestStorage(const std::string &name)
+{
+    if (!storage_path.empty())
+    {
+        remove(TestPath(name).c_str());
+        remove((TestPath(name) + ".checkpoint").c_str());
+        remove((TestPath(name) + ".history").c_str());
+        return;
+    }
+
+    CPostgresStorage storage(test_config);
+    if (storage.GetStatus() == CONNECTION_OK)
+    {
+        std::string schema = TestSchema(name);
+        char *quoted = PQescapeIdentifier(storage.GetConnection(), schema.c_str(), schema.size());
+        PQclear(PQexec(storage.GetConnection(), (std::string("DROP SCHEMA IF EXISTS ") + quoted + " CASCADE").c_str()));
+        PQfreemem(quoted);
+    }
+}
+
+/**
+ * \brief Fetch the track IDs of a playlist straight from the database
+ * \param conn Connection to query with
+ * \param playlist_id ID of the playlist
+ * \returns Track IDs ordered by position, or empty if the positions aren't 1..n
+ */
+static std::vector<std::string> StoredTracks(PGconn *conn, std::string playlist_id)
+{
+    std::string query = "SELECT track_id, position FROM tracks_playlists WHERE playlist_id = ";
+    char escaped_playlist_id[30];
+    PQescapeStringConn(conn, escaped_playlist_id, playlist_id.c_str(), 30, 0);
+    query.append(escaped_playlist_id);
+    query.append(" ORDER BY position");
+
+    PGresult *res = PQexec(conn, query.c_str());
+
+    std::vector<std::string> tracks;
+    for (int i = 0; i < PQntuples(res); ++i)
+    {
+        if (std::to_string(i + 1) != PQgetvalue(res, i, 1))
+        {
+            PQclear(res);
+            return std::vector<std::string>();
+        }
+        tracks.push_back(PQgetvalue(res, i, 0));
+    }
+    PQclear(res);
+
+    return tracks;
+}
+
+/**
+ * \brief Run one test in storage of its own, and time it
+ * \param test The test
+ * \returns How long it took, in milliseconds
  */
-int main()
+static double RunTest(const TestCase &test)
 {
+    test_name = test.name;
+    DropTestStorage(test_name);
 
-    Test_Library_Constructor();
+    auto start = std::chrono::steady_clock::now();
+    test.run();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-    Test_Library_PrepareDatabase();
+    DropTestStorage(test_name);
+    return ms;
+}
 
-    Test_Library_DestroyDatabase();
+/**
+ * \brief Main entry point of program, where tests will be run
+ *
+ *     tests [FILE] [-j JOBS] [--only NAME]... [--timings FILE]
+ *
+ * Tests run JOBS at a time (one per core by default), each against a
+ * library of its own: a schema of its own in the Postgres database
+ * configured for startup (see CConfig), or if FILE is given a local
+ * library file of its own next to it. Tests that touch process-wide
+ * state run alone once the rest are done. Each test's time is printed
+ * as it finishes, and --timings writes them out as JSON so runs from
+ * different commits can be compared.
+ *
+ * A failed assert stops the whole run; its message names the test.
+ */
+int main(int argc, char **argv)
+{
+    unsigned jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::string> only;
+    std::string timings;
 
-    Test_Library_AddTrack();
+    for (int i = 1; i < argc; ++i)
+    {
+        bool more = i + 1 < argc;
+        if (!strcmp(argv[i], "-j") && more)
+        {
+            jobs = std::max(1, atoi(argv[++i]));
+        }
+        else if (!strcmp(argv[i], "--only") && more)
+        {
+            only.push_back(argv[++i]);
+        }
+        else if (!strcmp(argv[i], "--timings") && more)
+        {
+            timings = argv[++i];
+        }
+        else if (argv[i][0] != '-' && storage_path.empty())
+        {
+            storage_path = argv[i];
+        }
+        else
+        {
+            std::cerr << "usage: " << argv[0] << " [FILE] [-j JOBS] [--only NAME]... [--timings FILE]" << endl;
+            return 1;
+        }
+    }
 
-    Test_Library_AddPlaylist();
+    test_config = CConfig::Startup();
 
-    Test_Library_RemoveTrack();
+    std::vector<const TestCase *> together, alone;
+    for (const TestCase &test : test_cases)
+    {
+        if (only.empty() || std::find(only.begin(), only.end(), test.name) != only.end())
+        {
+            (test.alone ? alone : together).push_back(&test);
+        }
+    }
 
-    Test_Library_RemovePlaylist();
+    std::vector<std::pair<std::string, double>> times;
+    std::mutex times_mutex;
+    auto finished = [&](const TestCase *test, double ms)
+    {
+        std::lock_guard<std::mutex> lock(times_mutex);
+        cout << test->name << "... OK (" << std::fixed << std::setprecision(1) << ms << " ms)" << endl;
+        times.push_back({test->name, ms});
+    };
 
-    Test_Playlist_Constructors();
+    auto start = std::chrono::steady_clock::now();
 
-    Test_Playlist_AppendTrack();
+    std::atomic<size_t> next(0);
+    std::vector<std::thread> workers;
+    for (unsigned i = 0; i < std::min<size_t>(jobs, together.size()); ++i)
+    {
+        workers.emplace_back([&]()
+        {
+            for (size_t n = next++; n < together.size(); n = next++)
+            {
+                finished(together[n], RunTest(*together[n]));
+            }
+        });
+    }
+    for (std::thread &worker : workers)
+    {
+        worker.join();
+    }
 
-    Test_Playlist_InsertTrack();
+    for (const TestCase *test : alone)
+    {
+        finished(test, RunTest(*test));
+    }
 
-    Test_Playlist_Normalize();
+    double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    double total = 0;
+    for (auto &time : times)
+    {
+        total += time.second;
+    }
+    cout << times.size() << " tests OK in " << wall << " ms (" << total << " ms of tests, "
+         << jobs << " at a time)" << endl;
 
-    Test_Playlist_RemoveTrack();
+    if (!timings.empty())
+    {
+        FILE *file = fopen(timings.c_str(), "w");
+        if (!file)
+        {
+            return 1;
+        }
+        fprintf(file, "{\n  \"wall_ms\": %.1f,\n  \"jobs\": %u,\n  \"tests\": {", wall, jobs);
+        for (size_t i = 0; i < times.size(); ++i)
+        {
+            fprintf(file, "%s\n    \"%s\": %.1f", i ? "," : "", times[i].first.c_str(), times[i].second);
+        }
+        fprintf(file, "\n  }\n}\n");
+        fclose(file);
+    }
 
     // So I can poke around manually after running tests
     //CLibrary library;
@@ -63,10 +359,8 @@ int main()
  */
 void Test_Library_Constructor()
 {
-    cout << "Test_Library_Constructor... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
     assert(library.GetStatus() == CONNECTION_OK);
-    cout << "OK" << endl;
 }
 
 /**
@@ -74,40 +368,44 @@ void Test_Library_Constructor()
  */
 void Test_Library_PrepareDatabase()
 {
-    cout << "Test_Library_PrepareDatabase... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     library.PrepareDatabase();
 
     // We need the unwrapped connection object for arbitrary queries to test
     PGconn *conn = library.GetConnection();
 
-    // Check to see if tables exist
-    // Three rows should be returned; one for tracks, one for playlists, one for tracks_playlists
-    PGresult* res_tables = PQexec(conn, "SELECT table_name FROM information_schema.tables WHERE table_name IN ('tracks', 'playlists', 'tracks_playlists');");
-    assert(PQntuples(res_tables) == 3);
-    PQclear(res_tables);
-
-    // Check to see if the tracks_playlists_insert_func procedure exists
-    PGresult* res_func = PQexec(conn, "SELECT routine_name FROM information_schema.routines WHERE routine_name = 'tracks_playlists_insert_func';");
-    assert(PQntuples(res_func) == 1);
-    PQclear(res_func);
-
-    // Check to see if the tracks_playlists_insert_trg trigger exists
-    // Two records should be returned; one for ON INSERT, one for ON DELETE
-    PGresult* res_trg = PQexec(conn, "SELECT trigger_name FROM information_schema.triggers WHERE trigger_name = 'tracks_playlists_insert_trg';");
-    assert(PQntuples(res_trg) == 2);
-    PQclear(res_trg);
+    if (conn)
+    {
+        // Check to see if tables exist
+        // Three rows should be returned; one for tracks, one for playlists, one for tracks_playlists
+        PGresult* res_tables = PQexec(conn, "SELECT table_name FROM information_schema.tables WHERE table_schema = current_schema() AND table_name IN ('tracks', 'playlists', 'tracks_playlists');");
+        assert(PQntuples(res_tables) == 3);
+        PQclear(res_tables);
+
+        // Check to see if the tracks_playlists_insert_func procedure exists
+        PGresult* res_func = PQexec(conn, "SELECT routine_name FROM information_schema.routines WHERE routine_schema = current_schema() AND routine_name = 'tracks_playlists_insert_func';");
+        assert(PQntuples(res_func) == 1);
+        PQclear(res_func);
+
+        // Check to see if the tracks_playlists_insert_trg trigger exists
+        // Two records should be returned; one for ON INSERT, one for ON DELETE
+        PGresult* res_trg = PQexec(conn, "SELECT trigger_name FROM information_schema.triggers WHERE trigger_schema = current_schema() AND trigger_name = 'tracks_playlists_insert_trg';");
+        assert(PQntuples(res_trg) == 2);
+        PQclear(res_trg);
+
+        // Check to see if the default library playlist was properly created
+        PGresult *res_playlist = PQexec(conn, "SELECT id, title, length FROM playlists WHERE id=1");
+        assert(PQntuples(res_playlist) == 1);
+        PQclear(res_playlist);
+    }
 
-    // Check to see if the default library playlist was properly created
-    PGresult *res_playlist = PQexec(conn, "SELECT id, title, length FROM playlists WHERE id=1");
-    assert(PQntuples(res_playlist) == 1);
-    PQclear(res_playlist);
+    // The library playlist should be there whatever the storage
+    CPlaylist library_playlist(&library, "1");
+    assert(library_playlist.GetTitle() == "library");
 
     // clean up, I guess
     library.DestroyDatabase();
-
-    cout << "OK" << endl;
 }
 
 /**
@@ -115,8 +413,7 @@ void Test_Library_PrepareDatabase()
  */
 void Test_Library_DestroyDatabase()
 {
-    cout << "Test_Library_DestroyDatabase... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -126,24 +423,27 @@ void Test_Library_DestroyDatabase()
     // We need the unwrapped connection object for arbitrary queries to test
     PGconn *conn = library.GetConnection();
 
-    // Check to see if tables exist
-    PGresult* res_tables = PQexec(conn, "SELECT table_name FROM information_schema.tables WHERE table_name IN ('tracks', 'playlists', 'tracks_playlists');");
-    assert(PQntuples(res_tables) == 0);
-    PQclear(res_tables);
-
-    // Check to see if the tracks_playlists_insert_func procedure exists
-    PGresult* res_func = PQexec(conn, "SELECT routine_name FROM information_schema.routines WHERE routine_name = 'tracks_playlists_insert_func';");
-    assert(PQntuples(res_func) == 0);
-    PQclear(res_func);
-
-    // Check to see if the tracks_playlists_insert_trg trigger exists
-    PGresult* res_trg = PQexec(conn, "SELECT trigger_name FROM information_schema.triggers WHERE trigger_name = 'tracks_playlists_insert_trg';");
-    assert(PQntuples(res_trg) == 0);
-    PQclear(res_trg);
-
-
-    cout << "OK" << endl;
+    if (conn)
+    {
+        // Check to see if tables exist
+        PGresult* res_tables = PQexec(conn, "SELECT table_name FROM information_schema.tables WHERE table_schema = current_schema() AND table_name IN ('tracks', 'playlists', 'tracks_playlists');");
+        assert(PQntuples(res_tables) == 0);
+        PQclear(res_tables);
+
+        // Check to see if the tracks_playlists_insert_func procedure exists
+        PGresult* res_func = PQexec(conn, "SELECT routine_name FROM information_schema.routines WHERE routine_schema = current_schema() AND routine_name = 'tracks_playlists_insert_func';");
+        assert(PQntuples(res_func) == 0);
+        PQclear(res_func);
+
+        // Check to see if the tracks_playlists_insert_trg trigger exists
+        PGresult* res_trg = PQexec(conn, "SELECT trigger_name FROM information_schema.triggers WHERE trigger_schema = current_schema() AND trigger_name = 'tracks_playlists_insert_trg';");
+        assert(PQntuples(res_trg) == 0);
+        PQclear(res_trg);
+    }
 
+    // The library playlist should be gone whatever the storage
+    CPlaylist library_playlist(&library, "1");
+    assert(library_playlist.GetTitle().empty());
 }
 
 /**
@@ -153,8 +453,7 @@ void Test_Library_DestroyDatabase()
  */
 void Test_Library_AddTrack()
 {
-    cout << "Test_Library_AddTrack... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -164,34 +463,39 @@ void Test_Library_AddTrack()
     // We need the unwrapped connection object for arbitrary queries to test
     PGconn* conn = library.GetConnection();
 
-    std::string query = "SELECT * FROM tracks WHERE id=";
+    if (conn)
+    {
+        std::string query = "SELECT * FROM track_paths WHERE id=";
 
-    // id should never not be a numeric string but safety first
-    char escaped_id[30];
-    PQescapeStringConn(conn, escaped_id, track1_id.c_str(), 30, 0);
-    query.append(escaped_id);
+        // id should never not be a numeric string but safety first
+        char escaped_id[30];
+        PQescapeStringConn(conn, escaped_id, track1_id.c_str(), 30, 0);
+        query.append(escaped_id);
 
-    PGresult* track_res = PQexec(conn, query.c_str());
+        PGresult* track_res = PQexec(conn, query.c_str());
 
-    // Is there actually a row inserted with our id?
-    std::string new_id(PQgetvalue(track_res, 0, 0));
-    assert(new_id == track1_id);
+        // Is there actually a row inserted with our id?
+        std::string new_id(PQgetvalue(track_res, 0, 0));
+        assert(new_id == track1_id);
 
-    // Is it the same one (same filepath) that we entered?
-    std::string filepath(PQgetvalue(track_res, 0, 1));
-    assert(filepath == track1);
+        // Is it the same one (same filepath) that we entered?
+        std::string filepath(PQgetvalue(track_res, 0, 1));
+        assert(filepath == track1);
 
-    PQclear(track_res);
+        PQclear(track_res);
 
-    std::string query2 = "SELECT * FROM tracks_playlists WHERE track_id = " + track1_id;
-    PGresult *playlist_entry_res = PQexec(conn, query2.c_str());
-    assert(PQntuples(playlist_entry_res) == 1);
+        std::string query2 = "SELECT * FROM tracks_playlists WHERE track_id = " + track1_id;
+        PGresult *playlist_entry_res = PQexec(conn, query2.c_str());
+        assert(PQntuples(playlist_entry_res) == 1);
 
-    PQclear(playlist_entry_res);
+        PQclear(playlist_entry_res);
+    }
 
-    library.DestroyDatabase();
+    // It should have gone on the end of the library playlist
+    CPlaylist library_playlist(&library, "1");
+    assert(library_playlist.GetTracks() == std::vector<std::string>({track1_id}));
 
-    cout << "OK" << endl;
+    library.DestroyDatabase();
 }
 
 /**
@@ -199,8 +503,7 @@ void Test_Library_AddTrack()
  */
 void Test_Library_AddPlaylist()
 {
-    cout << "Test_Library_AddPlaylist... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -210,28 +513,33 @@ void Test_Library_AddPlaylist()
     // We need the unwrapped connection object for arbitrary queries to test
     PGconn *conn = library.GetConnection();
 
-    std::string query = "SELECT * FROM playlists WHERE id=";
+    if (conn)
+    {
+        std::string query = "SELECT * FROM playlists WHERE id=";
 
-    // id should never not be a numeric string but safety first
-    char escaped_id[30];
-    PQescapeStringConn(conn, escaped_id, playlist_id.c_str(), 30, 0);
-    query.append(escaped_id);
+        // id should never not be a numeric string but safety first
+        char escaped_id[30];
+        PQescapeStringConn(conn, escaped_id, playlist_id.c_str(), 30, 0);
+        query.append(escaped_id);
 
-    PGresult *playlist_res = PQexec(conn, query.c_str());
+        PGresult *playlist_res = PQexec(conn, query.c_str());
 
-    // Is there actually a row inserted with our id?
-    std::string new_id(PQgetvalue(playlist_res, 0, 0));
-    assert(new_id == playlist_id);
+        // Is there actually a row inserted with our id?
+        std::string new_id(PQgetvalue(playlist_res, 0, 0));
+        assert(new_id == playlist_id);
 
-    // Is it the same one (same title) that we entered?
-    std::string title(PQgetvalue(playlist_res, 0, 1));
-    assert(title == playlist1);
+        // Is it the same one (same title) that we entered?
+        std::string title(PQgetvalue(playlist_res, 0, 1));
+        assert(title == playlist1);
 
-    PQclear(playlist_res);
+        PQclear(playlist_res);
+    }
 
-    library.DestroyDatabase();
+    CPlaylist playlist(&library, playlist_id);
+    assert(playlist.GetTitle() == playlist1);
+    assert(playlist.GetLength() == "0");
 
-    cout << "OK" << endl;
+    library.DestroyDatabase();
 }
 
 /**
@@ -240,8 +548,7 @@ void Test_Library_AddPlaylist()
  */
 void Test_Library_RemoveTrack()
 {
-    cout << "Test_Library_RemoveTrack... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -258,6 +565,7 @@ void Test_Library_RemoveTrack()
 
     PGconn *conn = library.GetConnection();
 
+    // Postgres is checked row by row; any storage is checked through the playlists afterwards
     std::string query = "SELECT * FROM tracks_playlists WHERE track_id = ";
     char escaped_track1_id[30];
     char escaped_track2_id[30];
@@ -273,9 +581,9 @@ void Test_Library_RemoveTrack()
     PGresult *playlist_entry2_res = PQexec(conn, query2.c_str());
     PGresult *playlist_entry3_res = PQexec(conn, query3.c_str());
 
-    assert(PQntuples(playlist_entry1_res) == 2);
-    assert(PQntuples(playlist_entry2_res) == 2);
-    assert(PQntuples(playlist_entry3_res) == 2);
+    assert(!conn || PQntuples(playlist_entry1_res) == 2);
+    assert(!conn || PQntuples(playlist_entry2_res) == 2);
+    assert(!conn || PQntuples(playlist_entry3_res) == 2);
 
     PQclear(playlist_entry1_res);
     PQclear(playlist_entry2_res);
@@ -291,45 +599,53 @@ void Test_Library_RemoveTrack()
 
     // we didn't delete this track, make sure it is still in there
     playlist_entry3_res = PQexec(conn, query3.c_str());
-    assert(PQntuples(playlist_entry3_res) == 2);
+    assert(!conn || PQntuples(playlist_entry3_res) == 2);
 
     PQclear(playlist_entry1_res);
     PQclear(playlist_entry2_res);
     PQclear(playlist_entry3_res);
 
-    std::string position_query = "SELECT * FROM tracks_playlists WHERE playlist_id=";
-    char escaped_playlist_id[30];
-    PQescapeStringConn(conn, escaped_playlist_id, playlist.GetId().c_str(), 30, 0);
-    position_query.append(escaped_playlist_id);
-    playlist_entry1_res = PQexec(conn, position_query.c_str());
-    assert(PQntuples(playlist_entry1_res) == 1); // one track should remain
-    std::string final_position(PQgetvalue(playlist_entry1_res, 0, 3));
-    assert(final_position == "1"); // it should be normalized to first position
-    PQclear(playlist_entry1_res);
-
-    std::string playlist_length_query = "SELECT * FROM playlists WHERE id=";
-    playlist_length_query.append(escaped_playlist_id);
-    playlist_entry1_res = PQexec(conn, playlist_length_query.c_str());
-    std::string final_length(PQgetvalue(playlist_entry1_res, 0, 2));
-    assert(final_length == "1");
-    PQclear(playlist_entry1_res);
-
-    std::string query4 = "SELECT * FROM tracks WHERE id = ";
-    query4.append(escaped_track1_id);
-    std::string query5 = "SELECT * FROM tracks WHERE id = ";
-    query5.append(escaped_track2_id);
-    PGresult *track1_res = PQexec(conn, query4.c_str());
-    PGresult *track2_res = PQexec(conn, query5.c_str());
+    // Only the third track should be left, first in both playlists
+    CPlaylist library_playlist(&library, "1");
+    CPlaylist reloaded(&library, playlist_id);
+    assert(library_playlist.GetTracks() == std::vector<std::string>({track3_id}));
+    assert(reloaded.GetTracks() == std::vector<std::string>({track3_id}));
+    assert(reloaded.GetLength() == "1");
 
-    assert(PQntuples(track1_res) == 0);
-    assert(PQntuples(track2_res) == 0);
-
-    PQclear(track1_res);
-    PQclear(track2_res);
+    if (conn)
+    {
+        std::string position_query = "SELECT * FROM tracks_playlists WHERE playlist_id=";
+        char escaped_playlist_id[30];
+        PQescapeStringConn(conn, escaped_playlist_id, playlist.GetId().c_str(), 30, 0);
+        position_query.append(escaped_playlist_id);
+        playlist_entry1_res = PQexec(conn, position_query.c_str());
+        assert(PQntuples(playlist_entry1_res) == 1); // one track should remain
+        std::string final_position(PQgetvalue(playlist_entry1_res, 0, 3));
+        assert(final_position == "1"); // it should be normalized to first position
+        PQclear(playlist_entry1_res);
+
+        std::string playlist_length_query = "SELECT * FROM playlists WHERE id=";
+        playlist_length_query.append(escaped_playlist_id);
+        playlist_entry1_res = PQexec(conn, playlist_length_query.c_str());
+        std::string final_length(PQgetvalue(playlist_entry1_res, 0, 2));
+        assert(final_length == "1");
+        PQclear(playlist_entry1_res);
+
+        std::string query4 = "SELECT * FROM tracks WHERE id = ";
+        query4.append(escaped_track1_id);
+        std::string query5 = "SELECT * FROM tracks WHERE id = ";
+        query5.append(escaped_track2_id);
+        PGresult *track1_res = PQexec(conn, query4.c_str());
+        PGresult *track2_res = PQexec(conn, query5.c_str());
+
+        assert(PQntuples(track1_res) == 0);
+        assert(PQntuples(track2_res) == 0);
+
+        PQclear(track1_res);
+        PQclear(track2_res);
+    }
 
     library.DestroyDatabase();
-
-    cout << "OK" << endl;
 }
 
 /**
@@ -337,8 +653,7 @@ void Test_Library_RemoveTrack()
  */
 void Test_Library_RemovePlaylist()
 {
-    cout << "Test_Library_RemovePlaylist... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -355,7 +670,7 @@ void Test_Library_RemovePlaylist()
 
     std::string playlist_query = "SELECT * FROM playlists WHERE id = " + playlist_id;
     PGresult *playlist_res = PQexec(conn, playlist_query.c_str());
-    assert(PQntuples(playlist_res) == 1);
+    assert(!conn || PQntuples(playlist_res) == 1);
     PQclear(playlist_res);
 
     std::string playlist_entry_query = "SELECT * FROM tracks_playlists WHERE playlist_id = ";
@@ -365,12 +680,17 @@ void Test_Library_RemovePlaylist()
     playlist_entry_query.append(escaped_playlist_id);
     PGresult *playlist_entry_res = PQexec(conn, playlist_entry_query.c_str());
 
-    assert(PQntuples(playlist_entry_res) == 2);
+    assert(!conn || PQntuples(playlist_entry_res) == 2);
 
     PQclear(playlist_entry_res);
 
     library.RemovePlaylist(playlist_id);
 
+    // It shouldn't load any more
+    CPlaylist removed(&library, playlist_id);
+    assert(removed.GetTitle().empty());
+    assert(removed.GetTracks().empty());
+
     playlist_res = PQexec(conn, playlist_query.c_str());
     assert(PQntuples(playlist_res) == 0);
     PQclear(playlist_res);
@@ -382,8 +702,6 @@ void Test_Library_RemovePlaylist()
     PQclear(playlist_entry_res);
 
     library.DestroyDatabase();
-
-    cout << "OK" << endl;
 }
 
 /**
@@ -394,8 +712,7 @@ void Test_Library_RemovePlaylist()
  */
 void Test_Playlist_Constructors()
 {
-    cout << "Test_Playlist_Constructors... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -415,8 +732,6 @@ void Test_Playlist_Constructors()
     assert(playlist2.GetLibrary() == &library);
     
     library.DestroyDatabase();
-
-    cout << "OK" << endl;
 }
 
 /**
@@ -427,8 +742,7 @@ void Test_Playlist_Constructors()
  */
 void Test_Playlist_AppendTrack()
 {
-    cout << "Test_Playlist_AppendTrack... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -461,8 +775,14 @@ void Test_Playlist_AppendTrack()
     // Insert logic to make sure Track objects were appropriately added to the container
     // for both playlists
 
+    // Make sure the tracks come back when the playlist is loaded again
+    CPlaylist reloaded(&library, playlist_id);
+    assert(reloaded.GetTracks() == std::vector<std::string>({track1_id, track2_id}));
+    assert(db_playlist.GetTracks() == reloaded.GetTracks());
+    assert(temp_playlist.GetTracks() == reloaded.GetTracks());
+
     // Verify that the proper database records were created
-    if (db_playlist.GetId() != "temp")
+    if (db_playlist.GetId() != "temp" && library.GetConnection())
     {
         PGconn *conn = library.GetConnection();
 
@@ -495,15 +815,13 @@ void Test_Playlist_AppendTrack()
         
         PQclear(res);
     }
-    else
+    else if (db_playlist.GetId() == "temp")
     {
         assert(association1 == "temp");
         assert(association2 == "temp");
     }
 
     library.DestroyDatabase();
-
-    cout << "OK" << endl;
 }
 
 /**
@@ -511,8 +829,7 @@ void Test_Playlist_AppendTrack()
  */
 void Test_Playlist_InsertTrack()
 {
-    cout << "Test_Playlist_InsertTrack... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -546,8 +863,14 @@ void Test_Playlist_InsertTrack()
     // Insert logic to make sure Track objects were appropriately added to the container
     // for both playlists
 
+    // Make sure the tracks come back when the playlist is loaded again
+    CPlaylist reloaded(&library, db_playlist_id);
+    assert(reloaded.GetTracks() == std::vector<std::string>({track1_id, track2_id}));
+    assert(db_playlist.GetTracks() == reloaded.GetTracks());
+    assert(temp_playlist.GetTracks() == reloaded.GetTracks());
+
     // Verify the proper database records were created
-    if (db_playlist.GetId() != "temp")
+    if (db_playlist.GetId() != "temp" && library.GetConnection())
     {
         PGconn *conn = library.GetConnection();
 
@@ -575,15 +898,13 @@ void Test_Playlist_InsertTrack()
 
         PQclear(res);
     }
-    else
+    else if (db_playlist.GetId() == "temp")
     {
         assert(association1 == "temp");
         assert(association2 == "temp");
     }
 
     library.DestroyDatabase();
-
-    cout << "OK" << endl;
 }
 
 /**
@@ -591,8 +912,7 @@ void Test_Playlist_InsertTrack()
  */
 void Test_Playlist_Normalize()
 {
-    cout << "Test_Playlist_Normalize... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -607,30 +927,35 @@ void Test_Playlist_Normalize()
 
     PGconn *conn = library.GetConnection();
 
-    std::string query = "SELECT id, playlist_id, track_id, position FROM tracks_playlists WHERE playlist_id = ";
+    if (conn)
+    {
+        std::string query = "SELECT id, playlist_id, track_id, position FROM tracks_playlists WHERE playlist_id = ";
 
-    char escaped_playlist_id[30];
-    PQescapeStringConn(conn, escaped_playlist_id, playlist.GetId().c_str(), 30, 0);
-    query.append(escaped_playlist_id);
-    query.append(" ORDER BY position");
+        char escaped_playlist_id[30];
+        PQescapeStringConn(conn, escaped_playlist_id, playlist.GetId().c_str(), 30, 0);
+        query.append(escaped_playlist_id);
+        query.append(" ORDER BY position");
 
-    PGresult *res = PQexec(conn, query.c_str());
+        PGresult *res = PQexec(conn, query.c_str());
 
-    std::string id1(PQgetvalue(res, 0, 2));
-    std::string id2(PQgetvalue(res, 1, 2));
-    std::string id3(PQgetvalue(res, 2, 2));
-    std::string id4(PQgetvalue(res, 3, 2));
+        std::string id1(PQgetvalue(res, 0, 2));
+        std::string id2(PQgetvalue(res, 1, 2));
+        std::string id3(PQgetvalue(res, 2, 2));
+        std::string id4(PQgetvalue(res, 3, 2));
 
-    assert(id1 == "1");
-    assert(id2 == "3");
-    assert(id3 == "2");
-    assert(id4 == "4");
+        assert(id1 == "1");
+        assert(id2 == "3");
+        assert(id3 == "2");
+        assert(id4 == "4");
 
-    PQclear(res);
+        PQclear(res);
+    }
 
-    library.DestroyDatabase();
+    CPlaylist reloaded(&library, playlist_id);
+    assert(reloaded.GetTracks() == std::vector<std::string>({"1", "3", "2", "4"}));
+    assert(playlist.GetTracks() == reloaded.GetTracks());
 
-    cout << "OK" << endl;
+    library.DestroyDatabase();
 }
 
 /**
@@ -638,8 +963,7 @@ void Test_Playlist_Normalize()
  */
 void Test_Playlist_RemoveTrack()
 {
-    cout << "Test_Playlist_RemoveTrack... ";
-    CLibrary library;
+    CLibrary library(TestStorage());
 
     // Make sure all tables and such exist
     library.PrepareDatabase();
@@ -658,28 +982,2534 @@ void Test_Playlist_RemoveTrack()
 
     PGconn *conn = library.GetConnection();
 
-    std::string query = "SELECT id, playlist_id, track_id, position FROM tracks_playlists WHERE playlist_id = ";
-    char escaped_playlist_id[30];
-    PQescapeStringConn(conn, escaped_playlist_id, playlist.GetId().c_str(), 30, 0);
-    query.append(escaped_playlist_id);
+    if (conn)
+    {
+        std::string query = "SELECT id, playlist_id, track_id, position FROM tracks_playlists WHERE playlist_id = ";
+        char escaped_playlist_id[30];
+        PQescapeStringConn(conn, escaped_playlist_id, playlist.GetId().c_str(), 30, 0);
+        query.append(escaped_playlist_id);
 
-    PGresult *res = PQexec(conn, query.c_str());
+        PGresult *res = PQexec(conn, query.c_str());
+
+        assert(PQntuples(res) == 3);
+
+        std::string track1_id(PQgetvalue(res, 0, 2));
+        std::string track2_id(PQgetvalue(res, 1, 2));
+        std::string track3_id(PQgetvalue(res, 2, 2));
+
+        assert(track1_id == "1");
+        assert(track2_id == "2");
+        assert(track3_id == "3");
+
+        assert(playlist.GetLength() == "3");
+
+        PQclear(res);
+    }
+
+    CPlaylist reloaded(&library, playlist_id);
+    assert(reloaded.GetTracks() == std::vector<std::string>({"1", "2", "3"}));
+    assert(reloaded.GetLength() == "3");
+    assert(playlist.GetTracks() == reloaded.GetTracks());
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure batched edits land in one go, or not at all
+ */
+void Test_Playlist_Batch()
+{
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+
+    std::string playlist_id = library.AddPlaylist("test");
+    CPlaylist playlist(&library, playlist_id);
+
+    {
+        CPlaylist::Batch batch(&playlist);
+        playlist.InsertTrack("1", "1");
+        playlist.InsertTrack("2", "1"); // goes ahead of track 1
+        playlist.InsertTrack("3", "3");
+        playlist.InsertTrack("4", "2"); // goes between tracks 2 and 1
+        playlist.RemoveTrack("4");      // takes track 3 back out
+        batch.Commit();
+    }
 
-    assert(PQntuples(res) == 3);
+    std::vector<std::string> expected = {"2", "4", "1"};
+    assert(playlist.GetTracks() == expected);
+    assert(playlist.GetLength() == "3");
+    assert(!library.GetConnection() || StoredTracks(library.GetConnection(), playlist_id) == expected);
 
-    std::string track1_id(PQgetvalue(res, 0, 2));
-    std::string track2_id(PQgetvalue(res, 1, 2));
-    std::string track3_id(PQgetvalue(res, 2, 2));
+    // The length trigger was held off, so make sure the recount happened
+    CPlaylist reloaded(&library, playlist_id);
+    assert(reloaded.GetTracks() == expected);
+    assert(reloaded.GetLength() == "3");
 
-    assert(track1_id == "1");
-    assert(track2_id == "2");
-    assert(track3_id == "3");
+    // A batch that isn't committed should leave nothing behind
+    {
+        CPlaylist::Batch batch(&playlist);
+        playlist.AppendTrack("5");
+        playlist.RemoveTrack("1");
+    }
 
+    assert(playlist.GetTracks() == expected);
     assert(playlist.GetLength() == "3");
+    assert(!library.GetConnection() || StoredTracks(library.GetConnection(), playlist_id) == expected);
 
-    PQclear(res);
+    CPlaylist rolled_back(&library, playlist_id);
+    assert(rolled_back.GetTracks() == expected);
+
+    // A batch whose transaction broke part way is rolled back by Commit(), and edits carry on after it
+    if (PGconn *conn = library.GetConnection())
+    {
+        {
+            CPlaylist::Batch batch(&playlist);
+            playlist.AppendTrack("5");
+            PQclear(PQexec(conn, "SELECT 1 / 0"));
+            assert(batch.Commit() == -1);
+        }
+        assert(PQtransactionStatus(conn) == PQTRANS_IDLE);
+        assert(playlist.GetTracks() == expected);
+        assert(StoredTracks(conn, playlist_id) == expected);
+
+        playlist.AppendTrack("5");
+        expected.push_back("5");
+        assert(StoredTracks(conn, playlist_id) == expected);
+    }
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure a playlist's length, size and artist and album counts follow its tracks as they come and go
+ */
+void Test_Playlist_Totals()
+{
+    std::vector<std::string> ids;
+    std::string playlist_id;
+    {
+        CLibrary library(TestStorage());
+        library.PrepareDatabase();
+        CStorage *storage = library.GetStorage();
+        ids = storage->AddTracks({"/music/a/1.flac", "/music/a/2.flac", "/music/b/1.flac", "/music/c/1.flac"});
+
+        // Two albums by one artist, and one by another
+        const char *albums[] = {"First", "First", "Second", "Third"};
+        std::vector<CStorage::TrackTags> tags;
+        for (size_t i = 0; i < ids.size(); ++i)
+        {
+            CStorage::TrackTags track;
+            track.track = std::stol(ids[i]);
+            track.title = "Track " + std::to_string(i);
+            track.artist = i < 3 ? "Band" : "Other";
+            track.album = albums[i];
+            track.duration = 100 * (i + 1);
+            track.bytes = 1000 * (i + 1);
+            tags.push_back(track);
+        }
+        storage->SaveTags({tags[0], tags[1]});
+
+        playlist_id = library.AddPlaylist("test");
+        CPlaylist playlist(&library, playlist_id);
+        assert(playlist.GetDuration() == 0 && playlist.GetArtistCount() == 0);
+
+        // A track on twice counts twice, but its artist and album once
+        playlist.AppendTrack(ids[0]);
+        playlist.AppendTrack(ids[1]);
+        playlist.AppendTrack(ids[0]);
+        playlist.AppendTrack(ids[2]);
+        assert(std::abs(playlist.GetDuration() - 400) < 0.01 && playlist.GetSize() == 4000);
+        assert(playlist.GetArtistCount() == 1 && playlist.GetAlbumCount() == 1);
+
+        // Tagging a track that's already on it moves it over
+        storage->SaveTags({tags[2], tags[3]});
+        CPlaylist tagged(&library, playlist_id);
+        assert(std::abs(tagged.GetDuration() - 700) < 0.01 && tagged.GetSize() == 7000);
+        assert(tagged.GetArtistCount() == 1 && tagged.GetAlbumCount() == 2);
+
+        // Batched edits are added up on commit
+        {
+            CPlaylist::Batch batch(&playlist);
+            playlist.InsertTracks({ids[3], ids[3]}, "1");
+            playlist.RemoveRange("3", "2");
+            batch.Commit();
+        }
+        assert(playlist.GetTracks() == std::vector<std::string>({ids[3], ids[3], ids[0], ids[2]}));
+        assert(std::abs(playlist.GetDuration() - 1200) < 0.01 && playlist.GetSize() == 12000);
+        assert(playlist.GetArtistCount() == 2 && playlist.GetAlbumCount() == 3);
+
+        // and a batch rolled back leaves nothing behind
+        {
+            CPlaylist::Batch batch(&playlist);
+            playlist.RemoveRange("1", "4");
+            assert(playlist.GetTracks().empty());
+        }
+        assert(playlist.GetArtistCount() == 2 && playlist.GetSize() == 12000);
+
+        // Measuring a track changes its length everywhere it is
+        CStorage::TrackFeatures features;
+        features.track = std::stol(ids[3]);
+        features.decoded = true;
+        features.duration = 450;
+        storage->SaveFeatures({features});
+        CPlaylist measured(&library, playlist_id);
+        assert(std::abs(measured.GetDuration() - 1300) < 0.01);
+
+        // Taking the last of an album off drops it from the count
+        playlist.RemoveTrack("4");
+        assert(playlist.GetAlbumCount() == 2 && playlist.GetArtistCount() == 2);
+        library.RemoveTrack(ids[3]);
+        CPlaylist removed(&library, playlist_id);
+        assert(removed.GetTracks() == std::vector<std::string>({ids[0]}));
+        assert(std::abs(removed.GetDuration() - 100) < 0.01 && removed.GetSize() == 1000);
+        assert(removed.GetArtistCount() == 1 && removed.GetAlbumCount() == 1);
+
+        // The library playlist has everything that's left
+        CPlaylist all(&library, "1");
+        assert(std::abs(all.GetDuration() - 600) < 0.01 && all.GetSize() == 6000);
+        assert(all.GetArtistCount() == 1 && all.GetAlbumCount() == 2);
+
+        CPlaylist temp(&library);
+        temp.AppendTrack(ids[0]);
+        assert(temp.GetDuration() == 0);
+        storage->Vacuum();
+    }
+
+    // Kept
+    {
+        CLibrary library(TestStorage());
+        CPlaylist playlist(&library, playlist_id);
+        assert(std::abs(playlist.GetDuration() - 100) < 0.01 && playlist.GetSize() == 1000);
+        assert(playlist.GetArtistCount() == 1 && playlist.GetAlbumCount() == 1);
+        CStorage::PlaylistTotals all = library.GetStorage()->GetPlaylistTotals("1");
+        assert(all.tracks == 3 && all.bytes == 6000 && all.albums == 2);
+
+        library.RemovePlaylist(playlist_id);
+        assert(library.GetStorage()->GetPlaylistTotals(playlist_id).tracks == 0);
+        library.DestroyDatabase();
+    }
+}
+
+/**
+ * \brief Ensure runs of tracks can be inserted in one go
+ */
+void Test_Playlist_InsertTracks()
+{
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+
+    std::string playlist_id = library.AddPlaylist("test");
+    CPlaylist playlist(&library, playlist_id);
+    CPlaylist temp_playlist(&library);
+
+    playlist.AppendTrack("1");
+    playlist.AppendTrack("2");
+    playlist.InsertTracks({"3", "4", "5"}, "2");
+    playlist.InsertTracks({"6"}, "100"); // past the end, so it's appended
+
+    temp_playlist.InsertTracks({"3", "4"}, "1");
+
+    std::vector<std::string> expected = {"1", "3", "4", "5", "2", "6"};
+    assert(playlist.GetTracks() == expected);
+    assert(playlist.GetLength() == "6");
+    assert(!library.GetConnection() || StoredTracks(library.GetConnection(), playlist_id) == expected);
+
+    // The length is written once rather than by the trigger
+    CPlaylist reloaded(&library, playlist_id);
+    assert(reloaded.GetLength() == "6");
+    assert(reloaded.GetTracks() == expected);
+
+    assert(temp_playlist.GetTracks() == std::vector<std::string>({"3", "4"}));
+    assert(temp_playlist.GetLength() == "2");
+
+    // A sharded library's ids run past what an int holds; anything that isn't an id stops the lot
+    CPlaylist wide(&library, library.AddPlaylist("wide"));
+    std::vector<std::string> long_ids = {"4294967361", "68719476800"};
+    wide.InsertTracks(long_ids, "1");
+    wide.InsertTracks({"12345678901", "-1"}, "1");
+    wide.InsertTracks({"99999999999999999999"}, "1");
+    wide.InsertTracks({" 7"}, "1");
+    assert(wide.GetTracks() == long_ids);
+    assert(CPlaylist(&library, wide.GetId()).GetTracks() == long_ids);
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure runs of tracks can be removed in one go
+ */
+void Test_Playlist_RemoveRange()
+{
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+
+    std::string playlist_id = library.AddPlaylist("test");
+    CPlaylist playlist(&library, playlist_id);
+
+    playlist.InsertTracks({"1", "2", "3", "4", "5", "6"}, "1");
+
+    playlist.RemoveRange("2", "3");
+    playlist.RemoveRange("3", "10"); // runs off the end, so it's cut short
+    playlist.RemoveRange("0", "1");  // nothing lives at 0
+
+    std::vector<std::string> expected = {"1", "5"};
+    assert(playlist.GetTracks() == expected);
+    assert(playlist.GetLength() == "2");
+    assert(!library.GetConnection() || StoredTracks(library.GetConnection(), playlist_id) == expected);
+
+    CPlaylist reloaded(&library, playlist_id);
+    assert(reloaded.GetLength() == "2");
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure tracks and runs of tracks can be moved around
+ */
+void Test_Playlist_MoveRange()
+{
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+
+    std::string playlist_id = library.AddPlaylist("test");
+    CPlaylist playlist(&library, playlist_id);
+    CPlaylist temp_playlist(&library);
+
+    playlist.InsertTracks({"1", "2", "3", "4", "5", "6"}, "1");
+    temp_playlist.InsertTracks({"1", "2", "3", "4", "5", "6"}, "1");
+
+    playlist.MoveTrack("1", "3");      // 2 3 1 4 5 6
+    playlist.MoveRange("4", "3", "1"); // 4 5 6 2 3 1
+    playlist.MoveRange("2", "2", "5"); // 4 2 3 1 5 6
+
+    temp_playlist.MoveTrack("1", "3");
+    temp_playlist.MoveRange("4", "3", "1");
+    temp_playlist.MoveRange("2", "2", "5");
+
+    std::vector<std::string> expected = {"4", "2", "3", "1", "5", "6"};
+    assert(playlist.GetTracks() == expected);
+    assert(temp_playlist.GetTracks() == expected);
+    assert(!library.GetConnection() || StoredTracks(library.GetConnection(), playlist_id) == expected);
+
+    // Moves don't change the length
+    assert(playlist.GetLength() == "6");
 
     library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure a local library file comes back the way it was left
+ *
+ * This one always uses a local file, whichever storage the rest run against.
+ */
+void Test_LocalStorage_Reopen()
+{
+    const std::string path = "/tmp/musicmanager_reopen_test.mml";
+    remove(path.c_str());
+
+    std::string playlist_id;
+    {
+        CLibrary library(new CLocalStorage(path));
+        library.PrepareDatabase();
+
+        std::string track1_id = library.AddTrack(track1);
+        library.AddTrack(track2);
+
+        playlist_id = library.AddPlaylist(playlist1);
+        CPlaylist playlist(&library, playlist_id);
+        playlist.InsertTracks({"2", "1", "2"}, "1");
+        playlist.MoveTrack("1", "3");
+
+        // Nothing from a rolled back batch should make it to the file
+        CPlaylist::Batch batch(&playlist);
+        playlist.RemoveRange("1", "3");
+        library.RemoveTrack(track1_id);
+    }
+
+    {
+        CLibrary library(new CLocalStorage(path));
+        CPlaylist playlist(&library, playlist_id);
+        assert(playlist.GetTitle() == playlist1);
+        assert(playlist.GetTracks() == std::vector<std::string>({"1", "2", "2"}));
+
+        CPlaylist library_playlist(&library, "1");
+        assert(library_playlist.GetTracks() == std::vector<std::string>({"1", "2"}));
+
+        // New ids pick up where the file left off
+        assert(library.AddTrack(track1) == "3");
+    }
+
+    // A frame torn halfway through writing should be dropped, not misread
+    FILE *file = fopen(path.c_str(), "ab");
+    fwrite("\x40\0\0\0garbage", 1, 11, file);
+    fclose(file);
+
+    {
+        CLocalStorage *storage = new CLocalStorage(path);
+        CLibrary library(storage);
+        assert(library.GetStatus() == CONNECTION_OK);
 
-    cout << "OK" << endl;
+        CPlaylist library_playlist(&library, "1");
+        assert(library_playlist.GetTracks() == std::vector<std::string>({"1", "2", "3"}));
+
+        library_playlist.RemoveTrack("2");
+        assert(storage->Checkpoint() == 0);
+    }
+
+    {
+        CLibrary library(new CLocalStorage(path));
+        CPlaylist library_playlist(&library, "1");
+        assert(library_playlist.GetTracks() == std::vector<std::string>({"1", "3"}));
+        library.DestroyDatabase();
+    }
+
+    remove(path.c_str());
+}
+
+/**
+ * \brief Ensure a library comes back from a snapshot the way it went out
+ */
+void Test_Library_ExportImport()
+{
+    const std::string path = "/tmp/musicmanager_snapshot_test.mmlx";
+
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+
+    std::string track1_id = library.AddTrack(track1);
+    std::string track2_id = library.AddTrack(track2);
+    std::string track3_id = library.AddTrack(track1 + "\ttab\\slash");
+    library.RemoveTrack(track2_id);
+
+    std::string playlist_id = library.AddPlaylist(playlist1);
+    std::string empty_id = library.AddPlaylist("it's empty");
+    CPlaylist playlist(&library, playlist_id);
+    playlist.InsertTracks({track3_id, track1_id, track3_id}, "1");
+
+    assert(library.Export(path) == 0);
+
+    // Scribble over the library, then bring it back
+    library.DestroyDatabase();
+    library.PrepareDatabase();
+    library.AddTrack(track2);
+
+    assert(library.Import(path) == 0);
+
+    CPlaylist library_playlist(&library, "1");
+    assert(library_playlist.GetTitle() == "library");
+    assert(library_playlist.GetTracks() == std::vector<std::string>({track1_id, track3_id}));
+
+    CPlaylist restored(&library, playlist_id);
+    assert(restored.GetTitle() == playlist1);
+    assert(restored.GetTracks() == std::vector<std::string>({track3_id, track1_id, track3_id}));
+    assert(restored.GetLength() == "3");
+
+    CPlaylist empty(&library, empty_id);
+    assert(empty.GetTitle() == "it's empty");
+    assert(empty.GetTracks().empty());
+
+    // New ids carry on after the restored ones
+    assert(library.AddTrack(track2) == std::to_string(std::stoi(track3_id) + 1));
+
+    // Exporting again should give the same bytes back, paths and all
+    library.RemoveTrack(std::to_string(std::stoi(track3_id) + 1));
+    assert(library.Export(path + "2") == 0);
+    FILE *first = fopen(path.c_str(), "rb");
+    FILE *second = fopen((path + "2").c_str(), "rb");
+    int a, b;
+    do
+    {
+        a = fgetc(first);
+        b = fgetc(second);
+        assert(a == b);
+    } while (a != EOF);
+    fclose(first);
+    fclose(second);
+
+    // A damaged snapshot shouldn't be restored at all
+    FILE *file = fopen(path.c_str(), "r+b");
+    fseek(file, 40, SEEK_SET);
+    fputc('X', file);
+    fclose(file);
+    assert(library.Import(path) == -1);
+    assert(CPlaylist(&library, playlist_id).GetTracks().size() == 3);
+
+    remove(path.c_str());
+    remove((path + "2").c_str());
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure playlists survive a trip through M3U, PLS and XSPF files
+ */
+void Test_Playlist_ImportExport()
+{
+    const std::string directory = "/tmp/musicmanager_playlist_test/";
+    const std::string track3 = directory + "music/new & improved.mp3";
+    mkdir(directory.c_str(), 0755);
+
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+
+    std::string track1_id = library.AddTrack(track1);
+
+    // Comments, windows line endings, a relative path and a file uri for the same new track
+    FILE *file = fopen((directory + "in.m3u").c_str(), "wb");
+    fputs("\xEF\xBB\xBF#EXTM3U\r\n#EXTINF:123,Gregory And The Hawk - Boats & Birds\r\n", file);
+    fputs((track1 + "\r\n\r\n").c_str(), file);
+    fputs("music/new & improved.mp3\n", file);
+    fputs("file:///tmp/musicmanager_playlist_test/./music/new%20%26%20improved.mp3\n", file);
+    fputs((track1 + "\n").c_str(), file);
+    fclose(file);
+
+    CPlaylist playlist(&library, library.AddPlaylist(playlist1));
+    assert(playlist.Import(directory + "in.m3u") == 4);
+
+    // The new track went into the library once
+    CPlaylist library_playlist(&library, "1");
+    assert(library_playlist.GetTracks().size() == 2);
+    std::string track3_id = library_playlist.GetTracks()[1];
+
+    std::vector<std::string> expected = {track1_id, track3_id, track3_id, track1_id};
+    assert(playlist.GetTracks() == expected);
+    assert(playlist.GetLength() == "4");
+    assert(CPlaylist(&library, playlist.GetId()).GetTracks() == expected);
+    assert(!library.GetConnection() || StoredTracks(library.GetConnection(), playlist.GetId()) == expected);
+
+    // Each format reads back what was written to it
+    for (std::string name : {"out.m3u8", "out.pls", "out.xspf"})
+    {
+        assert(playlist.Export(directory + name) == 4);
+
+        CPlaylist copy(&library, library.AddPlaylist(name));
+        assert(copy.Import(directory + name) == 4);
+        assert(copy.GetTracks() == expected);
+
+        remove((directory + name).c_str());
+    }
+    assert(CPlaylist(&library, "1").GetTracks().size() == 2);
+
+    // Nothing to read, nothing changes
+    assert(playlist.Import(directory + "missing.m3u") == -1);
+    assert(playlist.GetTracks() == expected);
+
+    remove((directory + "in.m3u").c_str());
+    remove(directory.c_str());
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure histogram percentiles land within a bucket of the truth
+ */
+void Test_Histogram()
+{
+    CHistogram histogram;
+
+    assert(histogram.GetPercentile(50) == 0);
+
+    for (uint64_t value = 1; value <= 10000; ++value)
+    {
+        histogram.Record(value);
+    }
+
+    assert(histogram.GetCount() == 10000);
+    assert(histogram.GetMax() == 10000);
+    assert(histogram.GetMean() == 5000.5);
+
+    // Buckets are 1/16 of a power of two wide
+    uint64_t p50 = histogram.GetPercentile(50);
+    uint64_t p99 = histogram.GetPercentile(99);
+    assert(p50 >= 5000 && p50 <= 5000 + 5000 / 16);
+    assert(p99 >= 9900 && p99 <= 9900 + 9900 / 16);
+    assert(histogram.GetPercentile(100) == 10000);
+
+    // Small values are exact
+    histogram.Clear();
+    histogram.Record(3);
+    histogram.Record(7);
+    assert(histogram.GetPercentile(50) == 3);
+    assert(histogram.GetPercentile(100) == 7);
+}
+
+/// A row for Test_Query to read into
+struct QueryRow
+{
+    long id = 0;            ///< An int4 column
+    long long bytes = 0;    ///< An int8 column
+    double duration = 0;    ///< A float8 column
+    std::string title;      ///< A text column
+    std::vector<long> ids;  ///< An int8[] column
+};
+
+/**
+ * \brief Ensure statements count their placeholders, and values survive binary and back
+ *
+ * The result is made by hand, so this runs without a server.
+ */
+void Test_Query()
+{
+    static_assert(CountPlaceholders("SELECT 1") == 0);
+    static_assert(CountPlaceholders("SELECT $1, $2 WHERE x = $1") == 2);
+    static_assert(CountPlaceholders("SELECT '$3', $12") == 12);
+
+    static constexpr CStatement<Column<long>, long, std::string> statement{"test", "SELECT $1 WHERE $2 <> ''"};
+    assert(statement.GetTypes()[0] == PG_INT8);
+    assert(statement.GetTypes()[1] == PG_TEXT);
+
+    std::string title = "Ünïcode 'title'";
+    std::vector<long> ids = {3, -1, 1L << 40};
+    BoundParams<int, long long, double, std::string, std::vector<long>> bound(-7, 1LL << 33, 12.5, title, ids);
+    assert(bound.lengths[0] == 4 && bound.lengths[1] == 8 && bound.lengths[2] == 8);
+    assert(bound.values[3] == title.data());
+
+    // The same bytes, as the server would send them back
+    const Oid types[5] = {PG_INT4, PG_INT8, PG_FLOAT8, PG_TEXT, PG_INT8_ARRAY};
+    PGresAttDesc columns[5];
+    char name[] = "column";
+    for (int i = 0; i < 5; ++i)
+    {
+        columns[i] = {name, 0, 0, 1, types[i], -1, -1};
+    }
+
+    PGresult *res = PQmakeEmptyPGresult(nullptr, PGRES_TUPLES_OK);
+    PQsetResultAttrs(res, 5, columns);
+    for (int i = 0; i < 5; ++i)
+    {
+        PQsetvalue(res, 0, i, (char *)bound.values[i], bound.lengths[i]);
+    }
+    PQsetvalue(res, 1, 0, nullptr, -1);
+
+    typedef Columns<&QueryRow::id, &QueryRow::bytes, &QueryRow::duration, &QueryRow::title, &QueryRow::ids> Rows;
+    std::vector<QueryRow> rows;
+    assert(ReadRows<Rows>(res, rows) == 0);
+    assert(rows.size() == 2);
+    assert(rows[0].id == -7);
+    assert(rows[0].bytes == 1LL << 33);
+    assert(rows[0].duration == 12.5);
+    assert(rows[0].title == title);
+    assert(rows[0].ids == ids);
+
+    // NULLs leave the field alone
+    assert(rows[1].id == 0);
+    assert(rows[1].title.empty());
+
+    // Columns that don't fit are turned away
+    std::vector<long> wrong;
+    assert(ReadRows<Column<long>>(res, wrong) == -1);
+    typedef Columns<&QueryRow::title, &QueryRow::bytes, &QueryRow::duration, &QueryRow::id, &QueryRow::ids> Swapped;
+    assert(ReadRows<Swapped>(res, rows) == -1);
+
+    PQclear(res);
+}
+
+/**
+ * \brief Ensure operations and their statements are counted
+ */
+void Test_Library_Stats()
+{
+    const std::string path = "/tmp/musicmanager_stats_test.txt";
+
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+    library.ResetStats();
+
+    library.GetStats()->SetTraceSampling(1);
+
+    std::string track1_id = library.AddTrack(track1);
+    std::string track2_id = library.AddTrack(track2);
+    CPlaylist playlist(&library, library.AddPlaylist(playlist1));
+    playlist.AppendTrack(track1_id);
+    playlist.AppendTrack(track2_id);
+    playlist.RemoveTrack("1");
+
+    CStats::Snapshot stats = library.Stats();
+
+    const CStats::Operation &add = stats.operations.at("Library::AddTrack");
+    assert(add.calls == 2);
+    assert(add.statements >= 2);
+    assert(add.bytesSent > 0);
+    assert(add.latency.GetCount() == 2);
+
+    assert(stats.operations.at("Playlist::Load").calls == 1);
+    assert(stats.operations.at("Playlist::AppendTrack").calls == 2);
+
+    // RemoveTrack goes through RemoveRange, which is charged to RemoveTrack
+    assert(stats.operations.at("Playlist::RemoveTrack").calls == 1);
+    assert(stats.operations.at("Playlist::RemoveTrack").statements >= 1);
+    assert(stats.operations.count("Playlist::RemoveRange") == 0);
+
+    uint64_t statements = 0;
+    for (const auto &operation : stats.operations)
+    {
+        statements += operation.second.statements;
+    }
+    assert(stats.statements.GetCount() == statements);
+
+    // Every statement was traced, oldest first
+    assert(stats.traces.size() == statements);
+    assert(stats.traces.front().operation == "Library::AddTrack");
+    assert(!stats.traces.front().query.empty());
+
+    // Postgres only
+    if (library.GetConnection())
+    {
+        assert(stats.traces.front().query.find(track1) != std::string::npos);
+        assert(stats.operations.at("Playlist::Load").bytesReceived > 0);
+    }
+
+    remove(path.c_str());
+    assert(library.DumpStats(path) == 0);
+    FILE *file = fopen(path.c_str(), "r");
+    char line[256];
+    assert(fgets(line, sizeof(line), file) && std::string(line).find("operation") == 0);
+    fclose(file);
+    remove(path.c_str());
+
+    library.ResetStats();
+    assert(library.Stats().operations.empty());
+    assert(library.Stats().traces.empty());
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Local storage that can be told to fail to write listening history
+ */
+class CFailingHistory : public CLocalStorage
+{
+public:
+
+    /**
+     * \brief Constructor
+     * \param path Where the library file is
+     */
+    CFailingHistory(std::string path) : CLocalStorage(path, false) {}
+
+    /** \brief Writes the history, unless the test says to fail */
+    virtual int AppendHistory(const std::vector<PlayRecord> &events) override
+    {
+        return fail ? -1 : CLocalStorage::AppendHistory(events);
+    }
+
+    bool fail = false;          ///< Whether to fail
+};
+
+/**
+ * \brief Ensure listening history rolls up into per-track stats, and stays put
+ */
+void Test_Library_PlayHistory()
+{
+    // Mid January and early February 2026
+    const long long january = 1768435200;
+    const long long february = 1770681600;
+
+    std::string track1_id, track2_id;
+    {
+        CLibrary library(TestStorage());
+
+        // Make sure all tables and such exist
+        library.PrepareDatabase();
+
+        track1_id = library.AddTrack(track1);
+        track2_id = library.AddTrack(track2);
+
+        library.SetHistoryBatch(2);
+        library.RecordPlay(track1_id, CStorage::EVENT_PLAY, january);
+        library.RecordPlay(track1_id, CStorage::EVENT_COMPLETE, january + 200);
+        library.RecordPlay(track1_id, CStorage::EVENT_PLAY, february);
+        library.RecordPlay(track1_id, CStorage::EVENT_SKIP, february + 10);
+        library.RecordPlay(track2_id, CStorage::EVENT_PLAY, january + 60);
+
+        // Not a track, so not recorded
+        library.RecordPlay("nope", CStorage::EVENT_PLAY, january);
+
+        CStorage::TrackStats stats1 = library.GetTrackStats(track1_id);
+        assert(stats1.plays == 2);
+        assert(stats1.skips == 1);
+        assert(stats1.completions == 1);
+        assert(stats1.lastPlayed == february + 10);
+        assert(stats1.SkipRate() == 0.5);
+
+        // Postgres only
+        PGconn *conn = library.GetConnection();
+        if (conn)
+        {
+            PGresult *res_rows = PQexec(conn, "SELECT count(*) FROM play_history");
+            assert(std::string(PQgetvalue(res_rows, 0, 0)) == "5");
+            PQclear(res_rows);
+
+            PGresult *res_parts = PQexec(conn, "SELECT relname FROM pg_class WHERE relname LIKE 'play\\_history\\_%' AND relkind = 'r'");
+            assert(PQntuples(res_parts) == 2);
+            PQclear(res_parts);
+        }
+
+        // Left buffered on purpose; closing the library should write it out
+        library.SetHistoryBatch(100);
+        library.RecordPlay(track2_id, CStorage::EVENT_SKIP, february);
+    }
+
+    {
+        CLibrary library(TestStorage());
+
+        std::vector<CStorage::TrackStats> stats = library.GetTrackStats({track1_id, track2_id, "999"});
+        assert(stats.size() == 3);
+        assert(stats[0].plays == 2 && stats[0].lastPlayed == february + 10);
+        assert(stats[1].plays == 1 && stats[1].skips == 1 && stats[1].completions == 0);
+        assert(stats[1].lastPlayed == february);
+        assert(stats[2].plays == 0 && stats[2].lastPlayed == 0);
+        assert(stats[2].SkipRate() == 0);
+
+        // The history stays, but a removed track has no stats
+        library.RemoveTrack(track1_id);
+        assert(library.GetTrackStats(track1_id).plays == 0);
+
+        library.DestroyDatabase();
+    }
+
+    // A write that fails leaves the events buffered for the next one
+    if (!storage_path.empty())
+    {
+        CFailingHistory *storage = new CFailingHistory(TestPath(test_name + "_failing"));
+        CLibrary library(storage);
+        library.PrepareDatabase();
+        std::string id = library.AddTrack(track1);
+        library.SetHistoryBatch(100);
+        storage->fail = true;
+        library.RecordPlay(id, CStorage::EVENT_PLAY, january);
+        assert(library.FlushHistory() == -1);
+        storage->fail = false;
+        assert(library.FlushHistory() == 0);
+        assert(library.GetTrackStats(id).plays == 1);
+        library.DestroyDatabase();
+        DropTestStorage(test_name + "_failing");
+    }
+
+    // A shard that fails while another doesn't keeps its share, so nothing is counted twice
+    if (!storage_path.empty())
+    {
+        CFailingHistory *rest = new CFailingHistory(TestPath(test_name + "_rest"));
+        CShardedStorage *storage = new CShardedStorage(new CLocalStorage(TestPath(test_name + "_catalog"), false),
+            {{"/music/a/", new CLocalStorage(TestPath(test_name + "_a"), false)}, {"", rest}});
+        CLibrary library(storage);
+        library.PrepareDatabase();
+        std::string in_a = library.AddTrack("/music/a/1.flac");
+        std::string in_rest = library.AddTrack(track1);
+        library.SetHistoryBatch(100);
+        rest->fail = true;
+        library.RecordPlay(in_a, CStorage::EVENT_PLAY, january);
+        library.RecordPlay(in_rest, CStorage::EVENT_PLAY, january);
+        assert(library.FlushHistory() == 0);
+        library.RecordPlay(in_rest, CStorage::EVENT_SKIP, february);
+        assert(library.FlushHistory() == -1);
+        rest->fail = false;
+        std::vector<CStorage::TrackStats> stats = library.GetTrackStats({in_a, in_rest});
+        assert(stats[0].plays == 1);
+        assert(stats[1].plays == 1 && stats[1].skips == 1);
+        library.DestroyDatabase();
+        for (const char *part : {"_catalog", "_a", "_rest"})
+        {
+            DropTestStorage(test_name + part);
+        }
+    }
+}
+
+/**
+ * \brief Ensure suggestions follow the playlists, and keep following them as they change
+ */
+void Test_Library_Recommend()
+{
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+
+    std::vector<std::string> t;
+    for (int i = 0; i < 8; ++i)
+    {
+        t.push_back(library.AddTrack("/music/recommend/" + std::to_string(i) + ".flac"));
+    }
+
+    std::vector<std::vector<int>> lists = {{0, 1, 2}, {0, 1, 2}, {0, 1, 2, 3}, {4, 5}, {4, 5}, {4, 5, 6}};
+    std::vector<std::string> playlist_ids;
+    for (const auto &list : lists)
+    {
+        playlist_ids.push_back(library.AddPlaylist(playlist1));
+        CPlaylist playlist(&library, playlist_ids.back());
+        for (int i : list)
+        {
+            playlist.AppendTrack(t[i]);
+        }
+    }
+
+    // Nothing to go on yet
+    assert(library.Recommend({t[0]}, 3).empty());
+
+    assert(library.BuildRecommendations() == 0);
+
+    std::vector<std::string> picks = library.Recommend({t[0], t[1]}, 3);
+    assert(!picks.empty() && picks[0] == t[2]);
+    assert(std::find(picks.begin(), picks.end(), t[0]) == picks.end());
+    assert(std::find(picks.begin(), picks.end(), t[7]) == picks.end());
+
+    CPlaylist extended(&library, library.AddPlaylist(playlist1));
+    extended.AppendTrack(t[4]);
+    assert(extended.Extend("1") == 1);
+    assert(extended.GetTracks().size() == 2 && extended.GetTracks()[1] == t[5]);
+
+    // Tracks that are always skipped get marked down
+    assert(library.Recommend({t[0], t[1]}, 2) == std::vector<std::string>({t[2], t[3]}));
+    for (int i = 0; i < 4; ++i)
+    {
+        library.RecordPlay(t[2], CStorage::EVENT_PLAY);
+        library.RecordPlay(t[2], CStorage::EVENT_SKIP);
+    }
+    assert(library.Recommend({t[0], t[1]}, 2) == std::vector<std::string>({t[3], t[2]}));
+
+    // Edit things every way there is, then check nothing drifted from a fresh count
+    CPlaylist playlist(&library, playlist_ids[3]);
+    playlist.InsertTracks({t[7], t[2], t[7]}, "2");
+    playlist.RemoveRange("1", "2");
+    playlist.InsertTrack(t[0], "1");
+    {
+        CPlaylist::Batch batch(&playlist);
+        playlist.AppendTrack(t[3]);
+        playlist.RemoveTrack("1");
+    }
+    library.RemoveTrack(t[1]);
+    library.RemovePlaylist(playlist_ids[5]);
+
+    library.FlushHistory();
+    CRecommender fresh;
+    assert(fresh.Build(library.GetStorage()) == 0);
+    for (const std::string &track : t)
+    {
+        assert(library.Recommend({track}, 8) == fresh.Recommend({track}, 8));
+    }
+    picks = library.Recommend({t[0]}, 8);
+    assert(std::find(picks.begin(), picks.end(), t[1]) == picks.end());
+
+    library.DestroyDatabase();
+    assert(library.Recommend({t[0]}, 3).empty());
+}
+
+/**
+ * \brief Write a 16-bit WAVE file
+ * \param path Where to write it
+ * \param rate Sample rate
+ * \param channels Number of channels
+ * \param samples Interleaved samples, from -1 to 1
+ */
+static void WriteWav(const std::string &path, int rate, int channels, const std::vector<float> &samples)
+{
+    auto little = [](std::string &out, uint32_t value, int bytes)
+    {
+        for (int i = 0; i < bytes; ++i)
+        {
+            out += (char)(value >> (8 * i));
+        }
+    };
+
+    std::string data;
+    for (float sample : samples)
+    {
+        little(data, (uint16_t)(int16_t)lrintf(std::max(-1.0f, std::min(1.0f, sample)) * 32767), 2);
+    }
+
+    std::string file = "RIFF";
+    little(file, 36 + data.size(), 4);
+    file += "WAVEfmt ";
+    little(file, 16, 4);
+    little(file, 1, 2);
+    little(file, channels, 2);
+    little(file, rate, 4);
+    little(file, rate * channels * 2, 4);
+    little(file, channels * 2, 2);
+    little(file, 16, 2);
+    file += "data";
+    little(file, data.size(), 4);
+    file += data;
+
+    FILE *f = fopen(path.c_str(), "wb");
+    fwrite(file.data(), 1, file.size(), f);
+    fclose(f);
+}
+
+/**
+ * \brief Make a mono click track over a sustained triad
+ * \param bpm Clicks per minute
+ * \param root Frequency of the bottom note of the triad, in Hz
+ * \param third Semitones from the root to the middle note
+ * \returns 20 seconds of samples at 22050Hz
+ */
+static std::vector<float> ClickTrack(double bpm, double root, int third)
+{
+    const int rate = 22050;
+    std::vector<float> samples(rate * 20);
+    unsigned noise = 1;
+    size_t beat = (size_t)(rate * 60 / bpm);
+    for (size_t i = 0; i < samples.size(); ++i)
+    {
+        double t = (double)i / rate;
+        double sample = 0;
+        for (int semitones : {0, third, 7})
+        {
+            sample += 0.1 * sin(2 * M_PI * root * pow(2, semitones / 12.0) * t);
+        }
+        if (i % beat < rate / 50)
+        {
+            noise = noise * 1103515245 + 12345;
+            sample += 0.4 * ((noise >> 16 & 0x7fff) / 16384.0 - 1);
+        }
+        samples[i] = (float)sample;
+    }
+    return samples;
+}
+
+void Test_Analyzer()
+{
+    const std::string dir = "/tmp/musicmanager_test_analyzer_";
+    WriteWav(dir + "c_major_120.wav", 22050, 1, ClickTrack(120, 261.63, 4));
+    WriteWav(dir + "c_major_122.wav", 22050, 1, ClickTrack(122, 261.63, 4));
+    WriteWav(dir + "a_minor_90.wav", 22050, 1, ClickTrack(90, 220.00, 3));
+
+    std::vector<float> sine(48000 * 2 * 10);
+    for (size_t i = 0; i < sine.size(); ++i)
+    {
+        sine[i] = (float)(0.1 * sin(2 * M_PI * 997 * (i / 2) / 48000.0));
+    }
+    WriteWav(dir + "sine.wav", 48000, 2, sine);
+
+    // Straight from a decoder
+    CWavDecoder decoder;
+    CStorage::TrackFeatures features;
+    assert(decoder.Open(dir + "sine.wav") == 0);
+    assert(decoder.GetRate() == 48000 && decoder.GetChannels() == 2);
+    assert(CAnalyzer::Analyze(&decoder, features) == 0);
+    assert(features.decoded);
+    assert(fabsf(features.duration - 10) < 0.01f);
+    assert(fabsf(features.loudness + 20) < 0.2f);
+    assert(fabsf(features.peak + 20) < 0.1f);
+    assert(features.fingerprint.size() == CAnalyzer::FINGERPRINT_BANDS);
+    assert(decoder.Open(dir + "missing.wav") == -1);
+
+    assert(decoder.Open(dir + "c_major_120.wav") == 0);
+    assert(CAnalyzer::Analyze(&decoder, features) == 0);
+    assert(fabsf(features.bpm - 120) < 2);
+    assert(CAnalyzer::KeyName(features.key) == "C major");
+
+    assert(decoder.Open(dir + "a_minor_90.wav") == 0);
+    assert(CAnalyzer::Analyze(&decoder, features) == 0);
+    assert(fabsf(features.bpm - 90) < 2);
+    assert(CAnalyzer::KeyName(features.key) == "A minor");
+
+    // Through the library
+    CLibrary library(TestStorage());
+    library.PrepareDatabase();
+
+    std::string slow = library.AddTrack(dir + "a_minor_90.wav");
+    std::string missing = library.AddTrack(dir + "missing.wav");
+    std::string first = library.AddTrack(dir + "c_major_120.wav");
+    std::string compressed = library.AddTrack(dir + "compressed.mp3");
+    std::string close = library.AddTrack(dir + "c_major_122.wav");
+
+    CAnalyzer analyzer;
+    analyzer.SetThreads(2);
+    analyzer.SetChunk(2);
+    analyzer.SetDecoders([](const std::string &filepath) -> CDecoder *
+    {
+        return filepath.size() > 4 && filepath.substr(filepath.size() - 4) == ".wav" ? new CWavDecoder() : nullptr;
+    });
+    assert(analyzer.Run(library.GetStorage()) == 4);
+    // Everything it can do is done, and the mp3 is left for a decoder that can read it
+    assert(analyzer.Run(library.GetStorage()) == 0);
+
+    std::vector<CStorage::TrackFeatures> found = library.GetFeatures({first, missing, compressed, close});
+    assert(found[0].decoded && found[0].track == std::stol(first));
+    assert(found[1].track == std::stol(missing) && !found[1].decoded);
+    assert(found[2].track == 0);
+    assert(found[3].decoded);
+    assert(CAnalyzer::Distance(found[0], found[3]) < CAnalyzer::Distance(found[0], library.GetFeatures({slow})[0]));
+    assert(std::isinf(CAnalyzer::Distance(found[0], found[1])));
+
+    // Smooth ordering keeps the first track and puts what couldn't be heard last
+    CPlaylist playlist(&library, library.AddPlaylist(playlist1));
+    playlist.InsertTracks({first, missing, slow, close}, "1");
+    assert(playlist.OrderForTransitions() == 2);
+    assert(playlist.GetTracks() == std::vector<std::string>({first, close, slow, missing}));
+    assert(CPlaylist(&library, playlist.GetId()).GetTracks() == playlist.GetTracks());
+    assert(playlist.OrderForTransitions() == 0);
+
+    // Findings go with the track
+    library.RemoveTrack(close);
+    assert(library.GetFeatures({close})[0].track == 0);
+
+    library.DestroyDatabase();
+    for (const char *name : {"c_major_120.wav", "c_major_122.wav", "a_minor_90.wav", "sine.wav"})
+    {
+        remove((dir + name).c_str());
+    }
+}
+
+/**
+ * \brief Ensure a sync transcodes each track once, and after that only what changed
+ */
+void Test_Exporter()
+{
+    const std::string dir = "/tmp/musicmanager_test_exporter_" + std::to_string(getpid()) + "/";
+    const std::string album = dir + "Album/";
+    const std::string device = dir + "device/";
+    const std::string cache = dir + "cache";
+    mkdir(dir.c_str(), 0755);
+    mkdir(album.c_str(), 0755);
+
+    std::vector<float> tone(8000);
+    for (size_t i = 0; i < tone.size(); ++i)
+    {
+        tone[i] = (float)(0.2 * sin(2 * M_PI * 440 * i / 8000.0));
+    }
+    WriteWav(album + "one.wav", 8000, 1, tone);
+    WriteWav(album + "two.wav", 8000, 1, std::vector<float>(4000, 0.1f));
+    WriteWav(dir + "three.wav", 8000, 1, std::vector<float>(2000, -0.1f));
+
+    CExporter exporter;
+    exporter.SetFormat("wav", 0);
+    exporter.SetCache(cache);
+    exporter.SetThreads(2);
+
+    // Everything is transcoded once, however many times it's on the playlist
+    CExporter::Summary summary;
+    std::vector<std::string> tracks = {album + "one.wav", album + "two.wav", dir + "three.wav", album + "one.wav"};
+    assert(exporter.Sync("Road Trip", tracks, device, &summary) == 3);
+    assert(summary.transcoded == 3 && summary.copied == 0 && summary.skipped == 0 && summary.failed == 0);
+
+    CWavDecoder decoder;
+    std::vector<float> samples(8000);
+    assert(decoder.Open(device + "Album/one.wav") == 0);
+    assert(decoder.GetRate() == 8000 && decoder.GetChannels() == 1);
+    assert(decoder.Read(samples.data(), samples.size()) == 8000);
+    assert(fabsf(samples[10] - tone[10]) < 0.001f);
+    assert(decoder.Open(device + "musicmanager_test_exporter_" + std::to_string(getpid()) + "/three.wav") == 0);
+
+    std::vector<std::string> listed;
+    assert(CPlaylistFile(device + "Road Trip.m3u8").Read(listed) == 4);
+    assert(listed[0] == device + "Album/one.wav" && listed[3] == listed[0]);
+
+    // Nothing changed, so nothing is done
+    assert(exporter.Sync("Road Trip", tracks, device, &summary) == 3);
+    assert(summary.transcoded == 0 && summary.copied == 0 && summary.skipped == 3);
+
+    // Only the track that changed is transcoded again, even by a new exporter
+    WriteWav(album + "two.wav", 8000, 1, std::vector<float>(6000, 0.1f));
+    CExporter again;
+    again.SetFormat("wav", 0);
+    again.SetCache(cache);
+    assert(again.Sync("Road Trip", tracks, device, &summary) == 3);
+    assert(summary.transcoded == 1 && summary.skipped == 2);
+
+    // A file lost from the device comes back out of the cache
+    remove((device + "Album/one.wav").c_str());
+    assert(exporter.Sync("Road Trip", tracks, device, &summary) == 3);
+    assert(summary.transcoded == 0 && summary.copied == 1 && summary.skipped == 2);
+
+    // Tracks taken off the playlist are taken off the device, unless another playlist has them
+    assert(exporter.Sync("Other", {album + "one.wav"}, device, &summary) == 1);
+    assert(summary.skipped == 1);
+    assert(exporter.Sync("Road Trip", {album + "one.wav"}, device, &summary) == 1);
+    assert(summary.removed == 2);
+    struct stat info;
+    assert(stat((device + "Album/two.wav").c_str(), &info) != 0);
+    assert(exporter.Sync("Road Trip", {}, device, &summary) == 0);
+    assert(summary.removed == 0);
+    assert(stat((device + "Album/one.wav").c_str(), &info) == 0);
+
+    // A track that can't be read doesn't hold up the rest
+    assert(exporter.Sync("Other", {dir + "missing.wav", album + "one.wav"}, device, &summary) == 1);
+    assert(summary.failed == 1 && summary.skipped == 1);
+
+    // An unknown codec is refused
+    exporter.SetFormat("tape", 0);
+    assert(exporter.Sync("Other", tracks, device, &summary) == -1);
+
+    // Through a playlist, with the library's settings
+    CConfig config;
+    config.Set("export.codec", "wav");
+    config.Set("export.cache", cache);
+    CLibrary library(TestStorage(), config);
+    library.PrepareDatabase();
+    CPlaylist playlist(&library, library.AddPlaylist("Other"));
+    playlist.AppendTrack(library.AddTrack(album + "one.wav"));
+    playlist.AppendTrack(library.AddTrack(album + "two.wav"));
+    assert(playlist.Sync(device, &summary) == 2);
+    assert(summary.transcoded == 0 && summary.copied == 1 && summary.skipped == 1);
+    library.DestroyDatabase();
+
+    std::string remove_all = "rm -rf '" + dir + "'";
+    assert(system(remove_all.c_str()) == 0);
+}
+
+/// Steps taken by CCountJobs, by name
+static std::vector<std::string> count_log;
+
+/// Guards count_log
+static std::mutex count_log_mutex;
+
+/**
+ * \brief A job that counts, a step at a time, logging each step
+ */
+class CCountJob : public CJob
+{
+public:
+
+    /**
+     * \brief Constructor
+     * \param argument Name to log, a colon, then how many steps to take
+     * \param progress Steps taken so far
+     */
+    CCountJob(const std::string &argument, const std::string &progress)
+    {
+        mName = argument.substr(0, argument.find(':'));
+        mSteps = atoi(argument.substr(argument.find(':') + 1).c_str());
+        mProgress = progress.empty() ? "0" : progress;
+    }
+
+    /**
+     * \brief Take the next step
+     * \param library Unused
+     * \param turn Unused
+     * \returns 1 until it has taken all its steps
+     */
+    virtual int Step(CLibrary *library, CScheduler::Turn &turn) override
+    {
+        (void)library;
+        (void)turn;
+        {
+            std::lock_guard<std::mutex> lock(count_log_mutex);
+            count_log.push_back(mName);
+        }
+        int taken = atoi(mProgress.c_str()) + 1;
+        mProgress = std::to_string(taken);
+        return taken < mSteps ? 1 : 0;
+    }
+
+private:
+    std::string mName;  ///< Name to log
+    int mSteps;         ///< How many steps to take
+};
+
+void Test_Scheduler()
+{
+    long normalize, analyze, vacuum;
+    {
+        CLibrary library(TestStorage());
+        library.PrepareDatabase();
+        for (int i = 0; i < 20; ++i)
+        {
+            library.AddTrack("/tmp/musicmanager_test_scheduler_" + std::to_string(i) + ".wav");
+            library.AddPlaylist(playlist1);
+        }
+
+        CScheduler scheduler(&library);
+        assert(scheduler.Submit("nonsense") == -1);
+        normalize = scheduler.Submit("normalize");
+        analyze = scheduler.Submit("analyze", "", CScheduler::PRIORITY_LOW);
+        vacuum = scheduler.Submit("vacuum");
+        assert(normalize > 0 && analyze > 0 && vacuum > 0);
+
+        assert(scheduler.Cancel(vacuum));
+        assert(!scheduler.Cancel(vacuum));
+        assert(scheduler.GetState(vacuum) == CStorage::JOB_CANCELLED);
+        assert(scheduler.GetState(normalize) == CStorage::JOB_QUEUED);
+        // Never started, so the rest are left for next time
+    }
+
+    CLibrary library(TestStorage());
+    CScheduler scheduler(&library);
+    assert(scheduler.Resume() == 2);
+    assert(scheduler.Resume() == 0);
+    scheduler.Start(2);
+    scheduler.Wait();
+    assert(scheduler.GetState(normalize) == CStorage::JOB_DONE);
+    assert(scheduler.GetState(analyze) == CStorage::JOB_DONE);
+    {
+        CScheduler::Interactive interactive(&scheduler);
+        assert(library.GetStorage()->LoadJobs().empty());
+        CStorage::TrackFeatures features = library.GetFeatures({"20"})[0];
+        assert(features.track == 20 && !features.decoded);
+    }
+
+    // Higher priorities go first, and equal ones take turns
+    scheduler.Stop();
+    scheduler.Register("count", [](const std::string &argument, const std::string &progress) -> CJob *
+    {
+        return new CCountJob(argument, progress);
+    });
+    scheduler.Submit("count", "low:2", CScheduler::PRIORITY_LOW);
+    scheduler.Submit("count", "a:2");
+    scheduler.Submit("count", "b:2");
+    scheduler.Submit("count", "high:1", CScheduler::PRIORITY_HIGH);
+    scheduler.Start(1);
+    scheduler.Wait();
+    assert(count_log == std::vector<std::string>({"high", "a", "b", "a", "b", "low", "low"}));
+
+    // Interactive work holds every step off until it's done
+    count_log.clear();
+    long endless = scheduler.Submit("count", "endless:1000000000");
+    while (true)
+    {
+        std::lock_guard<std::mutex> lock(count_log_mutex);
+        if (count_log.size() > 10)
+        {
+            break;
+        }
+    }
+    {
+        CScheduler::Interactive interactive(&scheduler);
+        size_t steps = count_log.size();
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        assert(library.AddPlaylist(playlist1) != "");
+        assert(count_log.size() == steps);
+    }
+    assert(scheduler.Cancel(endless));
+    scheduler.Wait();
+    assert(scheduler.GetState(endless) == CStorage::JOB_CANCELLED);
+
+    // Steps are held to the rate, across workers
+    scheduler.Stop();
+    scheduler.SetRate(200);
+    scheduler.Start(4);
+    auto start = std::chrono::steady_clock::now();
+    scheduler.Submit("count", "one:5");
+    scheduler.Submit("count", "two:5");
+    scheduler.Wait();
+    assert(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(45));
+
+    scheduler.Stop();
+    assert(library.GetStorage()->LoadJobs().empty());
+    library.DestroyDatabase();
+}
+
+void Test_Library_PlaylistCache()
+{
+    CLibrary library(TestStorage());
+
+    // Make sure all tables and such exist
+    library.PrepareDatabase();
+    CPlaylistCache *cache = library.GetPlaylistCache();
+
+    std::vector<std::string> filepaths;
+    for (int i = 0; i < 1200; ++i)
+    {
+        filepaths.push_back("/music/cache/" + std::to_string(i) + ".flac");
+    }
+    std::vector<std::string> tracks = library.GetStorage()->AddTracks(filepaths);
+
+    std::string id = library.AddPlaylist(playlist1);
+    {
+        CPlaylist playlist(&library, id);
+        playlist.InsertTracks(tracks, "1");
+    }
+
+    // Opening it again doesn't go near the storage
+    cache->ResetCounters();
+    library.ResetStats();
+    {
+        CPlaylist playlist(&library, id);
+        assert(playlist.GetTracks() == tracks);
+        assert(playlist.GetTitle() == playlist1);
+        assert(playlist.GetLength() == "1200");
+    }
+    assert(cache->GetCounters().hits == 1 && cache->GetCounters().misses == 0);
+    assert(library.Stats().operations.at("Playlist::Load").statements == 0);
+    assert(cache->GetCounters().pages == 3);
+
+    // Pages hold a window onto it
+    std::string title, length;
+    std::vector<std::string> page;
+    assert(library.LoadPlaylistPage(id, 1, title, length, page));
+    assert(page == std::vector<std::string>(tracks.begin() + 512, tracks.begin() + 1024));
+    assert(library.LoadPlaylistPage(id, 3, title, length, page) && page.empty() && length == "1200");
+    assert(library.Stats().operations.at("Library::LoadPlaylistPage").statements == 0);
+    assert(!library.LoadPlaylist("99999", title, length, page));
+
+    // Changes made through one playlist aren't undone by another one going away
+    {
+        CPlaylist stale(&library, id);
+        CPlaylist fresh(&library, id);
+        fresh.RemoveRange("1", "10");
+    }
+    {
+        CPlaylist playlist(&library, id);
+        assert(playlist.GetTracks().size() == 1190 && playlist.GetTracks()[0] == tracks[10]);
+    }
+
+    // A rolled back batch leaves what's in the storage
+    {
+        CPlaylist playlist(&library, id);
+        CPlaylist::Batch batch(&playlist);
+        playlist.RemoveRange("1", "100");
+    }
+    {
+        CPlaylist playlist(&library, id);
+        assert(playlist.GetTracks().size() == 1190);
+    }
+
+    // Removing a track reaches every playlist
+    library.RemoveTrack(tracks[500]);
+    {
+        CPlaylist playlist(&library, id);
+        assert(playlist.GetTracks().size() == 1189);
+        assert(std::find(playlist.GetTracks().begin(), playlist.GetTracks().end(), tracks[500]) == playlist.GetTracks().end());
+    }
+    {
+        CPlaylist playlist(&library, "1");
+        assert(playlist.GetTracks().size() == 1199);
+        library.AddTrack(track1);
+    }
+    {
+        CPlaylist playlist(&library, "1");
+        assert(playlist.GetTracks().size() == 1200);
+    }
+
+    // Only as much is held as there's budget for
+    cache->ResetCounters();
+    cache->SetBudget(64 << 10);
+    CPlaylistCache::Counters counters = cache->GetCounters();
+    assert(counters.bytes <= counters.budget);
+    assert(counters.evictions > 0);
+    for (size_t i = 0; i < 3; ++i)
+    {
+        assert(library.LoadPlaylistPage(id, i, title, length, page));
+        assert(cache->GetCounters().bytes <= 64 << 10);
+    }
+    cache->SetBudget(CPlaylistCache::DEFAULT_BUDGET);
+
+    library.DestroyDatabase();
+    assert(cache->GetCounters().headers == 0);
+}
+
+/**
+ * \brief Ensure settings come from defaults, files and the environment, and reach the library
+ */
+void Test_Config()
+{
+    CConfig config;
+    assert(config.GetInt("history.batch") == 512);
+    assert(config.GetInt("cache.playlist_bytes") == (long)CPlaylistCache::DEFAULT_BUDGET);
+    assert(config.Set("history.batchh", "4") == -1);
+    assert(config.Set("no equals sign") == -1);
+    assert(config.Set(" scheduler.rate =  2.5 ") == 0);
+    assert(config.GetDouble("scheduler.rate") == 2.5);
+    assert(CConfig::EnvironmentName("db.statement_timeout") == "MUSICMANAGER_DB_STATEMENT_TIMEOUT");
+
+    // Nothing to connect to is given by default, so libpq's environment decides
+    assert(config.ConnectionString() == "connect_timeout='10'");
+
+    // Values are quoted, so spaces and quotes in a password are fine
+    config.Set("db.name", "music");
+    config.Set("db.host", "");
+    config.Set("db.user", "matt");
+    config.Set("db.password", "it's a \\secret");
+    config.Set("db.connect_timeout", "");
+    assert(config.ConnectionString() == "dbname='music' user='matt' password='it\\'s a \\\\secret'");
+    config.Set("db.conninfo", "postgresql:///scratch");
+    assert(config.ConnectionString() == "postgresql:///scratch");
+
+    // A file, with a bad line that doesn't stop the rest being read
+    std::string path = "/tmp/musicmanager_test.conf";
+    FILE *file = fopen(path.c_str(), "w");
+    assert(file);
+    fputs("# Tuned for a big library\n\nhistory.batch = 3\ncache.playlist_bytes=0\nnot.a.setting = 1\n", file);
+    fclose(file);
+    assert(config.Load(path) == -1);
+    assert(config.GetInt("history.batch") == 3);
+    assert(config.GetInt("cache.playlist_bytes") == 0);
+    remove(path.c_str());
+    assert(config.Load(path) == -1);
+
+    // The environment wins over the file
+    setenv("MUSICMANAGER_HISTORY_BATCH", "7", 1);
+    assert(config.LoadEnvironment() == 1);
+    assert(config.GetInt("history.batch") == 7);
+    unsetenv("MUSICMANAGER_HISTORY_BATCH");
+
+    // The library picks up its knobs
+    config.Set("history.batch", "2");
+    config.Set("cache.playlist_bytes", "4096");
+    CLibrary library(TestStorage(), config);
+    library.PrepareDatabase();
+    assert(library.GetPlaylistCache()->GetCounters().budget == 4096);
+    assert(library.GetConfig().GetInt("history.batch") == 2);
+
+    std::string track = library.AddTrack(track1);
+    library.RecordPlay(track, CStorage::EVENT_PLAY);
+    assert(library.GetStorage()->GetTrackStats({track})[0].plays == 0);
+    library.RecordPlay(track, CStorage::EVENT_COMPLETE);
+    assert(library.GetStorage()->GetTrackStats({track})[0].plays == 1);
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure tracks and playlists stream back in order, and a stream can be left part way
+ */
+void Test_Library_Stream()
+{
+    const std::string path = "/tmp/musicmanager_stream_test.m3u";
+
+    CLibrary library(TestStorage());
+    library.PrepareDatabase();
+
+    std::vector<std::string> filepaths;
+    for (int i = 0; i < 1000; ++i)
+    {
+        filepaths.push_back("/music/stream/" + std::to_string(999 - i) + ".flac");
+    }
+    std::vector<std::string> ids = library.GetStorage()->AddTracks(filepaths);
+
+    // The whole library, by id
+    size_t seen = 0;
+    for (const CStorage::TrackRecord &track : library.StreamTracks())
+    {
+        assert(std::to_string(track.id) == ids[seen]);
+        assert(track.filepath == filepaths[seen]);
+        ++seen;
+    }
+    assert(seen == ids.size());
+
+    // A playlist, by position, with the filepaths that aren't held in a CPlaylist
+    CPlaylist playlist(&library, library.AddPlaylist(playlist1));
+    std::vector<std::string> order(ids.rbegin(), ids.rend());
+    playlist.InsertTracks(order, "1");
+    seen = 0;
+    for (const CStorage::EntryRecord &entry : playlist.Stream())
+    {
+        assert(entry.position == (long)seen + 1);
+        assert(std::to_string(entry.track) == order[seen]);
+        assert(entry.filepath == filepaths[ids.size() - 1 - seen]);
+        ++seen;
+    }
+    assert(seen == order.size());
+
+    // Leaving part way frees the library up again
+    for (const CStorage::EntryRecord &entry : library.StreamPlaylist("1"))
+    {
+        if (entry.position == 3)
+        {
+            break;
+        }
+    }
+    assert(library.AddTrack(track1) != "");
+
+    // Nothing to stream
+    assert(library.StreamPlaylist("999999").begin() == CStream<CStorage::EntryRecord>::Iterator());
+    assert(library.ExportPlaylist("999999", path) == -1);
+
+    // Exporting streams too, and reads back the same
+    assert(library.ExportPlaylist(playlist.GetId(), path) == 1000);
+    CPlaylist copy(&library, library.AddPlaylist("copy"));
+    assert(copy.Import(path) == 1000);
+    assert(copy.GetTracks() == playlist.GetTracks());
+    remove(path.c_str());
+
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Ensure moving a directory rewrites the filepaths under it, and only those
+ */
+void Test_Library_RelocateRoot()
+{
+    std::vector<std::string> filepaths = {"/mnt/old/music/a/1.flac", "/mnt/old/music/a/2.flac",
+                                          "/mnt/old/music/b/c/3.flac", "/mnt/old/musical/4.flac",
+                                          "/mnt/new/music/a/5.flac"};
+    std::vector<std::string> moved = {"/mnt/new/music/a/1.flac", "/mnt/new/music/a/2.flac",
+                                      "/mnt/new/music/b/c/3.flac", "/mnt/old/musical/4.flac",
+                                      "/mnt/new/music/a/5.flac"};
+    std::vector<std::string> ids;
+    std::string added;
+    {
+        CLibrary library(TestStorage());
+        library.PrepareDatabase();
+        CStorage *storage = library.GetStorage();
+        ids = storage->AddTracks(filepaths);
+
+        // Whole directories only, merging into one that's already there, and the ids stay put
+        assert(library.RelocateRoot("/mnt/old/music", "/mnt/new/music/") == 3);
+        assert(storage->FindFilepaths(ids) == moved);
+        assert(storage->FindTracks(moved) == ids);
+        assert(storage->FindTracks({filepaths[0]})[0] == "");
+        assert(CPlaylist(&library, "1").GetTracks() == ids);
+
+        added = library.AddTrack("/mnt/new/music/a/6.flac");
+        assert(storage->FindTracks({"/mnt/new/music/a/6.flac"})[0] == added);
+
+        // Into a directory of its own
+        assert(library.RelocateRoot("/mnt/new/", "/mnt/new/nested/") == 5);
+        assert(storage->FindFilepaths({ids[0], added})
+               == std::vector<std::string>({"/mnt/new/nested/music/a/1.flac", "/mnt/new/nested/music/a/6.flac"}));
+
+        assert(library.RelocateRoot("/nowhere", "/elsewhere") == 0);
+        assert(library.RelocateRoot("", "/elsewhere") == -1);
+    }
+
+    // Kept, and back out again
+    {
+        CLibrary library(TestStorage());
+        CStorage *storage = library.GetStorage();
+        assert(storage->FindFilepaths({ids[4]})[0] == "/mnt/new/nested/music/a/5.flac");
+        assert(library.RelocateRoot("/mnt/new/nested/", "/mnt/new/") == 5);
+        assert(storage->FindFilepaths(ids) == moved);
+
+        size_t seen = 0;
+        for (const CStorage::TrackRecord &track : library.StreamTracks())
+        {
+            assert(track.filepath == (seen < moved.size() ? moved[seen] : "/mnt/new/music/a/6.flac"));
+            ++seen;
+        }
+        assert(seen == moved.size() + 1);
+
+        // Down into itself, through directories that haven't moved out of the way yet
+        std::vector<std::string> more = storage->AddTracks({"/r/1.flac", "/r/r/2.flac", "/r/r/r/3.flac",
+                                                            "/s/x/4.flac", "/s/y/5.flac", "/t/x/6.flac"});
+        assert(library.RelocateRoot("/r/", "/r/r/") == 3);
+        assert(storage->FindFilepaths(more) == std::vector<std::string>({"/r/r/1.flac", "/r/r/r/2.flac",
+               "/r/r/r/r/3.flac", "/s/x/4.flac", "/s/y/5.flac", "/t/x/6.flac"}));
+
+        // Back up out of it
+        assert(library.RelocateRoot("/r/r/", "/r/") == 3);
+        assert(storage->FindFilepaths({more[0], more[1], more[2]})
+               == std::vector<std::string>({"/r/1.flac", "/r/r/2.flac", "/r/r/r/3.flac"}));
+
+        // Onto a directory that's already there and stays put, next to one that isn't
+        assert(library.RelocateRoot("/s/", "/t/") == 2);
+        assert(storage->FindFilepaths({more[3], more[4], more[5]})
+               == std::vector<std::string>({"/t/x/4.flac", "/t/y/5.flac", "/t/x/6.flac"}));
+        assert(storage->FindTracks({"/t/x/4.flac", "/t/x/6.flac", "/s/x/4.flac"})
+               == std::vector<std::string>({more[3], more[5], ""}));
+        library.DestroyDatabase();
+    }
+}
+
+/**
+ * \brief Ensure a library spread over shards by root reads back like one in a single storage
+ */
+void Test_ShardedStorage()
+{
+    const std::string path = "/tmp/musicmanager_sharded_test.mmlx";
+    const std::vector<std::string> parts = {"_catalog", "_a", "_b", "_rest"};
+    for (const std::string &part : parts)
+    {
+        DropTestStorage(test_name + part);
+    }
+
+    CShardedStorage *storage = new CShardedStorage(TestStorage("_catalog"),
+        {{"/music/a/", TestStorage("_a")}, {"/music/b/", TestStorage("_b")}, {"", TestStorage("_rest")}});
+    CLibrary library(storage);
+    library.PrepareDatabase();
+    assert(storage->GetStatus() == CONNECTION_OK);
+
+    // The longest root wins, and anything else goes to the catch-all
+    assert(storage->ShardFor("/music/a/1.flac") == 0);
+    assert(storage->ShardFor("/music/b/1.flac") == 1);
+    assert(storage->ShardFor("/elsewhere/1.flac") == 2);
+
+    std::vector<std::string> filepaths;
+    for (int i = 0; i < 300; ++i)
+    {
+        filepaths.push_back(std::string(i % 3 == 0 ? "/music/a/" : i % 3 == 1 ? "/music/b/" : "/other/")
+                            + std::to_string(i) + ".flac");
+    }
+    std::vector<std::string> ids = storage->AddTracks(filepaths);
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        assert(CShardedStorage::ShardOf(std::stol(ids[i])) == i % 3);
+    }
+    std::string single = library.AddTrack(track1);
+    assert(CShardedStorage::ShardOf(std::stol(single)) == 2);
+
+    // Lookups come back in the order asked, whichever shard answered
+    assert(storage->FindTracks(filepaths) == ids);
+    assert(storage->FindFilepaths(ids) == filepaths);
+    assert(storage->FindFilepaths({"not a track", ids[1]}) == std::vector<std::string>({"", filepaths[1]}));
+
+    // The library playlist and any other can mix shards
+    std::vector<std::string> all = ids;
+    all.push_back(single);
+    assert(CPlaylist(&library, "1").GetTracks() == all);
+
+    CPlaylist playlist(&library, library.AddPlaylist(playlist1));
+    std::vector<std::string> order(ids.rbegin(), ids.rend());
+    playlist.InsertTracks(order, "1");
+    size_t seen = 0;
+    for (const CStorage::EntryRecord &entry : playlist.Stream())
+    {
+        assert(std::to_string(entry.track) == order[seen]);
+        assert(entry.filepath == filepaths[ids.size() - 1 - seen]);
+        ++seen;
+    }
+    assert(seen == order.size());
+
+    // Every shard's tracks, merged by global id
+    long last = 0;
+    seen = 0;
+    for (const CStorage::TrackRecord &track : library.StreamTracks())
+    {
+        assert(track.id > last);
+        last = track.id;
+        ++seen;
+    }
+    assert(seen == all.size());
+
+    // History and features stay with the track
+    library.RecordPlay(ids[4], CStorage::EVENT_PLAY);
+    library.FlushHistory();
+    std::vector<CStorage::TrackStats> stats = storage->GetTrackStats({ids[3], ids[4]});
+    assert(stats[0].plays == 0 && stats[1].plays == 1);
+
+    CStorage::TrackFeatures features;
+    features.track = std::stol(ids[5]);
+    features.decoded = true;
+    features.bpm = 120;
+    storage->SaveFeatures({features});
+    assert(storage->GetFeatures({ids[5]})[0].track == features.track);
+    assert(storage->GetFeatures({ids[5]})[0].bpm == 120);
+    std::vector<CStorage::TrackRecord> unanalyzed = storage->FindUnanalyzed(0, all.size());
+    assert(unanalyzed.size() == all.size() - 1);
+    assert(storage->FindUnanalyzed(unanalyzed[9].id, 10).front().id == unanalyzed[10].id);
+
+    // A shard's root moves with its tracks, but tracks can't move under another shard's root
+    assert(library.RelocateRoot("/music/a", "/archive/a") == 100);
+    assert(storage->ShardFor("/archive/a/0.flac") == 0);
+    assert(storage->FindTracks({"/archive/a/0.flac"})[0] == ids[0]);
+    assert(library.RelocateRoot("/other", "/music/b") == -1);
+    assert(storage->FindFilepaths({ids[2]})[0] == filepaths[2]);
+    assert(library.RelocateRoot("/archive/a/x", "/other/x") == -1);
+    assert(storage->FindFilepaths({ids[0]})[0] == "/archive/a/0.flac");
+    assert(library.RelocateRoot("/archive/a", "/music/a") == 100);
+    assert(storage->FindTracks(filepaths) == ids);
+
+    // Removing a track takes it out of its shard and the catalog
+    library.RemoveTrack(ids[7]);
+    assert(storage->FindFilepaths({ids[7]})[0] == "");
+    assert(CPlaylist(&library, playlist.GetId()).GetTracks().size() == order.size() - 1);
+
+    // A snapshot puts every track back in the shard it came from
+    std::vector<std::string> before = CPlaylist(&library, playlist.GetId()).GetTracks();
+    assert(library.Export(path) == 0);
+    library.DestroyDatabase();
+    library.PrepareDatabase();
+    assert(library.Import(path) == 0);
+    assert(CPlaylist(&library, playlist.GetId()).GetTracks() == before);
+    assert(storage->FindFilepaths({ids[0], ids[1], ids[2]})
+           == std::vector<std::string>({filepaths[0], filepaths[1], filepaths[2]}));
+    assert(storage->GetShard(1)->FindTracks({filepaths[1]})[0] == std::to_string(CShardedStorage::LocalId(std::stol(ids[1]))));
+    remove(path.c_str());
+    library.DestroyDatabase();
+
+    // Without a catch-all, a filepath under no root is refused rather than put in some shard
+    {
+        CShardedStorage *rooted = new CShardedStorage(TestStorage("_catalog"), {{"/music/a/", TestStorage("_a")}});
+        CLibrary strict(rooted);
+        strict.PrepareDatabase();
+        assert(rooted->ShardFor("/elsewhere/1.flac") == CShardedStorage::NO_SHARD);
+        assert(strict.AddTrack("/elsewhere/1.flac") == "");
+        std::vector<std::string> added = rooted->AddTracks({"/elsewhere/2.flac", filepaths[0]});
+        assert(added[0] == "" && CShardedStorage::ShardOf(std::stol(added[1])) == 0);
+        assert(rooted->FindTracks({"/elsewhere/2.flac", filepaths[0]}) == added);
+        assert(CPlaylist(&strict, "1").GetTracks() == std::vector<std::string>({added[1]}));
+        assert(strict.RelocateRoot("/music/a/x", "/elsewhere/x") == -1);
+        strict.DestroyDatabase();
+    }
+
+    // The same from settings, with the library files as shards
+    if (!storage_path.empty())
+    {
+        CConfig config;
+        config.Set("storage.local", TestPath(test_name + "_catalog"));
+        config.Set("storage.shards", "/music/a/=" + TestPath(test_name + "_a") + ";=" + TestPath(test_name + "_rest"));
+        CLibrary configured(config);
+        configured.PrepareDatabase();
+        CShardedStorage *sharded = dynamic_cast<CShardedStorage *>(configured.GetStorage());
+        assert(sharded && sharded->GetShardCount() == 2);
+        assert(CShardedStorage::ShardOf(std::stol(configured.AddTrack(filepaths[0]))) == 0);
+        assert(CShardedStorage::ShardOf(std::stol(configured.AddTrack(filepaths[1]))) == 1);
+        configured.DestroyDatabase();
+    }
+
+    for (const std::string &part : parts)
+    {
+        DropTestStorage(test_name + part);
+    }
+}
+
+/**
+ * \brief Local storage whose log positions a test sets, to stand in for a primary or a standby
+ */
+class CTestPositions : public CLocalStorage
+{
+public:
+
+    /**
+     * \brief Constructor
+     * \param path Where the library file is
+     */
+    CTestPositions(std::string path) : CLocalStorage(path, false) {}
+
+    /** \brief Returns what the test says the write position is */
+    virtual long long GetWritePosition() override { ++asked; return written; }
+
+    /** \brief Returns what the test says the replay position is */
+    virtual long long GetReplayPosition() override { ++asked; return replayed; }
+
+    long long written = 0;      ///< Write position to give
+    long long replayed = 0;     ///< Replay position to give
+    int asked = 0;              ///< Times either position was asked for
+};
+
+/**
+ * \brief Ensure reads go to a standby only once it has caught up with this library's writes
+ */
+void Test_ReplicatedStorage()
+{
+    const std::string primary_path = TestPath(test_name + "_primary");
+    const std::string standby_path = TestPath(test_name + "_standby");
+    remove(primary_path.c_str());
+    remove(standby_path.c_str());
+
+    // The standby starts as a copy of the primary, and never sees its writes after that
+    std::string first_id;
+    {
+        CLocalStorage seed(primary_path, false);
+        seed.PrepareDatabase();
+        first_id = seed.AddTrack(track1);
+    }
+    {
+        FILE *from = fopen(primary_path.c_str(), "rb");
+        FILE *to = fopen(standby_path.c_str(), "wb");
+        int c;
+        while ((c = fgetc(from)) != EOF)
+        {
+            fputc(c, to);
+        }
+        fclose(from);
+        fclose(to);
+    }
+
+    CTestPositions *primary = new CTestPositions(primary_path);
+    CTestPositions *standby = new CTestPositions(standby_path);
+    primary->written = 100;
+    standby->replayed = 100;
+    CReplicatedStorage *storage = new CReplicatedStorage(primary, {standby});
+    CLibrary library(storage);
+
+    // Nothing written yet, so the standby has everything this library has seen
+    assert(library.GetStorage()->FindTracks({track1})[0] == first_id);
+    assert(storage->GetStandbyReads() == 1 && storage->GetPrimaryReads() == 0);
+
+    // After a write, reads stay on the primary until the standby gets there
+    std::string second_id = library.AddTrack(track2);
+    primary->written = 200;
+    assert(library.GetStorage()->FindTracks({track2})[0] == second_id);
+    assert(storage->GetPrimaryReads() == 1);
+    assert(CPlaylist(&library, "1").GetTracks() == std::vector<std::string>({first_id, second_id}));
+    assert(storage->GetPrimaryReads() == 2);
+
+    // Once it has, reads go back to it, without asking either again
+    standby->replayed = 200;
+    int asked = primary->asked + standby->asked;
+    assert(library.GetStorage()->FindTracks({track2})[0] == "");
+    assert(storage->GetStandbyReads() == 2);
+    assert(library.GetStorage()->FindFilepaths({first_id})[0] == track1);
+    assert(storage->GetStandbyReads() == 3);
+    assert(primary->asked + standby->asked == asked + 1);
+
+    // A batch reads its own edits
+    CPlaylist playlist(&library, library.AddPlaylist(playlist1));
+    primary->written = 300;
+    standby->replayed = 300;
+    bool outer = library.GetStorage()->BeginBatch();
+    library.GetStorage()->AppendTrack(playlist.GetId(), first_id);
+    std::string title, length;
+    std::vector<std::string> tracks;
+    assert(library.GetStorage()->LoadPlaylist(playlist.GetId(), title, length, tracks));
+    assert(tracks == std::vector<std::string>({first_id}));
+    library.GetStorage()->CommitBatch(playlist.GetId(), outer);
+
+    // If the primary can't say where it's got to, nothing is risked on the standby
+    primary->written = -1;
+    library.GetStorage()->AddTrack(track1 + ".2");
+    long reads = storage->GetStandbyReads();
+    library.GetStorage()->FindPlaylists(0, 10);
+    assert(storage->GetStandbyReads() == reads);
+
+    // Jobs always come from the primary
+    CStorage::JobRecord job;
+    job.kind = "test";
+    assert(library.GetStorage()->AddJob(job) > 0);
+    assert(library.GetStorage()->LoadJobs().size() == 1);
+
+    library.DestroyDatabase();
+    remove(primary_path.c_str());
+    remove(standby_path.c_str());
+}
+
+/**
+ * \brief Returns an ID3v2 or MP4 size field
+ * \param value The size
+ * \param bytes How many bytes it takes
+ * \param syncsafe Whether it's 7 bits to a byte, as ID3v2.4 and tag headers have
+ */
+static std::string SizeField(size_t value, int bytes, bool syncsafe = false)
+{
+    std::string field;
+    for (int i = bytes - 1; i >= 0; --i)
+    {
+        field.push_back((char)(syncsafe ? (value >> (7 * i)) & 0x7f : (value >> (8 * i)) & 0xff));
+    }
+    return field;
+}
+
+/**
+ * \brief Returns an MP4 atom
+ * \param type Its four letter type
+ * \param body What's in it
+ */
+static std::string Atom(const std::string &type, const std::string &body)
+{
+    return SizeField(body.size() + 8, 4) + type + body;
+}
+
+/**
+ * \brief Ensure album art comes out of ID3 and MP4 tags, and is kept once per image however many albums share it
+ */
+void Test_Artwork()
+{
+    const std::string directory = "/tmp/musicmanager_artwork_test_" + std::to_string(getpid()) + "/";
+    const std::string store_path = TestPath(test_name + "_art");
+    mkdir(directory.c_str(), 0755);
+    for (const char *album : {"id3v23", "id3v22", "id3v24", "mp4", "copy", "none"})
+    {
+        mkdir((directory + album).c_str(), 0755);
+    }
+    remove(store_path.c_str());
+
+    auto write = [](const std::string &path, const std::string &contents)
+    {
+        FILE *file = fopen(path.c_str(), "wb");
+        fwrite(contents.data(), 1, contents.size(), file);
+        fclose(file);
+    };
+    const std::string cover = std::string("\x89PNG front \xff\x00 cover", 19);
+    const std::string back = "JPEG back";
+
+    // ID3v2.3: a back cover, then the front one with a UTF-16 description
+    std::string apic_back = std::string("\0image/jpeg\0\x04" "back\0", 18) + back;
+    std::string apic_front = std::string("\x01image/png\0\x03\xff\xfe" "F\0\0\0", 18) + cover;
+    std::string v23 = "TIT2" + SizeField(4, 4) + std::string("\0\0\0Hi", 6)
+                      + "APIC" + SizeField(apic_back.size(), 4) + std::string(2, '\0') + apic_back
+                      + "APIC" + SizeField(apic_front.size(), 4) + std::string(2, '\0') + apic_front
+                      + std::string(32, '\0');
+    write(directory + "id3v23/1.mp3", "ID3" + std::string("\x03\0\0", 3) + SizeField(v23.size(), 4, true) + v23 + "audio");
+
+    // ID3v2.2: PIC with a three letter format
+    std::string pic = std::string("\0PNG\x03\0", 6) + cover;
+    std::string v22 = "PIC" + SizeField(pic.size(), 3);
+    v22 += pic;
+    write(directory + "id3v22/1.mp3", "ID3" + std::string("\x02\0\0", 3) + SizeField(v22.size(), 4, true) + v22);
+
+    // ID3v2.4: an unsynchronised frame with its data length up front
+    std::string synced;
+    for (char c : apic_front)
+    {
+        synced.push_back(c);
+        if ((unsigned char)c == 0xff)
+        {
+            synced.push_back('\0');
+        }
+    }
+    std::string v24_body = SizeField(apic_front.size(), 4, true) + synced;
+    std::string v24 = "APIC" + SizeField(v24_body.size(), 4, true) + std::string("\0\x03", 2) + v24_body;
+    write(directory + "id3v24/1.mp3", "ID3" + std::string("\x04\0\0", 3) + SizeField(v24.size(), 4, true) + v24);
+
+    // MP4: moov/udta/meta/ilst/covr/data, after the audio
+    std::string ilst = Atom("ilst", Atom("\xa9nam", Atom("data", std::string(8, '\0') + "Hi"))
+                                    + Atom("covr", Atom("data", std::string("\0\0\0\x0e\0\0\0\0", 8) + cover)));
+    std::string moov = Atom("moov", Atom("mvhd", std::string(100, '\0'))
+                                    + Atom("udta", Atom("meta", std::string(4, '\0') + Atom("hdlr", std::string(25, '\0')) + ilst)));
+    write(directory + "mp4/1.m4a", Atom("ftyp", "M4A \0\0\0\0") + Atom("mdat", std::string(1000, 'x')) + moov);
+
+    write(directory + "copy/1.mp3", "ID3" + std::string("\x03\0\0", 3) + SizeField(v23.size(), 4, true) + v23);
+    write(directory + "none/1.mp3", "no tag at all");
+
+    std::string image;
+    for (const char *path : {"id3v23/1.mp3", "id3v22/1.mp3", "id3v24/1.mp3", "mp4/1.m4a"})
+    {
+        image.clear();
+        assert(CArtwork::Extract(directory + path, image) == 0);
+        assert(image == cover);
+    }
+    assert(CArtwork::Extract(directory + "none/1.mp3", image) == -1);
+    assert(CArtwork::Extract(directory + "missing.mp3", image) == -1);
+    assert(CArtwork::AlbumOf(directory + "mp4/1.m4a") == directory + "mp4");
+
+    // Through the library: one scale per image and size, one file read per album
+    CConfig config;
+    config.Set("artwork.path", store_path);
+    config.Set("artwork.sizes", "4,8");
+    int scaled = 0;
+    {
+        CLibrary library(TestStorage(), config);
+        library.PrepareDatabase();
+        library.GetArtwork()->SetScaler([&scaled](const std::string &image, int size, std::string &pixels)
+        {
+            ++scaled;
+            pixels.assign(size * size * 3, image[1]);
+            return 0;
+        });
+
+        library.AddTrack(directory + "id3v23/1.mp3");
+        const unsigned char *small = library.GetThumbnail(directory + "id3v23/1.mp3", 4);
+        assert(small && small[0] == 'P' && small[4 * 4 * 3 - 1] == 'P');
+        assert(scaled == 2);
+
+        // Another track in the album isn't even opened
+        library.AddTrack(directory + "id3v23/2.mp3");
+        assert(library.GetThumbnail(directory + "id3v23/2.mp3", 4) == small);
+
+        for (const char *path : {"id3v22/1.mp3", "id3v24/1.mp3", "mp4/1.m4a", "none/1.mp3"})
+        {
+            library.AddTrack(directory + path);
+        }
+        assert(scaled == 2);
+        assert(library.GetArtwork()->GetImageCount() == 1);
+        assert(library.GetThumbnail(directory + "mp4/1.m4a", 8) != nullptr);
+        assert(library.GetThumbnail(directory + "mp4/1.m4a", 16) == nullptr);
+        assert(library.GetThumbnail(directory + "none/1.mp3", 4) == nullptr);
+        assert(library.GetArtwork()->Has(directory + "none"));
+
+        // Tracks added behind the library's back are picked up later; earlier pointers stay good
+        library.GetStorage()->AddTrack(directory + "copy/1.mp3");
+        assert(library.CollectArtwork() == 1);
+        assert(library.GetThumbnail(directory + "copy/1.mp3", 4) == small);
+        assert(small[0] == 'P');
+        assert(library.CollectArtwork() == 0);
+
+        library.DestroyDatabase();
+    }
+
+    // Everything is there again from the file, with nothing scaled
+    CArtworkStore store;
+    store.SetScaler([](const std::string &, int, std::string &) { return -1; });
+    assert(store.Open(store_path) == 0);
+    assert(store.GetImageCount() == 1);
+    const unsigned char *large = store.Find(directory + "id3v24", 8);
+    assert(large && large[8 * 8 * 3 - 1] == 'P');
+    assert(store.Find(directory + "none", 4) == nullptr && store.Has(directory + "none"));
+
+    // A new image that can't be scaled isn't kept
+    assert(store.Add(directory + "other", back) == -1);
+    assert(!store.Has(directory + "other"));
+    store.Close();
+
+    // A torn write at the end is dropped
+    FILE *file = fopen(store_path.c_str(), "ab");
+    fputs("torn", file);
+    fclose(file);
+    assert(store.Open(store_path) == 0);
+    assert(store.Find(directory + "mp4", 4) != nullptr);
+    store.Close();
+
+    for (const char *path : {"id3v23/1.mp3", "id3v22/1.mp3", "id3v24/1.mp3", "mp4/1.m4a", "copy/1.mp3", "none/1.mp3"})
+    {
+        remove((directory + path).c_str());
+    }
+    for (const char *album : {"id3v23", "id3v22", "id3v24", "mp4", "copy", "none"})
+    {
+        rmdir((directory + album).c_str());
+    }
+    rmdir(directory.c_str());
+    remove(store_path.c_str());
+}
+
+/**
+ * \brief Ensure tags are read into artists, albums and genres, whose counts and lengths follow the tracks, and page by keyset
+ */
+void Test_Library_Browse()
+{
+    const std::string directory = "/tmp/musicmanager_browse_test_" + std::to_string(getpid()) + "/";
+    mkdir(directory.c_str(), 0755);
+    for (const char *album : {"first", "second", "third"})
+    {
+        mkdir((directory + album).c_str(), 0755);
+    }
+
+    auto write = [](const std::string &path, const std::string &contents)
+    {
+        FILE *file = fopen(path.c_str(), "wb");
+        fwrite(contents.data(), 1, contents.size(), file);
+        fclose(file);
+    };
+    auto frame = [](const std::string &id, const std::string &text)
+    {
+        return id + SizeField(text.size() + 1, 4) + std::string(3, '\0') + text;
+    };
+    auto little = [](size_t value)
+    {
+        std::string field;
+        for (int i = 0; i < 4; ++i)
+        {
+            field.push_back((char)((value >> (8 * i)) & 0xff));
+        }
+        return field;
+    };
+
+    // ID3v2.3: a genre by ID3v1 number, a track number out of ten, and a length
+    std::string one = frame("TIT2", "One") + frame("TPE1", "Band") + frame("TALB", "First")
+                      + frame("TCON", "(17)") + frame("TRCK", "2/10") + frame("TLEN", "180000");
+    write(directory + "first/1.mp3", "ID3" + std::string("\x03\0\0", 3) + SizeField(one.size(), 4, true) + one + "audio");
+
+    // A UTF-16 title, and the genre by name
+    std::string title = std::string("\x01\xff\xfeT\0w\0o\0", 9);
+    std::string two = "TIT2" + SizeField(title.size(), 4) + std::string(2, '\0') + title
+                      + frame("TPE1", "Band") + frame("TALB", "First") + frame("TCON", "Rock")
+                      + frame("TRCK", "1") + frame("TLEN", "120000");
+    write(directory + "first/2.mp3", "ID3" + std::string("\x03\0\0", 3) + SizeField(two.size(), 4, true) + two + "audio");
+
+    // FLAC: a minute at 44.1kHz in STREAMINFO, and Vorbis comments in any case
+    std::string info(34, '\0');
+    info[10] = 0x0a;
+    info[11] = (char)0xc4;
+    info[12] = 0x42;
+    info[13] = (char)0xf0;
+    info.replace(14, 4, SizeField(44100 * 60, 4));
+    std::string comments = little(6) + "vendor" + little(5);
+    for (const char *comment : {"TITLE=Three", "artist=Band", "ALBUM=Second", "Genre=Jazz", "TRACKNUMBER=1"})
+    {
+        comments += little(strlen(comment)) + comment;
+    }
+    write(directory + "second/1.flac", "fLaC" + std::string("\x00", 1) + SizeField(info.size(), 3) + info
+                                       + "\x84" + SizeField(comments.size(), 3) + comments + "frames");
+
+    // MP4: the album artist over the artist, and 30 seconds in mvhd
+    auto data = [](const std::string &value) { return Atom("data", std::string(8, '\0') + value); };
+    std::string ilst = Atom("ilst", Atom("\xa9nam", data("Four")) + Atom("\xa9" "ART", data("Guest"))
+                                    + Atom("aART", data("Other")) + Atom("\xa9" "alb", data("Third"))
+                                    + Atom("gnre", data(SizeField(10, 2))) + Atom("trkn", data(SizeField(3, 4) + SizeField(0, 4))));
+    std::string mvhd = std::string(12, '\0') + SizeField(1000, 4) + SizeField(30000, 4) + std::string(80, '\0');
+    std::string moov = Atom("moov", Atom("mvhd", mvhd)
+                                    + Atom("udta", Atom("meta", std::string(4, '\0') + Atom("hdlr", std::string(25, '\0')) + ilst)));
+    write(directory + "third/1.m4a", Atom("ftyp", "M4A \0\0\0\0") + Atom("mdat", std::string(1000, 'x')) + moov);
+
+    CTags tags;
+    assert(tags.Read(directory + "first/1.mp3") == 0);
+    assert(tags.GetTitle() == "One" && tags.GetArtist() == "Band" && tags.GetAlbum() == "First");
+    assert(tags.GetGenre() == "Rock" && tags.GetNumber() == 2 && std::abs(tags.GetDuration() - 180) < 0.01);
+    assert(tags.Read(directory + "first/2.mp3") == 0 && tags.GetTitle() == "Two" && tags.GetNumber() == 1);
+    assert(tags.Read(directory + "second/1.flac") == 0);
+    assert(tags.GetArtist() == "Band" && tags.GetGenre() == "Jazz" && std::abs(tags.GetDuration() - 60) < 0.01);
+    assert(tags.Read(directory + "third/1.m4a") == 0);
+    assert(tags.GetArtist() == "Guest" && tags.GetAlbumArtist() == "Other" && tags.GetGenre() == "Metal");
+    assert(tags.GetNumber() == 3 && std::abs(tags.GetDuration() - 30) < 0.01);
+    assert(tags.Read(directory + "missing.mp3") == -1 && tags.GetTitle() == "");
+
+    auto names = [](const std::vector<CStorage::BrowseEntry> &entries)
+    {
+        std::vector<std::string> names;
+        for (const CStorage::BrowseEntry &entry : entries)
+        {
+            names.push_back(entry.name);
+        }
+        return names;
+    };
+
+    std::vector<std::string> ids;
+    long first = 0;
+    {
+        CLibrary library(TestStorage());
+        library.PrepareDatabase();
+        CStorage *storage = library.GetStorage();
+        ids = storage->AddTracks({directory + "first/1.mp3", directory + "first/2.mp3", directory + "second/1.flac",
+                                  directory + "third/1.m4a", directory + "missing.mp3"});
+
+        // Nothing shows up until the tags are read, and they're only read once
+        assert(library.Browse(CStorage::BROWSE_ARTISTS, 0, {}, 10).empty());
+        assert(library.CollectTags() == 5);
+        assert(library.CollectTags() == 0);
+
+        // The file that can't be read goes under no artist, album or genre
+        std::vector<CStorage::BrowseEntry> artists = library.Browse(CStorage::BROWSE_ARTISTS, 0, {}, 10);
+        assert(names(artists) == std::vector<std::string>({"", "Band", "Other"}));
+        assert(artists[0].tracks == 1 && artists[1].tracks == 3 && artists[2].tracks == 1);
+        assert(std::abs(artists[1].duration - 360) < 0.01 && std::abs(artists[2].duration - 30) < 0.01);
+
+        // A page at a time picks up where the last one ended
+        std::vector<std::string> paged;
+        CStorage::BrowseEntry after;
+        for (;;)
+        {
+            std::vector<CStorage::BrowseEntry> page = library.Browse(CStorage::BROWSE_ARTISTS, 0, after, 1);
+            if (page.empty())
+            {
+                break;
+            }
+            assert(page.size() == 1);
+            paged.push_back(page[0].name);
+            after = page[0];
+        }
+        assert(paged == names(artists));
+        assert(library.Browse(CStorage::BROWSE_ARTISTS, 0, {}, 0).empty());
+
+        // An artist's albums, every album, and an album's tracks by number
+        std::vector<CStorage::BrowseEntry> albums = library.Browse(CStorage::BROWSE_ALBUMS, artists[1].id, {}, 10);
+        assert(names(albums) == std::vector<std::string>({"First", "Second"}));
+        assert(albums[0].tracks == 2 && std::abs(albums[0].duration - 300) < 0.01);
+        first = albums[0].id;
+        assert(names(library.Browse(CStorage::BROWSE_ALBUMS, 0, {}, 10))
+               == std::vector<std::string>({"", "First", "Second", "Third"}));
+
+        std::vector<CStorage::BrowseEntry> tracks = library.Browse(CStorage::BROWSE_TRACKS, first, {}, 10);
+        assert(names(tracks) == std::vector<std::string>({"Two", "One"}));
+        assert(tracks[0].id == std::stol(ids[1]) && tracks[0].number == 1 && tracks[1].number == 2);
+        assert(std::abs(tracks[1].duration - 180) < 0.01);
+        assert(names(library.Browse(CStorage::BROWSE_TRACKS, first, tracks[0], 10)) == std::vector<std::string>({"One"}));
+
+        std::vector<CStorage::BrowseEntry> genres = library.Browse(CStorage::BROWSE_GENRES, 0, {}, 10);
+        assert(names(genres) == std::vector<std::string>({"", "Jazz", "Metal", "Rock"}));
+        assert(genres[3].tracks == 2);
+
+        // Removing a track, and decoding one for its real length, keep the counts up
+        storage->RemoveTrack(ids[1]);
+        CStorage::TrackFeatures features;
+        features.track = std::stol(ids[0]);
+        features.decoded = true;
+        features.duration = 200;
+        storage->SaveFeatures({features});
+        albums = library.Browse(CStorage::BROWSE_ALBUMS, artists[1].id, {}, 10);
+        assert(albums[0].tracks == 1 && std::abs(albums[0].duration - 200) < 0.01);
+        artists = library.Browse(CStorage::BROWSE_ARTISTS, 0, {}, 10);
+        assert(artists[1].tracks == 2 && std::abs(artists[1].duration - 260) < 0.01);
+        assert(library.Browse(CStorage::BROWSE_GENRES, 0, {}, 10)[3].tracks == 1);
+
+        // Retagging moves a track, and an album left empty drops out
+        CStorage::TrackTags retag;
+        retag.track = std::stol(ids[2]);
+        retag.title = "Three";
+        retag.artist = "Other";
+        retag.album = "Third";
+        retag.genre = "Jazz";
+        retag.number = 1;
+        storage->SaveTags({retag});
+        assert(names(library.Browse(CStorage::BROWSE_ALBUMS, artists[1].id, {}, 10))
+               == std::vector<std::string>({"First"}));
+        storage->Vacuum();
+    }
+
+    // Kept, with the same ids
+    {
+        CLibrary library(TestStorage());
+        std::vector<CStorage::BrowseEntry> artists = library.Browse(CStorage::BROWSE_ARTISTS, 0, {}, 10);
+        assert(names(artists) == std::vector<std::string>({"", "Band", "Other"}));
+        assert(artists[1].tracks == 1 && std::abs(artists[1].duration - 200) < 0.01);
+        assert(artists[2].tracks == 2 && std::abs(artists[2].duration - 90) < 0.01);
+        std::vector<CStorage::BrowseEntry> albums = library.Browse(CStorage::BROWSE_ALBUMS, artists[2].id, {}, 10);
+        assert(names(albums) == std::vector<std::string>({"Third"}) && albums[0].tracks == 2);
+        assert(names(library.Browse(CStorage::BROWSE_TRACKS, first, {}, 10)) == std::vector<std::string>({"One"}));
+        assert(names(library.Browse(CStorage::BROWSE_TRACKS, albums[0].id, {}, 10))
+               == std::vector<std::string>({"Three", "Four"}));
+    }
+
+    for (const char *path : {"first/1.mp3", "first/2.mp3", "second/1.flac", "third/1.m4a"})
+    {
+        remove((directory + path).c_str());
+    }
+    for (const char *album : {"first", "second", "third"})
+    {
+        rmdir((directory + album).c_str());
+    }
+    rmdir(directory.c_str());
+}
+
+void Test_Server()
+{
+    const std::string path = "/tmp/musicmanager_server_test_" + std::to_string(getpid()) + ".socket";
+    CLibrary library(TestStorage());
+    library.PrepareDatabase();
+
+    CServer server(&library);
+    assert(server.Listen(path) == 0);
+    {
+        // Another server can't take the socket over while this one has it
+        CServer other(&library);
+        assert(other.Listen(path) == -1);
+    }
+    std::thread serving([&server] { server.Run(); });
+
+    // Nothing below may touch the library until the server has stopped
+    CClient client, watcher;
+    assert(client.Connect(path) == 0 && watcher.Connect(path) == 0);
+    std::vector<std::pair<Notification, std::string>> heard;
+    watcher.SetListener([&heard](Notification what, const std::string &id) { heard.emplace_back(what, id); });
+    assert(watcher.Subscribe() == 0);
+    assert(client.Ping() == 0);
+
+    // A pipeline goes out in one go, and its answers can be taken in any order
+    std::vector<uint32_t> requests;
+    for (int i = 0; i < 100; ++i)
+    {
+        std::string payload;
+        PutString(payload, "/music/" + std::to_string(i) + ".mp3");
+        requests.push_back(client.Send(OP_ADD_TRACK, payload));
+    }
+    assert(client.Flush() == 0);
+    std::vector<std::string> tracks(requests.size());
+    for (size_t i = requests.size(); i-- > 0; )
+    {
+        std::string reply;
+        assert(client.Receive(requests[i], reply) == STATUS_OK);
+        const char *p = reply.data();
+        tracks[i] = GetId(p, p + reply.size());
+        assert(!tracks[i].empty());
+    }
+    assert(client.FindTracks({"/music/0.mp3", "/music/99.mp3", "/music/none.mp3"})
+           == std::vector<std::string>({tracks[0], tracks[99], ""}));
+    assert(client.FindFilepaths({tracks[5], "999999"}) == std::vector<std::string>({"/music/5.mp3", ""}));
+
+    // Playlists are edited and paged through the server's cache
+    std::string title, length;
+    std::vector<std::string> page;
+    assert(client.LoadPlaylistPage("1", 0, title, length, page));
+    assert(length == "100" && page == tracks);
+
+    std::string playlist = client.AddPlaylist("mix");
+    assert(!playlist.empty());
+    assert(client.InsertTracks(playlist, {tracks[0], tracks[1], tracks[2], tracks[3]}, 1) == 0);
+    assert(client.MoveRange(playlist, 1, 2, 3) == 0);
+    assert(client.RemoveRange(playlist, 4, 1) == 0);
+    assert(client.LoadPlaylistPage(playlist, 0, title, length, page));
+    assert(title == "mix" && length == "3" && page == std::vector<std::string>({tracks[2], tracks[3], tracks[0]}));
+    assert(!client.LoadPlaylistPage("999999", 0, title, length, page));
+    assert(client.InsertTracks("999999", {tracks[0]}, 1) == -1);
+
+    assert(client.RecordPlay(tracks[0], CStorage::EVENT_PLAY, 1000) == 0);
+    std::vector<CStorage::TrackStats> stats = client.GetTrackStats({tracks[0], tracks[1]});
+    assert(stats.size() == 2 && stats[0].plays == 1 && stats[0].lastPlayed == 1000 && stats[1].plays == 0);
+    assert(client.GetThumbnail("/music/0.mp3", 64).empty());
+    assert(client.RemoveTrack(tracks[99]) == 0);
+
+    // Nonsense gets an answer saying so, and the connection carries on
+    std::string reply;
+    assert(client.Receive(client.Send((Opcode)0x7f), reply) == STATUS_BAD_REQUEST);
+    assert(client.Receive(client.Send(OP_REMOVE_TRACK), reply) == STATUS_BAD_REQUEST);
+    assert(client.Receive(client.Send(OP_PING, "echo"), reply) == STATUS_OK && reply == "echo");
+
+    // The subscriber heard about every change, in order, and nothing else
+    while (heard.size() < 105)
+    {
+        assert(watcher.Poll(5000) > 0);
+    }
+    assert(heard[0] == std::make_pair(NOTIFY_TRACK_ADDED, tracks[0]));
+    assert(heard[99] == std::make_pair(NOTIFY_TRACK_ADDED, tracks[99]));
+    assert(heard[100] == std::make_pair(NOTIFY_PLAYLIST_ADDED, playlist));
+    assert(heard[103] == std::make_pair(NOTIFY_PLAYLIST_CHANGED, playlist));
+    assert(heard[104] == std::make_pair(NOTIFY_TRACK_REMOVED, tracks[99]));
+    assert(watcher.Poll(0) == 0);
+
+    // A client that sends something that isn't a frame is dropped
+    CClient rude;
+    assert(rude.Connect(path) == 0);
+    const char garbage[FRAME_HEADER] = {'\xff', '\xff', '\xff', '\xff'};
+    assert(write(rude.GetDescriptor(), garbage, sizeof(garbage)) == (ssize_t)sizeof(garbage));
+    assert(rude.Ping() == -1 && !rude.IsConnected());
+    assert(client.Ping() == 0);
+
+    server.Stop();
+    serving.join();
+    assert(server.GetRequestCount() > 100);
+
+    // What the clients did is in the library
+    assert(library.GetStorage()->FindTracks({"/music/0.mp3", "/music/99.mp3"}) == std::vector<std::string>({tracks[0], ""}));
+    library.DestroyDatabase();
+}
+
+/**
+ * \brief Read a line from a non-blocking descriptor, waiting for it as need be
+ * \param reactor Reactor to wait in
+ * \param fd The descriptor
+ * \returns The line, without its newline
+ */
+static CTask<std::string> ReadLine(CReactor *reactor, int fd)
+{
+    std::string line;
+    char c;
+    for (;;)
+    {
+        ssize_t got = read(fd, &c, 1);
+        if (got == 1 && c != '\n')
+        {
+            line += c;
+        }
+        else if (got >= 0)
+        {
+            co_return line;
+        }
+        else
+        {
+            co_await reactor->Readable(fd);
+        }
+    }
+}
+
+/**
+ * \brief Pass lines from one descriptor to another, reversed
+ * \param reactor Reactor to wait in
+ * \param in Where lines come from
+ * \param out Where they go
+ * \param lines How many to pass on
+ */
+static CTask<> Reverse(CReactor *reactor, int in, int out, int lines)
+{
+    for (int i = 0; i < lines; ++i)
+    {
+        std::string line = co_await ReadLine(reactor, in);
+        std::reverse(line.begin(), line.end());
+        line += '\n';
+        assert(write(out, line.data(), line.size()) == (ssize_t)line.size());
+    }
+}
+
+/**
+ * \brief Send lines to be reversed, and read them back
+ * \param reactor Reactor to wait in
+ * \param out Where to send them
+ * \param in Where they come back
+ * \returns How many came back right
+ */
+static CTask<int> Converse(CReactor *reactor, int out, int in)
+{
+    int right = 0;
+    for (std::string line : {"abc", "hello", "x"})
+    {
+        std::string sent = line + '\n';
+        assert(write(out, sent.data(), sent.size()) == (ssize_t)sent.size());
+        std::string back = co_await ReadLine(reactor, in);
+        std::reverse(line.begin(), line.end());
+        right += back == line;
+    }
+    co_return right;
+}
+
+/**
+ * \brief Await a chain of tasks nested deep enough to overflow the stack if they piled up on it
+ * \param depth How deep to go
+ * \returns depth
+ */
+static CTask<long> Nest(long depth)
+{
+    if (depth == 0)
+    {
+        co_return 0;
+    }
+    co_return 1 + co_await Nest(depth - 1);
+}
+
+/**
+ * \brief Add a track, and say where its ID went
+ * \param library Library to add it to
+ * \param filepath The filepath of the track
+ * \param id Filled in with the ID of the track
+ */
+static CTask<> AddInto(CLibrary *library, std::string filepath, std::string *id)
+{
+    *id = co_await library->AddTrackAsync(filepath);
+}
+
+void Test_Async()
+{
+    // Two coroutines talking over pipes, on one thread
+    CReactor reactor;
+    int there[2], back[2];
+    assert(pipe2(there, O_NONBLOCK) == 0 && pipe2(back, O_NONBLOCK) == 0);
+    reactor.Spawn(Reverse(&reactor, there[0], back[1], 3));
+    assert(reactor.GetSpawned() == 1 && reactor.GetWaiting() == 1);
+    assert(reactor.Run(Converse(&reactor, there[1], back[0])) == 3);
+    assert(reactor.GetSpawned() == 0 && reactor.GetWaiting() == 0);
+    assert(reactor.RunOnce(0) == -1);
+    for (int fd : {there[0], there[1], back[0], back[1]})
+    {
+        close(fd);
+    }
+
+    assert(reactor.Run(Nest(10000)) == 10000);
+
+    CLibrary library(TestStorage());
+    library.PrepareDatabase();
+    CReactor *waiting = library.GetReactor();
+
+    // Many adds at once; they go in in the order they were made
+    std::vector<std::string> ids(50);
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        waiting->Spawn(AddInto(&library, "/async/" + std::to_string(i) + ".mp3", &ids[i]));
+    }
+    while (waiting->GetSpawned() > 0 && waiting->RunOnce(-1) >= 0);
+    assert(waiting->GetSpawned() == 0);
+    for (size_t i = 0; i < ids.size(); ++i)
+    {
+        assert(!ids[i].empty());
+        assert(library.GetStorage()->FindFilepaths({ids[i]})[0] == "/async/" + std::to_string(i) + ".mp3");
+    }
+
+    // Pages come through the cache just as the blocking calls' do
+    library.GetPlaylistCache()->ResetCounters();
+    CStorage::PlaylistRange range = waiting->Run(library.LoadPlaylistPageAsync("1", 0));
+    assert(range.found && range.length == "50" && range.tracks == ids);
+    range = waiting->Run(library.LoadPlaylistPageAsync("1", 0));
+    assert(range.found && range.tracks == ids);
+    assert(library.GetPlaylistCache()->GetCounters().hits == 1);
+    assert(!waiting->Run(library.LoadPlaylistPageAsync("999999", 0)).found);
+
+    // Adding a track drops the library playlist from the cache
+    std::string added = library.AddTrack("/async/blocking.mp3");
+    std::string title, length;
+    std::vector<std::string> page;
+    assert(library.LoadPlaylistPage("1", 0, title, length, page));
+    assert(length == "51" && page.back() == added);
+
+    std::string id = waiting->Run(library.AddPlaylistAsync("async"));
+    assert(!id.empty());
+    {
+        CPlaylist playlist(&library, id);
+        playlist.InsertTracks(ids, "1");
+        range = playlist.LoadPage(0);
+        assert(range.found && range.title == "async" && range.tracks == ids);
+        assert(playlist.LoadPage(1).tracks.empty());
+
+        // Tracks added to the library go right after its own, however long other playlists are
+        for (int i = 0; i < 4; ++i)
+        {
+            playlist.InsertTracks(ids, "1");
+        }
+        std::vector<std::string> later = {library.AddTrack("/async/later.mp3"),
+                                          waiting->Run(library.AddTrackAsync("/async/later2.mp3"))};
+        assert(library.GetStorage()->LoadPlaylistRange("1", 52, 10, title, length, page));
+        assert(length == "53" && page == later);
+    }
+
+    library.DestroyDatabase();
 }
@@ -30,4 +30,53 @@ void Test_Playlist_Normalize();
 
 void Test_Playlist_RemoveTrack();
 
+void Test_Playlist_Batch();
+
+void Test_Playlist_Totals();
+
+void Test_Playlist_InsertTracks();
+
+void Test_Playlist_RemoveRange();
+
+void Test_Playlist_MoveRange();
+
+void Test_LocalStorage_Reopen();
+
+void Test_Library_ExportImport();
+
+void Test_Playlist_ImportExport();
+
+void Test_Histogram();
+
+void Test_Query();
+
+void Test_Library_Stats();
+
+void Test_Library_PlayHistory();
+
+void Test_Library_Recommend();
+
+void Test_Analyzer();
+
+void Test_Exporter();
+
+void Test_Scheduler();
+
+void Test_Library_PlaylistCache();
+
+void Test_Config();
+
+void Test_Library_Stream();
+
+void Test_Library_RelocateRoot();
+
+void Test_ShardedStorage();
+
+void Test_ReplicatedStorage();
+
+void Test_Artwork();
+void Test_Library_Browse();
+void Test_Server();
+void Test_Async();
+
 #endif